@@ -71,6 +71,7 @@
 #include "core/mainloop/connection.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
+#include "core/mainloop/orshard.h"
 #include "core/or/channel.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux.h"
@@ -91,9 +92,11 @@
 #include "feature/dirclient/dirclient_modes.h"
 #include "feature/hibernate/hibernate.h"
 #include "feature/hs/hs_config.h"
+#include "feature/metrics/metrics.h"
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
@@ -179,6 +182,9 @@ static const char unix_q_socket_prefix[] = "unix:\"";
 #define MIN_CONSTRAINED_TCP_BUFFER 2048
 #define MAX_CONSTRAINED_TCP_BUFFER 262144  /* 256k */
 
+/** Largest allowed value for ORConnThreads. */
+#define MAX_OR_CONN_THREADS 128
+
 /** macro to help with the bulk rename of *DownloadSchedule to
  * *DowloadInitialDelay . */
 #ifndef COCCI
@@ -359,6 +365,7 @@ static const config_var_t option_vars_[] = {
   V(CircuitsAvailableTimeout,    INTERVAL, "0"),
   V(CircuitStreamTimeout,        INTERVAL, "0"),
   V(CircuitPriorityHalflife,     DOUBLE,  "-1.0"), /*negative:'Use default'*/
+  V(CircuitPriorityQueueDelay,   AUTOBOOL, "auto"),
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
 #if defined(HAVE_MODULE_RELAY) || defined(TOR_UNIT_TESTS)
   /* The unit tests expect the ClientOnly default to be 0. */
@@ -560,6 +567,9 @@ static const config_var_t option_vars_[] = {
   OBSOLETE("MaxOnionsPending"),
   V(MaxOnionQueueDelay,          MSEC_INTERVAL, "1750 msec"),
   V(MaxUnparseableDescSizeToLog, MEMUNIT, "10 MB"),
+  VPORT(MetricsPort),
+  V(MetricsPortPolicy,           LINELIST, NULL),
+  V(MultipathCircuits,           POSINT,   "0"),
   VAR("MyFamily",                LINELIST, MyFamily_lines,       NULL),
   V(NewCircuitPeriod,            INTERVAL, "30 seconds"),
   OBSOLETE("NamingAuthoritativeDirectory"),
@@ -575,6 +585,7 @@ static const config_var_t option_vars_[] = {
   V(NumEntryGuards,              POSINT,     "0"),
   V(NumPrimaryGuards,            POSINT,     "0"),
   V(OfflineMasterKey,            BOOL,     "0"),
+  V(ORConnThreads,               POSINT,   "0"),
   OBSOLETE("ORListenAddress"),
   VPORT(ORPort),
   V(OutboundBindAddress,         LINELIST,   NULL),
@@ -677,6 +688,7 @@ static const config_var_t option_vars_[] = {
   VAR("UseEntryGuards",          BOOL,     UseEntryGuards_option, "1"),
   OBSOLETE("UseEntryGuardsAsDirGuards"),
   V(UseGuardFraction,            AUTOBOOL, "auto"),
+  V(UseIOUring,                  BOOL,     "0"),
   V(UseMicrodescriptors,         AUTOBOOL, "auto"),
   OBSOLETE("UseNTorHandshake"),
   V_IMMUTABLE(User,              STRING,   NULL),
@@ -2233,6 +2245,8 @@ options_act,(const or_options_t *old_options))
     log_warn(LD_BUG,"Error parsing already-validated policy options.");
     return -1;
   }
+  /* Our firewall and bridge options affect which nodes we can choose. */
+  node_select_invalidate_cache();
 
   if (init_control_cookie_authentication(options->CookieAuthentication) < 0) {
     log_warn(LD_CONFIG,"Error creating control cookie authentication file.");
@@ -2257,6 +2271,10 @@ options_act,(const or_options_t *old_options))
   /* Change the cell EWMA settings */
   cmux_ewma_set_options(options, networkstatus_get_latest_consensus());
 
+  /* Start or stop batching socket I/O with io_uring. */
+  mainloop_set_uring_enabled(options->UseIOUring);
+  orshard_set_n_threads(options->ORConnThreads);
+
   /* Update the BridgePassword's hashed version as needed.  We store this as a
    * digest so that we can do side-channel-proof comparisons on it.
    */
@@ -3400,6 +3418,14 @@ options_validate_cb(const void *old_options_, void *options_, char **msg)
     REJECT("FetchDirInfoExtraEarly requires that you also set "
            "FetchDirInfoEarly");
 
+  if (options->UseIOUring && options->Sandbox)
+    REJECT("UseIOUring is not compatible with Sandbox.");
+
+  if (options->ORConnThreads && options->Sandbox)
+    REJECT("ORConnThreads is not compatible with Sandbox.");
+  if (options->ORConnThreads > MAX_OR_CONN_THREADS)
+    REJECT("ORConnThreads is too high.");
+
   if (options->ConnLimit <= 0) {
     tor_asprintf(msg,
         "ConnLimit must be greater than 0, but was set to %d",
@@ -3428,6 +3454,13 @@ options_validate_cb(const void *old_options_, void *options_, char **msg)
     return -1;
   }
 
+  if (options->MultipathCircuits > MAX_MULTIPATH_CIRCUITS) {
+    tor_asprintf(msg,
+                 "MultipathCircuits must be at most %d, but was set to %d",
+                 MAX_MULTIPATH_CIRCUITS, options->MultipathCircuits);
+    return -1;
+  }
+
   if (validate_ports_csv(options->FirewallPorts, "FirewallPorts", msg) < 0)
     return -1;
 
@@ -6486,7 +6519,8 @@ parse_ports(or_options_t *options, int validate_only,
     }
   }
 
-  if (port_parse_ports_relay(options, msg, ports, &have_low_ports) < 0)
+  if (port_parse_ports_relay(options, msg, ports, &have_low_ports) < 0 ||
+      metrics_parse_ports(options, ports, msg) < 0)
     goto err;
 
   *n_ports_out = smartlist_len(ports);
@@ -144,6 +144,8 @@ struct or_options_t {
   int ReducedExitPolicy; /**<Should we use the Reduced Exit Policy? */
   struct config_line_t *SocksPolicy; /**< Lists of socks policy components */
   struct config_line_t *DirPolicy; /**< Lists of dir policy components */
+  /** Lists of MetricsPort policy components */
+  struct config_line_t *MetricsPortPolicy;
   /** Local address to bind outbound sockets */
   struct config_line_t *OutboundBindAddress;
   /** Local address to bind outbound relay sockets */
@@ -193,6 +195,8 @@ struct or_options_t {
   struct config_line_t *DirPort_lines;
   /** Ports to listen on for DNS requests. */
   struct config_line_t *DNSPort_lines;
+  /** Ports to listen on for MetricsPort requests. */
+  struct config_line_t *MetricsPort_lines;
 
   /* MaxMemInQueues value as input by the user. We clean this up to be
    * MaxMemInQueues. */
@@ -850,6 +854,11 @@ struct or_options_t {
    */
   double CircuitPriorityHalflife;
 
+  /** If 1, new channels choose which circuit to send from by the
+   * queue-delay policy, which also accounts for how long cells have waited;
+   * if 0, by the plain EWMA policy; if -1, as the consensus says. */
+  int CircuitPriorityQueueDelay;
+
   /** Set to true if the TestingTorNetwork configuration option is set.
    * This is used so that options_validate() has a chance to realize that
    * the defaults have changed. */
@@ -859,6 +868,14 @@ struct or_options_t {
    * If -1, Tor decides. */
   int UseMicrodescriptors;
 
+  /** If 1, we batch the socket reads and writes of connections that don't
+   * use TLS with io_uring, where the kernel supports it. */
+  int UseIOUring;
+
+  /** If nonzero, the number of worker threads that run the TLS and socket
+   * I/O of open OR connections. */
+  int ORConnThreads;
+
   /** File where we should write the ControlPort. */
   char *ControlPortWriteToFile;
   /** Should that file be group-readable? */
@@ -869,6 +886,11 @@ struct or_options_t {
    * once. */
   int MaxClientCircuitsPending;
 
+#define MAX_MULTIPATH_CIRCUITS 8
+  /** If at least 2, link each new exit circuit with this many circuits in
+   * all to the same exit, and spread the data of our streams over them. */
+  int MultipathCircuits;
+
   /** If 1, we always send optimistic data when it's supported.  If 0, we
    * never use it.  If -1, we do what the consensus says. */
   int OptimisticData;
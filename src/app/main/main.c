@@ -321,6 +321,7 @@ dumpmemusage(int severity)
       (rephist_total_alloc), rephist_total_num);
   dump_routerlist_mem_usage(severity);
   dump_cell_pool_usage(severity);
+  buf_dump_freelist_sizes(severity);
   dump_dns_mem_usage(severity);
   tor_log_mallinfo(severity);
 }
@@ -358,7 +359,8 @@ dumpstats(int severity)
           (int)(now - conn->timestamp_last_write_allowed));
       if (conn->type == CONN_TYPE_OR) {
         or_connection_t *or_conn = TO_OR_CONN(conn);
-        if (or_conn->tls) {
+        /* If a shard thread owns the TLS object, we can't look at it. */
+        if (or_conn->tls && !or_conn->shard_conn) {
           if (tor_tls_get_buffer_sizes(or_conn->tls, &rbuf_cap, &rbuf_len,
                                        &wbuf_cap, &wbuf_len) == 0) {
             tor_log(severity, LD_GENERAL,
@@ -17,14 +17,18 @@
 #include "app/main/main.h"
 #include "app/main/shutdown.h"
 #include "app/main/subsysmgr.h"
+#include "core/crypto/onion_crypto.h"
 #include "core/mainloop/connection.h"
 #include "core/mainloop/mainloop_pubsub.h"
+#include "core/mainloop/orshard.h"
 #include "core/or/channeltls.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux_ewma.h"
 #include "core/or/circuitpadding.h"
 #include "core/or/connection_edge.h"
 #include "core/or/dos.h"
+#include "core/or/multipath.h"
+#include "core/or/relay.h"
 #include "core/or/scheduler.h"
 #include "feature/client/addressmap.h"
 #include "feature/client/bridges.h"
@@ -50,6 +54,7 @@
 #include "feature/stats/bwhist.h"
 #include "feature/stats/geoip_stats.h"
 #include "feature/stats/rephist.h"
+#include "lib/buf/buffers.h"
 #include "lib/evloop/compat_libevent.h"
 #include "lib/geoip/geoip.h"
 
@@ -124,12 +129,14 @@ tor_free_all(int postfork)
   rep_hist_free_all();
   bwhist_free_all();
   circuit_free_all();
+  multipath_free_all();
   circpad_machines_free();
   entry_guards_free_all();
   pt_free_all();
   channel_tls_free_all();
   channel_free_all();
   connection_free_all();
+  orshard_free_all();
   connection_edge_free_all();
   scheduler_free_all();
   nodelist_free_all();
@@ -143,6 +150,9 @@ tor_free_all(int postfork)
   circuitmux_ewma_free_all();
   accounting_free_all();
   circpad_free_all();
+  onion_crypto_free_all();
+  cell_pools_free_all();
+  buf_shrink_freelists(1);
 
   if (!postfork) {
     config_free_all();
@@ -43,6 +43,34 @@
 #include "core/or/crypt_path_st.h"
 #include "core/or/extend_info_st.h"
 
+/** Largest number of precomputed ephemeral keypairs that we keep around for
+ * the client side of ntor handshakes. */
+#define CLIENT_NTOR_KEYPAIR_POOL_SIZE 32
+
+/** Precomputed ephemeral keypairs for the client side of ntor handshakes.
+ * Only used from the main thread.  When we have cpuworkers, they fill it for
+ * us; otherwise, it stays empty and we generate our keypairs as needed. */
+static ntor_keypair_pool_t *client_ntor_keypair_pool = NULL;
+
+/** Return the pool of precomputed ephemeral keypairs that we use for the
+ * client side of ntor handshakes, creating it if necessary.  Call only from
+ * the main thread. */
+ntor_keypair_pool_t *
+onion_get_client_ntor_keypair_pool(void)
+{
+  if (!client_ntor_keypair_pool)
+    client_ntor_keypair_pool =
+      ntor_keypair_pool_new(CLIENT_NTOR_KEYPAIR_POOL_SIZE);
+  return client_ntor_keypair_pool;
+}
+
+/** Release all storage held by this module. */
+void
+onion_crypto_free_all(void)
+{
+  ntor_keypair_pool_free(client_ntor_keypair_pool);
+}
+
 /** Return a new server_onion_keys_t object with all of the keys
  * and other info we might need to do onion handshakes.  (We make a copy of
  * our keys for each cpuworker to avoid race conditions with the main thread,
@@ -137,6 +165,7 @@ onion_skin_create(int type,
       return -1;
     if (onion_skin_ntor_create((const uint8_t*)node->identity_digest,
                                &node->curve25519_onion_key,
+                               onion_get_client_ntor_keypair_pool(),
                                &state_out->u.ntor,
                                onion_skin_out) < 0)
       return -1;
@@ -165,15 +194,18 @@ onion_skin_create(int type,
 
 /** Perform the second (server-side) step of a circuit-creation handshake of
  * type <b>type</b>, responding to the client request in <b>onion_skin</b>
- * using the keys in <b>keys</b>.  On success, write our response into
- * <b>reply_out</b>, generate <b>keys_out_len</b> bytes worth of key material
- * in <b>keys_out_len</b>, a hidden service nonce to <b>rend_nonce_out</b>,
- * and return the length of the reply. On failure, return -1.
+ * using the keys in <b>keys</b>.  If <b>keypair_pool</b> is provided, take
+ * any ephemeral keys we need from it when we can.  On success, write our
+ * response into <b>reply_out</b>, generate <b>keys_out_len</b> bytes worth of
+ * key material in <b>keys_out_len</b>, a hidden service nonce to
+ * <b>rend_nonce_out</b>, and return the length of the reply. On failure,
+ * return -1.
  */
 int
 onion_skin_server_handshake(int type,
                       const uint8_t *onion_skin, size_t onionskin_len,
                       const server_onion_keys_t *keys,
+                      ntor_keypair_pool_t *keypair_pool,
                       uint8_t *reply_out,
                       uint8_t *keys_out, size_t keys_out_len,
                       uint8_t *rend_nonce_out)
@@ -211,6 +243,7 @@ onion_skin_server_handshake(int type,
       if (onion_skin_ntor_server_handshake(
                                    onion_skin, keys->curve25519_key_map,
                                    keys->junk_keypair,
+                                   keypair_pool,
                                    keys->my_identity,
                                    reply_out, keys_tmp, keys_tmp_len)<0) {
         /* no need to memwipe here, since the output will never be used */
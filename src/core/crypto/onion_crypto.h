@@ -20,6 +20,8 @@ typedef struct server_onion_keys_t {
   struct curve25519_keypair_t *junk_keypair;
 } server_onion_keys_t;
 
+struct ntor_keypair_pool_t;
+
 void onion_handshake_state_release(onion_handshake_state_t *state);
 
 int onion_skin_create(int type,
@@ -29,6 +31,7 @@ int onion_skin_create(int type,
 int onion_skin_server_handshake(int type,
                       const uint8_t *onion_skin, size_t onionskin_len,
                       const server_onion_keys_t *keys,
+                      struct ntor_keypair_pool_t *keypair_pool,
                       uint8_t *reply_out,
                       uint8_t *keys_out, size_t key_out_len,
                       uint8_t *rend_nonce_out);
@@ -39,6 +42,9 @@ int onion_skin_client_handshake(int type,
                       uint8_t *rend_authenticator_out,
                       const char **msg_out);
 
+struct ntor_keypair_pool_t *onion_get_client_ntor_keypair_pool(void);
+void onion_crypto_free_all(void);
+
 server_onion_keys_t *server_onion_keys_new(void);
 void server_onion_keys_free_(server_onion_keys_t *keys);
 #define server_onion_keys_free(keys) \
@@ -29,6 +29,7 @@
 #include "lib/ctime/di_ops.h"
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
+#include "lib/malloc/malloc.h"
 #include "core/crypto/onion_ntor.h"
 
 #include <string.h>
@@ -43,6 +44,104 @@ ntor_handshake_state_free_(ntor_handshake_state_t *state)
   tor_free(state);
 }
 
+/** A pool of precomputed curve25519 keypairs, for use as the ephemeral keys
+ * of ntor handshakes.  Generating a keypair takes a fixed-base scalar
+ * multiplication, which is a large part of the cost of a handshake: with a
+ * pool, we can do that work while we are otherwise idle, rather than on the
+ * critical path of circuit extension.
+ *
+ * A pool is not thread-safe: every thread that uses one should have its
+ * own. */
+struct ntor_keypair_pool_t {
+  /** Number of keypairs that this pool can hold. */
+  int capacity;
+  /** Number of keypairs that are currently in the pool.  The available
+   * keypairs are keypairs[0] through keypairs[n_keypairs-1]. */
+  int n_keypairs;
+  /** Storage for the keypairs. */
+  curve25519_keypair_t keypairs[FLEXIBLE_ARRAY_MEMBER];
+};
+
+/** Return a new empty ntor_keypair_pool_t that can hold up to
+ * <b>capacity</b> keypairs. */
+ntor_keypair_pool_t *
+ntor_keypair_pool_new(int capacity)
+{
+  tor_assert(capacity > 0);
+  ntor_keypair_pool_t *pool =
+    tor_malloc_zero(offsetof(ntor_keypair_pool_t, keypairs) +
+                    capacity * sizeof(curve25519_keypair_t));
+  pool->capacity = capacity;
+  return pool;
+}
+
+/** Wipe and free all storage held in <b>pool</b>. */
+void
+ntor_keypair_pool_free_(ntor_keypair_pool_t *pool)
+{
+  if (!pool)
+    return;
+  memwipe(pool, 0, offsetof(ntor_keypair_pool_t, keypairs) +
+          pool->capacity * sizeof(curve25519_keypair_t));
+  tor_free(pool);
+}
+
+/** Return the number of precomputed keypairs available in <b>pool</b>. */
+int
+ntor_keypair_pool_n_keypairs(const ntor_keypair_pool_t *pool)
+{
+  return pool->n_keypairs;
+}
+
+/** Return true iff <b>pool</b> has no room for another keypair. */
+int
+ntor_keypair_pool_is_full(const ntor_keypair_pool_t *pool)
+{
+  return pool->n_keypairs >= pool->capacity;
+}
+
+/** Add a copy of <b>keypair</b> to <b>pool</b>.  Return 0 on success, and
+ * -1 if the pool is full. */
+int
+ntor_keypair_pool_add(ntor_keypair_pool_t *pool,
+                      const curve25519_keypair_t *keypair)
+{
+  if (ntor_keypair_pool_is_full(pool))
+    return -1;
+  memcpy(&pool->keypairs[pool->n_keypairs++], keypair,
+         sizeof(curve25519_keypair_t));
+  return 0;
+}
+
+/** If <b>pool</b> is not full, generate one more keypair for it and return
+ * 1.  Otherwise, return 0. */
+int
+ntor_keypair_pool_fill_one(ntor_keypair_pool_t *pool)
+{
+  if (ntor_keypair_pool_is_full(pool))
+    return 0;
+  if (curve25519_keypair_generate(&pool->keypairs[pool->n_keypairs], 0) < 0)
+    return 0; // LCOV_EXCL_LINE
+  ++pool->n_keypairs;
+  return 1;
+}
+
+/** Set *<b>keypair_out</b> to a fresh keypair for use in an ntor handshake:
+ * take one from <b>pool</b> if it is non-NULL and nonempty, and generate
+ * one otherwise.  Return 0 on success, -1 on failure. */
+static int
+ntor_keypair_pool_take(ntor_keypair_pool_t *pool,
+                       curve25519_keypair_t *keypair_out)
+{
+  if (pool && pool->n_keypairs > 0) {
+    curve25519_keypair_t *kp = &pool->keypairs[--pool->n_keypairs];
+    memcpy(keypair_out, kp, sizeof(curve25519_keypair_t));
+    memwipe(kp, 0, sizeof(curve25519_keypair_t));
+    return 0;
+  }
+  return curve25519_keypair_generate(keypair_out, 0);
+}
+
 /** Convenience function to represent HMAC_SHA256 as our instantiation of
  * ntor's "tweaked hash'.  Hash the <b>inp_len</b> bytes at <b>inp</b> into
  * a DIGEST256_LEN-byte digest at <b>out</b>, with the hash changing
@@ -87,22 +186,25 @@ static const tweakset_t proto1_tweaks = {
  * with a server whose DIGEST_LEN-byte server identity is <b>router_id</b>,
  * and whose onion key is <b>router_key</b>. Store the NTOR_ONIONSKIN_LEN-byte
  * message in <b>onion_skin_out</b>, and store the handshake state in
- * *<b>handshake_state_out</b>.  Return 0 on success, -1 on failure.
+ * *<b>handshake_state_out</b>.  If <b>keypair_pool</b> is provided, take our
+ * ephemeral keypair from it when we can.  Return 0 on success, -1 on failure.
  */
 int
 onion_skin_ntor_create(const uint8_t *router_id,
                        const curve25519_public_key_t *router_key,
+                       ntor_keypair_pool_t *keypair_pool,
                        ntor_handshake_state_t **handshake_state_out,
                        uint8_t *onion_skin_out)
 {
   ntor_handshake_state_t *state;
+  curve25519_keypair_t keypair_x;
   uint8_t *op;
 
   state = tor_malloc_zero(sizeof(ntor_handshake_state_t));
 
   memcpy(state->router_id, router_id, DIGEST_LEN);
   memcpy(&state->pubkey_B, router_key, sizeof(curve25519_public_key_t));
-  if (curve25519_secret_key_generate(&state->seckey_x, 0) < 0) {
+  if (ntor_keypair_pool_take(keypair_pool, &keypair_x) < 0) {
     /* LCOV_EXCL_START
      * Secret key generation should be unable to fail when the key isn't
      * marked as "extra-strong" */
@@ -111,7 +213,9 @@ onion_skin_ntor_create(const uint8_t *router_id,
     return -1;
     /* LCOV_EXCL_STOP */
   }
-  curve25519_public_key_generate(&state->pubkey_X, &state->seckey_x);
+  memcpy(&state->seckey_x, &keypair_x.seckey, sizeof(state->seckey_x));
+  memcpy(&state->pubkey_X, &keypair_x.pubkey, sizeof(state->pubkey_X));
+  memwipe(&keypair_x, 0, sizeof(keypair_x));
 
   op = onion_skin_out;
   APPEND(op, router_id, DIGEST_LEN);
@@ -140,15 +244,17 @@ onion_skin_ntor_create(const uint8_t *router_id,
  * fingerprint as <b>my_node_id</b>, and an associative array mapping public
  * onion keys to curve25519_keypair_t in <b>private_keys</b>, attempt to
  * perform the handshake.  Use <b>junk_keys</b> if present if the handshake
- * indicates an unrecognized public key.  Write an NTOR_REPLY_LEN-byte
- * message to send back to the client into <b>handshake_reply_out</b>, and
- * generate <b>key_out_len</b> bytes of key material in <b>key_out</b>. Return
- * 0 on success, -1 on failure.
+ * indicates an unrecognized public key.  If <b>keypair_pool</b> is provided,
+ * take our ephemeral keypair from it when we can.  Write an
+ * NTOR_REPLY_LEN-byte message to send back to the client into
+ * <b>handshake_reply_out</b>, and generate <b>key_out_len</b> bytes of key
+ * material in <b>key_out</b>. Return 0 on success, -1 on failure.
  */
 int
 onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
                                  const di_digest256_map_t *private_keys,
                                  const curve25519_keypair_t *junk_keys,
+                                 ntor_keypair_pool_t *keypair_pool,
                                  const uint8_t *my_node_id,
                                  uint8_t *handshake_reply_out,
                                  uint8_t *key_out,
@@ -161,8 +267,7 @@ onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
     uint8_t secret_input[SECRET_INPUT_LEN];
     uint8_t auth_input[AUTH_INPUT_LEN];
     curve25519_public_key_t pubkey_X;
-    curve25519_secret_key_t seckey_y;
-    curve25519_public_key_t pubkey_Y;
+    curve25519_keypair_t keypair_y;
     uint8_t verify[DIGEST256_LEN];
   } s;
   uint8_t *si = s.secret_input, *ai = s.auth_input;
@@ -185,8 +290,7 @@ onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
          CURVE25519_PUBKEY_LEN);
 
   /* Make y, Y */
-  curve25519_secret_key_generate(&s.seckey_y, 0);
-  curve25519_public_key_generate(&s.pubkey_Y, &s.seckey_y);
+  ntor_keypair_pool_take(keypair_pool, &s.keypair_y);
 
   /* NOTE: If we ever use a group other than curve25519, or a different
    * representation for its points, we may need to perform different or
@@ -198,7 +302,7 @@ onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
    * code will need to be reconsidered carefully. */
 
   /* build secret_input */
-  curve25519_handshake(si, &s.seckey_y, &s.pubkey_X);
+  curve25519_handshake(si, &s.keypair_y.seckey, &s.pubkey_X);
   bad = safe_mem_is_zero(si, CURVE25519_OUTPUT_LEN);
   si += CURVE25519_OUTPUT_LEN;
   curve25519_handshake(si, &keypair_bB->seckey, &s.pubkey_X);
@@ -208,7 +312,7 @@ onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
   APPEND(si, my_node_id, DIGEST_LEN);
   APPEND(si, keypair_bB->pubkey.public_key, CURVE25519_PUBKEY_LEN);
   APPEND(si, s.pubkey_X.public_key, CURVE25519_PUBKEY_LEN);
-  APPEND(si, s.pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
+  APPEND(si, s.keypair_y.pubkey.public_key, CURVE25519_PUBKEY_LEN);
   APPEND(si, PROTOID, PROTOID_LEN);
   tor_assert(si == s.secret_input + sizeof(s.secret_input));
 
@@ -219,14 +323,15 @@ onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
   APPEND(ai, s.verify, DIGEST256_LEN);
   APPEND(ai, my_node_id, DIGEST_LEN);
   APPEND(ai, keypair_bB->pubkey.public_key, CURVE25519_PUBKEY_LEN);
-  APPEND(ai, s.pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
+  APPEND(ai, s.keypair_y.pubkey.public_key, CURVE25519_PUBKEY_LEN);
   APPEND(ai, s.pubkey_X.public_key, CURVE25519_PUBKEY_LEN);
   APPEND(ai, PROTOID, PROTOID_LEN);
   APPEND(ai, SERVER_STR, SERVER_STR_LEN);
   tor_assert(ai == s.auth_input + sizeof(s.auth_input));
 
   /* Build the reply */
-  memcpy(handshake_reply_out, s.pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
+  memcpy(handshake_reply_out, s.keypair_y.pubkey.public_key,
+         CURVE25519_PUBKEY_LEN);
   h_tweak(handshake_reply_out+CURVE25519_PUBKEY_LEN,
           s.auth_input, sizeof(s.auth_input),
           T->t_mac);
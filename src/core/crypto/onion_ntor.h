@@ -18,6 +18,8 @@ struct curve25519_keypair_t;
 /** State to be maintained by a client between sending an ntor onionskin
  * and receiving a reply. */
 typedef struct ntor_handshake_state_t ntor_handshake_state_t;
+/** A pool of precomputed ephemeral keypairs for ntor handshakes. */
+typedef struct ntor_keypair_pool_t ntor_keypair_pool_t;
 
 /** Length of an ntor onionskin, as sent from the client to server. */
 #define NTOR_ONIONSKIN_LEN 84
@@ -28,14 +30,26 @@ void ntor_handshake_state_free_(ntor_handshake_state_t *state);
 #define ntor_handshake_state_free(state) \
   FREE_AND_NULL(ntor_handshake_state_t, ntor_handshake_state_free_, (state))
 
+ntor_keypair_pool_t *ntor_keypair_pool_new(int capacity);
+void ntor_keypair_pool_free_(ntor_keypair_pool_t *pool);
+#define ntor_keypair_pool_free(pool) \
+  FREE_AND_NULL(ntor_keypair_pool_t, ntor_keypair_pool_free_, (pool))
+int ntor_keypair_pool_n_keypairs(const ntor_keypair_pool_t *pool);
+int ntor_keypair_pool_is_full(const ntor_keypair_pool_t *pool);
+int ntor_keypair_pool_add(ntor_keypair_pool_t *pool,
+                          const struct curve25519_keypair_t *keypair);
+int ntor_keypair_pool_fill_one(ntor_keypair_pool_t *pool);
+
 int onion_skin_ntor_create(const uint8_t *router_id,
                            const struct curve25519_public_key_t *router_key,
+                           ntor_keypair_pool_t *keypair_pool,
                            ntor_handshake_state_t **handshake_state_out,
                            uint8_t *onion_skin_out);
 
 int onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
                            const struct di_digest256_map_t *private_keys,
                            const struct curve25519_keypair_t *junk_keypair,
+                           ntor_keypair_pool_t *keypair_pool,
                            const uint8_t *my_node_id,
                            uint8_t *handshake_reply_out,
                            uint8_t *key_out,
@@ -24,22 +24,31 @@
 #include "core/or/or_circuit_st.h"
 #include "core/or/origin_circuit_st.h"
 
-/** Update digest from the payload of cell. Assign integrity part to
- * cell.
+/** Offset of the "recognized" field within a relay cell's payload. */
+#define RELAY_RECOGNIZED_OFFSET 1
+/** Offset of the integrity field within a relay cell's payload. */
+#define RELAY_INTEGRITY_OFFSET 5
+
+/** Update digest from the relay cell <b>payload</b>. Assign integrity part
+ * to <b>payload</b>.
  */
 void
-relay_set_digest(crypto_digest_t *digest, cell_t *cell)
+relay_set_digest(crypto_digest_t *digest, uint8_t *payload)
+{
+  crypto_digest_add_bytes(digest, (char*)payload, CELL_PAYLOAD_SIZE);
+  crypto_digest_get_digest(digest,
+                           (char*)payload + RELAY_INTEGRITY_OFFSET, 4);
+}
+
+/** Return true iff the "recognized" field of the (decrypted) relay cell
+ * <b>cell</b> is zero, so that the cell might be for us.  This is the cheap
+ * test: a cell that isn't for us passes it only one time in 65536.
+ */
+static inline int
+relay_cell_maybe_recognized(const cell_t *cell)
 {
-  char integrity[4];
-  relay_header_t rh;
-
-  crypto_digest_add_bytes(digest, (char*)cell->payload, CELL_PAYLOAD_SIZE);
-  crypto_digest_get_digest(digest, integrity, 4);
-//  log_fn(LOG_DEBUG,"Putting digest of %u %u %u %u into relay cell.",
-//    integrity[0], integrity[1], integrity[2], integrity[3]);
-  relay_header_unpack(&rh, cell->payload);
-  memcpy(rh.integrity, integrity, 4);
-  relay_header_pack(cell->payload, &rh);
+  return cell->payload[RELAY_RECOGNIZED_OFFSET] == 0 &&
+    cell->payload[RELAY_RECOGNIZED_OFFSET + 1] == 0;
 }
 
 /** Does the digest for this circuit indicate that this cell is for us?
@@ -47,24 +56,21 @@ relay_set_digest(crypto_digest_t *digest, cell_t *cell)
  * Update digest from the payload of cell (with the integrity part set
  * to 0). If the integrity part is valid, return 1, else restore digest
  * and cell to their original state and return 0.
+ *
+ * We work on the cell's payload in place, and only save the digest state
+ * here: so callers should check relay_cell_maybe_recognized() first.
  */
 static int
 relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 {
+  uint8_t *integrity = cell->payload + RELAY_INTEGRITY_OFFSET;
   uint32_t received_integrity, calculated_integrity;
-  relay_header_t rh;
   crypto_digest_checkpoint_t backup_digest;
 
   crypto_digest_checkpoint(&backup_digest, digest);
 
-  relay_header_unpack(&rh, cell->payload);
-  memcpy(&received_integrity, rh.integrity, 4);
-  memset(rh.integrity, 0, 4);
-  relay_header_pack(cell->payload, &rh);
-
-//  log_fn(LOG_DEBUG,"Reading digest of %u %u %u %u from relay cell.",
-//    received_integrity[0], received_integrity[1],
-//    received_integrity[2], received_integrity[3]);
+  memcpy(&received_integrity, integrity, 4);
+  memset(integrity, 0, 4);
 
   crypto_digest_add_bytes(digest, (char*) cell->payload, CELL_PAYLOAD_SIZE);
   crypto_digest_get_digest(digest, (char*) &calculated_integrity, 4);
@@ -73,12 +79,10 @@ relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 
   if (calculated_integrity != received_integrity) {
 //    log_fn(LOG_INFO,"Recognized=0 but bad digest. Not recognizing.");
-// (%d vs %d).", received_integrity, calculated_integrity);
     /* restore digest to its old form */
     crypto_digest_restore(digest, &backup_digest);
     /* restore the relay header */
-    memcpy(rh.integrity, &received_integrity, 4);
-    relay_header_pack(cell->payload, &rh);
+    memcpy(integrity, &received_integrity, 4);
     rv = 0;
   }
 
@@ -86,6 +90,18 @@ relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
   return rv;
 }
 
+/** Remove one layer of encryption from <b>cell</b> using <b>cipher</b>,
+ * and return true iff the cell is now recognized according to
+ * <b>digest</b>.  If it is, <b>digest</b> is updated with the cell. */
+static inline int
+relay_crypt_and_recognize(crypto_cipher_t *cipher, crypto_digest_t *digest,
+                          cell_t *cell)
+{
+  relay_crypt_one_payload(cipher, cell->payload);
+  return relay_cell_maybe_recognized(cell) &&
+    relay_digest_matches(digest, cell);
+}
+
 /** Apply <b>cipher</b> to CELL_PAYLOAD_SIZE bytes of <b>in</b>
  * (in place).
  *
@@ -97,6 +113,20 @@ relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in)
   crypto_cipher_crypt_inplace(cipher, (char*) in, CELL_PAYLOAD_SIZE);
 }
 
+/** Apply <b>ciphers</b>[i] to CELL_PAYLOAD_SIZE bytes of
+ * <b>payloads</b>[i] (in place), for every i less than <b>n</b>.
+ *
+ * Use this instead of relay_crypt_one_payload() when we have a burst of
+ * payloads, possibly for different circuits, to process at once.  Payloads
+ * that share a cipher are processed in the order given.
+ */
+void
+relay_crypt_payloads(crypto_cipher_t **ciphers, uint8_t **payloads, int n)
+{
+  crypto_cipher_crypt_inplace_multi(ciphers, (char **) payloads,
+                                    CELL_PAYLOAD_SIZE, n);
+}
+
 /** Return the sendme_digest within the <b>crypto</b> object. */
 uint8_t *
 relay_crypto_get_sendme_digest(relay_crypto_t *crypto)
@@ -146,8 +176,6 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
                    cell_direction_t cell_direction,
                    crypt_path_t **layer_hint, char *recognized)
 {
-  relay_header_t rh;
-
   tor_assert(circ);
   tor_assert(cell);
   tor_assert(recognized);
@@ -167,17 +195,13 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
       do { /* Remember: cpath is in forward order, that is, first hop first. */
         tor_assert(thishop);
 
-        /* decrypt one layer */
-        cpath_crypt_cell(thishop, cell->payload, true);
-
-        relay_header_unpack(&rh, cell->payload);
-        if (rh.recognized == 0) {
-          /* it's possibly recognized. have to check digest to be sure. */
-          if (relay_digest_matches(cpath_get_incoming_digest(thishop), cell)) {
-            *recognized = 1;
-            *layer_hint = thishop;
-            return 0;
-          }
+        /* decrypt one layer, and see whether it was the last */
+        if (relay_crypt_and_recognize(cpath_get_incoming_cipher(thishop),
+                                      cpath_get_incoming_digest(thishop),
+                                      cell)) {
+          *recognized = 1;
+          *layer_hint = thishop;
+          return 0;
         }
 
         thishop = thishop->next;
@@ -194,15 +218,10 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
     /* We're in the middle. Decrypt one layer. */
     relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
 
-    relay_crypt_one_payload(crypto->f_crypto, cell->payload);
-
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
-      /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(crypto->f_digest, cell)) {
-        *recognized = 1;
-        return 0;
-      }
+    if (relay_crypt_and_recognize(crypto->f_crypto, crypto->f_digest,
+                                  cell)) {
+      *recognized = 1;
+      return 0;
     }
   }
   return 0;
@@ -220,21 +239,26 @@ relay_encrypt_cell_outbound(cell_t *cell,
                             origin_circuit_t *circ,
                             crypt_path_t *layer_hint)
 {
-  crypt_path_t *thishop; /* counter for repeated crypts */
-  cpath_set_cell_forward_digest(layer_hint, cell);
+  relay_encrypt_payload_outbound(cell->payload, circ, layer_hint);
+}
+
+/**
+ * As relay_encrypt_cell_outbound(), but encrypt the relay cell payload at
+ * <b>payload</b> in place, wherever it lives: we use this to encrypt cells
+ * that we have built directly in a packed_cell_t.
+ */
+void
+relay_encrypt_payload_outbound(uint8_t *payload,
+                               origin_circuit_t *circ,
+                               crypt_path_t *layer_hint)
+{
+  cpath_set_cell_forward_digest(layer_hint, payload);
 
   /* Record cell digest as the SENDME digest if need be. */
   sendme_record_sending_cell_digest(TO_CIRCUIT(circ), layer_hint);
 
-  thishop = layer_hint;
-  /* moving from farthest to nearest hop */
-  do {
-    tor_assert(thishop);
-    log_debug(LD_OR,"encrypting a layer of the relay cell.");
-    cpath_crypt_cell(thishop, cell->payload, false);
-
-    thishop = thishop->prev;
-  } while (thishop != circ->cpath->prev);
+  log_debug(LD_OR,"encrypting the layers of the relay cell.");
+  cpath_crypt_cell_outbound(circ->cpath, layer_hint, payload);
 }
 
 /**
@@ -248,13 +272,24 @@ void
 relay_encrypt_cell_inbound(cell_t *cell,
                            or_circuit_t *or_circ)
 {
-  relay_set_digest(or_circ->crypto.b_digest, cell);
+  relay_encrypt_payload_inbound(cell->payload, or_circ);
+}
+
+/**
+ * As relay_encrypt_cell_inbound(), but encrypt the relay cell payload at
+ * <b>payload</b> in place.
+ */
+void
+relay_encrypt_payload_inbound(uint8_t *payload,
+                              or_circuit_t *or_circ)
+{
+  relay_set_digest(or_circ->crypto.b_digest, payload);
 
   /* Record cell digest as the SENDME digest if need be. */
   sendme_record_sending_cell_digest(TO_CIRCUIT(or_circ), NULL);
 
   /* encrypt one layer */
-  relay_crypt_one_payload(or_circ->crypto.b_crypto, cell->payload);
+  relay_crypt_one_payload(or_circ->crypto.b_crypto, payload);
 }
 
 /**
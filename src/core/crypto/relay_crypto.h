@@ -22,6 +22,10 @@ int relay_decrypt_cell(circuit_t *circ, cell_t *cell,
 void relay_encrypt_cell_outbound(cell_t *cell, origin_circuit_t *or_circ,
                             crypt_path_t *layer_hint);
 void relay_encrypt_cell_inbound(cell_t *cell, or_circuit_t *or_circ);
+void relay_encrypt_payload_outbound(uint8_t *payload,
+                                    origin_circuit_t *or_circ,
+                                    crypt_path_t *layer_hint);
+void relay_encrypt_payload_inbound(uint8_t *payload, or_circuit_t *or_circ);
 
 void relay_crypto_clear(relay_crypto_t *crypto);
 
@@ -35,8 +39,15 @@ void relay_crypto_record_sendme_digest(relay_crypto_t *crypto,
 void
 relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in);
 
+/** Largest number of payloads that we usually hand to
+ * relay_crypt_payloads() at once. */
+#define RELAY_CRYPT_BATCH_MAX 32
+
+void
+relay_crypt_payloads(crypto_cipher_t **ciphers, uint8_t **payloads, int n);
+
 void
-relay_set_digest(crypto_digest_t *digest, cell_t *cell);
+relay_set_digest(crypto_digest_t *digest, uint8_t *payload);
 
 #endif /* !defined(TOR_RELAY_CRYPTO_H) */
 
@@ -71,6 +71,7 @@
 #include "core/mainloop/connection.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
+#include "core/mainloop/orshard.h"
 #include "core/or/channel.h"
 #include "core/or/channeltls.h"
 #include "core/or/circuitbuild.h"
@@ -79,6 +80,7 @@
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
 #include "core/or/dos.h"
+#include "core/or/multipath.h"
 #include "core/or/policies.h"
 #include "core/or/reasons.h"
 #include "core/or/relay.h"
@@ -99,6 +101,7 @@
 #include "feature/hibernate/hibernate.h"
 #include "feature/hs/hs_common.h"
 #include "feature/hs/hs_ident.h"
+#include "feature/metrics/metrics.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/relay/dns.h"
@@ -217,7 +220,8 @@ static smartlist_t *outgoing_addrs = NULL;
     case CONN_TYPE_AP_TRANS_LISTENER: \
     case CONN_TYPE_AP_NATD_LISTENER: \
     case CONN_TYPE_AP_DNS_LISTENER: \
-    case CONN_TYPE_AP_HTTP_CONNECT_LISTENER
+    case CONN_TYPE_AP_HTTP_CONNECT_LISTENER: \
+    case CONN_TYPE_METRICS_LISTENER
 
 /**************************************************************/
 
@@ -282,6 +286,8 @@ conn_type_to_string(int type)
     case CONN_TYPE_EXT_OR: return "Extended OR";
     case CONN_TYPE_EXT_OR_LISTENER: return "Extended OR listener";
     case CONN_TYPE_AP_HTTP_CONNECT_LISTENER: return "HTTP tunnel listener";
+    case CONN_TYPE_METRICS_LISTENER: return "Metrics listener";
+    case CONN_TYPE_METRICS: return "Metrics";
     default:
       log_warn(LD_BUG, "unknown connection type %d", type);
       tor_snprintf(buf, sizeof(buf), "unknown [%d]", type);
@@ -367,6 +373,12 @@ conn_state_to_string(int type, int state)
           return "waiting for authentication (protocol v1)";
       }
       break;
+    case CONN_TYPE_METRICS:
+      switch (state) {
+        case METRICS_CONN_STATE_READING: return "waiting for request";
+        case METRICS_CONN_STATE_WRITING: return "writing";
+      }
+      break;
   }
 
   if (state == 0) {
@@ -836,6 +848,9 @@ connection_free_minimal(connection_t *conn)
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
+    /* A connection that we closed has been given back already; but on
+     * exit, we free connections without closing them first. */
+    orshard_detach_conn(conn);
     if (or_conn->tls) {
       if (! SOCKET_OK(conn->s)) {
         /* The socket has been closed by somebody else; we must tell the
@@ -886,6 +901,7 @@ connection_free_minimal(connection_t *conn)
   if (CONN_IS_EDGE(conn)) {
     rend_data_free(TO_EDGE_CONN(conn)->rend_data);
     hs_ident_edge_conn_free(TO_EDGE_CONN(conn)->hs_ident);
+    multipath_stream_clear(TO_EDGE_CONN(conn));
   }
   if (conn->type == CONN_TYPE_CONTROL) {
     control_connection_t *control_conn = TO_CONTROL_CONN(conn);
@@ -1045,6 +1061,9 @@ connection_close_immediate(connection_t *conn)
              buf_datalen(conn->outbuf));
   }
 
+  /* Make sure no other thread is still using the socket: if a shard has
+   * it, the shard gives it back to be closed once it lets go. */
+  orshard_start_detach_conn(conn, 1);
   connection_unregister_events(conn);
 
   /* Prevent the event from getting unblocked. */
@@ -1130,6 +1149,10 @@ connection_mark_for_close_internal_, (connection_t *conn,
               file, line);
   }
 
+  /* We do our last flush, and close, on the main thread, once the shard
+   * (if any) has given the connection back. */
+  orshard_start_detach_conn(conn, 0);
+
   conn->marked_for_close = line;
   conn->marked_for_close_file = file;
   add_connection_to_closeable_list(conn);
@@ -2116,6 +2139,8 @@ connection_init_accepted_conn(connection_t *conn,
     case CONN_TYPE_CONTROL:
       conn->state = CONTROL_CONN_STATE_NEEDAUTH;
       break;
+    case CONN_TYPE_METRICS:
+      return metrics_connection_init_accepted(conn);
   }
   return 0;
 }
@@ -3822,6 +3847,8 @@ reenable_blocked_connection_init(const or_options_t *options)
   if (! reenable_blocked_connections_ev) {
     reenable_blocked_connections_ev =
       mainloop_event_new(reenable_blocked_connections_cb, NULL);
+    mainloop_event_set_name(reenable_blocked_connections_ev,
+                            "connection/reenable-blocked");
     reenable_blocked_connections_is_scheduled = 0;
   }
   time_t sec = options->TokenBucketRefillInterval / 1000;
@@ -3884,6 +3911,8 @@ connection_handle_read_impl(connection_t *conn)
       return connection_handle_listener_read(conn, CONN_TYPE_DIR);
     case CONN_TYPE_CONTROL_LISTENER:
       return connection_handle_listener_read(conn, CONN_TYPE_CONTROL);
+    case CONN_TYPE_METRICS_LISTENER:
+      return connection_handle_listener_read(conn, CONN_TYPE_METRICS);
     case CONN_TYPE_AP_DNS_LISTENER:
       /* This should never happen; eventdns.c handles the reads here. */
       tor_fragile_assert();
@@ -3980,6 +4009,58 @@ connection_handle_read(connection_t *conn)
   return res;
 }
 
+/** Return true iff we may hand the socket reads (or, if <b>for_write</b>,
+ * the socket writes) of <b>conn</b> to an io_uring batch, instead of doing
+ * them in connection_handle_read() or connection_handle_write().
+ *
+ * We only batch I/O on plain sockets: TLS connections do their own I/O
+ * inside the TLS library, and linked connections have no socket. */
+int
+connection_can_batch_socket_io(connection_t *conn, int for_write)
+{
+  if (conn->marked_for_close || !SOCKET_OK(conn->s) || conn->linked)
+    return 0;
+  if (connection_is_listener(conn) || connection_speaks_cells(conn))
+    return 0;
+  if (for_write && connection_state_is_connecting(conn))
+    return 0;
+  return 1;
+}
+
+/** Return the number of bytes that connection_handle_read() would try to
+ * read from the socket of <b>conn</b> with its first read, given our
+ * bandwidth limits. */
+ssize_t
+connection_next_socket_read_size(connection_t *conn)
+{
+  ssize_t at_most;
+  size_t slack_in_buf;
+
+  connection_bucket_refill_single(conn, monotime_coarse_get_stamp());
+  at_most = connection_bucket_read_limit(conn, approx_time());
+
+  /* These match the limits in connection_buf_read_from_socket(). */
+  const ssize_t maximum = BUF_MAX_LEN - buf_datalen(conn->inbuf);
+  if (at_most > maximum)
+    at_most = maximum;
+  slack_in_buf = buf_slack(conn->inbuf);
+  if ((size_t)at_most > slack_in_buf && slack_in_buf >= 1024)
+    at_most = slack_in_buf;
+  return at_most;
+}
+
+/** Return the number of bytes that connection_handle_write() would try to
+ * write to the socket of <b>conn</b>, given our bandwidth limits. */
+ssize_t
+connection_next_socket_write_size(connection_t *conn)
+{
+  ssize_t max_to_write;
+
+  connection_bucket_refill_single(conn, monotime_coarse_get_stamp());
+  max_to_write = connection_bucket_write_limit(conn, approx_time());
+  return MIN(max_to_write, (ssize_t)buf_datalen(conn->outbuf));
+}
+
 /** Pull in new bytes from conn-\>s or conn-\>linked_conn onto conn-\>inbuf,
  * either directly or via TLS. Reduce the token buckets by the number of bytes
  * read.
@@ -4019,7 +4100,20 @@ connection_buf_read_from_socket(connection_t *conn, ssize_t *max_to_read,
     more_to_read = 0;
   }
 
-  if (connection_speaks_cells(conn) &&
+  if (connection_speaks_cells(conn) && TO_OR_CONN(conn)->shard_conn) {
+    /* A shard thread has done the TLS for us. */
+    or_connection_t *or_conn = TO_OR_CONN(conn);
+    result = orshard_conn_read(or_conn->shard_conn, conn->inbuf, at_most,
+                               &n_read, &n_written);
+    if (TOR_TLS_IS_ERROR(result) || result == TOR_TLS_CLOSE) {
+      or_conn->tls_error = result;
+      log_debug(LD_NET,"TLS %s closed %son read in its shard. Closing.",
+                connection_describe(conn),
+                result == TOR_TLS_CLOSE ? "cleanly " : "");
+      return result;
+    }
+    or_conn->tls_error = 0;
+  } else if (connection_speaks_cells(conn) &&
       conn->state > OR_CONN_STATE_PROXY_HANDSHAKING) {
     int pending;
     or_connection_t *or_conn = TO_OR_CONN(conn);
@@ -4111,11 +4205,20 @@ connection_buf_read_from_socket(connection_t *conn, ssize_t *max_to_read,
   } else {
     /* !connection_speaks_cells, !conn->linked_conn. */
     int reached_eof = 0;
-    CONN_LOG_PROTECT(conn,
-                     result = buf_read_from_socket(conn->inbuf, conn->s,
-                                                   at_most,
-                                                   &reached_eof,
-                                                   socket_error));
+    if (conn->uring_read_done) {
+      /* An io_uring batch already did this read for us. */
+      conn->uring_read_done = 0;
+      result = conn->uring_read_result;
+      reached_eof = conn->uring_read_eof;
+      if (result < 0)
+        *socket_error = conn->uring_read_error;
+    } else {
+      CONN_LOG_PROTECT(conn,
+                       result = buf_read_from_socket(conn->inbuf, conn->s,
+                                                     at_most,
+                                                     &reached_eof,
+                                                     socket_error));
+    }
     if (reached_eof)
       conn->inbuf_reached_eof = 1;
 
@@ -4370,8 +4473,14 @@ connection_handle_write_impl(connection_t *conn, int force)
 
     /* else open, or closing */
     initial_size = buf_datalen(conn->outbuf);
-    result = buf_flush_to_tls(conn->outbuf, or_conn->tls,
-                              max_to_write);
+    if (or_conn->shard_conn) {
+      /* Hand the bytes to our shard thread, to encrypt and write. */
+      result = orshard_conn_flush(or_conn->shard_conn, conn->outbuf,
+                                  max_to_write, &n_read, &n_written);
+    } else {
+      result = buf_flush_to_tls(conn->outbuf, or_conn->tls,
+                                max_to_write);
+    }
 
     if (result >= 0)
       update_send_buffer_size(conn->s);
@@ -4423,7 +4532,8 @@ connection_handle_write_impl(connection_t *conn, int force)
        */
     }
 
-    tor_tls_get_n_raw_bytes(or_conn->tls, &n_read, &n_written);
+    if (!or_conn->shard_conn)
+      tor_tls_get_n_raw_bytes(or_conn->tls, &n_read, &n_written);
     log_debug(LD_GENERAL, "After TLS write of %d: %ld read, %ld written",
               result, (long)n_read, (long)n_written);
     or_conn->bytes_xmitted += result;
@@ -4435,9 +4545,15 @@ connection_handle_write_impl(connection_t *conn, int force)
      * or something. */
     result = (int)(initial_size-buf_datalen(conn->outbuf));
   } else {
-    CONN_LOG_PROTECT(conn,
-                     result = buf_flush_to_socket(conn->outbuf, conn->s,
-                                                  max_to_write));
+    if (conn->uring_write_done) {
+      /* An io_uring batch already did this write for us. */
+      conn->uring_write_done = 0;
+      result = conn->uring_write_result;
+    } else {
+      CONN_LOG_PROTECT(conn,
+                       result = buf_flush_to_socket(conn->outbuf, conn->s,
+                                                    max_to_write));
+    }
     if (result < 0) {
       if (CONN_IS_EDGE(conn))
         connection_edge_end_errno(TO_EDGE_CONN(conn));
@@ -4916,7 +5032,8 @@ connection_is_listener(connection_t *conn)
       conn->type == CONN_TYPE_AP_NATD_LISTENER ||
       conn->type == CONN_TYPE_AP_HTTP_CONNECT_LISTENER ||
       conn->type == CONN_TYPE_DIR_LISTENER ||
-      conn->type == CONN_TYPE_CONTROL_LISTENER)
+      conn->type == CONN_TYPE_CONTROL_LISTENER ||
+      conn->type == CONN_TYPE_METRICS_LISTENER)
     return 1;
   return 0;
 }
@@ -5099,6 +5216,8 @@ connection_process_inbuf(connection_t *conn, int package_partial)
       return connection_dir_process_inbuf(TO_DIR_CONN(conn));
     case CONN_TYPE_CONTROL:
       return connection_control_process_inbuf(TO_CONTROL_CONN(conn));
+    case CONN_TYPE_METRICS:
+      return metrics_connection_process_inbuf(conn);
     default:
       log_err(LD_BUG,"got unexpected conn type %d.", conn->type);
       tor_fragile_assert();
@@ -5157,6 +5276,8 @@ connection_finished_flushing(connection_t *conn)
       return connection_dir_finished_flushing(TO_DIR_CONN(conn));
     case CONN_TYPE_CONTROL:
       return connection_control_finished_flushing(TO_CONTROL_CONN(conn));
+    case CONN_TYPE_METRICS:
+      return metrics_connection_finished_flushing(conn);
     default:
       log_err(LD_BUG,"got unexpected conn type %d.", conn->type);
       tor_fragile_assert();
@@ -5212,6 +5333,8 @@ connection_reached_eof(connection_t *conn)
       return connection_dir_reached_eof(TO_DIR_CONN(conn));
     case CONN_TYPE_CONTROL:
       return connection_control_reached_eof(TO_CONTROL_CONN(conn));
+    case CONN_TYPE_METRICS:
+      return metrics_connection_reached_eof(conn);
     default:
       log_err(LD_BUG,"got unexpected conn type %d.", conn->type);
       tor_fragile_assert();
@@ -5662,6 +5785,10 @@ assert_connection_ok(connection_t *conn, time_t now)
       tor_assert(conn->state >= CONTROL_CONN_STATE_MIN_);
       tor_assert(conn->state <= CONTROL_CONN_STATE_MAX_);
       break;
+    case CONN_TYPE_METRICS:
+      tor_assert(conn->state >= METRICS_CONN_STATE_MIN_);
+      tor_assert(conn->state <= METRICS_CONN_STATE_MAX_);
+      break;
     default:
       tor_assert(0);
   }
@@ -73,8 +73,12 @@ struct buf_t;
 #define CONN_TYPE_EXT_OR_LISTENER 17
 /** Type for sockets listening for HTTP CONNECT tunnel connections. */
 #define CONN_TYPE_AP_HTTP_CONNECT_LISTENER 18
+/** Type for sockets listening for MetricsPort connections. */
+#define CONN_TYPE_METRICS_LISTENER 19
+/** Type for HTTP connections to the MetricsPort. */
+#define CONN_TYPE_METRICS 20
 
-#define CONN_TYPE_MAX_ 19
+#define CONN_TYPE_MAX_ 21
 /* !!!! If _CONN_TYPE_MAX is ever over 31, we must grow the type field in
  * struct connection_t. */
 
@@ -224,6 +228,9 @@ void connection_mark_all_noncontrol_listeners(void);
 void connection_mark_all_noncontrol_connections(void);
 
 ssize_t connection_bucket_write_limit(struct connection_t *conn, time_t now);
+int connection_can_batch_socket_io(struct connection_t *conn, int for_write);
+ssize_t connection_next_socket_read_size(struct connection_t *conn);
+ssize_t connection_next_socket_write_size(struct connection_t *conn);
 bool connection_dir_is_global_write_low(const struct connection_t *conn,
                                         size_t attempt);
 void connection_bucket_init(void);
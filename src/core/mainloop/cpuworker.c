@@ -16,7 +16,12 @@
  *      <li>for compressing consensuses in consdiffmgr.c,
  *      <li>and for calculating diffs and compressing them in consdiffmgr.c.
  *  </ul>
+ *
+ * When they have nothing else to do, the workers also precompute the
+ * ephemeral keypairs that ntor handshakes need, both for their own use and
+ * for the main thread's client-side handshakes.
  **/
+#define CPUWORKER_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
 #include "core/or/circuitlist.h"
@@ -32,15 +37,17 @@
 #include "feature/relay/router.h"
 #include "lib/evloop/workqueue.h"
 #include "core/crypto/onion_crypto.h"
+#include "core/crypto/onion_ntor.h"
+#include "lib/crypt_ops/crypto_curve25519.h"
 
 #include "core/or/or_circuit_st.h"
 
-static void queue_pending_tasks(void);
+static int assign_onionskins_to_cpuworker(int n, or_circuit_t **circs,
+                                          create_cell_t **onionskins);
 
-typedef struct worker_state_t {
-  int generation;
-  server_onion_keys_t *onion_keys;
-} worker_state_t;
+/** Largest number of precomputed ntor keypairs that each worker keeps for
+ * its own server-side handshakes. */
+#define WORKER_NTOR_KEYPAIR_POOL_SIZE 64
 
 static void *
 worker_state_new(void *arg)
@@ -49,6 +56,7 @@ worker_state_new(void *arg)
   (void)arg;
   ws = tor_malloc_zero(sizeof(worker_state_t));
   ws->onion_keys = server_onion_keys_new();
+  ws->keypair_pool = ntor_keypair_pool_new(WORKER_NTOR_KEYPAIR_POOL_SIZE);
   return ws;
 }
 
@@ -61,6 +69,7 @@ worker_state_free_(worker_state_t *ws)
   if (!ws)
     return;
   server_onion_keys_free(ws->onion_keys);
+  ntor_keypair_pool_free(ws->keypair_pool);
   tor_free(ws);
 }
 
@@ -70,11 +79,25 @@ worker_state_free_void(void *arg)
   worker_state_free_(arg);
 }
 
+/** Idle function for worker threads: precompute one more ephemeral keypair
+ * for this worker's ntor handshakes, if there is room for it.  Return true
+ * iff we did anything. */
+static int
+worker_idle_threadfn(void *state_)
+{
+  worker_state_t *state = state_;
+  return ntor_keypair_pool_fill_one(state->keypair_pool);
+}
+
 static replyqueue_t *replyqueue = NULL;
 static threadpool_t *threadpool = NULL;
 
+/** How many onionskins have we handed to the threadpool, without having
+ * processed the reply yet? */
 static int total_pending_tasks = 0;
 static int max_pending_tasks = 128;
+/** How many threads are there in the threadpool? */
+static int n_cpuworker_threads = 1;
 
 /** Initialize the cpuworker subsystem. It is OK to call this more than once
  * during Tor's lifetime.
@@ -93,6 +116,7 @@ cpu_init(void)
       least one thread of each kind.
     */
     const int n_threads = get_num_cpus(get_options()) + 1;
+    n_cpuworker_threads = n_threads;
     threadpool = threadpool_new(n_threads,
                                 replyqueue,
                                 worker_state_new,
@@ -102,6 +126,8 @@ cpu_init(void)
     int r = threadpool_register_reply_event(threadpool, NULL);
 
     tor_assert(r == 0);
+
+    threadpool_set_idle_fn(threadpool, worker_idle_threadfn);
   }
 
   /* Total voodoo. Can we make this more sensible? */
@@ -161,6 +187,8 @@ typedef struct cpuworker_reply_t {
 } cpuworker_reply_t;
 
 typedef struct cpuworker_job_u_t {
+  /** The circuit waiting for this job, or NULL if the circuit has stopped
+   * waiting for it. */
   or_circuit_t *circ;
   union {
     cpuworker_request_t request;
@@ -168,6 +196,45 @@ typedef struct cpuworker_job_u_t {
   } u;
 } cpuworker_job_t;
 
+/** A batch of onionskin jobs, processed together by a single cpuworker, and
+ * answered together by the main thread.  Every circuit whose job is in a
+ * batch has its workqueue_entry set to the batch's entry. */
+typedef struct cpuworker_batch_t {
+  /** How many jobs are there in <b>jobs</b>? */
+  int n_jobs;
+  /** How many of the jobs still have a circuit waiting for them? */
+  int n_live;
+  /** The jobs themselves. */
+  cpuworker_job_t jobs[FLEXIBLE_ARRAY_MEMBER];
+} cpuworker_batch_t;
+
+/** Allocate and return a new cpuworker_batch_t with room for <b>n_jobs</b>
+ * jobs. */
+static cpuworker_batch_t *
+cpuworker_batch_new(int n_jobs)
+{
+  tor_assert(n_jobs > 0 && n_jobs <= MAX_ONIONSKINS_PER_BATCH);
+  cpuworker_batch_t *batch =
+    tor_malloc_zero(offsetof(cpuworker_batch_t, jobs) +
+                    n_jobs * sizeof(cpuworker_job_t));
+  batch->n_jobs = n_jobs;
+  return batch;
+}
+
+#define cpuworker_batch_free(batch) \
+  FREE_AND_NULL(cpuworker_batch_t, cpuworker_batch_free_, (batch))
+
+/** Wipe and release all storage held in <b>batch</b>. */
+static void
+cpuworker_batch_free_(cpuworker_batch_t *batch)
+{
+  if (!batch)
+    return;
+  memwipe(batch, 0, offsetof(cpuworker_batch_t, jobs) +
+          batch->n_jobs * sizeof(cpuworker_job_t));
+  tor_free(batch);
+}
+
 static workqueue_reply_t
 update_state_threadfn(void *state_, void *work_)
 {
@@ -307,11 +374,10 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
          onionskin_type_name, (unsigned)overhead, relative_overhead*100);
 }
 
-/** Handle a reply from the worker threads. */
+/** Handle a single job's reply from the worker threads. */
 static void
-cpuworker_onion_handshake_replyfn(void *work_)
+cpuworker_onion_handshake_reply_job(cpuworker_job_t *job)
 {
-  cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
 
@@ -353,6 +419,13 @@ cpuworker_onion_handshake_replyfn(void *work_)
             "Unpacking cpuworker reply %p, circ=%p, success=%d",
             job, circ, rpl.success);
 
+  if (circ == NULL) {
+    /* The circuit stopped waiting for this reply after we had handed it to
+     * a worker; see cpuworker_cancel_circ_handshake(). */
+    log_debug(LD_OR, "Circuit was cancelled while reply was pending.");
+    goto done_processing;
+  }
+
   if (circ->base_.magic == DEAD_CIRCUIT_MAGIC) {
     /* The circuit was supposed to get freed while the reply was
      * pending. Instead, it got left for us to free so that we wouldn't freak
@@ -391,20 +464,32 @@ cpuworker_onion_handshake_replyfn(void *work_)
 
  done_processing:
   memwipe(&rpl, 0, sizeof(rpl));
-  memwipe(job, 0, sizeof(*job));
-  tor_free(job);
-  queue_pending_tasks();
 }
 
-/** Implementation function for onion handshake requests. */
-static workqueue_reply_t
-cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+/** Handle a reply from the worker threads, for a whole batch of jobs. */
+static void
+cpuworker_onion_handshake_replyfn(void *work_)
 {
-  worker_state_t *state = state_;
-  cpuworker_job_t *job = work_;
+  cpuworker_batch_t *batch = work_;
+  int i;
 
-  /* variables for onion processing */
-  server_onion_keys_t *onion_keys = state->onion_keys;
+  for (i = 0; i < batch->n_jobs; ++i) {
+    cpuworker_onion_handshake_reply_job(&batch->jobs[i]);
+  }
+
+  cpuworker_batch_free(batch);
+  queue_pending_tasks();
+}
+
+/** Process a single onion handshake request in a worker thread, using
+ * <b>onion_keys</b> and the ephemeral keys in <b>keypair_pool</b>.  Return 0
+ * on success (even if the handshake failed), and -1 if the job was so bad
+ * that the thread should exit. */
+static int
+cpuworker_onion_handshake_job(server_onion_keys_t *onion_keys,
+                              ntor_keypair_pool_t *keypair_pool,
+                              cpuworker_job_t *job)
+{
   cpuworker_request_t req;
   cpuworker_reply_t rpl;
 
@@ -424,7 +509,7 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
     tor_gettimeofday(&tv_start);
   n = onion_skin_server_handshake(cc->handshake_type,
                                   cc->onionskin, cc->handshake_len,
-                                  onion_keys,
+                                  onion_keys, keypair_pool,
                                   cell_out->reply,
                                   rpl.keys, CPATH_KEY_MATERIAL_LEN,
                                   rpl.rend_auth_material);
@@ -446,7 +531,7 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
       cell_out->cell_type = CELL_CREATED_FAST; break;
     default:
       tor_assert(0);
-      return WQ_RPL_SHUTDOWN;
+      return -1;
     }
     rpl.success = 1;
   }
@@ -467,23 +552,147 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
 
   memwipe(&req, 0, sizeof(req));
   memwipe(&rpl, 0, sizeof(req));
+  return 0;
+}
+
+/** Implementation function for onion handshake requests: process every
+ * job in a batch. */
+static workqueue_reply_t
+cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+{
+  worker_state_t *state = state_;
+  cpuworker_batch_t *batch = work_;
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    if (cpuworker_onion_handshake_job(state->onion_keys,
+                                      state->keypair_pool,
+                                      &batch->jobs[i]) < 0)
+      return WQ_RPL_SHUTDOWN;
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** How many keypairs do we ask a worker to precompute for the main thread's
+ * client-side handshakes at a time? */
+#define CLIENT_KEYPAIRS_PER_REFILL 16
+
+/** A request for a worker to precompute some ntor keypairs for the main
+ * thread. */
+typedef struct keypair_refill_job_t {
+  /** The keypairs themselves. */
+  curve25519_keypair_t keypairs[CLIENT_KEYPAIRS_PER_REFILL];
+} keypair_refill_job_t;
+
+/** True iff we have a keypair_refill_job_t pending. */
+static int client_keypair_refill_pending = 0;
+
+/** Worker function: generate the keypairs for a keypair_refill_job_t. */
+static workqueue_reply_t
+keypair_refill_threadfn(void *state_, void *work_)
+{
+  keypair_refill_job_t *job = work_;
+  int i;
+  (void)state_;
+
+  for (i = 0; i < CLIENT_KEYPAIRS_PER_REFILL; ++i) {
+    curve25519_keypair_generate(&job->keypairs[i], 0);
+  }
   return WQ_RPL_REPLY;
 }
 
-/** Take pending tasks from the queue and assign them to cpuworkers. */
+/** Reply function: add the keypairs from a keypair_refill_job_t to the
+ * main thread's pool. */
+static void
+keypair_refill_replyfn(void *work_)
+{
+  keypair_refill_job_t *job = work_;
+  ntor_keypair_pool_t *pool = onion_get_client_ntor_keypair_pool();
+  int i;
+
+  for (i = 0; i < CLIENT_KEYPAIRS_PER_REFILL; ++i) {
+    if (ntor_keypair_pool_add(pool, &job->keypairs[i]) < 0)
+      break;
+  }
+  memwipe(job, 0, sizeof(*job));
+  tor_free(job);
+  client_keypair_refill_pending = 0;
+}
+
+/** If the main thread's pool of ntor keypairs is running low, and we aren't
+ * already refilling it, ask a worker to precompute some more keypairs. */
 static void
+maybe_refill_client_keypair_pool(void)
+{
+  ntor_keypair_pool_t *pool = onion_get_client_ntor_keypair_pool();
+
+  if (client_keypair_refill_pending ||
+      ntor_keypair_pool_n_keypairs(pool) >= CLIENT_KEYPAIRS_PER_REFILL)
+    return;
+
+  keypair_refill_job_t *job = tor_malloc_zero(sizeof(keypair_refill_job_t));
+  if (!cpuworker_queue_work(WQ_PRI_LOW,
+                            keypair_refill_threadfn,
+                            keypair_refill_replyfn,
+                            job)) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    tor_free(job);
+    return;
+  }
+  client_keypair_refill_pending = 1;
+}
+
+/** Return the number of onionskins that we should put in each batch of
+ * work when draining the onion queue.  We want big batches when the queue is
+ * long, but we don't want to leave threads idle while a single thread works
+ * through a batch. */
+static int
+get_onionskin_batch_size(void)
+{
+  const int n_queued = onion_num_pending(ONION_HANDSHAKE_TYPE_TAP) +
+    onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR);
+  int batch_size = n_queued / n_cpuworker_threads;
+
+  if (batch_size > max_pending_tasks - total_pending_tasks)
+    batch_size = max_pending_tasks - total_pending_tasks;
+  return (int) CLAMP(1, batch_size, MAX_ONIONSKINS_PER_BATCH);
+}
+
+/** Take pending tasks from the queue and assign them to cpuworkers, in
+ * batches. */
+STATIC void
 queue_pending_tasks(void)
 {
-  or_circuit_t *circ;
-  create_cell_t *onionskin = NULL;
+  or_circuit_t *circs[MAX_ONIONSKINS_PER_BATCH];
+  create_cell_t *onionskins[MAX_ONIONSKINS_PER_BATCH];
 
   while (total_pending_tasks < max_pending_tasks) {
-    circ = onion_next_task(&onionskin);
+    const int batch_size = get_onionskin_batch_size();
+    int n = 0;
+
+    while (n < batch_size) {
+      create_cell_t *onionskin = NULL;
+      or_circuit_t *circ = onion_next_task(&onionskin);
+      if (!circ)
+        break;
+      if (!circ->p_chan) {
+        log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+        tor_free(onionskin);
+        continue;
+      }
+      circs[n] = circ;
+      onionskins[n] = onionskin;
+      ++n;
+    }
 
-    if (!circ)
+    if (n == 0) {
+      /* The onion queue is empty: this is a good time to make sure that
+       * the workers are precomputing keypairs for us. */
+      maybe_refill_client_keypair_pool();
       return;
+    }
 
-    if (assign_onionskin_to_cpuworker(circ, onionskin) < 0)
+    if (assign_onionskins_to_cpuworker(n, circs, onionskins) < 0)
       log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
   }
 }
@@ -504,6 +713,71 @@ cpuworker_queue_work,(workqueue_priority_t priority,
                                         arg);
 }
 
+/** Fill in <b>job</b> to process <b>onionskin</b> for the circuit
+ * <b>circ</b>, and take ownership of <b>onionskin</b>. */
+static void
+cpuworker_job_init(cpuworker_job_t *job, or_circuit_t *circ,
+                   create_cell_t *onionskin)
+{
+  cpuworker_request_t *req = &job->u.request;
+
+  if (!channel_is_client(circ->p_chan))
+    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+
+  job->circ = circ;
+  req->magic = CPUWORKER_REQUEST_MAGIC;
+  req->timed = should_time_request(onionskin->handshake_type);
+
+  memcpy(&req->create_cell, onionskin, sizeof(create_cell_t));
+  tor_free(onionskin);
+
+  if (req->timed)
+    tor_gettimeofday(&req->started_at);
+}
+
+/** Tell a cpuworker to perform the public key operations necessary to
+ * respond to the <b>n</b> onionskins in <b>onionskins</b>, for the
+ * corresponding circuits in <b>circs</b>, all as a single item of work.
+ * Every circuit must have a p_chan.  Takes ownership of the onionskins.
+ *
+ * Return 0 if we successfully assign the task, or -1 on failure.
+ */
+static int
+assign_onionskins_to_cpuworker(int n, or_circuit_t **circs,
+                               create_cell_t **onionskins)
+{
+  workqueue_entry_t *queue_entry;
+  cpuworker_batch_t *batch;
+  int i;
+
+  batch = cpuworker_batch_new(n);
+  for (i = 0; i < n; ++i) {
+    cpuworker_job_init(&batch->jobs[i], circs[i], onionskins[i]);
+  }
+  batch->n_live = n;
+
+  total_pending_tasks += n;
+  queue_entry = cpuworker_queue_work(WQ_PRI_HIGH,
+                                     cpuworker_onion_handshake_threadfn,
+                                     cpuworker_onion_handshake_replyfn,
+                                     batch);
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    total_pending_tasks -= n;
+    cpuworker_batch_free(batch);
+    return -1;
+  }
+
+  log_debug(LD_OR, "Queued task batch %p with %d onionskins (qe=%p)",
+            batch, n, queue_entry);
+
+  for (i = 0; i < n; ++i) {
+    circs[i]->workqueue_entry = queue_entry;
+  }
+
+  return 0;
+}
+
 /** Try to tell a cpuworker to perform the public key operations necessary to
  * respond to <b>onionskin</b> for the circuit <b>circ</b>.
  *
@@ -513,11 +787,6 @@ int
 assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  workqueue_entry_t *queue_entry;
-  cpuworker_job_t *job;
-  cpuworker_request_t req;
-  int should_time;
-
   tor_assert(threadpool);
 
   if (!circ->p_chan) {
@@ -535,63 +804,42 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
     return 0;
   }
 
-  if (!channel_is_client(circ->p_chan))
-    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
-
-  should_time = should_time_request(onionskin->handshake_type);
-  memset(&req, 0, sizeof(req));
-  req.magic = CPUWORKER_REQUEST_MAGIC;
-  req.timed = should_time;
-
-  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
-
-  tor_free(onionskin);
-
-  if (should_time)
-    tor_gettimeofday(&req.started_at);
-
-  job = tor_malloc_zero(sizeof(cpuworker_job_t));
-  job->circ = circ;
-  memcpy(&job->u.request, &req, sizeof(req));
-  memwipe(&req, 0, sizeof(req));
-
-  ++total_pending_tasks;
-  queue_entry = threadpool_queue_work_priority(threadpool,
-                                      WQ_PRI_HIGH,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
-                                      job);
-  if (!queue_entry) {
-    log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    tor_free(job);
-    return -1;
-  }
-
-  log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
-
-  circ->workqueue_entry = queue_entry;
-
-  return 0;
+  return assign_onionskins_to_cpuworker(1, &circ, &onionskin);
 }
 
 /** If <b>circ</b> has a pending handshake that hasn't been processed yet,
- * remove it from the worker queue. */
+ * remove it from the worker queue.  If we can't remove it (because a worker
+ * has already started on it, or because other circuits' handshakes are in
+ * the same batch), we detach the circuit from its job instead, so that the
+ * reply will be ignored. */
 void
 cpuworker_cancel_circ_handshake(or_circuit_t *circ)
 {
-  cpuworker_job_t *job;
+  cpuworker_batch_t *batch;
+  int i;
   if (circ->workqueue_entry == NULL)
     return;
 
-  job = workqueue_entry_cancel(circ->workqueue_entry);
-  if (job) {
-    /* It successfully cancelled. */
-    memwipe(job, 0xe0, sizeof(*job));
-    tor_free(job);
-    tor_assert(total_pending_tasks > 0);
-    --total_pending_tasks;
-    /* if (!job), this is done in cpuworker_onion_handshake_replyfn. */
+  batch = workqueue_entry_get_arg(circ->workqueue_entry);
+  tor_assert(batch->n_live > 0);
+
+  if (batch->n_live == 1 &&
+      workqueue_entry_cancel(circ->workqueue_entry) != NULL) {
+    /* It successfully cancelled, and nobody else was waiting for it. */
+    tor_assert(total_pending_tasks >= batch->n_jobs);
+    total_pending_tasks -= batch->n_jobs;
+    cpuworker_batch_free(batch);
     circ->workqueue_entry = NULL;
+    return;
+  }
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    if (batch->jobs[i].circ == circ) {
+      batch->jobs[i].circ = NULL;
+      --batch->n_live;
+      circ->workqueue_entry = NULL;
+      return;
+    }
   }
+  tor_assert_nonfatal_unreached();
 }
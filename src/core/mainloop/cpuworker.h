@@ -33,5 +33,24 @@ void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
+#ifdef CPUWORKER_PRIVATE
+/** Largest number of onionskins that we will hand to a cpuworker as a
+ * single item of work.  Batching onionskins saves us the per-item cost of
+ * queueing the work, waking up the worker, and handling the reply, which
+ * adds up when we are flooded with create cells. */
+#define MAX_ONIONSKINS_PER_BATCH 16
+
+/** The state that each cpuworker thread keeps for its handshakes. */
+typedef struct worker_state_t {
+  int generation;
+  struct server_onion_keys_t *onion_keys;
+  /** Precomputed ephemeral keypairs for this worker's ntor handshakes.  Only
+   * used from the thread that owns this state, so it needs no lock. */
+  struct ntor_keypair_pool_t *keypair_pool;
+} worker_state_t;
+
+STATIC void queue_pending_tasks(void);
+#endif /* defined(CPUWORKER_PRIVATE) */
+
 #endif /* !defined(TOR_CPUWORKER_H) */
 
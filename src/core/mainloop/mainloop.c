@@ -56,6 +56,7 @@
 #include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
+#include "core/mainloop/orshard.h"
 #include "core/mainloop/periodic.h"
 #include "core/or/channel.h"
 #include "core/or/channelpadding.h"
@@ -104,6 +105,7 @@
 
 #include "lib/net/buffers_net.h"
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/evloop_stats.h"
 
 #include <event2/event.h>
 
@@ -203,6 +205,7 @@ static void connection_start_reading_from_linked_conn(connection_t *conn);
 static int connection_should_read_from_linked_conn(connection_t *conn);
 static void conn_read_callback(evutil_socket_t fd, short event, void *_conn);
 static void conn_write_callback(evutil_socket_t fd, short event, void *_conn);
+static void conn_uring_forget(connection_t *conn);
 static void shutdown_did_not_work_callback(evutil_socket_t fd, short event,
                                            void *arg) ATTR_NORETURN;
 
@@ -354,6 +357,7 @@ connection_unlink(connection_t *conn)
   }
   smartlist_remove(closeable_connection_lst, conn);
   smartlist_remove(active_linked_connection_lst, conn);
+  conn_uring_forget(conn);
   if (conn->type == CONN_TYPE_EXIT) {
     assert_connection_edge_not_dns_pending(TO_EDGE_CONN(conn));
   }
@@ -509,8 +513,11 @@ connection_watch_events(connection_t *conn, watchable_events_t events)
 int
 connection_is_reading(connection_t *conn)
 {
+  orshard_conn_t *sc;
   tor_assert(conn);
 
+  if ((sc = orshard_conn_get(conn)))
+    return orshard_conn_is_reading(sc);
   return conn->reading_from_linked_conn ||
     (conn->read_event && event_pending(conn->read_event, EV_READ, NULL));
 }
@@ -610,12 +617,19 @@ connection_check_event(connection_t *conn, struct event *ev)
 MOCK_IMPL(void,
 connection_stop_reading,(connection_t *conn))
 {
+  orshard_conn_t *sc;
   tor_assert(conn);
 
   if (connection_check_event(conn, conn->read_event) < 0) {
     return;
   }
 
+  if ((sc = orshard_conn_get(conn))) {
+    /* Another thread is watching the socket. */
+    orshard_conn_set_reading(sc, 0);
+    return;
+  }
+
   if (conn->linked) {
     conn->reading_from_linked_conn = 0;
     connection_stop_reading_from_linked_conn(conn);
@@ -632,12 +646,19 @@ connection_stop_reading,(connection_t *conn))
 MOCK_IMPL(void,
 connection_start_reading,(connection_t *conn))
 {
+  orshard_conn_t *sc;
   tor_assert(conn);
 
   if (connection_check_event(conn, conn->read_event) < 0) {
     return;
   }
 
+  if ((sc = orshard_conn_get(conn))) {
+    /* Another thread is watching the socket. */
+    orshard_conn_set_reading(sc, 1);
+    return;
+  }
+
   if (conn->linked) {
     conn->reading_from_linked_conn = 1;
     if (connection_should_read_from_linked_conn(conn))
@@ -655,8 +676,11 @@ connection_start_reading,(connection_t *conn))
 int
 connection_is_writing(connection_t *conn)
 {
+  orshard_conn_t *sc;
   tor_assert(conn);
 
+  if ((sc = orshard_conn_get(conn)))
+    return orshard_conn_is_writing(sc);
   return conn->writing_to_linked_conn ||
     (conn->write_event && event_pending(conn->write_event, EV_WRITE, NULL));
 }
@@ -665,12 +689,19 @@ connection_is_writing(connection_t *conn)
 MOCK_IMPL(void,
 connection_stop_writing,(connection_t *conn))
 {
+  orshard_conn_t *sc;
   tor_assert(conn);
 
   if (connection_check_event(conn, conn->write_event) < 0) {
     return;
   }
 
+  if ((sc = orshard_conn_get(conn))) {
+    /* Another thread is watching the socket. */
+    orshard_conn_set_writing(sc, 0);
+    return;
+  }
+
   if (conn->linked) {
     conn->writing_to_linked_conn = 0;
     if (conn->linked_conn)
@@ -688,12 +719,19 @@ connection_stop_writing,(connection_t *conn))
 MOCK_IMPL(void,
 connection_start_writing,(connection_t *conn))
 {
+  orshard_conn_t *sc;
   tor_assert(conn);
 
   if (connection_check_event(conn, conn->write_event) < 0) {
     return;
   }
 
+  if ((sc = orshard_conn_get(conn))) {
+    /* Another thread is watching the socket. */
+    orshard_conn_set_writing(sc, 1);
+    return;
+  }
+
   if (conn->linked) {
     conn->writing_to_linked_conn = 1;
     if (conn->linked_conn &&
@@ -867,6 +905,230 @@ connection_count_moribund, (void))
   return moribund;
 }
 
+/** Largest number of socket reads and writes that we hand to io_uring in a
+ * single batch. */
+#define CONN_URING_BATCH_SIZE 256
+
+/** If we're batching the socket I/O of plain connections with io_uring, the
+ * batch we use for it.  Otherwise NULL. */
+static buf_uring_batch_t *conn_uring_batch = NULL;
+/** List of connections that are waiting for the next io_uring batch. */
+static smartlist_t *conn_uring_queued_lst = NULL;
+/** Event that runs the next io_uring batch, once libevent has run the
+ * read and write callbacks that were ready along with the first one. */
+static mainloop_event_t *conn_uring_batch_ev = NULL;
+/** True iff we should stop using io_uring once the current batch is
+ * done. */
+static int conn_uring_should_stop = 0;
+
+static void conn_handle_read_event(connection_t *conn);
+static void conn_handle_write_event(connection_t *conn);
+
+/** If we're batching socket I/O with io_uring and <b>conn</b> can take part,
+ * queue a read (or a write, if <b>is_write</b>) on <b>conn</b> for the next
+ * batch and return true.  Otherwise return false: the caller should handle
+ * the read or write itself. */
+static int
+conn_uring_queue(connection_t *conn, int is_write)
+{
+  if (!conn_uring_batch || conn_uring_should_stop)
+    return 0;
+  if (!connection_can_batch_socket_io(conn, is_write))
+    return 0;
+
+  if (!conn->uring_read_queued && !conn->uring_write_queued) {
+    /* Each connection can need two operations. */
+    if (smartlist_len(conn_uring_queued_lst) >= CONN_URING_BATCH_SIZE / 2)
+      return 0;
+    smartlist_add(conn_uring_queued_lst, conn);
+  }
+  if (is_write)
+    conn->uring_write_queued = 1;
+  else
+    conn->uring_read_queued = 1;
+  mainloop_event_activate(conn_uring_batch_ev);
+  return 1;
+}
+
+/** Stop batching socket I/O with io_uring, and release the batch.  No
+ * connection may be waiting for a batch.  (We keep conn_uring_batch_ev,
+ * since this may run from inside its callback.) */
+static void
+conn_uring_teardown(void)
+{
+  if (conn_uring_queued_lst)
+    tor_assert(smartlist_len(conn_uring_queued_lst) == 0);
+  buf_uring_batch_free(conn_uring_batch);
+  smartlist_free(conn_uring_queued_lst);
+  conn_uring_should_stop = 0;
+}
+
+/** Callback: hand the kernel one batch with the socket reads and writes of
+ * every connection in conn_uring_queued_lst, and then run the usual read
+ * and write handlers on those connections.  Those handlers will use the
+ * results of the batch rather than touching the socket again. */
+static void
+conn_uring_batch_cb(mainloop_event_t *ev, void *arg)
+{
+  smartlist_t *conns = conn_uring_queued_lst;
+  int n_conns = smartlist_len(conns);
+  int *read_idx = tor_calloc(n_conns, sizeof(int));
+  int *write_idx = tor_calloc(n_conns, sizeof(int));
+  (void)ev;
+  (void)arg;
+
+  conn_uring_queued_lst = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+    read_idx[conn_sl_idx] = write_idx[conn_sl_idx] = -1;
+    if (conn->uring_read_queued && connection_can_batch_socket_io(conn, 0)) {
+      ssize_t n = connection_next_socket_read_size(conn);
+      if (n > 0)
+        read_idx[conn_sl_idx] =
+          buf_uring_batch_add_read(conn_uring_batch, conn->inbuf, conn->s,
+                                   n);
+    }
+    if (conn->uring_write_queued && connection_can_batch_socket_io(conn, 1)) {
+      ssize_t n = connection_next_socket_write_size(conn);
+      if (n > 0)
+        write_idx[conn_sl_idx] =
+          buf_uring_batch_add_flush(conn_uring_batch, conn->outbuf, conn->s,
+                                    n);
+    }
+  } SMARTLIST_FOREACH_END(conn);
+
+  if (buf_uring_batch_get_n_ops(conn_uring_batch) &&
+      buf_uring_batch_run(conn_uring_batch) < 0) {
+    log_warn(LD_NET, "io_uring failed; going back to Libevent for all "
+             "socket I/O.");
+    conn_uring_should_stop = 1;
+  }
+
+  /* Remember the outcome of each operation on its connection.  Anything
+   * that didn't run, the handlers below will do themselves. */
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+    int eof = 0, err = 0;
+    if (read_idx[conn_sl_idx] >= 0 &&
+        buf_uring_batch_get_result(conn_uring_batch, read_idx[conn_sl_idx],
+                                   &conn->uring_read_result, &eof,
+                                   &err) == 0) {
+      conn->uring_read_done = 1;
+      conn->uring_read_eof = eof;
+      conn->uring_read_error = err;
+    }
+    if (write_idx[conn_sl_idx] >= 0 &&
+        buf_uring_batch_get_result(conn_uring_batch, write_idx[conn_sl_idx],
+                                   &conn->uring_write_result, NULL,
+                                   NULL) == 0) {
+      conn->uring_write_done = 1;
+    }
+  } SMARTLIST_FOREACH_END(conn);
+  buf_uring_batch_clear(conn_uring_batch);
+
+  /* No connection gets freed until we call close_closeable_connections()
+   * below, so it's safe to walk the whole list. */
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+    if (conn->uring_read_queued) {
+      conn->uring_read_queued = 0;
+      conn_handle_read_event(conn);
+    }
+    if (conn->uring_write_queued) {
+      conn->uring_write_queued = 0;
+      if (!conn->marked_for_close)
+        conn_handle_write_event(conn);
+    }
+    conn->uring_read_done = conn->uring_write_done = 0;
+  } SMARTLIST_FOREACH_END(conn);
+
+  smartlist_free(conns);
+  tor_free(read_idx);
+  tor_free(write_idx);
+
+  if (smartlist_len(closeable_connection_lst))
+    close_closeable_connections();
+
+  if (conn_uring_should_stop) {
+    /* Anything queued since we started will run through Libevent. */
+    SMARTLIST_FOREACH(conn_uring_queued_lst, connection_t *, conn,
+                      conn->uring_read_queued = conn->uring_write_queued = 0);
+    smartlist_clear(conn_uring_queued_lst);
+    conn_uring_teardown();
+  }
+}
+
+/** Remove <b>conn</b> from the list of connections waiting for an io_uring
+ * batch, if it is there. */
+static void
+conn_uring_forget(connection_t *conn)
+{
+  if (conn->uring_read_queued || conn->uring_write_queued) {
+    if (conn_uring_queued_lst)
+      smartlist_remove(conn_uring_queued_lst, conn);
+    conn->uring_read_queued = conn->uring_write_queued = 0;
+  }
+}
+
+/** Start batching the socket reads and writes of plain (non-TLS)
+ * connections with io_uring if <b>enable</b> is true and the kernel
+ * supports it; stop if <b>enable</b> is false. */
+void
+mainloop_set_uring_enabled(int enable)
+{
+  if (enable) {
+    conn_uring_should_stop = 0;
+    if (conn_uring_batch)
+      return;
+    conn_uring_batch = buf_uring_batch_new(CONN_URING_BATCH_SIZE);
+    if (!conn_uring_batch) {
+      log_notice(LD_NET, "io_uring is not available here; using Libevent "
+                 "for all socket I/O.");
+      return;
+    }
+    conn_uring_queued_lst = smartlist_new();
+    if (!conn_uring_batch_ev) {
+      conn_uring_batch_ev = mainloop_event_new(conn_uring_batch_cb, NULL);
+      mainloop_event_set_name(conn_uring_batch_ev, "mainloop/uring-batch");
+    }
+    log_notice(LD_NET, "Batching socket reads and writes with io_uring.");
+  } else if (conn_uring_batch) {
+    if (smartlist_len(conn_uring_queued_lst)) {
+      /* Let the batch we've started run, then stop. */
+      conn_uring_should_stop = 1;
+    } else {
+      conn_uring_teardown();
+    }
+  }
+}
+
+/** Cache of the statistics for the read (index 0) and write (index 1)
+ * callbacks of each type of connection.  See evloop_stats.c. */
+static evloop_stat_t *conn_callback_stats[CONN_TYPE_MAX_ + 1][2];
+
+/** Return the statistics for the read callbacks (if <b>is_write</b> is
+ * false) or the write callbacks (if it is true) of connections whose type
+ * is <b>type</b>. */
+static evloop_stat_t *
+conn_callback_stat(unsigned type, int is_write)
+{
+  if (BUG(type > CONN_TYPE_MAX_))
+    type = 0;
+  evloop_stat_t **statp = &conn_callback_stats[type][is_write ? 1 : 0];
+  if (PREDICT_UNLIKELY(*statp == NULL)) {
+    char *name = NULL;
+    tor_asprintf(&name, "conn/%s/%s", conn_type_to_string(type),
+                 is_write ? "write" : "read");
+    for (char *cp = name; *cp; ++cp) {
+      if (TOR_ISSPACE(*cp))
+        *cp = '-';
+      else
+        *cp = TOR_TOLOWER(*cp);
+    }
+    *statp = evloop_stat_get(name);
+    tor_free(name);
+  }
+  return *statp;
+}
+
 /** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
  * some data to read. */
 static void
@@ -878,6 +1140,43 @@ conn_read_callback(evutil_socket_t fd, short event, void *_conn)
 
   log_debug(LD_NET,"socket %d wants to read.",(int)conn->s);
 
+  if (conn_uring_queue(conn, 0))
+    return;
+
+  /* Look this up now: <b>conn</b> may be freed before we're done. */
+  evloop_stat_t *stat = conn_callback_stat(conn->type, 0);
+  evloop_stat_timer_t timer;
+  evloop_stat_timer_start(stat, &timer);
+
+  conn_handle_read_event(conn);
+
+  if (smartlist_len(closeable_connection_lst))
+    close_closeable_connections();
+
+  evloop_stat_timer_end(stat, &timer);
+}
+
+/** Run the handlers that Libevent would run if the socket of <b>conn</b>
+ * were readable (if <b>readable</b> is true) or writable (if
+ * <b>writable</b> is true).  We use this for connections whose socket I/O
+ * happens on another thread. */
+MOCK_IMPL(void,
+connection_handle_io_ready,(connection_t *conn, int readable, int writable))
+{
+  if (readable)
+    conn_handle_read_event(conn);
+  if (writable && !conn->marked_for_close)
+    conn_handle_write_event(conn);
+
+  if (smartlist_len(closeable_connection_lst))
+    close_closeable_connections();
+}
+
+/** Handle a read event on <b>conn</b>: read what we can, process it, and
+ * mark <b>conn</b> for close if that fails. */
+static void
+conn_handle_read_event(connection_t *conn)
+{
   /* assert_connection_ok(conn, time(NULL)); */
 
   /* Handle marked for close connections early */
@@ -904,9 +1203,6 @@ conn_read_callback(evutil_socket_t fd, short event, void *_conn)
     }
   }
   assert_connection_ok(conn, time(NULL));
-
-  if (smartlist_len(closeable_connection_lst))
-    close_closeable_connections();
 }
 
 /** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
@@ -921,6 +1217,26 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "socket %d wants to write.",
                      (int)conn->s));
 
+  if (conn_uring_queue(conn, 1))
+    return;
+
+  evloop_stat_t *stat = conn_callback_stat(conn->type, 1);
+  evloop_stat_timer_t timer;
+  evloop_stat_timer_start(stat, &timer);
+
+  conn_handle_write_event(conn);
+
+  if (smartlist_len(closeable_connection_lst))
+    close_closeable_connections();
+
+  evloop_stat_timer_end(stat, &timer);
+}
+
+/** Handle a write event on <b>conn</b>: flush what we can, and mark
+ * <b>conn</b> for close if that fails. */
+static void
+conn_handle_write_event(connection_t *conn)
+{
   /* assert_connection_ok(conn, time(NULL)); */
 
   if (connection_handle_write(conn, 0) < 0) {
@@ -942,9 +1258,6 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
     }
   }
   assert_connection_ok(conn, time(NULL));
-
-  if (smartlist_len(closeable_connection_lst))
-    close_closeable_connections();
 }
 
 /** If the connection at connection_array[i] is marked for close, then:
@@ -965,6 +1278,10 @@ conn_close_if_marked(int i)
   conn = smartlist_get(connection_array, i);
   if (!conn->marked_for_close)
     return 0; /* nothing to see here, move along */
+  /* A shard may still be using the connection's TLS object: wait until it
+   * gives the connection back. */
+  if (orshard_start_detach_conn(conn, 0))
+    return 0;
   now = time(NULL);
   assert_connection_ok(conn, now);
 
@@ -1106,6 +1423,8 @@ directory_all_unreachable(time_t now)
     directory_all_unreachable_cb_event =
       mainloop_event_new(directory_all_unreachable_cb, NULL);
     tor_assert(directory_all_unreachable_cb_event);
+    mainloop_event_set_name(directory_all_unreachable_cb_event,
+                            "mainloop/directory-unreachable");
   }
 
   mainloop_event_activate(directory_all_unreachable_cb_event);
@@ -1325,6 +1644,8 @@ do_signewnym(time_t now)
       if (!handle_deferred_signewnym_ev) {
         handle_deferred_signewnym_ev =
           mainloop_event_postloop_new(handle_deferred_signewnym_cb, NULL);
+        mainloop_event_set_name(handle_deferred_signewnym_ev,
+                                "mainloop/signewnym");
       }
       const struct timeval delay_tv = { delay_sec, 0 };
       mainloop_event_schedule(handle_deferred_signewnym_ev, &delay_tv);
@@ -1369,6 +1690,7 @@ CALLBACK(reset_padding_counts);
 CALLBACK(retry_listeners);
 CALLBACK(rotate_x509_certificate);
 CALLBACK(save_state);
+CALLBACK(shrink_buf_freelists);
 CALLBACK(write_stats_file);
 CALLBACK(control_per_second_events);
 CALLBACK(second_elapsed);
@@ -1388,6 +1710,7 @@ STATIC periodic_event_item_t mainloop_periodic_events[] = {
   CALLBACK(add_entropy, ALL, 0),
   CALLBACK(heartbeat, ALL, 0),
   CALLBACK(reset_padding_counts, ALL, 0),
+  CALLBACK(shrink_buf_freelists, ALL, 0),
 
   /* This is a legacy catch-all callback that runs once per second if
    * we are online and active. */
@@ -1576,6 +1899,8 @@ schedule_rescan_periodic_events,(void))
   if (!rescan_periodic_events_ev) {
     rescan_periodic_events_ev =
       mainloop_event_new(rescan_periodic_events_cb, NULL);
+    mainloop_event_set_name(rescan_periodic_events_ev,
+                            "mainloop/rescan-periodic");
   }
   mainloop_event_activate(rescan_periodic_events_ev);
 }
@@ -1661,6 +1986,8 @@ mainloop_schedule_shutdown(int delay_sec)
   const struct timeval delay_tv = { delay_sec, 0 };
   if (! scheduled_shutdown_ev) {
     scheduled_shutdown_ev = mainloop_event_new(scheduled_shutdown_cb, NULL);
+    mainloop_event_set_name(scheduled_shutdown_ev,
+                            "mainloop/scheduled-shutdown");
   }
   mainloop_event_schedule(scheduled_shutdown_ev, &delay_tv);
 }
@@ -2017,6 +2344,20 @@ clean_caches_callback(time_t now, const or_options_t *options)
   return CLEAN_CACHES_INTERVAL;
 }
 
+/**
+ * Periodic callback: give back to the system any buffer chunks that have
+ * sat unused on our freelists since the last time we were called.
+ */
+static int
+shrink_buf_freelists_callback(time_t now, const or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  buf_shrink_freelists(0);
+#define SHRINK_BUF_FREELISTS_INTERVAL 60
+  return SHRINK_BUF_FREELISTS_INTERVAL;
+}
+
 /**
  * Periodic callback: Clean the cache of failed hidden service lookups
  * frequently.
@@ -2328,10 +2669,13 @@ initialize_mainloop_events(void)
   if (!schedule_active_linked_connections_event) {
     schedule_active_linked_connections_event =
       mainloop_event_postloop_new(schedule_active_linked_connections_cb, NULL);
+    mainloop_event_set_name(schedule_active_linked_connections_event,
+                            "mainloop/linked-connections");
   }
   if (!postloop_cleanup_ev) {
     postloop_cleanup_ev =
       mainloop_event_postloop_new(postloop_cleanup_cb, NULL);
+    mainloop_event_set_name(postloop_cleanup_ev, "mainloop/postloop-cleanup");
   }
 }
 
@@ -2537,6 +2881,10 @@ tor_mainloop_free_all(void)
   smartlist_free(connection_array);
   smartlist_free(closeable_connection_lst);
   smartlist_free(active_linked_connection_lst);
+  if (conn_uring_queued_lst)
+    smartlist_clear(conn_uring_queued_lst);
+  conn_uring_teardown();
+  mainloop_event_free(conn_uring_batch_ev);
   teardown_periodic_events();
   tor_event_free(shutdown_did_not_work_event);
   tor_event_free(initialize_periodic_events_event);
@@ -2546,6 +2894,8 @@ tor_mainloop_free_all(void)
   mainloop_event_free(handle_deferred_signewnym_ev);
   mainloop_event_free(scheduled_shutdown_ev);
   mainloop_event_free(rescan_periodic_events_ev);
+  /* The statistics themselves are freed with the evloop subsystem. */
+  memset(conn_callback_stats, 0, sizeof(conn_callback_stats));
 
 #ifdef HAVE_SYSTEMD_209
   periodic_timer_free(systemd_watchdog_timer);
@@ -45,6 +45,8 @@ MOCK_DECL(void,connection_start_reading,(connection_t *conn));
 int connection_is_writing(connection_t *conn);
 MOCK_DECL(void,connection_stop_writing,(connection_t *conn));
 MOCK_DECL(void,connection_start_writing,(connection_t *conn));
+MOCK_DECL(void,connection_handle_io_ready,(connection_t *conn, int readable,
+                                            int writable));
 
 void tor_shutdown_event_loop_and_exit(int exitcode);
 int tor_event_loop_shutdown_is_pending(void);
@@ -88,6 +90,7 @@ void mainloop_schedule_shutdown(int delay_sec);
 
 void tor_init_connection_lists(void);
 void initialize_mainloop_events(void);
+void mainloop_set_uring_enabled(int enable);
 void initialize_periodic_events(void);
 void tor_mainloop_free_all(void);
 
@@ -89,9 +89,10 @@ tor_mainloop_connect_pubsub_events(void)
   const size_t num_channels = get_num_channel_ids();
   alert_events = smartlist_new();
   for (size_t i = 0; i < num_channels; ++i) {
-    smartlist_add(alert_events,
-                  mainloop_event_postloop_new(flush_channel_event,
-                                              (void*)(uintptr_t)(i)));
+    mainloop_event_t *ev =
+      mainloop_event_postloop_new(flush_channel_event, (void*)(uintptr_t)(i));
+    mainloop_event_set_name(ev, "pubsub/flush-channel");
+    smartlist_add(alert_events, ev);
   }
 }
 
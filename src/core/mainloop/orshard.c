@@ -0,0 +1,1295 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file orshard.c
+ * \brief Run the TLS and socket I/O of open OR connections on worker
+ *   threads.
+ *
+ * On a busy relay, much of the main thread's time goes to the byte stream
+ * of its OR connections: reading from the sockets and decrypting the TLS
+ * records we get, and encrypting and writing the cells that we send.  With
+ * ORConnThreads set, we shard open OR connections across that many worker
+ * threads.  Each shard runs its own Libevent loop, and owns the socket and
+ * the tor_tls_t of every connection assigned to it: it reads and decrypts
+ * into one ring of plaintext for the main thread, and it encrypts and
+ * writes whatever plaintext the main thread has put in the other ring.
+ *
+ * Everything above the byte stream -- cell parsing, channels, circuits, the
+ * scheduler, and bandwidth accounting -- stays on the main thread.  So a
+ * cell that arrives on a connection in one shard and leaves on a connection
+ * in another crosses over through the circuit's cell queue on the main
+ * thread, and circuits never need to move between shards.
+ *
+ * The rest of Tor sees a sharded connection almost as before:
+ * connection_buf_read_from_socket() and connection_handle_write_impl() move
+ * bytes to and from the rings instead of calling into TLS, and starting or
+ * stopping reading on a connection gets passed along to its shard.  When a
+ * shard has new plaintext for the main thread, or room for more, or an error
+ * to report, it queues the connection and wakes the main thread with an
+ * alert socket; the main thread then runs its usual read and write handlers
+ * on the connection.
+ *
+ * We only shard connections once they are open, and only with link protocol
+ * 3 or later, where we never renegotiate: so the TLS object never needs to
+ * call back into the main thread.  Before a connection closes, we take it
+ * back from its shard, and close it on the main thread as usual.  Taking a
+ * connection back doesn't block the main thread: we ask the shard to let go,
+ * and the shard tells us when it has through the same queue that it uses
+ * for I/O events.  Until then, the connection stays on the closeable list.
+ *
+ * Locking: each shard has a lock that protects its list of pending
+ * requests, and the rings and flags of its connections.  A separate lock
+ * protects the main thread's list of connections that need attention.  A
+ * shard may acquire main_lock while it holds its own lock, but we never
+ * acquire a shard's lock while holding main_lock; and we never hold either
+ * of them during TLS or socket I/O.
+ **/
+
+#define ORSHARD_PRIVATE
+#include "core/or/or.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
+#include "core/mainloop/orshard.h"
+#include "core/or/connection_or.h"
+#include "lib/buf/buffers.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/net/alertsock.h"
+#include "lib/thread/threads.h"
+#include "lib/tls/tortls.h"
+
+#include "core/or/or_connection_st.h"
+
+#include <event2/event.h>
+
+/** One side of the plaintext stream of a sharded connection: a ring of
+ * ORSHARD_RING_SIZE bytes.  Only one thread adds data to a ring, and only
+ * one thread removes it.  The indices are protected by the shard's lock;
+ * the bytes between them belong to whichever thread may remove them, and
+ * the rest to whichever thread may add. */
+typedef struct orshard_ring_t {
+  char *mem;
+  /** Total number of bytes ever removed from this ring. */
+  size_t head;
+  /** Total number of bytes ever added to this ring. */
+  size_t tail;
+} orshard_ring_t;
+
+/** A worker thread, running its own event loop, that does the TLS and
+ * socket I/O for some of our OR connections. */
+struct orshard_t {
+  /** Index of this shard, for logging. */
+  int idx;
+  /** Lock protecting the fields below it, and the shared fields of every
+   * orshard_conn_t on this shard. */
+  tor_mutex_t lock;
+  /** Signalled when the shard gives back a connection, or exits. */
+  tor_cond_t cond;
+  /** Connections whose state the main thread has changed since the shard
+   * last looked at them. */
+  smartlist_t *incoming;
+  /** True iff the main thread wants this shard to exit. */
+  unsigned int should_exit:1;
+  /** True iff this shard's thread has exited. */
+  unsigned int exited:1;
+
+  /** Used to wake this shard's event loop. */
+  alert_sockets_t alert;
+
+  /* These fields are only touched by the shard's thread (or, while the
+   * thread isn't running, by the main thread). */
+  /** This shard's event loop. */
+  struct event_base *base;
+  /** Event for the read end of <b>alert</b>. */
+  struct event *alert_ev;
+  /** Every connection that this shard owns. */
+  smartlist_t *conns;
+  /** Scratch list of connections to look at. */
+  smartlist_t *todo;
+
+  /** Number of connections assigned to this shard.  Main thread only. */
+  int n_conns;
+};
+
+/** The state we keep for each connection that a shard is handling. */
+struct orshard_conn_t {
+  /** The shard that owns this connection. */
+  orshard_t *shard;
+  /** The connection's socket. */
+  tor_socket_t s;
+  /** How we read from and write to the connection. */
+  const orshard_io_t *io;
+  void *io_arg;
+
+  /* Fields that only the shard's thread touches. */
+  /** Events for the socket becoming readable and writable. */
+  struct event *read_ev;
+  struct event *write_ev;
+  unsigned int read_ev_added:1;
+  unsigned int write_ev_added:1;
+  /** True iff our last read needs the socket to be writable. */
+  unsigned int read_wants_write:1;
+  /** True iff our last write needs the socket to be readable. */
+  unsigned int write_wants_read:1;
+
+  /* Fields protected by the shard's lock. */
+  /** Plaintext that we've read, for the main thread. */
+  orshard_ring_t in;
+  /** Plaintext from the main thread, for us to write. */
+  orshard_ring_t out;
+  /** Number of bytes read from and written to the network since the main
+   * thread last asked. */
+  size_t n_raw_read;
+  size_t n_raw_written;
+  /** If nonzero, the TOR_TLS_* error or close that stopped our I/O. */
+  int error;
+  /** True iff the main thread wants us to read. */
+  unsigned int reading:1;
+  /** True iff we stopped reading because <b>in</b> was full. */
+  unsigned int in_full:1;
+  /** True iff the main thread had more to write than would fit in
+   * <b>out</b>. */
+  unsigned int main_wants_room:1;
+  /** True iff we're on our shard's incoming list. */
+  unsigned int on_incoming:1;
+  /** True iff the main thread wants to take this connection back. */
+  unsigned int detach_requested:1;
+  /** True iff the shard has let go of this connection. */
+  unsigned int detached:1;
+
+  /* Fields protected by main_lock. */
+  /** True iff we're on main_ready_lst. */
+  unsigned int main_queued:1;
+  /** True iff the main thread should run our read handler. */
+  unsigned int main_readable:1;
+  /** True iff the main thread should run our write handler. */
+  unsigned int main_writable:1;
+  /** True iff the shard has let go of this connection, and the main thread
+   * should take it back. */
+  unsigned int main_detached:1;
+
+  /* Fields that only the main thread touches. */
+  /** The connection that we're handling I/O for. */
+  connection_t *conn;
+  /** True iff the connection wants to read; our answer to
+   * connection_is_reading(). */
+  unsigned int main_reading:1;
+  /** True iff the connection wants to write; our answer to
+   * connection_is_writing(). */
+  unsigned int main_writing:1;
+  /** True iff we're on main_todo_lst. */
+  unsigned int on_todo:1;
+  /** True iff the main thread should run our read handler. */
+  unsigned int todo_readable:1;
+  /** True iff the main thread should run our write handler. */
+  unsigned int todo_writable:1;
+  /** True iff the main thread should take this connection back. */
+  unsigned int todo_detached:1;
+  /** True iff we've asked the shard to let go of this connection. */
+  unsigned int detaching:1;
+  /** True iff we should close <b>s</b> once the shard lets go of it. */
+  unsigned int close_socket:1;
+};
+
+/** All of our shards, or NULL if we aren't sharding connections. */
+static smartlist_t *shards = NULL;
+/** Lock protecting main_ready_lst, and the main_queued, main_readable and
+ * main_writable fields of every orshard_conn_t. */
+static tor_mutex_t *main_lock = NULL;
+/** Connections that a shard has queued for the main thread's attention. */
+static smartlist_t *main_ready_lst = NULL;
+/** Used by the shards to wake the main thread. */
+static alert_sockets_t main_alert;
+/** Event for the read end of main_alert. */
+static struct event *main_alert_ev = NULL;
+/** Connections that the main thread will run handlers on next.  Main
+ * thread only. */
+static smartlist_t *main_todo_lst = NULL;
+/** Event to process main_todo_lst, when the main thread itself has added
+ * to it. */
+static mainloop_event_t *main_todo_ev = NULL;
+
+/** Mask to turn a ring index into an offset into its memory. */
+#define RING_MASK (ORSHARD_RING_SIZE - 1)
+
+/** Return the number of bytes of data in <b>ring</b>. */
+static inline size_t
+ring_datalen(const orshard_ring_t *ring)
+{
+  return ring->tail - ring->head;
+}
+
+/** Set *<b>ptr_out</b> to the first byte of data in <b>ring</b>, and return
+ * the number of bytes of data that follow it contiguously. */
+static inline size_t
+ring_peek(const orshard_ring_t *ring, char **ptr_out)
+{
+  size_t offset = ring->head & RING_MASK;
+  size_t n = ring_datalen(ring);
+  if (n > ORSHARD_RING_SIZE - offset)
+    n = ORSHARD_RING_SIZE - offset;
+  *ptr_out = ring->mem + offset;
+  return n;
+}
+
+/** Set *<b>ptr_out</b> to the first free byte in <b>ring</b>, and return
+ * the number of free bytes that follow it contiguously. */
+static inline size_t
+ring_reserve(const orshard_ring_t *ring, char **ptr_out)
+{
+  size_t offset = ring->tail & RING_MASK;
+  size_t n = ORSHARD_RING_SIZE - ring_datalen(ring);
+  if (n > ORSHARD_RING_SIZE - offset)
+    n = ORSHARD_RING_SIZE - offset;
+  *ptr_out = ring->mem + offset;
+  return n;
+}
+
+/** Move up to <b>n</b> bytes from <b>ring</b> onto the end of <b>buf</b>.
+ * Return the number of bytes moved. */
+static size_t
+ring_move_to_buf(orshard_ring_t *ring, buf_t *buf, size_t n)
+{
+  size_t moved = 0;
+  while (moved < n) {
+    char *ptr;
+    size_t k = ring_peek(ring, &ptr);
+    if (k == 0)
+      break;
+    if (k > n - moved)
+      k = n - moved;
+    buf_add(buf, ptr, k);
+    ring->head += k;
+    moved += k;
+  }
+  return moved;
+}
+
+/** Move up to <b>n</b> bytes from the front of <b>buf</b> into
+ * <b>ring</b>.  Return the number of bytes moved. */
+static size_t
+ring_move_from_buf(orshard_ring_t *ring, buf_t *buf, size_t n)
+{
+  size_t moved = 0;
+  if (n > buf_datalen(buf))
+    n = buf_datalen(buf);
+  while (moved < n) {
+    char *ptr;
+    size_t k = ring_reserve(ring, &ptr);
+    if (k == 0)
+      break;
+    if (k > n - moved)
+      k = n - moved;
+    buf_get_bytes(buf, ptr, k);
+    ring->tail += k;
+    moved += k;
+  }
+  return moved;
+}
+
+/* ==== Running the TLS of a connection. */
+
+/** Implements orshard_io_t.read for a tor_tls_t. */
+static int
+orshard_tls_read(void *arg, char *out, size_t n)
+{
+  return tor_tls_read(arg, out, n);
+}
+
+/** Implements orshard_io_t.write for a tor_tls_t. */
+static int
+orshard_tls_write(void *arg, const char *data, size_t n)
+{
+  return tor_tls_write(arg, data, n);
+}
+
+/** Implements orshard_io_t.get_n_raw_bytes for a tor_tls_t. */
+static void
+orshard_tls_get_n_raw_bytes(void *arg, size_t *n_read, size_t *n_written)
+{
+  tor_tls_get_n_raw_bytes(arg, n_read, n_written);
+}
+
+/** How a shard does I/O on an OR connection. */
+const orshard_io_t orshard_tls_io = {
+  orshard_tls_read,
+  orshard_tls_write,
+  orshard_tls_get_n_raw_bytes,
+};
+
+/* ==== Shard-side code. */
+
+/** Ask the shard that owns <b>sc</b> to look at it soon.  The shard's lock
+ * must be held. */
+static void
+orshard_conn_poke(orshard_conn_t *sc)
+{
+  orshard_t *shard = sc->shard;
+  /* Once the main thread has asked for a connection back, the shard is
+   * going to let go of it: it must not look at it again after that. */
+  if (sc->on_incoming || sc->detach_requested)
+    return;
+  sc->on_incoming = 1;
+  smartlist_add(shard->incoming, sc);
+  /* The shard drains its alert socket before it takes the incoming list,
+   * so we only need to wake it for the first entry. */
+  if (smartlist_len(shard->incoming) == 1)
+    shard->alert.alert_fn(shard->alert.write_fd);
+}
+
+/** Called from a shard: ask the main thread to run the read handler (if
+ * <b>readable</b>) and the write handler (if <b>writable</b>) on the
+ * connection of <b>sc</b>, or to take it back (if <b>detached</b>). */
+static void
+orshard_conn_notify_main(orshard_conn_t *sc, int readable, int writable,
+                         int detached)
+{
+  tor_mutex_acquire(main_lock);
+  if (readable)
+    sc->main_readable = 1;
+  if (writable)
+    sc->main_writable = 1;
+  if (detached)
+    sc->main_detached = 1;
+  if (!sc->main_queued) {
+    sc->main_queued = 1;
+    smartlist_add(main_ready_lst, sc);
+    if (smartlist_len(main_ready_lst) == 1)
+      main_alert.alert_fn(main_alert.write_fd);
+  }
+  tor_mutex_release(main_lock);
+}
+
+/** Called from a shard: read from the connection of <b>sc</b> into its
+ * <b>in</b> ring, for as long as there is data and room for it.  Return
+ * true iff the main thread should hear about what happened. */
+static int
+orshard_conn_do_read(orshard_conn_t *sc)
+{
+  tor_mutex_t *lock = &sc->shard->lock;
+  int notify = 0;
+
+  sc->read_wants_write = 0;
+  for (;;) {
+    char *ptr;
+    size_t n;
+    int r;
+
+    tor_mutex_acquire(lock);
+    if (!sc->reading || sc->error) {
+      tor_mutex_release(lock);
+      break;
+    }
+    n = ring_reserve(&sc->in, &ptr);
+    if (n == 0) {
+      sc->in_full = 1;
+      tor_mutex_release(lock);
+      break;
+    }
+    tor_mutex_release(lock);
+
+    r = sc->io->read(sc->io_arg, ptr, n);
+    if (r > 0) {
+      tor_mutex_acquire(lock);
+      sc->in.tail += r;
+      tor_mutex_release(lock);
+      notify = 1;
+      continue;
+    }
+    if (r == TOR_TLS_WANTREAD)
+      break;
+    if (r == TOR_TLS_WANTWRITE) {
+      sc->read_wants_write = 1;
+      break;
+    }
+    tor_mutex_acquire(lock);
+    sc->error = r ? r : TOR_TLS_CLOSE;
+    tor_mutex_release(lock);
+    notify = 1;
+    break;
+  }
+  return notify;
+}
+
+/** Called from a shard: write the contents of the <b>out</b> ring of
+ * <b>sc</b> to its connection, for as long as the connection will take
+ * it.  Return true iff the main thread should hear about what happened. */
+static int
+orshard_conn_do_write(orshard_conn_t *sc)
+{
+  tor_mutex_t *lock = &sc->shard->lock;
+  int notify = 0;
+
+  sc->write_wants_read = 0;
+  for (;;) {
+    char *ptr;
+    size_t n;
+    int r;
+
+    tor_mutex_acquire(lock);
+    if (sc->error) {
+      tor_mutex_release(lock);
+      break;
+    }
+    /* If the last write blocked, this is the same data as before, and at
+     * least as long: that's just what the TLS library needs from us. */
+    n = ring_peek(&sc->out, &ptr);
+    tor_mutex_release(lock);
+    if (n == 0)
+      break;
+
+    r = sc->io->write(sc->io_arg, ptr, n);
+    if (r > 0) {
+      tor_mutex_acquire(lock);
+      sc->out.head += r;
+      if (sc->main_wants_room &&
+          ring_datalen(&sc->out) <= ORSHARD_RING_SIZE / 2) {
+        sc->main_wants_room = 0;
+        notify = 1;
+      }
+      tor_mutex_release(lock);
+      continue;
+    }
+    if (r == TOR_TLS_WANTWRITE || r == TOR_TLS_DONE)
+      break;
+    if (r == TOR_TLS_WANTREAD) {
+      sc->write_wants_read = 1;
+      break;
+    }
+    tor_mutex_acquire(lock);
+    sc->error = r;
+    tor_mutex_release(lock);
+    notify = 1;
+    break;
+  }
+  return notify;
+}
+
+/** Called from a shard: add or remove the events of <b>sc</b> so that we
+ * hear about exactly the socket events in <b>want_read</b> and
+ * <b>want_write</b>. */
+static void
+orshard_conn_set_events(orshard_conn_t *sc, int want_read, int want_write)
+{
+  if (want_read && !sc->read_ev_added) {
+    event_add(sc->read_ev, NULL);
+    sc->read_ev_added = 1;
+  } else if (!want_read && sc->read_ev_added) {
+    event_del(sc->read_ev);
+    sc->read_ev_added = 0;
+  }
+  if (want_write && !sc->write_ev_added) {
+    event_add(sc->write_ev, NULL);
+    sc->write_ev_added = 1;
+  } else if (!want_write && sc->write_ev_added) {
+    event_del(sc->write_ev);
+    sc->write_ev_added = 0;
+  }
+}
+
+/** Called from a shard: do all the I/O that we can on <b>sc</b>, then wait
+ * for the socket events that we need for more, and tell the main thread
+ * if it has anything to do. */
+static void
+orshard_conn_run(orshard_conn_t *sc)
+{
+  int notify_read, notify_write, want_read, want_write;
+  size_t n_read = 0, n_written = 0;
+
+  notify_read = orshard_conn_do_read(sc);
+  notify_write = orshard_conn_do_write(sc);
+  sc->io->get_n_raw_bytes(sc->io_arg, &n_read, &n_written);
+
+  tor_mutex_acquire(&sc->shard->lock);
+  sc->n_raw_read += n_read;
+  sc->n_raw_written += n_written;
+  if (sc->error) {
+    /* Both handlers should find out. */
+    notify_read = notify_write = (notify_read || notify_write);
+    want_read = want_write = 0;
+  } else {
+    want_read = sc->write_wants_read || (sc->reading && !sc->in_full);
+    want_write = sc->read_wants_write || ring_datalen(&sc->out) > 0;
+  }
+  tor_mutex_release(&sc->shard->lock);
+
+  orshard_conn_set_events(sc, want_read, want_write);
+  if (notify_read || notify_write)
+    orshard_conn_notify_main(sc, notify_read, notify_write, 0);
+}
+
+/** Libevent callback, in a shard: the socket of (orshard_conn_t*)
+ * <b>arg</b> is readable or writable. */
+static void
+orshard_conn_event_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void) fd;
+  (void) events;
+  orshard_conn_run(arg);
+}
+
+/** Called from a shard: let go of <b>sc</b>, and tell the main thread that
+ * it may have it back. */
+static void
+orshard_conn_stop(orshard_conn_t *sc)
+{
+  orshard_t *shard = sc->shard;
+
+  tor_event_free(sc->read_ev);
+  tor_event_free(sc->write_ev);
+  sc->read_ev_added = sc->write_ev_added = 0;
+  smartlist_remove(shard->conns, sc);
+
+  tor_mutex_acquire(&shard->lock);
+  if (sc->on_incoming) {
+    smartlist_remove(shard->incoming, sc);
+    sc->on_incoming = 0;
+  }
+  sc->detached = 1;
+  /* We tell the main thread while we still hold our lock, since a thread
+   * waiting on our condition may free sc as soon as we release it. */
+  orshard_conn_notify_main(sc, 0, 0, 1);
+  tor_cond_signal_all(&shard->cond);
+  tor_mutex_release(&shard->lock);
+  /* The main thread may free sc at any time now. */
+}
+
+/** Called from a shard: act on whatever the main thread has changed about
+ * <b>sc</b>. */
+static void
+orshard_conn_update(orshard_conn_t *sc)
+{
+  orshard_t *shard = sc->shard;
+  int detach;
+
+  tor_mutex_acquire(&shard->lock);
+  detach = sc->detach_requested;
+  tor_mutex_release(&shard->lock);
+
+  if (detach) {
+    orshard_conn_stop(sc);
+    return;
+  }
+
+  if (!sc->read_ev) {
+    /* This is a new connection for us. */
+    sc->read_ev = tor_event_new(shard->base, sc->s, EV_READ|EV_PERSIST,
+                                orshard_conn_event_cb, sc);
+    sc->write_ev = tor_event_new(shard->base, sc->s, EV_WRITE|EV_PERSIST,
+                                 orshard_conn_event_cb, sc);
+    smartlist_add(shard->conns, sc);
+    if (!sc->read_ev || !sc->write_ev) {
+      /* LCOV_EXCL_START */
+      tor_event_free(sc->read_ev);
+      tor_event_free(sc->write_ev);
+      tor_mutex_acquire(&shard->lock);
+      sc->error = TOR_TLS_ERROR_MISC;
+      tor_mutex_release(&shard->lock);
+      orshard_conn_notify_main(sc, 1, 1, 0);
+      return;
+      /* LCOV_EXCL_STOP */
+    }
+  }
+  /* The TLS object may have data for us even if the socket has none, so
+   * always try reading here. */
+  if (sc->read_ev)
+    orshard_conn_run(sc);
+}
+
+/** Libevent callback, in a shard: the main thread has asked for our
+ * attention. */
+static void
+orshard_alert_cb(evutil_socket_t fd, short events, void *arg)
+{
+  orshard_t *shard = arg;
+  int should_exit;
+  (void) fd;
+  (void) events;
+
+  shard->alert.drain_fn(shard->alert.read_fd);
+
+  tor_mutex_acquire(&shard->lock);
+  smartlist_add_all(shard->todo, shard->incoming);
+  smartlist_clear(shard->incoming);
+  SMARTLIST_FOREACH(shard->todo, orshard_conn_t *, sc, sc->on_incoming = 0);
+  should_exit = shard->should_exit;
+  tor_mutex_release(&shard->lock);
+
+  SMARTLIST_FOREACH(shard->todo, orshard_conn_t *, sc,
+                    orshard_conn_update(sc));
+  smartlist_clear(shard->todo);
+
+  if (should_exit)
+    event_base_loopbreak(shard->base);
+}
+
+/** Main function for the thread of (orshard_t *)<b>arg</b>. */
+static void
+orshard_thread_main(void *arg)
+{
+  orshard_t *shard = arg;
+
+  event_base_loop(shard->base, 0);
+
+  tor_mutex_acquire(&shard->lock);
+  shard->exited = 1;
+  tor_cond_signal_all(&shard->cond);
+  tor_mutex_release(&shard->lock);
+}
+
+/* ==== Main-thread code. */
+
+/** Release all storage held by <b>shard</b>, whose thread must not be
+ * running. */
+static void
+orshard_free_storage(orshard_t *shard)
+{
+  tor_event_free(shard->alert_ev);
+  if (shard->base)
+    event_base_free(shard->base);
+  alert_sockets_close(&shard->alert);
+  smartlist_free(shard->incoming);
+  smartlist_free(shard->conns);
+  smartlist_free(shard->todo);
+  tor_cond_uninit(&shard->cond);
+  tor_mutex_uninit(&shard->lock);
+  tor_free(shard);
+}
+
+/** Create a new shard, with index <b>idx</b>, and start its thread.
+ * Return NULL on failure. */
+static orshard_t *
+orshard_new(int idx)
+{
+  orshard_t *shard = tor_malloc_zero(sizeof(orshard_t));
+  struct event_config *cfg;
+
+  shard->idx = idx;
+  tor_mutex_init_nonrecursive(&shard->lock);
+  tor_cond_init(&shard->cond);
+  shard->incoming = smartlist_new();
+  shard->conns = smartlist_new();
+  shard->todo = smartlist_new();
+  shard->alert.read_fd = shard->alert.write_fd = TOR_INVALID_SOCKET;
+
+  if (alert_sockets_create(&shard->alert, 0) < 0)
+    goto err;
+
+  /* Only the shard's thread will use this base, so it needs no locking. */
+  cfg = event_config_new();
+  event_config_set_flag(cfg, EVENT_BASE_FLAG_NOLOCK);
+  event_config_set_flag(cfg, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+  shard->base = event_base_new_with_config(cfg);
+  event_config_free(cfg);
+  if (!shard->base)
+    goto err;
+
+  shard->alert_ev = tor_event_new(shard->base, shard->alert.read_fd,
+                                  EV_READ|EV_PERSIST, orshard_alert_cb,
+                                  shard);
+  if (!shard->alert_ev || event_add(shard->alert_ev, NULL) < 0)
+    goto err;
+
+  if (spawn_func(orshard_thread_main, shard) < 0)
+    goto err;
+
+  return shard;
+ err:
+  orshard_free_storage(shard);
+  return NULL;
+}
+
+/** Stop the thread of <b>shard</b>, and free it.  The shard must not own
+ * any connections. */
+static void
+orshard_free_(orshard_t *shard)
+{
+  if (!shard)
+    return;
+  tor_assert(shard->n_conns == 0);
+
+  tor_mutex_acquire(&shard->lock);
+  shard->should_exit = 1;
+  shard->alert.alert_fn(shard->alert.write_fd);
+  while (!shard->exited)
+    tor_cond_wait(&shard->cond, &shard->lock, NULL);
+  tor_mutex_release(&shard->lock);
+
+  orshard_free_storage(shard);
+}
+#define orshard_free(shard) \
+  FREE_AND_NULL(orshard_t, orshard_free_, (shard))
+
+static void orshard_conn_give_back(orshard_conn_t *sc);
+
+/** Run the read and write handlers that the shards, or the main thread
+ * itself, have asked for, and take back the connections that shards have
+ * let go of. */
+STATIC void
+orshard_process_main_queue(void)
+{
+  orshard_conn_t *sc;
+
+  tor_mutex_acquire(main_lock);
+  SMARTLIST_FOREACH_BEGIN(main_ready_lst, orshard_conn_t *, ready) {
+    ready->main_queued = 0;
+    ready->todo_readable |= ready->main_readable;
+    ready->todo_writable |= ready->main_writable;
+    ready->todo_detached |= ready->main_detached;
+    ready->main_readable = ready->main_writable = ready->main_detached = 0;
+    if (!ready->on_todo) {
+      ready->on_todo = 1;
+      smartlist_add(main_todo_lst, ready);
+    }
+  } SMARTLIST_FOREACH_END(ready);
+  smartlist_clear(main_ready_lst);
+  tor_mutex_release(main_lock);
+
+  /* A handler can close other connections, which takes them off this
+   * list: so we pop each entry before we handle it. */
+  while ((sc = smartlist_pop_last(main_todo_lst))) {
+    int readable = sc->todo_readable && sc->main_reading && !sc->detaching;
+    int writable = sc->todo_writable && sc->main_writing && !sc->detaching;
+    sc->on_todo = sc->todo_readable = sc->todo_writable = 0;
+    if (sc->todo_detached) {
+      sc->todo_detached = 0;
+      orshard_conn_give_back(sc);
+    } else if (readable || writable) {
+      connection_handle_io_ready(sc->conn, readable, writable);
+    }
+  }
+}
+
+/** Libevent callback: a shard has woken the main thread. */
+static void
+orshard_main_alert_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void) fd;
+  (void) events;
+  (void) arg;
+  main_alert.drain_fn(main_alert.read_fd);
+  orshard_process_main_queue();
+}
+
+/** Mainloop callback: the main thread has added to main_todo_lst. */
+static void
+orshard_main_todo_cb(mainloop_event_t *ev, void *arg)
+{
+  (void) ev;
+  (void) arg;
+  orshard_process_main_queue();
+}
+
+/** Ask the main thread to run the read handler (if <b>readable</b>) and the
+ * write handler (if <b>writable</b>) of <b>sc</b> soon. */
+static void
+orshard_conn_queue_main(orshard_conn_t *sc, int readable, int writable)
+{
+  if (readable)
+    sc->todo_readable = 1;
+  if (writable)
+    sc->todo_writable = 1;
+  if (!sc->on_todo) {
+    sc->on_todo = 1;
+    smartlist_add(main_todo_lst, sc);
+  }
+  mainloop_event_activate(main_todo_ev);
+}
+
+/** Release the state that the main thread uses to hear from shards. */
+static void
+orshard_main_state_free(void)
+{
+  tor_event_free(main_alert_ev);
+  alert_sockets_close(&main_alert);
+  mainloop_event_free(main_todo_ev);
+  smartlist_free(main_ready_lst);
+  smartlist_free(main_todo_lst);
+  tor_mutex_free(main_lock);
+}
+
+/** Set up the state that the main thread uses to hear from shards.  Return
+ * 0 on success, -1 on failure. */
+static int
+orshard_main_state_init(void)
+{
+  main_lock = tor_mutex_new_nonrecursive();
+  main_ready_lst = smartlist_new();
+  main_todo_lst = smartlist_new();
+  main_todo_ev = mainloop_event_new(orshard_main_todo_cb, NULL);
+  mainloop_event_set_name(main_todo_ev, "orshard/main-todo");
+  if (alert_sockets_create(&main_alert, 0) < 0) {
+    main_alert.read_fd = main_alert.write_fd = TOR_INVALID_SOCKET;
+    orshard_main_state_free();
+    return -1;
+  }
+  main_alert_ev = tor_event_new(tor_libevent_get_base(), main_alert.read_fd,
+                                EV_READ|EV_PERSIST, orshard_main_alert_cb,
+                                NULL);
+  if (!main_alert_ev || event_add(main_alert_ev, NULL) < 0) {
+    orshard_main_state_free();
+    return -1;
+  }
+  return 0;
+}
+
+/** Return the number of threads that are running OR connection I/O. */
+int
+orshard_get_n_threads(void)
+{
+  return shards ? smartlist_len(shards) : 0;
+}
+
+/** Return the shard with index <b>idx</b>, or NULL if there is none. */
+orshard_t *
+orshard_get_shard(int idx)
+{
+  if (!shards || idx < 0 || idx >= smartlist_len(shards))
+    return NULL;
+  return smartlist_get(shards, idx);
+}
+
+/** Start running the I/O of OR connections on <b>n_threads</b> worker
+ * threads, or stop running it on worker threads if <b>n_threads</b> is 0.
+ * Connections that shards own now go back to the main thread, and then all
+ * eligible connections go to the new shards. */
+void
+orshard_set_n_threads(int n_threads)
+{
+  int i, had_shards = (shards != NULL);
+
+  if (n_threads < 0)
+    n_threads = 0;
+  if (n_threads == orshard_get_n_threads())
+    return;
+
+  if (shards) {
+    SMARTLIST_FOREACH(get_connection_array(), connection_t *, conn,
+                      orshard_detach_conn(conn));
+    SMARTLIST_FOREACH(shards, orshard_t *, shard, orshard_free(shard));
+    smartlist_free(shards);
+    orshard_main_state_free();
+  }
+
+  if (n_threads == 0) {
+    if (had_shards)
+      log_notice(LD_NET, "Running all OR connection I/O on the main thread "
+                 "again.");
+    return;
+  }
+
+  if (orshard_main_state_init() < 0) {
+    log_warn(LD_NET, "Unable to set up alert sockets for ORConnThreads; "
+             "running all OR connection I/O on the main thread.");
+    return;
+  }
+  shards = smartlist_new();
+  for (i = 0; i < n_threads; ++i) {
+    orshard_t *shard = orshard_new(i);
+    if (!shard) {
+      log_warn(LD_NET, "Unable to start thread %d of %d for OR connection "
+               "I/O.", i + 1, n_threads);
+      break;
+    }
+    smartlist_add(shards, shard);
+  }
+  if (smartlist_len(shards) == 0) {
+    smartlist_free(shards);
+    orshard_main_state_free();
+    return;
+  }
+  log_notice(LD_NET, "Running the TLS of open OR connections on %d "
+             "thread%s.", smartlist_len(shards),
+             smartlist_len(shards) == 1 ? "" : "s");
+
+  SMARTLIST_FOREACH(get_connection_array(), connection_t *, conn,
+                    if (conn->type == CONN_TYPE_OR)
+                      orshard_attach_conn(TO_OR_CONN(conn)));
+}
+
+/** Stop all of our shards, and release everything they hold. */
+void
+orshard_free_all(void)
+{
+  orshard_set_n_threads(0);
+}
+
+/** Create the state for a connection on the socket <b>s</b>, for which
+ * <b>shard</b> will do I/O using <b>io</b> and <b>io_arg</b>, and hand it
+ * to the shard.  <b>conn</b> is the connection that will hear about
+ * progress. */
+orshard_conn_t *
+orshard_conn_new(orshard_t *shard, tor_socket_t s, const orshard_io_t *io,
+                 void *io_arg, connection_t *conn)
+{
+  orshard_conn_t *sc = tor_malloc_zero(sizeof(orshard_conn_t));
+  sc->shard = shard;
+  sc->s = s;
+  sc->io = io;
+  sc->io_arg = io_arg;
+  sc->conn = conn;
+  sc->in.mem = tor_malloc(ORSHARD_RING_SIZE);
+  sc->out.mem = tor_malloc(ORSHARD_RING_SIZE);
+  ++shard->n_conns;
+
+  tor_mutex_acquire(&shard->lock);
+  orshard_conn_poke(sc);
+  tor_mutex_release(&shard->lock);
+  return sc;
+}
+
+/** Ask the shard of <b>sc</b> to let go of it, if we haven't already.  The
+ * shard will queue <b>sc</b> for the main thread once it has. */
+static void
+orshard_conn_request_detach(orshard_conn_t *sc)
+{
+  orshard_t *shard = sc->shard;
+
+  if (sc->detaching)
+    return;
+  sc->detaching = 1;
+
+  tor_mutex_acquire(&shard->lock);
+  orshard_conn_poke(sc);
+  sc->detach_requested = 1;
+  tor_mutex_release(&shard->lock);
+}
+
+/** Wait until the shard of <b>sc</b> has let go of it.  We must already
+ * have asked it to. */
+static void
+orshard_conn_wait_detached(orshard_conn_t *sc)
+{
+  orshard_t *shard = sc->shard;
+
+  tor_mutex_acquire(&shard->lock);
+  while (!sc->detached)
+    tor_cond_wait(&shard->cond, &shard->lock, NULL);
+  tor_mutex_release(&shard->lock);
+}
+
+/** Having seen the shard of <b>sc</b> let go of it, append any data that
+ * the shard has read to <b>inbuf</b>, and any data that it has not yet
+ * written to <b>unsent</b>, and forget about <b>sc</b> everywhere but in
+ * the connection. */
+static void
+orshard_conn_reclaim(orshard_conn_t *sc, buf_t *inbuf, buf_t *unsent)
+{
+  orshard_t *shard = sc->shard;
+
+  tor_mutex_acquire(&shard->lock);
+  tor_assert(sc->detached);
+  ring_move_to_buf(&sc->in, inbuf, ring_datalen(&sc->in));
+  ring_move_to_buf(&sc->out, unsent, ring_datalen(&sc->out));
+  tor_mutex_release(&shard->lock);
+
+  tor_mutex_acquire(main_lock);
+  if (sc->main_queued) {
+    smartlist_remove(main_ready_lst, sc);
+    sc->main_queued = 0;
+  }
+  tor_mutex_release(main_lock);
+  if (sc->on_todo) {
+    smartlist_remove(main_todo_lst, sc);
+    sc->on_todo = 0;
+  }
+  --shard->n_conns;
+}
+
+/** Take <b>sc</b> back from its shard, waiting until the shard lets go.
+ * Append any data that the shard has read to <b>inbuf</b>, and any data
+ * that it has not yet written to <b>unsent</b>. */
+void
+orshard_conn_release(orshard_conn_t *sc, buf_t *inbuf, buf_t *unsent)
+{
+  orshard_conn_request_detach(sc);
+  orshard_conn_wait_detached(sc);
+  orshard_conn_reclaim(sc, inbuf, unsent);
+}
+
+/** Release all storage held by <b>sc</b>, which no shard may own. */
+void
+orshard_conn_free_(orshard_conn_t *sc)
+{
+  if (!sc)
+    return;
+  tor_free(sc->in.mem);
+  tor_free(sc->out.mem);
+  tor_free(sc);
+}
+
+/** Return the shard state of <b>conn</b>, or NULL if no shard is doing
+ * its I/O. */
+orshard_conn_t *
+orshard_conn_get(const connection_t *conn)
+{
+  if (!shards || conn->type != CONN_TYPE_OR)
+    return NULL;
+  return CONST_TO_OR_CONN(conn)->shard_conn;
+}
+
+/** If we are sharding OR connections, and <b>conn</b> is one that a shard
+ * can handle, hand its TLS and socket I/O over to the least busy shard,
+ * and return 1.  Otherwise return 0. */
+int
+orshard_attach_conn(or_connection_t *or_conn)
+{
+  connection_t *conn = TO_CONN(or_conn);
+  orshard_t *best = NULL;
+  orshard_conn_t *sc;
+  int was_reading, was_writing;
+
+  if (!shards || or_conn->shard_conn)
+    return 0;
+  /* Before link protocol 3, we might need to renegotiate; and our TLS code
+   * handles renegotiation on the main thread. */
+  if (conn->state != OR_CONN_STATE_OPEN || or_conn->link_proto < 3 ||
+      !or_conn->tls || conn->linked || conn->marked_for_close ||
+      !SOCKET_OK(conn->s) || !conn->read_event || !conn->write_event)
+    return 0;
+
+  SMARTLIST_FOREACH(shards, orshard_t *, shard,
+                    if (!best || shard->n_conns < best->n_conns)
+                      best = shard);
+  if (BUG(!best))
+    return 0;
+
+  was_reading = connection_is_reading(conn);
+  was_writing = connection_is_writing(conn);
+  connection_stop_reading(conn);
+  connection_stop_writing(conn);
+
+  sc = orshard_conn_new(best, conn->s, &orshard_tls_io, or_conn->tls, conn);
+  or_conn->shard_conn = sc;
+  if (was_reading)
+    orshard_conn_set_reading(sc, 1);
+  if (was_writing)
+    orshard_conn_set_writing(sc, 1);
+
+  log_debug(LD_NET, "Handing I/O for %s to shard %d.",
+            connection_describe(conn), best->idx);
+  return 1;
+}
+
+/** Called from the main thread once the shard of <b>sc</b> has let go of
+ * it: give the connection of <b>sc</b> any plaintext still in flight, set
+ * up its Libevent events as it wants them, and free <b>sc</b>. */
+static void
+orshard_conn_give_back(orshard_conn_t *sc)
+{
+  connection_t *conn = sc->conn;
+  buf_t *unsent = buf_new();
+  size_t inbuf_len = conn->inbuf ? buf_datalen(conn->inbuf) : 0;
+
+  orshard_conn_reclaim(sc, conn->inbuf ? conn->inbuf : unsent, unsent);
+  TO_OR_CONN(conn)->shard_conn = NULL;
+
+  if (sc->close_socket) {
+    /* connection_close_immediate() has already thrown away the outbuf, and
+     * the rest of Tor thinks this socket is closed. */
+    tor_close_socket(sc->s);
+    buf_free(unsent);
+  } else if (conn->outbuf && buf_datalen(unsent)) {
+    /* The shard's bytes go first. */
+    buf_move_all(unsent, conn->outbuf);
+    buf_free(conn->outbuf);
+    conn->outbuf = unsent;
+  } else {
+    buf_free(unsent);
+  }
+
+  if (sc->main_reading && conn->read_event)
+    connection_start_reading(conn);
+  if ((sc->main_writing || (conn->outbuf && buf_datalen(conn->outbuf))) &&
+      conn->write_event)
+    connection_start_writing(conn);
+  if (conn->inbuf && buf_datalen(conn->inbuf) > inbuf_len &&
+      conn->read_event && !conn->marked_for_close) {
+    /* The socket may have nothing new for us: make sure we look at what
+     * the shard gave back anyway. */
+    event_active(conn->read_event, EV_READ, 1);
+  }
+  /* conn_close_if_marked() has been waiting for us. */
+  if (conn->marked_for_close)
+    mainloop_schedule_postloop_cleanup();
+
+  log_debug(LD_NET, "Took I/O for %s back from shard %d.",
+            connection_describe(conn), sc->shard->idx);
+  orshard_conn_free(sc);
+}
+
+/** If a shard is doing the I/O of <b>conn</b>, ask it to give the
+ * connection back to the main thread, without waiting for it: once it has,
+ * orshard_process_main_queue() puts any plaintext in flight back in the
+ * connection's buffers, and sets up its Libevent events as the connection
+ * wants them.  Until then, <b>conn</b> must not be freed, and its handlers
+ * don't run.
+ *
+ * If <b>close_socket</b> is true, take the socket away from <b>conn</b>
+ * now, and close it as soon as the shard has let go of it.
+ *
+ * Return 1 if a shard still has <b>conn</b>, and 0 otherwise. */
+int
+orshard_start_detach_conn(connection_t *conn, int close_socket)
+{
+  orshard_conn_t *sc = orshard_conn_get(conn);
+
+  if (!sc)
+    return 0;
+  if (close_socket && !sc->close_socket) {
+    sc->close_socket = 1;
+    conn->s = TOR_INVALID_SOCKET;
+  }
+  orshard_conn_request_detach(sc);
+  return 1;
+}
+
+/** If a shard is doing the I/O of <b>conn</b>, take it back to the main
+ * thread now, waiting for the shard to let go of it.  Any plaintext in
+ * flight goes back to the connection's buffers, and its Libevent events are
+ * set up as the connection wants them.
+ *
+ * Only use this when <b>conn</b> is about to be freed, or when the shards
+ * are going away: otherwise, use orshard_start_detach_conn(). */
+void
+orshard_detach_conn(connection_t *conn)
+{
+  orshard_conn_t *sc = orshard_conn_get(conn);
+
+  if (!sc)
+    return;
+  orshard_conn_request_detach(sc);
+  orshard_conn_wait_detached(sc);
+  orshard_conn_give_back(sc);
+}
+
+/** Tell the shard of <b>sc</b> whether the connection wants to read. */
+void
+orshard_conn_set_reading(orshard_conn_t *sc, int reading)
+{
+  int has_data;
+
+  reading = !!reading;
+  if (sc->main_reading == (unsigned)reading)
+    return;
+  sc->main_reading = reading;
+
+  tor_mutex_acquire(&sc->shard->lock);
+  sc->reading = reading;
+  has_data = ring_datalen(&sc->in) > 0 || sc->error;
+  orshard_conn_poke(sc);
+  tor_mutex_release(&sc->shard->lock);
+
+  /* Anything the shard read while we weren't reading is still waiting. */
+  if (reading && has_data)
+    orshard_conn_queue_main(sc, 1, 0);
+}
+
+/** Return true iff the connection of <b>sc</b> wants to read. */
+int
+orshard_conn_is_reading(const orshard_conn_t *sc)
+{
+  return sc->main_reading;
+}
+
+/** Note whether the connection of <b>sc</b> wants to write.  If it does,
+ * its write handler will run soon, and then whenever its shard has room for
+ * more data. */
+void
+orshard_conn_set_writing(orshard_conn_t *sc, int writing)
+{
+  writing = !!writing;
+  if (sc->main_writing == (unsigned)writing)
+    return;
+  sc->main_writing = writing;
+  if (writing)
+    orshard_conn_queue_main(sc, 0, 1);
+}
+
+/** Return true iff the connection of <b>sc</b> wants to write. */
+int
+orshard_conn_is_writing(const orshard_conn_t *sc)
+{
+  return sc->main_writing;
+}
+
+/** Move up to <b>at_most</b> bytes that the shard of <b>sc</b> has read and
+ * decrypted onto the end of <b>buf</b>.  Set *<b>n_read</b> and
+ * *<b>n_written</b> to the number of bytes that the shard has read from and
+ * written to the network since the last call.
+ *
+ * Return the number of bytes moved.  If there was nothing to move because
+ * the shard's reading stopped for good, return the TOR_TLS_* code that
+ * stopped it. */
+int
+orshard_conn_read(orshard_conn_t *sc, buf_t *buf, size_t at_most,
+                  size_t *n_read, size_t *n_written)
+{
+  size_t n;
+  int r, leftover;
+
+  tor_mutex_acquire(&sc->shard->lock);
+  n = ring_move_to_buf(&sc->in, buf, at_most);
+  if (n && sc->in_full) {
+    sc->in_full = 0;
+    orshard_conn_poke(sc);
+  }
+  leftover = ring_datalen(&sc->in) > 0;
+  if (n == 0 && !leftover && sc->error)
+    r = sc->error;
+  else
+    r = (int)n;
+  *n_read = sc->n_raw_read;
+  *n_written = sc->n_raw_written;
+  sc->n_raw_read = sc->n_raw_written = 0;
+  tor_mutex_release(&sc->shard->lock);
+
+  /* If we took some but not all, come back for the rest.  (If we took
+   * none, we're out of bandwidth, and will start reading again when we
+   * have more.) */
+  if (n && leftover)
+    orshard_conn_queue_main(sc, 1, 0);
+  return r;
+}
+
+/** Move up to <b>flushlen</b> bytes from the front of <b>buf</b> to the
+ * shard of <b>sc</b>, for it to encrypt and write.  Set *<b>n_read</b> and
+ * *<b>n_written</b> as for orshard_conn_read().
+ *
+ * Return the number of bytes moved; or TOR_TLS_WANTWRITE if the shard had
+ * no room for some of them; or the TOR_TLS_* code that stopped the shard's
+ * I/O for good. */
+int
+orshard_conn_flush(orshard_conn_t *sc, buf_t *buf, size_t flushlen,
+                   size_t *n_read, size_t *n_written)
+{
+  size_t n;
+  int r;
+
+  if (flushlen > buf_datalen(buf))
+    flushlen = buf_datalen(buf);
+
+  tor_mutex_acquire(&sc->shard->lock);
+  if (sc->error) {
+    r = sc->error;
+  } else {
+    int was_empty = ring_datalen(&sc->out) == 0;
+    n = ring_move_from_buf(&sc->out, buf, flushlen);
+    if (n < flushlen) {
+      sc->main_wants_room = 1;
+      r = TOR_TLS_WANTWRITE;
+    } else {
+      r = (int)n;
+    }
+    /* If the ring had data, the shard is still working on it, and will
+     * get to ours. */
+    if (n && was_empty)
+      orshard_conn_poke(sc);
+  }
+  *n_read = sc->n_raw_read;
+  *n_written = sc->n_raw_written;
+  sc->n_raw_read = sc->n_raw_written = 0;
+  tor_mutex_release(&sc->shard->lock);
+
+  return r;
+}
@@ -0,0 +1,73 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file orshard.h
+ * \brief Header file for orshard.c.
+ **/
+
+#ifndef TOR_ORSHARD_H
+#define TOR_ORSHARD_H
+
+typedef struct orshard_conn_t orshard_conn_t;
+
+void orshard_set_n_threads(int n_threads);
+int orshard_get_n_threads(void);
+void orshard_free_all(void);
+
+int orshard_attach_conn(or_connection_t *conn);
+int orshard_start_detach_conn(connection_t *conn, int close_socket);
+void orshard_detach_conn(connection_t *conn);
+orshard_conn_t *orshard_conn_get(const connection_t *conn);
+
+void orshard_conn_set_reading(orshard_conn_t *sc, int reading);
+int orshard_conn_is_reading(const orshard_conn_t *sc);
+void orshard_conn_set_writing(orshard_conn_t *sc, int writing);
+int orshard_conn_is_writing(const orshard_conn_t *sc);
+
+int orshard_conn_read(orshard_conn_t *sc, buf_t *buf, size_t at_most,
+                      size_t *n_read, size_t *n_written);
+int orshard_conn_flush(orshard_conn_t *sc, buf_t *buf, size_t flushlen,
+                       size_t *n_read, size_t *n_written);
+
+#ifdef ORSHARD_PRIVATE
+/** Size of each of the two plaintext rings between a sharded connection
+ * and the main thread: enough for one TLS record of the largest size.  Must
+ * be a power of two. */
+#define ORSHARD_RING_SIZE 16384
+
+/** The operations that a shard uses to move bytes between a connection's
+ * socket and its rings.  In Tor, these are thin wrappers around a
+ * tor_tls_t; the unit tests use plain sockets. */
+typedef struct orshard_io_t {
+  /** Read up to <b>n</b> bytes into <b>out</b>.  Return the number of
+   * bytes read, or a TOR_TLS_* code. */
+  int (*read)(void *arg, char *out, size_t n);
+  /** Write up to <b>n</b> bytes from <b>data</b>.  Return the number of
+   * bytes written, or a TOR_TLS_* code. */
+  int (*write)(void *arg, const char *data, size_t n);
+  /** Set *<b>n_read</b> and *<b>n_written</b> to the number of bytes we
+   * have read from and written to the network since the last call. */
+  void (*get_n_raw_bytes)(void *arg, size_t *n_read, size_t *n_written);
+} orshard_io_t;
+
+typedef struct orshard_t orshard_t;
+
+extern const orshard_io_t orshard_tls_io;
+
+/* These let the unit tests and benchmarks run shards on connections of
+ * their own. */
+orshard_t *orshard_get_shard(int idx);
+orshard_conn_t *orshard_conn_new(orshard_t *shard, tor_socket_t s,
+                                 const orshard_io_t *io, void *io_arg,
+                                 connection_t *conn);
+void orshard_conn_release(orshard_conn_t *sc, buf_t *inbuf, buf_t *unsent);
+void orshard_conn_free_(orshard_conn_t *sc);
+#define orshard_conn_free(sc) \
+  FREE_AND_NULL(orshard_conn_t, orshard_conn_free_, (sc))
+#ifdef TOR_UNIT_TESTS
+STATIC void orshard_process_main_queue(void);
+#endif
+#endif /* defined(ORSHARD_PRIVATE) */
+
+#endif /* !defined(TOR_ORSHARD_H) */
@@ -124,6 +124,11 @@ periodic_event_connect(periodic_event_item_t *event)
   event->ev = mainloop_event_new(periodic_event_dispatch,
                                  event);
   tor_assert(event->ev);
+
+  char *stat_name = NULL;
+  tor_asprintf(&stat_name, "periodic/%s", event->name);
+  mainloop_event_set_name(event->ev, stat_name);
+  tor_free(stat_name);
 }
 
 /** Handles initial dispatch for periodic events. It should happen 1 second
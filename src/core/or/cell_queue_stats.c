@@ -0,0 +1,188 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file cell_queue_stats.c
+ * \brief Histograms of how long cells wait on circuit cell queues.
+ *
+ * Every packed_cell_t records when it was appended to a circuit's cell
+ * queue.  When channel_flush_from_first_active_circuit() takes the cell off
+ * the queue again, it calls cell_queue_note_sojourn(), which adds the time
+ * the cell waited to a global histogram (split by circuit type and by
+ * direction) and to a histogram kept on the channel itself.
+ *
+ * These histograms are exposed over the control port, as GETINFO
+ * cell-queue/sojourn and cell-queue/sojourn/channels, and on the
+ * MetricsPort.  Each enqueue and dequeue also fires a tracepoint.
+ **/
+
+#include "core/or/or.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
+#include "core/or/cell_queue_stats.h"
+#include "core/or/channel.h"
+#include "core/or/channeltls.h"
+#include "core/or/circuitlist.h"
+#include "core/or/connection_or.h"
+
+#include "core/or/cell_queue_st.h"
+#include "core/or/circuit_st.h"
+#include "core/or/or_connection_st.h"
+
+/** Global histograms of cell sojourn times, indexed by circuit type and by
+ * direction. */
+static cell_sojourn_hist_t
+  sojourn_hists[CELL_SOJOURN_N_CIRC_TYPES][CELL_SOJOURN_N_DIRECTIONS];
+
+/** Add a cell that waited <b>msec</b> msec to <b>hist</b>.  A cell that
+ * waited exactly 2^k msec goes in bucket k, so that each bucket's bound is
+ * inclusive, as Prometheus expects. */
+static inline void
+sojourn_hist_add(cell_sojourn_hist_t *hist, uint32_t msec)
+{
+  int bucket = msec > 1 ? tor_log2(msec - 1) + 1 : 0;
+  if (bucket >= CELL_SOJOURN_N_BUCKETS)
+    bucket = CELL_SOJOURN_N_BUCKETS - 1;
+  ++hist->hist[bucket];
+  ++hist->n_cells;
+  hist->total_msec += msec;
+}
+
+/** Note that we are about to flush <b>cell</b>, which we just took off the
+ * cell queue of <b>circ</b>, to <b>chan</b>.  <b>now_stamp</b> is the
+ * current coarse monotonic stamp.  Record how long the cell waited in the
+ * global histograms and in the histogram of <b>chan</b>, and return that
+ * time in msec. */
+uint32_t
+cell_queue_note_sojourn(channel_t *chan, const circuit_t *circ,
+                        const packed_cell_t *cell, uint32_t now_stamp)
+{
+  const int exitward = (circ->n_chan == chan);
+  const uint32_t msec = (uint32_t) monotime_coarse_stamp_units_to_approx_msec(
+                                   now_stamp - cell->inserted_timestamp);
+  const int circ_type = CIRCUIT_IS_ORIGIN(circ) ?
+    CELL_SOJOURN_CIRC_ORIGIN : CELL_SOJOURN_CIRC_OR;
+  const int direction = exitward ?
+    CELL_SOJOURN_EXITWARD : CELL_SOJOURN_APPWARD;
+
+  sojourn_hist_add(&sojourn_hists[circ_type][direction], msec);
+
+  if (PREDICT_UNLIKELY(!chan->cell_sojourn))
+    chan->cell_sojourn = tor_malloc_zero(sizeof(cell_sojourn_hist_t));
+  sojourn_hist_add(chan->cell_sojourn, msec);
+
+  tor_trace(TR_SUBSYS(cell_queue), TR_EV(sojourn), circ, chan, exitward,
+            msec);
+  return msec;
+}
+
+/** Return the global sojourn histogram for cells on circuits of type
+ * <b>circ_type</b> (a CELL_SOJOURN_CIRC_* value) that were travelling in
+ * <b>direction</b> (a CELL_SOJOURN_APPWARD or _EXITWARD value). */
+const cell_sojourn_hist_t *
+cell_queue_get_sojourn_hist(int circ_type, int direction)
+{
+  tor_assert(circ_type >= 0 && circ_type < CELL_SOJOURN_N_CIRC_TYPES);
+  tor_assert(direction >= 0 && direction < CELL_SOJOURN_N_DIRECTIONS);
+  return &sojourn_hists[circ_type][direction];
+}
+
+/** Return a short name for the circuit type <b>circ_type</b>. */
+const char *
+cell_queue_sojourn_circ_type_name(int circ_type)
+{
+  return circ_type == CELL_SOJOURN_CIRC_ORIGIN ? "origin" : "or";
+}
+
+/** Return a short name for the direction <b>direction</b>. */
+const char *
+cell_queue_sojourn_direction_name(int direction)
+{
+  return direction == CELL_SOJOURN_EXITWARD ? "exitward" : "appward";
+}
+
+/** Return a newly allocated string describing <b>hist</b>, as
+ * "cells=N total-msec=N hist=LIMIT:COUNT,...", with one "LIMIT:COUNT" for
+ * each nonempty bucket, where LIMIT is the bucket's upper bound in msec, or
+ * "inf" for the last bucket. */
+static char *
+sojourn_hist_format(const cell_sojourn_hist_t *hist)
+{
+  smartlist_t *buckets = smartlist_new();
+  char *joined, *result;
+
+  for (int b = 0; b < CELL_SOJOURN_N_BUCKETS; ++b) {
+    if (!hist->hist[b])
+      continue;
+    if (b == CELL_SOJOURN_N_BUCKETS - 1) {
+      smartlist_add_asprintf(buckets, "inf:%"PRIu64, hist->hist[b]);
+    } else {
+      smartlist_add_asprintf(buckets, "%u:%"PRIu64, 1u << b, hist->hist[b]);
+    }
+  }
+  joined = smartlist_join_strings(buckets, ",", 0, NULL);
+  tor_asprintf(&result, "cells=%"PRIu64" total-msec=%"PRIu64" hist=%s",
+               hist->n_cells, hist->total_msec, joined);
+
+  SMARTLIST_FOREACH(buckets, char *, cp, tor_free(cp));
+  smartlist_free(buckets);
+  tor_free(joined);
+  return result;
+}
+
+/** Return a newly allocated string holding one line for each of our global
+ * sojourn histograms, as "TYPE DIRECTION cells=N total-msec=N hist=...". */
+char *
+cell_queue_sojourn_format(void)
+{
+  smartlist_t *lines = smartlist_new();
+  char *result;
+  int t, d;
+
+  for (t = 0; t < CELL_SOJOURN_N_CIRC_TYPES; ++t) {
+    for (d = 0; d < CELL_SOJOURN_N_DIRECTIONS; ++d) {
+      char *hist = sojourn_hist_format(&sojourn_hists[t][d]);
+      smartlist_add_asprintf(lines, "%s %s %s",
+                             cell_queue_sojourn_circ_type_name(t),
+                             cell_queue_sojourn_direction_name(d),
+                             hist);
+      tor_free(hist);
+    }
+  }
+
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Return a newly allocated string holding one line for each open OR
+ * connection whose channel has flushed at least one cell from a circuit
+ * queue, as "CHANNEL-ID cells=N total-msec=N hist=...". */
+char *
+cell_queue_sojourn_format_channels(void)
+{
+  smartlist_t *lines = smartlist_new();
+  char *result;
+
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    channel_t *chan;
+    char *hist;
+    if (conn->type != CONN_TYPE_OR || conn->marked_for_close)
+      continue;
+    if (!TO_OR_CONN(conn)->chan)
+      continue;
+    chan = TLS_CHAN_TO_BASE(TO_OR_CONN(conn)->chan);
+    if (!chan->cell_sojourn)
+      continue;
+    hist = sojourn_hist_format(chan->cell_sojourn);
+    smartlist_add_asprintf(lines, "%"PRIu64" %s",
+                           chan->global_identifier, hist);
+    tor_free(hist);
+  } SMARTLIST_FOREACH_END(conn);
+
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
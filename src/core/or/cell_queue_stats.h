@@ -0,0 +1,66 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file cell_queue_stats.h
+ * \brief Header for cell_queue_stats.c
+ **/
+
+#ifndef TOR_CELL_QUEUE_STATS_H
+#define TOR_CELL_QUEUE_STATS_H
+
+#include "lib/trace/events.h"
+#include "core/or/trace_probes_cell_queue.h"
+
+/** Number of buckets in a cell_sojourn_hist_t: bucket 0 counts cells that
+ * waited at most 1 msec; bucket i counts cells that waited more than
+ * 2^(i-1) and at most 2^i msec; the last bucket also counts everything
+ * longer. */
+#define CELL_SOJOURN_N_BUCKETS 16
+
+/** Values for the circuit type index into our global histograms. */
+#define CELL_SOJOURN_CIRC_ORIGIN 0
+#define CELL_SOJOURN_CIRC_OR 1
+#define CELL_SOJOURN_N_CIRC_TYPES 2
+
+/** Values for the direction index into our global histograms. */
+#define CELL_SOJOURN_APPWARD 0
+#define CELL_SOJOURN_EXITWARD 1
+#define CELL_SOJOURN_N_DIRECTIONS 2
+
+/** A histogram of how long cells have waited on circuit cell queues, from
+ * append_cell_to_circuit_queue() until we flushed them to a channel. */
+typedef struct cell_sojourn_hist_t {
+  /** Number of cells in each bucket. */
+  uint64_t hist[CELL_SOJOURN_N_BUCKETS];
+  /** Total number of cells. */
+  uint64_t n_cells;
+  /** Total time that the cells waited, in msec. */
+  uint64_t total_msec;
+} cell_sojourn_hist_t;
+
+uint32_t cell_queue_note_sojourn(channel_t *chan, const circuit_t *circ,
+                                 const packed_cell_t *cell,
+                                 uint32_t now_stamp);
+
+const cell_sojourn_hist_t *cell_queue_get_sojourn_hist(int circ_type,
+                                                       int direction);
+const char *cell_queue_sojourn_circ_type_name(int circ_type);
+const char *cell_queue_sojourn_direction_name(int direction);
+char *cell_queue_sojourn_format(void);
+char *cell_queue_sojourn_format_channels(void);
+
+/** Note that we have just appended a cell to the cell queue of <b>circ</b>
+ * that is bound for <b>chan</b>, so that the queue now holds
+ * <b>queue_len</b> cells.  This only fires a tracepoint. */
+static inline void
+cell_queue_note_append(const circuit_t *circ, const channel_t *chan,
+                       int queue_len)
+{
+  tor_trace(TR_SUBSYS(cell_queue), TR_EV(append), circ, chan, queue_len);
+  (void)circ;
+  (void)chan;
+  (void)queue_len;
+}
+
+#endif /* !defined(TOR_CELL_QUEUE_STATS_H) */
@@ -62,6 +62,7 @@
 #include "core/or/channel.h"
 #include "core/or/channelpadding.h"
 #include "core/or/channeltls.h"
+#include "core/or/circid_table.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux.h"
@@ -72,7 +73,7 @@
 #include "core/or/scheduler.h"
 #include "feature/client/entrynodes.h"
 #include "feature/nodelist/dirlist.h"
-#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/netparams.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/relay/router.h"
@@ -942,6 +943,8 @@ channel_free_(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  circid_table_free(chan->circid_table);
+  tor_free(chan->cell_sojourn);
   tor_free(chan);
 }
 
@@ -1013,6 +1016,8 @@ channel_force_xfree(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  circid_table_free(chan->circid_table);
+  tor_free(chan->cell_sojourn);
   tor_free(chan);
 }
 
@@ -1862,6 +1867,8 @@ channel_do_open_actions(channel_t *chan)
   int started_here;
   time_t now = time(NULL);
   int close_origin_circuits = 0;
+  static netparam_t channelpadding_sos_param =
+    NETPARAM_INIT(CHANNELPADDING_SOS_PARAM, CHANNELPADDING_SOS_DEFAULT, 0, 1);
 
   tor_assert(chan);
 
@@ -1898,9 +1905,7 @@ channel_do_open_actions(channel_t *chan)
       /* Disable if torrc disabled */
       channelpadding_disable_padding_on_channel(chan);
     } else if (rend_service_allow_non_anonymous_connection(get_options()) &&
-               !networkstatus_get_param(NULL,
-                                        CHANNELPADDING_SOS_PARAM,
-                                        CHANNELPADDING_SOS_DEFAULT, 0, 1)) {
+               !netparam_get(&channelpadding_sos_param)) {
       /* Disable if we're using RSOS and the consensus disabled padding
        * for RSOS */
       channelpadding_disable_padding_on_channel(chan);
@@ -396,6 +396,11 @@ struct channel_t {
   /** Circuit mux for circuits sending on this channel */
   circuitmux_t *cmux;
 
+  /** Map from circuit ID to the circuits on this channel, and the circuit
+   * IDs that we are waiting to send a DESTROY for. NULL until we first need
+   * it. */
+  struct circid_table_t *circid_table;
+
   /** Circuit ID generation stuff for use by circuitbuild.c */
 
   /**
@@ -456,6 +461,10 @@ struct channel_t {
   uint64_t n_cells_recved, n_bytes_recved;
   /** Channel counters for cells and bytes we have sent. */
   uint64_t n_cells_xmitted, n_bytes_xmitted;
+
+  /** Histogram of how long the cells we have flushed from circuit cell
+   * queues waited there, or NULL if we have not flushed any yet. */
+  struct cell_sojourn_hist_t *cell_sojourn;
 };
 
 struct channel_listener_t {
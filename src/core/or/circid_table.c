@@ -0,0 +1,298 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circid_table.c
+ * \brief Map circuit IDs to circuits on a single channel, and pick unused
+ *   circuit IDs.
+ *
+ * Every cell that arrives on a channel needs its circuit looked up by
+ * circuit ID, so each channel owns a circid_table_t: a small hash table
+ * with open addressing and linear probing, which keeps the entries of one
+ * channel together in memory.  We remember the entry that we found last,
+ * since cells tend to arrive in runs on the same circuit.
+ *
+ * When we extend a circuit over a channel, we need a circuit ID that isn't
+ * in use on it.  Rather than trying random IDs until one is free, which
+ * gets slow and eventually fails as the channel fills up, the table keeps
+ * a bitmap of which IDs are in use in a window of the ID space that we may
+ * pick from.  The window starts at a random place, and doubles in size
+ * whenever it is three quarters full, so that there is always a free ID
+ * nearby and the bitmap stays proportional to the number of circuits.
+ **/
+
+#include "core/or/or.h"
+#include "core/or/circid_table.h"
+#include "lib/crypt_ops/crypto_rand.h"
+
+/** Smallest number of slots in a table that has any entries. */
+#define CIRCID_TABLE_MIN_CAPACITY 16
+/** Number of IDs in the first allocator window of a table. */
+#define CIRCID_ALLOC_MIN_WINDOW 1024
+
+/** Return a new, empty circid_table_t. */
+circid_table_t *
+circid_table_new(void)
+{
+  return tor_malloc_zero(sizeof(circid_table_t));
+}
+
+/** Release all storage held by <b>table</b>. */
+void
+circid_table_free_(circid_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->entries);
+  bitarray_free(table->alloc_used);
+  tor_free(table);
+}
+
+/** Return the slot of <b>table</b> at which we start looking for
+ * <b>circ_id</b>. */
+static inline unsigned int
+circid_table_home_slot(const circid_table_t *table, circid_t circ_id)
+{
+  /* Our peers choose some of these IDs, so use a keyed hash. */
+  return (unsigned) siphash24g(&circ_id, sizeof(circ_id)) &
+    (table->capacity - 1);
+}
+
+/** Move the entries of <b>table</b> into a new array of <b>capacity</b>
+ * slots. */
+static void
+circid_table_resize(circid_table_t *table, unsigned int capacity)
+{
+  circid_table_entry_t *old_entries = table->entries;
+  const unsigned int old_capacity = table->capacity;
+  unsigned int i, slot;
+
+  table->entries = tor_calloc(capacity, sizeof(circid_table_entry_t));
+  table->capacity = capacity;
+  table->last_found = NULL;
+
+  for (i = 0; i < old_capacity; ++i) {
+    if (!old_entries[i].used)
+      continue;
+    slot = circid_table_home_slot(table, old_entries[i].circ_id);
+    while (table->entries[slot].used)
+      slot = (slot + 1) & (capacity - 1);
+    table->entries[slot] = old_entries[i];
+  }
+  tor_free(old_entries);
+}
+
+/** If <b>circ_id</b> is in the allocator window of <b>table</b>, set
+ * *<b>idx_out</b> to its position there and return true. Otherwise return
+ * false. */
+static bool
+circid_table_window_idx(const circid_table_t *table, circid_t circ_id,
+                        uint32_t *idx_out)
+{
+  uint32_t idx;
+
+  if (!table->alloc_used ||
+      (circ_id & ~table->alloc_mask) != table->alloc_high_bit)
+    return false;
+  idx = ((circ_id & table->alloc_mask) - table->alloc_base) &
+    table->alloc_mask;
+  if (idx >= table->alloc_window)
+    return false;
+  *idx_out = idx;
+  return true;
+}
+
+/** Mark <b>circ_id</b> as used (if <b>used</b> is true) or unused in the
+ * allocator bitmap of <b>table</b>. */
+static void
+circid_table_alloc_note(circid_table_t *table, circid_t circ_id, bool used)
+{
+  uint32_t idx;
+
+  /* We never hand out an ID whose value is 0, so we keep its bit set. */
+  if ((circ_id & table->alloc_mask) == 0 ||
+      !circid_table_window_idx(table, circ_id, &idx))
+    return;
+  if (used && !bitarray_is_set(table->alloc_used, idx)) {
+    bitarray_set(table->alloc_used, idx);
+    ++table->alloc_n_used;
+  } else if (!used && bitarray_is_set(table->alloc_used, idx)) {
+    bitarray_clear(table->alloc_used, idx);
+    --table->alloc_n_used;
+  }
+}
+
+/** Set the bits of the allocator bitmap of <b>table</b> for every ID at
+ * position <b>from</b> or later in its window that we must not hand out. */
+static void
+circid_table_alloc_fill(circid_table_t *table, uint32_t from)
+{
+  uint32_t idx;
+  unsigned int i;
+
+  for (i = 0; i < table->capacity; ++i) {
+    const circid_table_entry_t *ent = &table->entries[i];
+    if (ent->used && circid_table_window_idx(table, ent->circ_id, &idx) &&
+        idx >= from)
+      circid_table_alloc_note(table, ent->circ_id, true);
+  }
+
+  idx = (0 - table->alloc_base) & table->alloc_mask;
+  if (idx >= from && idx < table->alloc_window) {
+    bitarray_set(table->alloc_used, idx);
+    ++table->alloc_n_used;
+  }
+}
+
+/** Start a new allocator window for <b>table</b>, for IDs made of
+ * <b>high_bit</b> and a value under <b>mask</b>. */
+static void
+circid_table_alloc_reset(circid_table_t *table,
+                         circid_t high_bit, circid_t mask)
+{
+  bitarray_free(table->alloc_used);
+  table->alloc_high_bit = high_bit;
+  table->alloc_mask = mask;
+  table->alloc_base = crypto_rand_u32() & mask;
+  table->alloc_window = MIN(CIRCID_ALLOC_MIN_WINDOW, mask + 1);
+  table->alloc_used = bitarray_init_zero(table->alloc_window);
+  table->alloc_n_used = 0;
+  circid_table_alloc_fill(table, 0);
+}
+
+/** Double the allocator window of <b>table</b>. */
+static void
+circid_table_alloc_grow(circid_table_t *table)
+{
+  const uint32_t old_window = table->alloc_window;
+
+  table->alloc_window = MIN(old_window * 2, table->alloc_mask + 1);
+  table->alloc_used = bitarray_expand(table->alloc_used, old_window,
+                                      table->alloc_window);
+  circid_table_alloc_fill(table, old_window);
+}
+
+/** Return the entry for <b>circ_id</b> in <b>table</b>, or NULL if there is
+ * none. */
+circid_table_entry_t *
+circid_table_get(circid_table_t *table, circid_t circ_id)
+{
+  unsigned int slot;
+
+  if (table->last_found && table->last_found->circ_id == circ_id)
+    return table->last_found;
+  if (!table->capacity)
+    return NULL;
+
+  slot = circid_table_home_slot(table, circ_id);
+  while (table->entries[slot].used) {
+    if (table->entries[slot].circ_id == circ_id) {
+      table->last_found = &table->entries[slot];
+      return table->last_found;
+    }
+    slot = (slot + 1) & (table->capacity - 1);
+  }
+  return NULL;
+}
+
+/** Return the entry for <b>circ_id</b> in <b>table</b>, adding an empty
+ * one if there is none. The entry stays valid until the next change to
+ * <b>table</b>. */
+circid_table_entry_t *
+circid_table_add(circid_table_t *table, circid_t circ_id)
+{
+  circid_table_entry_t *ent = circid_table_get(table, circ_id);
+  unsigned int slot;
+
+  if (ent)
+    return ent;
+
+  /* Keep the table at most 60% full, so that probe runs stay short. */
+  if ((table->n_entries + 1) * 5 > table->capacity * 3)
+    circid_table_resize(table, MAX(CIRCID_TABLE_MIN_CAPACITY,
+                                   table->capacity * 2));
+
+  slot = circid_table_home_slot(table, circ_id);
+  while (table->entries[slot].used)
+    slot = (slot + 1) & (table->capacity - 1);
+  ent = &table->entries[slot];
+  ent->circ_id = circ_id;
+  ent->used = 1;
+  ++table->n_entries;
+  circid_table_alloc_note(table, circ_id, true);
+  return ent;
+}
+
+/** Remove the entry <b>ent</b> from <b>table</b>. */
+void
+circid_table_remove(circid_table_t *table, circid_table_entry_t *ent)
+{
+  const unsigned int mask = table->capacity - 1;
+  unsigned int hole, slot, home;
+
+  tor_assert(ent >= table->entries && ent < table->entries + table->capacity);
+  tor_assert(ent->used);
+
+  circid_table_alloc_note(table, ent->circ_id, false);
+
+  /* Move later entries of the same run back into the hole, so that no
+   * lookup stops early at it. */
+  hole = slot = (unsigned) (ent - table->entries);
+  for (;;) {
+    slot = (slot + 1) & mask;
+    if (!table->entries[slot].used)
+      break;
+    home = circid_table_home_slot(table, table->entries[slot].circ_id);
+    /* An entry must stay put if its home is after the hole. */
+    if (hole <= slot ? (hole < home && home <= slot)
+                     : (hole < home || home <= slot))
+      continue;
+    table->entries[hole] = table->entries[slot];
+    hole = slot;
+  }
+  memset(&table->entries[hole], 0, sizeof(circid_table_entry_t));
+  --table->n_entries;
+  table->last_found = NULL;
+
+  if (table->capacity > CIRCID_TABLE_MIN_CAPACITY &&
+      table->n_entries * 8 < table->capacity)
+    circid_table_resize(table, table->capacity / 2);
+}
+
+/** Return a circuit ID that is not in <b>table</b>, made of
+ * <b>high_bit</b> and a nonzero value under <b>mask</b>. Return 0 if all
+ * such IDs are in use. */
+circid_t
+circid_table_pick_free(circid_table_t *table,
+                       circid_t high_bit, circid_t mask)
+{
+  uint32_t n_words, start, i, bit;
+
+  if (!table->alloc_used || table->alloc_high_bit != high_bit ||
+      table->alloc_mask != mask)
+    circid_table_alloc_reset(table, high_bit, mask);
+
+  while (table->alloc_n_used >= table->alloc_window / 4 * 3 &&
+         table->alloc_window <= mask)
+    circid_table_alloc_grow(table);
+  if (table->alloc_n_used >= table->alloc_window)
+    return 0;
+
+  /* Start at a random word, so that we don't hand out IDs in order. */
+  n_words = (table->alloc_window + BITARRAY_MASK) >> BITARRAY_SHIFT;
+  start = crypto_rand_uint(n_words);
+  for (i = 0; i < n_words; ++i) {
+    const uint32_t word_idx = (start + i) % n_words;
+    const unsigned int word = table->alloc_used[word_idx];
+    if (word == ~0u)
+      continue;
+    for (bit = 0; bit <= BITARRAY_MASK; ++bit) {
+      const uint32_t idx = (word_idx << BITARRAY_SHIFT) | bit;
+      if (idx >= table->alloc_window)
+        break;
+      if (!(word & (1u << bit)))
+        return high_bit | ((table->alloc_base + idx) & mask);
+    }
+  }
+  return 0;
+}
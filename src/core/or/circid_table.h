@@ -0,0 +1,67 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circid_table.h
+ * \brief Header file for circid_table.c.
+ **/
+
+#ifndef TOR_CIRCID_TABLE_H
+#define TOR_CIRCID_TABLE_H
+
+#include "lib/container/bitarray.h"
+
+/** One circuit ID that is in use on a channel: either by a circuit, or
+ * because we are waiting to send a DESTROY cell for it. */
+typedef struct circid_table_entry_t {
+  /** The circuit ID. */
+  circid_t circ_id;
+  /** True iff this slot of the table is in use. */
+  unsigned int used : 1;
+  /** The circuit that uses this ID, or NULL if this is a placeholder for a
+   * pending DESTROY cell. */
+  struct circuit_t *circuit;
+  /* For debugging 12184: when was this placeholder item added? */
+  time_t made_placeholder_at;
+} circid_table_entry_t;
+
+/** A map from circuit ID to circid_table_entry_t for the circuits on one
+ * channel, along with an allocator for new circuit IDs in the half of the
+ * ID space that we use on that channel. */
+typedef struct circid_table_t {
+  /** Open-addressed array of entries; its length is a power of two. */
+  circid_table_entry_t *entries;
+  /** Number of slots in <b>entries</b>. */
+  unsigned int capacity;
+  /** Number of used slots in <b>entries</b>. */
+  unsigned int n_entries;
+  /** The entry that circid_table_get() most recently returned, or NULL. */
+  circid_table_entry_t *last_found;
+
+  /** Circuit IDs that we hand out are <b>alloc_high_bit</b> ORed with a
+   * value under <b>alloc_mask</b>. Both are 0 until we first pick an ID. */
+  circid_t alloc_high_bit, alloc_mask;
+  /** The allocator keeps track of a window of <b>alloc_window</b> IDs,
+   * starting at <b>alloc_base</b> (before adding the high bit) and wrapping
+   * around under <b>alloc_mask</b>. */
+  uint32_t alloc_base, alloc_window;
+  /** One bit for each ID in the window, set iff it is in the table. */
+  bitarray_t *alloc_used;
+  /** Number of bits set in <b>alloc_used</b>. */
+  uint32_t alloc_n_used;
+} circid_table_t;
+
+circid_table_t *circid_table_new(void);
+void circid_table_free_(circid_table_t *table);
+#define circid_table_free(table) \
+  FREE_AND_NULL(circid_table_t, circid_table_free_, (table))
+
+circid_table_entry_t *circid_table_get(circid_table_t *table,
+                                       circid_t circ_id);
+circid_table_entry_t *circid_table_add(circid_table_t *table,
+                                       circid_t circ_id);
+void circid_table_remove(circid_table_t *table, circid_table_entry_t *ent);
+circid_t circid_table_pick_free(circid_table_t *table,
+                                circid_t high_bit, circid_t mask);
+
+#endif /* !defined(TOR_CIRCID_TABLE_H) */
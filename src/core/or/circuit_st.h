@@ -146,6 +146,18 @@ struct circuit_t {
    * At maximum, this list contains 200 bytes plus the smartlist overhead. */
   smartlist_t *sendme_last_digests;
 
+  /** If this is an OR circuit on which the client negotiated congestion
+   * control, the state that replaces package_window. (Origin circuits keep
+   * theirs on the crypt_path_t of the hop they negotiated it with.) */
+  struct congestion_control_t *ccontrol;
+
+  /** If this circuit belongs to a set of circuits between the same client
+   * and exit that carry data for each other's streams, that set. */
+  struct multipath_set_t *mp_set;
+  /** True iff both ends of this circuit agree that it belongs to
+   * <b>mp_set</b>, so that we may send multipath data on it. */
+  unsigned int mp_linked : 1;
+
   /** Temporary field used during circuits_handle_oom. */
   uint32_t age_tmp;
 
@@ -37,6 +37,7 @@
 #include "core/mainloop/connection.h"
 #include "core/mainloop/mainloop.h"
 #include "core/or/channel.h"
+#include "core/or/circid_table.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitstats.h"
@@ -112,29 +113,23 @@ channel_connect_for_circuit,(const extend_info_t *ei))
   return chan;
 }
 
-/** Search for a value for circ_id that we can use on <b>chan</b> for an
- * outbound circuit, until we get a circ_id that is not in use by any other
- * circuit on that conn.
+/** Pick a value for circ_id that we can use on <b>chan</b> for an
+ * outbound circuit: one that is not in use by any other circuit on that
+ * conn, or waiting for a destroy cell.
  *
  * Return it, or 0 if can't get a unique circ_id.
  */
 STATIC circid_t
 get_unique_circ_id_by_chan(channel_t *chan)
 {
-/* This number is chosen somewhat arbitrarily; see comment below for more
- * info.  When the space is 80% full, it gives a one-in-a-million failure
- * chance; when the space is 90% full, it gives a one-in-850 chance; and when
- * the space is 95% full, it gives a one-in-26 failure chance.  That seems
- * okay, though you could make a case IMO for anything between N=32 and
- * N=256. */
-#define MAX_CIRCID_ATTEMPTS 64
-  int in_use;
   unsigned n_with_circ = 0, n_pending_destroy = 0, n_weird_pending_destroy = 0;
-  circid_t test_circ_id;
-  circid_t attempts=0;
+  circid_t circ_id;
   circid_t high_bit, max_range, mask;
   int64_t pending_destroy_time_total = 0;
   int64_t pending_destroy_time_max = 0;
+  int64_t queued_destroys;
+  unsigned i;
+  char *m;
 
   tor_assert(chan);
 
@@ -147,97 +142,28 @@ get_unique_circ_id_by_chan(channel_t *chan)
   max_range = (chan->wide_circ_ids) ? (1u<<31) : (1u<<15);
   mask = max_range - 1;
   high_bit = (chan->circ_id_type == CIRC_ID_TYPE_HIGHER) ? max_range : 0;
-  do {
-    if (++attempts > MAX_CIRCID_ATTEMPTS) {
-      /* Make sure we don't loop forever because all circuit IDs are used.
-       *
-       * Once, we would try until we had tried every possible circuit ID.  But
-       * that's quite expensive.  Instead, we try MAX_CIRCID_ATTEMPTS random
-       * circuit IDs, and then give up.
-       *
-       * This potentially causes us to give up early if our circuit ID space
-       * is nearly full.  If we have N circuit IDs in use, then we will reject
-       * a new circuit with probability (N / max_range) ^ MAX_CIRCID_ATTEMPTS.
-       * This means that in practice, a few percent of our circuit ID capacity
-       * will go unused.
-       *
-       * The alternative here, though, is to do a linear search over the
-       * whole circuit ID space every time we extend a circuit, which is
-       * not so great either.
-       */
-      int64_t queued_destroys;
-      char *m = rate_limit_log(&chan->last_warned_circ_ids_exhausted,
-                               approx_time());
-      if (m == NULL)
-        return 0; /* This message has been rate-limited away. */
-      if (n_pending_destroy)
-        pending_destroy_time_total /= n_pending_destroy;
-      log_warn(LD_CIRC,"No unused circIDs found on channel %s wide "
-                 "circID support, with %u inbound and %u outbound circuits. "
-                 "Found %u circuit IDs in use by circuits, and %u with "
-                 "pending destroy cells. (%u of those were marked bogusly.) "
-                 "The ones with pending destroy cells "
-                 "have been marked unusable for an average of %ld seconds "
-                 "and a maximum of %ld seconds. This channel is %ld seconds "
-                 "old. Failing a circuit.%s",
-                 chan->wide_circ_ids ? "with" : "without",
-                 chan->num_p_circuits, chan->num_n_circuits,
-                 n_with_circ, n_pending_destroy, n_weird_pending_destroy,
-                 (long)pending_destroy_time_total,
-                 (long)pending_destroy_time_max,
-                 (long)(approx_time() - chan->timestamp_created),
-                 m);
-      tor_free(m);
-
-      if (!chan->cmux) {
-        /* This warning should be impossible. */
-        log_warn(LD_BUG, "  This channel somehow has no cmux on it!");
-        return 0;
-      }
-
-      /* analysis so far on 12184 suggests that we're running out of circuit
-         IDs because it looks like we have too many pending destroy
-         cells. Let's see how many we really have pending.
-      */
-      queued_destroys = circuitmux_count_queued_destroy_cells(chan,
-                                                              chan->cmux);
-
-      log_warn(LD_CIRC, "  Circuitmux on this channel has %u circuits, "
-               "of which %u are active. It says it has %"PRId64
-               " destroy cells queued.",
-               circuitmux_num_circuits(chan->cmux),
-               circuitmux_num_active_circuits(chan->cmux),
-               (queued_destroys));
-
-      /* Change this into "if (1)" in order to get more information about
-       * possible failure modes here.  You'll need to know how to use gdb with
-       * Tor: this will make Tor exit with an assertion failure if the cmux is
-       * corrupt. */
-      if (0)
-        circuitmux_assert_okay(chan->cmux);
-
-      channel_dump_statistics(chan, LOG_WARN);
-
-      return 0;
-    }
 
-    do {
-      crypto_rand((char*) &test_circ_id, sizeof(test_circ_id));
-      test_circ_id &= mask;
-    } while (test_circ_id == 0);
+  if (!chan->circid_table)
+    chan->circid_table = circid_table_new();
+  circ_id = circid_table_pick_free(chan->circid_table, high_bit, mask);
+  if (circ_id)
+    return circ_id;
 
-    test_circ_id |= high_bit;
+  /* Every circuit ID in our half of the space is in use. */
+  m = rate_limit_log(&chan->last_warned_circ_ids_exhausted, approx_time());
+  if (m == NULL)
+    return 0; /* This message has been rate-limited away. */
 
-    in_use = circuit_id_in_use_on_channel(test_circ_id, chan);
-    if (in_use == 1)
+  for (i = 0; i < chan->circid_table->capacity; ++i) {
+    const circid_table_entry_t *ent = &chan->circid_table->entries[i];
+    if (!ent->used || (ent->circ_id & ~mask) != high_bit)
+      continue;
+    if (ent->circuit) {
       ++n_with_circ;
-    else if (in_use == 2) {
-      time_t since_when;
+    } else {
       ++n_pending_destroy;
-      since_when =
-        circuit_id_when_marked_unusable_on_channel(test_circ_id, chan);
-      if (since_when) {
-        time_t waiting = approx_time() - since_when;
+      if (ent->made_placeholder_at) {
+        time_t waiting = approx_time() - ent->made_placeholder_at;
         pending_destroy_time_total += waiting;
         if (waiting > pending_destroy_time_max)
           pending_destroy_time_max = waiting;
@@ -245,8 +171,55 @@ get_unique_circ_id_by_chan(channel_t *chan)
         ++n_weird_pending_destroy;
       }
     }
-  } while (in_use);
-  return test_circ_id;
+  }
+  if (n_pending_destroy)
+    pending_destroy_time_total /= n_pending_destroy;
+  log_warn(LD_CIRC,"No unused circIDs found on channel %s wide "
+             "circID support, with %u inbound and %u outbound circuits. "
+             "Found %u circuit IDs in use by circuits, and %u with "
+             "pending destroy cells. (%u of those were marked bogusly.) "
+             "The ones with pending destroy cells "
+             "have been marked unusable for an average of %ld seconds "
+             "and a maximum of %ld seconds. This channel is %ld seconds "
+             "old. Failing a circuit.%s",
+             chan->wide_circ_ids ? "with" : "without",
+             chan->num_p_circuits, chan->num_n_circuits,
+             n_with_circ, n_pending_destroy, n_weird_pending_destroy,
+             (long)pending_destroy_time_total,
+             (long)pending_destroy_time_max,
+             (long)(approx_time() - chan->timestamp_created),
+             m);
+  tor_free(m);
+
+  if (!chan->cmux) {
+    /* This warning should be impossible. */
+    log_warn(LD_BUG, "  This channel somehow has no cmux on it!");
+    return 0;
+  }
+
+  /* analysis so far on 12184 suggests that we're running out of circuit
+     IDs because it looks like we have too many pending destroy
+     cells. Let's see how many we really have pending.
+  */
+  queued_destroys = circuitmux_count_queued_destroy_cells(chan, chan->cmux);
+
+  log_warn(LD_CIRC, "  Circuitmux on this channel has %u circuits, "
+           "of which %u are active. It says it has %"PRId64
+           " destroy cells queued.",
+           circuitmux_num_circuits(chan->cmux),
+           circuitmux_num_active_circuits(chan->cmux),
+           (queued_destroys));
+
+  /* Change this into "if (1)" in order to get more information about
+   * possible failure modes here.  You'll need to know how to use gdb with
+   * Tor: this will make Tor exit with an assertion failure if the cmux is
+   * corrupt. */
+  if (0)
+    circuitmux_assert_okay(chan->cmux);
+
+  channel_dump_statistics(chan, LOG_WARN);
+
+  return 0;
 }
 
 /** If <b>verbose</b> is false, allocate and return a comma-separated list of
@@ -474,8 +447,9 @@ origin_circuit_init(uint8_t purpose, int flags)
  * Also launch a connection to the first OR in the chosen path, if
  * it's not open already.
  */
-origin_circuit_t *
-circuit_establish_circuit(uint8_t purpose, extend_info_t *exit_ei, int flags)
+MOCK_IMPL(origin_circuit_t *,
+circuit_establish_circuit,(uint8_t purpose, extend_info_t *exit_ei,
+                           int flags))
 {
   origin_circuit_t *circ;
   int err_reason = 0;
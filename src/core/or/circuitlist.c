@@ -15,11 +15,12 @@
  * find which circuit it is associated with, based on the channel and the
  * circuit ID in the relay cell.
  *
- * To handle that, we maintain a global list of circuits, and a hashtable
- * mapping [channel,circID] pairs to circuits.  Circuits are added to and
- * removed from this mapping using circuit_set_p_circid_chan() and
- * circuit_set_n_circid_chan().  To look up a circuit from this map, most
- * callers should use circuit_get_by_circid_channel(), though
+ * To handle that, we maintain a global list of circuits, and each channel
+ * has a table (see circid_table.c) mapping its circuit IDs to circuits.
+ * Circuits are added to and removed from these tables using
+ * circuit_set_p_circid_chan() and circuit_set_n_circid_chan().  To look up
+ * a circuit from them, most callers should use
+ * circuit_get_by_circid_channel(), though
  * circuit_get_by_circid_channel_even_if_marked() is appropriate under some
  * circumstances.
  *
@@ -57,13 +58,16 @@
 #include "core/or/or.h"
 #include "core/or/channel.h"
 #include "core/or/channeltls.h"
+#include "core/or/circid_table.h"
 #include "feature/client/circpathbias.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuituse.h"
 #include "core/or/circuitstats.h"
 #include "core/or/circuitpadding.h"
+#include "core/or/congestion_control.h"
 #include "core/or/crypt_path.h"
+#include "core/or/multipath.h"
 #include "core/or/extendinfo.h"
 #include "core/or/trace_probes_circuit.h"
 #include "core/mainloop/connection.h"
@@ -80,6 +84,7 @@
 #include "feature/hs/hs_circuit.h"
 #include "feature/hs/hs_circuitmap.h"
 #include "feature/hs/hs_ident.h"
+#include "feature/nodelist/netparams.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/relay/onion_queue.h"
@@ -177,69 +182,16 @@ CONST_TO_ORIGIN_CIRCUIT(const circuit_t *x)
   return DOWNCAST(origin_circuit_t, x);
 }
 
-/** A map from channel and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
-typedef struct chan_circid_circuit_map_t {
-  HT_ENTRY(chan_circid_circuit_map_t) node;
-  channel_t *chan;
-  circid_t circ_id;
-  circuit_t *circuit;
-  /* For debugging 12184: when was this placeholder item added? */
-  time_t made_placeholder_at;
-} chan_circid_circuit_map_t;
-
-/** Helper for hash tables: compare the channel and circuit ID for a and
- * b, and return less than, equal to, or greater than zero appropriately.
- */
-static inline int
-chan_circid_entries_eq_(chan_circid_circuit_map_t *a,
-                        chan_circid_circuit_map_t *b)
-{
-  return a->chan == b->chan && a->circ_id == b->circ_id;
-}
-
-/** Helper: return a hash based on circuit ID and the pointer value of
- * chan in <b>a</b>. */
-static inline unsigned int
-chan_circid_entry_hash_(chan_circid_circuit_map_t *a)
-{
-  /* Try to squeze the siphash input into 8 bytes to save any extra siphash
-   * rounds.  This hash function is in the critical path. */
-  uintptr_t chan = (uintptr_t) (void*) a->chan;
-  uint32_t array[2];
-  array[0] = a->circ_id;
-  /* The low bits of the channel pointer are uninteresting, since the channel
-   * is a pretty big structure. */
-  array[1] = (uint32_t) (chan >> 6);
-  return (unsigned) siphash24g(array, sizeof(array));
-}
-
-/** Map from [chan,circid] to circuit. */
-static HT_HEAD(chan_circid_map, chan_circid_circuit_map_t)
-     chan_circid_map = HT_INITIALIZER();
-HT_PROTOTYPE(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_);
-HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
-             tor_reallocarray_, tor_free_);
-
-/** The most recently returned entry from circuit_get_by_circid_chan;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-static chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
-
 /** Implementation helper for circuit_set_{p,n}_circid_channel: A circuit ID
  * and/or channel for circ has just changed from <b>old_chan, old_id</b>
- * to <b>chan, id</b>.  Adjust the chan,circid map as appropriate, removing
- * the old entry (if any) and adding a new one. */
+ * to <b>chan, id</b>.  Adjust the circuit ID tables of the channels as
+ * appropriate, removing the old entry (if any) and adding a new one. */
 static void
 circuit_set_circid_chan_helper(circuit_t *circ, int direction,
                                circid_t id,
                                channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
+  circid_table_entry_t *found;
   channel_t *old_chan, **chan_ptr;
   circid_t old_id, *circid_ptr;
   int make_active, attached = 0;
@@ -260,14 +212,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (id == old_id && chan == old_chan)
     return;
 
-  if (_last_circid_chan_ent &&
-      ((old_id == _last_circid_chan_ent->circ_id &&
-        old_chan == _last_circid_chan_ent->chan) ||
-       (id == _last_circid_chan_ent->circ_id &&
-        chan == _last_circid_chan_ent->chan))) {
-    _last_circid_chan_ent = NULL;
-  }
-
   if (old_chan) {
     /*
      * If we're changing channels or ID and had an old channel and a non
@@ -281,12 +225,11 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
       circuitmux_detach_circuit(old_chan->cmux, circ);
     }
 
-    /* we may need to remove it from the conn-circid map */
-    search.circ_id = old_id;
-    search.chan = old_chan;
-    found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+    /* we may need to remove it from the circid table of old_chan */
+    found = old_chan->circid_table ?
+      circid_table_get(old_chan->circid_table, old_id) : NULL;
     if (found) {
-      tor_free(found);
+      circid_table_remove(old_chan->circid_table, found);
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
         --(old_chan->num_n_circuits);
@@ -305,20 +248,12 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (chan == NULL)
     return;
 
-  /* now add the new one to the conn-circid map */
-  search.circ_id = id;
-  search.chan = chan;
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-  if (found) {
-    found->circuit = circ;
-    found->made_placeholder_at = 0;
-  } else {
-    found = tor_malloc_zero(sizeof(chan_circid_circuit_map_t));
-    found->circ_id = id;
-    found->chan = chan;
-    found->circuit = circ;
-    HT_INSERT(chan_circid_map, &chan_circid_map, found);
-  }
+  /* now add the new one to the circid table of chan */
+  if (!chan->circid_table)
+    chan->circid_table = circid_table_new();
+  found = circid_table_add(chan->circid_table, id);
+  found->circuit = circ;
+  found->made_placeholder_at = 0;
 
   /*
    * Attach to the circuitmux if we're changing channels or IDs and
@@ -354,14 +289,13 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
 void
 channel_mark_circid_unusable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *ent;
+  circid_table_entry_t *ent;
+
+  if (!chan->circid_table)
+    chan->circid_table = circid_table_new();
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  ent = circid_table_get(chan->circid_table, id);
 
   if (ent && ent->circuit) {
     /* we have a problem. */
@@ -372,12 +306,9 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
     if (!ent->made_placeholder_at)
       ent->made_placeholder_at = approx_time();
   } else {
-    ent = tor_malloc_zero(sizeof(chan_circid_circuit_map_t));
-    ent->chan = chan;
-    ent->circ_id = id;
+    ent = circid_table_add(chan->circid_table, id);
     /* leave circuit at NULL. */
     ent->made_placeholder_at = approx_time();
-    HT_INSERT(chan_circid_map, &chan_circid_map, ent);
   }
 }
 
@@ -387,22 +318,20 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
 void
 channel_mark_circid_usable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *ent;
+  circid_table_entry_t *ent;
+
+  if (!chan->circid_table)
+    return;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+  ent = circid_table_get(chan->circid_table, id);
   if (ent && ent->circuit) {
     log_warn(LD_BUG, "Tried to mark %u usable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
     return;
   }
-  if (_last_circid_chan_ent == ent)
-    _last_circid_chan_ent = NULL;
-  tor_free(ent);
+  if (ent)
+    circid_table_remove(chan->circid_table, ent);
 }
 
 /** Called to indicate that a DESTROY is pending on <b>chan</b> with
@@ -976,9 +905,10 @@ circuit_purpose_to_string(uint8_t purpose)
 int32_t
 circuit_initial_package_window(void)
 {
-  int32_t num = networkstatus_get_param(NULL, "circwindow", CIRCWINDOW_START,
-                                        CIRCWINDOW_START_MIN,
-                                        CIRCWINDOW_START_MAX);
+  static netparam_t circwindow =
+    NETPARAM_INIT("circwindow", CIRCWINDOW_START,
+                  CIRCWINDOW_START_MIN, CIRCWINDOW_START_MAX);
+  int32_t num = netparam_get(&circwindow);
   /* If the consensus tells us a negative number, we'd assert. */
   if (num < 0)
     num = CIRCWINDOW_START;
@@ -1247,6 +1177,8 @@ circuit_free_(circuit_t *circ)
     SMARTLIST_FOREACH(circ->sendme_last_digests, uint8_t *, d, tor_free(d));
     smartlist_free(circ->sendme_last_digests);
   }
+  congestion_control_free(circ->ccontrol);
+  multipath_circuit_free(circ);
 
   log_info(LD_CIRC, "Circuit %u (id: %" PRIu32 ") has been freed.",
            n_circ_id,
@@ -1338,20 +1270,6 @@ circuit_free_all(void)
 
   smartlist_free(circuits_pending_other_guards);
   circuits_pending_other_guards = NULL;
-
-  {
-    chan_circid_circuit_map_t **elt, **next, *c;
-    for (elt = HT_START(chan_circid_map, &chan_circid_map);
-         elt;
-         elt = next) {
-      c = *elt;
-      next = HT_NEXT_RMV(chan_circid_map, &chan_circid_map, elt);
-
-      tor_assert(c->circuit == NULL);
-      tor_free(c);
-    }
-  }
-  HT_CLEAR(chan_circid_map, &chan_circid_map);
 }
 
 /** Release a crypt_path_reference_t*, which may be NULL. */
@@ -1459,19 +1377,10 @@ static inline circuit_t *
 circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
                                    int *found_entry_out)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
+  circid_table_entry_t *found = NULL;
 
-  if (_last_circid_chan_ent &&
-      circ_id == _last_circid_chan_ent->circ_id &&
-      chan == _last_circid_chan_ent->chan) {
-    found = _last_circid_chan_ent;
-  } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-    _last_circid_chan_ent = found;
-  }
+  if (chan->circid_table)
+    found = circid_table_get(chan->circid_table, circ_id);
   if (found && found->circuit) {
     log_debug(LD_CIRC,
               "circuit_get_by_circid_channel_impl() returning circuit %p for"
@@ -1503,13 +1412,13 @@ circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
         or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
         if (or_circ->p_chan == chan && or_circ->p_circ_id == circ_id) {
           log_warn(LD_BUG,
-                   "circuit matches p_chan, but not in hash table (Bug!)");
+                   "circuit matches p_chan, but not in circid table (Bug!)");
           return circ;
         }
       }
       if (circ->n_chan == chan && circ->n_circ_id == circ_id) {
         log_warn(LD_BUG,
-                 "circuit matches n_chan, but not in hash table (Bug!)");
+                 "circuit matches n_chan, but not in circid table (Bug!)");
         return circ;
       }
     }
@@ -1568,14 +1477,10 @@ circuit_id_in_use_on_channel(circid_t circ_id, channel_t *chan)
 time_t
 circuit_id_when_marked_unusable_on_channel(circid_t circ_id, channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
-
-  memset(&search, 0, sizeof(search));
-  search.circ_id = circ_id;
-  search.chan = chan;
+  circid_table_entry_t *found = NULL;
 
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  if (chan->circid_table)
+    found = circid_table_get(chan->circid_table, circ_id);
 
   if (! found || found->circuit)
     return 0;
@@ -2279,6 +2184,10 @@ circuit_mark_for_close_, (circuit_t *circ, int reason, int line,
   /* Notify the HS subsystem that this circuit is closing. */
   hs_circ_cleanup_on_close(circ);
 
+  /* Take this circuit out of its multipath set, closing the set if need
+   * be. */
+  multipath_circuit_about_to_close(circ);
+
   if (circuits_pending_close == NULL)
     circuits_pending_close = smartlist_new();
 
@@ -2642,6 +2551,33 @@ conns_compare_by_buffer_age_(const void **a_, const void **b_)
 
 #define FRACTION_OF_DATA_TO_RETAIN_ON_OOM 0.90
 
+/** How many times has circuits_handle_oom() been invoked? */
+static uint64_t oom_n_invocations = 0;
+/** How many circuits have we killed in circuits_handle_oom()? */
+static uint64_t oom_n_circuits_killed = 0;
+/** How many directory connections have we killed in circuits_handle_oom()? */
+static uint64_t oom_n_dirconns_killed = 0;
+/** How many bytes have we recovered in circuits_handle_oom()? */
+static uint64_t oom_bytes_recovered = 0;
+
+/** Set each of the non-NULL arguments to the corresponding total for every
+ * call to circuits_handle_oom() so far. */
+void
+circuits_get_oom_stats(uint64_t *n_invocations_out,
+                       uint64_t *n_circuits_killed_out,
+                       uint64_t *n_dirconns_killed_out,
+                       uint64_t *bytes_recovered_out)
+{
+  if (n_invocations_out)
+    *n_invocations_out = oom_n_invocations;
+  if (n_circuits_killed_out)
+    *n_circuits_killed_out = oom_n_circuits_killed;
+  if (n_dirconns_killed_out)
+    *n_dirconns_killed_out = oom_n_dirconns_killed;
+  if (bytes_recovered_out)
+    *bytes_recovered_out = oom_bytes_recovered;
+}
+
 /** We're out of memory for cells, having allocated <b>current_allocation</b>
  * bytes' worth.  Kill the 'worst' circuits until we're under
  * FRACTION_OF_DATA_TO_RETAIN_ON_OOM of our maximum usage. */
@@ -2656,6 +2592,7 @@ circuits_handle_oom(size_t current_allocation)
   int n_circuits_killed=0;
   int n_dirconns_killed=0;
   uint32_t now_ts;
+  ++oom_n_invocations;
   log_notice(LD_GENERAL, "We're low on memory (cell queues total alloc:"
              " %"TOR_PRIuSZ" buffer total alloc: %" TOR_PRIuSZ ","
              " tor compress total alloc: %" TOR_PRIuSZ
@@ -2755,6 +2692,9 @@ circuits_handle_oom(size_t current_allocation)
   } SMARTLIST_FOREACH_END(circ);
 
  done_recovering_mem:
+  oom_n_circuits_killed += n_circuits_killed;
+  oom_n_dirconns_killed += n_dirconns_killed;
+  oom_bytes_recovered += mem_recovered;
 
   log_notice(LD_GENERAL, "Removed %"TOR_PRIuSZ" bytes by killing %d circuits; "
              "%d circuits remain alive. Also killed %d non-linked directory "
@@ -234,6 +234,10 @@ int circuit_count_pending_on_channel(channel_t *chan);
 MOCK_DECL(void, assert_circuit_ok,(const circuit_t *c));
 void circuit_free_all(void);
 void circuits_handle_oom(size_t current_allocation);
+void circuits_get_oom_stats(uint64_t *n_invocations_out,
+                            uint64_t *n_circuits_killed_out,
+                            uint64_t *n_dirconns_killed_out,
+                            uint64_t *bytes_recovered_out);
 
 void circuit_clear_testing_cell_stats(circuit_t *circ);
 
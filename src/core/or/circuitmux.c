@@ -146,6 +146,10 @@ circuitmux_make_circuit_inactive(circuitmux_t *cmux, circuit_t *circ);
 
 /** Count the destroy balance to debug destroy queue logic */
 static int64_t global_destroy_ctr = 0;
+/** How many cells have circuitmuxes transmitted, in total? */
+static uint64_t global_n_cells_xmit = 0;
+/** How many destroy cells have circuitmuxes transmitted, in total? */
+static uint64_t global_n_destroys_xmit = 0;
 
 /* Function definitions */
 
@@ -1133,6 +1137,7 @@ circuitmux_notify_xmit_cells(circuitmux_t *cmux, circuit_t *circ,
   if (hashent->muxinfo.cell_count == 0) becomes_inactive = 1;
   /* Adjust the mux cell counter */
   cmux->n_cells -= n_cells;
+  global_n_cells_xmit += n_cells;
 
   /*
    * We call notify_xmit_cells() before making the circuit inactive if needed,
@@ -1166,6 +1171,7 @@ circuitmux_notify_xmit_destroy(circuitmux_t *cmux)
 
   --(cmux->destroy_ctr);
   --(global_destroy_ctr);
+  ++global_n_destroys_xmit;
   log_debug(LD_CIRC,
             "Cmux at %p sent a destroy, cmux counter is now %"PRId64", "
             "global counter is now %"PRId64,
@@ -1174,6 +1180,22 @@ circuitmux_notify_xmit_destroy(circuitmux_t *cmux)
             (global_destroy_ctr));
 }
 
+/**
+ * Set *<b>n_cells_xmit_out</b> to the number of cells, and
+ * *<b>n_destroys_xmit_out</b> to the number of destroy cells, that all
+ * circuitmuxes have transmitted, and *<b>n_destroys_queued_out</b> to the
+ * number of destroy cells that are queued on them now.
+ */
+void
+circuitmux_get_global_stats(uint64_t *n_cells_xmit_out,
+                            uint64_t *n_destroys_xmit_out,
+                            int64_t *n_destroys_queued_out)
+{
+  *n_cells_xmit_out = global_n_cells_xmit;
+  *n_destroys_xmit_out = global_n_destroys_xmit;
+  *n_destroys_queued_out = global_destroy_ctr;
+}
+
 /*DOCDOC */
 void
 circuitmux_append_destroy_cell(channel_t *chan,
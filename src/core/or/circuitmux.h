@@ -127,6 +127,10 @@ MOCK_DECL(unsigned int, circuitmux_num_cells, (circuitmux_t *cmux));
 unsigned int circuitmux_num_circuits(circuitmux_t *cmux);
 unsigned int circuitmux_num_active_circuits(circuitmux_t *cmux);
 
+void circuitmux_get_global_stats(uint64_t *n_cells_xmit_out,
+                                 uint64_t *n_destroys_xmit_out,
+                                 int64_t *n_destroys_queued_out);
+
 /* Debuging interface - slow. */
 int64_t circuitmux_count_queued_destroy_cells(const channel_t *chan,
                                               const circuitmux_t *cmux);
@@ -11,16 +11,34 @@
  * those that have sent few cells over time, prioritizing recent times
  * more than older ones.
  *
- * Specifically, a cell sent at time "now" has weight 1, but a time X ticks
- * before now has weight ewma_scale_factor ^ X , where ewma_scale_factor is
- * between 0.0 and 1.0.
+ * Specifically, a cell sent at time "now" has weight 1, but a cell sent X
+ * halflives before now has weight 2 ^ -X, where the halflife comes from the
+ * CircuitPriorityHalflife option or consensus parameter.
  *
  * For efficiency, we do not re-scale these averages every time we send a
  * cell: that would be horribly inefficient.  Instead, we we keep the cell
- * count on all circuits on the same circuitmux scaled relative to a single
- * tick.  When we add a new cell, we scale its weight depending on the time
- * that has elapsed since the tick.  We do re-scale the circuits on the
- * circuitmux periodically, so that we don't overflow double.
+ * count on all circuits scaled relative to the start of a single global
+ * "epoch".  When we add a new cell, we scale its weight up depending on the
+ * time that has elapsed since the start of the epoch.  The counts are
+ * fixed-point integers; once the weight of a new cell reaches
+ * 2^EWMA_EPOCH_SHIFT, we start a new epoch, and each circuitmux lazily
+ * shifts its circuits' counts right by EWMA_EPOCH_SHIFT bits the next time
+ * it is used.  With the default halflife, that happens every 8 minutes.
+ *
+ * The active circuits on each circuitmux are kept in an intrusive d-ary
+ * min-heap, ordered by their cell counts.
+ *
+ * This module also implements a second policy, qdelay_policy, which blends
+ * the EWMA with how long each circuit's first queued cell has been waiting.
+ * It gives that cell a deadline: the time it was queued, plus an allowance
+ * that grows with the circuit's EWMA cell count, at
+ * CircuitPriorityQueueDelayUsecPerCell microseconds per recent cell.  It
+ * then sends from the circuit with the earliest deadline.  Quiet circuits
+ * still go first, but a busy circuit's cells can no longer wait behind
+ * slightly quieter ones forever, which bounds the tail latency on congested
+ * channels.  Since every circuit's priority falls at the same rate as its
+ * cell ages, a deadline only changes when a circuit sends a cell, and the
+ * same heap works for both policies.
  *
  *
  * This module should be used through the interfaces in circuitmux.c, which it
@@ -35,45 +53,59 @@
 #include <math.h>
 
 #include "core/or/or.h"
+#include "core/or/circuitlist.h"
 #include "core/or/circuitmux.h"
 #include "core/or/circuitmux_ewma.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
 #include "feature/nodelist/networkstatus.h"
 #include "app/config/or_options_st.h"
+#include "core/or/cell_queue_st.h"
+#include "core/or/or_circuit_st.h"
 
 /*** EWMA parameter #defines ***/
 
-/** How long does a tick last (seconds)? */
-#define EWMA_TICK_LEN 10
+/** How many fractional bits of precision do we keep when measuring how many
+ * halflives have elapsed since the start of the epoch? */
+#define EWMA_ELAPSED_FRAC_BITS 8
 
-/** The default per-tick scale factor, if it hasn't been overridden by a
- * consensus or a configuration setting.  zero means "disabled". */
-#define EWMA_DEFAULT_HALFLIFE 0.0
+/** How many children does each node in the active circuit heap have? */
+#define EWMA_HEAP_ARITY 4
 
 /*** Some useful constant #defines ***/
 
 /** Any halflife smaller than this number of seconds is considered to be
  * "disabled". */
 #define EPSILON 0.00001
-/** The natural logarithm of 0.5. */
-#define LOG_ONEHALF -0.69314718055994529
+
+/** The fixed-point representation of 1.0 in cell_ewma_t.cell_count. */
+#define EWMA_ONE (UINT64_C(1) << EWMA_FRAC_BITS)
+
+/** The largest allowance that the queue-delay policy will give a cell,
+ * however busy its circuit has been. */
+#define QDELAY_MAX_ALLOWANCE_MSEC 10000
 
 /*** Static declarations for circuitmux_ewma.c ***/
 
 static void add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
-static int compare_cell_ewma_counts(const void *p1, const void *p2);
+static int compare_cell_ewma_counts(const cell_ewma_t *e1,
+                                    const cell_ewma_t *e2);
+static int compare_cell_ewma(const ewma_policy_data_t *pol,
+                             const cell_ewma_t *e1, const cell_ewma_t *e2);
+static void qdelay_update_deadline(ewma_policy_data_t *pol,
+                                   ewma_policy_circ_data_t *cdata);
 static circuit_t * cell_ewma_to_circuit(cell_ewma_t *ewma);
-static inline double get_scale_factor(unsigned from_tick, unsigned to_tick);
-static cell_ewma_t * pop_first_cell_ewma(ewma_policy_data_t *pol);
 static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
-static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
-static void scale_active_circuits(ewma_policy_data_t *pol,
-                                  unsigned cur_tick);
+static void cell_ewma_heap_sift_down(ewma_policy_data_t *pol, int idx);
+static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned epoch);
+static void scale_active_circuits(ewma_policy_data_t *pol, unsigned epoch);
+static void catch_up_active_circuits(ewma_policy_data_t *pol);
+static unsigned cell_ewma_get_epoch(void);
 
 /*** Circuitmux policy methods ***/
 
 static circuitmux_policy_data_t * ewma_alloc_cmux_data(circuitmux_t *cmux);
+static circuitmux_policy_data_t * qdelay_alloc_cmux_data(circuitmux_t *cmux);
 static void ewma_free_cmux_data(circuitmux_t *cmux,
                                 circuitmux_policy_data_t *pol_data);
 static circuitmux_policy_circ_data_t *
@@ -110,11 +142,29 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
 
 /*** EWMA global variables ***/
 
-/** The per-tick scale factor to be used when computing cell-count EWMA
- * values.  (A cell sent N ticks before the start of the current tick
- * has value ewma_scale_factor ** N.)
- */
-static double ewma_scale_factor = 0.1;
+/** Default value for the CircuitPriorityHalflifeMsec consensus parameter in
+ * msec. */
+#define CMUX_PRIORITY_HALFLIFE_MSEC_DEFAULT 30000
+
+/** The halflife, in msec, to be used when computing cell-count EWMA values.
+ * (A cell sent N halflives before the start of the current epoch has value
+ * 2 ** -N.) */
+static uint64_t ewma_halflife_msec = CMUX_PRIORITY_HALFLIFE_MSEC_DEFAULT;
+
+/** Default value for the CircuitPriorityQueueDelayUsecPerCell consensus
+ * parameter. */
+#define CMUX_QDELAY_USEC_PER_CELL_DEFAULT 10000
+
+/** True iff new channels should use qdelay_policy rather than ewma_policy. */
+static int qdelay_enabled = 0;
+
+/** For the queue-delay policy: how many microseconds of allowance do we give
+ * a cell for each cell in its circuit's EWMA cell count? */
+static uint64_t qdelay_usec_per_cell = CMUX_QDELAY_USEC_PER_CELL_DEFAULT;
+
+/** ewma_frac_scale[i] is 2 ** (i / 2**EWMA_ELAPSED_FRAC_BITS), as a
+ * fixed-point number with EWMA_FRAC_BITS bits after the binary point. */
+static uint64_t ewma_frac_scale[1 << EWMA_ELAPSED_FRAC_BITS];
 
 /*** EWMA circuitmux_policy_t method table ***/
 
@@ -131,26 +181,32 @@ circuitmux_policy_t ewma_policy = {
   /*.cmp_cmux =*/ ewma_cmp_cmux
 };
 
-/** Have we initialized the ewma tick-counting logic? */
+/*** Queue-delay circuitmux_policy_t method table ***/
+
+/* Apart from allocating its data, this shares every method with EWMA: they
+ * check ewma_policy_data_t.by_queue_delay wherever the two differ. */
+circuitmux_policy_t qdelay_policy = {
+  /*.alloc_cmux_data =*/ qdelay_alloc_cmux_data,
+  /*.free_cmux_data =*/ ewma_free_cmux_data,
+  /*.alloc_circ_data =*/ ewma_alloc_circ_data,
+  /*.free_circ_data =*/ ewma_free_circ_data,
+  /*.notify_circ_active =*/ ewma_notify_circ_active,
+  /*.notify_circ_inactive =*/ ewma_notify_circ_inactive,
+  /*.notify_set_n_cells =*/ NULL,
+  /*.notify_xmit_cells =*/ ewma_notify_xmit_cells,
+  /*.pick_active_circuit =*/ ewma_pick_active_circuit,
+  /*.cmp_cmux =*/ ewma_cmp_cmux
+};
+
+/** Have we initialized the ewma epoch-counting logic? */
 static int ewma_ticks_initialized = 0;
-/** At what monotime_coarse_t did the current tick begin? */
-static monotime_coarse_t start_of_current_tick;
-/** What is the number of the current tick? */
-static unsigned current_tick_num;
+/** At what monotime_coarse_t did the current epoch begin? */
+static monotime_coarse_t start_of_current_epoch;
+/** What is the number of the current epoch? */
+static unsigned current_epoch_num;
 
 /*** EWMA method implementations using the below EWMA helper functions ***/
 
-/** Compute and return the current cell_ewma tick. */
-static inline unsigned int
-cell_ewma_get_tick(void)
-{
-  monotime_coarse_t now;
-  monotime_coarse_get(&now);
-  int32_t msec_diff = monotime_coarse_diff_msec32(&start_of_current_tick,
-                                                  &now);
-  return current_tick_num + msec_diff / (1000*EWMA_TICK_LEN);
-}
-
 /**
  * Allocate an ewma_policy_data_t and upcast it to a circuitmux_policy_data_t;
  * this is called when setting the policy on a circuitmux_t to ewma_policy.
@@ -165,8 +221,26 @@ ewma_alloc_cmux_data(circuitmux_t *cmux)
 
   pol = tor_malloc_zero(sizeof(*pol));
   pol->base_.magic = EWMA_POL_DATA_MAGIC;
-  pol->active_circuit_pqueue = smartlist_new();
-  pol->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
+  pol->epoch = cell_ewma_get_epoch();
+
+  return TO_CMUX_POL_DATA(pol);
+}
+
+/**
+ * As ewma_alloc_cmux_data(), but for qdelay_policy.
+ */
+
+static circuitmux_policy_data_t *
+qdelay_alloc_cmux_data(circuitmux_t *cmux)
+{
+  ewma_policy_data_t *pol = NULL;
+
+  tor_assert(cmux);
+
+  pol = tor_malloc_zero(sizeof(*pol));
+  pol->base_.magic = EWMA_POL_DATA_MAGIC;
+  pol->epoch = cell_ewma_get_epoch();
+  pol->by_queue_delay = 1;
 
   return TO_CMUX_POL_DATA(pol);
 }
@@ -186,7 +260,7 @@ ewma_free_cmux_data(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  smartlist_free(pol->active_circuit_pqueue);
+  tor_free(pol->active_circuits);
   memwipe(pol, 0xda, sizeof(ewma_policy_data_t));
   tor_free(pol);
 }
@@ -222,8 +296,8 @@ ewma_alloc_circ_data(circuitmux_t *cmux,
    * Initialize the cell_ewma_t structure (formerly in
    * init_circuit_base())
    */
-  cdata->cell_ewma.last_adjusted_tick = cell_ewma_get_tick();
-  cdata->cell_ewma.cell_count = 0.0;
+  cdata->cell_ewma.epoch = cell_ewma_get_epoch();
+  cdata->cell_ewma.cell_count = 0;
   cdata->cell_ewma.heap_index = -1;
   if (direction == CELL_DIRECTION_IN) {
     cdata->cell_ewma.is_for_p_chan = 1;
@@ -260,7 +334,7 @@ ewma_free_circ_data(circuitmux_t *cmux,
 
 /**
  * Handle circuit activation; this inserts the circuit's cell_ewma into
- * the active_circuits_pqueue.
+ * the active_circuits heap.
  */
 
 static void
@@ -280,12 +354,14 @@ ewma_notify_circ_active(circuitmux_t *cmux,
   pol = TO_EWMA_POL_DATA(pol_data);
   cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
 
+  if (pol->by_queue_delay)
+    qdelay_update_deadline(pol, cdata);
   add_cell_ewma(pol, &(cdata->cell_ewma));
 }
 
 /**
  * Handle circuit deactivation; this removes the circuit's cell_ewma from
- * the active_circuits_pqueue.
+ * the active_circuits heap.
  */
 
 static void
@@ -323,9 +399,9 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
 {
   ewma_policy_data_t *pol = NULL;
   ewma_policy_circ_data_t *cdata = NULL;
-  unsigned int tick;
-  double fractional_tick, ewma_increment;
-  cell_ewma_t *cell_ewma, *tmp;
+  unsigned int epoch;
+  uint64_t scale, ewma_increment;
+  cell_ewma_t *cell_ewma;
 
   tor_assert(cmux);
   tor_assert(pol_data);
@@ -337,27 +413,33 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
 
   /* Rescale the EWMAs if needed */
-  tick = cell_ewma_get_current_tick_and_fraction(&fractional_tick);
+  scale = cell_ewma_get_current_scale(&epoch);
 
-  if (tick != pol->active_circuit_pqueue_last_recalibrated) {
-    scale_active_circuits(pol, tick);
+  if (epoch != pol->epoch) {
+    scale_active_circuits(pol, epoch);
   }
 
   /* How much do we adjust the cell count in cell_ewma by? */
-  ewma_increment =
-    ((double)(n_cells)) * pow(ewma_scale_factor, -fractional_tick);
+  ewma_increment = ((uint64_t)n_cells) * scale;
 
-  /* Do the adjustment */
+  /* Do the adjustment, saturating instead of wrapping around. */
   cell_ewma = &(cdata->cell_ewma);
-  cell_ewma->cell_count += ewma_increment;
+  if (cell_ewma->cell_count > UINT64_MAX - ewma_increment)
+    cell_ewma->cell_count = UINT64_MAX;
+  else
+    cell_ewma->cell_count += ewma_increment;
+
+  /* A new cell is at the head of the circuit's queue now. */
+  if (pol->by_queue_delay)
+    qdelay_update_deadline(pol, cdata);
 
   /*
    * Since we just sent on this circuit, it should be at the head of
-   * the queue.  Pop the head, assert that it matches, then re-add.
+   * the queue.  Its count only went up (and its deadline, if any, may have
+   * moved either way), so move it down to where it belongs.
    */
-  tmp = pop_first_cell_ewma(pol);
-  tor_assert(tmp == cell_ewma);
-  add_cell_ewma(pol, cell_ewma);
+  tor_assert(cell_ewma->heap_index == 0);
+  cell_ewma_heap_sift_down(pol, 0);
 }
 
 /**
@@ -379,9 +461,9 @@ ewma_pick_active_circuit(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  if (smartlist_len(pol->active_circuit_pqueue) > 0) {
+  if (pol->n_active_circuits > 0) {
     /* Get the head of the queue */
-    cell_ewma = smartlist_get(pol->active_circuit_pqueue, 0);
+    cell_ewma = pol->active_circuits[0];
     circ = cell_ewma_to_circuit(cell_ewma);
   }
 
@@ -409,19 +491,23 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
   p2 = TO_EWMA_POL_DATA(pol_data_2);
 
   if (p1 != p2) {
+    /* Make sure both queues are scaled to the same epoch. */
+    catch_up_active_circuits(p1);
+    catch_up_active_circuits(p2);
+
     /* Get the head cell_ewma_t from each queue */
-    if (smartlist_len(p1->active_circuit_pqueue) > 0) {
-      ce1 = smartlist_get(p1->active_circuit_pqueue, 0);
+    if (p1->n_active_circuits > 0) {
+      ce1 = p1->active_circuits[0];
     }
 
-    if (smartlist_len(p2->active_circuit_pqueue) > 0) {
-      ce2 = smartlist_get(p2->active_circuit_pqueue, 0);
+    if (p2->n_active_circuits > 0) {
+      ce2 = p2->active_circuits[0];
     }
 
     /* Got both of them? */
     if (ce1 != NULL && ce2 != NULL) {
       /* Pick whichever one has the better best circuit */
-      return compare_cell_ewma_counts(ce1, ce2);
+      return compare_cell_ewma(p1, ce1, ce2);
     } else {
       if (ce1 != NULL) {
         /* We only have a circuit on cmux_1, so prefer it */
@@ -441,11 +527,9 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
 }
 
 /** Helper for sorting cell_ewma_t values in their priority queue. */
-static int
-compare_cell_ewma_counts(const void *p1, const void *p2)
+static inline int
+compare_cell_ewma_counts(const cell_ewma_t *e1, const cell_ewma_t *e2)
 {
-  const cell_ewma_t *e1 = p1, *e2 = p2;
-
   if (e1->cell_count < e2->cell_count)
     return -1;
   else if (e1->cell_count > e2->cell_count)
@@ -454,6 +538,26 @@ compare_cell_ewma_counts(const void *p1, const void *p2)
     return 0;
 }
 
+/** Helper for sorting cell_ewma_t values in the priority queue of
+ * <b>pol</b>: by deadline for the queue-delay policy, or else by count.
+ * Deadlines are coarse monotonic stamps, which can wrap around, so we
+ * compare them by their difference. */
+static inline int
+compare_cell_ewma(const ewma_policy_data_t *pol,
+                  const cell_ewma_t *e1, const cell_ewma_t *e2)
+{
+  if (pol->by_queue_delay) {
+    int32_t diff = (int32_t) (e1->deadline - e2->deadline);
+    if (diff < 0)
+      return -1;
+    else if (diff > 0)
+      return 1;
+    else
+      return 0;
+  }
+  return compare_cell_ewma_counts(e1, e2);
+}
+
 /** Given a cell_ewma_t, return a pointer to the circuit containing it. */
 static circuit_t *
 cell_ewma_to_circuit(cell_ewma_t *ewma)
@@ -490,58 +594,82 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
    This, however, would mean we'd need to re-scale *ALL* old circuits every
    time we wanted to send a cell.
 
-   So as a compromise, we divide time into 'ticks' (currently, 10-second
-   increments) and say that a cell sent at the start of a current tick is
-   worth 1.0, a cell sent N seconds before the start of the current tick is
-   worth F^N, and a cell sent N seconds after the start of the current tick is
-   worth F^-N.  This way we don't overflow, and we don't need to constantly
-   rescale.
+   So as a compromise, we divide time into 'epochs' (currently, 16
+   halflives long) and say that a cell sent at the start of the current epoch
+   is worth 1.0, a cell sent N seconds before the start of the current epoch
+   is worth F^N, and a cell sent N seconds after the start of the current
+   epoch is worth F^-N.  Because we choose F so that an epoch is a whole
+   number of halflives, moving a count from one epoch to the next is just a
+   right shift, which we do lazily.  This way we don't overflow, and we don't
+   need to constantly rescale.
  */
 
 /**
- * Initialize the system that tells which ewma tick we are in.
+ * Initialize the system that tells which ewma epoch we are in.
  */
 STATIC void
 cell_ewma_initialize_ticks(void)
 {
+  int i;
   if (ewma_ticks_initialized)
     return;
-  monotime_coarse_get(&start_of_current_tick);
-  crypto_rand((char*)&current_tick_num, sizeof(current_tick_num));
+  monotime_coarse_get(&start_of_current_epoch);
+  crypto_rand((char*)&current_epoch_num, sizeof(current_epoch_num));
+  for (i = 0; i < (1 << EWMA_ELAPSED_FRAC_BITS); ++i) {
+    ewma_frac_scale[i] = (uint64_t)
+      (EWMA_ONE * pow(2.0, ((double)i) / (1 << EWMA_ELAPSED_FRAC_BITS)));
+  }
   ewma_ticks_initialized = 1;
 }
 
-/** Compute the current cell_ewma tick and the fraction of the tick that has
- * elapsed between the start of the tick and the current time.  Return the
- * former and store the latter in *<b>remainder_out</b>.
+/** Compute the current cell_ewma epoch, and the weight of a cell sent now
+ * relative to one sent at the start of that epoch.  Return the latter, as
+ * a fixed-point number with EWMA_FRAC_BITS bits after the binary point, and
+ * store the former in *<b>epoch_out</b>.
  *
- * These tick values are not meant to be shared between Tor instances, or used
- * for other purposes. */
-STATIC unsigned
-cell_ewma_get_current_tick_and_fraction(double *remainder_out)
+ * These epoch values are not meant to be shared between Tor instances, or
+ * used for other purposes. */
+STATIC uint64_t
+cell_ewma_get_current_scale(unsigned *epoch_out)
 {
   if (BUG(!ewma_ticks_initialized)) {
     cell_ewma_initialize_ticks(); // LCOV_EXCL_LINE
   }
   monotime_coarse_t now;
   monotime_coarse_get(&now);
-  int32_t msec_diff = monotime_coarse_diff_msec32(&start_of_current_tick,
-                                                  &now);
-  if (msec_diff > (1000*EWMA_TICK_LEN)) {
-    unsigned ticks_difference = msec_diff / (1000*EWMA_TICK_LEN);
-    monotime_coarse_add_msec(&start_of_current_tick,
-                             &start_of_current_tick,
-                             ticks_difference * 1000 * EWMA_TICK_LEN);
-    current_tick_num += ticks_difference;
-    msec_diff %= 1000*EWMA_TICK_LEN;
+  int64_t msec_diff = monotime_coarse_diff_msec(&start_of_current_epoch,
+                                                &now);
+  if (msec_diff < 0)
+    msec_diff = 0;
+
+  /* How many halflives have elapsed since the start of the epoch? */
+  uint64_t elapsed = (((uint64_t)msec_diff) << EWMA_ELAPSED_FRAC_BITS) /
+    ewma_halflife_msec;
+  uint64_t whole = elapsed >> EWMA_ELAPSED_FRAC_BITS;
+
+  if (whole >= EWMA_EPOCH_SHIFT) {
+    uint64_t epochs_difference = whole / EWMA_EPOCH_SHIFT;
+    uint64_t msec = epochs_difference * EWMA_EPOCH_SHIFT * ewma_halflife_msec;
+    monotime_coarse_add_msec(&start_of_current_epoch,
+                             &start_of_current_epoch,
+                             (uint32_t) MIN(msec, UINT32_MAX));
+    current_epoch_num += (unsigned) epochs_difference;
+    elapsed -= (epochs_difference * EWMA_EPOCH_SHIFT)
+      << EWMA_ELAPSED_FRAC_BITS;
+    whole = elapsed >> EWMA_ELAPSED_FRAC_BITS;
+    /* If msec got clipped, we might still be more than an epoch past the
+     * start of the current one; that's fine, but don't overflow. */
+    if (whole >= EWMA_EPOCH_SHIFT) {
+      whole = EWMA_EPOCH_SHIFT - 1;
+      elapsed = (whole << EWMA_ELAPSED_FRAC_BITS) |
+        ((1 << EWMA_ELAPSED_FRAC_BITS) - 1);
+    }
   }
-  *remainder_out = ((double)msec_diff) / (1.0e3 * EWMA_TICK_LEN);
-  return current_tick_num;
+  *epoch_out = current_epoch_num;
+  return ewma_frac_scale[elapsed & ((1 << EWMA_ELAPSED_FRAC_BITS) - 1)]
+    << whole;
 }
 
-/* Default value for the CircuitPriorityHalflifeMsec consensus parameter in
- * msec. */
-#define CMUX_PRIORITY_HALFLIFE_MSEC_DEFAULT 30000
 /* Minimum and maximum value for the CircuitPriorityHalflifeMsec consensus
  * parameter. */
 #define CMUX_PRIORITY_HALFLIFE_MSEC_MIN 1
@@ -592,6 +720,19 @@ get_circuit_priority_halflife(const or_options_t *options,
   return halflife;
 }
 
+/** Return true iff new channels should use the queue-delay policy, according
+ * to the options if they say, or else to the consensus. */
+static int
+get_circuit_priority_queue_delay(const or_options_t *options,
+                                 const networkstatus_t *consensus)
+{
+  if (options && options->CircuitPriorityQueueDelay != -1)
+    return options->CircuitPriorityQueueDelay;
+
+  return networkstatus_get_param(consensus, "CircuitPriorityQueueDelay",
+                                 0, 0, 1);
+}
+
 /** Adjust the global cell scale factor based on <b>options</b> */
 void
 cmux_ewma_set_options(const or_options_t *options,
@@ -599,6 +740,7 @@ cmux_ewma_set_options(const or_options_t *options,
 {
   double halflife;
   const char *source;
+  int enable_qdelay;
 
   cell_ewma_initialize_ticks();
 
@@ -606,62 +748,178 @@ cmux_ewma_set_options(const or_options_t *options,
    * valid configured value or the default one. */
   halflife = get_circuit_priority_halflife(options, consensus, &source);
 
-  /* convert halflife into halflife-per-tick. */
-  halflife /= EWMA_TICK_LEN;
-  /* compute per-tick scale factor. */
-  ewma_scale_factor = exp(LOG_ONEHALF / halflife);
+  /* convert halflife into msec, and don't let it be zero. */
+  ewma_halflife_msec = (uint64_t) (halflife * 1000.0);
+  if (ewma_halflife_msec < 1)
+    ewma_halflife_msec = 1;
   log_info(LD_OR,
            "Enabled cell_ewma algorithm because of value in %s; "
-           "scale factor is %f per %d seconds",
-           source, ewma_scale_factor, EWMA_TICK_LEN);
+           "halflife is %"PRIu64" msec",
+           source, ewma_halflife_msec);
+
+  qdelay_usec_per_cell = networkstatus_get_param(consensus,
+                                 "CircuitPriorityQueueDelayUsecPerCell",
+                                 CMUX_QDELAY_USEC_PER_CELL_DEFAULT,
+                                 0, 1000000);
+  enable_qdelay = get_circuit_priority_queue_delay(options, consensus);
+  if (enable_qdelay != qdelay_enabled) {
+    log_info(LD_OR, "New channels will use the %s circuit priority policy.",
+             enable_qdelay ? "queue-delay" : "EWMA");
+  }
+  qdelay_enabled = enable_qdelay;
 }
 
-/** Return the multiplier necessary to convert the value of a cell sent in
- * 'from_tick' to one sent in 'to_tick'. */
-static inline double
-get_scale_factor(unsigned from_tick, unsigned to_tick)
+/** Return the circuitmux policy that new channels should use. */
+circuitmux_policy_t *
+cmux_ewma_get_default_policy(void)
 {
-  /* This math can wrap around, but that's okay: unsigned overflow is
-     well-defined */
-  int diff = (int)(to_tick - from_tick);
-  return pow(ewma_scale_factor, diff);
+  return qdelay_enabled ? &qdelay_policy : &ewma_policy;
+}
+
+/** Return the current cell_ewma epoch. */
+static unsigned
+cell_ewma_get_epoch(void)
+{
+  unsigned epoch;
+  if (!ewma_ticks_initialized)
+    return current_epoch_num;
+  (void) cell_ewma_get_current_scale(&epoch);
+  return epoch;
 }
 
 /** Adjust the cell count of <b>ewma</b> so that it is scaled with respect to
- * <b>cur_tick</b> */
+ * <b>epoch</b> */
 static void
-scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick)
+scale_single_cell_ewma(cell_ewma_t *ewma, unsigned epoch)
 {
-  double factor = get_scale_factor(ewma->last_adjusted_tick, cur_tick);
-  ewma->cell_count *= factor;
-  ewma->last_adjusted_tick = cur_tick;
+  /* This math can wrap around, but that's okay: unsigned overflow is
+     well-defined */
+  unsigned diff = epoch - ewma->epoch;
+  if (diff == 0)
+    return;
+  if (diff >= 64 / EWMA_EPOCH_SHIFT)
+    ewma->cell_count = 0;
+  else
+    ewma->cell_count >>= diff * EWMA_EPOCH_SHIFT;
+  ewma->epoch = epoch;
 }
 
-/** Adjust the cell count of every active circuit on <b>chan</b> so
- * that they are scaled with respect to <b>cur_tick</b> */
+/** Adjust the cell count of every active circuit on <b>pol</b> so
+ * that they are scaled with respect to <b>epoch</b> */
 static void
-scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
+scale_active_circuits(ewma_policy_data_t *pol, unsigned epoch)
 {
-  double factor;
+  int i;
 
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
 
-  factor =
-    get_scale_factor(
-      pol->active_circuit_pqueue_last_recalibrated,
-      cur_tick);
   /** Ordinarily it isn't okay to change the value of an element in a heap,
-   * but it's okay here, since we are preserving the order. */
-  SMARTLIST_FOREACH_BEGIN(
-      pol->active_circuit_pqueue,
-      cell_ewma_t *, e) {
-    tor_assert(e->last_adjusted_tick ==
-               pol->active_circuit_pqueue_last_recalibrated);
-    e->cell_count *= factor;
-    e->last_adjusted_tick = cur_tick;
-  } SMARTLIST_FOREACH_END(e);
-  pol->active_circuit_pqueue_last_recalibrated = cur_tick;
+   * but it's okay here, since shifting every count by the same amount
+   * preserves their order. */
+  for (i = 0; i < pol->n_active_circuits; ++i) {
+    cell_ewma_t *e = pol->active_circuits[i];
+    tor_assert(e->epoch == pol->epoch);
+    scale_single_cell_ewma(e, epoch);
+  }
+  pol->epoch = epoch;
+}
+
+/** Make sure that the active circuits on <b>pol</b> are scaled with
+ * respect to the current epoch. */
+static void
+catch_up_active_circuits(ewma_policy_data_t *pol)
+{
+  unsigned epoch = cell_ewma_get_epoch();
+  if (epoch != pol->epoch)
+    scale_active_circuits(pol, epoch);
+}
+
+/** For the queue-delay policy: scale <b>cdata</b> (and the rest of
+ * <b>pol</b>) to the current epoch, and set its deadline from the first
+ * cell on the circuit's queue.  <b>cdata</b> must be at the head of
+ * <b>pol</b>'s heap, or not in it at all. */
+static void
+qdelay_update_deadline(ewma_policy_data_t *pol,
+                       ewma_policy_circ_data_t *cdata)
+{
+  cell_ewma_t *ewma = &(cdata->cell_ewma);
+  const cell_queue_t *queue;
+  const packed_cell_t *head;
+  uint32_t head_stamp;
+  uint64_t scale, n_recent, allowance_msec;
+  unsigned epoch;
+
+  scale = cell_ewma_get_current_scale(&epoch);
+  if (epoch != pol->epoch)
+    scale_active_circuits(pol, epoch);
+  scale_single_cell_ewma(ewma, epoch);
+
+  if (ewma->is_for_p_chan)
+    queue = &(CONST_TO_OR_CIRCUIT(cdata->circ)->p_chan_cells);
+  else
+    queue = &(cdata->circ->n_chan_cells);
+  head = TOR_SIMPLEQ_FIRST(&queue->head);
+  head_stamp = head ? head->inserted_timestamp : monotime_coarse_get_stamp();
+
+  /* The current weight of the cells this circuit has sent; capped, so that
+   * the multiplication below can't overflow. */
+  n_recent = MIN(ewma->cell_count / scale,
+                 QDELAY_MAX_ALLOWANCE_MSEC * UINT64_C(1000));
+  allowance_msec = MIN(n_recent * qdelay_usec_per_cell / 1000,
+                       QDELAY_MAX_ALLOWANCE_MSEC);
+  ewma->deadline = head_stamp + (uint32_t)
+    monotime_msec_to_approx_coarse_stamp_units(allowance_msec);
+}
+
+/** Place <b>ewma</b> at position <b>idx</b> in <b>pol</b>'s heap. */
+static inline void
+cell_ewma_heap_set(ewma_policy_data_t *pol, int idx, cell_ewma_t *ewma)
+{
+  pol->active_circuits[idx] = ewma;
+  ewma->heap_index = idx;
+}
+
+/** Move the element at position <b>idx</b> in <b>pol</b>'s heap towards
+ * the root until the heap property holds. */
+static void
+cell_ewma_heap_sift_up(ewma_policy_data_t *pol, int idx)
+{
+  cell_ewma_t *ewma = pol->active_circuits[idx];
+  while (idx > 0) {
+    int parent = (idx - 1) / EWMA_HEAP_ARITY;
+    cell_ewma_t *p = pol->active_circuits[parent];
+    if (compare_cell_ewma(pol, p, ewma) <= 0)
+      break;
+    cell_ewma_heap_set(pol, idx, p);
+    idx = parent;
+  }
+  cell_ewma_heap_set(pol, idx, ewma);
+}
+
+/** Move the element at position <b>idx</b> in <b>pol</b>'s heap away
+ * from the root until the heap property holds. */
+static void
+cell_ewma_heap_sift_down(ewma_policy_data_t *pol, int idx)
+{
+  const int n = pol->n_active_circuits;
+  cell_ewma_t *ewma = pol->active_circuits[idx];
+  while (1) {
+    int first_child = idx * EWMA_HEAP_ARITY + 1;
+    int last_child = MIN(first_child + EWMA_HEAP_ARITY, n);
+    int best = -1, c;
+    if (first_child >= n)
+      break;
+    for (c = first_child; c < last_child; ++c) {
+      if (best < 0 || compare_cell_ewma(pol, pol->active_circuits[c],
+                                        pol->active_circuits[best]) < 0)
+        best = c;
+    }
+    if (compare_cell_ewma(pol, pol->active_circuits[best], ewma) >= 0)
+      break;
+    cell_ewma_heap_set(pol, idx, pol->active_circuits[best]);
+    idx = best;
+  }
+  cell_ewma_heap_set(pol, idx, ewma);
 }
 
 /** Rescale <b>ewma</b> to the same scale as <b>pol</b>, and add it to
@@ -670,46 +928,49 @@ static void
 add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index == -1);
 
-  scale_single_cell_ewma(
-      ewma,
-      pol->active_circuit_pqueue_last_recalibrated);
+  catch_up_active_circuits(pol);
+  scale_single_cell_ewma(ewma, pol->epoch);
 
-  smartlist_pqueue_add(pol->active_circuit_pqueue,
-                       compare_cell_ewma_counts,
-                       offsetof(cell_ewma_t, heap_index),
-                       ewma);
+  if (pol->n_active_circuits == pol->active_circuits_capacity) {
+    pol->active_circuits_capacity =
+      MAX(16, pol->active_circuits_capacity * 2);
+    pol->active_circuits = tor_reallocarray(pol->active_circuits,
+                                            pol->active_circuits_capacity,
+                                            sizeof(cell_ewma_t *));
+  }
+  cell_ewma_heap_set(pol, pol->n_active_circuits++, ewma);
+  cell_ewma_heap_sift_up(pol, ewma->heap_index);
 }
 
 /** Remove <b>ewma</b> from <b>pol</b>'s priority queue of active circuits */
 static void
 remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  int idx;
+  cell_ewma_t *last;
+
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index != -1);
 
-  smartlist_pqueue_remove(pol->active_circuit_pqueue,
-                          compare_cell_ewma_counts,
-                          offsetof(cell_ewma_t, heap_index),
-                          ewma);
-}
-
-/** Remove and return the first cell_ewma_t from pol's priority queue of
- * active circuits.  Requires that the priority queue is nonempty. */
-static cell_ewma_t *
-pop_first_cell_ewma(ewma_policy_data_t *pol)
-{
-  tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
+  idx = ewma->heap_index;
+  tor_assert(idx < pol->n_active_circuits);
+  tor_assert(pol->active_circuits[idx] == ewma);
+  ewma->heap_index = -1;
 
-  return smartlist_pqueue_pop(pol->active_circuit_pqueue,
-                              compare_cell_ewma_counts,
-                              offsetof(cell_ewma_t, heap_index));
+  last = pol->active_circuits[--pol->n_active_circuits];
+  if (last == ewma)
+    return;
+  cell_ewma_heap_set(pol, idx, last);
+  if (idx > 0 &&
+      compare_cell_ewma(pol, last,
+               pol->active_circuits[(idx - 1) / EWMA_HEAP_ARITY]) < 0)
+    cell_ewma_heap_sift_up(pol, idx);
+  else
+    cell_ewma_heap_sift_down(pol, idx);
 }
 
 /**
@@ -719,4 +980,5 @@ void
 circuitmux_ewma_free_all(void)
 {
   ewma_ticks_initialized = 0;
+  qdelay_enabled = 0;
 }
@@ -14,10 +14,13 @@
 
 /* The public EWMA policy callbacks object. */
 extern circuitmux_policy_t ewma_policy;
+/* The public queue-delay policy callbacks object. */
+extern circuitmux_policy_t qdelay_policy;
 
 /* Externally visible EWMA functions */
 void cmux_ewma_set_options(const or_options_t *options,
                            const networkstatus_t *consensus);
+circuitmux_policy_t *cmux_ewma_get_default_policy(void);
 
 void circuitmux_ewma_free_all(void);
 
@@ -37,17 +40,21 @@ typedef struct ewma_policy_circ_data_t ewma_policy_circ_data_t;
  */
 
 struct cell_ewma_t {
-  /** The last 'tick' at which we recalibrated cell_count.
+  /** The rescaling epoch with respect to which cell_count is scaled.
    *
-   * A cell sent at exactly the start of this tick has weight 1.0. Cells sent
-   * since the start of this tick have weight greater than 1.0; ones sent
+   * A cell sent at exactly the start of this epoch has weight 1.0. Cells sent
+   * since the start of this epoch have weight greater than 1.0; ones sent
    * earlier have less weight. */
-  unsigned int last_adjusted_tick;
-  /** The EWMA of the cell count. */
-  double cell_count;
+  unsigned int epoch;
+  /** The EWMA of the cell count, as a fixed-point number with
+   * EWMA_FRAC_BITS bits after the binary point. */
+  uint64_t cell_count;
   /** True iff this is the cell count for a circuit's previous
    * channel. */
   unsigned int is_for_p_chan : 1;
+  /** For the queue-delay policy: the coarse monotonic stamp by which we
+   * would like to have sent the first cell on this circuit's queue. */
+  uint32_t deadline;
   /** The position of the circuit within the OR connection's priority
    * queue. */
   int heap_index;
@@ -59,17 +66,27 @@ struct ewma_policy_data_t {
   /**
    * Priority queue of cell_ewma_t for circuits with queued cells waiting
    * for room to free up on the channel that owns this circuitmux.  Kept
-   * in heap order according to EWMA.  This was formerly in channel_t, and
-   * in or_connection_t before that.
+   * as an EWMA_HEAP_ARITY-ary min-heap on cell_count; each cell_ewma_t
+   * remembers its position in heap_index.  This was formerly in channel_t,
+   * and in or_connection_t before that.
    */
-  smartlist_t *active_circuit_pqueue;
+  cell_ewma_t **active_circuits;
+  /** Number of elements in active_circuits. */
+  int n_active_circuits;
+  /** Number of elements allocated for active_circuits. */
+  int active_circuits_capacity;
 
   /**
-   * The tick on which the cell_ewma_ts in active_circuit_pqueue last had
-   * their ewma values rescaled.  This was formerly in channel_t, and in
-   * or_connection_t before that.
+   * The epoch with respect to which the cell_ewma_ts in active_circuits
+   * are scaled.
    */
-  unsigned int active_circuit_pqueue_last_recalibrated;
+  unsigned int epoch;
+
+  /**
+   * True iff this is the data for qdelay_policy: if so, active_circuits is
+   * ordered by cell_ewma_t.deadline rather than by cell_count.
+   */
+  unsigned int by_queue_delay : 1;
 };
 
 struct ewma_policy_circ_data_t {
@@ -130,7 +147,13 @@ TO_EWMA_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
   }
 }
 
-STATIC unsigned cell_ewma_get_current_tick_and_fraction(double *remainder_out);
+/** Number of bits after the binary point in cell_ewma_t.cell_count. */
+#define EWMA_FRAC_BITS 16
+/** How many halflives does an epoch last? This is also the number of bits
+ * by which we shift cell counts at the start of each epoch. */
+#define EWMA_EPOCH_SHIFT 16
+
+STATIC uint64_t cell_ewma_get_current_scale(unsigned *epoch_out);
 STATIC void cell_ewma_initialize_ticks(void);
 
 #endif /* defined(CIRCUITMUX_EWMA_PRIVATE) */
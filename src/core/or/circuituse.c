@@ -36,8 +36,10 @@
 #include "core/or/circuitstats.h"
 #include "core/or/circuituse.h"
 #include "core/or/circuitpadding.h"
+#include "core/or/congestion_control.h"
 #include "core/or/connection_edge.h"
 #include "core/or/extendinfo.h"
+#include "core/or/multipath.h"
 #include "core/or/policies.h"
 #include "core/or/trace_probes_circuit.h"
 #include "feature/client/addressmap.h"
@@ -53,6 +55,7 @@
 #include "feature/hs/hs_ident.h"
 #include "feature/hs/hs_stats.h"
 #include "feature/nodelist/describe.h"
+#include "feature/nodelist/netparams.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
@@ -1401,6 +1404,9 @@ circuit_detach_stream(circuit_t *circ, edge_connection_t *conn)
     entry_connection_t *entry_conn = EDGE_TO_ENTRY_CONN(conn);
     entry_conn->may_use_optimistic_data = 0;
   }
+  /* Release any multipath data cells that it holds while we can still
+   * find its set. */
+  multipath_stream_clear(conn);
   conn->cpath_layer = NULL; /* don't keep a stale pointer */
   conn->on_circuit = NULL;
 
@@ -1719,6 +1725,10 @@ circuit_has_opened(origin_circuit_t *circ)
     case CIRCUIT_PURPOSE_C_GENERAL:
     case CIRCUIT_PURPOSE_C_HSDIR_GET:
     case CIRCUIT_PURPOSE_S_HSDIR_POST:
+      /* Ask the last hop to use congestion control first, so that it sees
+       * our request before any of our streams. */
+      congestion_control_circuit_has_opened(circ);
+      multipath_circuit_has_opened(circ);
       /* Tell any AP connections that have been waiting for a new
        * circuit that one is ready. */
       circuit_try_attaching_streams(circ);
@@ -2641,9 +2651,9 @@ optimistic_data_enabled(void)
     /* Note: this default was 0 before #18815 was merged. We can't take the
      * parameter out of the consensus until versions before that are all
      * obsolete. */
-    const int32_t enabled =
-      networkstatus_get_param(NULL, "UseOptimisticData", /*default*/ 1, 0, 1);
-    return (int)enabled;
+    static netparam_t use_optimistic_data =
+      NETPARAM_INIT("UseOptimisticData", /*default*/ 1, 0, 1);
+    return (int)netparam_get(&use_optimistic_data);
   }
   return options->OptimisticData;
 }
@@ -2652,7 +2662,7 @@ optimistic_data_enabled(void)
  * p_streams. Also set apconn's cpath_layer to <b>cpath</b>, or to the last
  * hop in circ's cpath if <b>cpath</b> is NULL.
  */
-static void
+STATIC void
 link_apconn_to_circ(entry_connection_t *apconn, origin_circuit_t *circ,
                     crypt_path_t *cpath)
 {
@@ -2695,6 +2705,8 @@ link_apconn_to_circ(entry_connection_t *apconn, origin_circuit_t *circ,
   circ->isolation_any_streams_attached = 1;
   connection_edge_update_circuit_isolation(apconn, circ, 0);
 
+  multipath_circuit_stream_attached(circ, apconn);
+
   /* Compute the exitnode if possible, for logging below */
   if (cpath->extend_info)
     exitnode = node_get_by_id(cpath->extend_info->identity_digest);
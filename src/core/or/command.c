@@ -359,6 +359,7 @@ command_process_create_cell(cell_t *cell, channel_t *chan)
                                        create_cell->onionskin,
                                        create_cell->handshake_len,
                                        NULL,
+                                       NULL,
                                        created_cell.reply,
                                        keys, CPATH_KEY_MATERIAL_LEN,
                                        rend_circ_nonce);
@@ -0,0 +1,498 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control.c
+ * \brief Delay-based congestion control for circuits.
+ *
+ * With fixed SENDME windows, an endpoint may have at most
+ * circuit_initial_package_window() DATA cells in flight on a circuit, so a
+ * circuit can never carry more than one window per round trip, however fast
+ * its path is; and on a slow path, a full window sits in the queue of the
+ * slowest relay.
+ *
+ * A circuit that uses congestion control replaces the fixed window with a
+ * congestion window (cwnd), which it adjusts as it goes.  We time each SENDME
+ * round trip: from when we send the DATA cell that the SENDME acknowledges,
+ * until the SENDME arrives.  The smallest RTT that we see approximates the
+ * RTT of the path with empty queues, so
+ *
+ *     queue_use = cwnd - cwnd * min_rtt / ewma_rtt
+ *
+ * estimates how many of our cells are sitting in queues on the path.  As in
+ * TCP Vegas, once per congestion window we grow cwnd when that number is
+ * below vegas_alpha, shrink it when it is above vegas_beta, and cut it back
+ * to the estimated bandwidth-delay product when it is above vegas_delta.
+ * Until the queue first exceeds vegas_gamma, we are in slow start, and
+ * double cwnd instead.
+ *
+ * Only the sender needs to change: the receiver still sends a SENDME for
+ * every CIRCWINDOW_INCREMENT cells that it receives, as soon as it receives
+ * them.  But the sender may now have more than a fixed window in flight, so
+ * the two endpoints agree on it per circuit.  When a client has built a
+ * circuit whose last hop supports DelayCC=1, it sends a CC_NEGOTIATE cell
+ * to that hop; the hop starts using congestion control for the cells that
+ * it sends to the client, and replies with CC_NEGOTIATED; and the client
+ * then starts using it for the cells that it sends to the hop.
+ *
+ * The algorithm and all of its parameters come from the consensus.
+ *
+ * Stream windows are still how a slow reader pushes back on the sender,
+ * but a fixed stream window of STREAMWINDOW_START cells would cap a
+ * single stream at that many cells per round trip, whatever cwnd is.  So
+ * on a circuit that uses congestion control, a stream may have as many
+ * cells in flight as the circuit's cwnd, if that is more: see
+ * sendme_get_stream_package_window().  The receiver allows up to its own
+ * cwnd_max, which comes from the same consensus parameter.
+ **/
+
+#define CONGESTION_CONTROL_PRIVATE
+
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/or/circuitlist.h"
+#include "core/or/circuituse.h"
+#include "core/or/congestion_control.h"
+#include "core/or/relay.h"
+#include "feature/nodelist/netparams.h"
+#include "feature/nodelist/nodelist.h"
+#include "lib/time/compat_time.h"
+
+#include "core/or/congestion_control_st.h"
+#include "core/or/crypt_path_st.h"
+#include "core/or/extend_info_st.h"
+#include "core/or/origin_circuit_st.h"
+
+/** Default values for our consensus parameters. All the windows and queue
+ * thresholds are in cells. */
+#define CC_ALG_DEFAULT CC_ALG_SENDME
+#define CC_CWND_INIT_DEFAULT 500
+#define CC_CWND_MIN_DEFAULT 200
+#define CC_CWND_MAX_DEFAULT 10000
+#define CC_CWND_INC_DEFAULT CIRCWINDOW_INCREMENT
+#define CC_EWMA_N_DEFAULT 2
+#define CC_VEGAS_ALPHA_DEFAULT 200
+#define CC_VEGAS_BETA_DEFAULT 400
+#define CC_VEGAS_GAMMA_DEFAULT 400
+#define CC_VEGAS_DELTA_DEFAULT 800
+
+/** Which algorithm should new circuits negotiate? */
+static netparam_t cc_alg =
+  NETPARAM_INIT("cc_alg", CC_ALG_DEFAULT, CC_ALG_SENDME, CC_ALG_VEGAS);
+/** Congestion window for new circuits. */
+static netparam_t cc_cwnd_init =
+  NETPARAM_INIT("cc_cwnd_init", CC_CWND_INIT_DEFAULT,
+                CIRCWINDOW_INCREMENT, CC_CWND_MAX_MAX);
+/** Bounds on the congestion window. It can never be smaller than one
+ * SENDME's worth of cells, or we would never get a SENDME to grow it. */
+static netparam_t cc_cwnd_min =
+  NETPARAM_INIT("cc_cwnd_min", CC_CWND_MIN_DEFAULT,
+                CIRCWINDOW_INCREMENT, CC_CWND_MAX_MAX);
+static netparam_t cc_cwnd_max =
+  NETPARAM_INIT("cc_cwnd_max", CC_CWND_MAX_DEFAULT,
+                CIRCWINDOW_START_MAX, CC_CWND_MAX_MAX);
+/** How much we grow or shrink the window in congestion avoidance. */
+static netparam_t cc_cwnd_inc =
+  NETPARAM_INIT("cc_cwnd_inc", CC_CWND_INC_DEFAULT, 1, CC_CWND_MAX_MAX);
+/** How many RTT samples our moving average of RTTs covers. */
+static netparam_t cc_ewma_n =
+  NETPARAM_INIT("cc_ewma_n", CC_EWMA_N_DEFAULT, 1, 100);
+/** Vegas queue thresholds: see the comment at the top of this file. */
+static netparam_t cc_vegas_alpha =
+  NETPARAM_INIT("cc_vegas_alpha", CC_VEGAS_ALPHA_DEFAULT,
+                0, CC_CWND_MAX_MAX);
+static netparam_t cc_vegas_beta =
+  NETPARAM_INIT("cc_vegas_beta", CC_VEGAS_BETA_DEFAULT, 0, CC_CWND_MAX_MAX);
+static netparam_t cc_vegas_gamma =
+  NETPARAM_INIT("cc_vegas_gamma", CC_VEGAS_GAMMA_DEFAULT,
+                0, CC_CWND_MAX_MAX);
+static netparam_t cc_vegas_delta =
+  NETPARAM_INIT("cc_vegas_delta", CC_VEGAS_DELTA_DEFAULT,
+                0, CC_CWND_MAX_MAX);
+
+/** Return the number of SENDMEs that acknowledge one congestion window's
+ * worth of cells on <b>cc</b>. */
+static int
+cwnd_update_interval(const congestion_control_t *cc)
+{
+  return MAX(1, cc->cwnd / CIRCWINDOW_INCREMENT);
+}
+
+/** Return a new congestion control state for a circuit that already has
+ * <b>inflight</b> DATA cells in flight, using the current consensus
+ * parameters. */
+congestion_control_t *
+congestion_control_new(int inflight)
+{
+  congestion_control_t *cc = tor_malloc_zero(sizeof(*cc));
+
+  cc->alg = CC_ALG_VEGAS;
+  cc->cwnd_min = netparam_get(&cc_cwnd_min);
+  cc->cwnd_max = MAX(netparam_get(&cc_cwnd_max), cc->cwnd_min);
+  cc->cwnd = CLAMP(cc->cwnd_min, netparam_get(&cc_cwnd_init), cc->cwnd_max);
+  cc->cwnd_inc = netparam_get(&cc_cwnd_inc);
+  cc->ewma_n = netparam_get(&cc_ewma_n);
+  cc->vegas_alpha = netparam_get(&cc_vegas_alpha);
+  cc->vegas_beta = netparam_get(&cc_vegas_beta);
+  cc->vegas_gamma = netparam_get(&cc_vegas_gamma);
+  cc->vegas_delta = netparam_get(&cc_vegas_delta);
+
+  cc->inflight = MAX(inflight, 0);
+  cc->n_untimed_sendmes = cc->inflight / CIRCWINDOW_INCREMENT;
+  cc->in_slow_start = 1;
+  cc->next_cc_event = cwnd_update_interval(cc);
+  cc->sendme_pending_timestamps = smartlist_new();
+
+  return cc;
+}
+
+/** Release all storage held by <b>cc</b>. */
+void
+congestion_control_free_(congestion_control_t *cc)
+{
+  if (!cc)
+    return;
+
+  SMARTLIST_FOREACH(cc->sendme_pending_timestamps, uint64_t *, t,
+                    tor_free(t));
+  smartlist_free(cc->sendme_pending_timestamps);
+  tor_free(cc);
+}
+
+/** Return the algorithm that the consensus tells new circuits to
+ * negotiate. */
+cc_alg_t
+congestion_control_get_alg(void)
+{
+  const int alg = netparam_get(&cc_alg);
+  return (cc_alg_t) alg;
+}
+
+/** Return true iff either endpoint of <b>circ</b> that we are has
+ * negotiated congestion control on it. */
+bool
+circuit_has_congestion_control(const circuit_t *circ)
+{
+  const crypt_path_t *hop;
+
+  tor_assert(circ);
+
+  if (circ->ccontrol)
+    return true;
+  if (!CIRCUIT_IS_ORIGIN(circ))
+    return false;
+
+  hop = CONST_TO_ORIGIN_CIRCUIT(circ)->cpath;
+  while (hop) {
+    if (hop->ccontrol)
+      return true;
+    hop = hop->next;
+    if (hop == CONST_TO_ORIGIN_CIRCUIT(circ)->cpath)
+      break;
+  }
+  return false;
+}
+
+/** Return how many more DATA cells we may send under <b>cc</b> before we
+ * must wait for a SENDME. */
+int
+congestion_control_get_package_window(const congestion_control_t *cc)
+{
+  tor_assert(cc);
+
+  return MAX(cc->cwnd - cc->inflight, 0);
+}
+
+/** Return the congestion window of <b>cc</b>: how many DATA cells we may
+ * have in flight under it. */
+int
+congestion_control_get_cwnd(const congestion_control_t *cc)
+{
+  tor_assert(cc);
+
+  return cc->cwnd;
+}
+
+/** Return the largest congestion window that <b>cc</b> may ever have. */
+int
+congestion_control_get_cwnd_max(const congestion_control_t *cc)
+{
+  tor_assert(cc);
+
+  return cc->cwnd_max;
+}
+
+/** Return true iff the next DATA cell that we send under <b>cc</b> is one
+ * that the other side will acknowledge with a SENDME. */
+bool
+congestion_control_sendme_is_next(const congestion_control_t *cc)
+{
+  tor_assert(cc);
+
+  return ((cc->inflight + 1) % CIRCWINDOW_INCREMENT) == 0;
+}
+
+/** Note that we have just sent a DATA cell under <b>cc</b>. */
+void
+congestion_control_note_cell_sent(congestion_control_t *cc)
+{
+  tor_assert(cc);
+
+  ++cc->inflight;
+  if (cc->inflight >= cc->cwnd)
+    cc->cwnd_full = 1;
+
+  /* Remember when we sent each cell that a SENDME will acknowledge, so that
+   * we can time the round trip. */
+  if ((cc->inflight % CIRCWINDOW_INCREMENT) == 0) {
+    uint64_t *now = tor_malloc(sizeof(uint64_t));
+    *now = monotime_absolute_usec();
+    smartlist_add(cc->sendme_pending_timestamps, now);
+  }
+}
+
+/** Add an RTT sample of <b>rtt_usec</b> usec to our estimates on
+ * <b>cc</b>. */
+STATIC void
+congestion_control_update_rtt(congestion_control_t *cc, uint64_t rtt_usec)
+{
+  /* A zero estimate means "no estimate yet". */
+  rtt_usec = MAX(rtt_usec, 1);
+
+  if (!cc->ewma_rtt_usec) {
+    cc->ewma_rtt_usec = rtt_usec;
+  } else {
+    /* The usual N-sample EWMA, with alpha = 2/(N+1). */
+    cc->ewma_rtt_usec = (2 * rtt_usec + (cc->ewma_n - 1) * cc->ewma_rtt_usec)
+      / (cc->ewma_n + 1);
+  }
+
+  /* Take the minimum of the smoothed RTT, so that a single lucky sample
+   * doesn't convince us that the path is emptier than it ever gets. */
+  if (!cc->min_rtt_usec || cc->ewma_rtt_usec < cc->min_rtt_usec)
+    cc->min_rtt_usec = cc->ewma_rtt_usec;
+}
+
+/** Adjust the congestion window of <b>cc</b> after a congestion window's
+ * worth of SENDMEs, as described at the top of this file. */
+STATIC void
+congestion_control_vegas_update(congestion_control_t *cc)
+{
+  int bdp, queue_use;
+  const int old_cwnd = cc->cwnd;
+
+  /* We can't estimate the queue without an RTT. */
+  if (!cc->ewma_rtt_usec)
+    return;
+
+  bdp = (int) ((uint64_t) cc->cwnd * cc->min_rtt_usec / cc->ewma_rtt_usec);
+  queue_use = cc->cwnd - bdp;
+
+  if (cc->in_slow_start) {
+    if (queue_use >= cc->vegas_gamma) {
+      cc->cwnd = bdp + cc->vegas_gamma;
+      cc->in_slow_start = 0;
+    } else if (cc->cwnd_full) {
+      cc->cwnd *= 2;
+    }
+  } else if (queue_use > cc->vegas_delta) {
+    cc->cwnd = bdp + cc->vegas_delta - cc->cwnd_inc;
+  } else if (queue_use > cc->vegas_beta) {
+    cc->cwnd -= cc->cwnd_inc;
+  } else if (queue_use < cc->vegas_alpha && cc->cwnd_full) {
+    cc->cwnd += cc->cwnd_inc;
+  }
+
+  cc->cwnd = CLAMP(cc->cwnd_min, cc->cwnd, cc->cwnd_max);
+  /* Only grow the window again once we have used it. */
+  cc->cwnd_full = 0;
+
+  log_debug(LD_CIRC, "Vegas: cwnd %d -> %d (bdp %d, queue %d, inflight %d, "
+            "min_rtt %"PRIu64" usec, rtt %"PRIu64" usec%s).",
+            old_cwnd, cc->cwnd, bdp, queue_use, cc->inflight,
+            cc->min_rtt_usec, cc->ewma_rtt_usec,
+            cc->in_slow_start ? ", slow start" : "");
+}
+
+/** Process a circuit-level SENDME that acknowledges cells that we sent
+ * under <b>cc</b>, and adjust the congestion window if it's time to.
+ *
+ * Return 0 on success, or a negative END_CIRC_REASON if the SENDME is
+ * bogus and the caller should close the circuit. */
+int
+congestion_control_process_sendme(congestion_control_t *cc)
+{
+  tor_assert(cc);
+
+  if (cc->inflight < CIRCWINDOW_INCREMENT) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Unexpected circuit SENDME with only %d cells in flight. "
+           "Closing circuit.", cc->inflight);
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+  cc->inflight -= CIRCWINDOW_INCREMENT;
+
+  /* We have no timestamp for cells that we sent before we negotiated:
+   * don't time their SENDMEs against the cells we sent after. */
+  if (cc->n_untimed_sendmes > 0) {
+    --cc->n_untimed_sendmes;
+  } else if (smartlist_len(cc->sendme_pending_timestamps)) {
+    uint64_t *sent_at = smartlist_get(cc->sendme_pending_timestamps, 0);
+    smartlist_del_keeporder(cc->sendme_pending_timestamps, 0);
+    congestion_control_update_rtt(cc, monotime_absolute_usec() - *sent_at);
+    tor_free(sent_at);
+  }
+
+  if (--cc->next_cc_event <= 0) {
+    if (cc->alg == CC_ALG_VEGAS)
+      congestion_control_vegas_update(cc);
+    cc->next_cc_event = cwnd_update_interval(cc);
+  }
+
+  return 0;
+}
+
+/** Called when the client-side circuit <b>circ</b> has finished building.
+ * If the consensus says so, and its last hop can do it, ask that hop to
+ * use congestion control on it. */
+void
+congestion_control_circuit_has_opened(origin_circuit_t *circ)
+{
+  const crypt_path_t *last_hop;
+  const node_t *node;
+  uint8_t body[CC_NEGOTIATE_LEN];
+  const cc_alg_t alg = congestion_control_get_alg();
+
+  tor_assert(circ);
+
+  if (alg == CC_ALG_SENDME || circ->cc_negotiation_pending)
+    return;
+
+  last_hop = circ->cpath ? circ->cpath->prev : NULL;
+  if (!last_hop || last_hop->ccontrol || !last_hop->extend_info)
+    return;
+  node = node_get_by_id(last_hop->extend_info->identity_digest);
+  if (!node || !node_supports_congestion_control(node))
+    return;
+
+  body[0] = CC_NEGOTIATE_VERSION;
+  body[1] = alg;
+  if (relay_send_command_from_edge(0, TO_CIRCUIT(circ),
+                                   RELAY_COMMAND_CC_NEGOTIATE,
+                                   (const char *) body, sizeof(body),
+                                   circ->cpath->prev) < 0) {
+    /* The circuit is closed. */
+    return;
+  }
+  circ->cc_negotiation_pending = 1;
+  log_info(LD_CIRC, "Asked circuit %u to use congestion control.",
+           (unsigned) circ->global_identifier);
+}
+
+/** Process the body (<b>body</b>, <b>body_len</b> bytes) of a CC_NEGOTIATE
+ * cell that arrived on <b>circ</b>, from the hop <b>layer_hint</b> if we are
+ * its origin.  If we can, start using congestion control for the cells that
+ * we send on <b>circ</b>.  Either way, answer with a CC_NEGOTIATED cell.
+ *
+ * Return 0 on success, or a negative END_CIRC_REASON if the caller should
+ * close the circuit. */
+int
+congestion_control_process_negotiate(circuit_t *circ,
+                                     const crypt_path_t *layer_hint,
+                                     const uint8_t *body, size_t body_len)
+{
+  uint8_t reply[CC_NEGOTIATED_LEN];
+  cc_alg_t alg;
+
+  tor_assert(circ);
+
+  /* Only the last hop of a client's circuit packages cells for it. */
+  if (layer_hint || CIRCUIT_IS_ORIGIN(circ)) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Received a CC_NEGOTIATE cell at a client. Dropping.");
+    return 0;
+  }
+  if (body_len < CC_NEGOTIATE_LEN || body[0] != CC_NEGOTIATE_VERSION) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Received an unparseable CC_NEGOTIATE cell. Closing circuit.");
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+  if (circ->ccontrol) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Received a second CC_NEGOTIATE cell. Closing circuit.");
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+
+  alg = (cc_alg_t) body[1];
+  reply[0] = CC_NEGOTIATE_VERSION;
+  reply[1] = body[1];
+  if (alg == CC_ALG_VEGAS && congestion_control_get_alg() != CC_ALG_SENDME) {
+    /* Any cells that we sent before now count as in flight. */
+    circ->ccontrol = congestion_control_new(
+                 circuit_initial_package_window() - circ->package_window);
+    reply[2] = CC_NEGOTIATED_OK;
+  } else {
+    reply[2] = CC_NEGOTIATED_REFUSED;
+  }
+  log_info(LD_EXIT, "%s congestion control algorithm %d on a circuit.",
+           circ->ccontrol ? "Using" : "Refused", (int) alg);
+
+  /* If this fails, the circuit is already marked for close. */
+  relay_send_command_from_edge(0, circ, RELAY_COMMAND_CC_NEGOTIATED,
+                               (const char *) reply, sizeof(reply), NULL);
+  return 0;
+}
+
+/** Process the body (<b>body</b>, <b>body_len</b> bytes) of a CC_NEGOTIATED
+ * cell that arrived on <b>circ</b> from the hop <b>layer_hint</b>.  If that
+ * hop agreed, start using congestion control for the cells that we send it.
+ *
+ * Return 0 on success, or a negative END_CIRC_REASON if the caller should
+ * close the circuit. */
+int
+congestion_control_process_negotiated(circuit_t *circ,
+                                      crypt_path_t *layer_hint,
+                                      const uint8_t *body, size_t body_len)
+{
+  origin_circuit_t *ocirc;
+
+  tor_assert(circ);
+
+  if (!CIRCUIT_IS_ORIGIN(circ) || !layer_hint) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Received a CC_NEGOTIATED cell at a relay. Dropping.");
+    return 0;
+  }
+  ocirc = TO_ORIGIN_CIRCUIT(circ);
+  if (!ocirc->cc_negotiation_pending || layer_hint != ocirc->cpath->prev) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Received an unexpected CC_NEGOTIATED cell. Dropping.");
+    return 0;
+  }
+  ocirc->cc_negotiation_pending = 0;
+
+  if (body_len < CC_NEGOTIATED_LEN || body[0] != CC_NEGOTIATE_VERSION) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Received an unparseable CC_NEGOTIATED cell. Closing circuit.");
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+  circuit_read_valid_data(ocirc, body_len);
+
+  if (body[2] != CC_NEGOTIATED_OK) {
+    log_info(LD_CIRC, "Circuit %u refused to use congestion control.",
+             (unsigned) ocirc->global_identifier);
+    return 0;
+  }
+  if (body[1] != CC_ALG_VEGAS) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Received a CC_NEGOTIATED cell for an algorithm we didn't ask "
+           "for. Closing circuit.");
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+
+  layer_hint->ccontrol = congestion_control_new(
+           circuit_initial_package_window() - layer_hint->package_window);
+  log_info(LD_CIRC, "Circuit %u is using congestion control.",
+           (unsigned) ocirc->global_identifier);
+  return 0;
+}
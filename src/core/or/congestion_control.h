@@ -0,0 +1,66 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control.h
+ * \brief Header file for congestion_control.c.
+ **/
+
+#ifndef TOR_CONGESTION_CONTROL_H
+#define TOR_CONGESTION_CONTROL_H
+
+typedef struct congestion_control_t congestion_control_t;
+
+/** Ways to decide how many DATA cells a circuit may have in flight. */
+typedef enum cc_alg_t {
+  /** A fixed window of circuit_initial_package_window() cells. */
+  CC_ALG_SENDME = 0,
+  /** A window that follows the delay of the SENDMEs, as in TCP Vegas. */
+  CC_ALG_VEGAS = 1,
+} cc_alg_t;
+
+/** Largest value that we allow for the cc_cwnd_max consensus parameter. */
+#define CC_CWND_MAX_MAX 50000
+
+/** Version of the CC_NEGOTIATE and CC_NEGOTIATED cells that we send. */
+#define CC_NEGOTIATE_VERSION 0
+/** Length of a CC_NEGOTIATE cell body: version, algorithm. */
+#define CC_NEGOTIATE_LEN 2
+/** Length of a CC_NEGOTIATED cell body: version, algorithm, response. */
+#define CC_NEGOTIATED_LEN 3
+/** Response codes in a CC_NEGOTIATED cell. */
+#define CC_NEGOTIATED_OK 0
+#define CC_NEGOTIATED_REFUSED 1
+
+congestion_control_t *congestion_control_new(int inflight);
+void congestion_control_free_(congestion_control_t *cc);
+#define congestion_control_free(cc) \
+  FREE_AND_NULL(congestion_control_t, congestion_control_free_, (cc))
+
+cc_alg_t congestion_control_get_alg(void);
+bool circuit_has_congestion_control(const circuit_t *circ);
+
+int congestion_control_get_package_window(const congestion_control_t *cc);
+int congestion_control_get_cwnd(const congestion_control_t *cc);
+int congestion_control_get_cwnd_max(const congestion_control_t *cc);
+bool congestion_control_sendme_is_next(const congestion_control_t *cc);
+void congestion_control_note_cell_sent(congestion_control_t *cc);
+int congestion_control_process_sendme(congestion_control_t *cc);
+
+void congestion_control_circuit_has_opened(origin_circuit_t *circ);
+int congestion_control_process_negotiate(circuit_t *circ,
+                                         const crypt_path_t *layer_hint,
+                                         const uint8_t *body,
+                                         size_t body_len);
+int congestion_control_process_negotiated(circuit_t *circ,
+                                          crypt_path_t *layer_hint,
+                                          const uint8_t *body,
+                                          size_t body_len);
+
+#ifdef CONGESTION_CONTROL_PRIVATE
+STATIC void congestion_control_update_rtt(congestion_control_t *cc,
+                                          uint64_t rtt_usec);
+STATIC void congestion_control_vegas_update(congestion_control_t *cc);
+#endif
+
+#endif /* !defined(TOR_CONGESTION_CONTROL_H) */
@@ -0,0 +1,61 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file congestion_control_st.h
+ * @brief Congestion control state for one direction of a circuit.
+ **/
+
+#ifndef CONGESTION_CONTROL_ST_H
+#define CONGESTION_CONTROL_ST_H
+
+#include "core/or/congestion_control.h"
+
+/** The state that decides how many DATA cells we may send on a circuit,
+ * for a circuit (or an origin circuit hop) that has negotiated congestion
+ * control.  It replaces the fixed package window. */
+struct congestion_control_t {
+  /** Which algorithm we are running. */
+  cc_alg_t alg;
+
+  /** Congestion window: how many DATA cells may be in flight, that is, sent
+   * but not yet acknowledged by a SENDME. */
+  int cwnd;
+  /** How many DATA cells are in flight. */
+  int inflight;
+  /** How many more SENDMEs we will receive before we next adjust cwnd. We
+   * adjust it about once per congestion window, which is once per RTT. */
+  int next_cc_event;
+  /** True iff we are still growing cwnd exponentially. */
+  unsigned int in_slow_start : 1;
+  /** True iff we have had cwnd cells in flight since we last adjusted cwnd.
+   * We only grow a window that we are using. */
+  unsigned int cwnd_full : 1;
+
+  /** For each in-flight DATA cell that will be acknowledged by a SENDME,
+   * oldest first: a uint64_t* holding the monotonic time in usec at which
+   * we sent it. */
+  smartlist_t *sendme_pending_timestamps;
+  /** How many SENDMEs we still expect for cells that we sent before we
+   * started using congestion control.  We have no timestamps for those
+   * cells, so these SENDMEs give us no RTT samples. */
+  int n_untimed_sendmes;
+
+  /** Smallest RTT we have seen, in usec, or 0 if we have seen none. This is
+   * our estimate of the RTT of the path with empty queues. */
+  uint64_t min_rtt_usec;
+  /** Moving average of recent RTTs, in usec, or 0 if we have seen none. */
+  uint64_t ewma_rtt_usec;
+
+  /** Consensus parameters, as they were when we created this object. */
+  int cwnd_min;
+  int cwnd_max;
+  int cwnd_inc;
+  int ewma_n;
+  int vegas_alpha;
+  int vegas_beta;
+  int vegas_gamma;
+  int vegas_delta;
+};
+
+#endif /* !defined(CONGESTION_CONTROL_ST_H) */
@@ -71,6 +71,7 @@
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
 #include "core/or/extendinfo.h"
+#include "core/or/multipath.h"
 #include "core/or/policies.h"
 #include "core/or/reasons.h"
 #include "core/or/relay.h"
@@ -548,6 +549,11 @@ connection_edge_end(edge_connection_t *conn, uint8_t reason)
     }
     set_uint32(payload+1+addrlen, htonl(clip_dns_ttl(conn->address_ttl)));
     payload_len += 4+addrlen;
+  } else if (conn->mp_sending) {
+    /* Tell the other end how many data cells to wait for: they may still be
+     * on their way over the other circuits of the multipath set. */
+    set_uint32(payload+1, htonl(conn->mp_next_send_seq));
+    payload_len += MULTIPATH_SEQ_LEN;
   }
 
   if (circ && !circ->marked_for_close) {
@@ -643,7 +649,7 @@ connection_half_edge_add(const edge_connection_t *conn,
    * data. */
   if (conn->base_.state != AP_CONN_STATE_RESOLVE_WAIT) {
     // How many more data cells can arrive on this id?
-    half_conn->data_pending = conn->deliver_window;
+    half_conn->data_pending = sendme_get_stream_deliver_window(conn);
   }
 
   insert_at = smartlist_bsearch_idx(circ->half_streams, &half_conn->stream_id,
@@ -1398,6 +1404,8 @@ connection_ap_mark_as_pending_circuit_(entry_connection_t *entry_conn,
   if (PREDICT_UNLIKELY(NULL == attach_pending_entry_connections_ev)) {
     attach_pending_entry_connections_ev = mainloop_event_postloop_new(
                                   attach_pending_entry_connections_cb, NULL);
+    mainloop_event_set_name(attach_pending_entry_connections_ev,
+                            "connection_edge/attach-pending");
   }
   if (PREDICT_UNLIKELY(smartlist_contains(pending_entry_connections,
                                           entry_conn))) {
@@ -3119,13 +3127,27 @@ connection_ap_process_http_connect(entry_connection_t *conn)
   return rv;
 }
 
+/** Return true iff <b>stream_id</b> names a stream on <b>circ</b>, or one
+ * that we closed recently. */
+static bool
+stream_id_is_used_on_circ(const origin_circuit_t *circ, streamid_t stream_id)
+{
+  const edge_connection_t *tmpconn;
+
+  for (tmpconn = circ->p_streams; tmpconn; tmpconn=tmpconn->next_stream)
+    if (tmpconn->stream_id == stream_id)
+      return true;
+
+  return connection_half_edge_find_stream_id(circ->half_streams,
+                                             stream_id) != NULL;
+}
+
 /** Iterate over the two bytes of stream_id until we get one that is not
  * already in use; return it. Return 0 if can't get a unique stream_id.
  */
 streamid_t
 get_unique_stream_id_by_circ(origin_circuit_t *circ)
 {
-  edge_connection_t *tmpconn;
   streamid_t test_stream_id;
   uint32_t attempts=0;
 
@@ -3138,14 +3160,21 @@ get_unique_stream_id_by_circ(origin_circuit_t *circ)
   }
   if (test_stream_id == 0)
     goto again;
-  for (tmpconn = circ->p_streams; tmpconn; tmpconn=tmpconn->next_stream)
-    if (tmpconn->stream_id == test_stream_id)
-      goto again;
-
-  if (connection_half_edge_find_stream_id(circ->half_streams,
-                                           test_stream_id))
+  if (stream_id_is_used_on_circ(circ, test_stream_id))
     goto again;
 
+  /* Multipath data cells name their stream by ID alone, so the ID must be
+   * unique over the whole set. */
+  if (TO_CIRCUIT(circ)->mp_set) {
+    const smartlist_t *legs = multipath_get_legs(TO_CIRCUIT(circ));
+    SMARTLIST_FOREACH_BEGIN(legs, const circuit_t *, leg) {
+      if (leg != TO_CIRCUIT(circ) && CIRCUIT_IS_ORIGIN(leg) &&
+          stream_id_is_used_on_circ(CONST_TO_ORIGIN_CIRCUIT(leg),
+                                    test_stream_id))
+        goto again;
+    } SMARTLIST_FOREACH_END(leg);
+  }
+
   return test_stream_id;
 }
 
@@ -3325,6 +3354,8 @@ connection_ap_handshake_send_begin,(entry_connection_t *ap_conn))
 
   edge_conn->package_window = STREAMWINDOW_START;
   edge_conn->deliver_window = STREAMWINDOW_START;
+  /* Retried streams count their data cells from 0 on the new circuit. */
+  edge_conn->mp_next_send_seq = edge_conn->mp_next_recv_seq = 0;
   base_conn->state = AP_CONN_STATE_CONNECT_WAIT;
   log_info(LD_APP,"Address/port sent, ap socket "TOR_SOCKET_T_FORMAT
            ", n_circ_id %u",
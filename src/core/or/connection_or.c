@@ -46,7 +46,10 @@
 #include "feature/dirauth/reachability.h"
 #include "feature/client/entrynodes.h"
 #include "lib/geoip/geoip.h"
+#include "lib/malloc/slab.h"
+#include "lib/thread/threads.h"
 #include "core/mainloop/mainloop.h"
+#include "core/mainloop/orshard.h"
 #include "trunnel/netinfo.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
@@ -484,16 +487,51 @@ var_cell_pack_header(const var_cell_t *cell, char *hdr_out, int wide_circ_ids)
   return r;
 }
 
+/** Largest payload for which we allocate a var_cell_t from
+ * var_cell_pool. This is enough for every var cell in a typical link
+ * handshake; larger cells come from tor_malloc(). */
+#define VAR_CELL_POOL_MAX_PAYLOAD 2048
+/** Number of var cells in each slab of var_cell_pool. */
+#define VAR_CELL_POOL_OBJS_PER_SLAB 32
+/** Number of bytes that we allocate before each var_cell_t, to remember
+ * the pool it came from (or NULL if it came from tor_malloc()).  We only
+ * need room for a pointer, but we use a whole SLAB_OBJ_ALIGN bytes so that
+ * a pooled var_cell_t starts on a cache line of its own. */
+#define VAR_CELL_HDR_LEN SLAB_OBJ_ALIGN
+
+/** Pool from which we allocate small var_cell_t objects.  Like the other
+ * cell pools, it has no lock, so only the main thread may use it. */
+static slab_pool_t *var_cell_pool = NULL;
+
 /** Allocate and return a new var_cell_t with <b>payload_len</b> bytes of
  * payload space. */
 var_cell_t *
 var_cell_new(uint16_t payload_len)
 {
   size_t size = offsetof(var_cell_t, payload) + payload_len;
-  var_cell_t *cell = tor_malloc_zero(size);
+  slab_pool_t *pool = NULL;
+  char *mem;
+  var_cell_t *cell;
+
+  if (payload_len <= VAR_CELL_POOL_MAX_PAYLOAD) {
+    tor_assert(in_main_thread());
+    if (PREDICT_UNLIKELY(!var_cell_pool)) {
+      var_cell_pool = slab_pool_new("var cell",
+                                    VAR_CELL_HDR_LEN +
+                                    offsetof(var_cell_t, payload) +
+                                    VAR_CELL_POOL_MAX_PAYLOAD,
+                                    VAR_CELL_POOL_OBJS_PER_SLAB);
+    }
+    pool = var_cell_pool;
+    mem = slab_pool_alloc(pool);
+  } else {
+    mem = tor_malloc(VAR_CELL_HDR_LEN + size);
+  }
+  memcpy(mem, &pool, sizeof(pool));
+
+  cell = (var_cell_t *)(mem + VAR_CELL_HDR_LEN);
+  memset(cell, 0, size);
   cell->payload_len = payload_len;
-  cell->command = 0;
-  cell->circ_id = 0;
   return cell;
 }
 
@@ -505,12 +543,9 @@ var_cell_t *
 var_cell_copy(const var_cell_t *src)
 {
   var_cell_t *copy = NULL;
-  size_t size = 0;
 
   if (src != NULL) {
-    size = offsetof(var_cell_t, payload) + src->payload_len;
-    copy = tor_malloc_zero(size);
-    copy->payload_len = src->payload_len;
+    copy = var_cell_new(src->payload_len);
     copy->command = src->command;
     copy->circ_id = src->circ_id;
     memcpy(copy->payload, src->payload, copy->payload_len);
@@ -523,7 +558,44 @@ var_cell_copy(const var_cell_t *src)
 void
 var_cell_free_(var_cell_t *cell)
 {
-  tor_free(cell);
+  char *mem;
+  slab_pool_t *pool;
+
+  if (!cell)
+    return;
+
+  mem = ((char *)cell) - VAR_CELL_HDR_LEN;
+  memcpy(&pool, mem, sizeof(pool));
+  if (pool) {
+    tor_assert(in_main_thread());
+    slab_pool_release(pool, mem);
+  } else {
+    tor_free(mem);
+  }
+}
+
+/** Return the pool from which we allocate var cells, or NULL if we
+ * haven't allocated any yet. */
+const slab_pool_t *
+var_cell_get_pool(void)
+{
+  return var_cell_pool;
+}
+
+/** Return any unused slabs in the var cell pool to the system
+ * allocator. */
+void
+var_cell_pool_trim(void)
+{
+  if (var_cell_pool)
+    slab_pool_trim(var_cell_pool);
+}
+
+/** Release all storage held by the var cell pool. */
+void
+var_cell_pool_free_all(void)
+{
+  slab_pool_free(var_cell_pool);
 }
 
 /** We've received an EOF from <b>conn</b>. Mark it for close and return. */
@@ -2244,6 +2316,8 @@ connection_or_set_state_open(or_connection_t *conn)
 
   or_handshake_state_free(conn->handshake_state);
   conn->handshake_state = NULL;
+  /* From here on, a shard thread can do our TLS, if we're using them. */
+  orshard_attach_conn(conn);
   connection_start_reading(TO_CONN(conn));
 
   return 0;
@@ -2321,10 +2395,45 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   return fetch_var_cell_from_buf(conn->inbuf, out, or_conn->link_proto);
 }
 
+/** Most fixed-length cells that we take off the inbuf of an open OR
+ * connection at once. */
+#define OR_CONN_CELL_BATCH_MAX 16
+
+/** Take the fixed-length cells at the start of the inbuf of the open
+ * connection <b>conn</b> off it in one pass, up to OR_CONN_CELL_BATCH_MAX of
+ * them and up to the first variable-length cell, and process them.
+ *
+ * Cells that arrive together tend to be for the same circuit; the circuit ID
+ * table of the channel remembers the last circuit that it found, so runs of
+ * such cells share one lookup.
+ *
+ * Return the number of cells that we processed. */
+static size_t
+connection_or_process_cell_batch(or_connection_t *conn)
+{
+  cell_t cells[OR_CONN_CELL_BATCH_MAX];
+  const int wide_circ_ids = conn->wide_circ_ids;
+  const size_t cell_network_size = get_cell_network_size(wide_circ_ids);
+  const char *head;
+  size_t n_cells, i;
+
+  n_cells = peek_fixed_cells_from_buf(TO_CONN(conn)->inbuf, wide_circ_ids,
+                                      conn->link_proto,
+                                      OR_CONN_CELL_BATCH_MAX, &head);
+  for (i = 0; i < n_cells; ++i)
+    cell_unpack(&cells[i], head + i * cell_network_size, wide_circ_ids);
+  buf_drain(TO_CONN(conn)->inbuf, n_cells * cell_network_size);
+
+  for (i = 0; i < n_cells; ++i)
+    channel_tls_handle_cell(&cells[i], conn);
+  return n_cells;
+}
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
- * and hand it to command_process_cell().
+ * and hand it to command_process_cell().  Once the connection is open,
+ * take fixed-length cells off in batches.
  *
  * Always return 0.
  */
@@ -2351,7 +2460,7 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
               TOR_SOCKET_T_FORMAT": starting, inbuf_datalen %d "
               "(%d pending in tls object).",
               conn->base_.s,(int)connection_get_inbuf_len(TO_CONN(conn)),
-              tor_tls_get_pending_bytes(conn->tls));
+              conn->shard_conn ? 0 : tor_tls_get_pending_bytes(conn->tls));
     if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
       if (!var_cell)
         return 0; /* not yet. */
@@ -2377,6 +2486,11 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
         channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
 
       circuit_build_times_network_is_live(get_circuit_build_times_mutable());
+
+      if (conn->base_.state == OR_CONN_STATE_OPEN &&
+          connection_or_process_cell_batch(conn) > 0)
+        continue;
+
       connection_buf_get_bytes(buf, cell_network_size, TO_CONN(conn));
 
       /* retrieve cell info from buf (create the host-order struct from the
@@ -104,6 +104,10 @@ var_cell_t *var_cell_new(uint16_t payload_len);
 var_cell_t *var_cell_copy(const var_cell_t *src);
 void var_cell_free_(var_cell_t *cell);
 #define var_cell_free(cell) FREE_AND_NULL(var_cell_t, var_cell_free_, (cell))
+struct slab_pool_t;
+const struct slab_pool_t *var_cell_get_pool(void);
+void var_cell_pool_trim(void);
+void var_cell_pool_free_all(void);
 
 /* DOCDOC */
 #define MIN_LINK_PROTO_FOR_WIDE_CIRC_IDS 4
@@ -91,6 +91,28 @@ struct connection_t {
   /** CONNECT/SOCKS proxy client handshake state (for outgoing connections). */
   unsigned int proxy_state:4;
 
+  /* For connections whose socket I/O we batch with io_uring:
+   */
+  /** True iff we're waiting for the next io_uring batch to read from this
+   * connection's socket. */
+  unsigned int uring_read_queued:1;
+  /** True iff we're waiting for the next io_uring batch to write to this
+   * connection's socket. */
+  unsigned int uring_write_queued:1;
+  /** True iff an io_uring batch has already done our next socket read, and
+   * left its outcome in uring_read_result and uring_read_error. */
+  unsigned int uring_read_done:1;
+  /** True iff an io_uring batch has already done our next socket write, and
+   * left its outcome in uring_write_result. */
+  unsigned int uring_write_done:1;
+  /** True iff the read in uring_read_result reached end-of-file. */
+  unsigned int uring_read_eof:1;
+  /** Outcomes of the last batched read and write, as buf_read_from_socket()
+   * and buf_flush_to_socket() would return them. */
+  int uring_read_result;
+  int uring_read_error;
+  int uring_write_result;
+
   /** Our socket; set to TOR_INVALID_SOCKET if this connection is closed,
    * or has no socket. */
   tor_socket_t s;
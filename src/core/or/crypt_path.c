@@ -30,6 +30,7 @@
 #include "core/crypto/onion_crypto.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
+#include "core/or/congestion_control.h"
 #include "core/or/extendinfo.h"
 
 #include "lib/crypt_ops/crypto_dh.h"
@@ -169,6 +170,7 @@ cpath_free(crypt_path_t *victim)
   onion_handshake_state_release(&victim->handshake_state);
   crypto_dh_free(victim->rend_dh_handshake_state);
   extend_info_free(victim->extend_info);
+  congestion_control_free(victim->ccontrol);
 
   memwipe(victim, 0xBB, sizeof(crypt_path_t)); /* poison memory */
   tor_free(victim);
@@ -188,6 +190,43 @@ cpath_crypt_cell(const crypt_path_t *cpath, uint8_t *payload, bool is_decrypt)
   }
 }
 
+/** Encrypt <b>payload</b> for every hop of the circuit with path
+ * <b>cpath</b>, from <b>layer_hint</b> back to the first hop, as we do for
+ * a cell that we're sending to <b>layer_hint</b>.
+ *
+ * Every layer XORs an independent keystream onto the payload, so we hand
+ * them all to the cipher as one batch. */
+void
+cpath_crypt_cell_outbound(const crypt_path_t *cpath,
+                          const crypt_path_t *layer_hint, uint8_t *payload)
+{
+  crypto_cipher_t *ciphers[RELAY_CRYPT_BATCH_MAX];
+  uint8_t *payloads[RELAY_CRYPT_BATCH_MAX];
+  const crypt_path_t *thishop = layer_hint;
+  int n = 0;
+
+  /* moving from farthest to nearest hop */
+  do {
+    tor_assert(thishop);
+    ciphers[n] = thishop->pvt_crypto.f_crypto;
+    payloads[n] = payload;
+    if (++n == RELAY_CRYPT_BATCH_MAX) {
+      relay_crypt_payloads(ciphers, payloads, n);
+      n = 0;
+    }
+    thishop = thishop->prev;
+  } while (thishop != cpath->prev);
+
+  relay_crypt_payloads(ciphers, payloads, n);
+}
+
+/** Getter for the incoming cipher of <b>cpath</b>. */
+crypto_cipher_t *
+cpath_get_incoming_cipher(const crypt_path_t *cpath)
+{
+  return cpath->pvt_crypto.b_crypto;
+}
+
 /** Getter for the incoming digest of <b>cpath</b>. */
 struct crypto_digest_t *
 cpath_get_incoming_digest(const crypt_path_t *cpath)
@@ -195,12 +234,12 @@ cpath_get_incoming_digest(const crypt_path_t *cpath)
   return cpath->pvt_crypto.b_digest;
 }
 
-/** Set the right integrity digest on the outgoing <b>cell</b> based on the
- *  cell payload and update the forward digest of <b>cpath</b>. */
+/** Set the right integrity digest on the outgoing relay cell
+ *  <b>payload</b> and update the forward digest of <b>cpath</b>. */
 void
-cpath_set_cell_forward_digest(crypt_path_t *cpath, cell_t *cell)
+cpath_set_cell_forward_digest(crypt_path_t *cpath, uint8_t *payload)
 {
-  relay_set_digest(cpath->pvt_crypto.f_digest, cell);
+  relay_set_digest(cpath->pvt_crypto.f_digest, payload);
 }
 
 /************ cpath sendme API ***************************/
@@ -24,6 +24,13 @@ void cpath_extend_linked_list(crypt_path_t **head_ptr, crypt_path_t *new_hop);
 void
 cpath_crypt_cell(const crypt_path_t *cpath, uint8_t *payload, bool is_decrypt);
 
+void
+cpath_crypt_cell_outbound(const crypt_path_t *cpath,
+                          const crypt_path_t *layer_hint, uint8_t *payload);
+
+crypto_cipher_t *
+cpath_get_incoming_cipher(const crypt_path_t *cpath);
+
 struct crypto_digest_t *
 cpath_get_incoming_digest(const crypt_path_t *cpath);
 
@@ -31,7 +38,7 @@ void cpath_sendme_record_cell_digest(crypt_path_t *cpath,
                                      bool is_foward_digest);
 
 void
-cpath_set_cell_forward_digest(crypt_path_t *cpath, cell_t *cell);
+cpath_set_cell_forward_digest(crypt_path_t *cpath, uint8_t *payload);
 
 crypt_path_t *cpath_get_next_non_open_hop(crypt_path_t *cpath);
 
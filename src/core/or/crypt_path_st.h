@@ -79,6 +79,9 @@ struct crypt_path_t {
                        * at this step? */
   int deliver_window; /**< How many cells are we willing to deliver originating
                        * at this step? */
+  /** If we negotiated congestion control with this hop, the state that
+   * replaces package_window. */
+  struct congestion_control_t *ccontrol;
 
   /*********************** Private members ****************************/
 
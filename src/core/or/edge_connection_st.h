@@ -72,6 +72,26 @@ struct edge_connection_t {
    * cells. */
   unsigned int edge_blocked_on_circ:1;
 
+  /** True iff we send this stream's data as MP_DATA cells, spread over the
+   * multipath set of its circuit. Once set, this never goes back to 0. */
+  unsigned int mp_sending:1;
+  /** True iff the other end sent us a final sequence number with its END
+   * cell before we had all the data up to it; see mp_end_seq. */
+  unsigned int mp_end_pending:1;
+  /** The END reason that we got along with mp_end_seq. */
+  uint8_t mp_end_reason;
+
+  /** Sequence number of the next data cell that we send on this stream. */
+  uint32_t mp_next_send_seq;
+  /** Sequence number of the next data cell that we deliver on this stream. */
+  uint32_t mp_next_recv_seq;
+  /** If mp_end_pending is set, the number of data cells that the other end
+   * sent before its END cell. */
+  uint32_t mp_end_seq;
+  /** Multipath data cells that arrived ahead of mp_next_recv_seq, ordered by
+   * sequence number. */
+  smartlist_t *mp_reorder;
+
   /** Unique ID for directory requests; this used to be in connection_t, but
    * that's going away and being used on channels instead.  We still tag
    * edge connections with dirreq_id from circuits, so it's copied here. */
@@ -0,0 +1,634 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file multipath.c
+ * \brief Spread the data of a stream over several circuits to the same exit.
+ *
+ * A stream normally lives on one circuit, so it can go no faster than the
+ * slowest relay of that circuit.  When MultipathCircuits is set, a client
+ * that opens a circuit for exit streams builds MultipathCircuits - 1 more
+ * circuits ("legs") to the same exit, and links them all into a multipath
+ * set.  It sends an MP_LINK cell with a random nonce on each leg; the exit
+ * puts every circuit that sent it the same nonce into one set, and answers
+ * each with MP_LINKED.  A leg is "linked" once both ends agree on it.
+ *
+ * We only build the other legs once the user attaches a CONNECT stream to
+ * the circuit: most of the circuits that we build ahead of time, or to
+ * measure how long circuits take to build, never carry a stream, and the
+ * legs would cost more than they save.
+ *
+ * Streams are still opened on one circuit, which we call their home
+ * circuit, and stream IDs are unique over the whole set.  Each end numbers
+ * the data cells that it sends on a stream, starting at 0.  DATA cells
+ * carry their number implicitly: they arrive in order on the home circuit.
+ * Once an end has received a stream-level SENDME on a stream whose home
+ * circuit is linked, it knows that the other end has the stream open, so it
+ * switches to MP_DATA cells, which carry an explicit sequence number, and
+ * sends each on whichever linked leg has the most room.  The receiver
+ * delivers the data in order, and holds cells that arrive early until the
+ * gap before them is filled.  It doesn't count the cells that it holds as
+ * delivered when it decides whether to send a stream-level SENDME, so the
+ * stream windows bound how much data it may have to hold for each stream;
+ * and it closes a set that makes it hold more than
+ * MULTIPATH_MAX_HELD_CELLS in all.
+ *
+ * An END cell from an end that uses MP_DATA also carries the number of data
+ * cells that it sent, so that the receiver can wait for the last of them
+ * before it closes the stream.
+ *
+ * Data cells in flight on a leg are lost if that leg closes, so when a
+ * linked leg closes, we close the whole set.
+ **/
+
+#define MULTIPATH_PRIVATE
+
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/mainloop/connection.h"
+#include "core/or/circuitbuild.h"
+#include "core/or/circuitlist.h"
+#include "core/or/circuituse.h"
+#include "core/or/multipath.h"
+#include "core/or/relay.h"
+#include "core/or/sendme.h"
+#include "feature/nodelist/nodelist.h"
+#include "lib/crypt_ops/crypto_rand.h"
+
+#include "core/or/cpath_build_state_st.h"
+#include "core/or/crypt_path_st.h"
+#include "core/or/edge_connection_st.h"
+#include "core/or/entry_connection_st.h"
+#include "core/or/extend_info_st.h"
+#include "core/or/or_circuit_st.h"
+#include "core/or/origin_circuit_st.h"
+#include "core/or/socks_request_st.h"
+
+/** A set of circuits between the same client and exit that carry data for
+ * each other's streams. */
+struct multipath_set_t {
+  /** The nonce that the client chose for this set. */
+  uint8_t nonce[MULTIPATH_NONCE_LEN];
+  /** The circuits in this set, linked or not. On a client, the first one is
+   * the circuit that made us build the others. */
+  smartlist_t *legs;
+  /** True iff this set is in exit_sets. */
+  unsigned int is_registered : 1;
+  /** How many data cells we are holding for the streams whose home circuit
+   * is in this set, because they arrived out of order. */
+  int n_held_cells;
+};
+
+/** A data cell that arrived before the ones that come before it. */
+typedef struct mp_data_cell_t {
+  /** Sequence number of this cell. */
+  uint32_t seq;
+  /** Number of bytes in <b>body</b>. */
+  uint16_t len;
+  /** The stream data. */
+  uint8_t body[FLEXIBLE_ARRAY_MEMBER];
+} mp_data_cell_t;
+
+/** Map from nonce to the multipath_set_t for every set that clients have
+ * asked us to link as an exit. */
+static digest256map_t *exit_sets = NULL;
+
+/** Return a new multipath set named by <b>nonce</b>, or by a random nonce if
+ * <b>nonce</b> is NULL. If <b>nonce</b> is set, we are the exit, and we
+ * register the set so that other circuits can join it. */
+STATIC multipath_set_t *
+multipath_set_new(const uint8_t *nonce)
+{
+  multipath_set_t *set = tor_malloc_zero(sizeof(multipath_set_t));
+  set->legs = smartlist_new();
+  if (nonce) {
+    memcpy(set->nonce, nonce, MULTIPATH_NONCE_LEN);
+    if (!exit_sets)
+      exit_sets = digest256map_new();
+    digest256map_set(exit_sets, set->nonce, set);
+    set->is_registered = 1;
+  } else {
+    crypto_rand((char *) set->nonce, sizeof(set->nonce));
+  }
+  return set;
+}
+
+/** Release all storage held by <b>set</b>. Its legs must already have been
+ * detached from it. */
+static void
+multipath_set_free_(multipath_set_t *set)
+{
+  if (!set)
+    return;
+  if (set->is_registered)
+    digest256map_remove(exit_sets, set->nonce);
+  smartlist_free(set->legs);
+  tor_free(set);
+}
+#define multipath_set_free(set) \
+  FREE_AND_NULL(multipath_set_t, multipath_set_free_, (set))
+
+/** Add <b>circ</b> to <b>set</b>, as a leg that isn't linked yet. */
+STATIC void
+multipath_set_add_leg(multipath_set_t *set, circuit_t *circ)
+{
+  tor_assert(set);
+  tor_assert(circ);
+  tor_assert(!circ->mp_set);
+
+  smartlist_add(set->legs, circ);
+  circ->mp_set = set;
+  circ->mp_linked = 0;
+}
+
+/** Return the number of linked legs in <b>set</b>. */
+STATIC int
+multipath_set_n_linked(const multipath_set_t *set)
+{
+  int n = 0;
+  SMARTLIST_FOREACH(set->legs, const circuit_t *, leg,
+                    n += leg->mp_linked);
+  return n;
+}
+
+/** Return the number of out-of-order data cells that we are holding for the
+ * streams of <b>set</b>. */
+STATIC int
+multipath_set_n_held_cells(const multipath_set_t *set)
+{
+  return set->n_held_cells;
+}
+
+/** Remove <b>circ</b> from its multipath set, without closing anything. */
+static void
+multipath_detach_leg(circuit_t *circ)
+{
+  smartlist_remove_keeporder(circ->mp_set->legs, circ);
+  circ->mp_set = NULL;
+  circ->mp_linked = 0;
+}
+
+/** Return the hop of <b>circ</b> at which its multipath set ends: the last
+ * hop if we are the client, or NULL if we are the exit. */
+static crypt_path_t *
+multipath_leg_layer(const circuit_t *circ)
+{
+  if (CIRCUIT_IS_ORIGIN(circ))
+    return CONST_TO_ORIGIN_CIRCUIT(circ)->cpath->prev;
+  return NULL;
+}
+
+/** Return the first stream on the list of streams that <b>circ</b>
+ * delivers to, or NULL if it has none. */
+static edge_connection_t *
+multipath_leg_streams(const circuit_t *circ)
+{
+  if (CIRCUIT_IS_ORIGIN(circ))
+    return CONST_TO_ORIGIN_CIRCUIT(circ)->p_streams;
+  return CONST_TO_OR_CIRCUIT(circ)->n_streams;
+}
+
+/** Send an MP_LINK cell on the client circuit <b>circ</b>, to ask its exit
+ * to link it into its multipath set. Return 0 on success, or -1 if the
+ * circuit was closed. */
+static int
+multipath_send_link(origin_circuit_t *circ)
+{
+  circuit_t *c = TO_CIRCUIT(circ);
+  if (relay_send_command_from_edge(0, c, RELAY_COMMAND_MP_LINK,
+                                   (const char *) c->mp_set->nonce,
+                                   MULTIPATH_NONCE_LEN,
+                                   circ->cpath->prev) < 0) {
+    return -1;
+  }
+  log_info(LD_CIRC, "Asked the exit of circuit %u to link it.",
+           (unsigned) circ->global_identifier);
+  return 0;
+}
+
+/** The client circuit <b>circ</b> has just opened. If it is a leg that we
+ * built for a multipath set, ask its exit to link it. */
+void
+multipath_circuit_has_opened(origin_circuit_t *circ)
+{
+  circuit_t *c = TO_CIRCUIT(circ);
+
+  if (c->purpose == CIRCUIT_PURPOSE_C_GENERAL && c->mp_set)
+    multipath_send_link(circ);
+}
+
+/** We have just attached the stream <b>conn</b> to the open client circuit
+ * <b>circ</b>. If the user wants multipath circuits, and this is the first
+ * CONNECT stream on a general-purpose circuit to an exit that supports
+ * them, start a set with <b>circ</b> and build the other legs. */
+void
+multipath_circuit_stream_attached(origin_circuit_t *circ,
+                                  const entry_connection_t *conn)
+{
+  circuit_t *c = TO_CIRCUIT(circ);
+  const cpath_build_state_t *state = circ->build_state;
+  const node_t *node;
+  int n_legs = get_options()->MultipathCircuits;
+  int flags = CIRCLAUNCH_NEED_CAPACITY;
+  int i;
+
+  if (n_legs < 2 || c->mp_set || c->purpose != CIRCUIT_PURPOSE_C_GENERAL)
+    return;
+  if (!conn->socks_request ||
+      conn->socks_request->command != SOCKS_COMMAND_CONNECT)
+    return;
+  if (!state || !state->chosen_exit ||
+      state->is_internal || state->onehop_tunnel)
+    return;
+  node = node_get_by_id(state->chosen_exit->identity_digest);
+  if (!node || !node_supports_multipath(node))
+    return;
+
+  multipath_set_add_leg(multipath_set_new(NULL), c);
+  if (multipath_send_link(circ) < 0) {
+    /* The circuit is closed, and took its set with it. */
+    return;
+  }
+
+  if (state->need_uptime)
+    flags |= CIRCLAUNCH_NEED_UPTIME;
+  for (i = 1; i < n_legs; ++i) {
+    origin_circuit_t *leg =
+      circuit_establish_circuit(CIRCUIT_PURPOSE_C_GENERAL,
+                                state->chosen_exit, flags);
+    if (!leg)
+      break;
+    multipath_set_add_leg(c->mp_set, TO_CIRCUIT(leg));
+  }
+  log_info(LD_CIRC, "Building %d more circuits to link with circuit %u.",
+           i - 1, (unsigned) circ->global_identifier);
+}
+
+/** Process the body (<b>body</b>, <b>body_len</b> bytes) of an MP_LINK cell
+ * that arrived on <b>circ</b>, from the hop <b>layer_hint</b> if we are its
+ * origin. If we can, add <b>circ</b> to the set that the cell names, and
+ * answer with an MP_LINKED cell.
+ *
+ * Return 0 on success, or a negative END_CIRC_REASON if the caller should
+ * close the circuit. */
+int
+multipath_process_link(circuit_t *circ, const crypt_path_t *layer_hint,
+                       const uint8_t *body, size_t body_len)
+{
+  multipath_set_t *set = NULL;
+
+  if (layer_hint || CIRCUIT_IS_ORIGIN(circ) ||
+      circ->purpose != CIRCUIT_PURPOSE_OR ||
+      TO_OR_CIRCUIT(circ)->rend_splice) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "MP_LINK cell on a circuit that can't be linked. Dropping.");
+    return 0;
+  }
+  if (body_len != MULTIPATH_NONCE_LEN) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "MP_LINK cell with bad length %d. Closing circuit.",
+           (int) body_len);
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+  if (circ->mp_set) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "MP_LINK cell on a circuit that is already linked. "
+           "Closing circuit.");
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+
+  if (exit_sets)
+    set = digest256map_get(exit_sets, body);
+  if (!set) {
+    set = multipath_set_new(body);
+  } else if (smartlist_len(set->legs) >= MULTIPATH_MAX_LEGS) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "MP_LINK cell for a multipath set that already has %d "
+           "circuits. Closing circuit.", smartlist_len(set->legs));
+    return -END_CIRC_REASON_RESOURCELIMIT;
+  }
+  multipath_set_add_leg(set, circ);
+  circ->mp_linked = 1;
+
+  log_debug(LD_EXIT, "Linked a circuit into a multipath set of %d.",
+            smartlist_len(set->legs));
+  if (relay_send_command_from_edge(0, circ, RELAY_COMMAND_MP_LINKED,
+                                   (const char *) body, body_len,
+                                   NULL) < 0) {
+    /* The circuit is closed. */
+    return 0;
+  }
+  return 0;
+}
+
+/** Process the body (<b>body</b>, <b>body_len</b> bytes) of an MP_LINKED
+ * cell that arrived on <b>circ</b>, from the hop <b>layer_hint</b> if we
+ * are its origin: the exit has linked <b>circ</b>.
+ *
+ * Return 0 on success, or a negative END_CIRC_REASON if the caller should
+ * close the circuit. */
+int
+multipath_process_linked(circuit_t *circ, const crypt_path_t *layer_hint,
+                         const uint8_t *body, size_t body_len)
+{
+  if (!CIRCUIT_IS_ORIGIN(circ) || !circ->mp_set || circ->mp_linked ||
+      layer_hint != multipath_leg_layer(circ)) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Got an unexpected MP_LINKED cell. Closing circuit.");
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+  if (body_len != MULTIPATH_NONCE_LEN ||
+      tor_memneq(body, circ->mp_set->nonce, MULTIPATH_NONCE_LEN)) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "MP_LINKED cell for the wrong multipath set. Closing circuit.");
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+
+  circ->mp_linked = 1;
+  log_info(LD_CIRC, "Circuit %u is linked; %d of %d in its set.",
+           (unsigned) TO_ORIGIN_CIRCUIT(circ)->global_identifier,
+           multipath_set_n_linked(circ->mp_set),
+           smartlist_len(circ->mp_set->legs));
+  return 0;
+}
+
+/** The circuit <b>circ</b> is being marked for close. If it is a leg that
+ * hasn't been linked, and that we didn't start its set with, just take it
+ * out of its set. Otherwise, data for the set's streams may be lost with
+ * it, so close the whole set. */
+void
+multipath_circuit_about_to_close(circuit_t *circ)
+{
+  multipath_set_t *set = circ->mp_set;
+  smartlist_t *to_close;
+
+  if (!set)
+    return;
+
+  if (!circ->mp_linked && smartlist_get(set->legs, 0) != circ) {
+    multipath_detach_leg(circ);
+    return;
+  }
+
+  to_close = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(set->legs, circuit_t *, leg) {
+    leg->mp_set = NULL;
+    leg->mp_linked = 0;
+    if (leg != circ && !leg->marked_for_close)
+      smartlist_add(to_close, leg);
+  } SMARTLIST_FOREACH_END(leg);
+  multipath_set_free(set);
+
+  SMARTLIST_FOREACH(to_close, circuit_t *, leg,
+                    circuit_mark_for_close(leg, END_CIRC_REASON_FINISHED));
+  smartlist_free(to_close);
+}
+
+/** The circuit <b>circ</b> is about to be freed. Make sure that no
+ * multipath set still points to it. */
+void
+multipath_circuit_free(circuit_t *circ)
+{
+  multipath_set_t *set = circ->mp_set;
+
+  if (!set)
+    return;
+  multipath_detach_leg(circ);
+  if (smartlist_len(set->legs) == 0)
+    multipath_set_free(set);
+}
+
+/** Return the list of circuits in the multipath set of <b>circ</b>, or NULL
+ * if it has none. */
+const smartlist_t *
+multipath_get_legs(const circuit_t *circ)
+{
+  return circ->mp_set ? circ->mp_set->legs : NULL;
+}
+
+/** Return the linked circuit in the multipath set of the home circuit of
+ * <b>conn</b> on which we should send its next data cell: the one that may
+ * send the most cells, counting those it has queued already. Set
+ * *<b>layer_out</b> to the hop to send it to. Return NULL if none of them
+ * may send a cell now. */
+circuit_t *
+multipath_pick_leg(const edge_connection_t *conn, crypt_path_t **layer_out)
+{
+  circuit_t *best = NULL;
+  int best_room = 0;
+
+  tor_assert(conn);
+  tor_assert(layer_out);
+
+  if (!conn->on_circuit || !conn->on_circuit->mp_set)
+    return NULL;
+
+  SMARTLIST_FOREACH_BEGIN(conn->on_circuit->mp_set->legs, circuit_t *, leg) {
+    crypt_path_t *layer;
+    int room, queued;
+
+    if (!leg->mp_linked || leg->marked_for_close ||
+        leg->state != CIRCUIT_STATE_OPEN)
+      continue;
+    layer = multipath_leg_layer(leg);
+    if (CIRCUIT_IS_ORIGIN(leg)) {
+      if (leg->streams_blocked_on_n_chan)
+        continue;
+      queued = leg->n_chan_cells.n;
+    } else {
+      if (leg->streams_blocked_on_p_chan)
+        continue;
+      queued = TO_OR_CIRCUIT(leg)->p_chan_cells.n;
+    }
+    room = sendme_get_circuit_package_window(leg, layer);
+    if (room <= 0)
+      continue;
+    room -= queued;
+    if (!best || room > best_room) {
+      best = leg;
+      best_room = room;
+      *layer_out = layer;
+    }
+  } SMARTLIST_FOREACH_END(leg);
+
+  return best;
+}
+
+/** Return the open stream with ID <b>stream_id</b> on any circuit in the
+ * multipath set of <b>circ</b>, if a multipath data cell for it may arrive
+ * on <b>circ</b> from the hop <b>layer_hint</b>. Else return NULL. */
+edge_connection_t *
+multipath_find_stream(const circuit_t *circ, streamid_t stream_id,
+                      const crypt_path_t *layer_hint)
+{
+  if (!circ->mp_set || !circ->mp_linked ||
+      layer_hint != multipath_leg_layer(circ))
+    return NULL;
+
+  SMARTLIST_FOREACH_BEGIN(circ->mp_set->legs, const circuit_t *, leg) {
+    const crypt_path_t *layer = multipath_leg_layer(leg);
+    edge_connection_t *conn;
+    for (conn = multipath_leg_streams(leg); conn; conn = conn->next_stream) {
+      if (conn->stream_id == stream_id && !conn->base_.marked_for_close &&
+          conn->cpath_layer == layer)
+        return conn;
+    }
+  } SMARTLIST_FOREACH_END(leg);
+
+  return NULL;
+}
+
+/** We got a valid stream-level SENDME for <b>conn</b> on its home circuit
+ * <b>circ</b>: the other end has the stream open. If <b>circ</b> is linked
+ * with another circuit, start sending the data of <b>conn</b> over both. */
+void
+multipath_stream_note_sendme(edge_connection_t *conn, const circuit_t *circ)
+{
+  if (conn->mp_sending || !circ->mp_set || !circ->mp_linked ||
+      multipath_set_n_linked(circ->mp_set) < 2)
+    return;
+
+  conn->mp_sending = 1;
+  log_info(CIRCUIT_IS_ORIGIN(circ) ? LD_APP : LD_EXIT,
+           "Spreading stream %d over %d circuits.", conn->stream_id,
+           multipath_set_n_linked(circ->mp_set));
+}
+
+/** Return the multipath set of the home circuit of <b>conn</b>, or NULL if
+ * it has none. */
+static multipath_set_t *
+multipath_stream_get_set(const edge_connection_t *conn)
+{
+  return conn->on_circuit ? conn->on_circuit->mp_set : NULL;
+}
+
+/** Note that we are no longer holding <b>n</b> data cells for
+ * <b>conn</b>. */
+static void
+multipath_stream_note_released(const edge_connection_t *conn, int n)
+{
+  multipath_set_t *set = multipath_stream_get_set(conn);
+
+  if (set)
+    set->n_held_cells = MAX(set->n_held_cells - n, 0);
+}
+
+/** Return the number of data cells that we are holding for <b>conn</b>,
+ * because they arrived before the ones that come before them. */
+int
+multipath_stream_n_held(const edge_connection_t *conn)
+{
+  return conn->mp_reorder ? smartlist_len(conn->mp_reorder) : 0;
+}
+
+/** Deliver the data cells of <b>conn</b> that we are holding, for as long
+ * as the next one in sequence is among them. */
+static void
+multipath_stream_flush(edge_connection_t *conn)
+{
+  int n_released = 0;
+
+  while (smartlist_len(conn->mp_reorder)) {
+    mp_data_cell_t *cell = smartlist_get(conn->mp_reorder, 0);
+    if (cell->seq != conn->mp_next_recv_seq)
+      break;
+    connection_buf_add((const char *) cell->body, cell->len, TO_CONN(conn));
+    ++conn->mp_next_recv_seq;
+    smartlist_del_keeporder(conn->mp_reorder, 0);
+    tor_free(cell);
+    ++n_released;
+  }
+  multipath_stream_note_released(conn, n_released);
+}
+
+/** We got the data cell with sequence number <b>seq</b> and body
+ * <b>data</b> (<b>data_len</b> bytes) for <b>conn</b>. Deliver it, and any
+ * that we held for it, if it is next in sequence; otherwise, hold it.
+ *
+ * Return 0 on success, or -1 if the cell breaks the protocol. */
+int
+multipath_stream_data_received(edge_connection_t *conn, uint32_t seq,
+                               const uint8_t *data, size_t data_len)
+{
+  /* Sequence numbers wrap, so compare them by their distance. */
+  const int32_t ahead = (int32_t) (seq - conn->mp_next_recv_seq);
+  /* The most data cells that the other end may have in flight on this
+   * stream: see sendme_get_stream_deliver_window(). */
+  const int window = STREAMWINDOW_START +
+    sendme_get_stream_deliver_window(conn) - conn->deliver_window;
+  multipath_set_t *set = multipath_stream_get_set(conn);
+  mp_data_cell_t *cell;
+  int idx;
+
+  tor_assert(data_len <= RELAY_PAYLOAD_SIZE);
+
+  if (ahead == 0) {
+    connection_buf_add((const char *) data, data_len, TO_CONN(conn));
+    ++conn->mp_next_recv_seq;
+    if (conn->mp_reorder)
+      multipath_stream_flush(conn);
+    return 0;
+  }
+
+  /* The stream window keeps the sender from getting further ahead. */
+  if (ahead < 0 || ahead > window) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Multipath data cell %u for stream %d is out of its window "
+           "(expecting %u).", (unsigned) seq, conn->stream_id,
+           (unsigned) conn->mp_next_recv_seq);
+    return -1;
+  }
+
+  if (!conn->mp_reorder)
+    conn->mp_reorder = smartlist_new();
+  /* Cells mostly arrive in order, so search from the end. */
+  for (idx = smartlist_len(conn->mp_reorder); idx > 0; --idx) {
+    const mp_data_cell_t *prev = smartlist_get(conn->mp_reorder, idx - 1);
+    const int32_t prev_ahead =
+      (int32_t) (prev->seq - conn->mp_next_recv_seq);
+    if (prev_ahead == ahead) {
+      log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+             "Got multipath data cell %u twice for stream %d.",
+             (unsigned) seq, conn->stream_id);
+      return -1;
+    }
+    if (prev_ahead < ahead)
+      break;
+  }
+
+  if (set && multipath_set_n_held_cells(set) >= MULTIPATH_MAX_HELD_CELLS) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Holding %d multipath data cells for one set of circuits; "
+           "closing it.", multipath_set_n_held_cells(set));
+    return -1;
+  }
+
+  cell = tor_malloc(offsetof(mp_data_cell_t, body) + data_len);
+  cell->seq = seq;
+  cell->len = (uint16_t) data_len;
+  memcpy(cell->body, data, data_len);
+  smartlist_insert(conn->mp_reorder, idx, cell);
+  if (set)
+    ++set->n_held_cells;
+  return 0;
+}
+
+/** Release the multipath data cells that <b>conn</b> is holding. */
+void
+multipath_stream_clear(edge_connection_t *conn)
+{
+  if (!conn->mp_reorder)
+    return;
+  multipath_stream_note_released(conn, smartlist_len(conn->mp_reorder));
+  SMARTLIST_FOREACH(conn->mp_reorder, mp_data_cell_t *, cell,
+                    tor_free(cell));
+  smartlist_free(conn->mp_reorder);
+}
+
+/** Release all storage held by the multipath module. Every circuit has been
+ * freed by now, and with them, every set. */
+void
+multipath_free_all(void)
+{
+  digest256map_free(exit_sets, NULL);
+}
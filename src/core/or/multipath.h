@@ -0,0 +1,60 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file multipath.h
+ * \brief Header file for multipath.c.
+ **/
+
+#ifndef TOR_MULTIPATH_H
+#define TOR_MULTIPATH_H
+
+typedef struct multipath_set_t multipath_set_t;
+
+/** Length of the nonce that names a multipath set in MP_LINK and MP_LINKED
+ * cells. */
+#define MULTIPATH_NONCE_LEN 32
+/** Length of the sequence number at the start of an MP_DATA cell body, and
+ * after the reason of an END cell for a multipath stream. */
+#define MULTIPATH_SEQ_LEN 4
+/** Most circuits that an exit lets a client put in one multipath set. */
+#define MULTIPATH_MAX_LEGS 8
+/** Most out-of-order data cells that we hold for the streams of one
+ * multipath set, over all of them: about 1 MB. */
+#define MULTIPATH_MAX_HELD_CELLS 2048
+
+void multipath_circuit_has_opened(origin_circuit_t *circ);
+void multipath_circuit_stream_attached(origin_circuit_t *circ,
+                                       const entry_connection_t *conn);
+int multipath_process_link(circuit_t *circ, const crypt_path_t *layer_hint,
+                           const uint8_t *body, size_t body_len);
+int multipath_process_linked(circuit_t *circ,
+                             const crypt_path_t *layer_hint,
+                             const uint8_t *body, size_t body_len);
+void multipath_circuit_about_to_close(circuit_t *circ);
+void multipath_circuit_free(circuit_t *circ);
+
+const smartlist_t *multipath_get_legs(const circuit_t *circ);
+circuit_t *multipath_pick_leg(const edge_connection_t *conn,
+                              crypt_path_t **layer_out);
+edge_connection_t *multipath_find_stream(const circuit_t *circ,
+                                         streamid_t stream_id,
+                                         const crypt_path_t *layer_hint);
+
+void multipath_stream_note_sendme(edge_connection_t *conn,
+                                  const circuit_t *circ);
+int multipath_stream_data_received(edge_connection_t *conn, uint32_t seq,
+                                   const uint8_t *data, size_t data_len);
+int multipath_stream_n_held(const edge_connection_t *conn);
+void multipath_stream_clear(edge_connection_t *conn);
+
+void multipath_free_all(void);
+
+#ifdef MULTIPATH_PRIVATE
+STATIC multipath_set_t *multipath_set_new(const uint8_t *nonce);
+STATIC void multipath_set_add_leg(multipath_set_t *set, circuit_t *circ);
+STATIC int multipath_set_n_linked(const multipath_set_t *set);
+STATIC int multipath_set_n_held_cells(const multipath_set_t *set);
+#endif
+
+#endif /* !defined(TOR_MULTIPATH_H) */
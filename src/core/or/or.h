@@ -210,6 +210,17 @@ struct curve25519_public_key_t;
 #define RELAY_COMMAND_PADDING_NEGOTIATE 41
 #define RELAY_COMMAND_PADDING_NEGOTIATED 42
 
+/* The commands below are not assigned in tor-spec.txt.  We keep them well
+ * clear of the assigned ranges, so that they can't be mistaken for cells
+ * that other implementations send; they are only ever sent to relays that
+ * advertise the matching subprotocol. */
+#define RELAY_COMMAND_CC_NEGOTIATE 80
+#define RELAY_COMMAND_CC_NEGOTIATED 81
+
+#define RELAY_COMMAND_MP_LINK 82
+#define RELAY_COMMAND_MP_LINKED 83
+#define RELAY_COMMAND_MP_DATA 84
+
 /* Reasons why an OR connection is closed. */
 #define END_OR_CONN_REASON_DONE           1
 #define END_OR_CONN_REASON_REFUSED        2 /* connection refused */
@@ -861,6 +872,16 @@ typedef struct protover_summary_flags_t {
    * negotiate hs circuit setup padding. Requires Padding=2. */
   unsigned int supports_hs_setup_padding : 1;
 
+  /** True iff this router has a protocol list that allows clients to
+   * negotiate congestion control on circuits that exit from it. Requires
+   * DelayCC=1. */
+  unsigned int supports_congestion_control : 1;
+
+  /** True iff this router has a protocol list that allows clients to link
+   * several circuits that exit from it, and to send a stream's data over all
+   * of them. Requires Multipath=1. */
+  unsigned int supports_multipath : 1;
+
 } protover_summary_flags_t;
 
 typedef struct routerinfo_t routerinfo_t;
@@ -43,6 +43,9 @@ struct or_connection_t {
 
   struct tor_tls_t *tls; /**< TLS connection state. */
   int tls_error; /**< Last tor_tls error code. */
+  /** If a worker thread is doing our TLS and socket I/O, its state for this
+   * connection; otherwise NULL.  See orshard.c. */
+  struct orshard_conn_t *shard_conn;
   /** When we last used this conn for any client traffic. If not
    * recent, we can rate limit it further. */
 
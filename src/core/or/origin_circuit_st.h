@@ -170,6 +170,10 @@ struct origin_circuit_t {
    * not try to negotiate further circuit padding. */
   unsigned padding_negotiation_failed : 1;
 
+  /** Set iff we have asked the last hop of this circuit to use congestion
+   * control, and it has not answered yet. */
+  unsigned int cc_negotiation_pending : 1;
+
   /**
    * Tristate variable to guard against pathbias miscounting
    * due to circuit purpose transitions changing the decision
@@ -21,6 +21,7 @@
 #include "feature/client/bridges.h"
 #include "app/config/config.h"
 #include "core/or/policies.h"
+#include "core/or/policy_compile.h"
 #include "feature/dirparse/policy_parse.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
@@ -48,6 +49,9 @@
 static smartlist_t *socks_policy = NULL;
 /** Policy that addresses for incoming directory connections must match. */
 static smartlist_t *dir_policy = NULL;
+/** Policy that addresses for incoming MetricsPort connections must match;
+ * if it is NULL, only localhost may connect. */
+static smartlist_t *metrics_policy = NULL;
 /** Policy that addresses for incoming router descriptors must match in order
  * to be published by us. */
 static smartlist_t *authdir_reject_policy = NULL;
@@ -1060,6 +1064,21 @@ socks_policy_permits_address(const tor_addr_t *addr)
   return addr_policy_permits_tor_addr(addr, 1, socks_policy);
 }
 
+/** Return 1 if <b>addr</b> is permitted to connect to our MetricsPort,
+ * based on <b>metrics_policy</b>. Else return 0.
+ *
+ * Unlike the other policies, an address that no MetricsPortPolicy entry
+ * accepts is rejected; and with no MetricsPortPolicy at all, we only accept
+ * loopback addresses.
+ */
+int
+metrics_policy_permits_address(const tor_addr_t *addr)
+{
+  if (!metrics_policy)
+    return tor_addr_is_loopback(addr);
+  return addr_policy_permits_tor_addr(addr, 1, metrics_policy);
+}
+
 /** Return true iff the address <b>addr</b> is in a country listed in the
  * case-insensitive list of country codes <b>cc_list</b>. */
 static int
@@ -1153,6 +1172,8 @@ validate_addr_policies(const or_options_t *options, char **msg)
     REJECT("Error in DirPolicy entry.");
   if (parse_addr_policy(options->SocksPolicy, &addr_policy, -1))
     REJECT("Error in SocksPolicy entry.");
+  if (parse_addr_policy(options->MetricsPortPolicy, &addr_policy, -1))
+    REJECT("Error in MetricsPortPolicy entry.");
   if (parse_addr_policy(options->AuthDirReject, &addr_policy,
                         ADDR_POLICY_REJECT))
     REJECT("Error in AuthDirReject entry.");
@@ -1230,6 +1251,12 @@ policies_parse_from_options(const or_options_t *options)
   if (load_policy_from_option(options->DirPolicy, "DirPolicy",
                               &dir_policy, -1) < 0)
     ret = -1;
+  if (load_policy_from_option(options->MetricsPortPolicy, "MetricsPortPolicy",
+                              &metrics_policy, -1) < 0)
+    ret = -1;
+  /* Anything that MetricsPortPolicy doesn't accept is rejected. */
+  if (metrics_policy)
+    policies_exit_policy_append_reject_star(&metrics_policy);
   if (load_policy_from_option(options->AuthDirReject, "AuthDirReject",
                               &authdir_reject_policy, ADDR_POLICY_REJECT) < 0)
     ret = -1;
@@ -2850,6 +2877,27 @@ short_policy_is_reject_star(const short_policy_t *policy)
           policy->entries[0].max_port == 65535);
 }
 
+/** Decide whether addr:port is probably or definitely accepted or rejected by
+ * the exit policy of <b>router</b>, just as compare_tor_addr_to_addr_policy()
+ * would, but using a compiled copy of the policy. */
+addr_policy_result_t
+compare_tor_addr_to_router_exit_policy(const tor_addr_t *addr, uint16_t port,
+                                       const routerinfo_t *router)
+{
+  if (!router->exit_policy)
+    return compare_tor_addr_to_addr_policy(addr, port, NULL);
+
+  if (!router->compiled_exit_policy) {
+    /* The compiled policy is only a cache of exit_policy, which never
+     * changes once the routerinfo is built. */
+    routerinfo_t *mutable_router = (routerinfo_t *) router;
+    mutable_router->compiled_exit_policy =
+      addr_policy_compile(router->exit_policy);
+  }
+  return compare_tor_addr_to_compiled_policy(addr, port,
+                                             router->compiled_exit_policy);
+}
+
 /** Decide whether addr:port is probably or definitely accepted or rejected by
  * <b>node</b>.  See compare_tor_addr_to_addr_policy for details on addr/port
  * interpretation. */
@@ -2873,7 +2921,7 @@ compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
   }
 
   if (node->ri) {
-    return compare_tor_addr_to_addr_policy(addr, port, node->ri->exit_policy);
+    return compare_tor_addr_to_router_exit_policy(addr, port, node->ri);
   } else if (node->md) {
     if (node->md->exit_policy == NULL)
       return ADDR_POLICY_REJECTED;
@@ -3074,6 +3122,8 @@ policies_free_all(void)
   socks_policy = NULL;
   addr_policy_list_free(dir_policy);
   dir_policy = NULL;
+  addr_policy_list_free(metrics_policy);
+  metrics_policy = NULL;
   addr_policy_list_free(authdir_reject_policy);
   authdir_reject_policy = NULL;
   addr_policy_list_free(authdir_invalid_policy);
@@ -3081,6 +3131,8 @@ policies_free_all(void)
   addr_policy_list_free(authdir_badexit_policy);
   authdir_badexit_policy = NULL;
 
+  policy_compile_free_all();
+
   if (!HT_EMPTY(&policy_root)) {
     policy_map_ent_t **ent;
     int n = 0;
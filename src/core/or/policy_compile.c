@@ -0,0 +1,606 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file policy_compile.c
+ * \brief Compile address policies into a form that we can match in
+ *   logarithmic time.
+ *
+ * compare_tor_addr_to_addr_policy() walks a policy from the top, and stops
+ * at the first entry that matches.  That's fine for short policies, but an
+ * exit checks its own policy for every BEGIN cell, and a client checks the
+ * policy of every candidate exit, and a policy can have hundreds of entries.
+ *
+ * A compiled policy splits the port space at every port where some entry
+ * starts or stops applying.  Within each of those port ranges, the same
+ * entries apply to every port, so we can flatten them, in order, into a
+ * sorted list of disjoint address ranges, each with a fixed answer.  Most
+ * port ranges end up with the same entries as some other port range, so
+ * they share an address table.  Matching an address and a port is then two
+ * binary searches.
+ *
+ * Every entry in a parsed policy is the canonical copy of that entry (see
+ * addr_policy_get_canonical_entry()), so two identical policies are two
+ * identical lists of pointers.  We use that to share one compiled policy
+ * among all the routers that declare the same exit policy.
+ **/
+
+#define POLICY_COMPILE_PRIVATE
+
+#include "core/or/or.h"
+#include "core/or/policies.h"
+#include "core/or/policy_compile.h"
+#include "lib/container/map.h"
+#include "lib/crypt_ops/crypto_digest.h"
+#include "ext/ht.h"
+#include "ext/siphash.h"
+
+#include "core/or/addr_policy_st.h"
+
+/** A 128-bit address, in host order.  IPv4 addresses use only <b>lo</b>. */
+typedef struct policy_addr_key_t {
+  uint64_t hi;
+  uint64_t lo;
+} policy_addr_key_t;
+
+/** A range of addresses, from <b>lo</b> to <b>hi</b> inclusive, that all
+ * get the answer <b>result</b>. */
+typedef struct policy_addr_range_t {
+  policy_addr_key_t lo;
+  policy_addr_key_t hi;
+  addr_policy_result_t result;
+} policy_addr_range_t;
+
+/** A map from every address of one family to a policy result.
+ *
+ * The address space is split into <b>n</b> ranges: range <b>i</b> starts at
+ * starts[i] and runs up to the start of range i+1, and every address in it
+ * gets results[i].  starts[0] is always 0. */
+typedef struct policy_addr_table_t {
+  int n_v4;
+  uint32_t *v4_starts;
+  int8_t *v4_results;
+  int n_v6;
+  policy_addr_key_t *v6_starts;
+  int8_t *v6_results;
+} policy_addr_table_t;
+
+/** An address policy, compiled for fast lookups. */
+struct addr_policy_compiled_t {
+  HT_ENTRY(addr_policy_compiled_t) node;
+  /** How many references are there to this compiled policy? */
+  int refcnt;
+  /** The policy that we compiled: a list of canonical addr_policy_t, to each
+   * of which we hold a reference. */
+  smartlist_t *policy;
+  /** True iff this policy was too complex to compile, so we just walk
+   * <b>policy</b>. */
+  unsigned int is_linear:1;
+
+  /** The number of port ranges. */
+  int n_port_ranges;
+  /** The first port of each port range, in ascending order.  The first port
+   * range always starts at 0. */
+  uint16_t *port_starts;
+  /** For each port range, the index in <b>tables</b> of its address
+   * table. */
+  int *port_tables;
+  /** For each port range, the result of matching an unknown address to any
+   * port in it. */
+  int8_t *unknown_addr_results;
+  /** The number of distinct address tables. */
+  int n_tables;
+  /** The address tables used by our port ranges. */
+  policy_addr_table_t *tables;
+};
+
+/** If compiling a policy would give us more than this many address ranges in
+ * total, don't bother: just walk the policy. */
+#define MAX_COMPILED_POLICY_RANGES (1<<16)
+
+/** Map from a list of canonical policy entries to the compiled policy for
+ * that list. */
+static HT_HEAD(compiled_policy_map, addr_policy_compiled_t)
+     compiled_policy_root = HT_INITIALIZER();
+
+/** Return true iff <b>a</b> and <b>b</b> were compiled from the same list of
+ * canonical entries. */
+static inline int
+compiled_policy_eq(const addr_policy_compiled_t *a,
+                   const addr_policy_compiled_t *b)
+{
+  const int n = smartlist_len(a->policy);
+  if (n != smartlist_len(b->policy))
+    return 0;
+  return n == 0 || fast_memeq(a->policy->list, b->policy->list,
+                              n * sizeof(void *));
+}
+
+/** Return a hashcode for <b>c</b>. */
+static unsigned int
+compiled_policy_hash(const addr_policy_compiled_t *c)
+{
+  return (unsigned) siphash24g(c->policy->list,
+                               smartlist_len(c->policy) * sizeof(void *));
+}
+
+HT_PROTOTYPE(compiled_policy_map, addr_policy_compiled_t, node,
+             compiled_policy_hash, compiled_policy_eq);
+HT_GENERATE2(compiled_policy_map, addr_policy_compiled_t, node,
+             compiled_policy_hash, compiled_policy_eq, 0.6,
+             tor_reallocarray_, tor_free_);
+
+/** Return -1, 0, or 1 as <b>a</b> is less than, equal to, or greater than
+ * <b>b</b>. */
+static inline int
+key_cmp(const policy_addr_key_t *a, const policy_addr_key_t *b)
+{
+  if (a->hi != b->hi)
+    return a->hi < b->hi ? -1 : 1;
+  if (a->lo != b->lo)
+    return a->lo < b->lo ? -1 : 1;
+  return 0;
+}
+
+/** Set <b>out</b> to <b>k</b>+1.  <b>k</b> must not be the largest key. */
+static inline void
+key_inc(policy_addr_key_t *out, const policy_addr_key_t *k)
+{
+  out->lo = k->lo + 1;
+  out->hi = k->hi + (out->lo == 0);
+}
+
+/** Set <b>out</b> to <b>k</b>-1.  <b>k</b> must not be zero. */
+static inline void
+key_dec(policy_addr_key_t *out, const policy_addr_key_t *k)
+{
+  out->hi = k->hi - (k->lo == 0);
+  out->lo = k->lo - 1;
+}
+
+/** Set <b>out</b> to the key for <b>addr</b>, which must be an IPv4 or IPv6
+ * address. */
+static void
+key_from_addr(policy_addr_key_t *out, const tor_addr_t *addr)
+{
+  if (tor_addr_family(addr) == AF_INET) {
+    out->hi = 0;
+    out->lo = tor_addr_to_ipv4h(addr);
+  } else {
+    const uint8_t *a = tor_addr_to_in6_addr8(addr);
+    out->hi = tor_ntohll(get_uint64(a));
+    out->lo = tor_ntohll(get_uint64(a + 8));
+  }
+}
+
+/** Return a mask with the top <b>bits</b> of 64 bits set. */
+static inline uint64_t
+high_bits_mask(int bits)
+{
+  if (bits <= 0)
+    return 0;
+  if (bits >= 64)
+    return UINT64_MAX;
+  return UINT64_MAX << (64 - bits);
+}
+
+/** Set *<b>lo_out</b> and *<b>hi_out</b> to the first and last addresses
+ * that <b>ent</b> matches, in the same way as tor_addr_compare_masked()
+ * does.  <b>ent</b> must be an IPv4 or IPv6 entry. */
+static void
+entry_get_range(const addr_policy_t *ent, policy_addr_key_t *lo_out,
+                policy_addr_key_t *hi_out)
+{
+  int bits = ent->maskbits;
+  key_from_addr(lo_out, &ent->addr);
+  if (tor_addr_family(&ent->addr) == AF_INET) {
+    const uint64_t mask = high_bits_mask(MIN(bits, 32)) >> 32;
+    lo_out->lo &= mask;
+    hi_out->hi = 0;
+    hi_out->lo = lo_out->lo | (~mask & UINT32_MAX);
+  } else {
+    const uint64_t hi_mask = high_bits_mask(bits);
+    const uint64_t lo_mask = high_bits_mask(bits - 64);
+    lo_out->hi &= hi_mask;
+    lo_out->lo &= lo_mask;
+    hi_out->hi = lo_out->hi | ~hi_mask;
+    hi_out->lo = lo_out->lo | ~lo_mask;
+  }
+}
+
+/** Give every address from <b>lo</b> to <b>hi</b> that isn't already in one
+ * of the <b>*n_ranges</b> sorted, disjoint ranges in <b>*ranges</b> the
+ * result <b>result</b>, keeping the ranges sorted. */
+static void
+ranges_fill(policy_addr_range_t **ranges, int *n_ranges,
+            const policy_addr_key_t *lo, const policy_addr_key_t *hi,
+            addr_policy_result_t result)
+{
+  /* Each existing range can add at most one gap before it, plus one after
+   * the last. */
+  policy_addr_range_t *out = tor_calloc(*n_ranges * 2 + 1,
+                                        sizeof(policy_addr_range_t));
+  policy_addr_key_t pos = *lo;
+  int exhausted = 0, n_out = 0, i;
+
+  for (i = 0; i < *n_ranges; ++i) {
+    const policy_addr_range_t *r = &(*ranges)[i];
+    if (!exhausted && key_cmp(&r->lo, &pos) > 0) {
+      /* There's a gap before this range. */
+      policy_addr_range_t *gap = &out[n_out++];
+      gap->lo = pos;
+      key_dec(&gap->hi, &r->lo);
+      if (key_cmp(&gap->hi, hi) >= 0) {
+        gap->hi = *hi;
+        exhausted = 1;
+      } else {
+        pos = r->lo;
+      }
+      gap->result = result;
+    }
+    out[n_out++] = *r;
+    if (!exhausted && key_cmp(&r->hi, &pos) >= 0) {
+      if (key_cmp(&r->hi, hi) >= 0)
+        exhausted = 1;
+      else
+        key_inc(&pos, &r->hi);
+    }
+  }
+  if (!exhausted) {
+    policy_addr_range_t *gap = &out[n_out++];
+    gap->lo = pos;
+    gap->hi = *hi;
+    gap->result = result;
+  }
+
+  tor_free(*ranges);
+  *ranges = out;
+  *n_ranges = n_out;
+}
+
+/** Build the part of <b>table</b> for address family <b>family</b>, using
+ * the <b>n_idx</b> entries of <b>policy</b> whose indices are in
+ * <b>idx</b>.  Return the number of ranges we made. */
+static int
+addr_table_build_family(policy_addr_table_t *table, sa_family_t family,
+                        const smartlist_t *policy, const int *idx, int n_idx)
+{
+  policy_addr_range_t *ranges = NULL;
+  policy_addr_key_t lo, hi, max;
+  int n_ranges = 0, n_out = 0, i;
+
+  for (i = 0; i < n_idx; ++i) {
+    const addr_policy_t *ent = smartlist_get(policy, idx[i]);
+    if (tor_addr_family(&ent->addr) != family)
+      continue;
+    entry_get_range(ent, &lo, &hi);
+    ranges_fill(&ranges, &n_ranges, &lo, &hi,
+                ent->policy_type == ADDR_POLICY_ACCEPT ?
+                ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED);
+  }
+  /* Everything else is accepted. */
+  memset(&lo, 0, sizeof(lo));
+  max.hi = (family == AF_INET) ? 0 : UINT64_MAX;
+  max.lo = (family == AF_INET) ? UINT32_MAX : UINT64_MAX;
+  ranges_fill(&ranges, &n_ranges, &lo, &max, ADDR_POLICY_ACCEPTED);
+
+  /* Merge neighbors with the same result. */
+  for (i = 0; i < n_ranges; ++i) {
+    if (n_out && ranges[n_out-1].result == ranges[i].result)
+      ranges[n_out-1].hi = ranges[i].hi;
+    else
+      ranges[n_out++] = ranges[i];
+  }
+
+  if (family == AF_INET) {
+    table->n_v4 = n_out;
+    table->v4_starts = tor_calloc(n_out, sizeof(uint32_t));
+    table->v4_results = tor_calloc(n_out, sizeof(int8_t));
+    for (i = 0; i < n_out; ++i) {
+      table->v4_starts[i] = (uint32_t) ranges[i].lo.lo;
+      table->v4_results[i] = ranges[i].result;
+    }
+  } else {
+    table->n_v6 = n_out;
+    table->v6_starts = tor_calloc(n_out, sizeof(policy_addr_key_t));
+    table->v6_results = tor_calloc(n_out, sizeof(int8_t));
+    for (i = 0; i < n_out; ++i) {
+      table->v6_starts[i] = ranges[i].lo;
+      table->v6_results[i] = ranges[i].result;
+    }
+  }
+  tor_free(ranges);
+  return n_out;
+}
+
+/** Return the result of matching an unknown address to a port that is
+ * covered by exactly the <b>n_idx</b> entries of <b>policy</b> whose
+ * indices are in <b>idx</b>.  This follows
+ * compare_unknown_tor_addr_to_addr_policy() exactly. */
+static addr_policy_result_t
+unknown_addr_result(const smartlist_t *policy, const int *idx, int n_idx)
+{
+  int maybe_accept = 0, maybe_reject = 0, i;
+
+  for (i = 0; i < n_idx; ++i) {
+    const addr_policy_t *ent = smartlist_get(policy, idx[i]);
+    if (ent->maskbits == 0) {
+      if (ent->policy_type == ADDR_POLICY_ACCEPT)
+        return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED :
+          ADDR_POLICY_ACCEPTED;
+      else
+        return maybe_accept ? ADDR_POLICY_PROBABLY_REJECTED :
+          ADDR_POLICY_REJECTED;
+    }
+    if (ent->policy_type == ADDR_POLICY_REJECT)
+      maybe_reject = 1;
+    else
+      maybe_accept = 1;
+  }
+  return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_ACCEPTED;
+}
+
+/** Helper for qsort: compare two ports. */
+static int
+compare_ports_(const void *a, const void *b)
+{
+  const int pa = *(const int *)a, pb = *(const int *)b;
+  return pa - pb;
+}
+
+/** Compile the canonical entries in <b>c</b>-&gt;policy into <b>c</b>.  If
+ * that would take too much space, mark <b>c</b> as linear instead. */
+static void
+addr_policy_compiled_build(addr_policy_compiled_t *c)
+{
+  const smartlist_t *policy = c->policy;
+  const int n = smartlist_len(policy);
+  int *bounds = tor_calloc(2 * n + 1, sizeof(int));
+  int *idx = tor_calloc(n + 1, sizeof(int));
+  digestmap_t *tables_by_entries = digestmap_new();
+  int n_bounds = 0, i, r, n_idx, total_ranges = 0;
+
+  /* Find the port ranges. */
+  bounds[n_bounds++] = 0;
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, ent) {
+    if (ent->addr.family == AF_UNSPEC) {
+      log_warn(LD_BUG, "Policy contains an AF_UNSPEC address, which only "
+               "matches other AF_UNSPEC addresses.");
+    }
+    bounds[n_bounds++] = ent->prt_min;
+    if (ent->prt_max < 65535)
+      bounds[n_bounds++] = ent->prt_max + 1;
+  } SMARTLIST_FOREACH_END(ent);
+  qsort(bounds, n_bounds, sizeof(int), compare_ports_);
+
+  c->port_starts = tor_calloc(n_bounds, sizeof(uint16_t));
+  for (i = 0; i < n_bounds; ++i) {
+    if (i && bounds[i] == bounds[i-1])
+      continue;
+    c->port_starts[c->n_port_ranges++] = bounds[i];
+  }
+  c->port_tables = tor_calloc(c->n_port_ranges, sizeof(int));
+  c->unknown_addr_results = tor_calloc(c->n_port_ranges, sizeof(int8_t));
+  c->tables = tor_calloc(c->n_port_ranges, sizeof(policy_addr_table_t));
+
+  for (r = 0; r < c->n_port_ranges; ++r) {
+    const uint16_t port = c->port_starts[r];
+    char digest[DIGEST_LEN];
+    void *found;
+
+    /* Every entry either covers this whole port range, or none of it. */
+    n_idx = 0;
+    SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, ent) {
+      if (ent->prt_min <= port && port <= ent->prt_max)
+        idx[n_idx++] = ent_sl_idx;
+    } SMARTLIST_FOREACH_END(ent);
+
+    c->unknown_addr_results[r] = unknown_addr_result(policy, idx, n_idx);
+
+    if (crypto_digest(digest, (const char *)idx, n_idx * sizeof(int)) < 0) {
+      /* LCOV_EXCL_START */
+      c->is_linear = 1;
+      break;
+      /* LCOV_EXCL_STOP */
+    }
+    found = digestmap_get(tables_by_entries, digest);
+    if (found) {
+      c->port_tables[r] = (int)(uintptr_t)found - 1;
+      continue;
+    }
+
+    total_ranges += addr_table_build_family(&c->tables[c->n_tables], AF_INET,
+                                            policy, idx, n_idx);
+    total_ranges += addr_table_build_family(&c->tables[c->n_tables],
+                                            AF_INET6, policy, idx, n_idx);
+    c->port_tables[r] = c->n_tables++;
+    digestmap_set(tables_by_entries, digest,
+                  (void *)(uintptr_t)c->n_tables);
+
+    if (total_ranges > MAX_COMPILED_POLICY_RANGES) {
+      log_info(LD_GENERAL, "Address policy with %d entries is too complex "
+               "to compile; we'll check it the slow way.", n);
+      c->is_linear = 1;
+      break;
+    }
+  }
+
+  digestmap_free(tables_by_entries, NULL);
+  tor_free(bounds);
+  tor_free(idx);
+}
+
+/** Release the compiled tables in <b>c</b>, but not its policy. */
+static void
+addr_policy_compiled_clear_tables(addr_policy_compiled_t *c)
+{
+  int i;
+  for (i = 0; i < c->n_tables; ++i) {
+    tor_free(c->tables[i].v4_starts);
+    tor_free(c->tables[i].v4_results);
+    tor_free(c->tables[i].v6_starts);
+    tor_free(c->tables[i].v6_results);
+  }
+  tor_free(c->tables);
+  tor_free(c->port_starts);
+  tor_free(c->port_tables);
+  tor_free(c->unknown_addr_results);
+  c->n_tables = c->n_port_ranges = 0;
+}
+
+/** Return a reference to the compiled form of <b>policy</b>, compiling it if
+ * we haven't already.  Release it with addr_policy_compiled_free().
+ *
+ * <b>policy</b> must not be NULL.  It should not change while the compiled
+ * form is in use: the compiled form matches the policy as it was when it
+ * was compiled. */
+addr_policy_compiled_t *
+addr_policy_compile(const smartlist_t *policy)
+{
+  addr_policy_compiled_t search, *c;
+
+  tor_assert(policy);
+
+  /* Take a reference to the canonical copy of every entry. */
+  search.policy = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(policy, addr_policy_t *, ent) {
+    if (ent->is_canonical) {
+      ++ent->refcnt;
+      smartlist_add(search.policy, ent);
+    } else {
+      smartlist_add(search.policy, addr_policy_get_canonical_entry(ent));
+    }
+  } SMARTLIST_FOREACH_END(ent);
+
+  c = HT_FIND(compiled_policy_map, &compiled_policy_root, &search);
+  if (c) {
+    addr_policy_list_free(search.policy);
+    ++c->refcnt;
+    return c;
+  }
+
+  c = tor_malloc_zero(sizeof(addr_policy_compiled_t));
+  c->policy = search.policy;
+  c->refcnt = 1;
+  addr_policy_compiled_build(c);
+  if (c->is_linear)
+    addr_policy_compiled_clear_tables(c);
+  HT_INSERT(compiled_policy_map, &compiled_policy_root, c);
+  return c;
+}
+
+/** Return the index of the port range in <b>c</b> that contains
+ * <b>port</b>. */
+static inline int
+find_port_range(const addr_policy_compiled_t *c, uint16_t port)
+{
+  int lo = 0, hi = c->n_port_ranges - 1;
+  /* Invariant: port_starts[lo] <= port, and port_starts[hi+1] > port. */
+  while (lo < hi) {
+    const int mid = (lo + hi + 1) / 2;
+    if (c->port_starts[mid] <= port)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/** Return the result for <b>addr</b> in <b>table</b>. */
+static addr_policy_result_t
+table_lookup(const policy_addr_table_t *table, const tor_addr_t *addr)
+{
+  int lo, hi;
+  if (tor_addr_family(addr) == AF_INET) {
+    const uint32_t a = tor_addr_to_ipv4h(addr);
+    lo = 0;
+    hi = table->n_v4 - 1;
+    while (lo < hi) {
+      const int mid = (lo + hi + 1) / 2;
+      if (table->v4_starts[mid] <= a)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    return table->v4_results[lo];
+  } else {
+    policy_addr_key_t k;
+    key_from_addr(&k, addr);
+    lo = 0;
+    hi = table->n_v6 - 1;
+    while (lo < hi) {
+      const int mid = (lo + hi + 1) / 2;
+      if (key_cmp(&table->v6_starts[mid], &k) <= 0)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    return table->v6_results[lo];
+  }
+}
+
+/** Decide whether a given addr:port is definitely accepted, definitely
+ * rejected, probably accepted, or probably rejected by the compiled policy
+ * <b>c</b>.  The result is always the same as that of
+ * compare_tor_addr_to_addr_policy() on the policy that <b>c</b> was
+ * compiled from. */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const addr_policy_compiled_t *c)
+{
+  const int have_addr = addr && !tor_addr_is_null(addr);
+
+  if (c->is_linear || port == 0)
+    return compare_tor_addr_to_addr_policy(addr, port, c->policy);
+
+  if (!have_addr)
+    return c->unknown_addr_results[find_port_range(c, port)];
+
+  if (tor_addr_family(addr) != AF_INET && tor_addr_family(addr) != AF_INET6)
+    return compare_tor_addr_to_addr_policy(addr, port, c->policy);
+
+  return table_lookup(&c->tables[c->port_tables[find_port_range(c, port)]],
+                      addr);
+}
+
+/** Release a reference to <b>c</b>, freeing it if that was the last. */
+void
+addr_policy_compiled_free_(addr_policy_compiled_t *c)
+{
+  if (!c)
+    return;
+  if (--c->refcnt > 0)
+    return;
+
+  HT_REMOVE(compiled_policy_map, &compiled_policy_root, c);
+  addr_policy_compiled_clear_tables(c);
+  addr_policy_list_free(c->policy);
+  tor_free(c);
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return true iff <b>c</b> is too complex to have been compiled. */
+STATIC int
+addr_policy_compiled_is_linear(const addr_policy_compiled_t *c)
+{
+  return c->is_linear;
+}
+
+/** Return the number of distinct address tables in <b>c</b>. */
+STATIC int
+addr_policy_compiled_n_tables(const addr_policy_compiled_t *c)
+{
+  return c->n_tables;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** Release all storage held by compiled policies. */
+void
+policy_compile_free_all(void)
+{
+  if (!HT_EMPTY(&compiled_policy_root)) {
+    log_warn(LD_MM, "Still had %d compiled address policies at shutdown.",
+             (int)HT_SIZE(&compiled_policy_root));
+  }
+  HT_CLEAR(compiled_policy_map, &compiled_policy_root);
+}
@@ -0,0 +1,30 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file policy_compile.h
+ * \brief Header file for policy_compile.c.
+ **/
+
+#ifndef TOR_POLICY_COMPILE_H
+#define TOR_POLICY_COMPILE_H
+
+#include "core/or/policies.h"
+
+typedef struct addr_policy_compiled_t addr_policy_compiled_t;
+
+addr_policy_compiled_t *addr_policy_compile(const smartlist_t *policy);
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                                        const tor_addr_t *addr, uint16_t port,
+                                        const addr_policy_compiled_t *c);
+void addr_policy_compiled_free_(addr_policy_compiled_t *c);
+#define addr_policy_compiled_free(c) \
+  FREE_AND_NULL(addr_policy_compiled_t, addr_policy_compiled_free_, (c))
+void policy_compile_free_all(void);
+
+#if defined(POLICY_COMPILE_PRIVATE) && defined(TOR_UNIT_TESTS)
+STATIC int addr_policy_compiled_is_linear(const addr_policy_compiled_t *c);
+STATIC int addr_policy_compiled_n_tables(const addr_policy_compiled_t *c);
+#endif /* defined(POLICY_COMPILE_PRIVATE) && defined(TOR_UNIT_TESTS) */
+
+#endif /* !defined(TOR_POLICY_COMPILE_H) */
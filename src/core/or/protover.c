@@ -55,6 +55,8 @@ static const struct {
   { PRT_PADDING, "Padding"},
   { PRT_CONS, "Cons" },
   { PRT_FLOWCTRL, "FlowCtrl"},
+  { PRT_DELAYCC, "DelayCC"},
+  { PRT_MULTIPATH, "Multipath"},
 };
 
 #define N_PROTOCOL_NAMES ARRAY_LENGTH(PROTOCOL_NAMES)
@@ -402,6 +404,7 @@ protover_get_supported_protocols(void)
    */
   return
     "Cons=1-2 "
+    "DelayCC=1 "
     "Desc=1-2 "
     "DirCache=1-2 "
     "FlowCtrl=1 "
@@ -415,6 +418,7 @@ protover_get_supported_protocols(void)
     "LinkAuth=3 "
 #endif
     "Microdesc=1-2 "
+    "Multipath=1 "
     "Padding=2 "
     "Relay=1-3";
 }
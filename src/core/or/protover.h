@@ -51,6 +51,15 @@ struct smartlist_t;
 /** The protover that signals support for HS circuit setup padding machines */
 #define PROTOVER_HS_SETUP_PADDING 2
 
+/** The protover that signals support for negotiating delay-based circuit
+ * congestion control with CC_NEGOTIATE cells.  This is our own subprotocol,
+ * not FlowCtrl=2, which means something else. */
+#define PROTOVER_DELAYCC_V1 1
+
+/** The protover that signals support for linking circuits into a multipath
+ * set with MP_LINK cells.  Like DelayCC, this is our own subprotocol. */
+#define PROTOVER_MULTIPATH_V1 1
+
 /** List of recognized subprotocols. */
 /// C_RUST_COUPLED: src/rust/protover/ffi.rs `translate_to_rust`
 /// C_RUST_COUPLED: src/rust/protover/protover.rs `Proto`
@@ -67,6 +76,8 @@ typedef enum protocol_type_t {
   PRT_CONS      = 9,
   PRT_PADDING   = 10,
   PRT_FLOWCTRL  = 11,
+  PRT_DELAYCC   = 12,
+  PRT_MULTIPATH = 13,
 } protocol_type_t;
 
 bool protover_list_is_invalid(const char *s);
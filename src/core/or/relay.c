@@ -27,8 +27,11 @@
  * connection_edge_send_command() that calls it.  Of particular interest is
  * connection_edge_package_raw_inbuf(), which takes information that has
  * arrived on an edge connection socket, and packages it as a RELAY_DATA cell
- * -- this is how information is actually sent across the Tor network.  The
- * cryptography for these functions is handled deep in
+ * -- this is how information is actually sent across the Tor network.  It
+ * builds each cell right in the packed_cell_t that will sit on the circuit
+ * queue, and hands it to relay_send_packed_cell_from_edge(), so that stream
+ * data is copied only once on its way out.  The cryptography for other
+ * cells is handled deep in
  * circuit_package_relay_cell(), which either adds a single layer of
  * encryption (if we're an exit), or multiple layers (if we're the origin of
  * the circuit).  After construction and encryption, the RELAY cells are
@@ -56,6 +59,7 @@
 #include "core/or/circuitlist.h"
 #include "core/or/circuituse.h"
 #include "core/or/circuitpadding.h"
+#include "core/or/congestion_control.h"
 #include "core/or/extendinfo.h"
 #include "lib/compress/compress.h"
 #include "app/config/config.h"
@@ -71,8 +75,10 @@
 #include "feature/stats/geoip_stats.h"
 #include "feature/hs/hs_cache.h"
 #include "core/mainloop/mainloop.h"
+#include "feature/nodelist/netparams.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
+#include "core/or/multipath.h"
 #include "core/or/onion.h"
 #include "core/or/policies.h"
 #include "core/or/reasons.h"
@@ -96,6 +102,9 @@
 #include "feature/nodelist/routerinfo_st.h"
 #include "core/or/socks_request_st.h"
 #include "core/or/sendme.h"
+#include "core/or/cell_queue_stats.h"
+#include "lib/malloc/slab.h"
+#include "lib/thread/threads.h"
 
 static edge_connection_t *relay_lookup_conn(circuit_t *circ, cell_t *cell,
                                             cell_direction_t cell_direction,
@@ -109,10 +118,16 @@ static int circuit_resume_edge_reading_helper(edge_connection_t *conn,
 static int circuit_consider_stop_edge_reading(circuit_t *circ,
                                               crypt_path_t *layer_hint);
 static int circuit_queue_streams_are_blocked(circuit_t *circ);
+static void circuit_resume_multipath_streams(circuit_t *circ, int package);
 static void adjust_exit_policy_from_exitpolicy_failure(origin_circuit_t *circ,
                                                   entry_connection_t *conn,
                                                   node_t *node,
                                                   const tor_addr_t *addr);
+static void append_packed_cell_to_circuit_queue(circuit_t *circ,
+                                                channel_t *chan,
+                                                packed_cell_t *cell,
+                                                cell_direction_t direction,
+                                                streamid_t fromstream);
 
 /** Stop reading on edge connections when we have this many cells
  * waiting on the appropriate queue. */
@@ -529,6 +544,11 @@ relay_command_to_string(uint8_t command)
     case RELAY_COMMAND_EXTENDED2: return "EXTENDED2";
     case RELAY_COMMAND_PADDING_NEGOTIATE: return "PADDING_NEGOTIATE";
     case RELAY_COMMAND_PADDING_NEGOTIATED: return "PADDING_NEGOTIATED";
+    case RELAY_COMMAND_CC_NEGOTIATE: return "CC_NEGOTIATE";
+    case RELAY_COMMAND_CC_NEGOTIATED: return "CC_NEGOTIATED";
+    case RELAY_COMMAND_MP_LINK: return "MP_LINK";
+    case RELAY_COMMAND_MP_LINKED: return "MP_LINKED";
+    case RELAY_COMMAND_MP_DATA: return "MP_DATA";
     default:
       tor_snprintf(buf, sizeof(buf), "Unrecognized relay command %u",
                    (unsigned)command);
@@ -594,51 +614,18 @@ pad_cell_payload(uint8_t *cell_payload, size_t data_len)
                            cell_payload + pad_offset, pad_len);
 }
 
-/** Make a relay cell out of <b>relay_command</b> and <b>payload</b>, and send
- * it onto the open circuit <b>circ</b>. <b>stream_id</b> is the ID on
- * <b>circ</b> for the stream that's sending the relay cell, or 0 if it's a
- * control cell.  <b>cpath_layer</b> is NULL for OR->OP cells, or the
- * destination hop for OP->OR cells.
- *
- * If you can't send the cell, mark the circuit for close and return -1. Else
- * return 0.
- */
-MOCK_IMPL(int,
-relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
-                               uint8_t relay_command, const char *payload,
-                               size_t payload_len, crypt_path_t *cpath_layer,
-                               const char *filename, int lineno))
+/** We are about to send a relay cell with command <b>relay_command</b> and
+ * a body of <b>body_len</b> bytes on <b>circ</b>, toward the hop
+ * <b>cpath_layer</b> if we're the OP.  Tell everybody who cares about it,
+ * and return the cell command (CELL_RELAY or CELL_RELAY_EARLY) that the
+ * cell should have. */
+static uint8_t
+relay_note_sending_cell(circuit_t *circ, uint8_t relay_command,
+                        size_t body_len, crypt_path_t *cpath_layer)
 {
-  cell_t cell;
-  relay_header_t rh;
-  cell_direction_t cell_direction;
-  /* XXXX NM Split this function into a separate versions per circuit type? */
-
-  tor_assert(circ);
-  tor_assert(payload_len <= RELAY_PAYLOAD_SIZE);
-
-  memset(&cell, 0, sizeof(cell_t));
-  cell.command = CELL_RELAY;
-  if (CIRCUIT_IS_ORIGIN(circ)) {
-    tor_assert(cpath_layer);
-    cell.circ_id = circ->n_circ_id;
-    cell_direction = CELL_DIRECTION_OUT;
-  } else {
-    tor_assert(! cpath_layer);
-    cell.circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
-    cell_direction = CELL_DIRECTION_IN;
-  }
-
-  memset(&rh, 0, sizeof(rh));
-  rh.command = relay_command;
-  rh.stream_id = stream_id;
-  rh.length = payload_len;
-  relay_header_pack(cell.payload, &rh);
-  if (payload_len)
-    memcpy(cell.payload+RELAY_HEADER_SIZE, payload, payload_len);
-
-  /* Add random padding to the cell if we can. */
-  pad_cell_payload(cell.payload, payload_len);
+  uint8_t command = CELL_RELAY;
+  const cell_direction_t cell_direction =
+    CIRCUIT_IS_ORIGIN(circ) ? CELL_DIRECTION_OUT : CELL_DIRECTION_IN;
 
   log_debug(LD_OR,"delivering %d cell %s.", relay_command,
             cell_direction == CELL_DIRECTION_OUT ? "forward" : "backward");
@@ -667,7 +654,7 @@ relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
        * an extend cell or we're not talking to the first hop), use
        * one of them.  Don't worry about the conn protocol version:
        * append_cell_to_circuit_queue will fix it up. */
-      cell.command = CELL_RELAY_EARLY;
+      command = CELL_RELAY_EARLY;
       /* If we're out of relay early cells, tell circpad */
       if (--origin_circ->remaining_relay_early_cells == 0)
         circpad_machine_event_circ_has_no_relay_early(origin_circ);
@@ -698,9 +685,60 @@ relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
 
     /* Let's assume we're well-behaved: Anything that we decide to send is
      * valid, delivered data. */
-    circuit_sent_valid_data(origin_circ, rh.length);
+    circuit_sent_valid_data(origin_circ, body_len);
+  }
+
+  return command;
+}
+
+/** Make a relay cell out of <b>relay_command</b> and <b>payload</b>, and send
+ * it onto the open circuit <b>circ</b>. <b>stream_id</b> is the ID on
+ * <b>circ</b> for the stream that's sending the relay cell, or 0 if it's a
+ * control cell.  <b>cpath_layer</b> is NULL for OR->OP cells, or the
+ * destination hop for OP->OR cells.
+ *
+ * If you can't send the cell, mark the circuit for close and return -1. Else
+ * return 0.
+ */
+MOCK_IMPL(int,
+relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
+                               uint8_t relay_command, const char *payload,
+                               size_t payload_len, crypt_path_t *cpath_layer,
+                               const char *filename, int lineno))
+{
+  cell_t cell;
+  relay_header_t rh;
+  cell_direction_t cell_direction;
+  /* XXXX NM Split this function into a separate versions per circuit type? */
+
+  tor_assert(circ);
+  tor_assert(payload_len <= RELAY_PAYLOAD_SIZE);
+
+  memset(&cell, 0, sizeof(cell_t));
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    tor_assert(cpath_layer);
+    cell.circ_id = circ->n_circ_id;
+    cell_direction = CELL_DIRECTION_OUT;
+  } else {
+    tor_assert(! cpath_layer);
+    cell.circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
+    cell_direction = CELL_DIRECTION_IN;
   }
 
+  memset(&rh, 0, sizeof(rh));
+  rh.command = relay_command;
+  rh.stream_id = stream_id;
+  rh.length = payload_len;
+  relay_header_pack(cell.payload, &rh);
+  if (payload_len)
+    memcpy(cell.payload+RELAY_HEADER_SIZE, payload, payload_len);
+
+  /* Add random padding to the cell if we can. */
+  pad_cell_payload(cell.payload, payload_len);
+
+  cell.command = relay_note_sending_cell(circ, relay_command, payload_len,
+                                         cpath_layer);
+
   if (circuit_package_relay_cell(&cell, circ, cell_direction, cpath_layer,
                                  stream_id, filename, lineno) < 0) {
     log_warn(LD_BUG,"circuit_package_relay_cell failed. Closing.");
@@ -711,7 +749,117 @@ relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
   /* If applicable, note the cell digest for the SENDME version 1 purpose if
    * we need to. This call needs to be after the circuit_package_relay_cell()
    * because the cell digest is set within that function. */
-  if (relay_command == RELAY_COMMAND_DATA) {
+  if (relay_command == RELAY_COMMAND_DATA ||
+      relay_command == RELAY_COMMAND_MP_DATA) {
+    sendme_record_cell_digest_on_circ(circ, cpath_layer);
+  }
+
+  return 0;
+}
+
+/** Return a new packed cell in which the caller can build a relay cell to
+ * send with relay_send_packed_cell_from_edge(), and set *<b>body_out</b> to
+ * where the body of that relay cell goes. */
+packed_cell_t *
+relay_packed_cell_new(uint8_t **body_out)
+{
+  packed_cell_t *cell = packed_cell_new();
+  *body_out = (uint8_t *) cell->body + RELAY_PACKED_PAYLOAD_OFFSET +
+    RELAY_HEADER_SIZE;
+  return cell;
+}
+
+/** Send the relay cell in <b>cell</b>, which came from
+ * relay_packed_cell_new() and has a body of <b>body_len</b> bytes, onto the
+ * open circuit <b>circ</b>, with command <b>relay_command</b>.  The other
+ * arguments are as for relay_send_command_from_edge().
+ *
+ * Unlike relay_send_command_from_edge(), we fill in the headers and encrypt
+ * the cell right where it is, and queue it on <b>circ</b> without copying
+ * it.  We take ownership of <b>cell</b>.
+ *
+ * If you can't send the cell, mark the circuit for close and return -1. Else
+ * return 0.
+ */
+MOCK_IMPL(int,
+relay_send_packed_cell_from_edge,(streamid_t stream_id, circuit_t *circ,
+                                  uint8_t relay_command, packed_cell_t *cell,
+                                  size_t body_len, crypt_path_t *cpath_layer))
+{
+  uint8_t *payload = (uint8_t *) cell->body + RELAY_PACKED_PAYLOAD_OFFSET;
+  relay_header_t rh;
+  cell_direction_t cell_direction;
+  channel_t *chan;
+  circid_t circ_id;
+  uint8_t command;
+
+  tor_assert(circ);
+  tor_assert(body_len <= RELAY_PAYLOAD_SIZE);
+
+  if (circ->marked_for_close) {
+    packed_cell_free(cell);
+    return -1;
+  }
+
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    tor_assert(cpath_layer);
+    chan = circ->n_chan;
+    circ_id = circ->n_circ_id;
+    cell_direction = CELL_DIRECTION_OUT;
+  } else {
+    tor_assert(! cpath_layer);
+    chan = TO_OR_CIRCUIT(circ)->p_chan;
+    circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
+    cell_direction = CELL_DIRECTION_IN;
+  }
+  if (!chan) {
+    log_warn(LD_BUG, "Tried to send a relay cell on a circuit with no "
+             "channel. Circuit is in state %s (%d). Dropping.",
+             circuit_state_to_string(circ->state), circ->state);
+    packed_cell_free(cell);
+    return 0;
+  }
+
+  memset(&rh, 0, sizeof(rh));
+  rh.command = relay_command;
+  rh.stream_id = stream_id;
+  rh.length = body_len;
+  relay_header_pack(payload, &rh);
+  pad_cell_payload(payload, body_len);
+
+  command = relay_note_sending_cell(circ, relay_command, body_len,
+                                    cpath_layer);
+
+  if (cell_direction == CELL_DIRECTION_OUT) {
+    origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
+    relay_encrypt_payload_outbound(payload, ocirc, cpath_layer);
+    /* Update circ written totals for control port */
+    ocirc->n_written_circ_bw = tor_add_u32_nowrap(ocirc->n_written_circ_bw,
+                                                  CELL_PAYLOAD_SIZE);
+  } else {
+    relay_encrypt_payload_inbound(payload, TO_OR_CIRCUIT(circ));
+  }
+
+  /* We left room for a wide circuit ID; with a narrow one, the payload
+   * moves up to meet it. */
+  if (chan->wide_circ_ids) {
+    set_uint32(cell->body, htonl(circ_id));
+    set_uint8(cell->body + 4, command);
+  } else {
+    set_uint16(cell->body, htons(circ_id));
+    set_uint8(cell->body + 2, command);
+    memmove(cell->body + 3, payload, CELL_PAYLOAD_SIZE);
+    memset(cell->body + CELL_MAX_NETWORK_SIZE - 2, 0, 2);
+  }
+  ++stats_n_relay_cells_relayed;
+
+  append_packed_cell_to_circuit_queue(circ, chan, cell, cell_direction,
+                                      stream_id);
+
+  /* The cell digest was set when we encrypted the cell, so we can note it
+   * for SENDME version 1 now. */
+  if (relay_command == RELAY_COMMAND_DATA ||
+      relay_command == RELAY_COMMAND_MP_DATA) {
     sendme_record_cell_digest_on_circ(circ, cpath_layer);
   }
 
@@ -1531,6 +1679,8 @@ process_sendme_cell(const relay_header_t *rh, const cell_t *cell,
     /* Resume reading on any streams now that we've processed a valid
      * SENDME cell that updated our package window. */
     circuit_resume_edge_reading(circ, layer_hint);
+    if (circ->mp_set)
+      circuit_resume_multipath_streams(circ, 1);
     /* We are done, the rest of the code is for the stream level. */
     return 0;
   }
@@ -1559,6 +1709,7 @@ process_sendme_cell(const relay_header_t *rh, const cell_t *cell,
     /* Means we need to close the circuit with reason ret. */
     return ret;
   }
+  multipath_stream_note_sendme(conn, circ);
 
   /* We've now processed properly a SENDME cell, all windows have been
    * properly updated, we'll read on the edge connection to see if we can
@@ -1579,6 +1730,65 @@ process_sendme_cell(const relay_header_t *rh, const cell_t *cell,
   return 0;
 }
 
+/** Deliver the data of the DATA or MP_DATA cell with header <b>rh</b> and
+ * body <b>body</b> to the stream <b>conn</b>, in sequence. Return 0 on
+ * success, or -1 if the cell breaks the protocol. */
+static int
+connection_edge_deliver_data(edge_connection_t *conn,
+                             const relay_header_t *rh, const uint8_t *body)
+{
+  size_t length = rh->length;
+  uint32_t seq = conn->mp_next_recv_seq;
+
+  if (rh->command == RELAY_COMMAND_MP_DATA) {
+    if (length < MULTIPATH_SEQ_LEN) {
+      log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+             "Multipath data cell too short. Killing.");
+      return -1;
+    }
+    seq = ntohl(get_uint32(body));
+    body += MULTIPATH_SEQ_LEN;
+    length -= MULTIPATH_SEQ_LEN;
+  }
+  return multipath_stream_data_received(conn, seq, body, length);
+}
+
+/** Close the open stream <b>conn</b> on <b>circ</b>, because the other end
+ * sent us an END cell with reason <b>reason</b> and <b>length</b> bytes of
+ * body. Use <b>domain</b> for logging. */
+static void
+handle_relay_end(edge_connection_t *conn, circuit_t *circ, int reason,
+                 unsigned domain, uint16_t length)
+{
+/* XXX add to this log_fn the exit node's nickname? */
+  log_info(domain,TOR_SOCKET_T_FORMAT": end cell (%s) for stream %d. "
+           "Removing stream.",
+           conn->base_.s,
+           stream_end_reason_to_string(reason),
+           conn->stream_id);
+  if (conn->base_.type == CONN_TYPE_AP) {
+    entry_connection_t *entry_conn = EDGE_TO_ENTRY_CONN(conn);
+    if (entry_conn->socks_request &&
+        !entry_conn->socks_request->has_finished)
+      log_warn(LD_BUG,
+               "open stream hasn't sent socks answer yet? Closing.");
+  }
+  /* We just *got* an end; no reason to send one. */
+  conn->edge_has_sent_end = 1;
+  if (!conn->end_reason)
+    conn->end_reason = reason | END_STREAM_REASON_FLAG_REMOTE;
+  if (!conn->base_.marked_for_close) {
+    /* only mark it if not already marked. it's possible to
+     * get the 'end' right around when the client hangs up on us. */
+    connection_mark_and_flush(TO_CONN(conn));
+
+    /* Total all valid application bytes delivered */
+    if (CIRCUIT_IS_ORIGIN(circ)) {
+      circuit_read_valid_data(TO_ORIGIN_CIRCUIT(circ), length);
+    }
+  }
+}
+
 /** A helper for connection_edge_process_relay_cell(): Actually handles the
  *  cell that we received on the connection.
  *
@@ -1594,6 +1804,8 @@ handle_relay_cell_command(cell_t *cell, circuit_t *circ,
 {
   unsigned domain = layer_hint?LD_APP:LD_EXIT;
   int reason;
+  static netparam_t allow_nonearly_extend =
+    NETPARAM_INIT("AllowNonearlyExtend", 0, 0, 1);
 
   tor_assert(rh);
 
@@ -1638,6 +1850,7 @@ handle_relay_cell_command(cell_t *cell, circuit_t *circ,
       }
       return connection_exit_begin_conn(cell, circ);
     case RELAY_COMMAND_DATA:
+    case RELAY_COMMAND_MP_DATA:
       ++stats_n_data_cells_received;
 
       /* Update our circuit-level deliver window that we received a DATA cell.
@@ -1690,8 +1903,11 @@ handle_relay_cell_command(cell_t *cell, circuit_t *circ,
       }
 
       stats_n_data_bytes_received += rh->length;
-      connection_buf_add((char*)(cell->payload + RELAY_HEADER_SIZE),
-                              rh->length, TO_CONN(conn));
+      if (connection_edge_deliver_data(conn, rh,
+                                 cell->payload + RELAY_HEADER_SIZE) < 0) {
+        connection_edge_end_close(conn, END_STREAM_REASON_TORPROTOCOL);
+        return -END_CIRC_REASON_TORPROTOCOL;
+      }
 
 #ifdef MEASUREMENTS_21206
       /* Count number of RELAY_DATA cells received on a linked directory
@@ -1703,6 +1919,13 @@ handle_relay_cell_command(cell_t *cell, circuit_t *circ,
       }
 #endif /* defined(MEASUREMENTS_21206) */
 
+      if (conn->mp_end_pending &&
+          conn->mp_next_recv_seq == conn->mp_end_seq) {
+        /* We were holding the END cell until this data arrived. */
+        handle_relay_end(conn, circ, conn->mp_end_reason, domain, 0);
+        return 0;
+      }
+
       if (!optimistic_data) {
         /* Only send a SENDME if we're not getting optimistic data; otherwise
          * a SENDME could arrive before the CONNECTED.
@@ -1733,33 +1956,23 @@ handle_relay_cell_command(cell_t *cell, circuit_t *circ,
                  stream_end_reason_to_string(reason));
         return 0;
       }
-/* XXX add to this log_fn the exit node's nickname? */
-      log_info(domain,TOR_SOCKET_T_FORMAT": end cell (%s) for stream %d. "
-               "Removing stream.",
-               conn->base_.s,
-               stream_end_reason_to_string(reason),
-               conn->stream_id);
-      if (conn->base_.type == CONN_TYPE_AP) {
-        entry_connection_t *entry_conn = EDGE_TO_ENTRY_CONN(conn);
-        if (entry_conn->socks_request &&
-            !entry_conn->socks_request->has_finished)
-          log_warn(LD_BUG,
-                   "open stream hasn't sent socks answer yet? Closing.");
-      }
-      /* We just *got* an end; no reason to send one. */
-      conn->edge_has_sent_end = 1;
-      if (!conn->end_reason)
-        conn->end_reason = reason | END_STREAM_REASON_FLAG_REMOTE;
-      if (!conn->base_.marked_for_close) {
-        /* only mark it if not already marked. it's possible to
-         * get the 'end' right around when the client hangs up on us. */
-        connection_mark_and_flush(TO_CONN(conn));
-
-        /* Total all valid application bytes delivered */
-        if (CIRCUIT_IS_ORIGIN(circ)) {
-          circuit_read_valid_data(TO_ORIGIN_CIRCUIT(circ), rh->length);
+      if (circ->mp_set && rh->length == 1 + MULTIPATH_SEQ_LEN &&
+          reason != END_STREAM_REASON_EXITPOLICY) {
+        /* The other end sent data cells over several circuits; wait for
+         * the last of them before we close the stream. */
+        uint32_t end_seq =
+          ntohl(get_uint32(cell->payload + RELAY_HEADER_SIZE + 1));
+        if ((int32_t) (end_seq - conn->mp_next_recv_seq) > 0) {
+          log_info(domain, "end cell for stream %d is ahead of %u data "
+                   "cells. Holding it.", conn->stream_id,
+                   (unsigned) (end_seq - conn->mp_next_recv_seq));
+          conn->mp_end_pending = 1;
+          conn->mp_end_seq = end_seq;
+          conn->mp_end_reason = reason;
+          return 0;
         }
       }
+      handle_relay_end(conn, circ, reason, domain, rh->length);
       return 0;
     case RELAY_COMMAND_EXTEND:
     case RELAY_COMMAND_EXTEND2: {
@@ -1771,7 +1984,7 @@ handle_relay_cell_command(cell_t *cell, circuit_t *circ,
         return 0;
       }
       if (cell->command != CELL_RELAY_EARLY &&
-          !networkstatus_get_param(NULL,"AllowNonearlyExtend",0,0,1)) {
+          !netparam_get(&allow_nonearly_extend)) {
 #define EARLY_WARNING_INTERVAL 3600
         static ratelim_t early_warning_limit =
           RATELIM_INIT(EARLY_WARNING_INTERVAL);
@@ -1940,6 +2153,22 @@ handle_relay_cell_command(cell_t *cell, circuit_t *circ,
       log_info(domain,
                "'resolved' received, no conn attached anymore. Ignoring.");
       return 0;
+    case RELAY_COMMAND_CC_NEGOTIATE:
+      return congestion_control_process_negotiate(circ, layer_hint,
+                                          cell->payload + RELAY_HEADER_SIZE,
+                                          rh->length);
+    case RELAY_COMMAND_CC_NEGOTIATED:
+      return congestion_control_process_negotiated(circ, layer_hint,
+                                          cell->payload + RELAY_HEADER_SIZE,
+                                          rh->length);
+    case RELAY_COMMAND_MP_LINK:
+      return multipath_process_link(circ, layer_hint,
+                                    cell->payload + RELAY_HEADER_SIZE,
+                                    rh->length);
+    case RELAY_COMMAND_MP_LINKED:
+      return multipath_process_linked(circ, layer_hint,
+                                      cell->payload + RELAY_HEADER_SIZE,
+                                      rh->length);
     case RELAY_COMMAND_ESTABLISH_INTRO:
     case RELAY_COMMAND_ESTABLISH_RENDEZVOUS:
     case RELAY_COMMAND_INTRODUCE1:
@@ -2016,6 +2245,10 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
   /* Tell circpad that we've received a recognized cell */
   circpad_deliver_recognized_relay_cell_events(circ, rh.command, layer_hint);
 
+  /* Multipath data cells may arrive on any circuit of the stream's set. */
+  if (rh.command == RELAY_COMMAND_MP_DATA && !conn && rh.stream_id)
+    conn = multipath_find_stream(circ, rh.stream_id, layer_hint);
+
   /* either conn is NULL, in which case we've got a control cell, or else
    * conn points to the recognized stream. */
   if (conn && !connection_state_is_open(TO_CONN(conn))) {
@@ -2076,11 +2309,13 @@ circuit_reset_sendme_randomness(circuit_t *circ)
 /**
  * Helper. Return the number of bytes that should be put into a cell from a
  * given edge connection on which <b>n_available</b> bytes are available.
+ * The cell body starts with <b>header_len</b> bytes that aren't stream data.
  */
 STATIC size_t
 connection_edge_get_inbuf_bytes_to_package(size_t n_available,
                                            int package_partial,
-                                           circuit_t *on_circuit)
+                                           circuit_t *on_circuit,
+                                           size_t header_len)
 {
   if (!n_available)
     return 0;
@@ -2097,6 +2332,7 @@ connection_edge_get_inbuf_bytes_to_package(size_t n_available,
   } else {
     target_length = RELAY_PAYLOAD_SIZE;
   }
+  target_length -= header_len;
 
   /* Decide how many bytes we will actually put into this cell. */
   size_t package_length;
@@ -2112,7 +2348,7 @@ connection_edge_get_inbuf_bytes_to_package(size_t n_available,
   /* If we reach this point, we will be definitely sending the cell. */
   tor_assert_nonfatal(package_length > 0);
 
-  if (package_length <= RELAY_PAYLOAD_LENGTH_FOR_RANDOM_SENDMES) {
+  if (package_length + header_len <= RELAY_PAYLOAD_LENGTH_FOR_RANDOM_SENDMES) {
     /* This cell will have enough randomness in the padding to make a future
      * sendme cell unpredictable. */
     on_circuit->have_sent_sufficiently_random_cell = 1;
@@ -2145,9 +2381,12 @@ int
 connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
                                   int *max_cells)
 {
-  size_t bytes_to_process, length;
-  char payload[CELL_PAYLOAD_SIZE];
+  size_t bytes_to_process, length, header_len;
+  packed_cell_t *cell;
+  uint8_t *body;
+  uint8_t relay_command;
   circuit_t *circ;
+  int r;
   const unsigned domain = conn->base_.type == CONN_TYPE_AP ? LD_APP : LD_EXIT;
   int sending_from_optimistic = 0;
   entry_connection_t *entry_conn =
@@ -2179,10 +2418,21 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
     return -1;
   }
 
-  if (circuit_consider_stop_edge_reading(circ, cpath_layer))
-    return 0;
+  if (conn->mp_sending) {
+    /* Send on whichever circuit of the multipath set has the most room. */
+    circ = multipath_pick_leg(conn, &cpath_layer);
+    if (!circ) {
+      connection_stop_reading(TO_CONN(conn));
+      return 0;
+    }
+    header_len = MULTIPATH_SEQ_LEN;
+  } else {
+    if (circuit_consider_stop_edge_reading(circ, cpath_layer))
+      return 0;
+    header_len = 0;
+  }
 
-  if (conn->package_window <= 0) {
+  if (sendme_get_stream_package_window(conn) <= 0) {
     log_info(domain,"called with package_window %d. Skipping.",
              conn->package_window);
     connection_stop_reading(TO_CONN(conn));
@@ -2204,7 +2454,8 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   }
 
   length = connection_edge_get_inbuf_bytes_to_package(bytes_to_process,
-                                                      package_partial, circ);
+                                                      package_partial, circ,
+                                                      header_len);
   if (!length)
     return 0;
 
@@ -2214,17 +2465,23 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   stats_n_data_bytes_packaged += length;
   stats_n_data_cells_packaged += 1;
 
+  /* Take the bytes straight into the cell that we'll queue on the circuit,
+   * rather than through a cell_t. */
+  cell = relay_packed_cell_new(&body);
+
   if (PREDICT_UNLIKELY(sending_from_optimistic)) {
     /* XXXX We could be more efficient here by sometimes packing
      * previously-sent optimistic data in the same cell with data
      * from the inbuf. */
-    buf_get_bytes(entry_conn->sending_optimistic_data, payload, length);
+    buf_get_bytes(entry_conn->sending_optimistic_data,
+                  (char *) body + header_len, length);
     if (!buf_datalen(entry_conn->sending_optimistic_data)) {
         buf_free(entry_conn->sending_optimistic_data);
         entry_conn->sending_optimistic_data = NULL;
     }
   } else {
-    connection_buf_get_bytes(payload, length, TO_CONN(conn));
+    connection_buf_get_bytes((char *) body + header_len, length,
+                             TO_CONN(conn));
   }
 
   log_debug(domain,TOR_SOCKET_T_FORMAT": Packaging %d bytes (%d waiting).",
@@ -2236,14 +2493,35 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
        retry */
     if (!entry_conn->pending_optimistic_data)
       entry_conn->pending_optimistic_data = buf_new();
-    buf_add(entry_conn->pending_optimistic_data, payload, length);
+    buf_add(entry_conn->pending_optimistic_data, (char *) body + header_len,
+            length);
+  }
+
+  if (conn->mp_sending) {
+    set_uint32(body, htonl(conn->mp_next_send_seq));
+    relay_command = RELAY_COMMAND_MP_DATA;
+  } else {
+    relay_command = RELAY_COMMAND_DATA;
+  }
+
+#ifdef MEASUREMENTS_21206
+  /* Keep track of the number of RELAY_DATA cells sent for directory
+   * connections. */
+  connection_t *linked_conn = TO_CONN(conn)->linked_conn;
+
+  if (linked_conn && linked_conn->type == CONN_TYPE_DIR) {
+    ++(TO_DIR_CONN(linked_conn)->data_cells_sent);
   }
+#endif /* defined(MEASUREMENTS_21206) */
 
-  if (connection_edge_send_command(conn, RELAY_COMMAND_DATA,
-                                   payload, length) < 0 ) {
+  r = relay_send_packed_cell_from_edge(conn->stream_id, circ, relay_command,
+                                       cell, header_len + length,
+                                       cpath_layer);
+  if (r < 0) {
     /* circuit got marked for close, don't continue, don't need to mark conn */
     return 0;
   }
+  ++conn->mp_next_send_seq;
 
   /* Handle the circuit-level SENDME package window. */
   if (sendme_note_circuit_data_packaged(circ, cpath_layer) < 0) {
@@ -2321,7 +2599,7 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
   /* How many cells do we have space for?  It will be the minimum of
    * the number needed to exhaust the package window, and the minimum
    * needed to fill the cell queue. */
-  max_to_package = circ->package_window;
+  max_to_package = sendme_get_circuit_package_window(circ, layer_hint);
   if (CIRCUIT_IS_ORIGIN(circ)) {
     cells_on_queue = circ->n_chan_cells.n;
   } else {
@@ -2369,7 +2647,8 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
   /* Activate reading starting from the chosen stream */
   for (conn=chosen_stream; conn; conn = conn->next_stream) {
     /* Start reading for the streams starting from here */
-    if (conn->base_.marked_for_close || conn->package_window <= 0)
+    if (conn->base_.marked_for_close ||
+        sendme_get_stream_package_window(conn) <= 0)
       continue;
     if (!layer_hint || conn->cpath_layer == layer_hint) {
       connection_start_reading(TO_CONN(conn));
@@ -2380,7 +2659,8 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
   }
   /* Go back and do the ones we skipped, circular-style */
   for (conn = first_conn; conn != chosen_stream; conn = conn->next_stream) {
-    if (conn->base_.marked_for_close || conn->package_window <= 0)
+    if (conn->base_.marked_for_close ||
+        sendme_get_stream_package_window(conn) <= 0)
       continue;
     if (!layer_hint || conn->cpath_layer == layer_hint) {
       connection_start_reading(TO_CONN(conn));
@@ -2406,7 +2686,8 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
    * package.
    */
   for (conn=first_conn; conn; conn=conn->next_stream) {
-    if (conn->base_.marked_for_close || conn->package_window <= 0)
+    if (conn->base_.marked_for_close ||
+        sendme_get_stream_package_window(conn) <= 0)
       continue;
     if (!layer_hint || conn->cpath_layer == layer_hint) {
       int n = cells_per_conn, r;
@@ -2461,27 +2742,32 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
 {
   edge_connection_t *conn = NULL;
   unsigned domain = layer_hint ? LD_APP : LD_EXIT;
+  const int package_window =
+    sendme_get_circuit_package_window(circ, layer_hint);
 
   if (!layer_hint) {
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
     log_debug(domain,"considering circ->package_window %d",
-              circ->package_window);
-    if (circ->package_window <= 0) {
+              package_window);
+    if (package_window <= 0) {
       log_debug(domain,"yes, not-at-origin. stopped.");
-      for (conn = or_circ->n_streams; conn; conn=conn->next_stream)
-        connection_stop_reading(TO_CONN(conn));
+      for (conn = or_circ->n_streams; conn; conn=conn->next_stream) {
+        /* Multipath streams may still send on the other circuits. */
+        if (!conn->mp_sending)
+          connection_stop_reading(TO_CONN(conn));
+      }
       return 1;
     }
     return 0;
   }
   /* else, layer hint is defined, use it */
   log_debug(domain,"considering layer_hint->package_window %d",
-            layer_hint->package_window);
-  if (layer_hint->package_window <= 0) {
+            package_window);
+  if (package_window <= 0) {
     log_debug(domain,"yes, at-origin. stopped.");
     for (conn = TO_ORIGIN_CIRCUIT(circ)->p_streams; conn;
          conn=conn->next_stream) {
-      if (conn->cpath_layer == layer_hint)
+      if (conn->cpath_layer == layer_hint && !conn->mp_sending)
         connection_stop_reading(TO_CONN(conn));
     }
     return 1;
@@ -2489,23 +2775,89 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
   return 0;
 }
 
-/** The total number of cells we have allocated. */
-static size_t total_cells_allocated = 0;
+/** The circuit <b>circ</b>, which belongs to a multipath set, can take more
+ * cells. Let the multipath streams of every circuit in the set resume
+ * reading, and package what they have if <b>package</b> is true.
+ */
+static void
+circuit_resume_multipath_streams(circuit_t *circ, int package)
+{
+  /* Packaging may close circuits, and with them the set. */
+  smartlist_t *legs = smartlist_new();
+  smartlist_add_all(legs, multipath_get_legs(circ));
+
+  SMARTLIST_FOREACH_BEGIN(legs, circuit_t *, leg) {
+    edge_connection_t *conn;
+    if (CIRCUIT_IS_ORIGIN(leg))
+      conn = TO_ORIGIN_CIRCUIT(leg)->p_streams;
+    else
+      conn = TO_OR_CIRCUIT(leg)->n_streams;
+    for (; conn; conn = conn->next_stream) {
+      if (!conn->mp_sending || conn->base_.marked_for_close ||
+          sendme_get_stream_package_window(conn) <= 0 ||
+          !TO_CONN(conn)->read_event)
+        continue;
+      connection_start_reading(TO_CONN(conn));
+      if (package && connection_edge_package_raw_inbuf(conn, 1, NULL) < 0) {
+        /* (We already sent an end cell if possible) */
+        connection_mark_for_close(TO_CONN(conn));
+      }
+    }
+  } SMARTLIST_FOREACH_END(leg);
+
+  smartlist_free(legs);
+}
+
+/** Number of objects in each slab of our cell pools. */
+#define CELL_POOL_OBJS_PER_SLAB 128
+
+/* The cell pools have no locks: only the main thread may allocate or
+ * release cells.  (OR connection shards only move bytes; they never see
+ * cells.) */
+
+/** Pool from which we allocate every packed_cell_t. */
+static slab_pool_t *packed_cell_pool = NULL;
+/** Pool from which we allocate every destroy_cell_t. */
+static slab_pool_t *destroy_cell_pool = NULL;
+
+/** Return the pool for packed cells, creating it if necessary. */
+static inline slab_pool_t *
+get_packed_cell_pool(void)
+{
+  tor_assert(in_main_thread());
+  if (PREDICT_UNLIKELY(!packed_cell_pool)) {
+    packed_cell_pool = slab_pool_new("packed cell", sizeof(packed_cell_t),
+                                     CELL_POOL_OBJS_PER_SLAB);
+  }
+  return packed_cell_pool;
+}
+
+/** Return the pool for destroy cells, creating it if necessary. */
+static inline slab_pool_t *
+get_destroy_cell_pool(void)
+{
+  tor_assert(in_main_thread());
+  if (PREDICT_UNLIKELY(!destroy_cell_pool)) {
+    destroy_cell_pool = slab_pool_new("destroy cell", sizeof(destroy_cell_t),
+                                      CELL_POOL_OBJS_PER_SLAB);
+  }
+  return destroy_cell_pool;
+}
 
 /** Release storage held by <b>cell</b>. */
 static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
-  --total_cells_allocated;
-  tor_free(cell);
+  slab_pool_release(get_packed_cell_pool(), cell);
 }
 
 /** Allocate and return a new packed_cell_t. */
 STATIC packed_cell_t *
 packed_cell_new(void)
 {
-  ++total_cells_allocated;
-  return tor_malloc_zero(sizeof(packed_cell_t));
+  packed_cell_t *cell = slab_pool_alloc(get_packed_cell_pool());
+  memset(cell, 0, sizeof(packed_cell_t));
+  return cell;
 }
 
 /** Return a packed cell used outside by channel_t lower layer */
@@ -2517,6 +2869,30 @@ packed_cell_free_(packed_cell_t *cell)
   packed_cell_free_unchecked(cell);
 }
 
+/** Release storage held by <b>cell</b>. */
+void
+destroy_cell_free_(destroy_cell_t *cell)
+{
+  if (!cell)
+    return;
+  slab_pool_release(get_destroy_cell_pool(), cell);
+}
+
+/** Log usage statistics for <b>pool</b> at log level <b>severity</b>. */
+static void
+dump_slab_pool_usage(int severity, const slab_pool_t *pool)
+{
+  slab_pool_stats_t st;
+  if (!pool)
+    return;
+  slab_pool_get_stats(pool, &st);
+  tor_log(severity, LD_MM,
+          "%s pool: %"TOR_PRIuSZ" in use, %"TOR_PRIuSZ" free, "
+          "in %"TOR_PRIuSZ" slabs (%"TOR_PRIuSZ" bytes).",
+          slab_pool_get_name(pool), st.n_used, st.n_free, st.n_slabs,
+          st.bytes_allocated);
+}
+
 /** Log current statistics for cell pool allocation at log level
  * <b>severity</b>. */
 void
@@ -2524,6 +2900,8 @@ dump_cell_pool_usage(int severity)
 {
   int n_circs = 0;
   int n_cells = 0;
+  const size_t n_allocated = packed_cell_pool ?
+    slab_pool_get_n_used(packed_cell_pool) : 0;
   SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, c) {
     n_cells += c->n_chan_cells.n;
     if (!CIRCUIT_IS_ORIGIN(c))
@@ -2533,7 +2911,31 @@ dump_cell_pool_usage(int severity)
   SMARTLIST_FOREACH_END(c);
   tor_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
-          n_cells, n_circs, (int)total_cells_allocated - n_cells);
+          n_cells, n_circs, (int)n_allocated - n_cells);
+  dump_slab_pool_usage(severity, packed_cell_pool);
+  dump_slab_pool_usage(severity, destroy_cell_pool);
+  dump_slab_pool_usage(severity, var_cell_get_pool());
+}
+
+/** Return as much memory as we can from our cell pools to the system
+ * allocator. */
+static void
+cell_pools_trim(void)
+{
+  if (packed_cell_pool)
+    slab_pool_trim(packed_cell_pool);
+  if (destroy_cell_pool)
+    slab_pool_trim(destroy_cell_pool);
+  var_cell_pool_trim();
+}
+
+/** Release all storage held by our cell pools. Called from tor_free_all. */
+void
+cell_pools_free_all(void)
+{
+  slab_pool_free(packed_cell_pool);
+  slab_pool_free(destroy_cell_pool);
+  var_cell_pool_free_all();
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
@@ -2621,7 +3023,7 @@ destroy_cell_queue_clear(destroy_cell_queue_t *queue)
   destroy_cell_t *cell;
   while ((cell = TOR_SIMPLEQ_FIRST(&queue->head))) {
     TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
-    tor_free(cell);
+    destroy_cell_free(cell);
   }
   TOR_SIMPLEQ_INIT(&queue->head);
   queue->n = 0;
@@ -2646,7 +3048,8 @@ destroy_cell_queue_append(destroy_cell_queue_t *queue,
                           circid_t circid,
                           uint8_t reason)
 {
-  destroy_cell_t *cell = tor_malloc_zero(sizeof(destroy_cell_t));
+  destroy_cell_t *cell = slab_pool_alloc(get_destroy_cell_pool());
+  memset(cell, 0, sizeof(destroy_cell_t));
   cell->circid = circid;
   cell->reason = reason;
   /* Not yet used, but will be required for OOM handling. */
@@ -2668,7 +3071,7 @@ destroy_cell_to_packed_cell(destroy_cell_t *inp, int wide_circ_ids)
   cell.payload[0] = inp->reason;
   cell_pack(packed, &cell, wide_circ_ids);
 
-  tor_free(inp);
+  destroy_cell_free(inp);
   return packed;
 }
 
@@ -2680,11 +3083,17 @@ packed_cell_mem_cost(void)
   return sizeof(packed_cell_t);
 }
 
-/* DOCDOC */
+/** Return the total number of bytes used by the cells in our queues. */
 size_t
 cell_queues_get_total_allocation(void)
 {
-  return total_cells_allocated * packed_cell_mem_cost();
+  size_t total = 0;
+  if (packed_cell_pool)
+    total += slab_pool_get_n_used(packed_cell_pool) * packed_cell_mem_cost();
+  if (destroy_cell_pool)
+    total += slab_pool_get_n_used(destroy_cell_pool) *
+      sizeof(destroy_cell_t);
+  return total;
 }
 
 /** How long after we've been low on memory should we try to conserve it? */
@@ -2713,6 +3122,8 @@ cell_queues_check_size(void)
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
     last_time_under_memory_pressure = approx_time();
     if (alloc >= get_options()->MaxMemInQueues) {
+      /* Unused buffer chunks are the cheapest thing to give back. */
+      alloc -= buf_shrink_freelists(1);
       /* If we're spending over 20% of the memory limit on hidden service
        * descriptors, free them until we're down to 10%. Do the same for geoip
        * client cache. */
@@ -2733,6 +3144,8 @@ cell_queues_check_size(void)
         alloc -= dns_cache_handle_oom(now, bytes_to_remove);
       }
       circuits_handle_oom(alloc);
+      cell_pools_trim();
+      buf_shrink_freelists(1);
       return 1;
     }
   }
@@ -2837,6 +3250,9 @@ set_streams_blocked_on_circ(circuit_t *circ, channel_t *chan,
     connection_t *conn = TO_CONN(edge);
     if (stream_id && edge->stream_id != stream_id)
       continue;
+    /* Multipath streams check for room on each circuit they send on. */
+    if (edge->mp_sending)
+      continue;
 
     if (edge->edge_blocked_on_circ != block) {
       ++n;
@@ -2859,6 +3275,9 @@ set_streams_blocked_on_circ(circuit_t *circ, channel_t *chan,
     }
   }
 
+  if (!block && circ->mp_set)
+    circuit_resume_multipath_streams(circ, 0);
+
   return n;
 }
 
@@ -2899,11 +3318,13 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
   or_circuit_t *or_circ;
   int streams_blocked;
   packed_cell_t *cell;
+  uint32_t timestamp_now, msec_waiting;
 
   /* Get the cmux */
   tor_assert(chan);
   tor_assert(chan->cmux);
   cmux = chan->cmux;
+  timestamp_now = monotime_coarse_get_stamp();
 
   /* Main loop: pick a circuit, send a cell, update the cmux */
   while (n_flushed < max) {
@@ -2965,13 +3386,9 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
     cell = cell_queue_pop(queue);
 
     /* Calculate the exact time that this cell has spent in the queue. */
+    msec_waiting = cell_queue_note_sojourn(chan, circ, cell, timestamp_now);
     if (get_options()->CellStatistics ||
         get_options()->TestingEnableCellStatsEvent) {
-      uint32_t timestamp_now = monotime_coarse_get_stamp();
-      uint32_t msec_waiting =
-        (uint32_t) monotime_coarse_stamp_units_to_approx_msec(
-                         timestamp_now - cell->inserted_timestamp);
-
       if (get_options()->CellStatistics && !CIRCUIT_IS_ORIGIN(circ)) {
         or_circ = TO_OR_CIRCUIT(circ);
         or_circ->total_cell_waiting_time += msec_waiting;
@@ -3078,6 +3495,12 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
 static int32_t max_circuit_cell_queue_size =
   RELAY_CIRC_CELL_QUEUE_SIZE_DEFAULT;
 
+/* How many kilobytes worth of unused buffer chunks may we keep around for
+ * each chunk size, by default? */
+#define BUF_FREELIST_KB_DEFAULT (BUF_FREELIST_DEFAULT_MAX_BYTES >> 10)
+/* We can't have a consensus parameter above this value: 64 MB. */
+#define BUF_FREELIST_KB_MAX (64*1024)
+
 /* Called when the consensus has changed. At this stage, the global consensus
  * object has NOT been updated. It is called from
  * notify_before_networkstatus_changes(). */
@@ -3092,6 +3515,12 @@ relay_consensus_has_changed(const networkstatus_t *ns)
                             RELAY_CIRC_CELL_QUEUE_SIZE_DEFAULT,
                             RELAY_CIRC_CELL_QUEUE_SIZE_MIN,
                             RELAY_CIRC_CELL_QUEUE_SIZE_MAX);
+
+  /* Update how many unused buffer chunks we keep around. */
+  buf_set_freelist_max_bytes(
+    ((size_t) networkstatus_get_param(ns, "BufFreelistKB",
+                                      BUF_FREELIST_KB_DEFAULT,
+                                      0, BUF_FREELIST_KB_MAX)) << 10);
 }
 
 /** Add <b>cell</b> to the queue of <b>circ</b> writing to <b>chan</b>
@@ -3105,13 +3534,34 @@ void
 append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
                              cell_t *cell, cell_direction_t direction,
                              streamid_t fromstream)
+{
+  if (circ->marked_for_close)
+    return;
+
+  /* Very important that we copy to the circuit queue because all calls to
+   * this function use the stack for the cell memory. */
+  append_packed_cell_to_circuit_queue(circ, chan,
+                                      packed_cell_copy(cell,
+                                                       chan->wide_circ_ids),
+                                      direction, fromstream);
+}
+
+/** As append_cell_to_circuit_queue(), but add the already packed
+ * <b>cell</b> to the queue itself, taking ownership of it. */
+static void
+append_packed_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
+                                    packed_cell_t *cell,
+                                    cell_direction_t direction,
+                                    streamid_t fromstream)
 {
   or_circuit_t *orcirc = NULL;
   cell_queue_t *queue;
   int streams_blocked;
   int exitward;
-  if (circ->marked_for_close)
+  if (circ->marked_for_close) {
+    packed_cell_free(cell);
     return;
+  }
 
   exitward = (direction == CELL_DIRECTION_OUT);
   if (exitward) {
@@ -3129,15 +3579,15 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
            "Closing circuit for safety reasons.",
            (exitward) ? "Outbound" : "Inbound", queue->n,
            max_circuit_cell_queue_size);
+    packed_cell_free(cell);
     circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
     stats_n_circ_max_cell_reached++;
     return;
   }
 
-  /* Very important that we copy to the circuit queue because all calls to
-   * this function use the stack for the cell memory. */
-  cell_queue_append_packed_copy(circ, queue, exitward, cell,
-                                chan->wide_circ_ids, 1);
+  cell->inserted_timestamp = monotime_coarse_get_stamp();
+  cell_queue_append(queue, cell);
+  cell_queue_note_append(circ, chan, queue->n);
 
   /* Check and run the OOM if needed. */
   if (PREDICT_UNLIKELY(cell_queues_check_size())) {
@@ -35,6 +35,13 @@ relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
   relay_send_command_from_edge_((stream_id), (circ), (relay_command),   \
                                 (payload), (payload_len), (cpath_layer), \
                                 __FILE__, __LINE__)
+/** Where relay_packed_cell_new() puts the relay cell payload within the
+ * body of a packed cell: after a wide circuit ID and the cell command. */
+#define RELAY_PACKED_PAYLOAD_OFFSET 5
+packed_cell_t *relay_packed_cell_new(uint8_t **body_out);
+MOCK_DECL(int, relay_send_packed_cell_from_edge,
+          (streamid_t stream_id, circuit_t *circ, uint8_t relay_command,
+           packed_cell_t *cell, size_t body_len, crypt_path_t *cpath_layer));
 int connection_edge_send_command(edge_connection_t *fromconn,
                                  uint8_t relay_command, const char *payload,
                                  size_t payload_len);
@@ -50,6 +57,7 @@ extern uint64_t stats_n_data_cells_received;
 extern uint64_t stats_n_data_bytes_received;
 
 void dump_cell_pool_usage(int severity);
+void cell_pools_free_all(void);
 size_t packed_cell_mem_cost(void);
 
 int have_been_under_memory_pressure(void);
@@ -58,6 +66,9 @@ int have_been_under_memory_pressure(void);
 void packed_cell_free_(packed_cell_t *cell);
 #define packed_cell_free(cell) \
   FREE_AND_NULL(packed_cell_t, packed_cell_free_, (cell))
+void destroy_cell_free_(destroy_cell_t *cell);
+#define destroy_cell_free(cell) \
+  FREE_AND_NULL(destroy_cell_t, destroy_cell_free_, (cell))
 
 void cell_queue_init(cell_queue_t *queue);
 void cell_queue_clear(cell_queue_t *queue);
@@ -130,7 +141,8 @@ STATIC int connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
 STATIC size_t get_pad_cell_offset(size_t payload_len);
 STATIC size_t connection_edge_get_inbuf_bytes_to_package(size_t n_available,
                                                       int package_partial,
-                                                      circuit_t *on_circuit);
+                                                      circuit_t *on_circuit,
+                                                      size_t header_len);
 
 #endif /* defined(RELAY_PRIVATE) */
 
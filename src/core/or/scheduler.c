@@ -619,6 +619,7 @@ scheduler_init(void)
     run_sched_ev = NULL;
   }
   run_sched_ev = mainloop_event_new(scheduler_evt_callback, NULL);
+  mainloop_event_set_name(run_sched_ev, "scheduler/run");
   channels_pending = smartlist_new();
 
   set_scheduler();
@@ -130,6 +130,11 @@ void scheduler_channel_wants_writes(channel_t *chan);
 MOCK_DECL(void, scheduler_channel_doesnt_want_writes, (channel_t *chan));
 MOCK_DECL(void, scheduler_channel_has_waiting_cells, (channel_t *chan));
 
+/* Defined in scheduler_kist.c; for reporting. */
+void scheduler_kist_get_stats(uint64_t *n_runs_out,
+                              uint64_t *n_bytes_written_out,
+                              uint64_t *n_kernel_writes_out);
+
 /*****************************************************************************
  * Private scheduler functions
  *
@@ -421,6 +421,27 @@ update_socket_info(socket_table_t *table, const channel_t *chan)
             ent->notsent, ent->mss);
 }
 
+/* Totals over the lifetime of this process, for reporting: how many times
+ * has KIST run, how many bytes has it let channels write, and how many times
+ * has it pushed a channel's outbuf to the kernel? */
+static uint64_t kist_n_runs = 0;
+static uint64_t kist_n_bytes_written = 0;
+static uint64_t kist_n_kernel_writes = 0;
+
+/** Set each of the non-NULL arguments to the corresponding KIST total. */
+void
+scheduler_kist_get_stats(uint64_t *n_runs_out,
+                         uint64_t *n_bytes_written_out,
+                         uint64_t *n_kernel_writes_out)
+{
+  if (n_runs_out)
+    *n_runs_out = kist_n_runs;
+  if (n_bytes_written_out)
+    *n_bytes_written_out = kist_n_bytes_written;
+  if (n_kernel_writes_out)
+    *n_kernel_writes_out = kist_n_kernel_writes;
+}
+
 /* Increment the channel's socket written value by the number of bytes. */
 static void
 update_socket_written(socket_table_t *table, channel_t *chan, size_t bytes)
@@ -435,6 +456,7 @@ update_socket_written(socket_table_t *table, channel_t *chan, size_t bytes)
             chan->global_identifier, (unsigned long) bytes, ent->written);
 
   ent->written += bytes;
+  kist_n_bytes_written += bytes;
 }
 
 /*
@@ -468,6 +490,7 @@ MOCK_IMPL(void, channel_write_to_kernel, (channel_t *chan))
   log_debug(LD_SCHED, "Writing %lu bytes to kernel for chan %" PRIu64,
             (unsigned long)channel_outbuf_length(chan),
             chan->global_identifier);
+  ++kist_n_kernel_writes;
   /* Note that 'connection_handle_write()' may change the scheduler state of
    * the channel during the scheduling loop with
    * 'connection_or_flushed_some()' -> 'scheduler_channel_wants_writes()'.
@@ -596,6 +619,8 @@ kist_scheduler_run(void)
 
   outbuf_table_t outbuf_table = HT_INITIALIZER();
 
+  ++kist_n_runs;
+
   /* For each pending channel, collect new kernel information */
   SMARTLIST_FOREACH_BEGIN(cp, const channel_t *, pchan) {
       init_socket_info(&socket_table, pchan);
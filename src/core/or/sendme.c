@@ -18,10 +18,12 @@
 #include "core/or/crypt_path.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuituse.h"
+#include "core/or/congestion_control.h"
+#include "core/or/multipath.h"
 #include "core/or/or_circuit_st.h"
 #include "core/or/relay.h"
 #include "core/or/sendme.h"
-#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/netparams.h"
 #include "lib/ctime/di_ops.h"
 #include "trunnel/sendme_cell.h"
 
@@ -30,10 +32,12 @@
 STATIC int
 get_emit_min_version(void)
 {
-  return networkstatus_get_param(NULL, "sendme_emit_min_version",
-                                 SENDME_EMIT_MIN_VERSION_DEFAULT,
-                                 SENDME_EMIT_MIN_VERSION_MIN,
-                                 SENDME_EMIT_MIN_VERSION_MAX);
+  static netparam_t emit_min_version =
+    NETPARAM_INIT("sendme_emit_min_version",
+                  SENDME_EMIT_MIN_VERSION_DEFAULT,
+                  SENDME_EMIT_MIN_VERSION_MIN,
+                  SENDME_EMIT_MIN_VERSION_MAX);
+  return netparam_get(&emit_min_version);
 }
 
 /* Return the minimum version given by the consensus (if any) that should be
@@ -41,10 +45,12 @@ get_emit_min_version(void)
 STATIC int
 get_accept_min_version(void)
 {
-  return networkstatus_get_param(NULL, "sendme_accept_min_version",
-                                 SENDME_ACCEPT_MIN_VERSION_DEFAULT,
-                                 SENDME_ACCEPT_MIN_VERSION_MIN,
-                                 SENDME_ACCEPT_MIN_VERSION_MAX);
+  static netparam_t accept_min_version =
+    NETPARAM_INIT("sendme_accept_min_version",
+                  SENDME_ACCEPT_MIN_VERSION_DEFAULT,
+                  SENDME_ACCEPT_MIN_VERSION_MIN,
+                  SENDME_ACCEPT_MIN_VERSION_MAX);
+  return netparam_get(&accept_min_version);
 }
 
 /* Pop the first cell digset on the given circuit from the SENDME last digests
@@ -67,9 +73,12 @@ pop_first_cell_digest(const circuit_t *circ)
   /* More cell digest than the SENDME window is never suppose to happen. The
    * cell should have been rejected before reaching this point due to its
    * package_window down to 0 leading to a circuit close. Scream loudly but
-   * still pop the element so we don't memory leak. */
+   * still pop the element so we don't memory leak. (With congestion control,
+   * the window can be as large as the largest congestion window.) */
   tor_assert_nonfatal(smartlist_len(circ->sendme_last_digests) <=
-                      CIRCWINDOW_START_MAX / CIRCWINDOW_INCREMENT);
+                      (circuit_has_congestion_control(circ) ?
+                       CC_CWND_MAX_MAX : CIRCWINDOW_START_MAX) /
+                      CIRCWINDOW_INCREMENT);
 
   circ_digest = smartlist_get(circ->sendme_last_digests, 0);
   smartlist_del_keeporder(circ->sendme_last_digests, 0);
@@ -364,6 +373,41 @@ circuit_sendme_cell_is_next(int window)
   return true;
 }
 
+/* Return the congestion control state that decides how many DATA cells we
+ * may package on circ, at the hop layer_hint if we are its origin, or NULL
+ * if the fixed package window decides. */
+static inline congestion_control_t *
+get_package_ccontrol(const circuit_t *circ, const crypt_path_t *layer_hint)
+{
+  return layer_hint ? layer_hint->ccontrol : circ->ccontrol;
+}
+
+/* Return the congestion control state of the circuit that the stream conn
+ * is on, at the stream's hop if we are the circuit's origin, or NULL if the
+ * circuit uses fixed windows. */
+static inline const congestion_control_t *
+get_stream_ccontrol(const edge_connection_t *conn)
+{
+  const circuit_t *circ = conn->on_circuit;
+
+  return circ ? get_package_ccontrol(circ, conn->cpath_layer) : NULL;
+}
+
+/* Return true iff the next DATA cell that we package on circ, at the hop
+ * cpath if we are its origin, is one that the other side will acknowledge
+ * with a SENDME. */
+static bool
+sendme_cell_is_next_packaged(const circuit_t *circ, const crypt_path_t *cpath)
+{
+  const congestion_control_t *cc = get_package_ccontrol(circ, cpath);
+
+  if (cc) {
+    return congestion_control_sendme_is_next(cc);
+  }
+  return circuit_sendme_cell_is_next(cpath ? cpath->package_window :
+                                             circ->package_window);
+}
+
 /** Called when we've just received a relay data cell, when we've just
  * finished flushing all bytes to stream <b>conn</b>, or when we've flushed
  * *some* bytes to the stream <b>conn</b>.
@@ -391,7 +435,9 @@ sendme_connection_edge_consider_sending(edge_connection_t *conn)
     goto end;
   }
 
-  while (conn->deliver_window <=
+  /* Multipath data cells that we are holding because they arrived out of
+   * order haven't been delivered yet, so don't acknowledge them. */
+  while (conn->deliver_window + multipath_stream_n_held(conn) <=
          (STREAMWINDOW_START - STREAMWINDOW_INCREMENT)) {
     log_debug(log_domain, "Outbuf %" TOR_PRIuSZ ", queuing stream SENDME.",
               buf_datalen(TO_CONN(conn)->outbuf));
@@ -475,17 +521,27 @@ sendme_process_circuit_level(crypt_path_t *layer_hint,
     if (BUG(layer_hint == NULL)) {
       return -END_CIRC_REASON_TORPROTOCOL;
     }
-    if ((layer_hint->package_window + CIRCWINDOW_INCREMENT) >
-        CIRCWINDOW_START_MAX) {
-      static struct ratelim_t exit_warn_ratelim = RATELIM_INIT(600);
-      log_fn_ratelim(&exit_warn_ratelim, LOG_WARN, LD_PROTOCOL,
-                     "Unexpected sendme cell from exit relay. "
-                     "Closing circ.");
-      return -END_CIRC_REASON_TORPROTOCOL;
+    if (layer_hint->ccontrol) {
+      /* The congestion window replaces the package window. */
+      int ret = congestion_control_process_sendme(layer_hint->ccontrol);
+      if (ret < 0) {
+        return ret;
+      }
+      log_debug(LD_APP, "circ-level sendme at origin, packagewindow %d.",
+                congestion_control_get_package_window(layer_hint->ccontrol));
+    } else {
+      if ((layer_hint->package_window + CIRCWINDOW_INCREMENT) >
+          CIRCWINDOW_START_MAX) {
+        static struct ratelim_t exit_warn_ratelim = RATELIM_INIT(600);
+        log_fn_ratelim(&exit_warn_ratelim, LOG_WARN, LD_PROTOCOL,
+                       "Unexpected sendme cell from exit relay. "
+                       "Closing circ.");
+        return -END_CIRC_REASON_TORPROTOCOL;
+      }
+      layer_hint->package_window += CIRCWINDOW_INCREMENT;
+      log_debug(LD_APP, "circ-level sendme at origin, packagewindow %d.",
+                layer_hint->package_window);
     }
-    layer_hint->package_window += CIRCWINDOW_INCREMENT;
-    log_debug(LD_APP, "circ-level sendme at origin, packagewindow %d.",
-              layer_hint->package_window);
 
     /* We count circuit-level sendme's as valid delivered data because they
      * are rate limited. */
@@ -493,17 +549,26 @@ sendme_process_circuit_level(crypt_path_t *layer_hint,
   } else {
     /* We aren't the origin of this circuit so we are the Exit and thus we
      * track the package window with the circuit object. */
-    if ((circ->package_window + CIRCWINDOW_INCREMENT) >
-        CIRCWINDOW_START_MAX) {
-      static struct ratelim_t client_warn_ratelim = RATELIM_INIT(600);
-      log_fn_ratelim(&client_warn_ratelim, LOG_PROTOCOL_WARN, LD_PROTOCOL,
-                     "Unexpected sendme cell from client. "
-                     "Closing circ (window %d).", circ->package_window);
-      return -END_CIRC_REASON_TORPROTOCOL;
+    if (circ->ccontrol) {
+      int ret = congestion_control_process_sendme(circ->ccontrol);
+      if (ret < 0) {
+        return ret;
+      }
+      log_debug(LD_EXIT, "circ-level sendme at non-origin, packagewindow %d.",
+                congestion_control_get_package_window(circ->ccontrol));
+    } else {
+      if ((circ->package_window + CIRCWINDOW_INCREMENT) >
+          CIRCWINDOW_START_MAX) {
+        static struct ratelim_t client_warn_ratelim = RATELIM_INIT(600);
+        log_fn_ratelim(&client_warn_ratelim, LOG_PROTOCOL_WARN, LD_PROTOCOL,
+                       "Unexpected sendme cell from client. "
+                       "Closing circ (window %d).", circ->package_window);
+        return -END_CIRC_REASON_TORPROTOCOL;
+      }
+      circ->package_window += CIRCWINDOW_INCREMENT;
+      log_debug(LD_EXIT, "circ-level sendme at non-origin, packagewindow %d.",
+                circ->package_window);
     }
-    circ->package_window += CIRCWINDOW_INCREMENT;
-    log_debug(LD_EXIT, "circ-level sendme at non-origin, packagewindow %d.",
-              circ->package_window);
   }
 
   return 0;
@@ -576,13 +641,35 @@ sendme_circuit_data_received(circuit_t *circ, crypt_path_t *layer_hint)
   return deliver_window;
 }
 
+/* Return how many more relay DATA cells the other side may send us on the
+ * stream conn before it needs a stream-level SENDME. On a circuit that uses
+ * congestion control, the sender may have up to its congestion window in
+ * flight on one stream, so we allow up to our own largest congestion
+ * window. */
+int
+sendme_get_stream_deliver_window(const edge_connection_t *conn)
+{
+  const congestion_control_t *cc;
+
+  tor_assert(conn);
+
+  cc = get_stream_ccontrol(conn);
+  if (cc) {
+    return conn->deliver_window +
+      MAX(congestion_control_get_cwnd_max(cc) - STREAMWINDOW_START, 0);
+  }
+  return conn->deliver_window;
+}
+
 /* Called when a relay DATA cell is received for the given edge connection
- * conn. Update the deliver window and return its new value. */
+ * conn. Update the deliver window and return how many more DATA cells we
+ * will accept, as for sendme_get_stream_deliver_window(). */
 int
 sendme_stream_data_received(edge_connection_t *conn)
 {
   tor_assert(conn);
-  return --conn->deliver_window;
+  --conn->deliver_window;
+  return sendme_get_stream_deliver_window(conn);
 }
 
 /* Called when a relay DATA cell is packaged on the given circuit. If
@@ -592,9 +679,20 @@ int
 sendme_note_circuit_data_packaged(circuit_t *circ, crypt_path_t *layer_hint)
 {
   int package_window, domain;
+  congestion_control_t *cc;
 
   tor_assert(circ);
 
+  cc = get_package_ccontrol(circ, layer_hint);
+  if (cc) {
+    congestion_control_note_cell_sent(cc);
+    package_window = congestion_control_get_package_window(cc);
+    log_debug(layer_hint ? LD_APP : LD_EXIT,
+              "Circuit package_window now %d (congestion control).",
+              package_window);
+    return package_window;
+  }
+
   if (CIRCUIT_IS_ORIGIN(circ)) {
     /* Client side. */
     tor_assert(layer_hint);
@@ -613,8 +711,48 @@ sendme_note_circuit_data_packaged(circuit_t *circ, crypt_path_t *layer_hint)
   return package_window;
 }
 
+/* Return how many more relay DATA cells we may package on the given circuit
+ * before we need a circuit-level SENDME. If layer_hint is NULL, this means
+ * we are the Exit end point else we are the Client. */
+int
+sendme_get_circuit_package_window(const circuit_t *circ,
+                                  const crypt_path_t *layer_hint)
+{
+  const congestion_control_t *cc;
+
+  tor_assert(circ);
+
+  cc = get_package_ccontrol(circ, layer_hint);
+  if (cc) {
+    return congestion_control_get_package_window(cc);
+  }
+  return layer_hint ? layer_hint->package_window : circ->package_window;
+}
+
+/* Return how many more relay DATA cells we may package on the stream conn
+ * before we need a stream-level SENDME. On a circuit that uses congestion
+ * control, a stream may have as many cells in flight as the circuit's
+ * congestion window, if that is more than STREAMWINDOW_START: otherwise one
+ * stream could never use more than STREAMWINDOW_START cells of the window
+ * per round trip. */
+int
+sendme_get_stream_package_window(const edge_connection_t *conn)
+{
+  const congestion_control_t *cc;
+
+  tor_assert(conn);
+
+  cc = get_stream_ccontrol(conn);
+  if (cc) {
+    return conn->package_window +
+      MAX(congestion_control_get_cwnd(cc) - STREAMWINDOW_START, 0);
+  }
+  return conn->package_window;
+}
+
 /* Called when a relay DATA cell is packaged for the given edge connection
- * conn. Update the package window and return its new value. */
+ * conn. Update the package window and return how many more DATA cells we
+ * may package, as for sendme_get_stream_package_window(). */
 int
 sendme_note_stream_data_packaged(edge_connection_t *conn)
 {
@@ -622,7 +760,7 @@ sendme_note_stream_data_packaged(edge_connection_t *conn)
 
   --conn->package_window;
   log_debug(LD_APP, "Stream package_window now %d.", conn->package_window);
-  return conn->package_window;
+  return sendme_get_stream_package_window(conn);
 }
 
 /* Record the cell digest into the circuit sendme digest list depending on
@@ -631,20 +769,14 @@ sendme_note_stream_data_packaged(edge_connection_t *conn)
 void
 sendme_record_cell_digest_on_circ(circuit_t *circ, crypt_path_t *cpath)
 {
-  int package_window;
   uint8_t *sendme_digest;
 
   tor_assert(circ);
 
-  package_window = circ->package_window;
-  if (cpath) {
-    package_window = cpath->package_window;
-  }
-
   /* Is this the last cell before a SENDME? The idea is that if the
    * package_window reaches a multiple of the increment, after this cell, we
    * should expect a SENDME. */
-  if (!circuit_sendme_cell_is_next(package_window)) {
+  if (!sendme_cell_is_next_packaged(circ, cpath)) {
     return;
   }
 
@@ -692,8 +824,7 @@ sendme_record_sending_cell_digest(circuit_t *circ, crypt_path_t *cpath)
   tor_assert(circ);
 
   /* Only record if the next cell is expected to be a SENDME. */
-  if (!circuit_sendme_cell_is_next(cpath ? cpath->package_window :
-                                           circ->package_window)) {
+  if (!sendme_cell_is_next_packaged(circ, cpath)) {
     goto end;
   }
 
@@ -27,12 +27,16 @@ int sendme_process_stream_level(edge_connection_t *conn, circuit_t *circ,
 
 /* Update deliver window functions. */
 int sendme_stream_data_received(edge_connection_t *conn);
+int sendme_get_stream_deliver_window(const edge_connection_t *conn);
 int sendme_circuit_data_received(circuit_t *circ, crypt_path_t *layer_hint);
 
 /* Update package window functions. */
 int sendme_note_circuit_data_packaged(circuit_t *circ,
                                       crypt_path_t *layer_hint);
 int sendme_note_stream_data_packaged(edge_connection_t *conn);
+int sendme_get_stream_package_window(const edge_connection_t *conn);
+int sendme_get_circuit_package_window(const circuit_t *circ,
+                                      const crypt_path_t *layer_hint);
 
 /* Record cell digest on circuit. */
 void sendme_record_cell_digest_on_circ(circuit_t *circ, crypt_path_t *cpath);
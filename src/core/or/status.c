@@ -23,6 +23,7 @@
 #include "core/or/relay.h"
 #include "feature/relay/router.h"
 #include "feature/relay/routermode.h"
+#include "feature/relay/onion_queue.h"
 #include "core/or/circuitlist.h"
 #include "core/mainloop/mainloop.h"
 #include "feature/stats/rephist.h"
@@ -36,6 +37,7 @@
 #include "app/config/or_state_st.h"
 #include "feature/nodelist/routerinfo_st.h"
 #include "lib/tls/tortls.h"
+#include "lib/evloop/evloop_stats.h"
 
 static void log_accounting(const time_t now, const or_options_t *options);
 
@@ -148,6 +150,65 @@ note_connection(bool inbound, int family)
   }
 }
 
+/** How many of the slowest main loop callbacks do we name in the
+ * heartbeat? */
+#define HEARTBEAT_N_SLOW_CALLBACKS 3
+/** If any main loop callback took at least this many microseconds since the
+ * last heartbeat, log the slowest callbacks at notice level rather than info
+ * level. */
+#define HEARTBEAT_SLOW_CALLBACK_USEC (100*1000)
+
+/** Log the main loop callbacks that have run for the longest at a time
+ * since the last heartbeat, and start a new period for the next one. */
+static void
+log_mainloop_callback_stats(void)
+{
+  const smartlist_t *all_stats = evloop_stats_get_all();
+  const evloop_stat_t *slowest[HEARTBEAT_N_SLOW_CALLBACKS] = { NULL };
+  uint64_t n_calls = 0;
+
+  if (!all_stats)
+    return;
+
+  SMARTLIST_FOREACH_BEGIN(all_stats, const evloop_stat_t *, stat) {
+    if (!stat->period_n_calls)
+      continue;
+    n_calls += stat->period_n_calls;
+    /* Insert stat into slowest, keeping it sorted by decreasing maximum. */
+    for (int i = 0; i < HEARTBEAT_N_SLOW_CALLBACKS; ++i) {
+      if (!slowest[i] ||
+          stat->period_max_wall_usec > slowest[i]->period_max_wall_usec) {
+        memmove(&slowest[i+1], &slowest[i],
+                sizeof(slowest[0]) * (HEARTBEAT_N_SLOW_CALLBACKS - i - 1));
+        slowest[i] = stat;
+        break;
+      }
+    }
+  } SMARTLIST_FOREACH_END(stat);
+
+  if (n_calls) {
+    smartlist_t *parts = smartlist_new();
+    char *msg;
+    for (int i = 0; i < HEARTBEAT_N_SLOW_CALLBACKS && slowest[i]; ++i) {
+      smartlist_add_asprintf(parts, "%s (%"PRIu64" calls, %"PRIu64" msec "
+                             "total, %"PRIu64" msec max)",
+                             slowest[i]->name, slowest[i]->period_n_calls,
+                             slowest[i]->period_wall_usec / 1000,
+                             slowest[i]->period_max_wall_usec / 1000);
+    }
+    msg = smartlist_join_strings(parts, ", ", 0, NULL);
+    log_fn(slowest[0]->period_max_wall_usec >= HEARTBEAT_SLOW_CALLBACK_USEC
+           ? LOG_NOTICE : LOG_INFO, LD_HEARTBEAT,
+           "Main loop ran %"PRIu64" callbacks; the slowest were: %s.",
+           n_calls, msg);
+    tor_free(msg);
+    SMARTLIST_FOREACH(parts, char *, cp, tor_free(cp));
+    smartlist_free(parts);
+  }
+
+  evloop_stats_reset_period();
+}
+
 /** Log a "heartbeat" message describing Tor's status and history so that the
  * user can know that there is indeed a running Tor.  Return 0 on success and
  * -1 on failure. */
@@ -213,6 +274,7 @@ log_heartbeat(time_t now)
 
   if (public_server_mode(options)) {
     rep_hist_log_circuit_handshake_stats(now);
+    onion_queue_log_delay_stats();
     rep_hist_log_link_protocol_counts();
     dos_log_heartbeat();
   }
@@ -241,6 +303,8 @@ log_heartbeat(time_t now)
          (main_loop_idle_count));
   }
 
+  log_mainloop_callback_stats();
+
   /** Now, if we are an HS service, log some stats about our usage */
   log_onion_service_stats();
 
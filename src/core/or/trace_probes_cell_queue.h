@@ -0,0 +1,23 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file trace_probes_cell_queue.h
+ * \brief The tracing probes for the circuit cell queues. Currently, only
+ *        LTTng-UST probes are declared here; USDT probes need no
+ *        declaration.
+ **/
+
+#ifndef TOR_TRACE_PROBES_CELL_QUEUE_H
+#define TOR_TRACE_PROBES_CELL_QUEUE_H
+
+#include "lib/trace/events.h"
+
+/* We only build the following if LTTng instrumentation has been enabled. */
+#ifdef USE_TRACING_INSTRUMENTATION_LTTNG
+
+#include "core/or/lttng_cell_queue.inc"
+
+#endif /* USE_TRACING_INSTRUMENTATION_LTTNG */
+
+#endif /* TOR_TRACE_PROBES_CELL_QUEUE_H */
@@ -90,3 +90,38 @@ fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto)
   *out = result;
   return 1;
 }
+
+/** Look for whole fixed-length cells at the start of <b>buf</b>, according
+ * to the rules of link protocol version <b>linkproto</b>, with circuit IDs
+ * as wide as <b>wide_circ_ids</b> says.  Return how many there are, up to
+ * <b>max</b> and up to the first variable-length cell, among those that are
+ * next to each other in memory.  Set *<b>head_out</b> to the first byte of
+ * the first one.
+ *
+ * The cells stay on <b>buf</b>; the caller must drain them once it has
+ * unpacked them. */
+size_t
+peek_fixed_cells_from_buf(buf_t *buf, int wide_circ_ids, int linkproto,
+                          size_t max, const char **head_out)
+{
+  const int circ_id_len = get_circ_id_size(wide_circ_ids);
+  const size_t cell_network_size = get_cell_network_size(wide_circ_ids);
+  size_t head_len, n_cells, i;
+
+  *head_out = NULL;
+  if (buf_datalen(buf) < cell_network_size)
+    return 0;
+
+  /* Only copy data around if the first cell straddles two chunks; take the
+   * rest of the cells from wherever they already are. */
+  buf_pullup(buf, cell_network_size, head_out, &head_len);
+  n_cells = MIN(head_len / cell_network_size, max);
+
+  for (i = 0; i < n_cells; ++i) {
+    uint8_t command =
+      get_uint8(*head_out + i * cell_network_size + circ_id_len);
+    if (cell_command_is_var_length(command, linkproto))
+      break;
+  }
+  return i;
+}
@@ -17,5 +17,8 @@ struct var_cell_t;
 
 int fetch_var_cell_from_buf(struct buf_t *buf, struct var_cell_t **out,
                             int linkproto);
+size_t peek_fixed_cells_from_buf(struct buf_t *buf, int wide_circ_ids,
+                                 int linkproto, size_t max,
+                                 const char **head_out);
 
 #endif /* !defined(TOR_PROTO_CELL_H) */
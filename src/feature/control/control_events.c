@@ -413,6 +413,8 @@ control_initialize_event_queue(void)
       flush_queued_events_event =
         mainloop_event_new(flush_queued_events_cb, NULL);
       tor_assert(flush_queued_events_event);
+      mainloop_event_set_name(flush_queued_events_event,
+                              "control/flush-events");
     }
   }
 
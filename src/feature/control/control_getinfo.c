@@ -54,6 +54,8 @@
 #include "feature/stats/rephist.h"
 #include "lib/version/torversion.h"
 #include "lib/encoding/kvline.h"
+#include "lib/evloop/evloop_stats.h"
+#include "core/or/cell_queue_stats.h"
 
 #include "core/or/entry_connection_st.h"
 #include "core/or/or_connection_st.h"
@@ -1484,6 +1486,42 @@ getinfo_helper_rephist(control_connection_t *control_conn,
   return 0;
 }
 
+/** Implementation helper for GETINFO: answers queries about how long the
+ * main loop spends in each of its callbacks. */
+STATIC int
+getinfo_helper_mainloop(control_connection_t *control_conn,
+                        const char *question, char **answer,
+                        const char **errmsg)
+{
+  (void) control_conn;
+  (void) errmsg;
+
+  if (!strcmp(question, "mainloop/callback-stats")) {
+    *answer = evloop_stats_format();
+  }
+
+  return 0;
+}
+
+/** Implementation helper for GETINFO: answers queries about how long cells
+ * wait on circuit cell queues. */
+STATIC int
+getinfo_helper_cell_queue(control_connection_t *control_conn,
+                          const char *question, char **answer,
+                          const char **errmsg)
+{
+  (void) control_conn;
+  (void) errmsg;
+
+  if (!strcmp(question, "cell-queue/sojourn")) {
+    *answer = cell_queue_sojourn_format();
+  } else if (!strcmp(question, "cell-queue/sojourn/channels")) {
+    *answer = cell_queue_sojourn_format_channels();
+  }
+
+  return 0;
+}
+
 /** Implementation helper for GETINFO: answers queries about shared random
  * value. */
 static int
@@ -1722,6 +1760,12 @@ static const getinfo_item_t getinfo_items[] = {
        "Assigned TAP circuit handshake stats."),
   ITEM("stats/tap/requested", rephist,
        "Requested TAP circuit handshake stats."),
+  ITEM("mainloop/callback-stats", mainloop,
+       "Time spent in each kind of main loop callback."),
+  ITEM("cell-queue/sojourn", cell_queue,
+       "Histograms of how long cells waited on circuit queues."),
+  ITEM("cell-queue/sojourn/channels", cell_queue,
+       "Per-channel histograms of how long cells waited on circuit queues."),
   { NULL, NULL, NULL, 0 }
 };
 
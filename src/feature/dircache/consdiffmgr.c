@@ -389,6 +389,7 @@ cdm_cache_init(void)
   }
   consdiffmgr_rescan_ev =
     mainloop_event_postloop_new(consdiffmgr_rescan_cb, NULL);
+  mainloop_event_set_name(consdiffmgr_rescan_ev, "consdiffmgr/rescan");
   mark_cdm_cache_dirty();
   cdm_cache_loaded = 0;
 }
@@ -1028,6 +1028,7 @@ hibernate_schedule_wakeup_event(time_t now, time_t end_time)
 
   if (!wakeup_event) {
     wakeup_event = mainloop_event_postloop_new(wakeup_event_callback, NULL);
+    mainloop_event_set_name(wakeup_event, "hibernate/wakeup");
   }
 
   mainloop_event_schedule(wakeup_event, &delay);
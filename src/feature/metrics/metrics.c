@@ -0,0 +1,423 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file metrics.c
+ * @brief Export internal statistics over HTTP, for Prometheus.
+ *
+ * When MetricsPort is set, we listen on it for HTTP connections, and answer
+ * "GET /metrics" with a snapshot of our internal counters and histograms in
+ * the Prometheus text exposition format (version 0.0.4).  Each connection
+ * gets a single answer, after which we close it.
+ *
+ * Everything we report here is already kept by the module it describes: we
+ * only collect and format it.  Counters are totals since startup, so that a
+ * collector can compute rates over whatever window it likes.
+ *
+ * Because these statistics reveal something about our traffic, the
+ * MetricsPort only accepts connections from localhost, unless
+ * MetricsPortPolicy says otherwise.
+ **/
+
+#define METRICS_PRIVATE
+
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/or/cell_queue_stats.h"
+#include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/connection_or.h"
+#include "core/or/policies.h"
+#include "core/or/relay.h"
+#include "core/or/scheduler.h"
+#include "core/proto/proto_http.h"
+#include "feature/dircommon/directory.h"
+#include "feature/metrics/metrics.h"
+#include "feature/relay/dns.h"
+#include "feature/relay/onion_queue.h"
+#include "lib/buf/buffers.h"
+#include "lib/evloop/evloop_stats.h"
+
+#include "core/or/connection_st.h"
+
+/** Add the HELP and TYPE lines for the metric called <b>name</b> to
+ * <b>out</b>. */
+static void
+add_header(smartlist_t *out, const char *name, const char *type,
+           const char *help)
+{
+  smartlist_add_asprintf(out, "# HELP %s %s\n# TYPE %s %s\n",
+                         name, help, name, type);
+}
+
+/** Add a metric called <b>name</b>, with a single unlabelled
+ * <b>value</b>, to <b>out</b>. */
+static void
+add_value(smartlist_t *out, const char *name, const char *type,
+          const char *help, uint64_t value)
+{
+  add_header(out, name, type, help);
+  smartlist_add_asprintf(out, "%s %"PRIu64"\n", name, value);
+}
+
+/** Add to <b>out</b> a histogram called <b>name</b>, with the given
+ * <b>labels</b> (or NULL).  The histogram has <b>n_buckets</b> buckets in
+ * <b>buckets</b>: bucket 0 counts observations of at most <b>first_bound</b>
+ * seconds, each following bucket counts observations above the bound of the
+ * one before it and at most twice that bound, and the last bucket counts
+ * everything else.  <b>sum_usec</b> is the total
+ * of all the observations, in microseconds.
+ *
+ * Prometheus buckets are cumulative, so we add up our buckets as we go. */
+STATIC void
+metrics_format_histogram(smartlist_t *out, const char *name,
+                         const char *labels, const uint64_t *buckets,
+                         int n_buckets, double first_bound, uint64_t sum_usec)
+{
+  const char *sep = labels ? "," : "";
+  uint64_t total = 0;
+  double bound = first_bound;
+
+  if (!labels)
+    labels = "";
+  for (int i = 0; i < n_buckets - 1; ++i) {
+    total += buckets[i];
+    smartlist_add_asprintf(out, "%s_bucket{%s%sle=\"%.9g\"} %"PRIu64"\n",
+                           name, labels, sep, bound, total);
+    bound *= 2;
+  }
+  total += buckets[n_buckets - 1];
+  smartlist_add_asprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %"PRIu64"\n",
+                         name, labels, sep, total);
+  if (*labels) {
+    smartlist_add_asprintf(out, "%s_sum{%s} %.6f\n%s_count{%s} %"PRIu64"\n",
+                           name, labels, sum_usec / 1e6,
+                           name, labels, total);
+  } else {
+    smartlist_add_asprintf(out, "%s_sum %.6f\n%s_count %"PRIu64"\n",
+                           name, sum_usec / 1e6, name, total);
+  }
+}
+
+/** Add the metrics for our cell queues and circuits to <b>out</b>. */
+static void
+add_cell_metrics(smartlist_t *out)
+{
+  uint64_t n_cells_xmit, n_destroys_xmit;
+  int64_t n_destroys_queued;
+
+  circuitmux_get_global_stats(&n_cells_xmit, &n_destroys_xmit,
+                              &n_destroys_queued);
+
+  add_value(out, "tor_cell_queues_bytes", "gauge",
+            "Memory used by queued cells.",
+            cell_queues_get_total_allocation());
+  add_value(out, "tor_relay_cells_relayed_total", "counter",
+            "Relay cells passed on to another hop.",
+            stats_n_relay_cells_relayed);
+  add_value(out, "tor_relay_cells_delivered_total", "counter",
+            "Relay cells delivered to this hop.",
+            stats_n_relay_cells_delivered);
+  add_value(out, "tor_circuit_max_cells_reached_total", "counter",
+            "Circuits closed for having too many cells queued.",
+            stats_n_circ_max_cell_reached);
+  add_value(out, "tor_circuitmux_cells_sent_total", "counter",
+            "Cells sent by circuit multiplexers.", n_cells_xmit);
+  add_value(out, "tor_circuitmux_destroy_cells_sent_total", "counter",
+            "Destroy cells sent by circuit multiplexers.", n_destroys_xmit);
+  add_value(out, "tor_circuitmux_destroy_cells_queued", "gauge",
+            "Destroy cells waiting to be sent.",
+            n_destroys_queued > 0 ? (uint64_t)n_destroys_queued : 0);
+}
+
+/** Add the histograms of how long cells waited on circuit cell queues to
+ * <b>out</b>. */
+static void
+add_cell_sojourn_metrics(smartlist_t *out)
+{
+  add_header(out, "tor_cell_queue_sojourn_seconds", "histogram",
+             "Time cells spent on circuit cell queues, by circuit type "
+             "and direction.");
+  for (int t = 0; t < CELL_SOJOURN_N_CIRC_TYPES; ++t) {
+    for (int d = 0; d < CELL_SOJOURN_N_DIRECTIONS; ++d) {
+      const cell_sojourn_hist_t *hist = cell_queue_get_sojourn_hist(t, d);
+      char *labels = NULL;
+      tor_asprintf(&labels, "circ=\"%s\",direction=\"%s\"",
+                   cell_queue_sojourn_circ_type_name(t),
+                   cell_queue_sojourn_direction_name(d));
+      metrics_format_histogram(out, "tor_cell_queue_sojourn_seconds", labels,
+                               hist->hist, CELL_SOJOURN_N_BUCKETS, 0.001,
+                               hist->total_msec * 1000);
+      tor_free(labels);
+    }
+  }
+}
+
+/** Add the metrics for our onionskin queue to <b>out</b>. */
+static void
+add_onion_metrics(smartlist_t *out)
+{
+  uint64_t hist[ONION_QUEUE_DELAY_N_BUCKETS];
+  uint64_t sum_usec;
+
+  add_header(out, "tor_onion_queue_pending", "gauge",
+             "Onionskins waiting for a cpuworker.");
+  smartlist_add_asprintf(out, "tor_onion_queue_pending{type=\"tap\"} %d\n"
+                         "tor_onion_queue_pending{type=\"ntor\"} %d\n",
+                         onion_num_pending(ONION_HANDSHAKE_TYPE_TAP),
+                         onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  onion_queue_get_total_delay_hist(hist, &sum_usec);
+  add_header(out, "tor_onion_queue_delay_seconds", "histogram",
+             "Time onionskins spent waiting for a cpuworker.");
+  metrics_format_histogram(out, "tor_onion_queue_delay_seconds", NULL,
+                           hist, ONION_QUEUE_DELAY_N_BUCKETS, 0.001,
+                           sum_usec);
+  add_value(out, "tor_onion_queue_dropped_total", "counter",
+            "Onionskins dropped from the queue because of overload.",
+            onion_queue_get_total_dropped());
+
+  add_header(out, "tor_onionskin_estimated_seconds", "gauge",
+             "Estimated time for a cpuworker to answer one onionskin.");
+  smartlist_add_asprintf(out,
+                   "tor_onionskin_estimated_seconds{type=\"tap\"} %.6f\n"
+                   "tor_onionskin_estimated_seconds{type=\"ntor\"} %.6f\n",
+        estimated_usec_for_onionskins(1, ONION_HANDSHAKE_TYPE_TAP) / 1e6,
+        estimated_usec_for_onionskins(1, ONION_HANDSHAKE_TYPE_NTOR) / 1e6);
+}
+
+/** Add the metrics for our memory use and out-of-memory handler to
+ * <b>out</b>. */
+static void
+add_memory_metrics(smartlist_t *out)
+{
+  uint64_t n_oom, n_circs_killed, n_dirconns_killed, bytes_recovered;
+
+  circuits_get_oom_stats(&n_oom, &n_circs_killed, &n_dirconns_killed,
+                         &bytes_recovered);
+
+  add_value(out, "tor_buffers_bytes", "gauge",
+            "Memory used by connection buffers.",
+            buf_get_total_allocation());
+  add_value(out, "tor_buffers_freelist_bytes", "gauge",
+            "Memory held in freelists of unused buffer chunks.",
+            buf_get_freelist_allocation());
+  add_value(out, "tor_oom_invocations_total", "counter",
+            "Times the out-of-memory handler has run.", n_oom);
+  add_value(out, "tor_oom_circuits_killed_total", "counter",
+            "Circuits closed by the out-of-memory handler.", n_circs_killed);
+  add_value(out, "tor_oom_dirconns_killed_total", "counter",
+            "Directory connections closed by the out-of-memory handler.",
+            n_dirconns_killed);
+  add_value(out, "tor_oom_bytes_recovered_total", "counter",
+            "Bytes freed by the out-of-memory handler.", bytes_recovered);
+}
+
+/** Add the metrics for the KIST scheduler and the DNS cache to <b>out</b>. */
+static void
+add_scheduler_and_dns_metrics(smartlist_t *out)
+{
+  uint64_t n_runs, n_bytes, n_kernel_writes;
+  uint64_t n_hits, n_pending, n_misses, n_entries;
+
+  scheduler_kist_get_stats(&n_runs, &n_bytes, &n_kernel_writes);
+  add_value(out, "tor_kist_runs_total", "counter",
+            "Times the KIST scheduler has run.", n_runs);
+  add_value(out, "tor_kist_bytes_written_total", "counter",
+            "Bytes the KIST scheduler has let channels write.", n_bytes);
+  add_value(out, "tor_kist_kernel_writes_total", "counter",
+            "Times the KIST scheduler has flushed an outbuf to the kernel.",
+            n_kernel_writes);
+
+  dns_cache_get_stats(&n_hits, &n_pending, &n_misses, &n_entries);
+  add_header(out, "tor_dns_cache_lookups_total", "counter",
+             "Exit DNS cache lookups, by result.");
+  smartlist_add_asprintf(out,
+                 "tor_dns_cache_lookups_total{result=\"hit\"} %"PRIu64"\n"
+                 "tor_dns_cache_lookups_total{result=\"pending\"} %"PRIu64"\n"
+                 "tor_dns_cache_lookups_total{result=\"miss\"} %"PRIu64"\n",
+                 n_hits, n_pending, n_misses);
+  add_value(out, "tor_dns_cache_entries", "gauge",
+            "Entries in the exit DNS cache.", n_entries);
+}
+
+/** Add the metrics for our main loop callbacks to <b>out</b>, skipping any
+ * callback that has never run.  (Callback names come from our own code, so
+ * they never need escaping.) */
+static void
+add_mainloop_metrics(smartlist_t *out)
+{
+  const smartlist_t *stats = evloop_stats_get_all();
+
+  if (!stats)
+    return;
+
+  add_header(out, "tor_mainloop_callback_seconds", "histogram",
+             "Wall-clock time spent in each kind of main loop callback.");
+  SMARTLIST_FOREACH_BEGIN(stats, const evloop_stat_t *, stat) {
+    char *labels = NULL;
+    if (!stat->n_calls)
+      continue;
+    tor_asprintf(&labels, "callback=\"%s\"", stat->name);
+    metrics_format_histogram(out, "tor_mainloop_callback_seconds", labels,
+                             stat->wall_hist, EVLOOP_STAT_N_BUCKETS, 1e-6,
+                             stat->wall_usec);
+    tor_free(labels);
+  } SMARTLIST_FOREACH_END(stat);
+
+  add_header(out, "tor_mainloop_callback_cpu_seconds_total", "counter",
+             "CPU time spent in each kind of main loop callback, "
+             "estimated from a sample of calls.");
+  SMARTLIST_FOREACH_BEGIN(stats, const evloop_stat_t *, stat) {
+    if (!stat->n_calls)
+      continue;
+    smartlist_add_asprintf(out,
+                 "tor_mainloop_callback_cpu_seconds_total{callback=\"%s\"} "
+                 "%.6f\n", stat->name,
+                 evloop_stat_estimate_cpu_usec(stat) / 1e6);
+  } SMARTLIST_FOREACH_END(stat);
+}
+
+/** Return a newly allocated string holding all of our metrics, in the
+ * Prometheus text exposition format. */
+char *
+metrics_get_output(void)
+{
+  smartlist_t *out = smartlist_new();
+  char *result;
+
+  add_cell_metrics(out);
+  add_cell_sojourn_metrics(out);
+  add_onion_metrics(out);
+  add_memory_metrics(out);
+  add_scheduler_and_dns_metrics(out);
+  add_mainloop_metrics(out);
+
+  result = smartlist_join_strings(out, "", 0, NULL);
+  SMARTLIST_FOREACH(out, char *, cp, tor_free(cp));
+  smartlist_free(out);
+  return result;
+}
+
+/** Called when we have accepted a new MetricsPort connection <b>conn</b>.
+ * Return 0 if we should keep it, or -1 if it should be closed. */
+int
+metrics_connection_init_accepted(connection_t *conn)
+{
+  tor_assert(conn->type == CONN_TYPE_METRICS);
+
+  if (!metrics_policy_permits_address(&conn->addr)) {
+    log_notice(LD_NET, "Denying MetricsPort connection from untrusted "
+               "address %s.", fmt_and_decorate_addr(&conn->addr));
+    return -1;
+  }
+  conn->state = METRICS_CONN_STATE_READING;
+  return 0;
+}
+
+/** Answer a request for our metrics on <b>conn</b>. */
+static void
+write_metrics(connection_t *conn)
+{
+  char *body = metrics_get_output();
+  char *headers = NULL;
+  const size_t body_len = strlen(body);
+
+  tor_asprintf(&headers, "HTTP/1.0 200 OK\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: %"TOR_PRIuSZ"\r\n\r\n", body_len);
+  connection_buf_add(headers, strlen(headers), conn);
+  connection_buf_add(body, body_len, conn);
+  tor_free(headers);
+  tor_free(body);
+}
+
+/** Called when we have read data on the MetricsPort connection <b>conn</b>.
+ * Once we have a whole HTTP request, answer it and close the connection.
+ * Return 0 on success, -1 on failure. */
+int
+metrics_connection_process_inbuf(connection_t *conn)
+{
+  char *headers = NULL, *command = NULL, *url = NULL;
+  const char *errmsg = NULL;
+
+  tor_assert(conn->type == CONN_TYPE_METRICS);
+
+  if (conn->state != METRICS_CONN_STATE_READING) {
+    /* We've already answered; we don't care what else they send. */
+    buf_clear(conn->inbuf);
+    return 0;
+  }
+
+  switch (fetch_from_buf_http(conn->inbuf, &headers, MAX_HEADERS_SIZE,
+                              NULL, NULL, MAX_HEADERS_SIZE, 0)) {
+    case -1:
+      errmsg = "HTTP/1.0 400 Bad Request\r\n\r\n";
+      goto done;
+    case 0:
+      /* Not all here yet. */
+      return 0;
+  }
+
+  if (parse_http_command(headers, &command, &url) < 0) {
+    errmsg = "HTTP/1.0 400 Bad Request\r\n\r\n";
+  } else if (strcmp(command, "GET")) {
+    errmsg = "HTTP/1.0 405 Method Not Allowed\r\n\r\n";
+  } else if (strcmp(url, "/metrics")) {
+    errmsg = "HTTP/1.0 404 Not Found\r\n\r\n";
+  } else {
+    write_metrics(conn);
+  }
+
+ done:
+  if (errmsg)
+    connection_buf_add(errmsg, strlen(errmsg), conn);
+  conn->state = METRICS_CONN_STATE_WRITING;
+  connection_mark_and_flush(conn);
+  tor_free(headers);
+  tor_free(command);
+  tor_free(url);
+  return 0;
+}
+
+/** Called when the other side of the MetricsPort connection <b>conn</b> has
+ * closed it.  Return 0. */
+int
+metrics_connection_reached_eof(connection_t *conn)
+{
+  tor_assert(conn->type == CONN_TYPE_METRICS);
+
+  log_info(LD_NET, "MetricsPort connection reached EOF. Closing.");
+  connection_mark_for_close(conn);
+  return 0;
+}
+
+/** Called when we have flushed everything we meant to send on the
+ * MetricsPort connection <b>conn</b>.  Return 0. */
+int
+metrics_connection_finished_flushing(connection_t *conn)
+{
+  tor_assert(conn->type == CONN_TYPE_METRICS);
+
+  /* Once we've answered, the connection is marked, and will close now. */
+  return 0;
+}
+
+/** Parse the MetricsPort lines in <b>options</b>, and add them to
+ * <b>ports</b>.  On success, return 0.  On failure, set *<b>err_msg_out</b>
+ * to a newly allocated string describing the problem, and return -1. */
+int
+metrics_parse_ports(const or_options_t *options, smartlist_t *ports,
+                    char **err_msg_out)
+{
+  if (port_parse_config(ports, options->MetricsPort_lines,
+                        "Metrics", CONN_TYPE_METRICS_LISTENER,
+                        "127.0.0.1", 0,
+                        CL_PORT_NO_STREAM_OPTIONS|CL_PORT_WARN_NONLOCAL) < 0) {
+    *err_msg_out = tor_strdup("Invalid MetricsPort configuration");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,42 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file metrics.h
+ * @brief Header for feature/metrics/metrics.c
+ **/
+
+#ifndef TOR_FEATURE_METRICS_METRICS_H
+#define TOR_FEATURE_METRICS_METRICS_H
+
+#define METRICS_CONN_STATE_MIN_ 1
+/** State for a MetricsPort connection: waiting for an HTTP request. */
+#define METRICS_CONN_STATE_READING 1
+/** State for a MetricsPort connection: flushing our answer, then closing. */
+#define METRICS_CONN_STATE_WRITING 2
+#define METRICS_CONN_STATE_MAX_ 2
+
+struct smartlist_t;
+
+char *metrics_get_output(void);
+
+int metrics_connection_init_accepted(connection_t *conn);
+int metrics_connection_process_inbuf(connection_t *conn);
+int metrics_connection_reached_eof(connection_t *conn);
+int metrics_connection_finished_flushing(connection_t *conn);
+
+int metrics_parse_ports(const or_options_t *options,
+                        struct smartlist_t *ports,
+                        char **err_msg_out);
+
+#ifdef METRICS_PRIVATE
+STATIC void metrics_format_histogram(struct smartlist_t *out,
+                                     const char *name,
+                                     const char *labels,
+                                     const uint64_t *buckets,
+                                     int n_buckets,
+                                     double first_bound,
+                                     uint64_t sum_usec);
+#endif /* defined(METRICS_PRIVATE) */
+
+#endif /* !defined(TOR_FEATURE_METRICS_METRICS_H) */
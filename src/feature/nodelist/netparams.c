@@ -0,0 +1,178 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file netparams.c
+ * \brief Keep the integer parameters of the latest consensus in a table, so
+ *   that frequently used ones cost us a field lookup instead of a parse.
+ *
+ * networkstatus_get_param() walks the list of "name=value" strings in the
+ * consensus, and parses the one it wants, every time it's called.  That's
+ * fine for code that runs once per consensus, but some parameters are read
+ * once per cell or once per connection.
+ *
+ * So whenever the latest consensus changes, we compile its parameters into
+ * a map from name to value, and bump a generation counter.  A subsystem
+ * declares each parameter it reads often as a netparam_t, and reads it with
+ * netparam_get().  Each netparam_t remembers its clamped value and the
+ * generation it came from; every registered parameter is brought up to
+ * date as soon as the consensus changes, so netparam_get() normally just
+ * returns a field.  Parameters register themselves the first time they are
+ * read, or up front with netparam_register().
+ **/
+
+#include "core/or/or.h"
+#include "feature/nodelist/netparams.h"
+#include "feature/nodelist/networkstatus.h"
+#include "lib/container/map.h"
+
+#include "feature/nodelist/networkstatus_st.h"
+
+/** The consensus whose parameters are in <b>compiled_params</b>, or NULL if
+ * we have compiled none. */
+static const networkstatus_t *compiled_ns = NULL;
+/** Map from parameter name to int32_t*, holding every well-formed integer
+ * parameter of <b>compiled_ns</b>.  NULL if compiled_ns is NULL. */
+static strmap_t *compiled_params = NULL;
+/** Incremented whenever <b>compiled_params</b> changes.  It starts at 1, so
+ * that a netparam_t with a generation of 0 is always out of date. */
+static uint64_t netparams_generation = 1;
+/** Every netparam_t that has been registered. */
+static smartlist_t *registered_params = NULL;
+
+/** Set <b>param</b> to its value in the compiled parameter table. */
+static void
+netparam_refresh(netparam_t *param)
+{
+  int32_t res = param->default_val;
+  const int32_t *valp = NULL;
+
+  tor_assert(param->max_val > param->min_val);
+  tor_assert(param->min_val <= param->default_val);
+  tor_assert(param->max_val >= param->default_val);
+
+  if (compiled_params)
+    valp = strmap_get(compiled_params, param->name);
+  if (valp)
+    res = *valp;
+
+  if (res < param->min_val) {
+    log_warn(LD_DIR, "Consensus parameter %s is too small. Got %d, raising to "
+             "%d.", param->name, res, param->min_val);
+    res = param->min_val;
+  } else if (res > param->max_val) {
+    log_warn(LD_DIR, "Consensus parameter %s is too large. Got %d, capping to "
+             "%d.", param->name, res, param->max_val);
+    res = param->max_val;
+  }
+
+  param->value = res;
+  param->generation = netparams_generation;
+}
+
+/** Release the compiled parameter table. */
+static void
+netparams_clear(void)
+{
+  strmap_free(compiled_params, tor_free_);
+  compiled_ns = NULL;
+  ++netparams_generation;
+}
+
+/** Compile the integer parameters of <b>ns</b>, which may be NULL, into our
+ * parameter table, and update every registered parameter to match. */
+static void
+netparams_compile(const networkstatus_t *ns)
+{
+  netparams_clear();
+  compiled_ns = ns;
+
+  if (ns && ns->net_params) {
+    compiled_params = strmap_new();
+    SMARTLIST_FOREACH_BEGIN(ns->net_params, const char *, p) {
+      const char *eq = strchr(p, '=');
+      char *name;
+      long v;
+      int ok = 0;
+      if (!eq)
+        continue;
+      v = tor_parse_long(eq+1, 10, INT32_MIN, INT32_MAX, &ok, NULL);
+      if (!ok)
+        continue;
+      name = tor_strndup(p, eq - p);
+      /* As in networkstatus_get_param(), the first good value wins. */
+      if (!strmap_get(compiled_params, name)) {
+        int32_t *valp = tor_malloc(sizeof(int32_t));
+        *valp = (int32_t) v;
+        strmap_set(compiled_params, name, valp);
+      }
+      tor_free(name);
+    } SMARTLIST_FOREACH_END(p);
+  }
+
+  if (registered_params) {
+    SMARTLIST_FOREACH(registered_params, netparam_t *, param,
+                      netparam_refresh(param));
+  }
+}
+
+/** Add <b>param</b> to the parameters that we update as soon as the
+ * consensus changes.  Subsystems may call this when they start up, so that
+ * any complaints about their parameters' values show up right away. */
+void
+netparam_register(netparam_t *param)
+{
+  if (param->registered)
+    return;
+  if (!registered_params)
+    registered_params = smartlist_new();
+  smartlist_add(registered_params, param);
+  param->registered = 1;
+}
+
+/** Return the value of <b>param</b> in the latest consensus, or its default
+ * if there is no consensus or it doesn't set <b>param</b>. */
+int32_t
+netparam_get(netparam_t *param)
+{
+  const networkstatus_t *ns = networkstatus_get_latest_consensus();
+
+  /* The latest consensus can change without a new one arriving, if our
+   * choice of flavor changes. */
+  if (PREDICT_UNLIKELY(ns != compiled_ns))
+    netparams_compile(ns);
+  if (PREDICT_UNLIKELY(param->generation != netparams_generation)) {
+    netparam_register(param);
+    netparam_refresh(param);
+  }
+  return param->value;
+}
+
+/** Called when the latest consensus has changed to <b>ns</b>, or when its
+ * parameters have changed: recompile our table. */
+void
+netparams_consensus_changed(const networkstatus_t *ns)
+{
+  netparams_compile(ns);
+}
+
+/** Called when we are about to free <b>ns</b>: forget its parameters if
+ * they're in our table. */
+void
+netparams_consensus_freed(const networkstatus_t *ns)
+{
+  if (ns && ns == compiled_ns)
+    netparams_clear();
+}
+
+/** Release all storage held by the parameter table. */
+void
+netparams_free_all(void)
+{
+  netparams_clear();
+  if (registered_params) {
+    SMARTLIST_FOREACH(registered_params, netparam_t *, param,
+                      param->registered = 0);
+    smartlist_free(registered_params);
+  }
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file netparams.h
+ * \brief Header file for netparams.c.
+ **/
+
+#ifndef TOR_NETPARAMS_H
+#define TOR_NETPARAMS_H
+
+#include "lib/cc/torint.h"
+
+struct networkstatus_t;
+
+/** An integer consensus parameter that we look up often enough that we
+ * don't want to parse it out of the consensus each time.
+ *
+ * Declare one of these as a static variable with NETPARAM_INIT(), and read
+ * it with netparam_get().  The value comes from the latest consensus, and
+ * is clamped to lie between <b>min_val</b> and <b>max_val</b>. */
+typedef struct netparam_t {
+  /** The name of the parameter in the consensus. */
+  const char *name;
+  /** The value to use if the consensus doesn't set this parameter. */
+  int32_t default_val;
+  /** The smallest and largest values that we'll accept. */
+  int32_t min_val;
+  int32_t max_val;
+
+  /* These fields are private to netparams.c. */
+  /** Our value, as of the consensus parameters in <b>generation</b>. */
+  int32_t value;
+  /** The generation of consensus parameters that <b>value</b> is from, or
+   * 0 if we have never looked this parameter up. */
+  uint64_t generation;
+  /** True iff this parameter is on the list of registered parameters. */
+  unsigned int registered:1;
+} netparam_t;
+
+/** Initializer for a netparam_t. */
+#define NETPARAM_INIT(name, default_val, min_val, max_val)       \
+  { (name), (default_val), (min_val), (max_val), (default_val), 0, 0 }
+
+void netparam_register(netparam_t *param);
+int32_t netparam_get(netparam_t *param);
+
+void netparams_consensus_changed(const struct networkstatus_t *ns);
+void netparams_consensus_freed(const struct networkstatus_t *ns);
+void netparams_free_all(void);
+
+#endif /* !defined(TOR_NETPARAMS_H) */
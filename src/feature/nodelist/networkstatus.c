@@ -74,6 +74,7 @@
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/fmt_routerstatus.h"
 #include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/netparams.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
@@ -349,6 +350,8 @@ networkstatus_vote_free_(networkstatus_t *ns)
   if (!ns)
     return;
 
+  netparams_consensus_freed(ns);
+
   tor_free(ns->client_versions);
   tor_free(ns->server_versions);
   tor_free(ns->recommended_client_protocols);
@@ -1674,6 +1677,10 @@ notify_after_networkstatus_changes(void)
   const or_options_t *options = get_options();
   const time_t now = approx_time();
 
+  /* Recompile the parameter table first, so that every subsystem we notify
+   * below sees the new values. */
+  netparams_consensus_changed(c);
+
   scheduler_notify_networkstatus_changed();
 
   /* The "current" consensus has just been set and it is a usable flavor so
@@ -2774,6 +2781,7 @@ networkstatus_free_all(void)
       waiting->consensus = NULL;
     }
   }
+  netparams_free_all();
 }
 
 /** Return the start of the next interval of size <b>interval</b> (in
@@ -480,6 +480,107 @@ choose_array_element_by_weight(const uint64_t *entries, int n_entries)
                            entries, n_entries, total, rand_val);
 }
 
+/** Build and return a new alias table for choosing among <b>n</b> items,
+ * where item <b>i</b> has weight <b>weights</b>[i].  All weights must be
+ * nonnegative.
+ *
+ * We scale the weights to integers first, in the same way as
+ * choose_array_element_by_weight() does, and build the table with integer
+ * arithmetic, so that the probability of each item is exactly its scaled
+ * weight divided by the scaled total. */
+STATIC weighted_alias_table_t *
+weighted_alias_table_new(const double *weights, int n)
+{
+  weighted_alias_table_t *table;
+  double total_dbl = 0.0, scale_factor;
+  uint64_t total = 0;
+  int *small = NULL, *large = NULL;
+  int n_small = 0, n_large = 0;
+  int i;
+
+  tor_assert(n > 0);
+
+  table = tor_malloc_zero(sizeof(weighted_alias_table_t));
+  table->n = n;
+  table->prob = tor_calloc(n, sizeof(uint64_t));
+  table->alias = tor_calloc(n, sizeof(int));
+
+  for (i = 0; i < n; ++i)
+    total_dbl += weights[i];
+  if (!(total_dbl > 0.0))
+    return table;
+
+  /* Every column is n times as high as the average weight, so leave room
+   * for a factor of n. */
+  scale_factor = ((double)INT64_MAX) / total_dbl / n;
+  scale_factor /= 4.0; /* make sure we're very far away from overflowing */
+
+  for (i = 0; i < n; ++i) {
+    table->prob[i] = tor_llround(weights[i] * scale_factor);
+    total += table->prob[i];
+  }
+  if (total == 0)
+    return table;
+  table->total = total;
+
+  /* Vose's method: sort the columns into those that are shorter than the
+   * average, and those that aren't.  Then repeatedly top up a short column
+   * with weight taken from a tall one, until every column is full. */
+  small = tor_calloc(n, sizeof(int));
+  large = tor_calloc(n, sizeof(int));
+  for (i = 0; i < n; ++i) {
+    table->prob[i] *= n;
+    table->alias[i] = i;
+    if (table->prob[i] < total)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+  while (n_small && n_large) {
+    const int s = small[--n_small];
+    const int l = large[n_large-1];
+    table->alias[s] = l;
+    table->prob[l] -= total - table->prob[s];
+    if (table->prob[l] < total) {
+      --n_large;
+      small[n_small++] = l;
+    }
+  }
+  /* Whatever is left is exactly full. */
+  while (n_small)
+    table->prob[small[--n_small]] = total;
+  while (n_large)
+    table->prob[large[--n_large]] = total;
+
+  tor_free(small);
+  tor_free(large);
+  return table;
+}
+
+/** Choose an item from <b>table</b>, and return its index. */
+STATIC int
+weighted_alias_table_choose(const weighted_alias_table_t *table)
+{
+  const int i = crypto_rand_int(table->n);
+
+  if (table->total == 0)
+    return i;
+  if (crypto_rand_uint64(table->total) < table->prob[i])
+    return i;
+  return table->alias[i];
+}
+
+/** Release all storage held by <b>table</b>. */
+STATIC void
+weighted_alias_table_free_(weighted_alias_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->prob);
+  tor_free(table->alias);
+  tor_free(table);
+}
+
 /** Return bw*1000, unless bw*1000 would overflow, in which case return
  * INT32_MAX. */
 static inline int32_t
@@ -932,6 +1033,128 @@ nodelist_subtract(smartlist_t *sl, const smartlist_t *excluded)
   bitarray_free(excluded_idx);
 }
 
+/** A cached alias table over every node that router_can_choose_node()
+ * accepts for some set of flags, weighted by some rule. */
+typedef struct node_weight_cache_ent_t {
+  router_crn_flags_t flags;
+  bandwidth_weight_rule_t rule;
+  /** The nodes that we can choose, in the order of the table's items. */
+  smartlist_t *nodes;
+  /** An alias table for choosing among <b>nodes</b>, or NULL if there are
+   * no nodes. */
+  weighted_alias_table_t *table;
+} node_weight_cache_ent_t;
+
+/** A list of node_weight_cache_ent_t, one for each combination of flags and
+ * weighting rule that router_choose_random_node() has been asked about since
+ * the last time our directory information changed. */
+STATIC smartlist_t *node_weight_cache = NULL;
+
+/** How many times will we draw from a cached alias table, looking for a node
+ * that isn't excluded, before we give up and do things the slow way? */
+#define MAX_ALIAS_TABLE_TRIES 32
+
+/** Called when anything that affects our choice of nodes changes: our
+ * consensus, our descriptors, our view of which nodes are running, or our
+ * options.  Forget every cached alias table. */
+void
+node_select_invalidate_cache(void)
+{
+  if (!node_weight_cache)
+    return;
+  SMARTLIST_FOREACH_BEGIN(node_weight_cache, node_weight_cache_ent_t *, ent) {
+    smartlist_free(ent->nodes);
+    weighted_alias_table_free(ent->table);
+    tor_free(ent);
+  } SMARTLIST_FOREACH_END(ent);
+  smartlist_free(node_weight_cache);
+}
+
+/** Return the cached alias table entry for <b>flags</b> and <b>rule</b>,
+ * building it if we don't have one. */
+static const node_weight_cache_ent_t *
+node_weight_cache_get(router_crn_flags_t flags, bandwidth_weight_rule_t rule)
+{
+  node_weight_cache_ent_t *ent;
+  double *bandwidths = NULL;
+
+  if (!node_weight_cache)
+    node_weight_cache = smartlist_new();
+  SMARTLIST_FOREACH(node_weight_cache, node_weight_cache_ent_t *, e,
+                    if (e->flags == flags && e->rule == rule) return e);
+
+  ent = tor_malloc_zero(sizeof(node_weight_cache_ent_t));
+  ent->flags = flags;
+  ent->rule = rule;
+  ent->nodes = smartlist_new();
+  router_add_running_nodes_to_smartlist(ent->nodes, flags);
+  if (compute_weighted_bandwidths(ent->nodes, rule, &bandwidths, NULL) == 0)
+    ent->table = weighted_alias_table_new(bandwidths,
+                                          smartlist_len(ent->nodes));
+  tor_free(bandwidths);
+  smartlist_add(node_weight_cache, ent);
+  return ent;
+}
+
+/** Fast path for router_choose_random_node_helper(): choose a node from the
+ * cached alias table for <b>flags</b> and <b>rule</b>, drawing again
+ * whenever we get a node that we need to exclude.
+ *
+ * Since every draw that we keep is weighted just as in
+ * node_sl_choose_by_bandwidth(), the result has the same distribution as
+ * if we had built the list of candidates and chosen among them.
+ *
+ * Return NULL if we can't find a node this way: the caller should then do
+ * it the slow way. */
+static const node_t *
+router_choose_random_node_from_cache(const smartlist_t *excludednodes,
+                                     routerset_t *excludedset,
+                                     router_crn_flags_t flags,
+                                     bandwidth_weight_rule_t rule)
+{
+  const node_weight_cache_ent_t *ent = node_weight_cache_get(flags, rule);
+  const smartlist_t *nodelist = nodelist_get_list();
+  const int nodelist_len = smartlist_len(nodelist);
+  bitarray_t *excluded_idx = NULL;
+  const node_t *choice = NULL;
+  int i;
+
+  if (!ent->table)
+    return NULL;
+
+  excluded_idx = bitarray_init_zero(nodelist_len);
+  SMARTLIST_FOREACH_BEGIN(excludednodes, const node_t *, node) {
+    const int idx = node->nodelist_idx;
+    if (idx < 0 || idx >= nodelist_len ||
+        node != smartlist_get(nodelist, idx)) {
+      /* Let nodelist_subtract() sort this out. */
+      goto done;
+    }
+    bitarray_set(excluded_idx, idx);
+  } SMARTLIST_FOREACH_END(node);
+
+  for (i = 0; i < MAX_ALIAS_TABLE_TRIES; ++i) {
+    const int item = weighted_alias_table_choose(ent->table);
+    const node_t *node = smartlist_get(ent->nodes, item);
+    const int idx = node->nodelist_idx;
+    if (BUG(idx < 0 || idx >= nodelist_len))
+      break;
+    if (bitarray_is_set(excluded_idx, idx))
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, node))
+      continue;
+    /* In case something changed without telling us. */
+    if (!router_can_choose_node(node, flags))
+      continue;
+    choice = node;
+    break;
+  }
+
+ done:
+  bitarray_free(excluded_idx);
+  return choice;
+}
+
 /* Node selection helper for router_choose_random_node().
  *
  * Populates a node list based on <b>flags</b>, ignoring nodes in
@@ -943,9 +1166,15 @@ router_choose_random_node_helper(smartlist_t *excludednodes,
                                  router_crn_flags_t flags,
                                  bandwidth_weight_rule_t rule)
 {
-  smartlist_t *sl=smartlist_new();
-  const node_t *choice = NULL;
+  smartlist_t *sl;
+  const node_t *choice;
+
+  choice = router_choose_random_node_from_cache(excludednodes, excludedset,
+                                                flags, rule);
+  if (choice)
+    return choice;
 
+  sl = smartlist_new();
   router_add_running_nodes_to_smartlist(sl, flags);
   log_debug(LD_CIRC,
            "We found %d running nodes.",
@@ -86,6 +86,8 @@ const node_t *router_choose_random_node(smartlist_t *excludedsmartlist,
                                         struct routerset_t *excludedset,
                                         router_crn_flags_t flags);
 
+void node_select_invalidate_cache(void);
+
 const routerstatus_t *router_pick_trusteddirserver(dirinfo_type_t type,
                                                    int flags);
 const routerstatus_t *router_pick_fallback_dirserver(dirinfo_type_t type,
@@ -103,6 +105,35 @@ STATIC const routerstatus_t *router_pick_directory_server_impl(
                                            int *n_busy_out);
 STATIC int router_is_already_dir_fetching(const tor_addr_port_t *ap,
                                           int serverdesc, int microdesc);
+
+/** A table for choosing among <b>n</b> items in constant time, each with a
+ * probability proportional to its weight, using Walker's alias method.
+ *
+ * To choose, we pick a column <b>i</b> uniformly at random, and then choose
+ * item <b>i</b> with probability prob[i]/total, or item alias[i] otherwise.
+ * If <b>total</b> is 0, every item had zero weight, and we choose uniformly.
+ */
+typedef struct weighted_alias_table_t {
+  /** The number of items. */
+  int n;
+  /** The height of every column. */
+  uint64_t total;
+  /** For each column, the part of its height that belongs to its own item. */
+  uint64_t *prob;
+  /** For each column, the item that owns the rest of its height. */
+  int *alias;
+} weighted_alias_table_t;
+
+STATIC weighted_alias_table_t *weighted_alias_table_new(const double *weights,
+                                                        int n);
+STATIC int weighted_alias_table_choose(const weighted_alias_table_t *table);
+STATIC void weighted_alias_table_free_(weighted_alias_table_t *table);
+#define weighted_alias_table_free(table) \
+  FREE_AND_NULL(weighted_alias_table_t, weighted_alias_table_free_, (table))
+
+#ifdef TOR_UNIT_TESTS
+extern smartlist_t *node_weight_cache;
+#endif
 #endif /* defined(NODE_SELECT_PRIVATE) */
 
 #endif /* !defined(TOR_NODE_SELECT_H) */
@@ -777,6 +777,8 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp->nodelist_idx = idx;
   }
   node->nodelist_idx = -1;
+  /* Our cached alias tables may point to this node. */
+  node_select_invalidate_cache();
 }
 
 /** Return a newly allocated smartlist of the nodes that have <b>md</b> as
@@ -847,6 +849,8 @@ nodelist_free_all(void)
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
+  node_select_invalidate_cache();
+
   HT_CLEAR(nodelist_map, &the_nodelist->nodes_by_id);
   HT_CLEAR(nodelist_ed_map, &the_nodelist->nodes_by_ed_id);
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
@@ -1124,7 +1128,7 @@ node_ed25519_id_matches(const node_t *node, const ed25519_public_key_t *id)
 /** Dummy object that should be unreturnable.  Used to ensure that
  * node_get_protover_summary_flags() always returns non-NULL. */
 static const protover_summary_flags_t zero_protover_flags = {
-  0,0,0,0,0,0,0,0,0,0,0,0
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0
 };
 
 /** Return the protover_summary_flags for a given node. */
@@ -1210,6 +1214,27 @@ node_supports_establish_intro_dos_extension(const node_t *node)
                            supports_establish_intro_dos_extension;
 }
 
+/** Return true iff <b>node</b> can negotiate congestion control on circuits
+ * that exit from it (DelayCC=1). */
+bool
+node_supports_congestion_control(const node_t *node)
+{
+  tor_assert(node);
+
+  return node_get_protover_summary_flags(node)->
+                           supports_congestion_control;
+}
+
+/** Return true iff <b>node</b> can link several circuits that exit from it
+ * into a multipath set (Multipath=1). */
+bool
+node_supports_multipath(const node_t *node)
+{
+  tor_assert(node);
+
+  return node_get_protover_summary_flags(node)->supports_multipath;
+}
+
 /** Return true iff <b>node</b> can initiate IPv6 extends (Relay=3).
  *
  * This check should only be performed by client path selection code.
@@ -2389,6 +2414,7 @@ void
 router_dir_info_changed(void)
 {
   need_to_update_have_min_dir_info = 1;
+  node_select_invalidate_cache();
   rend_hsdir_routers_changed();
   hs_service_dir_info_changed();
   hs_client_dir_info_changed();
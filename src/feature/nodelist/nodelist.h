@@ -79,6 +79,8 @@ bool node_supports_v3_hsdir(const node_t *node);
 bool node_supports_ed25519_hs_intro(const node_t *node);
 bool node_supports_v3_rendezvous_point(const node_t *node);
 bool node_supports_establish_intro_dos_extension(const node_t *node);
+bool node_supports_congestion_control(const node_t *node);
+bool node_supports_multipath(const node_t *node);
 bool node_supports_initiating_ipv6_extends(const node_t *node);
 bool node_supports_accepting_ipv6_extends(const node_t *node,
                                           bool need_canonical_ipv6_conn);
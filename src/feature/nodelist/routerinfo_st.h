@@ -58,6 +58,9 @@ struct routerinfo_t {
   uint32_t bandwidthcapacity;
   smartlist_t *exit_policy; /**< What streams will this OR permit
                              * to exit on IPv4?  NULL for 'reject *:*'. */
+  /** A compiled copy of <b>exit_policy</b>, built the first time we need
+   * it. */
+  struct addr_policy_compiled_t *compiled_exit_policy;
   /** What streams will this OR permit to exit on IPv6?
    * NULL for 'reject *:*' */
   struct short_policy_t *ipv6_exit_policy;
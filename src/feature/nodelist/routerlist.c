@@ -66,6 +66,7 @@
 #include "core/mainloop/connection.h"
 #include "core/mainloop/mainloop.h"
 #include "core/or/policies.h"
+#include "core/or/policy_compile.h"
 #include "feature/client/bridges.h"
 #include "feature/control/control_events.h"
 #include "feature/dirauth/authmode.h"
@@ -937,6 +938,7 @@ routerinfo_free_(routerinfo_t *router)
     smartlist_free(router->declared_family);
   }
   addr_policy_list_free(router->exit_policy);
+  addr_policy_compiled_free(router->compiled_exit_policy);
   short_policy_free(router->ipv6_exit_policy);
 
   memset(router, 77, sizeof(routerinfo_t));
@@ -128,6 +128,12 @@ static uint64_t n_ipv6_timeouts = 0;
 /** Global: Do we think that IPv6 DNS is broken? */
 static int dns_is_broken_for_ipv6 = 0;
 
+/** How many lookups in dns_resolve_impl() have found a cached answer, found
+ * a resolve already in progress, or found nothing, respectively? */
+static uint64_t dns_n_cache_hits = 0;
+static uint64_t dns_n_cache_pending = 0;
+static uint64_t dns_n_cache_misses = 0;
+
 /** Function to compare hashed resolves on their addresses; used to
  * implement hash tables. */
 static inline int
@@ -782,6 +788,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
   if (resolve && resolve->expire > now) { /* already there */
     switch (resolve->state) {
       case CACHE_STATE_PENDING:
+        ++dns_n_cache_pending;
         /* add us to the pending list */
         pending_connection = tor_malloc_zero(
                                       sizeof(pending_connection_t));
@@ -794,6 +801,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
                   escaped_safe_str(exitconn->base_.address));
         return 0;
       case CACHE_STATE_CACHED:
+        ++dns_n_cache_hits;
         log_debug(LD_EXIT,"Connection (fd "TOR_SOCKET_T_FORMAT") found "
                   "cached answer for %s",
                   exitconn->base_.s,
@@ -810,6 +818,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
   }
   tor_assert(!resolve);
   /* not there, need to add it */
+  ++dns_n_cache_misses;
   resolve = tor_malloc_zero(sizeof(cached_resolve_t));
   resolve->magic = CACHED_RESOLVE_MAGIC;
   resolve->state = CACHE_STATE_PENDING;
@@ -2116,6 +2125,23 @@ dns_cache_entry_count(void)
    return HT_SIZE(&cache_root);
 }
 
+/** Set each of the non-NULL arguments to the corresponding count of lookups
+ * in the DNS cache, and set *<b>n_entries_out</b> to the number of entries
+ * now in the cache. */
+void
+dns_cache_get_stats(uint64_t *n_hits_out, uint64_t *n_pending_out,
+                    uint64_t *n_misses_out, uint64_t *n_entries_out)
+{
+  if (n_hits_out)
+    *n_hits_out = dns_n_cache_hits;
+  if (n_pending_out)
+    *n_pending_out = dns_n_cache_pending;
+  if (n_misses_out)
+    *n_misses_out = dns_n_cache_misses;
+  if (n_entries_out)
+    *n_entries_out = dns_cache_entry_count();
+}
+
 /* Return the total size in bytes of the DNS cache. */
 size_t
 dns_cache_total_allocation(void)
@@ -26,6 +26,8 @@ void dns_reset_correctness_checks(void);
 size_t dns_cache_total_allocation(void);
 void dump_dns_mem_usage(int severity);
 size_t dns_cache_handle_oom(time_t now, size_t min_remove_bytes);
+void dns_cache_get_stats(uint64_t *n_hits_out, uint64_t *n_pending_out,
+                         uint64_t *n_misses_out, uint64_t *n_entries_out);
 
 /* These functions are only used within the feature/relay module, and don't
  * need stubs. */
@@ -54,6 +56,19 @@ void dns_launch_correctness_checks(void);
   tor_assert_nonfatal_unreached();  \
   STMT_END
 
+static inline void
+dns_cache_get_stats(uint64_t *n_hits_out, uint64_t *n_pending_out,
+                    uint64_t *n_misses_out, uint64_t *n_entries_out)
+{
+  if (n_hits_out)
+    *n_hits_out = 0;
+  if (n_pending_out)
+    *n_pending_out = 0;
+  if (n_misses_out)
+    *n_misses_out = 0;
+  if (n_entries_out)
+    *n_entries_out = 0;
+}
 static inline int
 dns_reset(void)
 {
@@ -21,6 +21,10 @@
  *      them to worker threads.
  *   <li>Expiring onionskins on the relay side if they have waited for
  *     too long.
+ *   <li>Shedding load under sustained overload, using a CoDel-style
+ *     controller on the time each onionskin spends on the queue.
+ *   <li>Keeping a histogram of how long processed onionskins waited, for
+ *     the heartbeat.
  * </ul>
  **/
 
@@ -32,7 +36,11 @@
 #include "core/mainloop/cpuworker.h"
 #include "core/or/circuitlist.h"
 #include "core/or/onion.h"
-#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/netparams.h"
+#include "lib/intmath/bits.h"
+#include "lib/time/compat_time.h"
+
+#include <math.h>
 
 #include "core/or/or_circuit_st.h"
 
@@ -43,12 +51,32 @@ typedef struct onion_queue_t {
   or_circuit_t *circ;
   uint16_t handshake_type;
   create_cell_t *onionskin;
-  time_t when_added;
+  /** Coarse monotonic time, in usec, at which this entry was queued. */
+  uint64_t when_added_usec;
 } onion_queue_t;
 
 /** 5 seconds on the onion queue til we just send back a destroy */
 #define ONIONQUEUE_WAIT_CUTOFF 5
 
+/** State for the CoDel-style controller that sheds load from one onion
+ * queue.  See RFC 8289: while the time that the head of the queue has
+ * waited stays above a target delay for a full interval, we start dropping
+ * entries from the head, and drop faster for as long as it stays there. */
+typedef struct onion_queue_codel_t {
+  /** If nonzero, the time (in usec) at which the head of the queue will
+   * have been above the target delay for a full interval. Zero if the
+   * delay was below target the last time we looked. */
+  uint64_t first_above_usec;
+  /** While dropping, the time (in usec) at which we next drop an entry. */
+  uint64_t drop_next_usec;
+  /** Number of entries dropped since we entered the dropping state. */
+  unsigned count;
+  /** Value of <b>count</b> when we last entered the dropping state. */
+  unsigned lastcount;
+  /** True iff we are currently in the dropping state. */
+  unsigned dropping : 1;
+} onion_queue_codel_t;
+
 TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t);
 typedef struct onion_queue_head_t onion_queue_head_t;
 
@@ -63,8 +91,29 @@ static onion_queue_head_t ol_list[MAX_ONION_HANDSHAKE_TYPE+1] =
 /** Number of entries of each type currently in each element of ol_list[]. */
 static int ol_entries[MAX_ONION_HANDSHAKE_TYPE+1];
 
+/** CoDel state for each element of ol_list[]. */
+static onion_queue_codel_t ol_codel[MAX_ONION_HANDSHAKE_TYPE+1];
+
+/** Histogram of how long the onionskins that we handed to cpuworkers spent
+ * on the queue. Bucket 0 counts delays under 1 msec; bucket i counts delays
+ * in [2^(i-1), 2^i) msec; the last bucket also counts everything longer. */
+static uint64_t ol_delay_hist[ONION_QUEUE_DELAY_N_BUCKETS];
+/** As ol_delay_hist[], but never reset except at shutdown. */
+static uint64_t ol_delay_hist_total[ONION_QUEUE_DELAY_N_BUCKETS];
+/** Total time, in usec, that the onionskins counted in ol_delay_hist_total[]
+ * spent on the queue. */
+static uint64_t ol_delay_usec_total;
+
+/** Number of onionskins we have dropped from the queue because of overload
+ * since the last time we logged our delay statistics. */
+static uint64_t ol_n_dropped;
+/** Number of onionskins we have dropped from the queue because of overload
+ * since we started. */
+static uint64_t ol_n_dropped_total;
+
 static int num_ntors_per_tap(void);
 static void onion_queue_entry_remove(onion_queue_t *victim);
+static void onion_queue_entry_drop(onion_queue_t *victim);
 
 /* XXXX Check lengths vs MAX_ONIONSKIN_{CHALLENGE,REPLY}_LEN.
  *
@@ -142,7 +191,7 @@ int
 onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 {
   onion_queue_t *tmp;
-  time_t now = time(NULL);
+  const uint64_t now_usec = monotime_coarse_absolute_usec();
 
   if (onionskin->handshake_type > MAX_ONION_HANDSHAKE_TYPE) {
     /* LCOV_EXCL_START
@@ -157,7 +206,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   tmp->circ = circ;
   tmp->handshake_type = onionskin->handshake_type;
   tmp->onionskin = onionskin;
-  tmp->when_added = now;
+  tmp->when_added_usec = now_usec;
 
   if (!have_room_for_onionskin(onionskin->handshake_type)) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
@@ -189,21 +238,67 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   /* cull elderly requests. */
   while (1) {
     onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[onionskin->handshake_type]);
-    if (now - head->when_added < (time_t)ONIONQUEUE_WAIT_CUTOFF)
+    if (now_usec - head->when_added_usec <
+        (uint64_t)ONIONQUEUE_WAIT_CUTOFF * 1000000)
       break;
 
-    circ = head->circ;
-    circ->onionqueue_entry = NULL;
-    onion_queue_entry_remove(head);
     log_info(LD_CIRC,
              "Circuit create request is too old; canceling due to overload.");
-    if (! TO_CIRCUIT(circ)->marked_for_close) {
-      circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
-    }
+    onion_queue_entry_drop(head);
   }
   return 0;
 }
 
+/** Remove <b>victim</b> from its queue because we are overloaded, and close
+ * its circuit, sending a DESTROY cell back to the client. */
+static void
+onion_queue_entry_drop(onion_queue_t *victim)
+{
+  or_circuit_t *circ = victim->circ;
+
+  circ->onionqueue_entry = NULL;
+  onion_queue_entry_remove(victim);
+  ++ol_n_dropped;
+  ++ol_n_dropped_total;
+  if (! TO_CIRCUIT(circ)->marked_for_close) {
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+  }
+}
+
+/** Return the target queueing delay, in usec, for the CoDel controller on
+ * the onion queues. Zero means that the controller is disabled. */
+static uint64_t
+get_onion_queue_target_usec(void)
+{
+#define DEFAULT_ONION_QUEUE_TARGET_DELAY_MSEC 100
+#define MIN_ONION_QUEUE_TARGET_DELAY_MSEC 0
+#define MAX_ONION_QUEUE_TARGET_DELAY_MSEC 60000
+
+  static netparam_t target_delay =
+    NETPARAM_INIT("OnionQueueTargetDelay",
+                  DEFAULT_ONION_QUEUE_TARGET_DELAY_MSEC,
+                  MIN_ONION_QUEUE_TARGET_DELAY_MSEC,
+                  MAX_ONION_QUEUE_TARGET_DELAY_MSEC);
+  return (uint64_t)netparam_get(&target_delay) * 1000;
+}
+
+/** Return the interval, in usec, for which the onion queue delay must stay
+ * above its target before the CoDel controller starts dropping. */
+static uint64_t
+get_onion_queue_interval_usec(void)
+{
+#define DEFAULT_ONION_QUEUE_DROP_INTERVAL_MSEC 1000
+#define MIN_ONION_QUEUE_DROP_INTERVAL_MSEC 1
+#define MAX_ONION_QUEUE_DROP_INTERVAL_MSEC 600000
+
+  static netparam_t drop_interval =
+    NETPARAM_INIT("OnionQueueDropInterval",
+                  DEFAULT_ONION_QUEUE_DROP_INTERVAL_MSEC,
+                  MIN_ONION_QUEUE_DROP_INTERVAL_MSEC,
+                  MAX_ONION_QUEUE_DROP_INTERVAL_MSEC);
+  return (uint64_t)netparam_get(&drop_interval) * 1000;
+}
+
 /** Return a fairness parameter, to prefer processing NTOR style
  * handshakes but still slowly drain the TAP queue so we don't starve
  * it entirely. */
@@ -214,10 +309,10 @@ num_ntors_per_tap(void)
 #define MIN_NUM_NTORS_PER_TAP 1
 #define MAX_NUM_NTORS_PER_TAP 100000
 
-  int result = networkstatus_get_param(NULL, "NumNTorsPerTAP",
-                                       DEFAULT_NUM_NTORS_PER_TAP,
-                                       MIN_NUM_NTORS_PER_TAP,
-                                       MAX_NUM_NTORS_PER_TAP);
+  static netparam_t ntors_per_tap =
+    NETPARAM_INIT("NumNTorsPerTAP", DEFAULT_NUM_NTORS_PER_TAP,
+                  MIN_NUM_NTORS_PER_TAP, MAX_NUM_NTORS_PER_TAP);
+  int result = netparam_get(&ntors_per_tap);
   tor_assert(result > 0);
   return result;
 }
@@ -262,6 +357,128 @@ decide_next_handshake_type(void)
   return ONION_HANDSHAKE_TYPE_TAP;
 }
 
+/** Return the time at which the CoDel controller should next drop an entry,
+ * given that it last dropped (or started dropping) at <b>t</b>, has dropped
+ * <b>count</b> entries so far, and uses the interval <b>interval</b>. */
+static uint64_t
+onion_queue_codel_control_law(uint64_t t, uint64_t interval, unsigned count)
+{
+  return t + (uint64_t)(interval / sqrt((double)count));
+}
+
+/** Look at <b>head</b>, the first entry on the onion queue for
+ * <b>type</b> (or NULL if that queue is empty), at time <b>now_usec</b>,
+ * and update the CoDel state for that queue. Return true iff the queue
+ * delay has been above <b>target</b> for at least <b>interval</b>, so that
+ * we may drop <b>head</b>. */
+static int
+onion_queue_codel_ok_to_drop(uint16_t type, const onion_queue_t *head,
+                             uint64_t now_usec,
+                             uint64_t target, uint64_t interval)
+{
+  onion_queue_codel_t *codel = &ol_codel[type];
+  uint64_t sojourn;
+
+  if (!head) {
+    codel->first_above_usec = 0;
+    return 0;
+  }
+  sojourn = now_usec > head->when_added_usec ?
+    now_usec - head->when_added_usec : 0;
+
+  /* Never drop the last entry: if we've caught up that far, the queue is
+   * not what is making it wait. */
+  if (sojourn < target || ol_entries[type] <= 1) {
+    codel->first_above_usec = 0;
+    return 0;
+  }
+  if (codel->first_above_usec == 0) {
+    codel->first_above_usec = now_usec + interval;
+    return 0;
+  }
+  return now_usec >= codel->first_above_usec;
+}
+
+/** Return the first entry on the onion queue for <b>type</b> that we should
+ * process at time <b>now_usec</b>, or NULL if there is none. Before
+ * returning, drop entries from the head of the queue as the CoDel
+ * controller tells us to. */
+static onion_queue_t *
+onion_queue_codel_head(uint16_t type, uint64_t now_usec)
+{
+  onion_queue_codel_t *codel = &ol_codel[type];
+  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[type]);
+  const uint64_t target = get_onion_queue_target_usec();
+  uint64_t interval;
+  int ok_to_drop;
+
+  if (target == 0 || !head) {
+    codel->first_above_usec = 0;
+    codel->dropping = 0;
+    return head;
+  }
+
+  interval = get_onion_queue_interval_usec();
+  ok_to_drop = onion_queue_codel_ok_to_drop(type, head, now_usec,
+                                            target, interval);
+  if (codel->dropping) {
+    if (!ok_to_drop)
+      codel->dropping = 0;
+    while (codel->dropping && now_usec >= codel->drop_next_usec) {
+      log_info(LD_CIRC, "Onion queue delay has stayed above target; "
+               "canceling circuit create request due to overload.");
+      onion_queue_entry_drop(head);
+      ++codel->count;
+      head = TOR_TAILQ_FIRST(&ol_list[type]);
+      if (!onion_queue_codel_ok_to_drop(type, head, now_usec,
+                                        target, interval)) {
+        codel->dropping = 0;
+      } else {
+        codel->drop_next_usec =
+          onion_queue_codel_control_law(codel->drop_next_usec, interval,
+                                        codel->count);
+      }
+    }
+  } else if (ok_to_drop) {
+    unsigned delta;
+    log_info(LD_CIRC, "Onion queue delay has been above target for too "
+             "long; canceling circuit create request due to overload.");
+    onion_queue_entry_drop(head);
+    head = TOR_TAILQ_FIRST(&ol_list[type]);
+    (void) onion_queue_codel_ok_to_drop(type, head, now_usec,
+                                        target, interval);
+    codel->dropping = 1;
+    /* If we were dropping recently, start from close to the drop rate that
+     * was working last time, rather than from scratch. */
+    delta = codel->count - codel->lastcount;
+    if (delta > 1 &&
+        (int64_t)(now_usec - codel->drop_next_usec) < 16 * (int64_t)interval)
+      codel->count = delta;
+    else
+      codel->count = 1;
+    codel->drop_next_usec =
+      onion_queue_codel_control_law(now_usec, interval, codel->count);
+    codel->lastcount = codel->count;
+  }
+  return head;
+}
+
+/** Record that an onionskin waited <b>usec</b> microseconds on the queue
+ * before we handed it to a cpuworker. */
+static void
+onion_queue_note_delay(uint64_t usec)
+{
+  /* Round up, so that each bucket's bound is inclusive, as the MetricsPort
+   * reports it. */
+  const uint64_t msec = (usec + 999) / 1000;
+  int bucket = msec > 1 ? tor_log2(msec - 1) + 1 : 0;
+  if (bucket >= ONION_QUEUE_DELAY_N_BUCKETS)
+    bucket = ONION_QUEUE_DELAY_N_BUCKETS - 1;
+  ++ol_delay_hist[bucket];
+  ++ol_delay_hist_total[bucket];
+  ol_delay_usec_total += usec;
+}
+
 /** Remove the highest priority item from ol_list[] and return it, or
  * return NULL if the lists are empty.
  */
@@ -269,8 +486,16 @@ or_circuit_t *
 onion_next_task(create_cell_t **onionskin_out)
 {
   or_circuit_t *circ;
-  uint16_t handshake_to_choose = decide_next_handshake_type();
-  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
+  const uint64_t now_usec = monotime_coarse_absolute_usec();
+  onion_queue_t *head;
+
+  do {
+    uint16_t handshake_to_choose = decide_next_handshake_type();
+    head = onion_queue_codel_head(handshake_to_choose, now_usec);
+    /* If we emptied the queue we picked, the other one may still have
+     * something for us. */
+  } while (!head && (ol_entries[ONION_HANDSHAKE_TYPE_NTOR] ||
+                     ol_entries[ONION_HANDSHAKE_TYPE_TAP]));
 
   if (!head)
     return NULL; /* no onions pending, we're done */
@@ -287,6 +512,8 @@ onion_next_task(create_cell_t **onionskin_out)
     head->handshake_type == ONION_HANDSHAKE_TYPE_NTOR ? "ntor" : "tap",
     ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
     ol_entries[ONION_HANDSHAKE_TYPE_TAP]);
+  onion_queue_note_delay(now_usec > head->when_added_usec ?
+                         now_usec - head->when_added_usec : 0);
 
   *onionskin_out = head->onionskin;
   head->onionskin = NULL; /* prevent free. */
@@ -362,4 +589,93 @@ clear_pending_onions(void)
     tor_assert(TOR_TAILQ_EMPTY(&ol_list[i]));
   }
   memset(ol_entries, 0, sizeof(ol_entries));
+  memset(ol_codel, 0, sizeof(ol_codel));
+  memset(ol_delay_hist, 0, sizeof(ol_delay_hist));
+  memset(ol_delay_hist_total, 0, sizeof(ol_delay_hist_total));
+  ol_delay_usec_total = 0;
+  ol_n_dropped = 0;
+  ol_n_dropped_total = 0;
+}
+
+/** Return an upper bound, in msec, on the <b>pct</b>th percentile of the
+ * time that onionskins spent on the queue since we last logged our delay
+ * statistics. Return 0 if we have not processed any onionskins since
+ * then. */
+uint64_t
+onion_queue_get_delay_percentile_msec(unsigned pct)
+{
+  uint64_t total = 0, seen = 0, want;
+  int i;
+
+  for (i = 0; i < ONION_QUEUE_DELAY_N_BUCKETS; ++i)
+    total += ol_delay_hist[i];
+  if (total == 0)
+    return 0;
+
+  want = (total * pct + 99) / 100;
+  if (want < 1)
+    want = 1;
+  for (i = 0; i < ONION_QUEUE_DELAY_N_BUCKETS - 1; ++i) {
+    seen += ol_delay_hist[i];
+    if (seen >= want)
+      break;
+  }
+  return UINT64_C(1) << i;
+}
+
+/** Return the number of onionskins we have dropped because of overload
+ * since we last logged our delay statistics. */
+uint64_t
+onion_queue_get_n_dropped(void)
+{
+  return ol_n_dropped;
+}
+
+/** Copy into <b>hist_out</b>, which must have room for
+ * ONION_QUEUE_DELAY_N_BUCKETS elements, a histogram of how long every
+ * onionskin that we have handed to a cpuworker spent on the queue, and set
+ * *<b>sum_usec_out</b> to the total of those delays.  The buckets are as for
+ * ol_delay_hist[]. */
+void
+onion_queue_get_total_delay_hist(uint64_t *hist_out, uint64_t *sum_usec_out)
+{
+  memcpy(hist_out, ol_delay_hist_total, sizeof(ol_delay_hist_total));
+  *sum_usec_out = ol_delay_usec_total;
+}
+
+/** Return the number of onionskins we have dropped because of overload
+ * since we started. */
+uint64_t
+onion_queue_get_total_dropped(void)
+{
+  return ol_n_dropped_total;
+}
+
+/** Log the onion queue delay statistics since the last time we were
+ * called, and reset them.  Log nothing if we haven't processed or dropped
+ * any onionskins since then. */
+void
+onion_queue_log_delay_stats(void)
+{
+  uint64_t total = 0;
+  int i;
+
+  for (i = 0; i < ONION_QUEUE_DELAY_N_BUCKETS; ++i)
+    total += ol_delay_hist[i];
+
+  if (total == 0 && ol_n_dropped == 0)
+    return;
+
+  log_notice(LD_HEARTBEAT, "Onion queue delay since last time: "
+             "%"PRIu64" processed, median <=%"PRIu64" msec, "
+             "90th percentile <=%"PRIu64" msec, 99th percentile "
+             "<=%"PRIu64" msec; %"PRIu64" dropped due to overload.",
+             total,
+             onion_queue_get_delay_percentile_msec(50),
+             onion_queue_get_delay_percentile_msec(90),
+             onion_queue_get_delay_percentile_msec(99),
+             ol_n_dropped);
+
+  memset(ol_delay_hist, 0, sizeof(ol_delay_hist));
+  ol_n_dropped = 0;
 }
@@ -14,10 +14,23 @@
 
 struct create_cell_t;
 
+/** Number of buckets in our histograms of onion queue delay: bucket 0
+ * counts delays of at most 1 msec; bucket i counts delays of more than
+ * 2^(i-1) and at most 2^i msec; the last bucket also counts everything
+ * longer. */
+#define ONION_QUEUE_DELAY_N_BUCKETS 16
+
 int onion_pending_add(or_circuit_t *circ, struct create_cell_t *onionskin);
 or_circuit_t *onion_next_task(struct create_cell_t **onionskin_out);
 int onion_num_pending(uint16_t handshake_type);
 void onion_pending_remove(or_circuit_t *circ);
 void clear_pending_onions(void);
 
+uint64_t onion_queue_get_delay_percentile_msec(unsigned pct);
+uint64_t onion_queue_get_n_dropped(void);
+void onion_queue_get_total_delay_hist(uint64_t *hist_out,
+                                      uint64_t *sum_usec_out);
+uint64_t onion_queue_get_total_dropped(void);
+void onion_queue_log_delay_stats(void);
+
 #endif /* !defined(TOR_ONION_QUEUE_H) */
@@ -125,24 +125,106 @@ chunk_repack(chunk_t *chunk)
 
 /** Keep track of total size of allocated chunks for consistency asserts */
 static size_t total_bytes_allocated_in_chunks = 0;
-static void
+/** Total size of all the chunks sitting on freelists. */
+static size_t total_bytes_in_freelists = 0;
+
+/** A freelist of chunks, all with the same allocation size. */
+typedef struct chunk_freelist_t {
+  size_t alloc_size; /**< What size chunks does this freelist hold? */
+  int max_length; /**< Never allow more than this number of chunks in the
+                   * freelist. */
+  int cur_length; /**< How many chunks on the freelist now? */
+  int lowest_length; /**< What's the smallest value of cur_length since the
+                      * last time we cleaned this freelist? */
+  uint64_t n_alloc; /**< How many chunks have we allocated of this size from
+                     * the system? */
+  uint64_t n_free; /**< How many chunks of this size have we given back to
+                    * the system? */
+  uint64_t n_hit; /**< How many allocations have we served from this
+                   * freelist? */
+  chunk_t *head; /**< First chunk on the freelist. */
+} chunk_freelist_t;
+
+/** Macro to help define freelists. */
+#define FL(a) { a, BUF_FREELIST_DEFAULT_MAX_BYTES / (a), 0, 0, 0, 0, 0, NULL }
+
+/** Static array of freelists, sorted by alloc_len, terminated by an entry
+ * with alloc_size of 0.  These are the sizes that buf_new() and
+ * buf_preferred_chunk_size() hand out most often. */
+static chunk_freelist_t freelists[] = {
+  FL(4096), FL(8192), FL(16384), FL(32768), FL(65536),
+  { 0, 0, 0, 0, 0, 0, 0, NULL }
+};
+#undef FL
+
+/** Return the freelist to hold chunks of size <b>alloc</b>, or NULL if
+ * no freelist exists for that size. */
+static inline chunk_freelist_t *
+get_freelist(size_t alloc)
+{
+  int i;
+  for (i=0; (freelists[i].alloc_size <= alloc &&
+             freelists[i].alloc_size); ++i ) {
+    if (freelists[i].alloc_size == alloc) {
+      return &freelists[i];
+    }
+  }
+  return NULL;
+}
+
+/** Release <b>chunk</b>, which must not be on any buffer's list of
+ * chunks.  If there is room for it on the freelist for its size, put it
+ * there; otherwise give it back to the system. */
+void
 buf_chunk_free_unchecked(chunk_t *chunk)
 {
+  size_t alloc;
+  chunk_freelist_t *freelist;
   if (!chunk)
     return;
+  alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
-  tor_assert(CHUNK_ALLOC_SIZE(chunk->memlen) == chunk->DBG_alloc);
+  tor_assert(alloc == chunk->DBG_alloc);
 #endif
-  tor_assert(total_bytes_allocated_in_chunks >=
-             CHUNK_ALLOC_SIZE(chunk->memlen));
-  total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
-  tor_free(chunk);
+  tor_assert(total_bytes_allocated_in_chunks >= alloc);
+  total_bytes_allocated_in_chunks -= alloc;
+
+  freelist = get_freelist(alloc);
+  if (freelist && freelist->cur_length < freelist->max_length) {
+    chunk->next = freelist->head;
+    freelist->head = chunk;
+    ++freelist->cur_length;
+    total_bytes_in_freelists += alloc;
+  } else {
+    if (freelist)
+      ++freelist->n_free;
+    tor_free(chunk);
+  }
 }
+
+/** Allocate a new chunk with a given allocation size, or get one from the
+ * freelist.  Note that a chunk with allocation size A can actually hold only
+ * CHUNK_SIZE_WITH_ALLOC(A) bytes in its mem field. */
 static inline chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
-  ch = tor_malloc(alloc);
+  chunk_freelist_t *freelist;
+  tor_assert(alloc >= sizeof(chunk_t));
+  freelist = get_freelist(alloc);
+  if (freelist && freelist->head) {
+    ch = freelist->head;
+    freelist->head = ch->next;
+    if (--freelist->cur_length < freelist->lowest_length)
+      freelist->lowest_length = freelist->cur_length;
+    ++freelist->n_hit;
+    tor_assert(total_bytes_in_freelists >= alloc);
+    total_bytes_in_freelists -= alloc;
+  } else {
+    if (freelist)
+      ++freelist->n_alloc;
+    ch = tor_malloc(alloc);
+  }
   ch->next = NULL;
   ch->datalen = 0;
 #ifdef DEBUG_CHUNK_ALLOC
@@ -155,6 +237,88 @@ chunk_new_with_alloc_size(size_t alloc)
   return ch;
 }
 
+/** Give the first <b>n</b> chunks on <b>freelist</b> back to the system.
+ * Return the number of bytes released. */
+static size_t
+freelist_release(chunk_freelist_t *freelist, int n)
+{
+  size_t released = 0;
+  tor_assert(n <= freelist->cur_length);
+  while (n--) {
+    chunk_t *chunk = freelist->head;
+    tor_assert(chunk);
+    freelist->head = chunk->next;
+    --freelist->cur_length;
+    ++freelist->n_free;
+    tor_free(chunk);
+    released += freelist->alloc_size;
+  }
+  if (freelist->lowest_length > freelist->cur_length)
+    freelist->lowest_length = freelist->cur_length;
+  tor_assert(total_bytes_in_freelists >= released);
+  total_bytes_in_freelists -= released;
+  return released;
+}
+
+/** Remove from the freelists most chunks that have not been used since the
+ * last call to buf_shrink_freelists().  If <b>free_all</b> is true, empty
+ * the freelists entirely.  Return the number of bytes released. */
+size_t
+buf_shrink_freelists(int free_all)
+{
+  size_t released = 0;
+  int i;
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    chunk_freelist_t *freelist = &freelists[i];
+    int n_to_free = free_all ? freelist->cur_length : freelist->lowest_length;
+    if (n_to_free) {
+      log_info(LD_MM, "Cleaning freelist for %d-byte chunks: releasing %d "
+               "of %d.", (int)freelist->alloc_size, n_to_free,
+               freelist->cur_length);
+      released += freelist_release(freelist, n_to_free);
+    }
+    freelist->lowest_length = freelist->cur_length;
+  }
+  return released;
+}
+
+/** Allow each freelist to hold up to <b>max_bytes</b> bytes worth of
+ * chunks, and release any chunks beyond that. */
+void
+buf_set_freelist_max_bytes(size_t max_bytes)
+{
+  int i;
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    chunk_freelist_t *freelist = &freelists[i];
+    size_t max_length = max_bytes / freelist->alloc_size;
+    if (max_length > INT_MAX)
+      max_length = INT_MAX;
+    freelist->max_length = (int)max_length;
+    if (freelist->cur_length > freelist->max_length)
+      freelist_release(freelist,
+                       freelist->cur_length - freelist->max_length);
+  }
+}
+
+/** Describe the current status of the freelists at log level
+ * <b>severity</b>. */
+void
+buf_dump_freelist_sizes(int severity)
+{
+  int i;
+  tor_log(severity, LD_MM, "====== Buffer freelists:");
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    chunk_freelist_t *freelist = &freelists[i];
+    uint64_t total = ((uint64_t)freelist->cur_length) * freelist->alloc_size;
+    tor_log(severity, LD_MM,
+            "  %"PRIu64" bytes in %d %d-byte chunks (max %d) "
+            "[%"PRIu64" misses; %"PRIu64" frees; %"PRIu64" hits]",
+            total, freelist->cur_length, (int)freelist->alloc_size,
+            freelist->max_length, freelist->n_alloc, freelist->n_free,
+            freelist->n_hit);
+  }
+}
+
 /** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
  * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
 static inline chunk_t *
@@ -468,23 +632,40 @@ buf_copy(const buf_t *buf)
   return out;
 }
 
-/** Append a new chunk with enough capacity to hold <b>capacity</b> bytes to
- * the tail of <b>buf</b>.  If <b>capped</b>, don't allocate a chunk bigger
- * than MAX_CHUNK_ALLOC. */
+/** Allocate and return a new chunk, suitable for <b>buf</b>, with enough
+ * capacity to hold <b>capacity</b> bytes.  Do not add it to <b>buf</b>.
+ * If <b>capped</b>, don't allocate a chunk bigger than MAX_CHUNK_ALLOC. */
 chunk_t *
-buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
+buf_new_chunk_with_capacity(const buf_t *buf, size_t capacity, int capped)
 {
-  chunk_t *chunk;
-
   if (CHUNK_ALLOC_SIZE(capacity) < buf->default_chunk_size) {
-    chunk = chunk_new_with_alloc_size(buf->default_chunk_size);
+    return chunk_new_with_alloc_size(buf->default_chunk_size);
   } else if (capped && CHUNK_ALLOC_SIZE(capacity) > MAX_CHUNK_ALLOC) {
-    chunk = chunk_new_with_alloc_size(MAX_CHUNK_ALLOC);
+    return chunk_new_with_alloc_size(MAX_CHUNK_ALLOC);
   } else {
-    chunk = chunk_new_with_alloc_size(buf_preferred_chunk_size(capacity));
+    return chunk_new_with_alloc_size(buf_preferred_chunk_size(capacity));
   }
+}
+
+/** Append a new chunk with enough capacity to hold <b>capacity</b> bytes to
+ * the tail of <b>buf</b>.  If <b>capped</b>, don't allocate a chunk bigger
+ * than MAX_CHUNK_ALLOC. */
+chunk_t *
+buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
+{
+  chunk_t *chunk = buf_new_chunk_with_capacity(buf, capacity, capped);
+  buf_append_chunk(buf, chunk);
+  return chunk;
+}
 
+/** Append <b>chunk</b>, which must not be on any buffer, to the tail of
+ * <b>buf</b>, and account for any data it already holds. */
+void
+buf_append_chunk(buf_t *buf, chunk_t *chunk)
+{
+  tor_assert(chunk->next == NULL);
   chunk->inserted_time = monotime_coarse_get_stamp();
+  buf->datalen += chunk->datalen;
 
   if (buf->tail) {
     tor_assert(buf->head);
@@ -495,7 +676,6 @@ buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
     buf->head = buf->tail = chunk;
   }
   check();
-  return chunk;
 }
 
 /** Return the age of the oldest chunk in the buffer <b>buf</b>, in
@@ -512,10 +692,20 @@ buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now)
   }
 }
 
+/** Return the total number of bytes held by all buffers, including the
+ * chunks sitting on our freelists. */
 size_t
 buf_get_total_allocation(void)
 {
-  return total_bytes_allocated_in_chunks;
+  return total_bytes_allocated_in_chunks + total_bytes_in_freelists;
+}
+
+/** Return the number of bytes in the unused chunks sitting on our
+ * freelists.  These are included in buf_get_total_allocation(). */
+size_t
+buf_get_freelist_allocation(void)
+{
+  return total_bytes_in_freelists;
 }
 
 /** Append <b>string_len</b> bytes from <b>string</b> to the end of
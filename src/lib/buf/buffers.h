@@ -38,6 +38,14 @@ size_t buf_slack(const buf_t *buf);
 
 uint32_t buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now);
 size_t buf_get_total_allocation(void);
+size_t buf_get_freelist_allocation(void);
+
+/** By default, how many bytes worth of unused chunks do we keep around for
+ * each chunk size? */
+#define BUF_FREELIST_DEFAULT_MAX_BYTES (1<<20)
+size_t buf_shrink_freelists(int free_all);
+void buf_set_freelist_max_bytes(size_t max_bytes);
+void buf_dump_freelist_sizes(int severity);
 
 int buf_add(buf_t *buf, const char *string, size_t string_len);
 void buf_add_string(buf_t *buf, const char *string);
@@ -100,6 +108,10 @@ struct buf_t {
 };
 
 chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped);
+chunk_t *buf_new_chunk_with_capacity(const buf_t *buf, size_t capacity,
+                                     int capped);
+void buf_append_chunk(buf_t *buf, chunk_t *chunk);
+void buf_chunk_free_unchecked(chunk_t *chunk);
 /** If a read onto the end of a chunk would be smaller than this number, then
  * just start a new chunk. */
 #define MIN_READ_LEN 8
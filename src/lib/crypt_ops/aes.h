@@ -24,6 +24,8 @@ void aes_cipher_free_(aes_cnt_cipher_t *cipher);
 #define aes_cipher_free(cipher) \
   FREE_AND_NULL(aes_cnt_cipher_t, aes_cipher_free_, (cipher))
 void aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len);
+void aes_crypt_inplace_multi(aes_cnt_cipher_t **ciphers, char **data,
+                             size_t len, int n);
 
 int evaluate_evp_for_aes(int force_value);
 int evaluate_ctr_for_aes(void);
@@ -92,6 +92,15 @@ aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data_, size_t len_)
   tor_assert(result_len == len);
 }
 
+void
+aes_crypt_inplace_multi(aes_cnt_cipher_t **ciphers, char **data,
+                        size_t len, int n)
+{
+  int i;
+  for (i = 0; i < n; ++i)
+    aes_crypt_inplace(ciphers[i], data[i], len);
+}
+
 int
 evaluate_evp_for_aes(int force_value)
 {
@@ -134,6 +134,26 @@ aes_crypt_inplace(aes_cnt_cipher_t *cipher_, char *data, size_t len)
   EVP_EncryptUpdate(cipher, (unsigned char*)data,
                     &outl, (unsigned char*)data, (int)len);
 }
+/** Encrypt <b>len</b> bytes of each of the <b>n</b> buffers in <b>data</b>
+ * in place, the i'th one with <b>ciphers</b>[i].
+ *
+ * OpenSSL won't let us interleave the rounds of different keys, but its
+ * counter mode already keeps the AES pipeline full across a whole cell:
+ * what we save here is the checking and dispatch of one call per cell. */
+void
+aes_crypt_inplace_multi(aes_cnt_cipher_t **ciphers, char **data,
+                        size_t len, int n)
+{
+  int i, outl;
+
+  tor_assert(len < INT_MAX);
+
+  for (i = 0; i < n; ++i) {
+    EVP_EncryptUpdate((EVP_CIPHER_CTX *) ciphers[i],
+                      (unsigned char*)data[i], &outl,
+                      (unsigned char*)data[i], (int)len);
+  }
+}
 int
 evaluate_evp_for_aes(int force_val)
 {
@@ -391,6 +411,17 @@ aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len)
   }
 }
 
+/** Encrypt <b>len</b> bytes of each of the <b>n</b> buffers in <b>data</b>
+ * in place, the i'th one with <b>ciphers</b>[i]. */
+void
+aes_crypt_inplace_multi(aes_cnt_cipher_t **ciphers, char **data,
+                        size_t len, int n)
+{
+  int i;
+  for (i = 0; i < n; ++i)
+    aes_crypt_inplace(ciphers[i], data[i], len);
+}
+
 /** Reset the 128-bit counter of <b>cipher</b> to the 16-bit big-endian value
  * in <b>iv</b>. */
 static void
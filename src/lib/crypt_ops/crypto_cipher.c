@@ -128,6 +128,20 @@ crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *buf, size_t len)
   aes_crypt_inplace(env, buf, len);
 }
 
+/** Encrypt <b>len</b> bytes in place at each of the <b>n</b> buffers in
+ * <b>bufs</b>, the i'th one using the cipher in <b>envs</b>[i].  A cipher
+ * may appear more than once; its buffers are handled in order.  Cheaper
+ * than calling crypto_cipher_crypt_inplace() on each buffer.
+ */
+void
+crypto_cipher_crypt_inplace_multi(crypto_cipher_t **envs, char **bufs,
+                                  size_t len, int n)
+{
+  tor_assert(len < SIZE_T_CEILING);
+  tor_assert(n >= 0);
+  aes_crypt_inplace_multi(envs, bufs, len, n);
+}
+
 /** Encrypt <b>fromlen</b> bytes (at least 1) from <b>from</b> with the key in
  * <b>key</b> to the buffer in <b>to</b> of length
  * <b>tolen</b>. <b>tolen</b> must be at least <b>fromlen</b> plus
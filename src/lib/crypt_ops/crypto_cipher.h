@@ -46,6 +46,8 @@ int crypto_cipher_encrypt(crypto_cipher_t *env, char *to,
 int crypto_cipher_decrypt(crypto_cipher_t *env, char *to,
                           const char *from, size_t fromlen);
 void crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *d, size_t len);
+void crypto_cipher_crypt_inplace_multi(crypto_cipher_t **envs, char **bufs,
+                                       size_t len, int n);
 
 int crypto_cipher_encrypt_with_iv(const char *key,
                                   char *to, size_t tolen,
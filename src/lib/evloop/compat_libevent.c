@@ -9,6 +9,7 @@
 #include "orconfig.h"
 #define COMPAT_LIBEVENT_PRIVATE
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/evloop_stats.h"
 
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/log/log.h"
@@ -321,8 +322,29 @@ struct mainloop_event_t {
   struct event *ev;
   void (*cb)(mainloop_event_t *, void *);
   void *userdata;
+  /** If set, the statistics where we record how long <b>cb</b> takes. */
+  evloop_stat_t *stat;
 };
 
+/**
+ * Internal: Run the callback for <b>mev</b>, recording its cost if it has
+ * a name.
+ */
+static inline void
+mainloop_event_run(mainloop_event_t *mev)
+{
+  if (mev->stat) {
+    evloop_stat_t *stat = mev->stat;
+    evloop_stat_timer_t timer;
+    evloop_stat_timer_start(stat, &timer);
+    mev->cb(mev, mev->userdata);
+    /* Don't look at mev again: the callback may have freed it. */
+    evloop_stat_timer_end(stat, &timer);
+  } else {
+    mev->cb(mev, mev->userdata);
+  }
+}
+
 /**
  * Internal: Implements mainloop event using a libevent event.
  */
@@ -332,7 +354,7 @@ mainloop_event_cb(evutil_socket_t fd, short what, void *arg)
   (void)fd;
   (void)what;
   mainloop_event_t *mev = arg;
-  mev->cb(mev, mev->userdata);
+  mainloop_event_run(mev);
 }
 
 /**
@@ -357,7 +379,7 @@ mainloop_event_postloop_cb(evutil_socket_t fd, short what, void *arg)
   event_active(rescan_mainloop_ev, EV_READ, 1);
 
   mainloop_event_t *mev = arg;
-  mev->cb(mev, mev->userdata);
+  mainloop_event_run(mev);
 }
 
 /**
@@ -413,6 +435,19 @@ mainloop_event_postloop_new(void (*cb)(mainloop_event_t *, void *),
   return mainloop_event_new_impl(1, cb, userdata);
 }
 
+/**
+ * Give <b>event</b> the name <b>name</b>, and start recording how much time
+ * its callback takes under that name.  Events that share a name share
+ * their statistics.  See evloop_stats.c.
+ */
+void
+mainloop_event_set_name(mainloop_event_t *event, const char *name)
+{
+  tor_assert(event);
+  tor_assert(name);
+  event->stat = evloop_stat_get(name);
+}
+
 /**
  * Schedule <b>event</b> to run in the main loop, immediately.  If it is
  * not scheduled, it will run anyway. If it is already scheduled to run
@@ -51,6 +51,7 @@ mainloop_event_t *mainloop_event_new(void (*cb)(mainloop_event_t *, void *),
 mainloop_event_t * mainloop_event_postloop_new(
                                      void (*cb)(mainloop_event_t *, void *),
                                      void *userdata);
+void mainloop_event_set_name(mainloop_event_t *event, const char *name);
 void mainloop_event_activate(mainloop_event_t *event);
 int mainloop_event_schedule(mainloop_event_t *event,
                             const struct timeval *delay);
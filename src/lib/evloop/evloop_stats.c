@@ -0,0 +1,266 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file evloop_stats.c
+ * \brief Measure how long, and how much CPU time, the main loop spends in
+ *   each kind of callback.
+ *
+ * When the main loop stalls, we want to know who is responsible.  So every
+ * periodic event, every named mainloop_event_t, and the read and write
+ * callbacks for each type of connection keep an evloop_stat_t, and add the
+ * wall-clock time of each call to it, and the CPU time of one call in
+ * EVLOOP_STAT_CPU_SAMPLE_INTERVAL.  Reading the monotonic clock twice per
+ * callback is cheap enough to leave on all the time; reading the thread
+ * CPU clock costs a system call each time, so we only sample it.  The
+ * controller can read the totals and histograms with GETINFO
+ * mainloop/callback-stats, and the heartbeat summarizes the slowest
+ * callbacks since the last heartbeat.
+ *
+ * These statistics are only for the main thread.
+ **/
+
+#include "orconfig.h"
+#include "lib/evloop/evloop_stats.h"
+#include "lib/container/map.h"
+#include "lib/container/smartlist.h"
+#include "lib/malloc/malloc.h"
+#include "lib/string/printf.h"
+
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/** Every evloop_stat_t we have, in the order we created them. */
+static smartlist_t *all_stats = NULL;
+/** Map from name to evloop_stat_t, for everything in all_stats. */
+static strmap_t *stats_by_name = NULL;
+
+/** Return the evloop_stat_t called <b>name</b>, creating it if it doesn't
+ * exist yet.  The result stays valid until evloop_stats_free_all() is
+ * called, so callers should look it up once and keep it. */
+evloop_stat_t *
+evloop_stat_get(const char *name)
+{
+  evloop_stat_t *stat;
+
+  if (!all_stats) {
+    all_stats = smartlist_new();
+    stats_by_name = strmap_new();
+  }
+  stat = strmap_get(stats_by_name, name);
+  if (!stat) {
+    stat = tor_malloc_zero(sizeof(evloop_stat_t));
+    stat->name = tor_strdup(name);
+    smartlist_add(all_stats, stat);
+    strmap_set(stats_by_name, name, stat);
+  }
+  return stat;
+}
+
+/** Return the CPU time used so far by the current thread, in microseconds,
+ * or 0 if we can't tell on this platform. */
+uint64_t
+evloop_thread_cpu_usec(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    return ((uint64_t)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+  return 0;
+#elif defined(_WIN32)
+  FILETIME created, exited, kernel, user;
+  if (GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) {
+    const uint64_t k = (((uint64_t)kernel.dwHighDateTime) << 32) |
+      kernel.dwLowDateTime;
+    const uint64_t u = (((uint64_t)user.dwHighDateTime) << 32) |
+      user.dwLowDateTime;
+    /* FILETIME counts units of 100 nanoseconds. */
+    return (k + u) / 10;
+  }
+  return 0;
+#else
+  return 0;
+#endif /* defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID) ||
+        * ... */
+}
+
+/** Record in <b>timer</b> that we're starting a callback, which we will
+ * add to <b>stat</b>, now. */
+void
+evloop_stat_timer_start(const evloop_stat_t *stat, evloop_stat_timer_t *timer)
+{
+  timer->sample_cpu =
+    (stat->n_calls % EVLOOP_STAT_CPU_SAMPLE_INTERVAL) == 0;
+  if (timer->sample_cpu)
+    timer->start_cpu_usec = evloop_thread_cpu_usec();
+  monotime_get(&timer->start);
+}
+
+/** Add the callback that we started at <b>timer</b>, and that has just
+ * finished, to <b>stat</b>. */
+void
+evloop_stat_timer_end(evloop_stat_t *stat, const evloop_stat_timer_t *timer)
+{
+  monotime_t end;
+  int64_t wall;
+  uint64_t cpu = EVLOOP_STAT_NO_CPU;
+
+  monotime_get(&end);
+  wall = monotime_diff_usec(&timer->start, &end);
+  if (timer->sample_cpu) {
+    cpu = evloop_thread_cpu_usec();
+    cpu = cpu > timer->start_cpu_usec ? cpu - timer->start_cpu_usec : 0;
+  }
+  evloop_stat_add(stat, wall > 0 ? (uint64_t)wall : 0, cpu);
+}
+
+/** Return the histogram bucket for a call that took <b>usec</b>
+ * microseconds.  A call that took exactly 2^k microseconds goes in bucket
+ * k, so that each bucket's bound is inclusive. */
+static inline int
+evloop_stat_bucket(uint64_t usec)
+{
+  int b = 0;
+  if (usec)
+    --usec;
+  while (usec && b < EVLOOP_STAT_N_BUCKETS - 1) {
+    usec >>= 1;
+    ++b;
+  }
+  return b;
+}
+
+/** Add a call that took <b>wall_usec</b> microseconds, and used
+ * <b>cpu_usec</b> microseconds of CPU time, to <b>stat</b>.  If we didn't
+ * measure its CPU time, <b>cpu_usec</b> is EVLOOP_STAT_NO_CPU. */
+void
+evloop_stat_add(evloop_stat_t *stat, uint64_t wall_usec, uint64_t cpu_usec)
+{
+  ++stat->n_calls;
+  stat->wall_usec += wall_usec;
+  if (wall_usec > stat->max_wall_usec)
+    stat->max_wall_usec = wall_usec;
+  ++stat->wall_hist[evloop_stat_bucket(wall_usec)];
+  if (cpu_usec != EVLOOP_STAT_NO_CPU) {
+    ++stat->cpu_n_samples;
+    stat->cpu_usec += cpu_usec;
+    ++stat->cpu_hist[evloop_stat_bucket(cpu_usec)];
+  }
+
+  ++stat->period_n_calls;
+  stat->period_wall_usec += wall_usec;
+  if (wall_usec > stat->period_max_wall_usec)
+    stat->period_max_wall_usec = wall_usec;
+}
+
+/** Return our estimate of the total CPU time that every call to
+ * <b>stat</b> has used, in microseconds, scaling up from the calls that we
+ * measured. */
+uint64_t
+evloop_stat_estimate_cpu_usec(const evloop_stat_t *stat)
+{
+  if (!stat->cpu_n_samples)
+    return 0;
+  return (uint64_t)((double)stat->cpu_usec *
+                    stat->n_calls / stat->cpu_n_samples);
+}
+
+/** Return a list of every evloop_stat_t, or NULL if we have none. */
+const smartlist_t *
+evloop_stats_get_all(void)
+{
+  return all_stats;
+}
+
+/** Start a new period for the period_* fields of every evloop_stat_t. */
+void
+evloop_stats_reset_period(void)
+{
+  if (!all_stats)
+    return;
+  SMARTLIST_FOREACH_BEGIN(all_stats, evloop_stat_t *, stat) {
+    stat->period_n_calls = 0;
+    stat->period_wall_usec = 0;
+    stat->period_max_wall_usec = 0;
+  } SMARTLIST_FOREACH_END(stat);
+}
+
+/** Add <b>hist</b> to <b>out</b>, as a comma-separated list of
+ * "LIMIT:COUNT" for each nonempty bucket, where LIMIT is the bucket's upper
+ * bound in microseconds, or "inf" for the last bucket. */
+static void
+format_hist(smartlist_t *out, const uint64_t *hist)
+{
+  int first = 1;
+  for (int b = 0; b < EVLOOP_STAT_N_BUCKETS; ++b) {
+    if (!hist[b])
+      continue;
+    if (b == EVLOOP_STAT_N_BUCKETS - 1) {
+      smartlist_add_asprintf(out, "%sinf:%"PRIu64, first ? "" : ",", hist[b]);
+    } else {
+      smartlist_add_asprintf(out, "%s%"PRIu64":%"PRIu64, first ? "" : ",",
+                             ((uint64_t)1) << b, hist[b]);
+    }
+    first = 0;
+  }
+}
+
+/** Return a newly allocated string describing every evloop_stat_t that has
+ * recorded at least one call, one per line, for the controller.  Each line
+ * looks like:
+ *
+ *   NAME calls=N wall-usec=N wall-max-usec=N cpu-samples=N cpu-usec=N
+ *     wall-hist=LIMIT:COUNT,... cpu-hist=LIMIT:COUNT,...
+ *
+ * (all on one line), where the histograms are as for format_hist().  The
+ * CPU time and its histogram only cover the cpu-samples calls that we
+ * measured. */
+char *
+evloop_stats_format(void)
+{
+  smartlist_t *lines = smartlist_new();
+  smartlist_t *parts = smartlist_new();
+  char *result;
+
+  if (all_stats) {
+    SMARTLIST_FOREACH_BEGIN(all_stats, const evloop_stat_t *, stat) {
+      if (!stat->n_calls)
+        continue;
+      smartlist_add_asprintf(parts, "%s calls=%"PRIu64" wall-usec=%"PRIu64
+                             " wall-max-usec=%"PRIu64" cpu-samples=%"PRIu64
+                             " cpu-usec=%"PRIu64" wall-hist=",
+                             stat->name, stat->n_calls, stat->wall_usec,
+                             stat->max_wall_usec, stat->cpu_n_samples,
+                             stat->cpu_usec);
+      format_hist(parts, stat->wall_hist);
+      smartlist_add_strdup(parts, " cpu-hist=");
+      format_hist(parts, stat->cpu_hist);
+      smartlist_add(lines, smartlist_join_strings(parts, "", 0, NULL));
+      SMARTLIST_FOREACH(parts, char *, cp, tor_free(cp));
+      smartlist_clear(parts);
+    } SMARTLIST_FOREACH_END(stat);
+  }
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  smartlist_free(parts);
+  return result;
+}
+
+/** Release all storage held by evloop statistics.  Every evloop_stat_t
+ * pointer becomes invalid. */
+void
+evloop_stats_free_all(void)
+{
+  if (all_stats) {
+    SMARTLIST_FOREACH_BEGIN(all_stats, evloop_stat_t *, stat) {
+      tor_free(stat->name);
+      tor_free(stat);
+    } SMARTLIST_FOREACH_END(stat);
+    smartlist_free(all_stats);
+  }
+  strmap_free(stats_by_name, NULL);
+}
@@ -0,0 +1,84 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file evloop_stats.h
+ * \brief Header for evloop_stats.c
+ **/
+
+#ifndef TOR_EVLOOP_STATS_H
+#define TOR_EVLOOP_STATS_H
+
+#include "lib/cc/torint.h"
+#include "lib/time/compat_time.h"
+
+/** The number of buckets in each histogram of an evloop_stat_t.  Bucket 0
+ * counts calls that took at most 1 microsecond; bucket i, for 0 < i <
+ * EVLOOP_STAT_N_BUCKETS-1, counts calls that took more than 2^(i-1) and at
+ * most 2^i microseconds; and the last bucket counts everything longer. */
+#define EVLOOP_STAT_N_BUCKETS 25
+
+/** We read the thread CPU time for one call out of every
+ * EVLOOP_STAT_CPU_SAMPLE_INTERVAL to each callback.  Unlike the monotonic
+ * clock, the thread CPU clock is not served from the vDSO, so each read is
+ * a system call. */
+#define EVLOOP_STAT_CPU_SAMPLE_INTERVAL 16
+
+/** A value for the <b>cpu_usec</b> argument of evloop_stat_add(), meaning
+ * that we did not measure the CPU time of that call. */
+#define EVLOOP_STAT_NO_CPU UINT64_MAX
+
+/** How long and how much CPU time the main loop has spent in one kind of
+ * callback. */
+typedef struct evloop_stat_t {
+  /** The name of this kind of callback, like "periodic/heartbeat". */
+  char *name;
+  /** How many times have we run this callback? */
+  uint64_t n_calls;
+  /** How much wall-clock time have we spent in it, in total? */
+  uint64_t wall_usec;
+  /** For how many calls have we measured the CPU time? */
+  uint64_t cpu_n_samples;
+  /** How much CPU time have we spent in the calls that we measured? */
+  uint64_t cpu_usec;
+  /** What's the most wall-clock time that one call has taken? */
+  uint64_t max_wall_usec;
+  /** Histogram of the wall-clock time of each call. */
+  uint64_t wall_hist[EVLOOP_STAT_N_BUCKETS];
+  /** Histogram of the CPU time of each call that we measured. */
+  uint64_t cpu_hist[EVLOOP_STAT_N_BUCKETS];
+  /** As n_calls, since evloop_stats_reset_period() was last called. */
+  uint64_t period_n_calls;
+  /** As wall_usec, since evloop_stats_reset_period() was last called. */
+  uint64_t period_wall_usec;
+  /** As max_wall_usec, since evloop_stats_reset_period() was last
+   * called. */
+  uint64_t period_max_wall_usec;
+} evloop_stat_t;
+
+/** The time at which we started a callback that we're measuring. */
+typedef struct evloop_stat_timer_t {
+  monotime_t start;
+  /** True iff we are measuring the CPU time of this call. */
+  bool sample_cpu;
+  uint64_t start_cpu_usec;
+} evloop_stat_timer_t;
+
+evloop_stat_t *evloop_stat_get(const char *name);
+void evloop_stat_timer_start(const evloop_stat_t *stat,
+                             evloop_stat_timer_t *timer);
+void evloop_stat_timer_end(evloop_stat_t *stat,
+                           const evloop_stat_timer_t *timer);
+void evloop_stat_add(evloop_stat_t *stat, uint64_t wall_usec,
+                     uint64_t cpu_usec);
+
+struct smartlist_t;
+const struct smartlist_t *evloop_stats_get_all(void);
+void evloop_stats_reset_period(void);
+char *evloop_stats_format(void);
+uint64_t evloop_stat_estimate_cpu_usec(const evloop_stat_t *stat);
+void evloop_stats_free_all(void);
+
+uint64_t evloop_thread_cpu_usec(void);
+
+#endif /* !defined(TOR_EVLOOP_STATS_H) */
@@ -12,6 +12,7 @@
 #include "orconfig.h"
 #include "lib/subsys/subsys.h"
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/evloop_stats.h"
 #include "lib/evloop/evloop_sys.h"
 #include "lib/log/log.h"
 
@@ -36,6 +37,7 @@ subsys_evloop_postfork(void)
 static void
 subsys_evloop_shutdown(void)
 {
+  evloop_stats_free_all();
   tor_libevent_free_all();
 }
 
@@ -222,6 +222,7 @@ timers_initialize(void)
   mainloop_event_t *timer_event;
   timer_event = mainloop_event_new(libevent_timer_callback, NULL);
   tor_assert(timer_event);
+  mainloop_event_set_name(timer_event, "timers");
   global_timer_event = timer_event;
 
   libevent_timer_reschedule();
@@ -9,17 +9,28 @@
  * for them to send answers back to the main thread.
  *
  * The main structure here is a threadpool_t : it manages a set of worker
- * threads, a queue of pending work, and a reply queue.  Every piece of work
- * is a workqueue_entry_t, containing data to process and a function to
- * process it with.
+ * threads, and a reply queue.  Every worker thread owns its own set of
+ * priority queues of pending work, protected by its own lock.  Every piece
+ * of work is a workqueue_entry_t, containing data to process and a function
+ * to process it with.
  *
- * The main thread informs the worker threads of pending work by using a
+ * New work is spread across the workers' queues in round-robin order.  A
+ * worker takes work from its own queues first; when those are empty, it
+ * steals work from the queues of the other workers before going to sleep.
+ * This way, the workers only contend with each other (and with the main
+ * thread) when the pool is nearly idle, rather than on every item.
+ *
+ * The main thread informs sleeping worker threads of pending work by using a
  * condition variable.  The workers inform the main process of completed work
  * by using an alert_sockets_t object, as implemented in net/alertsock.c.
  *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
  *
+ * Finally, a threadpool can have an "idle function" that workers run, a
+ * little at a time, whenever they have nothing else to do.  This is useful
+ * for precomputing things that the work functions will need later.
+ *
  * In Tor today, there is currently only one thread pool, used in cpuworker.c.
  */
 
@@ -53,15 +64,22 @@ struct threadpool_t {
   struct workerthread_t **threads;
 
   /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
+   * gets signaled when some queue becomes nonempty. */
   tor_cond_t condition;
-  /** Queues of pending work that we have to do. The queue with priority
-   * <b>p</b> is work[p]. */
-  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** Number of work items that are queued on some thread's queues, and not
+   * yet taken by any worker. */
+  atomic_counter_t n_pending;
+  /** Number of worker threads that are waiting (or about to wait) on
+   * <b>condition</b>. */
+  atomic_counter_t n_idle;
+  /** Index of the thread whose queue will receive the next item of work.
+   * Only used from the thread that queues work. */
+  unsigned next_thread;
 
   /** The current 'update generation' of the threadpool.  Any thread that is
-   * at an earlier generation needs to run the update function. */
-  unsigned generation;
+   * at an earlier generation needs to run the update function.  Only
+   * modified with <b>lock</b> held, but may be read without it. */
+  atomic_counter_t generation;
 
   /** Function that should be run for updates on each thread. */
   workqueue_reply_t (*update_fn)(void *, void *);
@@ -72,10 +90,16 @@ struct threadpool_t {
   /** Event to notice when another thread has sent a reply. */
   struct event *reply_event;
   void (*reply_cb)(threadpool_t *);
+  /** Function that worker threads run when they have no work; see
+   * threadpool_set_idle_fn(). */
+  int (*idle_fn)(void *);
 
   /** Number of elements in threads. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Mutex to protect all the above fields, except those that are atomic.
+   * It is also used with <b>condition</b> to put idle threads to sleep.
+   *
+   * We never hold this lock and a worker thread's lock at the same time. */
   tor_mutex_t lock;
 
   /** A reply queue to use when constructing new threads. */
@@ -100,7 +124,12 @@ struct workqueue_entry_t {
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_t *on_pool;
-  /** True iff this entry is waiting for a worker to start processing it. */
+  /** The worker thread on whose queue this entry was placed.  The entry
+   * stays on that thread's queue until some worker (not necessarily that
+   * one) takes it. */
+  struct workerthread_t *on_thread;
+  /** True iff this entry is waiting for a worker to start processing it.
+   * Protected by the lock of <b>on_thread</b>. */
   uint8_t pending;
   /** Priority of this entry. */
   workqueue_priority_bitfield_t priority : WORKQUEUE_PRIORITY_BITS;
@@ -134,9 +163,15 @@ typedef struct workerthread_t {
   /** Reply queue to which we pass our results. */
   replyqueue_t *reply_queue;
   /** The current update generation of this thread */
-  unsigned generation;
+  size_t generation;
   /** One over the probability of taking work from a lower-priority queue. */
   int32_t lower_priority_chance;
+  /** Mutex to protect <b>work</b>, and the <b>pending</b> field of every
+   * entry on it. */
+  tor_mutex_t lock;
+  /** Queues of pending work assigned to this thread. The queue with priority
+   * <b>p</b> is work[p]. */
+  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
 } workerthread_t;
 
 static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
@@ -187,19 +222,21 @@ workqueue_entry_free_(workqueue_entry_t *ent)
  * This function will have no effect if the worker thread has already executed
  * or begun to execute the work item.  In that case, it will return NULL.
  */
-void *
-workqueue_entry_cancel(workqueue_entry_t *ent)
+MOCK_IMPL(void *,
+workqueue_entry_cancel,(workqueue_entry_t *ent))
 {
   int cancelled = 0;
   void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
+  workerthread_t *thread = ent->on_thread;
+  tor_mutex_acquire(&thread->lock);
   workqueue_priority_t prio = ent->priority;
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work[prio], ent, next_work);
+    TOR_TAILQ_REMOVE(&thread->work[prio], ent, next_work);
+    atomic_counter_sub(&ent->on_pool->n_pending, 1);
     cancelled = 1;
     result = ent->arg;
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&thread->lock);
 
   if (cancelled) {
     workqueue_entry_free(ent);
@@ -207,32 +244,44 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
   return result;
 }
 
-/**DOCDOC
+/**
+ * Return the argument that was passed to the work function of <b>ent</b>
+ * when it was queued.
+ *
+ * You must not call this function on any work whose reply function has been
+ * executed in the main thread.
+ */
+MOCK_IMPL(void *,
+workqueue_entry_get_arg,(workqueue_entry_t *ent))
+{
+  return ent->arg;
+}
 
-   must hold lock */
+/** Return true iff <b>thread</b> needs to wake up: either because some
+ * work is queued anywhere in its pool, or because it needs to run an
+ * update. */
 static int
 worker_thread_has_work(workerthread_t *thread)
 {
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    if (!TOR_TAILQ_EMPTY(&thread->in_pool->work[i]))
-        return 1;
-  }
-  return thread->generation != thread->in_pool->generation;
+  threadpool_t *pool = thread->in_pool;
+  if (atomic_counter_get(&pool->n_pending) > 0)
+    return 1;
+  return thread->generation != atomic_counter_get(&pool->generation);
 }
 
-/** Extract the next workqueue_entry_t from the the thread's pool, removing
- * it from the relevant queues and marking it as non-pending.
+/** Extract the next workqueue_entry_t from the queues of <b>victim</b>
+ * on behalf of <b>thread</b>, removing it from the relevant queue and marking
+ * it as non-pending.  Return NULL if <b>victim</b> has no queued work.
  *
- * The caller must hold the lock. */
+ * The caller must hold the lock of <b>victim</b>. */
 static workqueue_entry_t *
-worker_thread_extract_next_work(workerthread_t *thread)
+worker_thread_extract_work_from(workerthread_t *thread,
+                                workerthread_t *victim)
 {
-  threadpool_t *pool = thread->in_pool;
   work_tailq_t *queue = NULL, *this_queue;
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    this_queue = &pool->work[i];
+    this_queue = &victim->work[i];
     if (!TOR_TAILQ_EMPTY(this_queue)) {
       queue = this_queue;
       if (! crypto_fast_rng_one_in_n(get_thread_fast_rng(),
@@ -252,9 +301,84 @@ worker_thread_extract_next_work(workerthread_t *thread)
   workqueue_entry_t *work = TOR_TAILQ_FIRST(queue);
   TOR_TAILQ_REMOVE(queue, work, next_work);
   work->pending = 0;
+  atomic_counter_sub(&thread->in_pool->n_pending, 1);
   return work;
 }
 
+/** Extract the next workqueue_entry_t for <b>thread</b> to run.  We look at
+ * the thread's own queues first; if they are empty, we try to steal work
+ * from every other thread in the pool, in order.  Return NULL if there is no
+ * work to be found.
+ *
+ * The caller must not hold any lock. */
+static workqueue_entry_t *
+worker_thread_extract_next_work(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_entry_t *work;
+  int i;
+
+  tor_mutex_acquire(&thread->lock);
+  work = worker_thread_extract_work_from(thread, thread);
+  tor_mutex_release(&thread->lock);
+  if (work)
+    return work;
+
+  /* Nothing of our own to do; go looking for work in the other threads'
+   * queues.  The set of threads is fixed before any worker starts, so we
+   * can look at it without holding the pool lock. */
+  for (i = 1; i < pool->n_threads; ++i) {
+    workerthread_t *victim =
+      pool->threads[(thread->index + i) % pool->n_threads];
+    if (atomic_counter_get(&pool->n_pending) == 0)
+      break;
+    tor_mutex_acquire(&victim->lock);
+    work = worker_thread_extract_work_from(thread, victim);
+    tor_mutex_release(&victim->lock);
+    if (work)
+      return work;
+  }
+  return NULL;
+}
+
+/** Put <b>work</b>, which we extracted but have not started to run, back at
+ * the front of the queue it came from. */
+static void
+worker_thread_unextract_work(workerthread_t *thread, workqueue_entry_t *work)
+{
+  workerthread_t *owner = work->on_thread;
+  tor_mutex_acquire(&owner->lock);
+  atomic_counter_add(&thread->in_pool->n_pending, 1);
+  TOR_TAILQ_INSERT_HEAD(&owner->work[work->priority], work, next_work);
+  work->pending = 1;
+  tor_mutex_release(&owner->lock);
+}
+
+/** Run the current update function of the pool in <b>thread</b>, if the
+ * thread has not already done so.  Return the result of the update function,
+ * or WQ_RPL_REPLY if there was nothing to do.
+ *
+ * The caller must not hold any lock. */
+static workqueue_reply_t
+worker_thread_run_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+
+  tor_mutex_acquire(&pool->lock);
+  size_t generation = atomic_counter_get(&pool->generation);
+  if (generation == thread->generation) {
+    tor_mutex_release(&pool->lock);
+    return WQ_RPL_REPLY;
+  }
+  void *arg = pool->update_args[thread->index];
+  pool->update_args[thread->index] = NULL;
+  workqueue_reply_t (*update_fn)(void*,void*) = pool->update_fn;
+  thread->generation = generation;
+  tor_mutex_release(&pool->lock);
+
+  return update_fn(thread->state, arg);
+}
+
 /**
  * Main function for the worker thread.
  */
@@ -266,35 +390,26 @@ worker_thread_main(void *thread_)
   workqueue_entry_t *work;
   workqueue_reply_t result;
 
-  tor_mutex_acquire(&pool->lock);
   while (1) {
-    /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
-
-        tor_mutex_acquire(&pool->lock);
+    /* No lock is held at this point. */
+    if (atomic_counter_get(&pool->generation) != thread->generation) {
+      if (worker_thread_run_update(thread) != WQ_RPL_REPLY) {
+        return;
+      }
+      continue;
+    }
+
+    work = worker_thread_extract_next_work(thread);
+    if (work) {
+      if (atomic_counter_get(&pool->generation) != thread->generation) {
+        /* An update was queued while we were looking for work.  It may have
+         * been queued before this work was, so we have to run the update
+         * first. */
+        worker_thread_unextract_work(thread, work);
         continue;
       }
-      work = worker_thread_extract_next_work(thread);
-      if (BUG(work == NULL))
-        break;
-      tor_mutex_release(&pool->lock);
 
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
+      /* We run the work function without holding any lock. */
       result = work->fn(thread->state, work->arg);
 
       /* Queue the reply for the main thread. */
@@ -304,17 +419,33 @@ worker_thread_main(void *thread_)
       if (result != WQ_RPL_REPLY) {
         return;
       }
-      tor_mutex_acquire(&pool->lock);
+      continue;
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
 
-    /* TODO: support an idle-function */
+    /* We found no work in any queue. If there is an idle function, we give
+     * it a chance to do a little work, and then look for work again. */
+    tor_mutex_acquire(&pool->lock);
+    int (*idle_fn)(void *) = pool->idle_fn;
+    if (idle_fn) {
+      tor_mutex_release(&pool->lock);
+      if (idle_fn(thread->state))
+        continue;
+      tor_mutex_acquire(&pool->lock);
+    }
 
-    /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    /* We announce that we are idle before checking for work one last time:
+     * threadpool_queue_work_priority() makes its work visible before
+     * checking for idle threads, so one of us is sure to notice the
+     * other. */
+    atomic_counter_add(&pool->n_idle, 1);
+    if (! worker_thread_has_work(thread)) {
+      /* Okay. Now, wait till somebody has work for us. */
+      if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
+        log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+      }
     }
+    atomic_counter_sub(&pool->n_idle, 1);
+    tor_mutex_release(&pool->lock);
   }
 }
 
@@ -347,17 +478,38 @@ workerthread_new(int32_t lower_priority_chance,
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
   thr->lower_priority_chance = lower_priority_chance;
+  thr->generation = atomic_counter_get(&pool->generation);
+  tor_mutex_init_nonrecursive(&thr->lock);
+  unsigned i;
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
+    TOR_TAILQ_INIT(&thr->work[i]);
+  }
+
+  return thr;
+}
 
+/** Launch the thread for the worker thread object <b>thr</b>.  Return 0 on
+ * success and -1 on failure. */
+static int
+workerthread_start(workerthread_t *thr)
+{
   if (spawn_func(worker_thread_main, thr) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
     log_err(LD_GENERAL, "Can't launch worker thread.");
-    tor_free(thr);
-    return NULL;
+    return -1;
     //LCOV_EXCL_STOP
   }
+  return 0;
+}
 
-  return thr;
+/** Release all storage held by <b>thr</b>, which must not have been
+ * started. */
+static void
+workerthread_free_unstarted(workerthread_t *thr)
+{
+  tor_mutex_uninit(&thr->lock);
+  tor_free(thr);
 }
 
 /**
@@ -380,7 +532,12 @@ workerthread_new(int32_t lower_priority_chance,
  * visit lower-priority queues to keep them from starving completely.
  *
  * Note that because of priorities and thread behavior, work items may not
- * be executed strictly in order.
+ * be executed strictly in order.  Priorities are only honored within each
+ * worker's queue: a thread that runs out of its own work may steal
+ * lower-priority work from another thread while that thread is still busy.
+ *
+ * This function must only be called from one thread at a time: in practice,
+ * the main thread.
  */
 workqueue_entry_t *
 threadpool_queue_work_priority(threadpool_t *pool,
@@ -392,18 +549,34 @@ threadpool_queue_work_priority(threadpool_t *pool,
   tor_assert(((int)prio) >= WORKQUEUE_PRIORITY_FIRST &&
              ((int)prio) <= WORKQUEUE_PRIORITY_LAST);
 
+  if (BUG(pool->n_threads == 0))
+    return NULL; // LCOV_EXCL_LINE
+
   workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
+  workerthread_t *thread = pool->threads[pool->next_thread];
+  if (++pool->next_thread == (unsigned) pool->n_threads)
+    pool->next_thread = 0;
+
   ent->on_pool = pool;
+  ent->on_thread = thread;
   ent->pending = 1;
   ent->priority = prio;
 
-  tor_mutex_acquire(&pool->lock);
-
-  TOR_TAILQ_INSERT_TAIL(&pool->work[prio], ent, next_work);
+  /* Count the work as pending before we queue it, so that the counter can
+   * never go below zero when a worker takes it. */
+  atomic_counter_add(&pool->n_pending, 1);
 
-  tor_cond_signal_one(&pool->condition);
+  tor_mutex_acquire(&thread->lock);
+  TOR_TAILQ_INSERT_TAIL(&thread->work[prio], ent, next_work);
+  tor_mutex_release(&thread->lock);
 
-  tor_mutex_release(&pool->lock);
+  /* Only wake somebody up if some thread is sleeping.  Busy threads will
+   * find this work on their own. */
+  if (atomic_counter_get(&pool->n_idle) > 0) {
+    tor_mutex_acquire(&pool->lock);
+    tor_cond_signal_one(&pool->condition);
+    tor_mutex_release(&pool->lock);
+  }
 
   return ent;
 }
@@ -461,7 +634,7 @@ threadpool_queue_update(threadpool_t *pool,
   pool->update_args = new_args;
   pool->free_update_arg_fn = free_fn;
   pool->update_fn = fn;
-  ++pool->generation;
+  atomic_counter_add(&pool->generation, 1);
 
   tor_cond_signal_all(&pool->condition);
 
@@ -504,6 +677,7 @@ threadpool_start_threads(threadpool_t *pool, int n)
     pool->threads = tor_reallocarray(pool->threads,
                                      sizeof(workerthread_t*), n);
 
+  int first_new = pool->n_threads;
   while (pool->n_threads < n) {
     /* For half of our threads, we'll choose lower priorities permissively;
      * for the other half, we'll stick more strictly to higher priorities.
@@ -513,17 +687,27 @@ threadpool_start_threads(threadpool_t *pool, int n)
     void *state = pool->new_thread_state_fn(pool->new_thread_state_arg);
     workerthread_t *thr = workerthread_new(chance,
                                            state, pool, pool->reply_queue);
+    thr->index = pool->n_threads;
+    pool->threads[pool->n_threads++] = thr;
+  }
 
-    if (!thr) {
+  /* We only start the threads once they are all in place, since the workers
+   * look at each other's queues without holding the pool lock. */
+  int i;
+  for (i = first_new; i < pool->n_threads; ++i) {
+    workerthread_t *thr = pool->threads[i];
+    if (workerthread_start(thr) < 0) {
       //LCOV_EXCL_START
       tor_assert_nonfatal_unreached();
-      pool->free_thread_state_fn(state);
+      while (pool->n_threads > i) {
+        thr = pool->threads[--pool->n_threads];
+        pool->free_thread_state_fn(thr->state);
+        workerthread_free_unstarted(thr);
+      }
       tor_mutex_release(&pool->lock);
       return -1;
       //LCOV_EXCL_STOP
     }
-    thr->index = pool->n_threads;
-    pool->threads[pool->n_threads++] = thr;
   }
   tor_mutex_release(&pool->lock);
 
@@ -548,10 +732,9 @@ threadpool_new(int n_threads,
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
   tor_cond_init(&pool->condition);
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    TOR_TAILQ_INIT(&pool->work[i]);
-  }
+  atomic_counter_init(&pool->n_pending);
+  atomic_counter_init(&pool->n_idle);
+  atomic_counter_init(&pool->generation);
 
   pool->new_thread_state_fn = new_thread_state_fn;
   pool->new_thread_state_arg = arg;
@@ -571,6 +754,24 @@ threadpool_new(int n_threads,
   return pool;
 }
 
+/**
+ * Set the idle function of <b>pool</b> to <b>idle_fn</b>.  Whenever a worker
+ * thread has no work to do, it will call <b>idle_fn</b> with its thread
+ * state.  The function should do a small amount of work and return true, or
+ * return false if it has nothing to do, in which case the worker sleeps until
+ * more work arrives.  Since workers check for new work between calls, the
+ * function should not take long to run.
+ */
+void
+threadpool_set_idle_fn(threadpool_t *pool, int (*idle_fn)(void *))
+{
+  tor_mutex_acquire(&pool->lock);
+  pool->idle_fn = idle_fn;
+  /* Wake up the sleeping threads so that they can start running it. */
+  tor_cond_signal_all(&pool->condition);
+  tor_mutex_release(&pool->lock);
+}
+
 /** Return the reply queue associated with a given thread pool. */
 replyqueue_t *
 threadpool_get_replyqueue(threadpool_t *tp)
@@ -13,14 +13,19 @@
  * statistical functions, which collect statistics about different kinds of
  * per-country usage.
  *
- * The geoip lookup tables are implemented as sorted lists of disjoint address
- * ranges, each mapping to a singleton geoip_country_t.  These country objects
- * are also indexed by their names in a hashtable.
+ * The geoip lookup tables split the address space of each family into
+ * disjoint ranges, each mapping to a singleton geoip_country_t.  The start
+ * of each range is kept in an array in Eytzinger (breadth-first) order, so
+ * that a lookup is a short, branch-light walk down an implicit binary tree
+ * whose top levels share a few cache lines.  See geoip_table_t.  The country
+ * objects are also indexed by their names in a hashtable.
  *
  * The tables are populated from disk at startup by the geoip_load_file()
- * function.  For more information on the file format they read, see that
- * function.  See the scripts and the README file in src/config for more
- * information about how those files are generated.
+ * function, either by parsing a text file or by mapping a binary file that
+ * was written by geoip_write_binary_file().  For more information on the
+ * file formats they read, see those functions.  See the scripts and the
+ * README file in src/config for more information about how the text files
+ * are generated.
  *
  * Tor uses GeoIP information in order to implement user requests (such as
  * ExcludeNodes {cc}), and to keep track of how much usage relays are getting
@@ -29,6 +34,7 @@
 
 #define GEOIP_PRIVATE
 #include "lib/geoip/geoip.h"
+#include "lib/arch/bytes.h"
 #include "lib/container/map.h"
 #include "lib/container/order.h"
 #include "lib/container/smartlist.h"
@@ -36,6 +42,7 @@
 #include "lib/ctime/di_ops.h"
 #include "lib/encoding/binascii.h"
 #include "lib/fs/files.h"
+#include "lib/fs/mmap.h"
 #include "lib/log/escape.h"
 #include "lib/malloc/malloc.h"
 #include "lib/net/address.h" //????
@@ -64,18 +71,73 @@ typedef struct geoip_ipv6_entry_t {
   intptr_t country; /**< An index into geoip_countries */
 } geoip_ipv6_entry_t;
 
+/** An IPv6 address as a 128-bit integer, in host order.  We also use these
+ * for IPv4 addresses, with <b>hi</b> set to 0, while building tables. */
+typedef struct geoip_ipv6_key_t {
+  uint64_t hi;
+  uint64_t lo;
+} geoip_ipv6_key_t;
+
+/** A lookup table mapping every address of one family to a country.
+ *
+ * A table is a view of a binary GeoIP image, in the format described in
+ * geoip_write_binary_file().  We get the image either by mapping a binary
+ * file, or by building one in memory from the entries of a text file.
+ *
+ * The address space is split into <b>n_ranges</b> ranges, the first of which
+ * starts at address 0.  The start addresses of the ranges are stored in
+ * positions 1 through n_ranges of <b>v4_keys</b> or <b>v6_keys</b>, in
+ * Eytzinger order: the children of position k are 2k and 2k+1.  Walking
+ * down that tree finds the position of the first range that starts after
+ * the address we're looking for.  So instead of storing the country of each
+ * range, countries[k] is the country of the range just before the one at
+ * position k, and countries[0] is the country of the last range.
+ */
+typedef struct geoip_table_t {
+  /** The number of address ranges. */
+  uint32_t n_ranges;
+  /** For IPv4 tables, the start of each range, as described above. */
+  const uint32_t *v4_keys;
+  /** For IPv6 tables, the start of each range, as described above. */
+  const geoip_ipv6_key_t *v6_keys;
+  /** The country of each range, as described above, as an index into the
+   * country codes in the image. */
+  const uint16_t *countries;
+  /** The number of country codes in the image. */
+  uint16_t n_countries;
+  /** Map from the indices of the country codes in the image to indices into
+   * geoip_countries. */
+  country_t *country_map;
+  /** The image itself. */
+  const char *image;
+  /** The length of <b>image</b>. */
+  size_t image_len;
+  /** If we built the image in memory, the storage for it. */
+  char *image_mem;
+  /** If we mapped the image from disk, the mapping. */
+  tor_mmap_t *image_mmap;
+} geoip_table_t;
+
 /** A list of geoip_country_t */
 static smartlist_t *geoip_countries = NULL;
 /** A map from lowercased country codes to their position in geoip_countries.
  * The index is encoded in the pointer, and 1 is added so that NULL can mean
  * not found. */
 static strmap_t *country_idxplus1_by_lc_code = NULL;
-/** List of all known geoip_ipv4_entry_t sorted
- * by their respective ip_low values. */
+/** List of geoip_ipv4_entry_t that we have parsed, but haven't yet put in
+ * geoip_ipv4_table. */
 static smartlist_t *geoip_ipv4_entries = NULL;
-/** List of all known geoip_ipv6_entry_t, sorted by their respective
- * ip_low values. */
+/** List of geoip_ipv6_entry_t that we have parsed, but haven't yet put in
+ * geoip_ipv6_table. */
 static smartlist_t *geoip_ipv6_entries = NULL;
+/** The IPv4 lookup table, if we have one. */
+static geoip_table_t *geoip_ipv4_table = NULL;
+/** The IPv6 lookup table, if we have one. */
+static geoip_table_t *geoip_ipv6_table = NULL;
+
+static void geoip_table_free_(geoip_table_t *t);
+#define geoip_table_free(t) \
+  FREE_AND_NULL(geoip_table_t, geoip_table_free_, (t))
 
 /** SHA1 digest of the IPv4 GeoIP file to include in extra-info
  * descriptors. */
@@ -111,20 +173,14 @@ geoip_get_country,(const char *country))
   return (country_t)idx;
 }
 
-/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
- * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
-static void
-geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
-                const char *country)
+/** Return the index in geoip_countries of the 2-letter country code
+ * <b>country</b>, adding it if it isn't there yet. */
+static intptr_t
+geoip_intern_country(const char *country)
 {
   intptr_t idx;
   void *idxplus1_;
 
-  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
-    return;
-  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
-    return;
-
   idxplus1_ = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
   if (!idxplus1_) {
@@ -141,6 +197,23 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
     geoip_country_t *c = smartlist_get(geoip_countries, (int)idx);
     tor_assert(!strcasecmp(c->countrycode, country));
   }
+  return idx;
+}
+
+/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
+ * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
+static void
+geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
+                const char *country)
+{
+  intptr_t idx;
+
+  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
+    return;
+  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
+    return;
+
+  idx = geoip_intern_country(country);
 
   if (tor_addr_family(low) == AF_INET) {
     geoip_ipv4_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv4_entry_t));
@@ -158,7 +231,10 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
 }
 
 /** Add an entry to the GeoIP table indicated by <b>family</b>,
- * parsing it from <b>line</b>. The format is as for geoip_load_file(). */
+ * parsing it from <b>line</b>. The format is as for geoip_load_file().
+ *
+ * The entry joins those we've parsed since we last built a table for
+ * <b>family</b>; we rebuild the table from them when we next need it. */
 STATIC int
 geoip_parse_entry(const char *line, sa_family_t family)
 {
@@ -168,12 +244,16 @@ geoip_parse_entry(const char *line, sa_family_t family)
 
   if (!geoip_countries)
     init_geoip_countries();
+  /* We'll rebuild the table from the parsed entries the next time we need
+   * it. */
   if (family == AF_INET) {
     if (!geoip_ipv4_entries)
       geoip_ipv4_entries = smartlist_new();
+    geoip_table_free(geoip_ipv4_table);
   } else if (family == AF_INET6) {
     if (!geoip_ipv6_entries)
       geoip_ipv6_entries = smartlist_new();
+    geoip_table_free(geoip_ipv6_table);
   } else {
     log_warn(LD_GENERAL, "Unsupported family: %d", family);
     return -1;
@@ -240,22 +320,6 @@ geoip_ipv4_compare_entries_(const void **_a, const void **_b)
     return 0;
 }
 
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IP (a pointer
- * to a uint32_t in host order) to a geoip_ipv4_entry_t */
-static int
-geoip_ipv4_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  /* No alignment issue here, since _key really is a pointer to uint32_t */
-  const uint32_t addr = *(uint32_t *)_key;
-  const geoip_ipv4_entry_t *entry = *_member;
-  if (addr < entry->ip_low)
-    return -1;
-  else if (addr > entry->ip_high)
-    return 1;
-  else
-    return 0;
-}
-
 /** Sorting helper: return -1, 1, or 0 based on comparison of two
  * geoip_ipv6_entry_t */
 static int
@@ -266,24 +330,6 @@ geoip_ipv6_compare_entries_(const void **_a, const void **_b)
                      sizeof(struct in6_addr));
 }
 
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IPv6
- * (a pointer to a in6_addr) to a geoip_ipv6_entry_t */
-static int
-geoip_ipv6_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  const struct in6_addr *addr = (struct in6_addr *)_key;
-  const geoip_ipv6_entry_t *entry = *_member;
-
-  if (fast_memcmp(addr->s6_addr, entry->ip_low.s6_addr,
-             sizeof(struct in6_addr)) < 0)
-    return -1;
-  else if (fast_memcmp(addr->s6_addr, entry->ip_high.s6_addr,
-                  sizeof(struct in6_addr)) > 0)
-    return 1;
-  else
-    return 0;
-}
-
 /** Set up a new list of geoip countries with no countries (yet) set in it,
  * except for the unknown country.
  */
@@ -302,10 +348,418 @@ init_geoip_countries(void)
   strmap_set_lc(country_idxplus1_by_lc_code, "??", (void*)(1));
 }
 
+/** The magic string at the start of every binary GeoIP file. */
+#define GEOIP_BINARY_MAGIC "TORGEOIP"
+/** The length of GEOIP_BINARY_MAGIC. */
+#define GEOIP_BINARY_MAGIC_LEN 8
+/** The version of the binary GeoIP format that we write and understand. */
+#define GEOIP_BINARY_VERSION 1
+/** A number that we store in binary GeoIP files, so that we can tell
+ * whether they were written with our byte order. */
+#define GEOIP_BINARY_BYTE_ORDER 0x01020304
+/** The length of the header of a binary GeoIP file. */
+#define GEOIP_BINARY_HEADER_LEN 64
+/** The offset of the source digest in the header of a binary GeoIP file. */
+#define GEOIP_BINARY_DIGEST_OFF 32
+/** Round <b>n</b> up so that the next part of a binary GeoIP file is
+ * aligned. */
+#define GEOIP_BINARY_ALIGN(n) (((n) + 15) & ~(size_t)15)
+/** The largest number of address ranges we allow in one table.  This keeps
+ * positions in the Eytzinger tree well away from overflowing. */
+#define GEOIP_MAX_RANGES (1u<<28)
+
+/** Return the number that binary GeoIP files use for <b>family</b>.  (We
+ * don't use AF_INET and AF_INET6 themselves, since they differ between
+ * platforms.) */
+static inline uint32_t
+geoip_binary_family(sa_family_t family)
+{
+  return family == AF_INET ? 4 : 6;
+}
+
+/** Compute the layout of a binary GeoIP image for <b>family</b> with
+ * <b>n_ranges</b> address ranges and <b>n_countries</b> country codes.  Set
+ * *<b>keys_off_out</b> and *<b>countries_off_out</b> to the offsets of the
+ * key array and the country array, and return the length of the image. */
+static size_t
+geoip_image_layout(sa_family_t family, uint32_t n_ranges,
+                   uint32_t n_countries,
+                   size_t *keys_off_out, size_t *countries_off_out)
+{
+  const size_t key_len = (family == AF_INET) ?
+    sizeof(uint32_t) : sizeof(geoip_ipv6_key_t);
+  size_t off = GEOIP_BINARY_HEADER_LEN;
+
+  off += GEOIP_BINARY_ALIGN(2 * (size_t)n_countries);
+  *keys_off_out = off;
+  off += GEOIP_BINARY_ALIGN(key_len * ((size_t)n_ranges + 1));
+  *countries_off_out = off;
+  off += sizeof(uint16_t) * ((size_t)n_ranges + 1);
+  return off;
+}
+
+/** Fill in positions <b>k</b> and below of an Eytzinger tree with <b>n</b>
+ * nodes: set <b>perm</b>[j] to the index, in sorted order, of the key that
+ * belongs at position j.  <b>i</b> is the first sorted index that we haven't
+ * placed yet; return the next one. */
+static uint32_t
+geoip_eytzinger_fill(uint32_t *perm, uint32_t n, uint32_t i, uint32_t k)
+{
+  if (k <= n) {
+    i = geoip_eytzinger_fill(perm, n, i, 2*k);
+    perm[k] = i++;
+    i = geoip_eytzinger_fill(perm, n, i, 2*k + 1);
+  }
+  return i;
+}
+
+/** Given the position <b>k</b> where a search of an Eytzinger tree fell off
+ * the bottom, return the position of the first key that was greater than
+ * the one we searched for, or 0 if there was none.
+ *
+ * Each step of the search appended a bit to <b>k</b>: 1 if we went right,
+ * 0 if we went left.  The answer is the last place where we went left, so
+ * we strip the trailing 1 bits and the 0 bit before them. */
+static inline uint32_t
+geoip_eytzinger_result(uint32_t k)
+{
+#ifdef __GNUC__
+  return k >> (__builtin_ctz(~k) + 1);
+#else
+  while (k & 1)
+    k >>= 1;
+  return k >> 1;
+#endif /* defined(__GNUC__) */
+}
+
+/** Return the country that <b>t</b> stores at position <b>k</b>, as an
+ * index into geoip_countries. */
+static inline int
+geoip_table_get_country(const geoip_table_t *t, uint32_t k)
+{
+  const uint16_t c = t->countries[k];
+  return c < t->n_countries ? t->country_map[c] : 0;
+}
+
+/** Set *<b>low_out</b>, *<b>high_out</b>, and *<b>country_out</b> from
+ * <b>ent</b>, an entry for the address family <b>family</b>. */
+static void
+geoip_entry_get_range(sa_family_t family, const void *ent,
+                      geoip_ipv6_key_t *low_out, geoip_ipv6_key_t *high_out,
+                      uint16_t *country_out)
+{
+  if (family == AF_INET) {
+    const geoip_ipv4_entry_t *e = ent;
+    low_out->hi = high_out->hi = 0;
+    low_out->lo = e->ip_low;
+    high_out->lo = e->ip_high;
+    *country_out = (uint16_t) e->country;
+  } else {
+    const geoip_ipv6_entry_t *e = ent;
+    low_out->hi = tor_ntohll(get_uint64(e->ip_low.s6_addr));
+    low_out->lo = tor_ntohll(get_uint64(e->ip_low.s6_addr + 8));
+    high_out->hi = tor_ntohll(get_uint64(e->ip_high.s6_addr));
+    high_out->lo = tor_ntohll(get_uint64(e->ip_high.s6_addr + 8));
+    *country_out = (uint16_t) e->country;
+  }
+}
+
+/** Return true iff <b>a</b> is less than <b>b</b>. */
+static inline int
+geoip_key_lt(const geoip_ipv6_key_t *a, const geoip_ipv6_key_t *b)
+{
+  return a->hi < b->hi || (a->hi == b->hi && a->lo < b->lo);
+}
+
+/** Build a binary GeoIP image for <b>family</b> from the entries we've
+ * parsed for it, with the source digest <b>digest</b>.  Set *<b>len_out</b>
+ * to its length, and return it.
+ *
+ * Addresses that no entry covers go to the unknown country.  If entries
+ * overlap, the one with the lower start address wins. */
+static char *
+geoip_build_image(sa_family_t family, const char *digest, size_t *len_out)
+{
+  smartlist_t *entries = (family == AF_INET) ?
+    geoip_ipv4_entries : geoip_ipv6_entries;
+  const int n_entries = entries ? smartlist_len(entries) : 0;
+  geoip_ipv6_key_t *starts, next, low, high, max;
+  uint16_t *range_countries, country, *countries;
+  uint32_t *perm;
+  uint32_t n = 0, n_countries, k;
+  size_t keys_off, countries_off, len;
+  int done = 0;
+  char *image;
+
+  if (!geoip_countries)
+    init_geoip_countries();
+
+  /* Each entry adds at most one gap and one range, and there may be a gap
+   * at the end. */
+  starts = tor_calloc(2 * (size_t)n_entries + 1, sizeof(geoip_ipv6_key_t));
+  range_countries = tor_calloc(2 * (size_t)n_entries + 1, sizeof(uint16_t));
+
+#define ADD_RANGE(start, c) STMT_BEGIN                        \
+    if (n == 0 || range_countries[n-1] != (c)) {              \
+      starts[n] = (start);                                    \
+      range_countries[n++] = (c);                             \
+    }                                                         \
+  STMT_END
+
+  memset(&next, 0, sizeof(next));
+  max.hi = (family == AF_INET) ? 0 : UINT64_MAX;
+  max.lo = (family == AF_INET) ? UINT32_MAX : UINT64_MAX;
+  if (entries) {
+    smartlist_sort(entries, (family == AF_INET) ?
+                   geoip_ipv4_compare_entries_ : geoip_ipv6_compare_entries_);
+  }
+  for (int i = 0; i < n_entries && !done; ++i) {
+    geoip_entry_get_range(family, smartlist_get(entries, i),
+                          &low, &high, &country);
+    if (geoip_key_lt(&high, &next))
+      continue; /* Covered by earlier entries. */
+    if (geoip_key_lt(&low, &next))
+      low = next;
+    if (geoip_key_lt(&next, &low))
+      ADD_RANGE(next, 0);
+    ADD_RANGE(low, country);
+    if (!geoip_key_lt(&high, &max)) {
+      done = 1;
+    } else {
+      next.lo = high.lo + 1;
+      next.hi = high.hi + (next.lo == 0);
+    }
+  }
+  if (!done)
+    ADD_RANGE(next, 0);
+#undef ADD_RANGE
+
+  n_countries = smartlist_len(geoip_countries);
+  len = geoip_image_layout(family, n, n_countries, &keys_off, &countries_off);
+  image = tor_malloc_zero(len);
+
+  /* The header. */
+  {
+    const uint32_t header[] = {
+      GEOIP_BINARY_VERSION, GEOIP_BINARY_BYTE_ORDER,
+      geoip_binary_family(family), n, n_countries, 0
+    };
+    memcpy(image, GEOIP_BINARY_MAGIC, GEOIP_BINARY_MAGIC_LEN);
+    memcpy(image + GEOIP_BINARY_MAGIC_LEN, header, sizeof(header));
+    memcpy(image + GEOIP_BINARY_DIGEST_OFF, digest, DIGEST_LEN);
+  }
+  /* The country codes. */
+  SMARTLIST_FOREACH(geoip_countries, const geoip_country_t *, c,
+    memcpy(image + GEOIP_BINARY_HEADER_LEN + 2*c_sl_idx, c->countrycode, 2));
+
+  /* The keys and countries, in Eytzinger order. */
+  perm = tor_calloc((size_t)n + 1, sizeof(uint32_t));
+  geoip_eytzinger_fill(perm, n, 0, 1);
+  countries = (uint16_t *)(image + countries_off);
+  countries[0] = range_countries[n-1];
+  for (k = 1; k <= n; ++k) {
+    if (family == AF_INET) {
+      ((uint32_t *)(image + keys_off))[k] = (uint32_t) starts[perm[k]].lo;
+    } else {
+      ((geoip_ipv6_key_t *)(image + keys_off))[k] = starts[perm[k]];
+    }
+    countries[k] = perm[k] ? range_countries[perm[k]-1] : 0;
+  }
+
+  tor_free(perm);
+  tor_free(starts);
+  tor_free(range_countries);
+  *len_out = len;
+  return image;
+}
+
+/** Return a new table for <b>family</b> that uses the binary GeoIP image
+ * of <b>len</b> bytes at <b>image</b>, or NULL if it isn't a valid image.
+ * If it isn't, log why at <b>severity</b>, mentioning <b>filename</b>. */
+static geoip_table_t *
+geoip_table_new_from_image(sa_family_t family, const char *image, size_t len,
+                           const char *filename, int severity)
+{
+  uint32_t header[6];
+  size_t keys_off, countries_off;
+  geoip_table_t *t;
+  const char *problem = NULL;
+
+  if (len < GEOIP_BINARY_HEADER_LEN ||
+      fast_memneq(image, GEOIP_BINARY_MAGIC, GEOIP_BINARY_MAGIC_LEN)) {
+    problem = "not a binary GEOIP file";
+    goto err;
+  }
+  memcpy(header, image + GEOIP_BINARY_MAGIC_LEN, sizeof(header));
+  if (header[0] != GEOIP_BINARY_VERSION) {
+    problem = "unsupported version";
+  } else if (header[1] != GEOIP_BINARY_BYTE_ORDER) {
+    problem = "written on a host with a different byte order";
+  } else if (header[2] != geoip_binary_family(family)) {
+    problem = "wrong address family";
+  } else if (header[3] < 1 || header[3] > GEOIP_MAX_RANGES ||
+             header[4] < 1 || header[4] > COUNTRY_MAX) {
+    problem = "bad table size";
+  } else if (geoip_image_layout(family, header[3], header[4],
+                                &keys_off, &countries_off) != len) {
+    problem = "wrong length";
+  } else if (((uintptr_t)image) & (sizeof(uint64_t) - 1)) {
+    /* LCOV_EXCL_START -- mappings and allocations are always aligned. */
+    problem = "misaligned";
+    /* LCOV_EXCL_STOP */
+  }
+  if (problem)
+    goto err;
+
+  t = tor_malloc_zero(sizeof(geoip_table_t));
+  t->image = image;
+  t->image_len = len;
+  t->n_ranges = header[3];
+  t->n_countries = (uint16_t) header[4];
+  if (family == AF_INET)
+    t->v4_keys = (const uint32_t *)(image + keys_off);
+  else
+    t->v6_keys = (const geoip_ipv6_key_t *)(image + keys_off);
+  t->countries = (const uint16_t *)(image + countries_off);
+
+  /* Find (or add) each of the image's countries in our list. */
+  if (!geoip_countries)
+    init_geoip_countries();
+  t->country_map = tor_calloc(t->n_countries, sizeof(country_t));
+  for (unsigned i = 0; i < t->n_countries; ++i) {
+    char cc[3];
+    memcpy(cc, image + GEOIP_BINARY_HEADER_LEN + 2*i, 2);
+    cc[2] = '\0';
+    if (!TOR_ISPRINT(cc[0]) || TOR_ISSPACE(cc[0]) ||
+        !TOR_ISPRINT(cc[1]) || TOR_ISSPACE(cc[1])) {
+      problem = "bad country code";
+      geoip_table_free(t);
+      goto err;
+    }
+    t->country_map[i] = (country_t) geoip_intern_country(cc);
+  }
+  return t;
+
+ err:
+  log_fn(severity, LD_GENERAL, "Unable to use GEOIP %s file %s: %s.",
+         family == AF_INET ? "IPv4" : "IPv6", escaped(filename), problem);
+  return NULL;
+}
+
+/** Release all storage held by <b>t</b>. */
+static void
+geoip_table_free_(geoip_table_t *t)
+{
+  if (!t)
+    return;
+  tor_free(t->country_map);
+  tor_free(t->image_mem);
+  if (t->image_mmap)
+    tor_munmap_file(t->image_mmap);
+  tor_free(t);
+}
+
+/** Free all the entries we've parsed for <b>family</b>. */
+static void
+geoip_free_entries(sa_family_t family)
+{
+  if (family == AF_INET) {
+    if (geoip_ipv4_entries) {
+      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
+                        tor_free(e));
+      smartlist_free(geoip_ipv4_entries);
+    }
+  } else {
+    if (geoip_ipv6_entries) {
+      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
+                        tor_free(e));
+      smartlist_free(geoip_ipv6_entries);
+    }
+  }
+}
+
+/** Build a new lookup table for <b>family</b> from the entries we've
+ * parsed. */
+static geoip_table_t *
+geoip_table_new_from_entries(sa_family_t family)
+{
+  const char *digest = (family == AF_INET) ? geoip_digest : geoip6_digest;
+  geoip_table_t *t;
+  size_t len;
+  char *image = geoip_build_image(family, digest, &len);
+
+  t = geoip_table_new_from_image(family, image, len, "(built)", LOG_WARN);
+  if (BUG(!t)) {
+    /* LCOV_EXCL_START */
+    tor_free(image);
+    return NULL;
+    /* LCOV_EXCL_STOP */
+  }
+  t->image_mem = image;
+  return t;
+}
+
+/** Return the lookup table for <b>family</b>, building it from the entries
+ * we've parsed if we need to, or NULL if we have no GeoIP information for
+ * <b>family</b>. */
+static const geoip_table_t *
+geoip_get_table(sa_family_t family)
+{
+  if (family == AF_INET) {
+    if (PREDICT_UNLIKELY(!geoip_ipv4_table && geoip_ipv4_entries))
+      geoip_ipv4_table = geoip_table_new_from_entries(AF_INET);
+    return geoip_ipv4_table;
+  } else {
+    if (PREDICT_UNLIKELY(!geoip_ipv6_table && geoip_ipv6_entries))
+      geoip_ipv6_table = geoip_table_new_from_entries(AF_INET6);
+    return geoip_ipv6_table;
+  }
+}
+
+/** Map the binary GeoIP file <b>filename</b>, and use it as our table for
+ * <b>family</b>.  Return 0 on success, -1 on failure. */
+static int
+geoip_load_binary_file(sa_family_t family, const char *filename,
+                       int severity)
+{
+  tor_mmap_t *m = tor_mmap_file(filename);
+  geoip_table_t *t;
+
+  if (!m) {
+    log_fn(severity, LD_GENERAL, "Failed to map GEOIP file %s.", filename);
+    return -1;
+  }
+  t = geoip_table_new_from_image(family, m->data, m->size, filename,
+                                 severity);
+  if (!t) {
+    tor_munmap_file(m);
+    return -1;
+  }
+  t->image_mmap = m;
+
+  geoip_free_entries(family);
+  if (family == AF_INET) {
+    geoip_table_free(geoip_ipv4_table);
+    geoip_ipv4_table = t;
+    memcpy(geoip_digest, t->image + GEOIP_BINARY_DIGEST_OFF, DIGEST_LEN);
+  } else {
+    geoip_table_free(geoip_ipv6_table);
+    geoip_ipv6_table = t;
+    memcpy(geoip6_digest, t->image + GEOIP_BINARY_DIGEST_OFF, DIGEST_LEN);
+  }
+  log_notice(LD_GENERAL, "Mapped binary GEOIP %s file %s, with %u ranges.",
+             (family == AF_INET) ? "IPv4" : "IPv6", filename,
+             (unsigned) t->n_ranges);
+  return 0;
+}
+
 /** Clear appropriate GeoIP database, based on <b>family</b>, and
  * reload it from the file <b>filename</b>. Return 0 on success, -1 on
  * failure.
  *
+ * If the file starts with GEOIP_BINARY_MAGIC, it's a binary file written by
+ * geoip_write_binary_file(), and we map it.  Otherwise, it's a text file.
+ *
  * Recognized line formats for IPv4 are:
  *   INTIPLOW,INTIPHIGH,CC
  * and
@@ -325,6 +779,7 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
 {
   FILE *f;
   crypto_digest_t *geoip_digest_env = NULL;
+  char magic[GEOIP_BINARY_MAGIC_LEN];
 
   tor_assert(family == AF_INET || family == AF_INET6);
 
@@ -336,19 +791,19 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
   if (!geoip_countries)
     init_geoip_countries();
 
+  if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+      fast_memeq(magic, GEOIP_BINARY_MAGIC, sizeof(magic))) {
+    fclose(f);
+    return geoip_load_binary_file(family, filename, severity);
+  }
+  rewind(f);
+
+  geoip_free_entries(family);
   if (family == AF_INET) {
-    if (geoip_ipv4_entries) {
-      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv4_entries);
-    }
+    geoip_table_free(geoip_ipv4_table);
     geoip_ipv4_entries = smartlist_new();
   } else { /* AF_INET6 */
-    if (geoip_ipv6_entries) {
-      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv6_entries);
-    }
+    geoip_table_free(geoip_ipv6_table);
     geoip_ipv6_entries = smartlist_new();
   }
   geoip_digest_env = crypto_digest_new();
@@ -366,21 +821,52 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
   /*XXXX abort and return -1 if no entries/illformed?*/
   fclose(f);
 
-  /* Sort list and remember file digests so that we can include it in
-   * our extra-info descriptors. */
+  /* Remember file digests so that we can include it in our extra-info
+   * descriptors, then build the lookup table: we don't need the parsed
+   * entries after that. */
   if (family == AF_INET) {
-    smartlist_sort(geoip_ipv4_entries, geoip_ipv4_compare_entries_);
     crypto_digest_get_digest(geoip_digest_env, geoip_digest, DIGEST_LEN);
+    geoip_ipv4_table = geoip_table_new_from_entries(AF_INET);
   } else {
     /* AF_INET6 */
-    smartlist_sort(geoip_ipv6_entries, geoip_ipv6_compare_entries_);
     crypto_digest_get_digest(geoip_digest_env, geoip6_digest, DIGEST_LEN);
+    geoip_ipv6_table = geoip_table_new_from_entries(AF_INET6);
   }
   crypto_digest_free(geoip_digest_env);
+  geoip_free_entries(family);
 
   return 0;
 }
 
+/** Write our GeoIP table for <b>family</b> to <b>filename</b> in binary
+ * form, so that geoip_load_file() can map it later instead of parsing it.
+ * Return 0 on success, -1 on failure.
+ *
+ * A binary GeoIP file holds, with all integers in the byte order of the
+ * host that wrote it:
+ *   - A 64-byte header: the 8 bytes of GEOIP_BINARY_MAGIC; the 32-bit
+ *     version, byte order mark, address family (4 or 6), number of address
+ *     ranges N, number of country codes C, and a reserved 0; the SHA1
+ *     digest of the text file that the table came from; and zero padding.
+ *   - C two-letter country codes, padded to a multiple of 16 bytes.
+ *   - N+1 range start addresses in the order described for geoip_table_t:
+ *     32-bit integers for IPv4, or pairs of 64-bit integers (high half
+ *     first) for IPv6.  Padded to a multiple of 16 bytes.
+ *   - N+1 16-bit country numbers, as described for geoip_table_t, each an
+ *     index into the country codes.
+ */
+int
+geoip_write_binary_file(sa_family_t family, const char *filename)
+{
+  const geoip_table_t *t;
+
+  tor_assert(family == AF_INET || family == AF_INET6);
+  t = geoip_get_table(family);
+  if (!t)
+    return -1;
+  return write_bytes_to_file(filename, t->image, t->image_len, 1);
+}
+
 /** Given an IP address in host order, return a number representing the
  * country to which that address belongs, -1 for "No geoip information
  * available", or 0 for the 'unknown country'.  The return value will always
@@ -390,12 +876,17 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
 int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
 {
-  geoip_ipv4_entry_t *ent;
-  if (!geoip_ipv4_entries)
+  const geoip_table_t *t = geoip_get_table(AF_INET);
+  const uint32_t *keys;
+  uint32_t k = 1, n;
+
+  if (!t)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv4_entries, &ipaddr,
-                          geoip_ipv4_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  keys = t->v4_keys;
+  n = t->n_ranges;
+  while (k <= n)
+    k = 2*k + (keys[k] <= ipaddr);
+  return geoip_table_get_country(t, geoip_eytzinger_result(k));
 }
 
 /** Given an IPv6 address, return a number representing the country to
@@ -406,13 +897,23 @@ geoip_get_country_by_ipv4(uint32_t ipaddr)
 int
 geoip_get_country_by_ipv6(const struct in6_addr *addr)
 {
-  geoip_ipv6_entry_t *ent;
+  const geoip_table_t *t = geoip_get_table(AF_INET6);
+  const geoip_ipv6_key_t *keys;
+  uint64_t hi, lo;
+  uint32_t k = 1, n;
 
-  if (!geoip_ipv6_entries)
+  if (!t)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv6_entries, addr,
-                          geoip_ipv6_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  hi = tor_ntohll(get_uint64(addr->s6_addr));
+  lo = tor_ntohll(get_uint64(addr->s6_addr + 8));
+  keys = t->v6_keys;
+  n = t->n_ranges;
+  while (k <= n) {
+    const int le = (keys[k].hi < hi) |
+      ((keys[k].hi == hi) & (keys[k].lo <= lo));
+    k = 2*k + le;
+  }
+  return geoip_table_get_country(t, geoip_eytzinger_result(k));
 }
 
 /** Given an IP address, return a number representing the country to which
@@ -461,9 +962,9 @@ geoip_is_loaded,(sa_family_t family))
   if (geoip_countries == NULL)
     return 0;
   if (family == AF_INET)
-    return geoip_ipv4_entries != NULL;
+    return geoip_ipv4_table != NULL || geoip_ipv4_entries != NULL;
   else                          /* AF_INET6 */
-    return geoip_ipv6_entries != NULL;
+    return geoip_ipv6_table != NULL || geoip_ipv6_entries != NULL;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -489,20 +990,12 @@ clear_geoip_db(void)
   }
 
   strmap_free(country_idxplus1_by_lc_code, NULL);
-  if (geoip_ipv4_entries) {
-    SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv4_entries);
-  }
-  if (geoip_ipv6_entries) {
-    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv6_entries);
-  }
+  geoip_free_entries(AF_INET);
+  geoip_free_entries(AF_INET6);
+  geoip_table_free(geoip_ipv4_table);
+  geoip_table_free(geoip_ipv6_table);
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
-  geoip_ipv4_entries = NULL;
-  geoip_ipv6_entries = NULL;
 }
 
 /** Release all storage held in this file. */
@@ -0,0 +1,323 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file slab.c
+ * \brief A slab allocator for large numbers of fixed-size objects.
+ *
+ * Some of our objects, such as packed cells, are allocated and freed at a
+ * tremendous rate on a busy relay.  Sending each of them through the system
+ * allocator costs CPU, and over a long run it fragments the heap.  A
+ * slab_pool_t instead carves objects of a single size out of large slabs,
+ * and keeps the objects that are released on a per-slab freelist for
+ * reuse.
+ *
+ * Every object is aligned to SLAB_OBJ_ALIGN bytes, so that no two objects
+ * share a cache line.  Each object is followed by a pointer back to its
+ * slab, so that releasing an object is O(1).  When a slab becomes entirely
+ * unused, we give it back to the system allocator unless it is the only
+ * empty slab we have: keeping one around avoids thrashing when the number
+ * of live objects hovers at a slab boundary.
+ *
+ * Slab pools are not threadsafe.
+ **/
+
+#include "orconfig.h"
+#include "lib/malloc/slab.h"
+#include "lib/malloc/malloc.h"
+#include "lib/err/torerr.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/** Largest number of entirely unused slabs that a pool keeps around. */
+#define SLAB_MAX_EMPTY 1
+
+typedef struct slab_t slab_t;
+
+/** A single slab: one allocation, holding up to its pool's
+ * <b>objs_per_slab</b> objects. */
+struct slab_t {
+  /** Links in our pool's list of slabs that have free objects. */
+  slab_t *next;
+  slab_t *prev;
+  /** Links in our pool's list of all its slabs. */
+  slab_t *all_next;
+  slab_t *all_prev;
+  /** The pool that owns this slab. */
+  slab_pool_t *pool;
+  /** The memory we got from tor_malloc; <b>objects</b> points into it. */
+  void *mem;
+  /** First object in this slab, aligned to SLAB_OBJ_ALIGN. */
+  char *objects;
+  /** Singly linked list of released objects in this slab, linked through
+   * their first bytes. */
+  void *freelist;
+  /** Number of objects currently handed out from this slab. */
+  size_t n_used;
+  /** Number of objects at the start of this slab that we have ever handed
+   * out. Objects past this point are free but not on the freelist. */
+  size_t n_carved;
+  /** True iff this slab is on its pool's list of available slabs. */
+  unsigned on_avail_list : 1;
+};
+
+/** A pool of fixed-size objects, allocated from slabs. */
+struct slab_pool_t {
+  /** Name of this pool, for logging. */
+  const char *name;
+  /** Size of each object, as requested by the user. */
+  size_t obj_size;
+  /** Offset from each object to the pointer back to its slab. */
+  size_t trailer_offset;
+  /** Distance between consecutive objects in a slab. */
+  size_t stride;
+  /** Number of objects that fit in one slab. */
+  size_t objs_per_slab;
+  /** Doubly linked list of slabs that have at least one free object. */
+  slab_t *avail;
+  /** Doubly linked list of all our slabs. */
+  slab_t *all;
+  /** Number of slabs currently allocated. */
+  size_t n_slabs;
+  /** Number of slabs whose <b>n_used</b> is zero. */
+  size_t n_empty;
+  /** Number of objects currently handed out from all slabs. */
+  size_t n_used;
+};
+
+/** Round <b>n</b> up to the nearest multiple of <b>align</b>, which must be
+ * a power of two. */
+static inline size_t
+round_up_to(size_t n, size_t align)
+{
+  return (n + align - 1) & ~(align - 1);
+}
+
+/** Return a pointer to the slab-pointer trailer of <b>obj</b>. */
+static inline slab_t **
+slab_obj_trailer(const slab_pool_t *pool, void *obj)
+{
+  return (slab_t **)(((char *)obj) + pool->trailer_offset);
+}
+
+/** Create and return a new pool for objects of <b>obj_size</b> bytes,
+ * carved out of slabs that each hold <b>objs_per_slab</b> objects.
+ * <b>name</b> must be a string constant; it is used for logging. */
+slab_pool_t *
+slab_pool_new(const char *name, size_t obj_size, size_t objs_per_slab)
+{
+  slab_pool_t *pool;
+  raw_assert(obj_size > 0);
+  raw_assert(objs_per_slab > 0);
+
+  pool = tor_malloc_zero(sizeof(slab_pool_t));
+  pool->name = name;
+  pool->obj_size = obj_size;
+  /* We need room in each free object for the freelist pointer. */
+  if (obj_size < sizeof(void *))
+    obj_size = sizeof(void *);
+  pool->trailer_offset = round_up_to(obj_size, sizeof(void *));
+  pool->stride = round_up_to(pool->trailer_offset + sizeof(slab_t *),
+                             SLAB_OBJ_ALIGN);
+  pool->objs_per_slab = objs_per_slab;
+  return pool;
+}
+
+/** Add <b>slab</b> to the front of its pool's list of available slabs. */
+static void
+slab_link_avail(slab_pool_t *pool, slab_t *slab)
+{
+  raw_assert(! slab->on_avail_list);
+  slab->prev = NULL;
+  slab->next = pool->avail;
+  if (pool->avail)
+    pool->avail->prev = slab;
+  pool->avail = slab;
+  slab->on_avail_list = 1;
+}
+
+/** Remove <b>slab</b> from its pool's list of available slabs. */
+static void
+slab_unlink_avail(slab_pool_t *pool, slab_t *slab)
+{
+  raw_assert(slab->on_avail_list);
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    pool->avail = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  slab->next = slab->prev = NULL;
+  slab->on_avail_list = 0;
+}
+
+/** Allocate a new, empty slab for <b>pool</b>, and put it on the list of
+ * available slabs. */
+static slab_t *
+slab_new(slab_pool_t *pool)
+{
+  slab_t *slab = tor_malloc_zero(sizeof(slab_t));
+  uintptr_t base;
+
+  slab->pool = pool;
+  slab->mem = tor_malloc(pool->stride * pool->objs_per_slab +
+                         SLAB_OBJ_ALIGN - 1);
+  base = round_up_to((uintptr_t)slab->mem, SLAB_OBJ_ALIGN);
+  slab->objects = (char *)base;
+
+  slab->all_next = pool->all;
+  if (pool->all)
+    pool->all->all_prev = slab;
+  pool->all = slab;
+
+  ++pool->n_slabs;
+  ++pool->n_empty;
+  slab_link_avail(pool, slab);
+  return slab;
+}
+
+/** Return <b>slab</b> to the system allocator, along with any objects
+ * still allocated from it. */
+static void
+slab_free(slab_pool_t *pool, slab_t *slab)
+{
+  if (slab->on_avail_list)
+    slab_unlink_avail(pool, slab);
+  if (slab->all_prev)
+    slab->all_prev->all_next = slab->all_next;
+  else
+    pool->all = slab->all_next;
+  if (slab->all_next)
+    slab->all_next->all_prev = slab->all_prev;
+
+  --pool->n_slabs;
+  if (slab->n_used == 0)
+    --pool->n_empty;
+  pool->n_used -= slab->n_used;
+  tor_free(slab->mem);
+  tor_free(slab);
+}
+
+/** Release all storage held by <b>pool</b>. Any objects still allocated
+ * from it become invalid. */
+void
+slab_pool_free_(slab_pool_t *pool)
+{
+  slab_t *slab, *next;
+  if (!pool)
+    return;
+  for (slab = pool->all; slab; slab = next) {
+    next = slab->all_next;
+    slab_free(pool, slab);
+  }
+  raw_assert(pool->n_slabs == 0);
+  tor_free(pool);
+}
+
+/** Return a new object from <b>pool</b>. Its contents are unspecified. */
+void *
+slab_pool_alloc(slab_pool_t *pool)
+{
+  slab_t *slab = pool->avail;
+  void *obj;
+
+  if (!slab)
+    slab = slab_new(pool);
+
+  if (slab->freelist) {
+    obj = slab->freelist;
+    memcpy(&slab->freelist, obj, sizeof(void *));
+  } else {
+    raw_assert(slab->n_carved < pool->objs_per_slab);
+    obj = slab->objects + pool->stride * slab->n_carved++;
+    *slab_obj_trailer(pool, obj) = slab;
+  }
+
+  if (slab->n_used++ == 0)
+    --pool->n_empty;
+  ++pool->n_used;
+
+  if (slab->n_used == pool->objs_per_slab)
+    slab_unlink_avail(pool, slab);
+
+  return obj;
+}
+
+/** Return <b>obj</b>, which must have come from slab_pool_alloc() on
+ * <b>pool</b>, to <b>pool</b>. */
+void
+slab_pool_release(slab_pool_t *pool, void *obj)
+{
+  slab_t *slab;
+  if (!obj)
+    return;
+
+  slab = *slab_obj_trailer(pool, obj);
+  raw_assert(slab->pool == pool);
+  raw_assert(slab->n_used > 0);
+
+  memcpy(obj, &slab->freelist, sizeof(void *));
+  slab->freelist = obj;
+
+  if (! slab->on_avail_list)
+    slab_link_avail(pool, slab);
+
+  --pool->n_used;
+  if (--slab->n_used == 0) {
+    ++pool->n_empty;
+    if (pool->n_empty > SLAB_MAX_EMPTY)
+      slab_free(pool, slab);
+  }
+}
+
+/** Return every entirely unused slab in <b>pool</b> to the system
+ * allocator.  Return the number of bytes released. */
+size_t
+slab_pool_trim(slab_pool_t *pool)
+{
+  slab_t *slab, *next;
+  size_t n_freed = 0;
+
+  for (slab = pool->avail; slab && pool->n_empty; slab = next) {
+    next = slab->next;
+    if (slab->n_used == 0) {
+      slab_free(pool, slab);
+      ++n_freed;
+    }
+  }
+  return n_freed * (pool->stride * pool->objs_per_slab + SLAB_OBJ_ALIGN - 1);
+}
+
+/** Return the name that <b>pool</b> was created with. */
+const char *
+slab_pool_get_name(const slab_pool_t *pool)
+{
+  return pool->name;
+}
+
+/** Return the size of the objects allocated from <b>pool</b>. */
+size_t
+slab_pool_get_obj_size(const slab_pool_t *pool)
+{
+  return pool->obj_size;
+}
+
+/** Return the number of objects currently allocated from <b>pool</b>. */
+size_t
+slab_pool_get_n_used(const slab_pool_t *pool)
+{
+  return pool->n_used;
+}
+
+/** Fill <b>out</b> with usage statistics for <b>pool</b>. */
+void
+slab_pool_get_stats(const slab_pool_t *pool, slab_pool_stats_t *out)
+{
+  memset(out, 0, sizeof(*out));
+  out->n_used = pool->n_used;
+  out->n_slabs = pool->n_slabs;
+  out->n_free = pool->n_slabs * pool->objs_per_slab - pool->n_used;
+  out->bytes_allocated = pool->n_slabs *
+    (pool->stride * pool->objs_per_slab + SLAB_OBJ_ALIGN - 1);
+}
@@ -0,0 +1,47 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file slab.h
+ * \brief Headers for slab.c
+ **/
+
+#ifndef TOR_SLAB_H
+#define TOR_SLAB_H
+
+#include "lib/malloc/malloc.h"
+#include <stddef.h>
+
+/** Alignment, in bytes, of every object returned by slab_pool_alloc(). */
+#define SLAB_OBJ_ALIGN 64
+
+typedef struct slab_pool_t slab_pool_t;
+
+/** Usage statistics for a slab_pool_t. */
+typedef struct slab_pool_stats_t {
+  /** Number of objects currently handed out. */
+  size_t n_used;
+  /** Number of objects we could hand out without allocating a new slab. */
+  size_t n_free;
+  /** Number of slabs currently allocated. */
+  size_t n_slabs;
+  /** Total number of bytes held by the pool's slabs. */
+  size_t bytes_allocated;
+} slab_pool_stats_t;
+
+slab_pool_t *slab_pool_new(const char *name, size_t obj_size,
+                           size_t objs_per_slab);
+void slab_pool_free_(slab_pool_t *pool);
+#define slab_pool_free(pool) \
+  FREE_AND_NULL(slab_pool_t, slab_pool_free_, (pool))
+
+void *slab_pool_alloc(slab_pool_t *pool);
+void slab_pool_release(slab_pool_t *pool, void *obj);
+size_t slab_pool_trim(slab_pool_t *pool);
+
+const char *slab_pool_get_name(const slab_pool_t *pool);
+size_t slab_pool_get_obj_size(const slab_pool_t *pool);
+size_t slab_pool_get_n_used(const slab_pool_t *pool);
+void slab_pool_get_stats(const slab_pool_t *pool, slab_pool_stats_t *out);
+
+#endif /* !defined(TOR_SLAB_H) */
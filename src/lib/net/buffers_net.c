@@ -12,19 +12,54 @@
 #define BUFFERS_PRIVATE
 #include "lib/net/buffers_net.h"
 #include "lib/buf/buffers.h"
+#include "lib/intmath/cmp.h"
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
 #include "lib/net/nettypes.h"
+#include "lib/net/uring.h"
 
 #ifdef _WIN32
 #include <winsock2.h>
 #endif
 
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && defined(HAVE_WRITEV)
+/** Defined if we can read into and write from several chunks at once with
+ * readv() and writev(). */
+#define USE_BUF_IOVEC
+#endif
+
+#ifdef USE_BUF_IOVEC
+/** Largest number of chunks that we hand to a single writev() call. */
+#define BUF_MAX_WRITE_IOVECS 64
+#if defined(IOV_MAX) && IOV_MAX < BUF_MAX_WRITE_IOVECS
+#undef BUF_MAX_WRITE_IOVECS
+#define BUF_MAX_WRITE_IOVECS IOV_MAX
+#endif
+/** Largest number of freshly allocated chunks that we hand to a single
+ * readv() call, in addition to the space left in the buffer's tail.  We
+ * keep this small, since any chunk that the kernel doesn't fill gets freed
+ * right away. */
+#define BUF_MAX_READ_NEW_CHUNKS 4
+#endif /* defined(USE_BUF_IOVEC) */
+
+#if defined(USE_BUF_IOVEC) && defined(HAVE_TOR_URING)
+/** Defined if we can read and write buffers in batches with io_uring. */
+#define USE_BUF_URING
+#endif
 
 #ifdef PARANOIA
 /** Helper: If PARANOIA is defined, assert that the buffer in local variable
@@ -34,6 +69,7 @@
 #define check() STMT_NIL
 #endif /* defined(PARANOIA) */
 
+#ifndef USE_BUF_IOVEC
 /** Read up to <b>at_most</b> bytes from the file descriptor <b>fd</b> into
  * <b>chunk</b> (which must be on <b>buf</b>). If we get an EOF, set
  * *<b>reached_eof</b> to 1. Uses <b>tor_socket_recv()</b> iff <b>is_socket</b>
@@ -80,6 +116,155 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
     return (int)read_result;
   }
 }
+#endif /* !defined(USE_BUF_IOVEC) */
+
+#ifdef USE_BUF_IOVEC
+/** The free space that a single scattered read into a buffer may fill: the
+ * end of the buffer's tail chunk, and some new chunks that are not yet on
+ * the buffer. */
+typedef struct buf_read_space_t {
+  /** The buffer's tail chunk, if we're reading into it; else NULL. */
+  chunk_t *tail;
+  /** Newly allocated chunks, in the order we offered them. */
+  chunk_t *new_chunks[BUF_MAX_READ_NEW_CHUNKS];
+  /** Number of entries in <b>new_chunks</b>. */
+  int n_new;
+} buf_read_space_t;
+
+/** Find room for up to <b>want</b> more bytes at the end of <b>buf</b>:
+ * the free space in its tail chunk and as many new chunks as needed.
+ * Describe it in <b>space</b>, and in the iovecs at <b>iov</b>, which must
+ * have room for BUF_MAX_READ_NEW_CHUNKS + 1 entries.  Set
+ * *<b>offered_out</b> to the total amount of space we found.  Return the
+ * number of iovecs we used.
+ *
+ * The caller must pass <b>space</b> to buf_read_space_commit() once the
+ * read is done, whether or not it read anything. */
+static int
+buf_read_space_prepare(buf_t *buf, size_t want, buf_read_space_t *space,
+                       struct iovec *iov, size_t *offered_out)
+{
+  int n_iov = 0;
+  size_t offered = 0;
+
+  memset(space, 0, sizeof(*space));
+  if (buf->tail && CHUNK_REMAINING_CAPACITY(buf->tail) >= MIN_READ_LEN) {
+    space->tail = buf->tail;
+    iov[n_iov].iov_base = CHUNK_WRITE_PTR(space->tail);
+    iov[n_iov].iov_len = MIN(CHUNK_REMAINING_CAPACITY(space->tail), want);
+    offered += iov[n_iov++].iov_len;
+  }
+  while (offered < want && space->n_new < BUF_MAX_READ_NEW_CHUNKS) {
+    chunk_t *chunk = buf_new_chunk_with_capacity(buf, want - offered, 1);
+    space->new_chunks[space->n_new++] = chunk;
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = MIN(chunk->memlen, want - offered);
+    offered += iov[n_iov++].iov_len;
+  }
+  *offered_out = offered;
+  return n_iov;
+}
+
+/** Account for <b>n_read</b> bytes that were read into <b>space</b>, which
+ * we got from buf_read_space_prepare() on <b>buf</b> and <b>iov</b>: add
+ * them to <b>buf</b> in the order we offered them, and free any new chunks
+ * that didn't get any data. */
+static void
+buf_read_space_commit(buf_t *buf, buf_read_space_t *space,
+                      const struct iovec *iov, size_t n_read)
+{
+  size_t left = n_read;
+  int i;
+
+  if (space->tail) {
+    size_t n = MIN(left, iov[0].iov_len);
+    space->tail->datalen += n;
+    buf->datalen += n;
+    left -= n;
+  }
+  for (i = 0; i < space->n_new; ++i) {
+    chunk_t *chunk = space->new_chunks[i];
+    if (left) {
+      chunk->datalen = MIN(left, chunk->memlen);
+      left -= chunk->datalen;
+      buf_append_chunk(buf, chunk);
+    } else {
+      buf_chunk_free_unchecked(chunk);
+    }
+  }
+  tor_assert(left == 0);
+  space->n_new = 0;
+}
+
+/** Describe up to <b>sz</b> bytes from the first chunks of <b>buf</b> in
+ * the iovecs at <b>iov</b>, which must have room for BUF_MAX_WRITE_IOVECS
+ * entries.  Set *<b>total_out</b> to the number of bytes described.
+ * Return the number of iovecs we used. */
+static int
+buf_flush_iov_prepare(const buf_t *buf, size_t sz, struct iovec *iov,
+                      size_t *total_out)
+{
+  const chunk_t *chunk;
+  int n_iov = 0;
+  size_t total = 0;
+
+  for (chunk = buf->head; chunk && total < sz && n_iov < BUF_MAX_WRITE_IOVECS;
+       chunk = chunk->next) {
+    size_t len = MIN(chunk->datalen, sz - total);
+    if (len == 0)
+      continue;
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = len;
+    ++n_iov;
+    total += len;
+  }
+  *total_out = total;
+  return n_iov;
+}
+
+/** Read up to *<b>at_most</b> bytes from the file descriptor <b>fd</b> onto
+ * the end of <b>buf</b> with a single readv() call, scattering them into the
+ * free space at the end of <b>buf</b>'s tail chunk and into as many new
+ * chunks as needed.  Set *<b>at_most</b> to the number of bytes we actually
+ * asked for.  Other arguments and return values are as for
+ * read_to_chunk(). */
+static int
+read_to_chunks_iovec(buf_t *buf, tor_socket_t fd, size_t *at_most,
+                     int *reached_eof, int *error, bool is_socket)
+{
+  struct iovec iov[BUF_MAX_READ_NEW_CHUNKS + 1];
+  buf_read_space_t space;
+  int n_iov;
+  ssize_t read_result;
+
+  n_iov = buf_read_space_prepare(buf, *at_most, &space, iov, at_most);
+
+  read_result = readv(fd, iov, n_iov);
+
+  buf_read_space_commit(buf, &space, iov,
+                        read_result > 0 ? (size_t) read_result : 0);
+
+  if (read_result < 0) {
+    int e = is_socket ? tor_socket_errno(fd) : errno;
+
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      if (error)
+        *error = e;
+      return -1;
+    }
+    return 0; /* would block. */
+  } else if (read_result == 0) {
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+    *reached_eof = 1;
+    return 0;
+  }
+
+  log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
+            (int)buf->datalen);
+  tor_assert(read_result <= BUF_MAX_LEN);
+  return (int)read_result;
+}
+#endif /* defined(USE_BUF_IOVEC) */
 
 /** Read from file descriptor <b>fd</b>, writing onto end of <b>buf</b>.  Read
  * at most <b>at_most</b> bytes, growing the buffer as necessary.  If recv()
@@ -110,6 +295,10 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
 
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
+#ifdef USE_BUF_IOVEC
+    r = read_to_chunks_iovec(buf, fd, &readlen,
+                             reached_eof, socket_error, is_socket);
+#else
     chunk_t *chunk;
     if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
       chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
@@ -124,6 +313,7 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
 
     r = read_to_chunk(buf, chunk, fd, readlen,
                       reached_eof, socket_error, is_socket);
+#endif /* defined(USE_BUF_IOVEC) */
     check();
     if (r < 0)
       return r; /* Error */
@@ -136,6 +326,7 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
   return (int)total_read;
 }
 
+#ifndef USE_BUF_IOVEC
 /** Helper for buf_flush_to_socket(): try to write <b>sz</b> bytes from chunk
  * <b>chunk</b> of buffer <b>buf</b> onto file descriptor <b>fd</b>.  Return
  * the number of bytes written on success, 0 on blocking, -1 on failure.
@@ -172,6 +363,41 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
     return (int)write_result;
   }
 }
+#endif /* !defined(USE_BUF_IOVEC) */
+
+#ifdef USE_BUF_IOVEC
+/** Helper for buf_flush_to_fd(): try to write up to <b>sz</b> bytes from
+ * the first chunks of <b>buf</b> onto the file descriptor <b>fd</b> with a
+ * single writev() call.  Set *<b>flushlen_out</b> to the number of bytes we
+ * actually tried to write.  Return values are as for flush_chunk().
+ */
+static int
+flush_chunks_iovec(tor_socket_t fd, buf_t *buf, size_t sz,
+                   size_t *flushlen_out, bool is_socket)
+{
+  struct iovec iov[BUF_MAX_WRITE_IOVECS];
+  int n_iov;
+  ssize_t write_result;
+
+  n_iov = buf_flush_iov_prepare(buf, sz, iov, flushlen_out);
+
+  write_result = writev(fd, iov, n_iov);
+
+  if (write_result < 0) {
+    int e = is_socket ? tor_socket_errno(fd) : errno;
+
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"writev() would block, returning.");
+    return 0;
+  } else {
+    buf_drain(buf, write_result);
+    tor_assert(write_result <= BUF_MAX_LEN);
+    return (int)write_result;
+  }
+}
+#endif /* defined(USE_BUF_IOVEC) */
 
 /** Write data from <b>buf</b> to the file descriptor <b>fd</b>.  Write at most
  * <b>sz</b> bytes, and remove the written bytes
@@ -201,7 +427,11 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
     else
       flushlen0 = buf->head->datalen;
 
+#ifdef USE_BUF_IOVEC
+    r = flush_chunks_iovec(fd, buf, sz, &flushlen0, is_socket);
+#else
     r = flush_chunk(fd, buf, buf->head, flushlen0, is_socket);
+#endif
     check();
     if (r < 0)
       return r;
@@ -263,3 +493,294 @@ buf_read_from_pipe(buf_t *buf, int fd, size_t at_most,
 {
   return buf_read_from_fd(buf, fd, at_most, reached_eof, socket_error, false);
 }
+
+#ifdef USE_BUF_URING
+/** A single read or write in a buf_uring_batch_t. */
+typedef struct buf_uring_op_t {
+  /** The buffer we're reading into or writing from. */
+  buf_t *buf;
+  /** True iff this is a read. */
+  bool is_read;
+  /** True iff the kernel has finished this operation. */
+  bool done;
+  /** The message header we hand the kernel; it points at <b>iov</b>. */
+  struct msghdr msg;
+  /** The chunk memory we're reading into or writing from. */
+  struct iovec iov[BUF_MAX_WRITE_IOVECS];
+  /** For reads: the space described by <b>iov</b>. */
+  buf_read_space_t space;
+  /** Once <b>done</b>: the result, as from buf_read_from_socket() or
+   * buf_flush_to_socket(). */
+  int result;
+  /** Once <b>done</b>: true iff a read reached end-of-file. */
+  int reached_eof;
+  /** Once <b>done</b>: the error, if <b>result</b> is -1. */
+  int socket_error;
+} buf_uring_op_t;
+
+/** A batch of socket reads and writes on buffers, which we hand to the
+ * kernel all at once with io_uring. */
+struct buf_uring_batch_t {
+  /** Our io_uring, or NULL if it has failed. */
+  tor_uring_t *ring;
+  /** Largest number of operations we allow in this batch. */
+  int max_ops;
+  /** Number of operations in this batch so far. */
+  int n_ops;
+  /** True iff we've run this batch since it was last cleared. */
+  bool has_run;
+  /** Array of <b>max_ops</b> operations. */
+  buf_uring_op_t *ops;
+};
+#endif /* defined(USE_BUF_URING) */
+
+/** Create and return a new batch that can hold up to <b>max_ops</b>
+ * socket reads and writes.  Return NULL if we can't use io_uring here. */
+buf_uring_batch_t *
+buf_uring_batch_new(unsigned max_ops)
+{
+#ifdef USE_BUF_URING
+  buf_uring_batch_t *batch;
+  tor_uring_t *ring = tor_uring_new(max_ops);
+  if (!ring)
+    return NULL;
+  batch = tor_malloc_zero(sizeof(buf_uring_batch_t));
+  batch->ring = ring;
+  batch->max_ops = (int) MIN(max_ops, tor_uring_get_capacity(ring));
+  batch->ops = tor_calloc(batch->max_ops, sizeof(buf_uring_op_t));
+  return batch;
+#else
+  (void)max_ops;
+  return NULL;
+#endif /* defined(USE_BUF_URING) */
+}
+
+/** Release all storage held by <b>batch</b>, which must not have any
+ * operations that have not yet been run. */
+void
+buf_uring_batch_free_(buf_uring_batch_t *batch)
+{
+#ifdef USE_BUF_URING
+  if (!batch)
+    return;
+  buf_uring_batch_clear(batch);
+  tor_uring_free(batch->ring);
+  tor_free(batch->ops);
+  tor_free(batch);
+#else
+  (void)batch;
+#endif /* defined(USE_BUF_URING) */
+}
+
+/** Return true iff we can't add any more operations to <b>batch</b>. */
+int
+buf_uring_batch_is_full(const buf_uring_batch_t *batch)
+{
+#ifdef USE_BUF_URING
+  return !batch->ring || batch->has_run || batch->n_ops >= batch->max_ops;
+#else
+  (void)batch;
+  return 1;
+#endif
+}
+
+/** Add to <b>batch</b> a read of up to <b>at_most</b> bytes from the
+ * socket <b>s</b> onto the end of <b>buf</b>.  A buffer may have only one
+ * operation in a batch.  Return an index for use with
+ * buf_uring_batch_get_result(), or -1 if the batch is full. */
+int
+buf_uring_batch_add_read(buf_uring_batch_t *batch, buf_t *buf,
+                         tor_socket_t s, size_t at_most)
+{
+#ifdef USE_BUF_URING
+  buf_uring_op_t *op;
+  size_t offered;
+  int n_iov;
+
+  if (buf_uring_batch_is_full(batch))
+    return -1;
+  if (BUG(buf->datalen > BUF_MAX_LEN - at_most))
+    return -1;
+
+  op = &batch->ops[batch->n_ops];
+  memset(op, 0, sizeof(*op));
+  op->buf = buf;
+  op->is_read = true;
+  n_iov = buf_read_space_prepare(buf, at_most, &op->space, op->iov,
+                                 &offered);
+  op->msg.msg_iov = op->iov;
+  op->msg.msg_iovlen = n_iov;
+  if (tor_uring_prep_recvmsg(batch->ring, s, &op->msg, batch->n_ops) < 0) {
+    buf_read_space_commit(buf, &op->space, op->iov, 0);
+    return -1;
+  }
+  return batch->n_ops++;
+#else
+  (void)batch; (void)buf; (void)s; (void)at_most;
+  return -1;
+#endif /* defined(USE_BUF_URING) */
+}
+
+/** Add to <b>batch</b> a write of up to <b>sz</b> bytes from the start of
+ * <b>buf</b> onto the socket <b>s</b>.  A buffer may have only one
+ * operation in a batch.  Return an index for use with
+ * buf_uring_batch_get_result(), or -1 if the batch is full. */
+int
+buf_uring_batch_add_flush(buf_uring_batch_t *batch, buf_t *buf,
+                          tor_socket_t s, size_t sz)
+{
+#ifdef USE_BUF_URING
+  buf_uring_op_t *op;
+  size_t total;
+  int n_iov;
+
+  if (buf_uring_batch_is_full(batch))
+    return -1;
+  if (BUG(sz > buf->datalen))
+    sz = buf->datalen;
+
+  op = &batch->ops[batch->n_ops];
+  memset(op, 0, sizeof(*op));
+  op->buf = buf;
+  op->is_read = false;
+  n_iov = buf_flush_iov_prepare(buf, sz, op->iov, &total);
+  op->msg.msg_iov = op->iov;
+  op->msg.msg_iovlen = n_iov;
+  if (tor_uring_prep_sendmsg(batch->ring, s, &op->msg, batch->n_ops) < 0)
+    return -1;
+  return batch->n_ops++;
+#else
+  (void)batch; (void)buf; (void)s; (void)sz;
+  return -1;
+#endif /* defined(USE_BUF_URING) */
+}
+
+#ifdef USE_BUF_URING
+/** Record that the kernel finished <b>op</b> with result <b>res</b> (a
+ * byte count or a negative errno), and update its buffer to match. */
+static void
+buf_uring_op_complete(buf_uring_op_t *op, int res)
+{
+  buf_t *buf = op->buf;
+  op->done = true;
+  if (op->is_read) {
+    buf_read_space_commit(buf, &op->space, op->iov,
+                          res > 0 ? (size_t) res : 0);
+    if (res == 0) {
+      op->reached_eof = 1;
+    }
+  } else if (res > 0) {
+    buf_drain(buf, res);
+  }
+
+  if (res >= 0) {
+    tor_assert(res <= BUF_MAX_LEN);
+    op->result = res;
+  } else if (ERRNO_IS_EAGAIN(-res)) {
+    op->result = 0;
+  } else {
+    op->result = -1;
+    op->socket_error = -res;
+  }
+}
+#endif /* defined(USE_BUF_URING) */
+
+/** Hand every operation in <b>batch</b> to the kernel at once, wait for
+ * them to finish, and update their buffers with the results.  Return 0 on
+ * success, and -1 if io_uring failed; in that case, some operations may not
+ * have run, and we won't use this batch again. */
+int
+buf_uring_batch_run(buf_uring_batch_t *batch)
+{
+#ifdef USE_BUF_URING
+  uint64_t idx;
+  int res, r = 0;
+
+  if (BUG(batch->has_run) || !batch->ring)
+    return -1;
+  batch->has_run = true;
+  if (batch->n_ops == 0)
+    return 0;
+
+  if (tor_uring_submit_and_wait(batch->ring) < 0)
+    r = -1;
+  while (tor_uring_get_completion(batch->ring, &idx, &res)) {
+    if (BUG(idx >= (uint64_t)batch->n_ops) ||
+        BUG(batch->ops[idx].done))
+      continue;
+    buf_uring_op_complete(&batch->ops[idx], res);
+  }
+  if (r < 0) {
+    /* Closing the ring discards anything it hasn't started. */
+    tor_uring_free(batch->ring);
+  }
+  return r;
+#else
+  (void)batch;
+  return -1;
+#endif /* defined(USE_BUF_URING) */
+}
+
+/** Return the number of operations in <b>batch</b>. */
+int
+buf_uring_batch_get_n_ops(const buf_uring_batch_t *batch)
+{
+#ifdef USE_BUF_URING
+  return batch->n_ops;
+#else
+  (void)batch;
+  return 0;
+#endif
+}
+
+/** If the operation at <b>idx</b> in <b>batch</b> has run, set
+ * *<b>result_out</b> to its result, as buf_read_from_socket() or
+ * buf_flush_to_socket() would have returned it, set *<b>reached_eof</b>
+ * and *<b>socket_error</b> as those functions would, and return 0.  If it
+ * has not run, return -1. */
+int
+buf_uring_batch_get_result(const buf_uring_batch_t *batch, int idx,
+                           int *result_out, int *reached_eof,
+                           int *socket_error)
+{
+#ifdef USE_BUF_URING
+  const buf_uring_op_t *op;
+  if (BUG(idx < 0 || idx >= batch->n_ops))
+    return -1;
+  op = &batch->ops[idx];
+  if (!op->done)
+    return -1;
+  *result_out = op->result;
+  if (op->reached_eof && reached_eof)
+    *reached_eof = 1;
+  if (op->result < 0 && socket_error)
+    *socket_error = op->socket_error;
+  return 0;
+#else
+  (void)batch; (void)idx; (void)result_out; (void)reached_eof;
+  (void)socket_error;
+  return -1;
+#endif /* defined(USE_BUF_URING) */
+}
+
+/** Remove every operation from <b>batch</b>, so that we can fill it
+ * again. */
+void
+buf_uring_batch_clear(buf_uring_batch_t *batch)
+{
+#ifdef USE_BUF_URING
+  int i;
+  for (i = 0; i < batch->n_ops; ++i) {
+    buf_uring_op_t *op = &batch->ops[i];
+    /* Give back the space for any read that never ran. */
+    if (op->is_read && !op->done)
+      buf_read_space_commit(op->buf, &op->space, op->iov, 0);
+  }
+  if (batch->ring && !batch->has_run)
+    tor_uring_discard_prepared(batch->ring);
+  batch->n_ops = 0;
+  batch->has_run = false;
+#else
+  (void)batch;
+#endif /* defined(USE_BUF_URING) */
+}
@@ -14,6 +14,7 @@
 #define TOR_BUFFERS_NET_H
 
 #include <stddef.h>
+#include "lib/malloc/malloc.h"
 #include "lib/net/socket.h"
 
 struct buf_t;
@@ -29,4 +30,21 @@ int buf_read_from_pipe(struct buf_t *buf, int fd, size_t at_most,
 
 int buf_flush_to_pipe(struct buf_t *buf, int fd, size_t sz);
 
+typedef struct buf_uring_batch_t buf_uring_batch_t;
+buf_uring_batch_t *buf_uring_batch_new(unsigned max_ops);
+void buf_uring_batch_free_(buf_uring_batch_t *batch);
+#define buf_uring_batch_free(batch) \
+  FREE_AND_NULL(buf_uring_batch_t, buf_uring_batch_free_, (batch))
+int buf_uring_batch_is_full(const buf_uring_batch_t *batch);
+int buf_uring_batch_add_read(buf_uring_batch_t *batch, struct buf_t *buf,
+                             tor_socket_t s, size_t at_most);
+int buf_uring_batch_add_flush(buf_uring_batch_t *batch, struct buf_t *buf,
+                              tor_socket_t s, size_t sz);
+int buf_uring_batch_run(buf_uring_batch_t *batch);
+int buf_uring_batch_get_n_ops(const buf_uring_batch_t *batch);
+int buf_uring_batch_get_result(const buf_uring_batch_t *batch, int idx,
+                               int *result_out, int *reached_eof,
+                               int *socket_error);
+void buf_uring_batch_clear(buf_uring_batch_t *batch);
+
 #endif /* !defined(TOR_BUFFERS_NET_H) */
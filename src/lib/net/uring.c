@@ -0,0 +1,429 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file uring.c
+ * \brief A minimal wrapper around the Linux io_uring interface.
+ *
+ * We use io_uring to hand the kernel a whole batch of socket reads and
+ * writes in a single system call.  We don't use it to wait for sockets:
+ * every operation we submit is a non-blocking sendmsg() or recvmsg()
+ * (MSG_DONTWAIT), so that it either completes at once or fails with
+ * EAGAIN, and the caller goes back to waiting for readiness through
+ * Libevent as usual.  This keeps all buffer memory owned by the caller for
+ * exactly the duration of tor_uring_submit_and_wait().
+ *
+ * We talk to the kernel with raw system calls rather than liburing, since
+ * we need only a handful of them.  Older kernels may refuse to complete a
+ * MSG_DONTWAIT operation inline, and instead park it until the socket
+ * becomes ready; tor_uring_new() checks for that, and fails if it sees it.
+ **/
+
+#include "orconfig.h"
+#include "lib/net/uring.h"
+#include "lib/log/log.h"
+#include "lib/log/util_bug.h"
+
+#ifdef HAVE_TOR_URING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* These have the same numbers on every architecture. */
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+/** An io_uring instance, and the rings that we share with the kernel. */
+struct tor_uring_t {
+  /** File descriptor returned by io_uring_setup(). */
+  int fd;
+  /** Number of entries in the submission queue. */
+  unsigned sq_entries;
+
+  /** Mapping of the submission queue ring, and its size. */
+  void *sq_ring;
+  size_t sq_ring_sz;
+  /** Mapping of the completion queue ring, and its size.  May be the same
+   * as sq_ring. */
+  void *cq_ring;
+  size_t cq_ring_sz;
+  /** Mapping of the submission queue entries, and its size. */
+  struct io_uring_sqe *sqes;
+  size_t sqes_sz;
+
+  /** Pointers into sq_ring. */
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  /** Pointers into cq_ring. */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /** Number of entries we've prepared but not yet submitted. */
+  unsigned n_prepared;
+  /** Number of entries we've submitted whose completions we have not yet
+   * taken off the completion queue. */
+  unsigned n_inflight;
+};
+
+/** Wrapper for the io_uring_setup() system call. */
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+/** Wrapper for the io_uring_enter() system call. */
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       flags, NULL, 0);
+}
+
+/** Unmap the rings of <b>ring</b> and close its file descriptor. */
+static void
+tor_uring_teardown(tor_uring_t *ring)
+{
+  if (ring->sqes && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_sz);
+  if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+      ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_sz);
+  if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sq_ring_sz);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  ring->sqes = NULL;
+  ring->sq_ring = ring->cq_ring = NULL;
+  ring->fd = -1;
+}
+
+/** Make sure that the kernel behind <b>ring</b> completes a non-blocking
+ * recvmsg() on a socket with no data inline, with EAGAIN, rather than
+ * waiting for the socket to become readable.  Return 0 if it does, and -1
+ * if it doesn't or if something else goes wrong. */
+static int
+tor_uring_self_test(tor_uring_t *ring)
+{
+  int fds[2];
+  char byte;
+  struct iovec iov;
+  struct msghdr msg;
+  uint64_t user_data = 0;
+  int res = 0, r = -1;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    return -1;
+
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (tor_uring_prep_recvmsg(ring, fds[0], &msg, 1) < 0)
+    goto done;
+
+  /* Submit, but don't wait: if the kernel parks the operation, we want to
+   * find out rather than block forever. */
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->n_prepared,
+                   __ATOMIC_RELEASE);
+  if (sys_io_uring_enter(ring->fd, ring->n_prepared, 0, 0) != 1)
+    goto done;
+  ring->n_inflight += ring->n_prepared;
+  ring->n_prepared = 0;
+
+  if (tor_uring_get_completion(ring, &user_data, &res) != 1) {
+    log_info(LD_NET, "This kernel doesn't complete non-blocking io_uring "
+             "operations right away; not using io_uring.");
+    goto done;
+  }
+  if (user_data != 1 || res != -EAGAIN) {
+    log_info(LD_NET, "Unexpected result %d from io_uring self-test; not "
+             "using io_uring.", res);
+    goto done;
+  }
+  r = 0;
+
+ done:
+  close(fds[0]);
+  close(fds[1]);
+  return r;
+}
+
+/** Create and return a new io_uring with room for <b>entries</b>
+ * operations at a time.  Return NULL if io_uring is not available, or
+ * does not behave the way we need. */
+tor_uring_t *
+tor_uring_new(unsigned entries)
+{
+  struct io_uring_params p;
+  tor_uring_t *ring = tor_malloc_zero(sizeof(tor_uring_t));
+  int fd;
+
+  ring->fd = -1;
+  memset(&p, 0, sizeof(p));
+  fd = sys_io_uring_setup(entries, &p);
+  if (fd < 0) {
+    log_info(LD_NET, "io_uring_setup() failed: %s", strerror(errno));
+    goto err;
+  }
+  ring->fd = fd;
+  ring->sq_entries = p.sq_entries;
+
+  ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_sz = p.cq_off.cqes +
+    p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_sz > ring->sq_ring_sz)
+      ring->sq_ring_sz = ring->cq_ring_sz;
+    ring->cq_ring_sz = ring->sq_ring_sz;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto err;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED)
+      goto err;
+  }
+  ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto err;
+
+  ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+  ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+  ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring +
+                                       p.cq_off.cqes);
+
+  if (tor_uring_self_test(ring) < 0)
+    goto err;
+
+  return ring;
+ err:
+  tor_uring_teardown(ring);
+  tor_free(ring);
+  return NULL;
+}
+
+/** Release all storage held by <b>ring</b>. */
+void
+tor_uring_free_(tor_uring_t *ring)
+{
+  if (!ring)
+    return;
+  tor_uring_teardown(ring);
+  tor_free(ring);
+}
+
+/** Return the number of operations that <b>ring</b> can hold at once. */
+unsigned
+tor_uring_get_capacity(const tor_uring_t *ring)
+{
+  return ring->sq_entries;
+}
+
+/** Return a cleared submission queue entry for the next operation on
+ * <b>ring</b>, or NULL if the ring is full. */
+static struct io_uring_sqe *
+tor_uring_next_sqe(tor_uring_t *ring)
+{
+  unsigned idx;
+  struct io_uring_sqe *sqe;
+  if (ring->n_prepared + ring->n_inflight >= ring->sq_entries)
+    return NULL;
+  idx = (*ring->sq_tail + ring->n_prepared) & *ring->sq_mask;
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[idx] = idx;
+  ++ring->n_prepared;
+  return sqe;
+}
+
+/** Helper: prepare a <b>opcode</b> operation on <b>fd</b> with
+ * <b>msg</b>. */
+static int
+tor_uring_prep_msg(tor_uring_t *ring, uint8_t opcode, tor_socket_t fd,
+                   const struct msghdr *msg, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = tor_uring_next_sqe(ring);
+  if (!sqe)
+    return -1;
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_DONTWAIT;
+  sqe->user_data = user_data;
+  return 0;
+}
+
+/** Queue a non-blocking recvmsg() on <b>fd</b> into <b>msg</b>, tagged
+ * with <b>user_data</b>.  <b>msg</b> and everything it points to must stay
+ * valid until tor_uring_submit_and_wait() returns.  Return 0 on success,
+ * and -1 if the ring is full. */
+int
+tor_uring_prep_recvmsg(tor_uring_t *ring, tor_socket_t fd,
+                       struct msghdr *msg, uint64_t user_data)
+{
+  return tor_uring_prep_msg(ring, IORING_OP_RECVMSG, fd, msg, user_data);
+}
+
+/** As tor_uring_prep_recvmsg(), but queue a non-blocking sendmsg(). */
+int
+tor_uring_prep_sendmsg(tor_uring_t *ring, tor_socket_t fd,
+                       const struct msghdr *msg, uint64_t user_data)
+{
+  return tor_uring_prep_msg(ring, IORING_OP_SENDMSG, fd, msg, user_data);
+}
+
+/** Forget every operation we've prepared on <b>ring</b> but not yet
+ * submitted. */
+void
+tor_uring_discard_prepared(tor_uring_t *ring)
+{
+  ring->n_prepared = 0;
+}
+
+/** Submit every operation we've prepared on <b>ring</b>, and wait for all
+ * of them to complete.  Return the number of operations submitted, or -1
+ * on failure. */
+int
+tor_uring_submit_and_wait(tor_uring_t *ring)
+{
+  unsigned to_submit = ring->n_prepared;
+  int submitted = 0;
+
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit,
+                   __ATOMIC_RELEASE);
+  ring->n_prepared = 0;
+  ring->n_inflight += to_submit;
+
+  while (1) {
+    int r = sys_io_uring_enter(ring->fd, to_submit, ring->n_inflight,
+                               IORING_ENTER_GETEVENTS);
+    if (r < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      log_warn(LD_NET, "io_uring_enter() failed: %s", strerror(errno));
+      return -1;
+    }
+    submitted += r;
+    to_submit -= r;
+    if (to_submit == 0)
+      break;
+  }
+  return submitted;
+}
+
+/** If there is a completed operation waiting on <b>ring</b>, set
+ * *<b>user_data_out</b> to its tag and *<b>res_out</b> to its result (as
+ * returned by the system call, or a negative errno), remove it from the
+ * ring, and return 1.  Otherwise return 0. */
+int
+tor_uring_get_completion(tor_uring_t *ring, uint64_t *user_data_out,
+                         int *res_out)
+{
+  unsigned head = *ring->cq_head;
+  const struct io_uring_cqe *cqe;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+  cqe = &ring->cqes[head & *ring->cq_mask];
+  *user_data_out = cqe->user_data;
+  *res_out = cqe->res;
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  if (! BUG(ring->n_inflight == 0))
+    --ring->n_inflight;
+  return 1;
+}
+
+#else /* !defined(HAVE_TOR_URING) */
+
+/* Stub versions for platforms without io_uring.  tor_uring_new() always
+ * fails, so none of the others should ever get called. */
+
+tor_uring_t *
+tor_uring_new(unsigned entries)
+{
+  (void)entries;
+  return NULL;
+}
+
+void
+tor_uring_free_(tor_uring_t *ring)
+{
+  (void)ring;
+}
+
+unsigned
+tor_uring_get_capacity(const tor_uring_t *ring)
+{
+  (void)ring;
+  return 0;
+}
+
+int
+tor_uring_prep_recvmsg(tor_uring_t *ring, tor_socket_t fd,
+                       struct msghdr *msg, uint64_t user_data)
+{
+  (void)ring; (void)fd; (void)msg; (void)user_data;
+  return -1;
+}
+
+int
+tor_uring_prep_sendmsg(tor_uring_t *ring, tor_socket_t fd,
+                       const struct msghdr *msg, uint64_t user_data)
+{
+  (void)ring; (void)fd; (void)msg; (void)user_data;
+  return -1;
+}
+
+void
+tor_uring_discard_prepared(tor_uring_t *ring)
+{
+  (void)ring;
+}
+
+int
+tor_uring_submit_and_wait(tor_uring_t *ring)
+{
+  (void)ring;
+  return -1;
+}
+
+int
+tor_uring_get_completion(tor_uring_t *ring, uint64_t *user_data_out,
+                         int *res_out)
+{
+  (void)ring; (void)user_data_out; (void)res_out;
+  return 0;
+}
+
+#endif /* defined(HAVE_TOR_URING) */
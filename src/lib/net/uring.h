@@ -0,0 +1,44 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file uring.h
+ * \brief Header for uring.c
+ **/
+
+#ifndef TOR_URING_H
+#define TOR_URING_H
+
+#include "orconfig.h"
+#include "lib/cc/torint.h"
+#include "lib/malloc/malloc.h"
+#include "lib/net/socket.h"
+
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H) && \
+  defined(HAVE_SYS_SYSCALL_H) && defined(HAVE_SYS_MMAN_H) && \
+  defined(HAVE_SYS_UIO_H)
+/** Defined if we can build a Linux io_uring backend. Whether the running
+ * kernel actually supports it is only known once tor_uring_new() succeeds.
+ */
+#define HAVE_TOR_URING
+#endif
+
+struct msghdr;
+typedef struct tor_uring_t tor_uring_t;
+
+tor_uring_t *tor_uring_new(unsigned entries);
+void tor_uring_free_(tor_uring_t *ring);
+#define tor_uring_free(ring) \
+  FREE_AND_NULL(tor_uring_t, tor_uring_free_, (ring))
+
+unsigned tor_uring_get_capacity(const tor_uring_t *ring);
+int tor_uring_prep_recvmsg(tor_uring_t *ring, tor_socket_t fd,
+                           struct msghdr *msg, uint64_t user_data);
+int tor_uring_prep_sendmsg(tor_uring_t *ring, tor_socket_t fd,
+                           const struct msghdr *msg, uint64_t user_data);
+void tor_uring_discard_prepared(tor_uring_t *ring);
+int tor_uring_submit_and_wait(tor_uring_t *ring);
+int tor_uring_get_completion(tor_uring_t *ring, uint64_t *user_data_out,
+                             int *res_out);
+
+#endif /* !defined(TOR_URING_H) */
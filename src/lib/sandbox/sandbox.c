@@ -223,6 +223,7 @@ static int filter_nopar_gen[] = {
     SCMP_SYS(prlimit64),
 #endif
     SCMP_SYS(read),
+    SCMP_SYS(readv),
     SCMP_SYS(rt_sigreturn),
     SCMP_SYS(sched_getaffinity),
 #ifdef __NR_sched_yield
@@ -66,6 +66,7 @@ ENABLE_GCC_WARNING("-Wredundant-decls")
 #include "lib/string/printf.h"
 #include "lib/net/socket.h"
 #include "lib/intmath/cmp.h"
+#include "lib/lock/compat_mutex.h"
 #include "lib/ctime/di_ops.h"
 #include "lib/encoding/time_fmt.h"
 
@@ -149,6 +150,22 @@ tor_tls_get_by_ssl(const SSL *ssl)
 /** True iff tor_tls_init() has been called. */
 static int tls_library_is_initialized = 0;
 
+/** Lock protecting total_bytes_written_over_tls and
+ * total_bytes_written_by_tls, since we can do TLS I/O on more than one thread.
+ * Created by tor_tls_init(). */
+static tor_mutex_t *total_bytes_lock = NULL;
+
+#define LOCK_TOTAL_BYTES()                      \
+  STMT_BEGIN                                    \
+  if (total_bytes_lock)                         \
+    tor_mutex_acquire(total_bytes_lock);        \
+  STMT_END
+#define UNLOCK_TOTAL_BYTES()                    \
+  STMT_BEGIN                                    \
+  if (total_bytes_lock)                         \
+    tor_mutex_release(total_bytes_lock);        \
+  STMT_END
+
 /* Module-internal error codes. */
 #define TOR_TLS_SYSCALL_    (MIN_TOR_TLS_ERROR_VAL_ - 2)
 #define TOR_TLS_ZERORETURN_ (MIN_TOR_TLS_ERROR_VAL_ - 1)
@@ -375,6 +392,7 @@ tor_tls_init(void)
 #endif /* (SIZEOF_VOID_P >= 8 &&                              ... */
 
     tor_tls_allocate_tor_tls_object_ex_data_index();
+    total_bytes_lock = tor_mutex_new_nonrecursive();
 
     tls_library_is_initialized = 1;
   }
@@ -1306,7 +1324,9 @@ tor_tls_write(tor_tls_t *tls, const char *cp, size_t n)
   r = SSL_write(tls->ssl, cp, (int)n);
   err = tor_tls_get_error(tls, r, 0, "writing", LOG_INFO, LD_NET);
   if (err == TOR_TLS_DONE) {
+    LOCK_TOTAL_BYTES();
     total_bytes_written_over_tls += r;
+    UNLOCK_TOTAL_BYTES();
     return r;
   }
   if (err == TOR_TLS_WANTWRITE || err == TOR_TLS_WANTREAD) {
@@ -1549,7 +1569,9 @@ tor_tls_get_n_raw_bytes(tor_tls_t *tls, size_t *n_read, size_t *n_written)
              "r=%lu, last_read=%lu, w=%lu, last_written=%lu",
              r, tls->last_read_count, w, tls->last_write_count);
   }
+  LOCK_TOTAL_BYTES();
   total_bytes_written_by_tls += *n_written;
+  UNLOCK_TOTAL_BYTES();
   tls->last_read_count = r;
   tls->last_write_count = w;
 }
@@ -1559,11 +1581,14 @@ tor_tls_get_n_raw_bytes(tor_tls_t *tls, size_t *n_read, size_t *n_written)
 MOCK_IMPL(double,
 tls_get_write_overhead_ratio,(void))
 {
-  if (total_bytes_written_over_tls == 0)
-    return 1.0;
-
-  return ((double)total_bytes_written_by_tls) /
-    ((double)total_bytes_written_over_tls);
+  double ratio = 1.0;
+
+  LOCK_TOTAL_BYTES();
+  if (total_bytes_written_over_tls != 0)
+    ratio = ((double)total_bytes_written_by_tls) /
+      ((double)total_bytes_written_over_tls);
+  UNLOCK_TOTAL_BYTES();
+  return ratio;
 }
 
 /** Implement check_no_tls_errors: If there are any pending OpenSSL
@@ -32,6 +32,8 @@ fn translate_to_rust(c_proto: uint32_t) -> Result<Protocol, ProtoverError> {
         9 => Ok(Protocol::Cons),
         10 => Ok(Protocol::Padding),
         11 => Ok(Protocol::FlowCtrl),
+        12 => Ok(Protocol::DelayCC),
+        13 => Ok(Protocol::Multipath),
         _ => Err(ProtoverError::UnknownProtocol),
     }
 }
@@ -48,6 +48,8 @@ pub enum Protocol {
     Relay,
     Padding,
     FlowCtrl,
+    DelayCC,
+    Multipath,
 }
 
 impl fmt::Display for Protocol {
@@ -77,6 +79,8 @@ impl FromStr for Protocol {
             "Relay" => Ok(Protocol::Relay),
             "Padding" => Ok(Protocol::Padding),
             "FlowCtrl" => Ok(Protocol::FlowCtrl),
+            "DelayCC" => Ok(Protocol::DelayCC),
+            "Multipath" => Ok(Protocol::Multipath),
             _ => Err(ProtoverError::UnknownProtocol),
         }
     }
@@ -159,6 +163,7 @@ pub(crate) fn get_supported_protocols_cstr() -> &'static CStr {
     if !have_linkauth_v1() {
         cstr!(
             "Cons=1-2 \
+             DelayCC=1 \
              Desc=1-2 \
              DirCache=1-2 \
              FlowCtrl=1 \
@@ -168,12 +173,14 @@ pub(crate) fn get_supported_protocols_cstr() -> &'static CStr {
              Link=1-5 \
              LinkAuth=3 \
              Microdesc=1-2 \
+             Multipath=1 \
              Padding=2 \
              Relay=1-3"
         )
     } else {
         cstr!(
             "Cons=1-2 \
+             DelayCC=1 \
              Desc=1-2 \
              DirCache=1-2 \
              FlowCtrl=1 \
@@ -183,6 +190,7 @@ pub(crate) fn get_supported_protocols_cstr() -> &'static CStr {
              Link=1-5 \
              LinkAuth=1,3 \
              Microdesc=1-2 \
+             Multipath=1 \
              Padding=2 \
              Relay=1-3"
         )
@@ -8,8 +8,14 @@
  * \brief Benchmarks for lower level Tor modules.
  **/
 
+#define BUFFERS_PRIVATE
+#define CRYPT_PATH_PRIVATE
+#define ORSHARD_PRIVATE
+
 #include "orconfig.h"
 
+#include <math.h>
+
 #include "core/or/or.h"
 #include "core/crypto/onion_tap.h"
 #include "core/crypto/relay_crypto.h"
@@ -24,7 +30,18 @@
 #include <openssl/obj_mac.h>
 #endif /* defined(ENABLE_OPENSSL) */
 
+#include "core/mainloop/orshard.h"
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/crypt_path.h"
+#include "core/or/relay.h"
+#include "lib/time/compat_time.h"
+#include "lib/buf/buffers.h"
+#include "lib/net/buffers_net.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/tls/buffers_tls.h"
+#include "lib/tls/tortls.h"
 #include "app/config/config.h"
 #include "app/main/subsysmgr.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
@@ -32,17 +49,28 @@
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/crypt_ops/crypto_rsa.h"
 #include "feature/dircommon/consdiff.h"
 #include "lib/compress/compress.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
+#include "core/or/crypt_path_st.h"
 #include "core/or/or_circuit_st.h"
 
 #include "lib/crypt_ops/digestset.h"
 #include "lib/crypt_ops/crypto_init.h"
 
+#include "core/or/policies.h"
+#include "core/or/policy_compile.h"
 #include "feature/dirparse/microdesc_parse.h"
+#include "feature/dirparse/routerparse.h"
 #include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/routerlist.h"
+#include "lib/encoding/confline.h"
+
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/routerinfo_st.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -195,8 +223,19 @@ bench_onion_TAP(void)
   crypto_pk_free(key2);
 }
 
+/** Fill <b>pool</b> with precomputed keypairs, as our cpuworkers would do
+ * while idle. */
+static void
+bench_fill_keypair_pool(ntor_keypair_pool_t *pool)
+{
+  if (pool) {
+    while (ntor_keypair_pool_fill_one(pool))
+      ;
+  }
+}
+
 static void
-bench_onion_ntor_impl(void)
+bench_onion_ntor_impl(int pooled)
 {
   const int iters = 1<<10;
   int i;
@@ -207,6 +246,7 @@ bench_onion_ntor_impl(void)
   ntor_handshake_state_t *state = NULL;
   uint8_t nodeid[DIGEST_LEN];
   di_digest256_map_t *keymap = NULL;
+  ntor_keypair_pool_t *pool = pooled ? ntor_keypair_pool_new(iters) : NULL;
 
   curve25519_secret_key_generate(&keypair1.seckey, 0);
   curve25519_public_key_generate(&keypair1.pubkey, &keypair1.seckey);
@@ -216,10 +256,11 @@ bench_onion_ntor_impl(void)
   dimap_add_entry(&keymap, keypair2.pubkey.public_key, &keypair2);
   crypto_rand((char *)nodeid, sizeof(nodeid));
 
+  bench_fill_keypair_pool(pool);
   reset_perftime();
   start = perftime();
   for (i = 0; i < iters; ++i) {
-    onion_skin_ntor_create(nodeid, &keypair1.pubkey, &state, os);
+    onion_skin_ntor_create(nodeid, &keypair1.pubkey, pool, &state, os);
     ntor_handshake_state_free(state);
     state = NULL;
   }
@@ -227,11 +268,12 @@ bench_onion_ntor_impl(void)
   printf("Client-side, part 1: %f usec.\n", NANOCOUNT(start, end, iters)/1e3);
 
   state = NULL;
-  onion_skin_ntor_create(nodeid, &keypair1.pubkey, &state, os);
+  onion_skin_ntor_create(nodeid, &keypair1.pubkey, NULL, &state, os);
+  bench_fill_keypair_pool(pool);
   start = perftime();
   for (i = 0; i < iters; ++i) {
     uint8_t key_out[CPATH_KEY_MATERIAL_LEN];
-    onion_skin_ntor_server_handshake(os, keymap, NULL, nodeid, or,
+    onion_skin_ntor_server_handshake(os, keymap, NULL, pool, nodeid, or,
                                 key_out, sizeof(key_out));
   }
   end = perftime();
@@ -252,18 +294,23 @@ bench_onion_ntor_impl(void)
 
   ntor_handshake_state_free(state);
   dimap_free(keymap, NULL);
+  ntor_keypair_pool_free(pool);
 }
 
 static void
 bench_onion_ntor(void)
 {
-  int ed;
-
-  for (ed = 0; ed <= 1; ++ed) {
-    printf("Ed25519-based basepoint multiply = %s.\n",
-           (ed == 0) ? "disabled" : "enabled");
-    curve25519_set_impl_params(ed);
-    bench_onion_ntor_impl();
+  int ed, pooled;
+
+  for (pooled = 0; pooled <= 1; ++pooled) {
+    for (ed = 0; ed <= 1; ++ed) {
+      printf("Ed25519-based basepoint multiply = %s; "
+             "precomputed ephemeral keypairs = %s.\n",
+             (ed == 0) ? "disabled" : "enabled",
+             pooled ? "yes" : "no");
+      curve25519_set_impl_params(ed);
+      bench_onion_ntor_impl(pooled);
+    }
   }
 }
 
@@ -425,6 +472,106 @@ bench_cell_aes(void)
   tor_free(b);
 }
 
+/** Compare encrypting cells for many circuits one at a time with encrypting
+ * them in batches, and a client encrypting the layers of a cell one at a
+ * time with encrypting them all in one batch. */
+static void
+bench_cell_aes_batch(void)
+{
+  const int n_circs = 1024;
+  const int n_cells = 4096;
+  const int iters = 64;
+  static const int batch_sizes[] = { 1, 4, 16, RELAY_CRYPT_BATCH_MAX };
+  crypto_cipher_t **circ_ciphers = tor_calloc(n_circs, sizeof(void*));
+  crypto_cipher_t **ciphers = tor_calloc(n_cells, sizeof(void*));
+  uint8_t **payloads = tor_calloc(n_cells, sizeof(void*));
+  uint8_t *mem = tor_malloc_zero((size_t)n_cells * CELL_PAYLOAD_SIZE);
+  crypt_path_t *hops[3];
+  uint64_t start, end;
+  char key[CIPHER_KEY_LEN];
+  unsigned b;
+  int i, j, k;
+
+  for (i = 0; i < n_circs; ++i) {
+    crypto_rand(key, sizeof(key));
+    circ_ciphers[i] = crypto_cipher_new(key);
+  }
+  for (i = 0; i < n_cells; ++i) {
+    ciphers[i] = circ_ciphers[crypto_fast_rng_get_uint(get_thread_fast_rng(),
+                                                       n_circs)];
+    payloads[i] = mem + (size_t)i * CELL_PAYLOAD_SIZE;
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (j = 0; j < iters; ++j) {
+    for (i = 0; i < n_cells; ++i)
+      relay_crypt_one_payload(ciphers[i], payloads[i]);
+  }
+  end = perftime();
+  printf("%d circuits, one cell at a time: %.0f cells/sec "
+         "(%.2f nsec per cell)\n", n_circs,
+         1e9 / NANOCOUNT(start, end, iters*n_cells),
+         NANOCOUNT(start, end, iters*n_cells));
+
+  for (b = 0; b < ARRAY_LENGTH(batch_sizes); ++b) {
+    const int batch = batch_sizes[b];
+    start = perftime();
+    for (j = 0; j < iters; ++j) {
+      for (i = 0; i < n_cells; i += batch) {
+        k = MIN(batch, n_cells - i);
+        relay_crypt_payloads(ciphers + i, payloads + i, k);
+      }
+    }
+    end = perftime();
+    printf("%d circuits, batches of %d: %.0f cells/sec "
+           "(%.2f nsec per cell)\n", n_circs, batch,
+           1e9 / NANOCOUNT(start, end, iters*n_cells),
+           NANOCOUNT(start, end, iters*n_cells));
+  }
+
+  /* A client encrypting cells for the last hop of a three-hop circuit. */
+  for (i = 0; i < 3; ++i) {
+    hops[i] = tor_malloc_zero(sizeof(crypt_path_t));
+    hops[i]->pvt_crypto.f_crypto = circ_ciphers[i];
+  }
+  for (i = 0; i < 3; ++i) {
+    hops[i]->next = hops[(i + 1) % 3];
+    hops[i]->prev = hops[(i + 2) % 3];
+  }
+  start = perftime();
+  for (j = 0; j < iters; ++j) {
+    for (i = 0; i < n_cells; ++i) {
+      for (k = 2; k >= 0; --k)
+        cpath_crypt_cell(hops[k], payloads[i], false);
+    }
+  }
+  end = perftime();
+  printf("3-hop circuit, one layer at a time: %.0f cells/sec "
+         "(%.2f nsec per cell)\n",
+         1e9 / NANOCOUNT(start, end, iters*n_cells),
+         NANOCOUNT(start, end, iters*n_cells));
+  start = perftime();
+  for (j = 0; j < iters; ++j) {
+    for (i = 0; i < n_cells; ++i)
+      cpath_crypt_cell_outbound(hops[0], hops[2], payloads[i]);
+  }
+  end = perftime();
+  printf("3-hop circuit, all layers at once: %.0f cells/sec "
+         "(%.2f nsec per cell)\n",
+         1e9 / NANOCOUNT(start, end, iters*n_cells),
+         NANOCOUNT(start, end, iters*n_cells));
+
+  for (i = 0; i < 3; ++i)
+    tor_free(hops[i]);
+  for (i = 0; i < n_circs; ++i)
+    crypto_cipher_free(circ_ciphers[i]);
+  tor_free(circ_ciphers);
+  tor_free(ciphers);
+  tor_free(payloads);
+  tor_free(mem);
+}
+
 /** Run digestmap_t performance benchmarks. */
 static void
 bench_dmap(void)
@@ -616,6 +763,673 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** A replica of the floating-point EWMA bookkeeping that circuitmux_ewma
+ * used before it switched to fixed point, so that we can compare the two. */
+typedef struct legacy_ewma_t {
+  double cell_count;
+  unsigned last_adjusted_tick;
+  int heap_index;
+  circuit_t *circ;
+} legacy_ewma_t;
+
+static int
+legacy_ewma_cmp(const void *a, const void *b)
+{
+  const legacy_ewma_t *e1 = a, *e2 = b;
+  if (e1->cell_count < e2->cell_count)
+    return -1;
+  else if (e1->cell_count > e2->cell_count)
+    return 1;
+  return 0;
+}
+
+/** Run <b>iters</b> pick-then-transmit rounds over <b>n_circs</b> active
+ * circuits with the old floating-point EWMA and smartlist priority queue;
+ * return the elapsed time in nanoseconds. */
+static uint64_t
+bench_cmux_ewma_legacy(int n_circs, int iters)
+{
+  const double scale_factor = 0.9;
+  const int32_t tick_msec = 10*1000;
+  legacy_ewma_t *ewmas = tor_calloc(n_circs, sizeof(legacy_ewma_t));
+  smartlist_t *pq = smartlist_new();
+  monotime_coarse_t start_of_tick, now;
+  uint64_t start, end;
+  int i;
+
+  monotime_coarse_get(&start_of_tick);
+  for (i = 0; i < n_circs; ++i) {
+    ewmas[i].heap_index = -1;
+    smartlist_pqueue_add(pq, legacy_ewma_cmp,
+                         offsetof(legacy_ewma_t, heap_index), &ewmas[i]);
+  }
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    legacy_ewma_t *e = smartlist_get(pq, 0);
+    int32_t msec;
+    unsigned tick;
+    double frac;
+    monotime_coarse_get(&now);
+    msec = monotime_coarse_diff_msec32(&start_of_tick, &now);
+    tick = msec / tick_msec;
+    frac = (msec % tick_msec) / (double)tick_msec;
+    if (tick != e->last_adjusted_tick) {
+      SMARTLIST_FOREACH(pq, legacy_ewma_t *, e2, {
+        e2->cell_count *= pow(scale_factor, tick - e2->last_adjusted_tick);
+        e2->last_adjusted_tick = tick;
+      });
+    }
+    smartlist_pqueue_remove(pq, legacy_ewma_cmp,
+                            offsetof(legacy_ewma_t, heap_index), e);
+    e->cell_count += pow(scale_factor, -frac);
+    smartlist_pqueue_add(pq, legacy_ewma_cmp,
+                         offsetof(legacy_ewma_t, heap_index), e);
+  }
+  end = perftime();
+
+  smartlist_free(pq);
+  tor_free(ewmas);
+  return end - start;
+}
+
+/** As bench_cmux_ewma_legacy(), but with the real EWMA policy. */
+static uint64_t
+bench_cmux_ewma_current(int n_circs, int iters)
+{
+  circuitmux_t *cmux = circuitmux_alloc();
+  circuit_t *circs = tor_calloc(n_circs, sizeof(circuit_t));
+  circuitmux_policy_circ_data_t **circ_data =
+    tor_calloc(n_circs, sizeof(circuitmux_policy_circ_data_t *));
+  circuitmux_policy_data_t *pol_data;
+  uint64_t start, end;
+  int i;
+
+  pol_data = ewma_policy.alloc_cmux_data(cmux);
+  for (i = 0; i < n_circs; ++i) {
+    circ_data[i] = ewma_policy.alloc_circ_data(cmux, pol_data, &circs[i],
+                                               CELL_DIRECTION_OUT, 1);
+    ewma_policy.notify_circ_active(cmux, pol_data, &circs[i], circ_data[i]);
+  }
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    circuit_t *circ = ewma_policy.pick_active_circuit(cmux, pol_data);
+    int idx = (int)(circ - circs);
+    ewma_policy.notify_xmit_cells(cmux, pol_data, circ, circ_data[idx], 1);
+  }
+  end = perftime();
+
+  for (i = 0; i < n_circs; ++i) {
+    ewma_policy.notify_circ_inactive(cmux, pol_data, &circs[i],
+                                     circ_data[i]);
+    ewma_policy.free_circ_data(cmux, pol_data, &circs[i], circ_data[i]);
+  }
+  ewma_policy.free_cmux_data(cmux, pol_data);
+  circuitmux_free(cmux);
+  tor_free(circ_data);
+  tor_free(circs);
+  return end - start;
+}
+
+/** Compare the cost per transmitted cell of the EWMA circuit scheduling
+ * policy against its old floating-point implementation. */
+static void
+bench_cmux_ewma(void)
+{
+  const int sizes[] = { 10, 1000, 50000 };
+  const int iters = 1<<18;
+  unsigned i;
+
+  cmux_ewma_set_options(NULL, NULL);
+  reset_perftime();
+
+  for (i = 0; i < ARRAY_LENGTH(sizes); ++i) {
+    uint64_t t_old = bench_cmux_ewma_legacy(sizes[i], iters);
+    uint64_t t_new = bench_cmux_ewma_current(sizes[i], iters);
+    printf("%6d circuits: float/pqueue %.2f ns/cell; "
+           "fixed/4-ary heap %.2f ns/cell\n",
+           sizes[i], NANOCOUNT(0, t_old, iters), NANOCOUNT(0, t_new, iters));
+  }
+}
+
+/** How many msec of simulated time does bench_cmux_qdelay() cover?  This is
+ * less than the default EWMA halflife, so the EWMA counts hardly decay: the
+ * simulation runs much faster than real time. */
+#define QDELAY_SIM_MSEC 10000
+/** The kinds of circuit in the simulated channel, and for each kind: how
+ * many there are; how often, in msec, each one queues a burst of cells; and
+ * how many cells are in a burst.  Bulk circuits instead top their queues up
+ * to a burst every msec, so they always have cells waiting. */
+enum { QDELAY_SIM_BULK, QDELAY_SIM_WEB, QDELAY_SIM_CHAT, QDELAY_SIM_N_KINDS };
+static const char *qdelay_sim_kind_names[] = { "bulk", "web", "chat" };
+static const int qdelay_sim_n_circs[] = { 4, 20, 20 };
+static const int qdelay_sim_period_msec[] = { 1, 500, 100 };
+static const int qdelay_sim_burst[] = { 50, 45, 1 };
+
+/** Simulate a congested channel that uses <b>policy</b> and can send
+ * <b>cells_per_msec</b> cells each msec, and add the delay, in msec, of
+ * every cell it sends to hists[kind][delay]. */
+static void
+cmux_qdelay_sim(circuitmux_policy_t *policy, int cells_per_msec,
+                uint64_t hists[QDELAY_SIM_N_KINDS][QDELAY_SIM_MSEC + 1])
+{
+  const uint32_t stamp_per_msec =
+    MAX(1, (uint32_t) monotime_msec_to_approx_coarse_stamp_units(1));
+  circuitmux_t *cmux = circuitmux_alloc();
+  circuitmux_policy_data_t *pol_data = policy->alloc_cmux_data(cmux);
+  int n_circs = 0, i, kind;
+  circuit_t *circs;
+  int *kinds;
+  circuitmux_policy_circ_data_t **circ_data;
+
+  for (kind = 0; kind < QDELAY_SIM_N_KINDS; ++kind)
+    n_circs += qdelay_sim_n_circs[kind];
+  circs = tor_calloc(n_circs, sizeof(circuit_t));
+  kinds = tor_calloc(n_circs, sizeof(int));
+  circ_data = tor_calloc(n_circs, sizeof(circuitmux_policy_circ_data_t *));
+  for (i = 0, kind = 0; kind < QDELAY_SIM_N_KINDS; ++kind) {
+    for (int j = 0; j < qdelay_sim_n_circs[kind]; ++j, ++i) {
+      kinds[i] = kind;
+      cell_queue_init(&circs[i].n_chan_cells);
+      circ_data[i] = policy->alloc_circ_data(cmux, pol_data, &circs[i],
+                                             CELL_DIRECTION_OUT, 0);
+    }
+  }
+
+  for (uint32_t now = 0; now < QDELAY_SIM_MSEC; ++now) {
+    const uint32_t stamp = now * stamp_per_msec;
+    /* Queue new cells, spreading each kind's bursts over its period. */
+    for (i = 0; i < n_circs; ++i) {
+      cell_queue_t *queue = &circs[i].n_chan_cells;
+      const int period = qdelay_sim_period_msec[kinds[i]];
+      int n_new = 0;
+      if (kinds[i] == QDELAY_SIM_BULK)
+        n_new = MAX(0, qdelay_sim_burst[kinds[i]] - queue->n);
+      else if ((now + (uint32_t)i * 37) % period == 0)
+        n_new = qdelay_sim_burst[kinds[i]];
+      for (int j = 0; j < n_new; ++j) {
+        packed_cell_t *cell = tor_malloc_zero(sizeof(packed_cell_t));
+        cell->inserted_timestamp = stamp;
+        cell_queue_append(queue, cell);
+      }
+      if (n_new && queue->n == n_new)
+        policy->notify_circ_active(cmux, pol_data, &circs[i], circ_data[i]);
+    }
+    /* Send as many cells as the channel can. */
+    for (int j = 0; j < cells_per_msec; ++j) {
+      circuit_t *circ = policy->pick_active_circuit(cmux, pol_data);
+      cell_queue_t *queue;
+      packed_cell_t *cell;
+      uint32_t delay;
+      if (!circ)
+        break;
+      i = (int)(circ - circs);
+      queue = &circ->n_chan_cells;
+      cell = TOR_SIMPLEQ_FIRST(&queue->head);
+      TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
+      --queue->n;
+      delay = (stamp - cell->inserted_timestamp) / stamp_per_msec;
+      ++hists[kinds[i]][MIN(delay, QDELAY_SIM_MSEC)];
+      tor_free(cell);
+      policy->notify_xmit_cells(cmux, pol_data, circ, circ_data[i], 1);
+      if (queue->n == 0)
+        policy->notify_circ_inactive(cmux, pol_data, circ, circ_data[i]);
+    }
+  }
+
+  for (i = 0; i < n_circs; ++i) {
+    cell_queue_t *queue = &circs[i].n_chan_cells;
+    packed_cell_t *cell;
+    if (queue->n)
+      policy->notify_circ_inactive(cmux, pol_data, &circs[i], circ_data[i]);
+    while ((cell = TOR_SIMPLEQ_FIRST(&queue->head))) {
+      TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
+      tor_free(cell);
+    }
+    policy->free_circ_data(cmux, pol_data, &circs[i], circ_data[i]);
+  }
+  policy->free_cmux_data(cmux, pol_data);
+  circuitmux_free(cmux);
+  tor_free(circ_data);
+  tor_free(kinds);
+  tor_free(circs);
+}
+
+/** Return the smallest delay in <b>hist</b> that is at least as large as
+ * <b>frac</b> of its entries. */
+static int
+qdelay_sim_percentile(const uint64_t *hist, double frac)
+{
+  uint64_t total = 0, seen = 0;
+  int i;
+  for (i = 0; i <= QDELAY_SIM_MSEC; ++i)
+    total += hist[i];
+  for (i = 0; i <= QDELAY_SIM_MSEC; ++i) {
+    seen += hist[i];
+    if (seen && seen >= frac * total)
+      return i;
+  }
+  return QDELAY_SIM_MSEC;
+}
+
+/** Simulate a channel with bulk, bursty and interactive circuits, first
+ * with some spare capacity and then with none, and report the median and
+ * 99th percentile cell delays for each kind of circuit under the EWMA
+ * policy, and under the queue-delay policy with several weights. */
+static void
+bench_cmux_qdelay(void)
+{
+  const int capacities[] = { 3, 2 };
+  const char *weights[] = { NULL, "0", "100", "1000", "10000" };
+  networkstatus_t ns;
+  uint64_t (*hists)[QDELAY_SIM_MSEC + 1];
+  unsigned c, w;
+
+  memset(&ns, 0, sizeof(ns));
+  ns.net_params = smartlist_new();
+  hists = tor_calloc(QDELAY_SIM_N_KINDS, sizeof(*hists));
+
+  for (c = 0; c < ARRAY_LENGTH(capacities); ++c) {
+    printf("Channel sends %d cells/msec:\n", capacities[c]);
+    for (w = 0; w < ARRAY_LENGTH(weights); ++w) {
+      smartlist_clear(ns.net_params);
+      if (weights[w]) {
+        smartlist_add_asprintf(ns.net_params,
+                     "CircuitPriorityQueueDelayUsecPerCell=%s", weights[w]);
+      }
+      cmux_ewma_set_options(NULL, &ns);
+      memset(hists, 0, QDELAY_SIM_N_KINDS * sizeof(*hists));
+      cmux_qdelay_sim(weights[w] ? &qdelay_policy : &ewma_policy,
+                      capacities[c], hists);
+
+      if (weights[w])
+        printf("  queue delay, %5s usec/cell:", weights[w]);
+      else
+        printf("  EWMA:                         ");
+      for (int kind = 0; kind < QDELAY_SIM_N_KINDS; ++kind) {
+        printf(" %s p50 %4d p99 %4d;", qdelay_sim_kind_names[kind],
+               qdelay_sim_percentile(hists[kind], 0.5),
+               qdelay_sim_percentile(hists[kind], 0.99));
+      }
+      puts("");
+      SMARTLIST_FOREACH(ns.net_params, char *, cp, tor_free(cp));
+    }
+  }
+
+  smartlist_free(ns.net_params);
+  tor_free(hists);
+}
+
+/** Flush <b>sz</b> bytes from <b>buf</b> onto <b>s</b> the way we did
+ * before we had vectored I/O: with one send() per chunk.  Add the number of
+ * system calls we made to *<b>n_calls</b>. */
+static void
+bench_buf_flush_per_chunk(buf_t *buf, tor_socket_t s, size_t sz,
+                          uint64_t *n_calls)
+{
+  while (sz) {
+    size_t n = MIN(buf->head->datalen, sz);
+    ssize_t r = tor_socket_send(s, buf->head->data, n, 0);
+    ++*n_calls;
+    if (r <= 0)
+      break;
+    buf_drain(buf, r);
+    sz -= r;
+    if ((size_t)r < n)
+      break;
+  }
+}
+
+/** Read everything that is waiting on <b>s</b> onto <b>buf</b> the way we
+ * did before we had vectored I/O: first into the space left in the tail
+ * chunk, then into one new chunk at a time.  Add the number of system calls
+ * we made to *<b>n_calls</b>. */
+static void
+bench_buf_read_per_chunk(buf_t *buf, tor_socket_t s, size_t at_most,
+                         uint64_t *n_calls)
+{
+  while (at_most) {
+    chunk_t *chunk = buf->tail;
+    size_t n;
+    ssize_t r;
+    if (!chunk || CHUNK_REMAINING_CAPACITY(chunk) < MIN_READ_LEN)
+      chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
+    n = MIN(CHUNK_REMAINING_CAPACITY(chunk), at_most);
+    r = tor_socket_recv(s, CHUNK_WRITE_PTR(chunk), n, 0);
+    ++*n_calls;
+    if (r <= 0)
+      break;
+    chunk->datalen += r;
+    buf->datalen += r;
+    at_most -= r;
+    if ((size_t)r < n)
+      break;
+  }
+}
+
+/** Measure how many bytes we move per system call, and how long it takes,
+ * when we flush buffers onto a socket and read them back, with and without
+ * vectored I/O. */
+static void
+bench_buf_fd_io(void)
+{
+  const size_t piece_sizes[] = { 512, 4000 };
+  const size_t total = 1<<26, per_flush = 1<<16;
+  char *junk = tor_malloc(4096);
+  unsigned i;
+  int vectored;
+
+  crypto_rand(junk, 4096);
+  reset_perftime();
+
+  for (i = 0; i < ARRAY_LENGTH(piece_sizes); ++i) {
+    for (vectored = 0; vectored <= 1; ++vectored) {
+      tor_socket_t fds[2];
+      buf_t *src = buf_new_with_capacity(piece_sizes[i]);
+      buf_t *dst = buf_new();
+      uint64_t n_write_calls = 0, n_read_calls = 0, start, end;
+      size_t moved = 0;
+      int eof = 0, err = 0;
+
+      if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        puts("Couldn't make a socketpair.");
+        buf_free(src);
+        buf_free(dst);
+        break;
+      }
+      set_socket_nonblocking(fds[0]);
+      set_socket_nonblocking(fds[1]);
+
+      start = perftime();
+      while (moved < total) {
+        while (buf_datalen(src) < per_flush)
+          buf_add(src, junk, piece_sizes[i]);
+        if (vectored) {
+          buf_flush_to_socket(src, fds[0], per_flush);
+          ++n_write_calls;
+          buf_read_from_socket(dst, fds[1], per_flush, &eof, &err);
+          ++n_read_calls;
+        } else {
+          bench_buf_flush_per_chunk(src, fds[0], per_flush, &n_write_calls);
+          bench_buf_read_per_chunk(dst, fds[1], per_flush, &n_read_calls);
+        }
+        moved += buf_datalen(dst);
+        buf_clear(dst);
+      }
+      end = perftime();
+
+      printf("%4d-byte pieces, %s: %.1f bytes per write call, "
+             "%.1f bytes per read call, %.2f ns/byte\n",
+             (int)piece_sizes[i], vectored ? "vectored " : "per-chunk",
+             ((double)moved) / n_write_calls, ((double)moved) / n_read_calls,
+             NANOCOUNT(start, end, moved));
+
+      tor_close_socket_simple(fds[0]);
+      tor_close_socket_simple(fds[1]);
+      buf_free(src);
+      buf_free(dst);
+    }
+  }
+  tor_free(junk);
+}
+
+/** Move data across many loopback socketpairs at once, making one read and
+ * one write system call for each socket, or handing all the reads and all
+ * the writes to io_uring in one batch each. */
+static void
+bench_buf_uring(void)
+{
+  const int conn_counts[] = { 8, 32, 128 };
+  const size_t per_conn = 4096, total = 1<<26;
+  char *junk = tor_malloc(per_conn);
+  unsigned i;
+  int batched, j;
+
+  crypto_rand(junk, per_conn);
+  reset_perftime();
+
+  for (i = 0; i < ARRAY_LENGTH(conn_counts); ++i) {
+    const int n_conns = conn_counts[i];
+    for (batched = 0; batched <= 1; ++batched) {
+      tor_socket_t *fds = tor_calloc(2 * n_conns, sizeof(tor_socket_t));
+      buf_t **src = tor_calloc(n_conns, sizeof(buf_t *));
+      buf_t **dst = tor_calloc(n_conns, sizeof(buf_t *));
+      int *idx = tor_calloc(n_conns, sizeof(int));
+      buf_uring_batch_t *batch = NULL;
+      uint64_t n_syscalls = 0, start, end;
+      size_t moved = 0;
+      int eof = 0, err = 0, n_open = 0, r;
+
+      if (batched) {
+        batch = buf_uring_batch_new(n_conns);
+        if (!batch) {
+          puts("io_uring is not available; skipping.");
+          goto next;
+        }
+      }
+      for (j = 0; j < n_conns; ++j) {
+        if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[2*j]) < 0) {
+          puts("Couldn't make a socketpair.");
+          goto next;
+        }
+        ++n_open;
+        set_socket_nonblocking(fds[2*j]);
+        set_socket_nonblocking(fds[2*j+1]);
+        src[j] = buf_new();
+        dst[j] = buf_new();
+      }
+
+      start = perftime();
+      while (moved < total) {
+        for (j = 0; j < n_conns; ++j)
+          buf_add(src[j], junk, per_conn);
+        if (batched) {
+          for (j = 0; j < n_conns; ++j)
+            buf_uring_batch_add_flush(batch, src[j], fds[2*j], per_conn);
+          buf_uring_batch_run(batch);
+          buf_uring_batch_clear(batch);
+          for (j = 0; j < n_conns; ++j)
+            idx[j] = buf_uring_batch_add_read(batch, dst[j], fds[2*j+1],
+                                              per_conn);
+          buf_uring_batch_run(batch);
+          for (j = 0; j < n_conns; ++j)
+            buf_uring_batch_get_result(batch, idx[j], &r, &eof, &err);
+          buf_uring_batch_clear(batch);
+          n_syscalls += 2;
+        } else {
+          for (j = 0; j < n_conns; ++j)
+            buf_flush_to_socket(src[j], fds[2*j], per_conn);
+          for (j = 0; j < n_conns; ++j)
+            buf_read_from_socket(dst[j], fds[2*j+1], per_conn, &eof, &err);
+          n_syscalls += 2 * n_conns;
+        }
+        for (j = 0; j < n_conns; ++j) {
+          moved += buf_datalen(dst[j]);
+          buf_clear(dst[j]);
+        }
+      }
+      end = perftime();
+
+      printf("%3d connections, %s: %.1f bytes per syscall, %.3f ns/byte\n",
+             n_conns, batched ? "io_uring  " : "per-socket",
+             ((double)moved) / n_syscalls, NANOCOUNT(start, end, moved));
+
+    next:
+      for (j = 0; j < n_open; ++j) {
+        tor_close_socket_simple(fds[2*j]);
+        tor_close_socket_simple(fds[2*j+1]);
+        buf_free(src[j]);
+        buf_free(dst[j]);
+      }
+      buf_uring_batch_free(batch);
+      tor_free(fds);
+      tor_free(src);
+      tor_free(dst);
+      tor_free(idx);
+    }
+  }
+  tor_free(junk);
+}
+
+/** Set up a TLS connection over a loopback socketpair, with <b>server</b>
+ * on fds[0] and <b>client</b> on fds[1].  Return 0 on success, -1 on
+ * failure. */
+static int
+bench_tls_pair_new(tor_socket_t fds[2], tor_tls_t **server,
+                   tor_tls_t **client)
+{
+  int i, s_done = 0, c_done = 0, r;
+
+  *server = *client = NULL;
+  fds[0] = fds[1] = TOR_INVALID_SOCKET;
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    return -1;
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+  *server = tor_tls_new(fds[0], 1);
+  *client = tor_tls_new(fds[1], 0);
+  if (!*server || !*client)
+    return -1;
+  for (i = 0; i < 10000 && !(s_done && c_done); ++i) {
+    if (!c_done) {
+      r = tor_tls_handshake(*client);
+      if (r == TOR_TLS_DONE)
+        c_done = 1;
+      else if (r != TOR_TLS_WANTREAD && r != TOR_TLS_WANTWRITE)
+        return -1;
+    }
+    if (!s_done) {
+      r = tor_tls_handshake(*server);
+      if (r == TOR_TLS_DONE)
+        s_done = 1;
+      else if (r != TOR_TLS_WANTREAD && r != TOR_TLS_WANTWRITE)
+        return -1;
+    }
+  }
+  return (s_done && c_done) ? 0 : -1;
+}
+
+/** Move data through pairs of TLS connections on loopback socketpairs,
+ * doing all of the TLS and socket I/O on the main thread, or handing it to
+ * ORConnThreads shards and moving only plaintext on the main thread.  The
+ * main thread polls the shards rather than sleeping, so the sharded runs
+ * need one core more than they have threads to show what they can do. */
+static void
+bench_or_conn_threads(void)
+{
+  const int thread_counts[] = { 0, 1, 2, 4 };
+  const int n_pairs = 16;
+  const size_t per_pass = 16384, total = 1<<28;
+  char *junk = tor_malloc(per_pass);
+  crypto_pk_t *key = crypto_pk_new();
+  tor_libevent_cfg_t cfg;
+  unsigned i;
+  int j;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  crypto_rand(junk, per_pass);
+  if (crypto_pk_generate_key(key) < 0 ||
+      tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER, key, key,
+                           86400) < 0) {
+    puts("Couldn't set up a TLS context.");
+    goto out;
+  }
+
+  for (i = 0; i < ARRAY_LENGTH(thread_counts); ++i) {
+    const int n_threads = thread_counts[i];
+    tor_socket_t *fds = tor_calloc(2 * n_pairs, sizeof(tor_socket_t));
+    tor_tls_t **tls = tor_calloc(2 * n_pairs, sizeof(tor_tls_t *));
+    orshard_conn_t **sc = tor_calloc(2 * n_pairs, sizeof(orshard_conn_t *));
+    buf_t **src = tor_calloc(n_pairs, sizeof(buf_t *));
+    buf_t **dst = tor_calloc(n_pairs, sizeof(buf_t *));
+    buf_t *scrap = buf_new();
+    size_t moved = 0, n_read, n_written;
+    monotime_t start, end;
+    int n_open = 0;
+
+    for (j = 0; j < n_pairs; ++j) {
+      /* Count the pair as open first, so that we clean up after a failed
+       * handshake. */
+      ++n_open;
+      if (bench_tls_pair_new(&fds[2*j], &tls[2*j], &tls[2*j+1]) < 0) {
+        puts("Couldn't set up a TLS connection.");
+        goto next;
+      }
+      src[j] = buf_new();
+      dst[j] = buf_new();
+    }
+    if (n_threads) {
+      orshard_set_n_threads(n_threads);
+      if (orshard_get_n_threads() != n_threads) {
+        puts("Couldn't start the shards.");
+        goto next;
+      }
+      for (j = 0; j < 2 * n_pairs; ++j) {
+        sc[j] = orshard_conn_new(orshard_get_shard(j % n_threads), fds[j],
+                                 &orshard_tls_io, tls[j], NULL);
+      }
+      for (j = 0; j < n_pairs; ++j)
+        orshard_conn_set_reading(sc[2*j+1], 1);
+    }
+
+    monotime_get(&start);
+    while (moved < total) {
+      for (j = 0; j < n_pairs; ++j) {
+        if (buf_datalen(src[j]) < per_pass)
+          buf_add(src[j], junk, per_pass);
+        if (n_threads) {
+          orshard_conn_flush(sc[2*j], src[j], buf_datalen(src[j]),
+                             &n_read, &n_written);
+          orshard_conn_read(sc[2*j+1], dst[j], 4 * per_pass,
+                            &n_read, &n_written);
+        } else {
+          buf_flush_to_tls(src[j], tls[2*j], buf_datalen(src[j]));
+          buf_read_from_tls(dst[j], tls[2*j+1], 4 * per_pass);
+        }
+        moved += buf_datalen(dst[j]);
+        buf_clear(dst[j]);
+      }
+    }
+    monotime_get(&end);
+
+    printf("ORConnThreads %d, %d connection pairs: %.1f MB/s\n",
+           n_threads, n_pairs,
+           ((double)moved) / monotime_diff_usec(&start, &end));
+
+  next:
+    for (j = 0; j < 2 * n_pairs; ++j) {
+      if (sc[j]) {
+        orshard_conn_release(sc[j], scrap, scrap);
+        orshard_conn_free(sc[j]);
+      }
+    }
+    orshard_set_n_threads(0);
+    for (j = 0; j < 2 * n_open; ++j) {
+      /* Freeing a TLS object closes its socket. */
+      if (tls[j])
+        tor_tls_free(tls[j]);
+      else if (SOCKET_OK(fds[j]))
+        tor_close_socket_simple(fds[j]);
+    }
+    for (j = 0; j < n_open; ++j) {
+      buf_free(src[j]);
+      buf_free(dst[j]);
+    }
+    buf_free(scrap);
+    tor_free(fds);
+    tor_free(tls);
+    tor_free(sc);
+    tor_free(src);
+    tor_free(dst);
+  }
+
+ out:
+  crypto_pk_free(key);
+  tor_free(junk);
+}
+
 static void
 bench_dh(void)
 {
@@ -738,6 +1552,129 @@ bench_md_parse(void)
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
 }
 
+/** Add to <b>policies</b> the exit policy of every router in the
+ * cached-descriptors file at <b>fname</b>. */
+static void
+bench_load_exit_policies(const char *fname, smartlist_t *policies,
+                         smartlist_t *routers)
+{
+  char *body = read_file_to_str(fname, RFTS_IGNORE_MISSING, NULL);
+  const char *cp = body;
+  if (!body) {
+    printf("Couldn't read %s\n", fname);
+    return;
+  }
+  router_parse_list_from_string(&cp, NULL, routers, SAVED_IN_CACHE,
+                                0, 1, NULL, NULL);
+  SMARTLIST_FOREACH(routers, routerinfo_t *, ri,
+                    if (ri->exit_policy)
+                      smartlist_add(policies, ri->exit_policy));
+  tor_free(body);
+}
+
+static void
+bench_exit_policy(void)
+{
+  const int N = 200000;
+  const uint16_t common_ports[] = { 80, 443, 22, 25, 53, 6667, 8080 };
+  smartlist_t *policies = smartlist_new();
+  smartlist_t *routers = smartlist_new();
+  smartlist_t *own_policies = smartlist_new();
+  tor_addr_t *addrs = tor_calloc(N, sizeof(tor_addr_t));
+  uint16_t *ports = tor_calloc(N, sizeof(uint16_t));
+  const char *fname = getenv("TOR_BENCH_CACHED_DESCRIPTORS");
+  uint64_t start, end;
+  int i, n_entries = 0, sink = 0;
+  double linear_ns = 0, compiled_ns = 0;
+
+  if (fname) {
+    bench_load_exit_policies(fname, policies, routers);
+  } else {
+    /* No descriptors: use our own default and reduced exit policies, and
+     * a long blocklist. */
+    const exit_policy_parser_cfg_t cfgs[] = {
+      EXIT_POLICY_IPV6_ENABLED|EXIT_POLICY_REJECT_PRIVATE|
+        EXIT_POLICY_ADD_DEFAULT,
+      EXIT_POLICY_IPV6_ENABLED|EXIT_POLICY_REJECT_PRIVATE|
+        EXIT_POLICY_ADD_REDUCED,
+    };
+    smartlist_t *p;
+    config_line_t *lines = NULL;
+    for (i = 0; i < (int)ARRAY_LENGTH(cfgs); ++i) {
+      p = NULL;
+      policies_parse_exit_policy(NULL, &p, cfgs[i], NULL);
+      smartlist_add(own_policies, p);
+    }
+    for (i = 0; i < 500; ++i) {
+      char line[64];
+      tor_snprintf(line, sizeof(line), "reject %d.%d.%d.0/24:*",
+                   crypto_rand_int(224), crypto_rand_int(256),
+                   crypto_rand_int(256));
+      config_line_append(&lines, "ExitPolicy", line);
+    }
+    p = NULL;
+    policies_parse_exit_policy(lines, &p,
+                               EXIT_POLICY_IPV6_ENABLED|
+                               EXIT_POLICY_REJECT_PRIVATE|
+                               EXIT_POLICY_ADD_DEFAULT, NULL);
+    smartlist_add(own_policies, p);
+    config_free_lines(lines);
+    smartlist_add_all(policies, own_policies);
+  }
+  if (smartlist_len(policies) == 0) {
+    printf("No exit policies to benchmark.\n");
+    goto done;
+  }
+
+  for (i = 0; i < N; ++i) {
+    tor_addr_from_ipv4h(&addrs[i], crypto_rand_u32());
+    ports[i] = (i & 1) ? common_ports[i % ARRAY_LENGTH(common_ports)] :
+      (uint16_t) (1 + crypto_rand_int(65535));
+  }
+
+  SMARTLIST_FOREACH_BEGIN(policies, const smartlist_t *, policy) {
+    addr_policy_compiled_t *c = addr_policy_compile(policy);
+    const int n = N / smartlist_len(policies) + 1;
+    n_entries += smartlist_len(policy);
+
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < n; ++i)
+      sink += compare_tor_addr_to_addr_policy(&addrs[i % N], ports[i % N],
+                                              policy);
+    end = perftime();
+    linear_ns += NANOCOUNT(start, end, n);
+
+    reset_perftime();
+    start = perftime();
+    for (i = 0; i < n; ++i)
+      sink += compare_tor_addr_to_compiled_policy(&addrs[i % N],
+                                                  ports[i % N], c);
+    end = perftime();
+    compiled_ns += NANOCOUNT(start, end, n);
+
+    addr_policy_compiled_free(c);
+  } SMARTLIST_FOREACH_END(policy);
+
+  printf("Exit policy match over %d policies (%.1f entries avg):\n"
+         "  linear:   %.2f nsec/lookup\n  compiled: %.2f nsec/lookup\n",
+         smartlist_len(policies),
+         ((double)n_entries) / smartlist_len(policies),
+         linear_ns / smartlist_len(policies),
+         compiled_ns / smartlist_len(policies));
+  if (sink == 42)
+    puts("");
+
+ done:
+  SMARTLIST_FOREACH(own_policies, smartlist_t *, p, addr_policy_list_free(p));
+  smartlist_free(own_policies);
+  SMARTLIST_FOREACH(routers, routerinfo_t *, ri, routerinfo_free(ri));
+  smartlist_free(routers);
+  smartlist_free(policies);
+  tor_free(addrs);
+  tor_free(ports);
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -759,7 +1696,13 @@ static struct benchmark_t benchmarks[] = {
   ENT(rand),
 
   ENT(cell_aes),
+  ENT(cell_aes_batch),
   ENT(cell_ops),
+  ENT(cmux_ewma),
+  ENT(cmux_qdelay),
+  ENT(buf_fd_io),
+  ENT(buf_uring),
+  ENT(or_conn_threads),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -768,6 +1711,7 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+  ENT(exit_policy),
   {NULL,NULL,0}
 };
 
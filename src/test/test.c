@@ -238,14 +238,14 @@ test_ntor_handshake(void *arg)
 
   /* client handshake 1. */
   memset(c_buf, 0, NTOR_ONIONSKIN_LEN);
-  tt_int_op(0, OP_EQ, onion_skin_ntor_create(node_id, server_pubkey,
+  tt_int_op(0, OP_EQ, onion_skin_ntor_create(node_id, server_pubkey, NULL,
                                           &c_state, c_buf));
 
   /* server handshake */
   memset(s_buf, 0, NTOR_REPLY_LEN);
   memset(s_keys, 0, 40);
   tt_int_op(0, OP_EQ, onion_skin_ntor_server_handshake(c_buf, s_keymap, NULL,
-                                                    node_id,
+                                                    NULL, node_id,
                                                     s_buf, s_keys, 400));
 
   /* client handshake 2 */
@@ -271,6 +271,66 @@ test_ntor_handshake(void *arg)
   dimap_free(s_keymap, NULL);
 }
 
+static void
+test_ntor_handshake_pooled(void *arg)
+{
+  ntor_keypair_pool_t *c_pool = NULL, *s_pool = NULL;
+  ntor_handshake_state_t *c_state = NULL;
+  uint8_t c_buf[NTOR_ONIONSKIN_LEN];
+  uint8_t c_keys[400];
+  di_digest256_map_t *s_keymap=NULL;
+  curve25519_keypair_t s_keypair, kp;
+  uint8_t s_buf[NTOR_REPLY_LEN];
+  uint8_t s_keys[400];
+  uint8_t node_id[20] = "abcdefghijklmnopqrst";
+  int i;
+
+  (void) arg;
+
+  curve25519_keypair_generate(&s_keypair, 0);
+  dimap_add_entry(&s_keymap, s_keypair.pubkey.public_key, &s_keypair);
+
+  /* Filling a pool stops when it's full. */
+  c_pool = ntor_keypair_pool_new(2);
+  s_pool = ntor_keypair_pool_new(3);
+  tt_int_op(ntor_keypair_pool_n_keypairs(c_pool), OP_EQ, 0);
+  tt_int_op(ntor_keypair_pool_fill_one(c_pool), OP_EQ, 1);
+  tt_int_op(ntor_keypair_pool_fill_one(c_pool), OP_EQ, 1);
+  tt_int_op(ntor_keypair_pool_fill_one(c_pool), OP_EQ, 0);
+  tt_assert(ntor_keypair_pool_is_full(c_pool));
+  tt_int_op(ntor_keypair_pool_n_keypairs(c_pool), OP_EQ, 2);
+  curve25519_keypair_generate(&kp, 0);
+  tt_int_op(ntor_keypair_pool_add(c_pool, &kp), OP_EQ, -1);
+  tt_int_op(ntor_keypair_pool_add(s_pool, &kp), OP_EQ, 0);
+  tt_int_op(ntor_keypair_pool_n_keypairs(s_pool), OP_EQ, 1);
+
+  /* Handshakes take their keys from the pools while they last, and then
+   * generate their own. */
+  for (i = 2; i >= 0; --i) {
+    tt_int_op(0, OP_EQ, onion_skin_ntor_create(node_id, &s_keypair.pubkey,
+                                               c_pool, &c_state, c_buf));
+    tt_int_op(0, OP_EQ, onion_skin_ntor_server_handshake(c_buf, s_keymap,
+                                       NULL, s_pool, node_id,
+                                       s_buf, s_keys, 400));
+    tt_int_op(ntor_keypair_pool_n_keypairs(c_pool), OP_EQ, MAX(i-1, 0));
+    tt_int_op(ntor_keypair_pool_n_keypairs(s_pool), OP_EQ, 0);
+    if (i == 2) {
+      /* The server used the keypair we gave it. */
+      tt_mem_op(s_buf, OP_EQ, kp.pubkey.public_key, CURVE25519_PUBKEY_LEN);
+    }
+    tt_int_op(0, OP_EQ, onion_skin_ntor_client_handshake(c_state, s_buf,
+                                                       c_keys, 400, NULL));
+    tt_mem_op(c_keys, OP_EQ, s_keys, 400);
+    ntor_handshake_state_free(c_state);
+  }
+
+ done:
+  ntor_handshake_state_free(c_state);
+  ntor_keypair_pool_free(c_pool);
+  ntor_keypair_pool_free(s_pool);
+  dimap_free(s_keymap, NULL);
+}
+
 static void
 test_fast_handshake(void *arg)
 {
@@ -355,6 +415,73 @@ test_onion_queues(void *arg)
   tor_free(onionskin);
 }
 
+/** Run unit tests for shedding load from the onion queues when their
+ * delay stays above target. */
+static void
+test_onion_queue_codel(void *arg)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  or_circuit_t *circs[5];
+  create_cell_t *onionskin = NULL;
+  int i;
+  (void)arg;
+
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(INT64_C(1000) * 1000000);
+
+  for (i = 0; i < 5; ++i) {
+    create_cell_t *cc = tor_malloc_zero(sizeof(create_cell_t));
+    create_cell_init(cc, CELL_CREATE, ONION_HANDSHAKE_TYPE_NTOR,
+                     NTOR_ONIONSKIN_LEN, buf);
+    circs[i] = or_circuit_new(0, NULL);
+    TO_CIRCUIT(circs[i])->purpose = CIRCUIT_PURPOSE_OR;
+    tt_int_op(0, OP_EQ, onion_pending_add(circs[i], cc));
+  }
+  tt_int_op(5, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_u64_op(0, OP_EQ, onion_queue_get_delay_percentile_msec(50));
+
+  /* Above target, but not yet for a whole interval: nothing is dropped. */
+  monotime_coarse_set_mock_time_nsec(INT64_C(1200) * 1000000);
+  tt_ptr_op(circs[0], OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_int_op(4, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_u64_op(0, OP_EQ, onion_queue_get_n_dropped());
+
+  /* Still above target a full interval later: the head gets dropped. */
+  monotime_coarse_set_mock_time_nsec(INT64_C(2300) * 1000000);
+  tt_ptr_op(circs[2], OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_int_op(2, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_u64_op(1, OP_EQ, onion_queue_get_n_dropped());
+  tt_assert(TO_CIRCUIT(circs[1])->marked_for_close);
+  tt_int_op(TO_CIRCUIT(circs[1])->marked_for_close_reason, OP_EQ,
+            END_CIRC_REASON_RESOURCELIMIT);
+  tt_ptr_op(circs[1]->onionqueue_entry, OP_EQ, NULL);
+
+  /* Processed after 200 msec and 1300 msec. */
+  tt_u64_op(256, OP_EQ, onion_queue_get_delay_percentile_msec(50));
+  tt_u64_op(2048, OP_EQ, onion_queue_get_delay_percentile_msec(99));
+
+  /* While dropping, we keep dropping, but never the last entry. */
+  monotime_coarse_set_mock_time_nsec(INT64_C(9000) * 1000000);
+  tt_ptr_op(circs[4], OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_int_op(0, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_u64_op(2, OP_EQ, onion_queue_get_n_dropped());
+  tt_assert(TO_CIRCUIT(circs[3])->marked_for_close);
+  tt_ptr_op(NULL, OP_EQ, onion_next_task(&onionskin));
+
+  onion_queue_log_delay_stats();
+  tt_u64_op(0, OP_EQ, onion_queue_get_n_dropped());
+  tt_u64_op(0, OP_EQ, onion_queue_get_delay_percentile_msec(50));
+
+ done:
+  clear_pending_onions();
+  circuit_free_all();
+  tor_free(onionskin);
+  monotime_disable_test_mocking();
+}
+
 static void
 test_circuit_timeout(void *arg)
 {
@@ -656,7 +783,9 @@ static struct testcase_t test_array[] = {
   ENT(onion_handshake),
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
+  ENT(onion_queue_codel),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
+  { "ntor_handshake_pooled", test_ntor_handshake_pooled, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
   FORK(rend_fns),
@@ -690,6 +819,7 @@ struct testgroup_t testgroups[] = {
   { "config/", config_tests },
   { "config/mgr/", confmgr_tests },
   { "config/parse/", confparse_tests },
+  { "congestion_control/", congestion_control_tests },
   { "connection/", connection_tests },
   { "conscache/", conscache_tests },
   { "consdiff/", consdiff_tests },
@@ -699,6 +829,7 @@ struct testgroup_t testgroups[] = {
   { "control/", controller_tests },
   { "control/btrack/", btrack_tests },
   { "control/event/", controller_event_tests },
+  { "cpuworker/", cpuworker_tests },
   { "crypto/", crypto_tests },
   { "crypto/ope/", crypto_ope_tests },
 #ifdef ENABLE_OPENSSL
@@ -738,12 +869,16 @@ struct testgroup_t testgroups[] = {
   { "legacy_hs/", hs_tests },
   { "link-handshake/", link_handshake_tests },
   { "mainloop/", mainloop_tests },
+  { "metrics/", metrics_tests },
+  { "multipath/", multipath_tests },
   { "netinfo/", netinfo_tests },
+  { "netparams/", netparams_tests },
   { "nodelist/", nodelist_tests },
   { "oom/", oom_tests },
   { "oos/", oos_tests },
   { "options/", options_tests },
   { "options/act/", options_act_tests },
+  { "orshard/", orshard_tests },
   { "parsecommon/", parsecommon_tests },
   { "periodic-event/" , periodic_event_tests },
   { "policy/" , policy_tests },
@@ -108,6 +108,7 @@ extern struct testcase_t circuituse_tests[];
 extern struct testcase_t compat_libevent_tests[];
 extern struct testcase_t config_tests[];
 extern struct testcase_t confmgr_tests[];
+extern struct testcase_t congestion_control_tests[];
 extern struct testcase_t confparse_tests[];
 extern struct testcase_t connection_tests[];
 extern struct testcase_t conscache_tests[];
@@ -116,6 +117,7 @@ extern struct testcase_t consdiffmgr_tests[];
 extern struct testcase_t container_tests[];
 extern struct testcase_t controller_event_tests[];
 extern struct testcase_t controller_tests[];
+extern struct testcase_t cpuworker_tests[];
 extern struct testcase_t crypto_ope_tests[];
 extern struct testcase_t crypto_openssl_tests[];
 extern struct testcase_t crypto_rng_tests[];
@@ -152,12 +154,16 @@ extern struct testcase_t logging_tests[];
 extern struct testcase_t mainloop_tests[];
 extern struct testcase_t microdesc_tests[];
 extern struct testcase_t namemap_tests[];
+extern struct testcase_t metrics_tests[];
+extern struct testcase_t multipath_tests[];
 extern struct testcase_t netinfo_tests[];
+extern struct testcase_t netparams_tests[];
 extern struct testcase_t nodelist_tests[];
 extern struct testcase_t oom_tests[];
 extern struct testcase_t oos_tests[];
 extern struct testcase_t options_tests[];
 extern struct testcase_t options_act_tests[];
+extern struct testcase_t orshard_tests[];
 extern struct testcase_t parsecommon_tests[];
 extern struct testcase_t pem_tests[];
 extern struct testcase_t periodic_event_tests[];
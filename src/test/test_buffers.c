@@ -11,6 +11,7 @@
 #include "lib/tls/tortls.h"
 #include "lib/compress/compress.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/net/buffers_net.h"
 #include "core/proto/proto_http.h"
 #include "core/proto/proto_socks.h"
 #include "test/test.h"
@@ -211,6 +212,8 @@ test_buffer_pullup(void *arg)
   (void)arg;
   stuff = tor_malloc(16384);
   tmp = tor_malloc(16384);
+  /* Don't count freed chunks at the end of the test. */
+  buf_set_freelist_max_bytes(0);
 
   buf = buf_new_with_capacity(3000); /* rounds up to next power of 2. */
 
@@ -439,6 +442,9 @@ test_buffer_allocation_tracking(void *arg)
 
   (void)arg;
 
+  /* This test checks that freed chunks really go back to the system. */
+  buf_set_freelist_max_bytes(0);
+
   crypto_rand(junk, 16384);
   tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
 
@@ -498,6 +504,69 @@ test_buffer_allocation_tracking(void *arg)
   tor_free(junk);
 }
 
+static void
+test_buffer_freelists(void *arg)
+{
+  char *junk = tor_malloc(16384);
+  buf_t *buf1 = NULL, *buf2 = NULL;
+  int i;
+
+  (void)arg;
+
+  crypto_rand(junk, 16384);
+  /* Start out with empty freelists. */
+  buf_shrink_freelists(1);
+  buf_set_freelist_max_bytes(3*4096);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+  /* Four 4k chunks. */
+  buf1 = buf_new();
+  for (i = 0; i < 4; ++i)
+    buf_add(buf1, junk, 4000);
+  tt_int_op(buf_allocation(buf1), OP_EQ, 16384);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 16384);
+
+  /* Three of them fit on the freelist; the fourth goes back to the system,
+   * and the freelist still counts toward our total allocation. */
+  buf_free(buf1);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 3*4096);
+
+  /* New chunks of the same size come from the freelist. */
+  buf2 = buf_new();
+  buf_add(buf2, junk, 4000);
+  buf_add(buf2, junk, 4000);
+  tt_int_op(buf_allocation(buf2), OP_EQ, 8192);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 3*4096);
+
+  /* Chunks of other sizes don't. */
+  buf1 = buf_new_with_capacity(4096);
+  buf_add(buf1, junk, 100);
+  tt_int_op(buf_allocation(buf1), OP_EQ, 8192);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 3*4096 + 8192);
+  buf_free(buf1);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 3*4096 + 8192);
+
+  /* Shrinking only releases chunks that have sat unused on a freelist
+   * since the last shrink; the first time around, there aren't any. */
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 0);
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 4096 + 8192);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 8192);
+
+  /* Lowering the high-water mark trims the freelists at once. */
+  buf_free(buf2);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 8192);
+  buf_set_freelist_max_bytes(4096);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 4096);
+
+  tt_int_op(buf_shrink_freelists(1), OP_EQ, 4096);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  buf_free(buf1);
+  buf_free(buf2);
+  tor_free(junk);
+}
+
 static void
 test_buffer_time_tracking(void *arg)
 {
@@ -858,6 +927,234 @@ test_buffer_peek_startswith(void *arg)
   buf_free(buf);
 }
 
+/** Return the number of chunks in <b>buf</b>. */
+static int
+buf_n_chunks(const buf_t *buf)
+{
+  int n = 0;
+  const chunk_t *ch;
+  for (ch = buf->head; ch; ch = ch->next)
+    ++n;
+  return n;
+}
+
+/** Move data across a socketpair or a pipe with buf_flush_to_socket() and
+ * buf_read_from_socket(), or their pipe equivalents, making sure that reads
+ * and writes spanning several chunks come out intact. */
+static void
+test_buffers_fd_io(void *arg)
+{
+  const bool use_pipe = !strcmp(arg, "pipe");
+  const size_t total = 65536;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *src = NULL, *dst = NULL;
+  char *data = tor_malloc(total), *out = tor_malloc(total);
+  size_t off;
+  int i, r, eof = 0, err = 0;
+
+  crypto_rand(data, total);
+
+  if (use_pipe) {
+#ifdef _WIN32
+    tt_skip();
+#else
+    int pipefds[2];
+    tt_int_op(pipe(pipefds), OP_EQ, 0);
+    fds[0] = pipefds[1];
+    fds[1] = pipefds[0];
+#endif /* defined(_WIN32) */
+  } else {
+    tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  }
+  tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[1]), OP_EQ, 0);
+
+  /* Small chunks, so that a single flush has to span many of them. */
+  src = buf_new_with_capacity(1024);
+  dst = buf_new_with_capacity(1024);
+  for (off = 0; off < total; off += 1000)
+    buf_add(src, data + off, MIN(1000, total - off));
+  tt_int_op(buf_n_chunks(src), OP_GT, 16);
+
+  /* Leave a little room in the tail of dst, so that reads have to fill it
+   * before they spill into new chunks. */
+  buf_add(dst, "X", 1);
+
+  for (i = 0; i < 1000 && buf_datalen(dst) < total + 1; ++i) {
+    if (buf_datalen(src)) {
+      if (use_pipe)
+        r = buf_flush_to_pipe(src, fds[0], buf_datalen(src));
+      else
+        r = buf_flush_to_socket(src, fds[0], buf_datalen(src));
+      tt_int_op(r, OP_GE, 0);
+      buf_assert_ok(src);
+    }
+    if (use_pipe)
+      r = buf_read_from_pipe(dst, fds[1], total, &eof, &err);
+    else
+      r = buf_read_from_socket(dst, fds[1], total, &eof, &err);
+    tt_int_op(r, OP_GE, 0);
+    tt_int_op(eof, OP_EQ, 0);
+    buf_assert_ok(dst);
+    /* We should never leave an empty chunk at the end of the buffer. */
+    tt_uint_op(dst->tail->datalen, OP_GT, 0);
+  }
+  tt_int_op(buf_datalen(src), OP_EQ, 0);
+  tt_int_op(buf_datalen(dst), OP_EQ, total + 1);
+
+  tt_int_op(buf_get_bytes(dst, out, 1), OP_EQ, total);
+  tt_mem_op(out, OP_EQ, "X", 1);
+  tt_int_op(buf_get_bytes(dst, out, total), OP_EQ, 0);
+  tt_mem_op(out, OP_EQ, data, total);
+
+  /* Nothing to read: we should just block. */
+  if (use_pipe)
+    r = buf_read_from_pipe(dst, fds[1], total, &eof, &err);
+  else
+    r = buf_read_from_socket(dst, fds[1], total, &eof, &err);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 0);
+  tt_int_op(buf_datalen(dst), OP_EQ, 0);
+
+  /* Close the writing side; the next read should report EOF. */
+  tor_close_socket_simple(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  if (use_pipe)
+    r = buf_read_from_pipe(dst, fds[1], total, &eof, &err);
+  else
+    r = buf_read_from_socket(dst, fds[1], total, &eof, &err);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 1);
+  tt_int_op(buf_datalen(dst), OP_EQ, 0);
+  buf_assert_ok(dst);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket_simple(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket_simple(fds[1]);
+  buf_free(src);
+  buf_free(dst);
+  tor_free(data);
+  tor_free(out);
+}
+
+static void
+test_buffers_uring_batch(void *arg)
+{
+  const size_t total = 65536;
+  tor_socket_t a[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_socket_t b[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_uring_batch_t *batch = NULL;
+  buf_t *src = NULL, *dst = NULL, *idle = NULL;
+  char *data = tor_malloc(total), *out = tor_malloc(total);
+  size_t off;
+  int i, idx_w, idx_r, idx_idle, r, eof, err;
+
+  (void)arg;
+
+  batch = buf_uring_batch_new(4);
+  if (!batch) {
+    /* No io_uring here. */
+    tt_skip();
+  }
+
+  crypto_rand(data, total);
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, a), OP_EQ, 0);
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, b), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(a[0]), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(a[1]), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(b[1]), OP_EQ, 0);
+
+  src = buf_new_with_capacity(1024);
+  dst = buf_new_with_capacity(1024);
+  idle = buf_new();
+  for (off = 0; off < total; off += 1000)
+    buf_add(src, data + off, MIN(1000, total - off));
+  buf_add(dst, "X", 1);
+
+  /* Write and read the same socketpair in each batch, along with a read on
+   * a socket that never has anything to read. */
+  for (i = 0; i < 1000 && buf_datalen(dst) < total + 1; ++i) {
+    idx_w = -1;
+    if (buf_datalen(src)) {
+      idx_w = buf_uring_batch_add_flush(batch, src, a[0], buf_datalen(src));
+      tt_int_op(idx_w, OP_GE, 0);
+    }
+    idx_r = buf_uring_batch_add_read(batch, dst, a[1], total);
+    tt_int_op(idx_r, OP_GE, 0);
+    idx_idle = buf_uring_batch_add_read(batch, idle, b[1], total);
+    tt_int_op(idx_idle, OP_GE, 0);
+    tt_int_op(buf_uring_batch_run(batch), OP_EQ, 0);
+
+    eof = err = 0;
+    if (idx_w >= 0) {
+      tt_int_op(buf_uring_batch_get_result(batch, idx_w, &r, NULL, NULL),
+                OP_EQ, 0);
+      tt_int_op(r, OP_GE, 0);
+    }
+    tt_int_op(buf_uring_batch_get_result(batch, idx_r, &r, &eof, &err),
+              OP_EQ, 0);
+    tt_int_op(r, OP_GE, 0);
+    tt_int_op(eof, OP_EQ, 0);
+    tt_int_op(buf_uring_batch_get_result(batch, idx_idle, &r, &eof, &err),
+              OP_EQ, 0);
+    tt_int_op(r, OP_EQ, 0);
+    tt_int_op(eof, OP_EQ, 0);
+    buf_uring_batch_clear(batch);
+
+    buf_assert_ok(src);
+    buf_assert_ok(dst);
+    tt_int_op(buf_datalen(idle), OP_EQ, 0);
+    buf_assert_ok(idle);
+  }
+  tt_int_op(buf_datalen(src), OP_EQ, 0);
+  tt_int_op(buf_datalen(dst), OP_EQ, total + 1);
+  tt_int_op(buf_get_bytes(dst, out, 1), OP_EQ, total);
+  tt_mem_op(out, OP_EQ, "X", 1);
+  tt_int_op(buf_get_bytes(dst, out, total), OP_EQ, 0);
+  tt_mem_op(out, OP_EQ, data, total);
+
+  /* A batch only has room for so many operations. */
+  for (i = 0; i < 4; ++i)
+    tt_int_op(buf_uring_batch_add_read(batch, idle, b[1], 1024), OP_EQ, i);
+  tt_assert(buf_uring_batch_is_full(batch));
+  tt_int_op(buf_uring_batch_add_read(batch, idle, b[1], 1024), OP_EQ, -1);
+  /* Clearing a batch that never ran gives back the space it reserved. */
+  buf_uring_batch_clear(batch);
+  tt_int_op(buf_datalen(idle), OP_EQ, 0);
+  buf_assert_ok(idle);
+
+  /* Close the writing side; the next read should report EOF. */
+  tor_close_socket_simple(a[0]);
+  a[0] = TOR_INVALID_SOCKET;
+  idx_r = buf_uring_batch_add_read(batch, dst, a[1], total);
+  tt_int_op(buf_uring_batch_run(batch), OP_EQ, 0);
+  eof = 0;
+  tt_int_op(buf_uring_batch_get_result(batch, idx_r, &r, &eof, &err),
+            OP_EQ, 0);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 1);
+  buf_uring_batch_clear(batch);
+  tt_int_op(buf_datalen(dst), OP_EQ, 0);
+
+ done:
+  buf_uring_batch_free(batch);
+  if (SOCKET_OK(a[0]))
+    tor_close_socket_simple(a[0]);
+  if (SOCKET_OK(a[1]))
+    tor_close_socket_simple(a[1]);
+  if (SOCKET_OK(b[0]))
+    tor_close_socket_simple(b[0]);
+  if (SOCKET_OK(b[1]))
+    tor_close_socket_simple(b[1]);
+  buf_free(src);
+  buf_free(dst);
+  buf_free(idle);
+  tor_free(data);
+  tor_free(out);
+}
+
 struct testcase_t buffer_tests[] = {
   { "basic", test_buffers_basic, TT_FORK, NULL, NULL },
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
@@ -866,11 +1163,17 @@ struct testcase_t buffer_tests[] = {
   { "startswith", test_buffer_peek_startswith, 0, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
+  { "freelists", test_buffer_freelists, TT_FORK, NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
   { "find_contentlen", test_buffers_find_contentlen, 0, NULL, NULL },
+  { "fd_io/socket", test_buffers_fd_io, TT_FORK,
+    &passthrough_setup, (char*)"socket" },
+  { "fd_io/pipe", test_buffers_fd_io, TT_FORK,
+    &passthrough_setup, (char*)"pipe" },
+  { "uring_batch", test_buffers_uring_batch, TT_FORK, NULL, NULL },
 
   { "compress/zlib", test_buffers_compress, TT_FORK,
     &passthrough_setup, (char*)"deflate" },
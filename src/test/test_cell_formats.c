@@ -22,6 +22,7 @@
 #include "core/or/cell_st.h"
 #include "core/or/cell_queue_st.h"
 #include "core/or/var_cell_st.h"
+#include "lib/malloc/slab.h"
 
 #include "test/test.h"
 
@@ -1327,6 +1328,36 @@ test_cfmt_is_destroy(void *arg)
   tor_free(chan);
 }
 
+static void
+test_cfmt_var_cell_alloc(void *arg)
+{
+  var_cell_t *small = NULL, *big = NULL, *copy = NULL;
+  (void)arg;
+
+  /* Small var cells come from a pool, and start on a cache line. */
+  small = var_cell_new(100);
+  tt_int_op(small->payload_len, OP_EQ, 100);
+  tt_int_op(((uintptr_t)small) % SLAB_OBJ_ALIGN, OP_EQ, 0);
+  memset(small->payload, 0x5a, 100);
+  small->command = CELL_VERSIONS;
+
+  copy = var_cell_copy(small);
+  tt_int_op(((uintptr_t)copy) % SLAB_OBJ_ALIGN, OP_EQ, 0);
+  tt_int_op(copy->command, OP_EQ, CELL_VERSIONS);
+  tt_mem_op(copy->payload, OP_EQ, small->payload, 100);
+
+  /* Big ones come from tor_malloc(). */
+  big = var_cell_new(60000);
+  tt_int_op(big->payload_len, OP_EQ, 60000);
+  tt_int_op(big->command, OP_EQ, 0);
+  big->payload[59999] = 7;
+
+ done:
+  var_cell_free(small);
+  var_cell_free(copy);
+  var_cell_free(big);
+}
+
 #define TEST(name, flags)                                               \
   { #name, test_cfmt_ ## name, flags, 0, NULL }
 
@@ -1340,5 +1371,6 @@ struct testcase_t cell_format_tests[] = {
   TEST(extended_cells, 0),
   TEST(resolved_cells, 0),
   TEST(is_destroy, 0),
+  TEST(var_cell_alloc, 0),
   END_OF_TESTCASES
 };
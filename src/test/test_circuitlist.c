@@ -7,6 +7,7 @@
 #define HS_CIRCUITMAP_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
+#include "core/or/circid_table.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux_ewma.h"
@@ -169,12 +170,18 @@ test_clist_maps(void *arg)
     circuit_free_(TO_CIRCUIT(or_c1));
   if (or_c2)
     circuit_free_(TO_CIRCUIT(or_c2));
-  if (ch1)
+  if (ch1) {
     tor_free(ch1->cmux);
-  if (ch2)
+    circid_table_free(ch1->circid_table);
+  }
+  if (ch2) {
     tor_free(ch2->cmux);
-  if (ch3)
+    circid_table_free(ch2->circid_table);
+  }
+  if (ch3) {
     tor_free(ch3->cmux);
+    circid_table_free(ch3->circid_table);
+  }
   tor_free(ch1);
   tor_free(ch2);
   tor_free(ch3);
@@ -379,6 +386,8 @@ test_pick_circid(void *arg)
  done:
   circuitmux_free(chan1->cmux);
   circuitmux_free(chan2->cmux);
+  circid_table_free(chan1->circid_table);
+  circid_table_free(chan2->circid_table);
   tor_free(chan1);
   tor_free(chan2);
   bitarray_free(ba);
@@ -387,6 +396,90 @@ test_pick_circid(void *arg)
   UNMOCK(channel_dump_statistics);
 }
 
+static void
+test_circid_table(void *arg)
+{
+  circid_table_t *table = circid_table_new();
+  circid_table_entry_t *ent;
+  bitarray_t *ba = NULL;
+  circid_t circid, last = 0;
+  int i;
+  (void) arg;
+
+  /* Lookups, with enough entries to resize the table a few times. */
+  tt_ptr_op(circid_table_get(table, 5), OP_EQ, NULL);
+  for (i = 1; i <= 1000; ++i) {
+    ent = circid_table_add(table, i * 7919);
+    tt_assert(ent->used);
+    tt_uint_op(ent->circ_id, OP_EQ, i * 7919);
+    ent->made_placeholder_at = i;
+  }
+  tt_uint_op(table->n_entries, OP_EQ, 1000);
+  tt_uint_op(table->capacity, OP_EQ, 2048);
+  tt_ptr_op(circid_table_add(table, 7919), OP_EQ,
+            circid_table_get(table, 7919));
+  tt_uint_op(table->n_entries, OP_EQ, 1000);
+
+  /* Removing entries must not hide the ones that probed past them. */
+  for (i = 2; i <= 1000; i += 2)
+    circid_table_remove(table, circid_table_get(table, i * 7919));
+  for (i = 1; i <= 1000; ++i) {
+    ent = circid_table_get(table, i * 7919);
+    if (i % 2) {
+      tt_assert(ent);
+      tt_int_op(ent->made_placeholder_at, OP_EQ, i);
+    } else {
+      tt_ptr_op(ent, OP_EQ, NULL);
+    }
+  }
+  for (i = 1; i <= 1000; i += 2)
+    circid_table_remove(table, circid_table_get(table, i * 7919));
+  tt_uint_op(table->n_entries, OP_EQ, 0);
+  tt_uint_op(table->capacity, OP_EQ, 16);
+
+  /* The allocator never hands out an ID that is in the table, or one from
+   * the other half of the ID space. */
+  circid_table_add(table, 0x8005);
+  ba = bitarray_init_zero(1<<15);
+  for (i = 0; i < 3000; ++i) {
+    circid = circid_table_pick_free(table, 0x8000, 0x7fff);
+    tt_uint_op(circid, OP_GT, 0x8000);
+    tt_uint_op(circid, OP_LE, 0xffff);
+    tt_uint_op(circid, OP_NE, 0x8005);
+    tt_assert(! bitarray_is_set(ba, circid & 0x7fff));
+    bitarray_set(ba, circid & 0x7fff);
+    circid_table_add(table, circid);
+    circid_table_add(table, circid & 0x7fff);
+  }
+  tt_uint_op(table->alloc_window, OP_EQ, 4096);
+  tt_uint_op(table->alloc_n_used, OP_GE, 3000);
+
+  /* When it runs out, removing an entry frees its ID again. */
+  for (i = 0; i < (1<<15); ++i) {
+    circid = circid_table_pick_free(table, 0x8000, 0x7fff);
+    if (circid == 0)
+      break;
+    circid_table_add(table, circid);
+    last = circid;
+  }
+  tt_int_op(i, OP_EQ, (1<<15) - 3002);
+  circid_table_remove(table, circid_table_get(table, last));
+  tt_uint_op(circid_table_pick_free(table, 0x8000, 0x7fff), OP_EQ, last);
+
+  /* 0 is never free. */
+  for (i = 0; i < 100; ++i) {
+    circid = circid_table_pick_free(table, 0, 0x7fff);
+    tt_uint_op(circid, OP_GT, 0);
+    tt_uint_op(circid, OP_LT, 0x8000);
+    tt_assert(! circid_table_get(table, circid));
+    circid_table_add(table, circid);
+  }
+
+ done:
+  circid_table_free(table);
+  bitarray_free(ba);
+}
+
 /** Test that the circuit pools of our HS circuitmap are isolated based on
  *  their token type. */
 static void
@@ -468,6 +561,7 @@ struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
+  { "circid_table", test_circid_table, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
     TT_FORK, NULL, NULL },
   END_OF_TESTCASES
@@ -10,10 +10,14 @@
 #include "core/or/channel.h"
 #include "core/or/circuitmux.h"
 #include "core/or/circuitmux_ewma.h"
+#include "core/or/cell_queue_st.h"
 #include "core/or/destroy_cell_queue_st.h"
 #include "core/or/relay.h"
 #include "core/or/scheduler.h"
 
+#include "app/config/or_options_st.h"
+#include "core/or/or_circuit_st.h"
+
 #include "test/fakechans.h"
 #include "test/fakecircs.h"
 #include "test/test.h"
@@ -72,47 +76,58 @@ test_cmux_destroy_cell_queue(void *arg)
  done:
   free_fake_channel(ch);
   packed_cell_free(pc);
-  tor_free(dc);
+  destroy_cell_free(dc);
 
   UNMOCK(scheduler_release_channel);
 }
 
 static void
-test_cmux_compute_ticks(void *arg)
+test_cmux_compute_scale(void *arg)
 {
   const int64_t NS_PER_S = 1000 * 1000 * 1000;
   const int64_t START_NS = UINT64_C(1217709000)*NS_PER_S;
+  const uint64_t ONE = UINT64_C(1) << EWMA_FRAC_BITS;
   int64_t now;
-  double rem;
-  unsigned tick;
+  uint64_t scale;
+  unsigned epoch;
   (void)arg;
   circuitmux_ewma_free_all();
   monotime_enable_test_mocking();
 
   monotime_coarse_set_mock_time_nsec(START_NS);
   cell_ewma_initialize_ticks();
-  const unsigned tick_zero = cell_ewma_get_current_tick_and_fraction(&rem);
-  tt_double_op(rem, OP_GT, -1e-9);
-  tt_double_op(rem, OP_LT, 1e-9);
+  cmux_ewma_set_options(NULL, NULL); /* 30 second halflife */
+  scale = cell_ewma_get_current_scale(&epoch);
+  const unsigned epoch_zero = epoch;
+  tt_u64_op(scale, OP_EQ, ONE);
+
+  /* One halflife later, a cell is worth twice as much. */
+  now = START_NS + NS_PER_S * 30;
+  monotime_coarse_set_mock_time_nsec(now);
+  scale = cell_ewma_get_current_scale(&epoch);
+  tt_uint_op(epoch, OP_EQ, epoch_zero);
+  tt_u64_op(scale, OP_EQ, 2 * ONE);
 
-  /* 1.5 second later and we should still be in the same tick. */
-  now = START_NS + NS_PER_S + NS_PER_S/2;
+  /* Another half a halflife later, it's worth about 2.83 times as much. */
+  now = START_NS + NS_PER_S * 45;
   monotime_coarse_set_mock_time_nsec(now);
-  tick = cell_ewma_get_current_tick_and_fraction(&rem);
-  tt_uint_op(tick, OP_EQ, tick_zero);
-#ifdef USING_32BIT_MSEC_HACK
-  const double tolerance = .0005;
-#else
-  const double tolerance = .00000001;
-#endif
-  tt_double_op(fabs(rem - .15), OP_LT, tolerance);
-
-  /* 25 second later and we should be in another tick. */
-  now = START_NS + NS_PER_S * 25;
+  scale = cell_ewma_get_current_scale(&epoch);
+  tt_uint_op(epoch, OP_EQ, epoch_zero);
+  tt_double_op(fabs((double)scale / ONE - 2.0 * sqrt(2.0)), OP_LT, .01);
+
+  /* 16.5 halflives later and we should be in another epoch. */
+  now = START_NS + NS_PER_S * 495;
+  monotime_coarse_set_mock_time_nsec(now);
+  scale = cell_ewma_get_current_scale(&epoch);
+  tt_uint_op(epoch, OP_EQ, epoch_zero + 1);
+  tt_double_op(fabs((double)scale / ONE - sqrt(2.0)), OP_LT, .01);
+
+  /* Much later, and we've skipped several epochs. */
+  now = START_NS + NS_PER_S * 30 * 16 * 5;
   monotime_coarse_set_mock_time_nsec(now);
-  tick = cell_ewma_get_current_tick_and_fraction(&rem);
-  tt_uint_op(tick, OP_EQ, tick_zero + 2);
-  tt_double_op(fabs(rem - .5), OP_LT, tolerance);
+  scale = cell_ewma_get_current_scale(&epoch);
+  tt_uint_op(epoch, OP_EQ, epoch_zero + 5);
+  tt_u64_op(scale, OP_EQ, ONE);
 
  done:
   ;
@@ -433,6 +448,120 @@ test_cmux_xmit_cell(void *arg)
   free_fake_channel(nchan);
 }
 
+static void
+test_cmux_qdelay_select(void *arg)
+{
+  or_options_t *options = tor_malloc_zero(sizeof(or_options_t));
+
+  (void) arg;
+
+  /* By default, and with no consensus, we use EWMA. */
+  options->CircuitPriorityHalflife = -1;
+  options->CircuitPriorityQueueDelay = -1;
+  cmux_ewma_set_options(options, NULL);
+  tt_ptr_op(cmux_ewma_get_default_policy(), OP_EQ, &ewma_policy);
+
+  options->CircuitPriorityQueueDelay = 1;
+  cmux_ewma_set_options(options, NULL);
+  tt_ptr_op(cmux_ewma_get_default_policy(), OP_EQ, &qdelay_policy);
+
+  options->CircuitPriorityQueueDelay = 0;
+  cmux_ewma_set_options(options, NULL);
+  tt_ptr_op(cmux_ewma_get_default_policy(), OP_EQ, &ewma_policy);
+
+ done:
+  tor_free(options);
+}
+
+/** Append <b>n</b> cells to the outbound queue of <b>circ</b>, as if they
+ * had been queued at the coarse stamp <b>stamp</b>, and tell the circuitmux
+ * of its n_chan about them. */
+static void
+qdelay_queue_cells(circuit_t *circ, int n, uint32_t stamp)
+{
+  for (int i = 0; i < n; ++i) {
+    packed_cell_t *cell = packed_cell_new();
+    cell->inserted_timestamp = stamp;
+    cell_queue_append(&circ->n_chan_cells, cell);
+  }
+  circuitmux_set_num_cells(circ->n_chan->cmux, circ, circ->n_chan_cells.n);
+}
+
+/** Take <b>n</b> cells off the outbound queue of <b>circ</b>, as if we had
+ * sent them. */
+static void
+qdelay_send_cells(circuit_t *circ, int n)
+{
+  for (int i = 0; i < n; ++i) {
+    packed_cell_t *cell = cell_queue_pop(&circ->n_chan_cells);
+    packed_cell_free(cell);
+  }
+  circuitmux_notify_xmit_cells(circ->n_chan->cmux, circ, n);
+}
+
+static void
+test_cmux_qdelay_pick(void *arg)
+{
+  channel_t *pchan = NULL, *nchan = NULL;
+  or_circuit_t *orcirc_a = NULL, *orcirc_b = NULL;
+  circuit_t *a, *b;
+  circuitmux_t *cmux;
+  destroy_cell_queue_t *cq = NULL;
+  const uint32_t t0 = 1000000;
+  /* Coarse stamps are a little coarser than a msec, so convert whole
+   * offsets rather than multiplying a single msec. */
+  const uint32_t t10 =
+    t0 + (uint32_t) monotime_msec_to_approx_coarse_stamp_units(10);
+  const uint32_t t50 =
+    t0 + (uint32_t) monotime_msec_to_approx_coarse_stamp_units(50);
+
+  (void) arg;
+
+  cmux_ewma_set_options(NULL, NULL);
+  pchan = new_fake_channel();
+  nchan = new_fake_channel();
+  cmux = nchan->cmux;
+  circuitmux_set_policy(cmux, &qdelay_policy);
+  tt_ptr_op(circuitmux_get_policy(cmux), OP_EQ, &qdelay_policy);
+
+  orcirc_a = new_fake_orcirc(nchan, pchan);
+  orcirc_b = new_fake_orcirc(nchan, pchan);
+  a = TO_CIRCUIT(orcirc_a);
+  b = TO_CIRCUIT(orcirc_b);
+
+  /* Neither circuit has sent anything, so the older cell goes first. */
+  qdelay_queue_cells(b, 1, t50);
+  qdelay_queue_cells(a, 1, t0);
+  qdelay_queue_cells(a, 200, t10);
+  tt_ptr_op(circuitmux_get_first_active_circuit(cmux, &cq), OP_EQ, a);
+
+  /* Now a has sent a cell, so EWMA would prefer b; but a's next cell has
+   * waited 40 msec longer than b's, which is more than a's 10 msec
+   * allowance. */
+  qdelay_send_cells(a, 1);
+  tt_ptr_op(circuitmux_get_first_active_circuit(cmux, &cq), OP_EQ, a);
+
+  /* Once a has sent 100 more, its allowance is about a second, so b's
+   * cell goes first even though it is younger. */
+  qdelay_send_cells(a, 100);
+  tt_ptr_op(circuitmux_get_first_active_circuit(cmux, &cq), OP_EQ, b);
+
+  /* When b is done, a is the only choice. */
+  qdelay_send_cells(b, 1);
+  tt_int_op(circuitmux_is_circuit_active(cmux, b), OP_EQ, 0);
+  tt_ptr_op(circuitmux_get_first_active_circuit(cmux, &cq), OP_EQ, a);
+
+ done:
+  if (orcirc_a)
+    cell_queue_clear(&orcirc_a->base_.n_chan_cells);
+  if (orcirc_b)
+    cell_queue_clear(&orcirc_b->base_.n_chan_cells);
+  free_fake_orcirc(orcirc_a);
+  free_fake_orcirc(orcirc_b);
+  free_fake_channel(pchan);
+  free_fake_channel(nchan);
+}
+
 static void *
 cmux_setup_test(const struct testcase_t *tc)
 {
@@ -472,8 +601,12 @@ struct testcase_t circuitmux_tests[] = {
   TEST_CMUX(policy),
   TEST_CMUX(xmit_cell),
 
+  /* Queue-delay policy */
+  TEST_CMUX(qdelay_select),
+  TEST_CMUX(qdelay_pick),
+
   /* Misc. */
-  TEST_CMUX(compute_ticks),
+  TEST_CMUX(compute_scale),
   TEST_CMUX(destroy_cell_queue),
 
   END_OF_TESTCASES
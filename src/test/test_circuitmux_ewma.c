@@ -50,7 +50,7 @@ test_cmux_ewma_xmit_cell(void *arg)
   circuitmux_policy_circ_data_t *circ_data = NULL;
   ewma_policy_data_t *ewma_pol_data;
   ewma_policy_circ_data_t *ewma_data;
-  double old_cell_count;
+  uint64_t old_cell_count;
 
   (void) arg;
 
@@ -65,20 +65,23 @@ test_cmux_ewma_xmit_cell(void *arg)
   /* Make circuit active. */
   ewma_policy.notify_circ_active(&cmux, pol_data, &circ, circ_data);
 
-  /* Move back in time the last time we calibrated so we scale the active
+  /* Move back in time the last epoch we scaled to so we scale the active
    * circuit when emitting a cell. */
-  ewma_pol_data->active_circuit_pqueue_last_recalibrated -= 100;
-  ewma_data->cell_ewma.last_adjusted_tick =
-    ewma_pol_data->active_circuit_pqueue_last_recalibrated;
+  ewma_pol_data->epoch -= 1;
+  ewma_data->cell_ewma.epoch = ewma_pol_data->epoch;
+  ewma_data->cell_ewma.cell_count = UINT64_C(1) << 40;
 
   /* Grab old cell count. */
   old_cell_count = ewma_data->cell_ewma.cell_count;
 
   ewma_policy.notify_xmit_cells(&cmux, pol_data, &circ, circ_data, 1);
 
-  /* Our old cell count should be lower to what we have since we just emitted
-   * a cell and thus we scale. */
-  tt_double_op(old_cell_count, OP_LT, ewma_data->cell_ewma.cell_count);
+  /* The old count should have been shifted down by a whole epoch, and then
+   * had the new cell added. */
+  tt_uint_op(ewma_data->cell_ewma.epoch, OP_EQ, ewma_pol_data->epoch);
+  tt_u64_op(ewma_data->cell_ewma.cell_count, OP_GT,
+            old_cell_count >> EWMA_EPOCH_SHIFT);
+  tt_u64_op(ewma_data->cell_ewma.cell_count, OP_LT, old_cell_count);
 
  done:
   ewma_policy.free_circ_data(&cmux, pol_data, &circ, circ_data);
@@ -109,14 +112,12 @@ test_cmux_ewma_notify_circ(void *arg)
   /* We should have an active circuit in the queue so its EWMA value can be
    * tracked. */
   ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
-  tt_int_op(smartlist_len(ewma_pol_data->active_circuit_pqueue), OP_EQ, 1);
-  tt_uint_op(ewma_pol_data->active_circuit_pqueue_last_recalibrated, OP_NE, 0);
+  tt_int_op(ewma_pol_data->n_active_circuits, OP_EQ, 1);
 
   ewma_policy.notify_circ_inactive(&cmux, pol_data, &circ, circ_data);
   /* Should be removed from the active queue. */
   ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
-  tt_int_op(smartlist_len(ewma_pol_data->active_circuit_pqueue), OP_EQ, 0);
-  tt_uint_op(ewma_pol_data->active_circuit_pqueue_last_recalibrated, OP_NE, 0);
+  tt_int_op(ewma_pol_data->n_active_circuits, OP_EQ, 0);
 
  done:
   ewma_policy.free_circ_data(&cmux, pol_data, &circ, circ_data);
@@ -143,7 +144,7 @@ test_cmux_ewma_policy_circ_data(void *arg)
 
   ewma_data = TO_EWMA_POL_CIRC_DATA(circ_data);
   tt_mem_op(ewma_data->circ, OP_EQ, &circ, sizeof(circuit_t));
-  tt_double_op(ewma_data->cell_ewma.cell_count, OP_LE, 0.0);
+  tt_u64_op(ewma_data->cell_ewma.cell_count, OP_EQ, 0);
   tt_int_op(ewma_data->cell_ewma.heap_index, OP_EQ, -1);
   tt_uint_op(ewma_data->cell_ewma.is_for_p_chan, OP_EQ, 0);
   ewma_policy.free_circ_data(&cmux, &pol_data, &circ, circ_data);
@@ -155,7 +156,7 @@ test_cmux_ewma_policy_circ_data(void *arg)
 
   ewma_data = TO_EWMA_POL_CIRC_DATA(circ_data);
   tt_mem_op(ewma_data->circ, OP_EQ, &circ, sizeof(circuit_t));
-  tt_double_op(ewma_data->cell_ewma.cell_count, OP_LE, 0.0);
+  tt_u64_op(ewma_data->cell_ewma.cell_count, OP_EQ, 0);
   tt_int_op(ewma_data->cell_ewma.heap_index, OP_EQ, -1);
   tt_uint_op(ewma_data->cell_ewma.is_for_p_chan, OP_EQ, 1);
 
@@ -178,13 +179,80 @@ test_cmux_ewma_policy_data(void *arg)
 
   /* Test EWMA object. */
   ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
-  tt_assert(ewma_pol_data->active_circuit_pqueue);
-  tt_uint_op(ewma_pol_data->active_circuit_pqueue_last_recalibrated, OP_NE, 0);
+  tt_int_op(ewma_pol_data->n_active_circuits, OP_EQ, 0);
 
  done:
   ewma_policy.free_cmux_data(&cmux, pol_data);
 }
 
+static void
+test_cmux_ewma_heap(void *arg)
+{
+#define N_HEAP_CIRCS 100
+  circuitmux_t cmux; /* garbage */
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuit_t circs[N_HEAP_CIRCS]; /* garbage */
+  circuitmux_policy_circ_data_t *circ_data[N_HEAP_CIRCS];
+  ewma_policy_circ_data_t *ewma_data[N_HEAP_CIRCS];
+  ewma_policy_data_t *ewma_pol_data;
+  uint64_t last = 0;
+  int i, n_picked = 0;
+
+  (void) arg;
+  memset(circ_data, 0, sizeof(circ_data));
+
+  pol_data = ewma_policy.alloc_cmux_data(&cmux);
+  ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
+
+  /* Activate circuits with scrambled counts. */
+  for (i = 0; i < N_HEAP_CIRCS; ++i) {
+    circ_data[i] = ewma_policy.alloc_circ_data(&cmux, pol_data, &circs[i],
+                                               CELL_DIRECTION_OUT, 1);
+    ewma_data[i] = TO_EWMA_POL_CIRC_DATA(circ_data[i]);
+    tt_assert(ewma_data[i]);
+    ewma_data[i]->cell_ewma.cell_count = (i * 37) % N_HEAP_CIRCS;
+    ewma_policy.notify_circ_active(&cmux, pol_data, &circs[i], circ_data[i]);
+  }
+  tt_int_op(ewma_pol_data->n_active_circuits, OP_EQ, N_HEAP_CIRCS);
+  tt_ptr_op(ewma_policy.pick_active_circuit(&cmux, pol_data), OP_EQ,
+            &circs[0]);
+
+  /* Remove every third circuit from the middle of the heap. */
+  for (i = 1; i < N_HEAP_CIRCS; i += 3) {
+    ewma_policy.notify_circ_inactive(&cmux, pol_data, &circs[i],
+                                     circ_data[i]);
+    tt_int_op(ewma_data[i]->cell_ewma.heap_index, OP_EQ, -1);
+  }
+
+  /* Sending a cell moves the head back, behind everything else. */
+  ewma_policy.notify_xmit_cells(&cmux, pol_data, &circs[0], circ_data[0], 1);
+  tt_ptr_op(ewma_policy.pick_active_circuit(&cmux, pol_data), OP_NE,
+            &circs[0]);
+  ewma_policy.notify_circ_inactive(&cmux, pol_data, &circs[0], circ_data[0]);
+
+  /* The rest come out in order. */
+  while (ewma_pol_data->n_active_circuits) {
+    circuit_t *c = ewma_policy.pick_active_circuit(&cmux, pol_data);
+    i = (int)(c - circs);
+    tt_int_op(i % 3, OP_NE, 1);
+    cell_ewma_t *e = &ewma_data[i]->cell_ewma;
+    tt_int_op(e->heap_index, OP_EQ, 0);
+    tt_u64_op(e->cell_count, OP_GE, last);
+    last = e->cell_count;
+    ewma_policy.notify_circ_inactive(&cmux, pol_data, c, circ_data[i]);
+    ++n_picked;
+  }
+  tt_int_op(n_picked, OP_EQ, N_HEAP_CIRCS - 1 - (N_HEAP_CIRCS / 3));
+
+ done:
+  for (i = 0; i < N_HEAP_CIRCS; ++i) {
+    if (circ_data[i])
+      ewma_policy.free_circ_data(&cmux, pol_data, &circs[i], circ_data[i]);
+  }
+  ewma_policy.free_cmux_data(&cmux, pol_data);
+#undef N_HEAP_CIRCS
+}
+
 static void *
 cmux_ewma_setup_test(const struct testcase_t *tc)
 {
@@ -223,6 +291,7 @@ struct testcase_t circuitmux_ewma_tests[] = {
   TEST_CMUX_EWMA(policy_circ_data),
   TEST_CMUX_EWMA(notify_circ),
   TEST_CMUX_EWMA(xmit_cell),
+  TEST_CMUX_EWMA(heap),
 
   END_OF_TESTCASES
 };
@@ -8,6 +8,7 @@
 #include "test/test.h"
 
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/evloop_stats.h"
 
 #include <event2/event.h>
 
@@ -175,11 +176,106 @@ test_compat_libevent_postloop_events(void *arg)
   periodic_timer_free(timed);
 }
 
+/* Mainloop event callback that does nothing. */
+static void
+noop_event_cb(mainloop_event_t *ev, void *arg)
+{
+  (void)ev;
+  (void)arg;
+}
+
+static void
+test_compat_libevent_callback_stats(void *arg)
+{
+  (void)arg;
+  mainloop_event_t *ev = NULL;
+  char *s = NULL;
+
+  /* Histogram buckets and formatting. */
+  evloop_stat_t *st = evloop_stat_get("test/direct");
+  tt_ptr_op(st, OP_EQ, evloop_stat_get("test/direct"));
+  evloop_stat_add(st, 0, 0);
+  evloop_stat_add(st, 2, 1);
+  evloop_stat_add(st, 3, 2);
+  evloop_stat_add(st, UINT64_C(1)<<40, 4);
+  tt_u64_op(st->n_calls, OP_EQ, 4);
+  tt_u64_op(st->max_wall_usec, OP_EQ, UINT64_C(1)<<40);
+  tt_u64_op(st->wall_hist[0], OP_EQ, 1);
+  tt_u64_op(st->wall_hist[1], OP_EQ, 1);
+  tt_u64_op(st->wall_hist[2], OP_EQ, 1);
+  tt_u64_op(st->wall_hist[EVLOOP_STAT_N_BUCKETS-1], OP_EQ, 1);
+  tt_u64_op(st->cpu_hist[0], OP_EQ, 2);
+  tt_u64_op(st->cpu_hist[1], OP_EQ, 1);
+  tt_u64_op(st->cpu_hist[2], OP_EQ, 1);
+  tt_u64_op(st->period_n_calls, OP_EQ, 4);
+  s = evloop_stats_format();
+  tt_str_op(s, OP_EQ,
+            "test/direct calls=4 wall-usec=1099511627781 "
+            "wall-max-usec=1099511627776 cpu-samples=4 cpu-usec=7 "
+            "wall-hist=1:1,2:1,4:1,inf:1 cpu-hist=1:2,2:1,4:1");
+  tor_free(s);
+  evloop_stats_reset_period();
+  tt_u64_op(st->period_n_calls, OP_EQ, 0);
+  tt_u64_op(st->period_max_wall_usec, OP_EQ, 0);
+  tt_u64_op(st->n_calls, OP_EQ, 4);
+
+  /* Timing a call that takes at least 2 msec. */
+  evloop_stat_timer_t timer;
+  monotime_t start, now;
+  st = evloop_stat_get("test/slow");
+  evloop_stat_timer_start(st, &timer);
+  monotime_get(&start);
+  do {
+    monotime_get(&now);
+  } while (monotime_diff_usec(&start, &now) < 2000);
+  evloop_stat_timer_end(st, &timer);
+  tt_u64_op(st->n_calls, OP_EQ, 1);
+  tt_u64_op(st->period_n_calls, OP_EQ, 1);
+  tt_u64_op(st->wall_usec, OP_GE, 2000);
+  tt_u64_op(st->max_wall_usec, OP_EQ, st->wall_usec);
+  tt_u64_op(st->cpu_n_samples, OP_EQ, 1);
+
+  /* We only measure the CPU time of one call in
+   * EVLOOP_STAT_CPU_SAMPLE_INTERVAL, and scale up our estimate to match. */
+  for (int i = 1; i < EVLOOP_STAT_CPU_SAMPLE_INTERVAL; ++i) {
+    evloop_stat_timer_start(st, &timer);
+    evloop_stat_timer_end(st, &timer);
+    tt_assert(!timer.sample_cpu);
+  }
+  tt_u64_op(st->n_calls, OP_EQ, EVLOOP_STAT_CPU_SAMPLE_INTERVAL);
+  tt_u64_op(st->cpu_n_samples, OP_EQ, 1);
+  evloop_stat_timer_start(st, &timer);
+  tt_assert(timer.sample_cpu);
+  evloop_stat_timer_end(st, &timer);
+  tt_u64_op(st->cpu_n_samples, OP_EQ, 2);
+  st = evloop_stat_get("test/estimate");
+  evloop_stat_add(st, 10, 8);
+  evloop_stat_add(st, 10, EVLOOP_STAT_NO_CPU);
+  evloop_stat_add(st, 10, EVLOOP_STAT_NO_CPU);
+  evloop_stat_add(st, 10, EVLOOP_STAT_NO_CPU);
+  tt_u64_op(st->cpu_n_samples, OP_EQ, 1);
+  tt_u64_op(evloop_stat_estimate_cpu_usec(st), OP_EQ, 32);
+
+  /* Naming a mainloop event gives it statistics, shared by name. */
+  ev = mainloop_event_new(noop_event_cb, NULL);
+  mainloop_event_set_name(ev, "test/event");
+  st = evloop_stat_get("test/event");
+  tt_assert(smartlist_contains(evloop_stats_get_all(), st));
+  tt_u64_op(st->n_calls, OP_EQ, 0);
+
+ done:
+  tor_free(s);
+  mainloop_event_free(ev);
+  evloop_stats_free_all();
+}
+
 struct testcase_t compat_libevent_tests[] = {
   { "logging_callback", test_compat_libevent_logging_callback,
     TT_FORK, NULL, NULL },
   { "header_version", test_compat_libevent_header_version, 0, NULL, NULL },
   { "postloop_events", test_compat_libevent_postloop_events,
     TT_FORK, NULL, NULL },
+  { "callback_stats", test_compat_libevent_callback_stats,
+    TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
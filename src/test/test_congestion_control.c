@@ -0,0 +1,854 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file test_congestion_control.c
+ * \brief Tests for delay-based circuit congestion control.
+ */
+
+#define CIRCUITLIST_PRIVATE
+#define CONNECTION_PRIVATE
+#define CONGESTION_CONTROL_PRIVATE
+#define NETWORKSTATUS_PRIVATE
+#define RELAY_PRIVATE
+
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/mainloop/connection.h"
+#include "core/or/channel.h"
+#include "core/or/circuitlist.h"
+#include "core/or/congestion_control.h"
+#include "core/or/connection_edge.h"
+#include "core/or/crypt_path.h"
+#include "core/or/extendinfo.h"
+#include "core/or/relay.h"
+#include "core/or/sendme.h"
+#include "feature/nodelist/netparams.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/nodelist.h"
+
+#include "core/or/congestion_control_st.h"
+#include "core/or/crypt_path_st.h"
+#include "core/or/edge_connection_st.h"
+#include "core/or/extend_info_st.h"
+#include "core/or/or_circuit_st.h"
+#include "core/or/origin_circuit_st.h"
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/node_st.h"
+#include "feature/nodelist/routerstatus_st.h"
+
+#include "test/fakechans.h"
+#include "test/log_test_helpers.h"
+#include "test/test.h"
+#include "test/test_helpers.h"
+
+static networkstatus_t *mock_ns = NULL;
+
+static networkstatus_t *
+mock_networkstatus_get_latest_consensus(void)
+{
+  return mock_ns;
+}
+
+/** Make the latest consensus one whose parameters are <b>params</b>. */
+static void
+set_mock_consensus_params(const char *params)
+{
+  if (mock_ns) {
+    netparams_consensus_freed(mock_ns);
+    SMARTLIST_FOREACH(mock_ns->net_params, char *, cp, tor_free(cp));
+    smartlist_free(mock_ns->net_params);
+    tor_free(mock_ns);
+  }
+  if (!params)
+    return;
+  mock_ns = tor_malloc_zero(sizeof(networkstatus_t));
+  mock_ns->net_params = smartlist_new();
+  smartlist_split_string(mock_ns->net_params, params, " ", 0, 0);
+}
+
+/** The relay cells that mock_relay_send_command_from_edge() was asked to
+ * send: the command of the last one, and its body. */
+static int n_relay_cells_sent = 0;
+static uint8_t last_relay_command = 0;
+static uint8_t last_relay_body[RELAY_PAYLOAD_SIZE];
+static size_t last_relay_body_len = 0;
+
+static int
+mock_relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
+                                  uint8_t relay_command, const char *payload,
+                                  size_t payload_len,
+                                  crypt_path_t *cpath_layer,
+                                  const char *filename, int lineno)
+{
+  (void) stream_id;
+  (void) circ;
+  (void) cpath_layer;
+  (void) filename;
+  (void) lineno;
+
+  ++n_relay_cells_sent;
+  last_relay_command = relay_command;
+  last_relay_body_len = MIN(payload_len, sizeof(last_relay_body));
+  memcpy(last_relay_body, payload, last_relay_body_len);
+  return 0;
+}
+
+/** A node for the last hop of our test circuits, which may or may not
+ * support congestion control. */
+static routerstatus_t mock_rs;
+static node_t mock_node;
+
+static const node_t *
+mock_node_get_by_id(const char *identity_digest)
+{
+  (void) identity_digest;
+  return &mock_node;
+}
+
+static void
+test_cc_rtt(void *arg)
+{
+  congestion_control_t *cc = NULL;
+  (void) arg;
+
+  cc = congestion_control_new(0);
+  tt_int_op(cc->ewma_n, OP_EQ, 2);
+
+  /* The first sample is both our average and our minimum. */
+  congestion_control_update_rtt(cc, 90000);
+  tt_u64_op(cc->ewma_rtt_usec, OP_EQ, 90000);
+  tt_u64_op(cc->min_rtt_usec, OP_EQ, 90000);
+
+  /* With N=2, each new sample counts for 2/3 of the average. */
+  congestion_control_update_rtt(cc, 180000);
+  tt_u64_op(cc->ewma_rtt_usec, OP_EQ, 150000);
+  tt_u64_op(cc->min_rtt_usec, OP_EQ, 90000);
+
+  /* The minimum follows the average, not single samples. */
+  congestion_control_update_rtt(cc, 30000);
+  tt_u64_op(cc->ewma_rtt_usec, OP_EQ, 70000);
+  tt_u64_op(cc->min_rtt_usec, OP_EQ, 70000);
+
+  /* A zero sample doesn't reset anything. */
+  congestion_control_update_rtt(cc, 0);
+  tt_u64_op(cc->ewma_rtt_usec, OP_EQ, 23334);
+  tt_u64_op(cc->min_rtt_usec, OP_EQ, 23334);
+
+ done:
+  congestion_control_free(cc);
+}
+
+static void
+test_cc_vegas(void *arg)
+{
+  congestion_control_t *cc = NULL;
+  (void) arg;
+
+  cc = congestion_control_new(0);
+  tt_int_op(cc->cwnd, OP_EQ, 500);
+  tt_assert(cc->in_slow_start);
+
+  /* Without an RTT, we don't touch the window. */
+  cc->cwnd_full = 1;
+  congestion_control_vegas_update(cc);
+  tt_int_op(cc->cwnd, OP_EQ, 500);
+
+  /* In slow start, we double a full window while the queue is short... */
+  cc->min_rtt_usec = 100000;
+  cc->ewma_rtt_usec = 110000;
+  congestion_control_vegas_update(cc);
+  tt_int_op(cc->cwnd, OP_EQ, 1000);
+  tt_assert(cc->in_slow_start);
+  tt_assert(!cc->cwnd_full);
+
+  /* ... but not a window that we aren't using. */
+  congestion_control_vegas_update(cc);
+  tt_int_op(cc->cwnd, OP_EQ, 1000);
+
+  /* Once the queue reaches gamma, we leave slow start, with a window of
+   * the BDP plus gamma. */
+  cc->ewma_rtt_usec = 200000;
+  congestion_control_vegas_update(cc);
+  tt_assert(!cc->in_slow_start);
+  tt_int_op(cc->cwnd, OP_EQ, 500 + cc->vegas_gamma);
+
+  /* Between alpha and beta, we hold steady. */
+  cc->cwnd = 1000;
+  cc->ewma_rtt_usec = 140000; /* BDP 714, queue 286. */
+  cc->cwnd_full = 1;
+  congestion_control_vegas_update(cc);
+  tt_int_op(cc->cwnd, OP_EQ, 1000);
+
+  /* Below alpha, we grow a full window by cwnd_inc. */
+  cc->ewma_rtt_usec = 110000; /* BDP 909, queue 91. */
+  cc->cwnd_full = 1;
+  congestion_control_vegas_update(cc);
+  tt_int_op(cc->cwnd, OP_EQ, 1000 + cc->cwnd_inc);
+
+  /* Above beta, we shrink by cwnd_inc. */
+  cc->cwnd = 1000;
+  cc->ewma_rtt_usec = 200000; /* BDP 500, queue 500. */
+  congestion_control_vegas_update(cc);
+  tt_int_op(cc->cwnd, OP_EQ, 1000 - cc->cwnd_inc);
+
+  /* Above delta, we fall back to the BDP. */
+  cc->cwnd = 2000;
+  congestion_control_vegas_update(cc); /* BDP 1000, queue 1000. */
+  tt_int_op(cc->cwnd, OP_EQ, 1000 + cc->vegas_delta - cc->cwnd_inc);
+
+  /* And we never leave [cwnd_min, cwnd_max]. */
+  cc->cwnd = 250;
+  cc->vegas_beta = 100;
+  cc->ewma_rtt_usec = 1000000; /* BDP 25, queue 225. */
+  congestion_control_vegas_update(cc);
+  tt_int_op(cc->cwnd, OP_EQ, cc->cwnd_min);
+  cc->cwnd = cc->cwnd_max;
+  cc->ewma_rtt_usec = cc->min_rtt_usec;
+  cc->cwnd_full = 1;
+  congestion_control_vegas_update(cc);
+  tt_int_op(cc->cwnd, OP_EQ, cc->cwnd_max);
+
+ done:
+  congestion_control_free(cc);
+}
+
+static void
+test_cc_sendme(void *arg)
+{
+  or_circuit_t *or_circ = NULL;
+  circuit_t *circ;
+  congestion_control_t *cc;
+  int i;
+  (void) arg;
+
+  monotime_enable_test_mocking();
+  monotime_set_mock_time_nsec(1000000000);
+
+  or_circ = or_circuit_new(1, NULL);
+  circ = TO_CIRCUIT(or_circ);
+  cc = circ->ccontrol = congestion_control_new(0);
+  tt_assert(circuit_has_congestion_control(circ));
+  tt_int_op(sendme_get_circuit_package_window(circ, NULL), OP_EQ, 500);
+
+  /* Send a window's worth of cells: we expect a SENDME for every 100. */
+  for (i = 0; i < 500; ++i) {
+    tt_int_op(congestion_control_sendme_is_next(cc), OP_EQ,
+              (i % CIRCWINDOW_INCREMENT) == CIRCWINDOW_INCREMENT - 1);
+    sendme_record_cell_digest_on_circ(circ, NULL);
+    tt_int_op(sendme_note_circuit_data_packaged(circ, NULL), OP_EQ,
+              500 - i - 1);
+  }
+  tt_int_op(smartlist_len(circ->sendme_last_digests), OP_EQ, 5);
+  tt_int_op(smartlist_len(cc->sendme_pending_timestamps), OP_EQ, 5);
+  tt_int_op(cc->inflight, OP_EQ, 500);
+  tt_assert(cc->cwnd_full);
+  /* The fixed package window is no longer used. */
+  tt_int_op(circ->package_window, OP_EQ, circuit_initial_package_window());
+
+  /* Each SENDME acknowledges 100 cells and gives us an RTT sample. */
+  monotime_set_mock_time_nsec(1100000000);
+  tt_int_op(sendme_process_circuit_level(NULL, circ, (const uint8_t *) "",
+                                         0), OP_EQ, 0);
+  tt_int_op(cc->inflight, OP_EQ, 400);
+  tt_u64_op(cc->ewma_rtt_usec, OP_EQ, 100000);
+  tt_int_op(sendme_get_circuit_package_window(circ, NULL), OP_EQ, 100);
+
+  /* After a window's worth of SENDMEs, we update the window. */
+  for (i = 0; i < 4; ++i) {
+    tt_int_op(cc->cwnd, OP_EQ, 500);
+    tt_int_op(sendme_process_circuit_level(NULL, circ, (const uint8_t *) "",
+                                           0), OP_EQ, 0);
+  }
+  tt_int_op(cc->inflight, OP_EQ, 0);
+  tt_int_op(cc->cwnd, OP_EQ, 1000);
+  tt_int_op(cc->next_cc_event, OP_EQ, 10);
+
+  /* A SENDME for cells that we never sent closes the circuit. */
+  for (i = 0; i < 50; ++i)
+    sendme_note_circuit_data_packaged(circ, NULL);
+  setup_full_capture_of_logs(LOG_PROTOCOL_WARN);
+  tt_int_op(congestion_control_process_sendme(cc), OP_EQ,
+            -END_CIRC_REASON_TORPROTOCOL);
+  expect_log_msg_containing("Unexpected circuit SENDME");
+
+ done:
+  teardown_capture_of_logs();
+  if (or_circ)
+    circuit_free_(TO_CIRCUIT(or_circ));
+  monotime_disable_test_mocking();
+}
+
+static void
+test_cc_sendme_inflight(void *arg)
+{
+  or_circuit_t *or_circ = NULL;
+  circuit_t *circ;
+  congestion_control_t *cc;
+  uint8_t body[CC_NEGOTIATE_LEN] = { CC_NEGOTIATE_VERSION, CC_ALG_VEGAS };
+  int i;
+  (void) arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  monotime_enable_test_mocking();
+  monotime_set_mock_time_nsec(1000000000);
+
+  /* We had sent 250 cells when the client asked for congestion control:
+   * the SENDMEs for the first 200 of them are for cells we never timed. */
+  set_mock_consensus_params("cc_alg=1");
+  or_circ = or_circuit_new(1, NULL);
+  circ = TO_CIRCUIT(or_circ);
+  circ->package_window -= 250;
+  tt_int_op(congestion_control_process_negotiate(circ, NULL, body,
+                                                 sizeof(body)), OP_EQ, 0);
+  cc = circ->ccontrol;
+  tt_ptr_op(cc, OP_NE, NULL);
+  tt_int_op(cc->inflight, OP_EQ, 250);
+
+  /* Send enough new cells to get two SENDMEs for them. */
+  for (i = 0; i < 150; ++i)
+    congestion_control_note_cell_sent(cc);
+  tt_int_op(smartlist_len(cc->sendme_pending_timestamps), OP_EQ, 2);
+
+  /* The SENDMEs for the old cells arrive almost at once.  If we timed them
+   * against our new cells, we'd think the path was nearly empty. */
+  monotime_set_mock_time_nsec(1001000000);
+  for (i = 0; i < 2; ++i) {
+    tt_int_op(congestion_control_process_sendme(cc), OP_EQ, 0);
+    tt_u64_op(cc->min_rtt_usec, OP_EQ, 0);
+    tt_u64_op(cc->ewma_rtt_usec, OP_EQ, 0);
+  }
+  tt_int_op(smartlist_len(cc->sendme_pending_timestamps), OP_EQ, 2);
+
+  /* The next SENDME is for a cell that we timed. */
+  monotime_set_mock_time_nsec(1400000000);
+  tt_int_op(congestion_control_process_sendme(cc), OP_EQ, 0);
+  tt_u64_op(cc->min_rtt_usec, OP_EQ, 400000);
+  tt_int_op(smartlist_len(cc->sendme_pending_timestamps), OP_EQ, 1);
+  tt_int_op(cc->inflight, OP_EQ, 100);
+
+ done:
+  if (or_circ)
+    circuit_free_(TO_CIRCUIT(or_circ));
+  set_mock_consensus_params(NULL);
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(relay_send_command_from_edge_);
+  netparams_free_all();
+  monotime_disable_test_mocking();
+}
+
+static void
+test_cc_negotiate(void *arg)
+{
+  or_circuit_t *or_circ = NULL;
+  circuit_t *circ;
+  uint8_t body[CC_NEGOTIATE_LEN] = { CC_NEGOTIATE_VERSION, CC_ALG_VEGAS };
+  (void) arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  n_relay_cells_sent = 0;
+
+  /* If the consensus doesn't enable congestion control, we refuse. */
+  or_circ = or_circuit_new(1, NULL);
+  circ = TO_CIRCUIT(or_circ);
+  tt_int_op(congestion_control_process_negotiate(circ, NULL, body,
+                                                 sizeof(body)), OP_EQ, 0);
+  tt_ptr_op(circ->ccontrol, OP_EQ, NULL);
+  tt_int_op(n_relay_cells_sent, OP_EQ, 1);
+  tt_int_op(last_relay_command, OP_EQ, RELAY_COMMAND_CC_NEGOTIATED);
+  tt_int_op(last_relay_body_len, OP_EQ, CC_NEGOTIATED_LEN);
+  tt_int_op(last_relay_body[2], OP_EQ, CC_NEGOTIATED_REFUSED);
+
+  /* If it does, we accept, and count what we already sent as in flight. */
+  set_mock_consensus_params("cc_alg=1 cc_cwnd_init=600");
+  circ->package_window -= 150;
+  tt_int_op(congestion_control_process_negotiate(circ, NULL, body,
+                                                 sizeof(body)), OP_EQ, 0);
+  tt_ptr_op(circ->ccontrol, OP_NE, NULL);
+  tt_int_op(circ->ccontrol->cwnd, OP_EQ, 600);
+  tt_int_op(circ->ccontrol->inflight, OP_EQ, 150);
+  tt_int_op(n_relay_cells_sent, OP_EQ, 2);
+  tt_int_op(last_relay_body[0], OP_EQ, CC_NEGOTIATE_VERSION);
+  tt_int_op(last_relay_body[1], OP_EQ, CC_ALG_VEGAS);
+  tt_int_op(last_relay_body[2], OP_EQ, CC_NEGOTIATED_OK);
+
+  /* Asking twice, or asking nonsense, is a protocol error. */
+  setup_full_capture_of_logs(LOG_PROTOCOL_WARN);
+  tt_int_op(congestion_control_process_negotiate(circ, NULL, body,
+                                                 sizeof(body)), OP_EQ,
+            -END_CIRC_REASON_TORPROTOCOL);
+  expect_log_msg_containing("second CC_NEGOTIATE");
+  mock_clean_saved_logs();
+  tt_int_op(congestion_control_process_negotiate(circ, NULL, body, 1),
+            OP_EQ, -END_CIRC_REASON_TORPROTOCOL);
+  expect_log_msg_containing("unparseable CC_NEGOTIATE");
+  tt_int_op(n_relay_cells_sent, OP_EQ, 2);
+
+  /* We only refuse an algorithm that we don't know. */
+  circuit_free_(circ);
+  or_circ = or_circuit_new(1, NULL);
+  circ = TO_CIRCUIT(or_circ);
+  body[1] = 77;
+  tt_int_op(congestion_control_process_negotiate(circ, NULL, body,
+                                                 sizeof(body)), OP_EQ, 0);
+  tt_ptr_op(circ->ccontrol, OP_EQ, NULL);
+  tt_int_op(last_relay_body[1], OP_EQ, 77);
+  tt_int_op(last_relay_body[2], OP_EQ, CC_NEGOTIATED_REFUSED);
+
+ done:
+  teardown_capture_of_logs();
+  if (or_circ)
+    circuit_free_(TO_CIRCUIT(or_circ));
+  set_mock_consensus_params(NULL);
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(relay_send_command_from_edge_);
+  netparams_free_all();
+}
+
+static void
+test_cc_negotiated(void *arg)
+{
+  origin_circuit_t *ocirc = NULL;
+  extend_info_t *ei_list[2] = { NULL, NULL };
+  struct timeval tv = { 0, 0 };
+  crypt_path_t *last_hop;
+  uint8_t body[CC_NEGOTIATED_LEN] =
+    { CC_NEGOTIATE_VERSION, CC_ALG_VEGAS, CC_NEGOTIATED_OK };
+  (void) arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  MOCK(node_get_by_id, mock_node_get_by_id);
+  n_relay_cells_sent = 0;
+  memset(&mock_rs, 0, sizeof(mock_rs));
+  memset(&mock_node, 0, sizeof(mock_node));
+  mock_node.rs = &mock_rs;
+
+  ei_list[0] = extend_info_new("guard", "AAAAAAAAAAAAAAAAAAAA",
+                               NULL, NULL, NULL, NULL, 0);
+  ei_list[1] = extend_info_new("exit", "BBBBBBBBBBBBBBBBBBBB",
+                               NULL, NULL, NULL, NULL, 0);
+  ocirc = new_test_origin_circuit(true, tv, 2, ei_list);
+  last_hop = ocirc->cpath->prev;
+
+  /* Unless the consensus says so, we don't ask. */
+  mock_rs.pv.supports_congestion_control = 1;
+  congestion_control_circuit_has_opened(ocirc);
+  tt_int_op(n_relay_cells_sent, OP_EQ, 0);
+
+  /* Nor do we ask an exit that can't do it. */
+  set_mock_consensus_params("cc_alg=1");
+  mock_rs.pv.supports_congestion_control = 0;
+  congestion_control_circuit_has_opened(ocirc);
+  tt_int_op(n_relay_cells_sent, OP_EQ, 0);
+
+  /* We ask an exit that can, once. */
+  mock_rs.pv.supports_congestion_control = 1;
+  congestion_control_circuit_has_opened(ocirc);
+  congestion_control_circuit_has_opened(ocirc);
+  tt_int_op(n_relay_cells_sent, OP_EQ, 1);
+  tt_int_op(last_relay_command, OP_EQ, RELAY_COMMAND_CC_NEGOTIATE);
+  tt_int_op(last_relay_body_len, OP_EQ, CC_NEGOTIATE_LEN);
+  tt_int_op(last_relay_body[0], OP_EQ, CC_NEGOTIATE_VERSION);
+  tt_int_op(last_relay_body[1], OP_EQ, CC_ALG_VEGAS);
+  tt_assert(ocirc->cc_negotiation_pending);
+
+  /* An answer from the wrong hop is ignored. */
+  setup_full_capture_of_logs(LOG_PROTOCOL_WARN);
+  tt_int_op(congestion_control_process_negotiated(TO_CIRCUIT(ocirc),
+                                                  ocirc->cpath, body,
+                                                  sizeof(body)), OP_EQ, 0);
+  expect_log_msg_containing("unexpected CC_NEGOTIATED");
+  tt_assert(ocirc->cc_negotiation_pending);
+  tt_assert(!circuit_has_congestion_control(TO_CIRCUIT(ocirc)));
+
+  /* The right answer turns congestion control on for the last hop. */
+  last_hop->package_window -= 20;
+  tt_int_op(congestion_control_process_negotiated(TO_CIRCUIT(ocirc),
+                                                  last_hop, body,
+                                                  sizeof(body)), OP_EQ, 0);
+  tt_assert(!ocirc->cc_negotiation_pending);
+  tt_ptr_op(last_hop->ccontrol, OP_NE, NULL);
+  tt_int_op(last_hop->ccontrol->inflight, OP_EQ, 20);
+  tt_ptr_op(ocirc->cpath->ccontrol, OP_EQ, NULL);
+  tt_assert(circuit_has_congestion_control(TO_CIRCUIT(ocirc)));
+  tt_int_op(sendme_get_circuit_package_window(TO_CIRCUIT(ocirc), last_hop),
+            OP_EQ, 480);
+
+  /* A second answer is ignored. */
+  mock_clean_saved_logs();
+  tt_int_op(congestion_control_process_negotiated(TO_CIRCUIT(ocirc),
+                                                  last_hop, body,
+                                                  sizeof(body)), OP_EQ, 0);
+  expect_log_msg_containing("unexpected CC_NEGOTIATED");
+
+  /* A refusal leaves the fixed window in place; a bogus answer closes the
+   * circuit. */
+  congestion_control_free(last_hop->ccontrol);
+  ocirc->cc_negotiation_pending = 1;
+  body[2] = CC_NEGOTIATED_REFUSED;
+  tt_int_op(congestion_control_process_negotiated(TO_CIRCUIT(ocirc),
+                                                  last_hop, body,
+                                                  sizeof(body)), OP_EQ, 0);
+  tt_ptr_op(last_hop->ccontrol, OP_EQ, NULL);
+  ocirc->cc_negotiation_pending = 1;
+  body[1] = 77;
+  body[2] = CC_NEGOTIATED_OK;
+  tt_int_op(congestion_control_process_negotiated(TO_CIRCUIT(ocirc),
+                                                  last_hop, body,
+                                                  sizeof(body)), OP_EQ,
+            -END_CIRC_REASON_TORPROTOCOL);
+  tt_ptr_op(last_hop->ccontrol, OP_EQ, NULL);
+
+ done:
+  teardown_capture_of_logs();
+  if (ocirc)
+    circuit_free_(TO_CIRCUIT(ocirc));
+  extend_info_free(ei_list[0]);
+  extend_info_free(ei_list[1]);
+  set_mock_consensus_params(NULL);
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(relay_send_command_from_edge_);
+  UNMOCK(node_get_by_id);
+  netparams_free_all();
+}
+
+static void
+test_cc_stream_window(void *arg)
+{
+  or_circuit_t *or_circ = or_circuit_new(1, NULL);
+  circuit_t *circ = TO_CIRCUIT(or_circ);
+  edge_connection_t *stream = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  (void) arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  set_mock_consensus_params("cc_cwnd_init=300 cc_cwnd_max=2000");
+
+  stream->package_window = STREAMWINDOW_START;
+  stream->deliver_window = STREAMWINDOW_START;
+  stream->on_circuit = circ;
+
+  /* With fixed windows, the stream windows are what they say. */
+  tt_int_op(sendme_get_stream_package_window(stream), OP_EQ,
+            STREAMWINDOW_START);
+  tt_int_op(sendme_get_stream_deliver_window(stream), OP_EQ,
+            STREAMWINDOW_START);
+  stream->deliver_window = 1;
+  tt_int_op(sendme_stream_data_received(stream), OP_EQ, 0);
+  tt_int_op(sendme_stream_data_received(stream), OP_LT, 0);
+  stream->deliver_window = STREAMWINDOW_START;
+
+  /* A congestion window smaller than the stream window changes nothing for
+   * the sender. */
+  circ->ccontrol = congestion_control_new(0);
+  tt_int_op(circ->ccontrol->cwnd, OP_EQ, 300);
+  tt_int_op(sendme_get_stream_package_window(stream), OP_EQ,
+            STREAMWINDOW_START);
+
+  /* A larger one lets the stream have that many cells in flight. */
+  circ->ccontrol->cwnd = 1500;
+  tt_int_op(sendme_get_stream_package_window(stream), OP_EQ, 1500);
+  stream->package_window = 0;
+  tt_int_op(sendme_note_stream_data_packaged(stream), OP_EQ, 999);
+  tt_int_op(stream->package_window, OP_EQ, -1);
+
+  /* The receiver allows as many as the largest congestion window. */
+  tt_int_op(sendme_get_stream_deliver_window(stream), OP_EQ, 2000);
+  stream->deliver_window = STREAMWINDOW_START - 1999;
+  tt_int_op(sendme_stream_data_received(stream), OP_EQ, 0);
+  tt_int_op(sendme_stream_data_received(stream), OP_LT, 0);
+
+ done:
+  connection_free_minimal(TO_CONN(stream));
+  circuit_free_(circ);
+  set_mock_consensus_params(NULL);
+  UNMOCK(networkstatus_get_latest_consensus);
+  netparams_free_all();
+}
+
+/*
+ * A simulation of one stream on one circuit, sending DATA cells from an
+ * exit to a client over a path of fake channels.
+ *
+ * Each channel is a link with a fixed speed and latency, and a queue in
+ * front of it: a cell that we write to a link leaves its queue once the
+ * cells ahead of it have been sent, and arrives at the next hop one latency
+ * later.  The client reads each cell as soon as it arrives.  It sends a
+ * circuit-level SENDME for every CIRCWINDOW_INCREMENT cells that it
+ * receives, and a stream-level SENDME for every STREAMWINDOW_INCREMENT;
+ * each takes the sum of the latencies to get back to the exit, and SENDMEs
+ * never queue.
+ */
+
+/** How many links our simulated paths have. */
+#define SIM_N_LINKS 3
+/** How far the simulated clock advances each step, in usec. */
+#define SIM_TICK_USEC 100
+/** How many cells each link can hold in flight or in its queue. */
+#define SIM_RING_LEN 32768
+
+/** The speed and latency of one simulated link. */
+typedef struct sim_link_params_t {
+  int usec_per_cell;
+  int latency_usec;
+} sim_link_params_t;
+
+/** The state of one simulated link. */
+typedef struct sim_link_t {
+  channel_t *chan;
+  sim_link_params_t params;
+  /** When the last cell in the queue will have been sent. */
+  uint64_t busy_until;
+  /** For each cell on the link, oldest first, when it arrives at the next
+   * hop. */
+  uint64_t *arrivals;
+  int head;
+  int n;
+  /** The most cells that have been queued on this link since we started
+   * measuring. */
+  int max_queue;
+} sim_link_t;
+
+/** What we measured in one simulation. */
+typedef struct sim_result_t {
+  /** How many cells reached the client while we were measuring. */
+  int n_delivered;
+  /** The most cells queued on any link while we were measuring. */
+  int max_queue;
+} sim_result_t;
+
+static sim_link_t sim_links[SIM_N_LINKS];
+/** The simulated time, in usec. */
+static uint64_t sim_now = 0;
+/** True once we are past the warm-up half of the simulation. */
+static bool sim_measuring = false;
+
+/** Stand-in for a fake channel's write_packed_cell method: put the cell on
+ * the simulated link for <b>chan</b>. */
+static int
+sim_write_packed_cell(channel_t *chan, packed_cell_t *cell)
+{
+  sim_link_t *link = NULL;
+  uint64_t start;
+  int queue;
+  (void) cell;
+
+  for (int i = 0; i < SIM_N_LINKS; ++i) {
+    if (sim_links[i].chan == chan)
+      link = &sim_links[i];
+  }
+  tor_assert(link);
+  tor_assert(link->n < SIM_RING_LEN);
+
+  start = MAX(sim_now, link->busy_until);
+  queue = (int) ((start - sim_now) / link->params.usec_per_cell);
+  if (sim_measuring)
+    link->max_queue = MAX(link->max_queue, queue);
+
+  link->busy_until = start + link->params.usec_per_cell;
+  link->arrivals[(link->head + link->n) % SIM_RING_LEN] =
+    link->busy_until + link->params.latency_usec;
+  ++link->n;
+  return 1;
+}
+
+/** Return true iff the oldest cell on <b>link</b> has reached the next
+ * hop, and take it off the link if so. */
+static bool
+sim_link_pop_arrived(sim_link_t *link)
+{
+  if (!link->n || link->arrivals[link->head] > sim_now)
+    return false;
+  link->head = (link->head + 1) % SIM_RING_LEN;
+  --link->n;
+  return true;
+}
+
+/** Add a SENDME that will reach the exit at <b>at</b> to
+ * <b>arrivals</b>. */
+static void
+sim_send_sendme(smartlist_t *arrivals, uint64_t at)
+{
+  uint64_t *atp = tor_malloc(sizeof(uint64_t));
+  *atp = at;
+  smartlist_add(arrivals, atp);
+}
+
+/** Remove and return true iff the oldest SENDME in <b>arrivals</b> has
+ * reached the exit. */
+static bool
+sim_sendme_pop_arrived(smartlist_t *arrivals)
+{
+  if (!smartlist_len(arrivals) ||
+      *(uint64_t *) smartlist_get(arrivals, 0) > sim_now)
+    return false;
+  tor_free(arrivals->list[0]);
+  smartlist_del_keeporder(arrivals, 0);
+  return true;
+}
+
+/** Send cells on one stream from an exit to a client over a path of links
+ * with <b>params</b>, for <b>duration_usec</b> simulated usec, using
+ * congestion control iff <b>use_cc</b>.  Store what we measured over the
+ * second half of the simulation in <b>result_out</b>. */
+static void
+sim_run(const sim_link_params_t *params, bool use_cc, uint64_t duration_usec,
+        sim_result_t *result_out)
+{
+  or_circuit_t *or_circ = or_circuit_new(1, NULL);
+  circuit_t *circ = TO_CIRCUIT(or_circ);
+  edge_connection_t *stream = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  smartlist_t *sendme_arrivals = smartlist_new();
+  smartlist_t *stream_sendme_arrivals = smartlist_new();
+  uint64_t sendme_delay = 0;
+  int n_received = 0;
+
+  memset(result_out, 0, sizeof(*result_out));
+  sim_now = 0;
+  sim_measuring = false;
+  for (int i = 0; i < SIM_N_LINKS; ++i) {
+    memset(&sim_links[i], 0, sizeof(sim_link_t));
+    sim_links[i].chan = new_fake_channel();
+    sim_links[i].chan->write_packed_cell = sim_write_packed_cell;
+    sim_links[i].params = params[i];
+    sim_links[i].arrivals = tor_calloc(SIM_RING_LEN, sizeof(uint64_t));
+    sendme_delay += params[i].latency_usec;
+  }
+  if (use_cc)
+    circ->ccontrol = congestion_control_new(0);
+  stream->base_.state = EXIT_CONN_STATE_OPEN;
+  stream->package_window = STREAMWINDOW_START;
+  stream->deliver_window = STREAMWINDOW_START;
+  stream->on_circuit = circ;
+
+  for (sim_now = 0; sim_now < duration_usec; sim_now += SIM_TICK_USEC) {
+    monotime_set_mock_time_nsec((int64_t) sim_now * 1000);
+    sim_measuring = (sim_now >= duration_usec / 2);
+
+    /* The exit processes the SENDMEs that have reached it. */
+    while (sim_sendme_pop_arrived(sendme_arrivals)) {
+      tor_assert(sendme_process_circuit_level(NULL, circ,
+                                              (const uint8_t *) "", 0) == 0);
+    }
+    while (sim_sendme_pop_arrived(stream_sendme_arrivals)) {
+      tor_assert(sendme_process_stream_level(stream, circ, 0) == 0);
+    }
+
+    /* The client reads the cells that have reached it. */
+    while (sim_link_pop_arrived(&sim_links[SIM_N_LINKS - 1])) {
+      if (sim_measuring)
+        ++result_out->n_delivered;
+      ++n_received;
+      if ((n_received % CIRCWINDOW_INCREMENT) == 0)
+        sim_send_sendme(sendme_arrivals, sim_now + sendme_delay);
+      if ((n_received % STREAMWINDOW_INCREMENT) == 0)
+        sim_send_sendme(stream_sendme_arrivals, sim_now + sendme_delay);
+    }
+
+    /* Each relay relays the cells that have reached it. */
+    for (int i = SIM_N_LINKS - 2; i >= 0; --i) {
+      while (sim_link_pop_arrived(&sim_links[i])) {
+        channel_write_packed_cell(sim_links[i + 1].chan, packed_cell_new());
+      }
+    }
+
+    /* The exit sends as much as its windows allow. */
+    while (sendme_get_circuit_package_window(circ, NULL) > 0 &&
+           sendme_get_stream_package_window(stream) > 0) {
+      sendme_record_cell_digest_on_circ(circ, NULL);
+      sendme_note_circuit_data_packaged(circ, NULL);
+      sendme_note_stream_data_packaged(stream);
+      channel_write_packed_cell(sim_links[0].chan, packed_cell_new());
+    }
+  }
+
+  for (int i = 0; i < SIM_N_LINKS; ++i) {
+    result_out->max_queue = MAX(result_out->max_queue,
+                                sim_links[i].max_queue);
+    free_fake_channel(sim_links[i].chan);
+    tor_free(sim_links[i].arrivals);
+  }
+  SMARTLIST_FOREACH(sendme_arrivals, uint64_t *, at, tor_free(at));
+  smartlist_free(sendme_arrivals);
+  SMARTLIST_FOREACH(stream_sendme_arrivals, uint64_t *, at, tor_free(at));
+  smartlist_free(stream_sendme_arrivals);
+  connection_free_minimal(TO_CONN(stream));
+  circuit_free_(circ);
+}
+
+static void
+test_cc_sim_high_bdp(void *arg)
+{
+  /* Three fast links with a long latency: about 9000 cells fit in the
+   * path, so a fixed stream window of 500 cells leaves most of it idle.
+   * The congestion window grows to fill it, and the stream's window grows
+   * with it. */
+  const sim_link_params_t path[SIM_N_LINKS] = {
+    { 20, 30000 }, { 20, 30000 }, { 20, 30000 },
+  };
+  sim_result_t fixed, cc;
+  (void) arg;
+
+  monotime_enable_test_mocking();
+  sim_run(path, false, 10 * 1000 * 1000, &fixed);
+  sim_run(path, true, 10 * 1000 * 1000, &cc);
+
+  tt_int_op(fixed.n_delivered, OP_GT, 0);
+  tt_int_op(cc.n_delivered, OP_GT, fixed.n_delivered * 10);
+
+ done:
+  monotime_disable_test_mocking();
+}
+
+static void
+test_cc_sim_congested(void *arg)
+{
+  /* A slow middle link: only about 60 cells fit in the path, so the fixed
+   * stream window of 500 cells mostly sits in the middle relay's queue.
+   * With the default parameters, Vegas aims to keep 200 to 400 cells
+   * queued, which is not much better, so we use smaller thresholds. */
+  const sim_link_params_t path[SIM_N_LINKS] = {
+    { 20, 10000 }, { 1000, 10000 }, { 20, 10000 },
+  };
+  sim_result_t fixed, cc;
+  (void) arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  set_mock_consensus_params("cc_cwnd_min=150 cc_cwnd_init=200 "
+                            "cc_vegas_alpha=50 cc_vegas_beta=100 "
+                            "cc_vegas_gamma=100 cc_vegas_delta=200");
+  monotime_enable_test_mocking();
+  sim_run(path, false, 20 * 1000 * 1000, &fixed);
+  sim_run(path, true, 20 * 1000 * 1000, &cc);
+
+  /* We keep the slow link just as busy, with a much shorter queue. */
+  tt_int_op(fixed.n_delivered, OP_GT, 0);
+  tt_int_op(cc.n_delivered * 100, OP_GE, fixed.n_delivered * 95);
+  tt_int_op(cc.max_queue, OP_LT, fixed.max_queue / 2);
+
+ done:
+  monotime_disable_test_mocking();
+  set_mock_consensus_params(NULL);
+  UNMOCK(networkstatus_get_latest_consensus);
+  netparams_free_all();
+}
+
+struct testcase_t congestion_control_tests[] = {
+  { "rtt", test_cc_rtt, TT_FORK, NULL, NULL },
+  { "vegas", test_cc_vegas, TT_FORK, NULL, NULL },
+  { "sendme", test_cc_sendme, TT_FORK, NULL, NULL },
+  { "sendme_inflight", test_cc_sendme_inflight, TT_FORK, NULL, NULL },
+  { "negotiate", test_cc_negotiate, TT_FORK, NULL, NULL },
+  { "negotiated", test_cc_negotiated, TT_FORK, NULL, NULL },
+  { "stream_window", test_cc_stream_window, TT_FORK, NULL, NULL },
+  { "sim_high_bdp", test_cc_sim_high_bdp, TT_FORK, NULL, NULL },
+  { "sim_congested", test_cc_sim_congested, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
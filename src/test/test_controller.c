@@ -25,6 +25,7 @@
 #include "lib/net/resolve.h"
 #include "lib/encoding/confline.h"
 #include "lib/encoding/kvline.h"
+#include "lib/evloop/evloop_stats.h"
 
 #include "feature/control/control_connection_st.h"
 #include "feature/control/control_cmd_args_st.h"
@@ -2198,6 +2199,62 @@ test_stats(void *arg)
   return;
 }
 
+static void
+test_getinfo_mainloop_stats(void *arg)
+{
+  control_connection_t dummy;
+  char *answer = NULL;
+  const char *errmsg = NULL;
+
+  (void) arg;
+
+  evloop_stat_add(evloop_stat_get("periodic/example"), 5, 3);
+  evloop_stat_add(evloop_stat_get("conn/or/read"), 300, 200);
+  evloop_stat_add(evloop_stat_get("conn/or/read"), 100, EVLOOP_STAT_NO_CPU);
+
+  getinfo_helper_mainloop(&dummy, "mainloop/callback-stats",
+                          &answer, &errmsg);
+  tt_ptr_op(errmsg, OP_EQ, NULL);
+  tt_str_op(answer, OP_EQ,
+            "periodic/example calls=1 wall-usec=5 wall-max-usec=5 "
+            "cpu-samples=1 cpu-usec=3 wall-hist=8:1 cpu-hist=4:1\n"
+            "conn/or/read calls=2 wall-usec=400 wall-max-usec=300 "
+            "cpu-samples=1 cpu-usec=200 wall-hist=128:1,512:1 "
+            "cpu-hist=256:1");
+
+ done:
+  tor_free(answer);
+  evloop_stats_free_all();
+}
+
+static void
+test_getinfo_cell_queue_sojourn(void *arg)
+{
+  control_connection_t dummy;
+  char *answer = NULL;
+  const char *errmsg = NULL;
+
+  (void) arg;
+
+  getinfo_helper_cell_queue(&dummy, "cell-queue/sojourn", &answer, &errmsg);
+  tt_ptr_op(errmsg, OP_EQ, NULL);
+  tt_str_op(answer, OP_EQ,
+            "origin appward cells=0 total-msec=0 hist=\n"
+            "origin exitward cells=0 total-msec=0 hist=\n"
+            "or appward cells=0 total-msec=0 hist=\n"
+            "or exitward cells=0 total-msec=0 hist=");
+  tor_free(answer);
+
+  /* We have no OR connections, so there are no channels to describe. */
+  getinfo_helper_cell_queue(&dummy, "cell-queue/sojourn/channels",
+                            &answer, &errmsg);
+  tt_ptr_op(errmsg, OP_EQ, NULL);
+  tt_str_op(answer, OP_EQ, "");
+
+ done:
+  tor_free(answer);
+}
+
 #ifndef COCCI
 #define PARSER_TEST(type)                                             \
   { "parse/" #type, test_controller_parse_cmd, 0, &passthrough_setup, \
@@ -2233,5 +2290,9 @@ struct testcase_t controller_tests[] = {
   { "control_reply", test_control_reply, 0, NULL, NULL },
   { "control_getconf", test_control_getconf, 0, NULL, NULL },
   { "stats", test_stats, 0, NULL, NULL },
+  { "getinfo_mainloop_stats", test_getinfo_mainloop_stats, TT_FORK,
+    NULL, NULL },
+  { "getinfo_cell_queue_sojourn", test_getinfo_cell_queue_sojourn, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
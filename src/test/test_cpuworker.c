@@ -0,0 +1,275 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define CPUWORKER_PRIVATE
+#define CIRCUITLIST_PRIVATE
+
+#include "core/or/or.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/or/channel.h"
+#include "core/or/circuitlist.h"
+#include "core/or/onion.h"
+#include "feature/relay/onion_queue.h"
+#include "lib/evloop/workqueue.h"
+
+#include "core/or/or_circuit_st.h"
+
+#include "test/test.h"
+#include "test/fakechans.h"
+
+/* A pending item of work that would have gone to the threadpool. */
+typedef struct fake_work_queue_ent_t {
+  workqueue_reply_t (*fn)(void *, void *);
+  void (*reply_fn)(void *);
+  void *arg;
+  /* True iff a worker has picked this item up, so it can't be cancelled. */
+  int running;
+} fake_work_queue_ent_t;
+
+static smartlist_t *fake_cpuworker_queue = NULL;
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t prio,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void) prio;
+
+  if (! fake_cpuworker_queue)
+    fake_cpuworker_queue = smartlist_new();
+
+  fake_work_queue_ent_t *ent = tor_malloc_zero(sizeof(*ent));
+  ent->fn = fn;
+  ent->reply_fn = reply_fn;
+  ent->arg = arg;
+  smartlist_add(fake_cpuworker_queue, ent);
+  return (workqueue_entry_t *)ent;
+}
+
+static void *
+mock_workqueue_entry_get_arg(workqueue_entry_t *ent_)
+{
+  fake_work_queue_ent_t *ent = (fake_work_queue_ent_t *)ent_;
+  return ent->arg;
+}
+
+static void *
+mock_workqueue_entry_cancel(workqueue_entry_t *ent_)
+{
+  fake_work_queue_ent_t *ent = (fake_work_queue_ent_t *)ent_;
+  void *arg = ent->arg;
+  if (ent->running)
+    return NULL;
+  smartlist_remove(fake_cpuworker_queue, ent);
+  tor_free(ent);
+  return arg;
+}
+
+static int n_marked_for_close = 0;
+
+static void
+mock_circuit_mark_for_close_(circuit_t *circ, int reason, int line,
+                             const char *file)
+{
+  (void) reason;
+  (void) line;
+  (void) file;
+  circ->marked_for_close = 1;
+  ++n_marked_for_close;
+}
+
+/* Run the work item <b>ent</b> the way a worker and then the main thread
+ * would, and forget about it. */
+static void
+fake_run_work(fake_work_queue_ent_t *ent)
+{
+  worker_state_t state;
+  memset(&state, 0, sizeof(state));
+
+  smartlist_remove(fake_cpuworker_queue, ent);
+  ent->fn(&state, ent->arg);
+  ent->reply_fn(ent->arg);
+  tor_free(ent);
+}
+
+/* Run everything left on the fake queue, including anything that the
+ * reply functions queue in turn. */
+static void
+fake_run_all_work(void)
+{
+  while (fake_cpuworker_queue && smartlist_len(fake_cpuworker_queue)) {
+    fake_run_work(smartlist_get(fake_cpuworker_queue, 0));
+  }
+}
+
+#define N_TEST_CIRCS (MAX_ONIONSKINS_PER_BATCH + 4)
+
+static channel_t *test_chan = NULL;
+static or_circuit_t *test_circs[N_TEST_CIRCS];
+
+/* Make N_TEST_CIRCS circuits with an ntor onionskin each, and put them all
+ * on the onion queue. The onionskins are empty, so the handshakes will
+ * fail without needing any keys. */
+static void
+setup_queued_circs(void)
+{
+  int i;
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  MOCK(workqueue_entry_get_arg, mock_workqueue_entry_get_arg);
+  MOCK(workqueue_entry_cancel, mock_workqueue_entry_cancel);
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close_);
+  n_marked_for_close = 0;
+
+  test_chan = new_fake_channel();
+  for (i = 0; i < N_TEST_CIRCS; ++i) {
+    create_cell_t *onionskin = tor_malloc_zero(sizeof(create_cell_t));
+    onionskin->cell_type = CELL_CREATE2;
+    onionskin->handshake_type = ONION_HANDSHAKE_TYPE_NTOR;
+    test_circs[i] = or_circuit_new(0, NULL);
+    test_circs[i]->p_chan = test_chan;
+    tt_int_op(0, OP_EQ, onion_pending_add(test_circs[i], onionskin));
+  }
+ done:
+  ;
+}
+
+static void
+cleanup_queued_circs(void)
+{
+  int i;
+
+  fake_run_all_work();
+  for (i = 0; i < N_TEST_CIRCS; ++i) {
+    if (! test_circs[i])
+      continue;
+    test_circs[i]->p_chan = NULL;
+    circuit_free_(TO_CIRCUIT(test_circs[i]));
+    test_circs[i] = NULL;
+  }
+  clear_pending_onions();
+  free_fake_channel(test_chan);
+  test_chan = NULL;
+  smartlist_free(fake_cpuworker_queue);
+
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(workqueue_entry_get_arg);
+  UNMOCK(workqueue_entry_cancel);
+  UNMOCK(circuit_mark_for_close_);
+}
+
+static void
+test_cpuworker_batch_full(void *arg)
+{
+  (void) arg;
+  int i;
+  workqueue_entry_t *first, *second;
+
+  setup_queued_circs();
+  queue_pending_tasks();
+
+  /* With one thread, the first batch takes as many onionskins as a batch
+   * can hold, and the rest go in a second batch.  Emptying the onion queue
+   * also asks for a keypair refill. */
+  tt_int_op(smartlist_len(fake_cpuworker_queue), OP_EQ, 3);
+  first = test_circs[0]->workqueue_entry;
+  second = test_circs[MAX_ONIONSKINS_PER_BATCH]->workqueue_entry;
+  tt_ptr_op(first, OP_NE, NULL);
+  tt_ptr_op(second, OP_NE, NULL);
+  tt_ptr_op(first, OP_NE, second);
+  for (i = 0; i < N_TEST_CIRCS; ++i) {
+    tt_ptr_op(test_circs[i]->workqueue_entry, OP_EQ,
+              i < MAX_ONIONSKINS_PER_BATCH ? first : second);
+  }
+  tt_int_op(onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR), OP_EQ, 0);
+
+ done:
+  cleanup_queued_circs();
+}
+
+static void
+test_cpuworker_reply_fanout(void *arg)
+{
+  (void) arg;
+  int i;
+
+  setup_queued_circs();
+  queue_pending_tasks();
+  tt_int_op(smartlist_len(fake_cpuworker_queue), OP_EQ, 3);
+
+  /* One reply per batch has to reach every circuit in the batch. */
+  fake_run_work((fake_work_queue_ent_t *)test_circs[0]->workqueue_entry);
+  tt_int_op(n_marked_for_close, OP_EQ, MAX_ONIONSKINS_PER_BATCH);
+  for (i = 0; i < N_TEST_CIRCS; ++i) {
+    if (i < MAX_ONIONSKINS_PER_BATCH) {
+      tt_ptr_op(test_circs[i]->workqueue_entry, OP_EQ, NULL);
+      tt_assert(TO_CIRCUIT(test_circs[i])->marked_for_close);
+    } else {
+      tt_ptr_op(test_circs[i]->workqueue_entry, OP_NE, NULL);
+      tt_assert(! TO_CIRCUIT(test_circs[i])->marked_for_close);
+    }
+  }
+
+  fake_run_all_work();
+  tt_int_op(n_marked_for_close, OP_EQ, N_TEST_CIRCS);
+  for (i = 0; i < N_TEST_CIRCS; ++i) {
+    tt_ptr_op(test_circs[i]->workqueue_entry, OP_EQ, NULL);
+  }
+
+ done:
+  cleanup_queued_circs();
+}
+
+static void
+test_cpuworker_cancel_running(void *arg)
+{
+  (void) arg;
+  int i;
+  fake_work_queue_ent_t *first, *second;
+
+  setup_queued_circs();
+  queue_pending_tasks();
+  tt_int_op(smartlist_len(fake_cpuworker_queue), OP_EQ, 3);
+  first = (fake_work_queue_ent_t *)test_circs[0]->workqueue_entry;
+  second = (fake_work_queue_ent_t *)
+    test_circs[MAX_ONIONSKINS_PER_BATCH]->workqueue_entry;
+
+  /* A worker has the first batch, so cancelling one of its circuits can
+   * only detach that circuit from the batch. */
+  first->running = 1;
+  cpuworker_cancel_circ_handshake(test_circs[3]);
+  tt_ptr_op(test_circs[3]->workqueue_entry, OP_EQ, NULL);
+  tt_ptr_op(test_circs[4]->workqueue_entry, OP_EQ, first);
+  tt_int_op(smartlist_len(fake_cpuworker_queue), OP_EQ, 3);
+
+  /* Cancelling a circuit in a batch that nobody has picked up yet also
+   * detaches it, since other circuits still want the batch. */
+  cpuworker_cancel_circ_handshake(test_circs[MAX_ONIONSKINS_PER_BATCH]);
+  tt_ptr_op(test_circs[MAX_ONIONSKINS_PER_BATCH]->workqueue_entry,
+            OP_EQ, NULL);
+  tt_int_op(smartlist_len(fake_cpuworker_queue), OP_EQ, 3);
+
+  /* When the batch finishes, its reply must skip the detached circuit. */
+  fake_run_work(first);
+  tt_int_op(n_marked_for_close, OP_EQ, MAX_ONIONSKINS_PER_BATCH - 1);
+  tt_assert(! TO_CIRCUIT(test_circs[3])->marked_for_close);
+
+  fake_run_work(second);
+  tt_int_op(n_marked_for_close, OP_EQ, N_TEST_CIRCS - 2);
+  tt_assert(! TO_CIRCUIT(test_circs[MAX_ONIONSKINS_PER_BATCH])->
+            marked_for_close);
+  for (i = 0; i < N_TEST_CIRCS; ++i) {
+    tt_ptr_op(test_circs[i]->workqueue_entry, OP_EQ, NULL);
+  }
+
+ done:
+  cleanup_queued_circs();
+}
+
+struct testcase_t cpuworker_tests[] = {
+  { "batch_full", test_cpuworker_batch_full, TT_FORK, NULL, NULL },
+  { "reply_fanout", test_cpuworker_reply_fanout, TT_FORK, NULL, NULL },
+  { "cancel_running", test_cpuworker_cancel_running, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
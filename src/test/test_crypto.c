@@ -468,6 +468,51 @@ test_crypto_aes_ctr_testvec(void *arg)
   crypto_cipher_free(c);
 }
 
+/** Make sure that encrypting a batch of buffers gives the same result as
+ * encrypting them one at a time, including when a cipher appears in the
+ * batch more than once. */
+static void
+test_crypto_aes_multi(void *arg)
+{
+  crypto_cipher_t *a[3] = { NULL, NULL, NULL };
+  crypto_cipher_t *b[3] = { NULL, NULL, NULL };
+  crypto_cipher_t *batch[5];
+  char *bufs[5];
+  char one[5][509], many[5][509];
+  char key[CIPHER_KEY_LEN];
+  static const int which[5] = { 0, 1, 0, 2, 0 };
+  int i;
+
+  (void)arg;
+  for (i = 0; i < 3; ++i) {
+    crypto_rand(key, sizeof(key));
+    a[i] = crypto_cipher_new(key);
+    b[i] = crypto_cipher_new(key);
+  }
+  crypto_rand((char *)one, sizeof(one));
+  memcpy(many, one, sizeof(one));
+
+  for (i = 0; i < 5; ++i) {
+    crypto_cipher_crypt_inplace(a[which[i]], one[i], sizeof(one[i]));
+    batch[i] = b[which[i]];
+    bufs[i] = many[i];
+  }
+  crypto_cipher_crypt_inplace_multi(batch, bufs, sizeof(many[0]), 5);
+  tt_mem_op(one, OP_EQ, many, sizeof(one));
+
+  /* An empty batch is fine, and the streams carry on as usual. */
+  crypto_cipher_crypt_inplace_multi(batch, bufs, sizeof(many[0]), 0);
+  crypto_cipher_crypt_inplace(a[1], one[0], 17);
+  crypto_cipher_crypt_inplace_multi(batch + 1, bufs, 17, 1);
+  tt_mem_op(one, OP_EQ, many, sizeof(one));
+
+ done:
+  for (i = 0; i < 3; ++i) {
+    crypto_cipher_free(a[i]);
+    crypto_cipher_free(b[i]);
+  }
+}
+
 /** Run unit tests for our SHA-1 functionality */
 static void
 test_crypto_sha(void *arg)
@@ -3027,6 +3072,7 @@ struct testcase_t crypto_tests[] = {
   { "openssl_version", test_crypto_openssl_version, TT_FORK, NULL, NULL },
   { "aes_AES", test_crypto_aes128, TT_FORK, &passthrough_setup, (void*)"aes" },
   { "aes_EVP", test_crypto_aes128, TT_FORK, &passthrough_setup, (void*)"evp" },
+  { "aes_multi", test_crypto_aes_multi, 0, NULL, NULL },
   { "aes128_ctr_testvec", test_crypto_aes_ctr_testvec, 0,
     &passthrough_setup, (void*)"128" },
   { "aes192_ctr_testvec", test_crypto_aes_ctr_testvec, 0,
@@ -55,6 +55,7 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
 #include "feature/nodelist/node_select.h"
+#include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/dirparse/authcert_parse.h"
 #include "feature/dirparse/ns_parse.h"
@@ -74,6 +75,7 @@
 #include "lib/osinfo/uname.h"
 #include "test/log_test_helpers.h"
 #include "test/opts_test_helpers.h"
+#include "test/test_helpers.h"
 #include "test/test.h"
 #include "test/test_dir_common.h"
 
@@ -85,6 +87,7 @@
 #include "feature/nodelist/microdesc_st.h"
 #include "feature/nodelist/networkstatus_st.h"
 #include "feature/nodelist/networkstatus_voter_info_st.h"
+#include "feature/nodelist/node_st.h"
 #include "feature/dirauth/ns_detached_signatures_st.h"
 #include "core/or/port_cfg_st.h"
 #include "feature/nodelist/routerinfo_st.h"
@@ -4116,6 +4119,197 @@ test_dir_random_weighted(void *testdata)
   ;
 }
 
+static void
+test_dir_alias_weighted(void *testdata)
+{
+  const double vals[10] = {3,1,2,4,6,0,7,5,8,9};
+  uint64_t inp_u64[10], total_u64;
+  int hist_alias[10], hist_linear[10];
+  double owned[10];
+  weighted_alias_table_t *table = NULL;
+  int i, choice;
+  const int n = 50000;
+  double chi_sq = 0;
+  (void) testdata;
+
+  table = weighted_alias_table_new(vals, 10);
+  tt_int_op(table->n, OP_EQ, 10);
+  tt_u64_op(table->total, OP_GT, 0);
+
+  /* The table should give each item exactly the probability that
+   * choose_array_element_by_weight() would, up to our scaling. */
+  memset(owned, 0, sizeof(owned));
+  for (i = 0; i < 10; ++i) {
+    tt_u64_op(table->prob[i], OP_LE, table->total);
+    tt_int_op(table->alias[i], OP_GE, 0);
+    tt_int_op(table->alias[i], OP_LT, 10);
+    owned[i] += (double)table->prob[i];
+    owned[table->alias[i]] += (double)(table->total - table->prob[i]);
+  }
+  for (i = 0; i < 10; ++i) {
+    tt_double_op(fabs(owned[i] / (10.0 * table->total) - vals[i] / 45.0),
+                 OP_LT, 1e-9);
+  }
+
+  /* And when we actually draw from it, we should get the same distribution
+   * as the linear scan does. */
+  scale_array_elements_to_u64(inp_u64, vals, 10, &total_u64);
+  tt_u64_op(total_u64, OP_EQ, 45);
+  memset(hist_alias, 0, sizeof(hist_alias));
+  memset(hist_linear, 0, sizeof(hist_linear));
+  for (i = 0; i < n; ++i) {
+    choice = weighted_alias_table_choose(table);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 10);
+    hist_alias[choice]++;
+    hist_linear[choose_array_element_by_weight(inp_u64, 10)]++;
+  }
+  tt_int_op(hist_alias[5], OP_EQ, 0);
+  for (i = 0; i < 10; ++i) {
+    const int sum = hist_alias[i] + hist_linear[i];
+    TT_BLATHER(("  %d : %5d vs %5d\n", (int)vals[i], hist_alias[i],
+                hist_linear[i]));
+    if (sum)
+      chi_sq += ((double)(hist_alias[i] - hist_linear[i]) *
+                 (hist_alias[i] - hist_linear[i])) / sum;
+  }
+  /* Two-sample chi-squared with 8 degrees of freedom: the odds of going
+   * over 50 by chance are less than one in ten million. */
+  tt_double_op(chi_sq, OP_LT, 50.0);
+  weighted_alias_table_free(table);
+
+  /* A singleton is always chosen. */
+  table = weighted_alias_table_new(vals, 1);
+  for (i = 0; i < 100; ++i)
+    tt_int_op(weighted_alias_table_choose(table), OP_EQ, 0);
+  weighted_alias_table_free(table);
+
+  /* If everything has zero weight, we choose uniformly. */
+  {
+    const double zeros[5] = { 0, 0, 0, 0, 0 };
+    table = weighted_alias_table_new(zeros, 5);
+    tt_u64_op(table->total, OP_EQ, 0);
+    memset(hist_alias, 0, sizeof(hist_alias));
+    for (i = 0; i < n; ++i) {
+      choice = weighted_alias_table_choose(table);
+      tt_int_op(choice, OP_GE, 0);
+      tt_int_op(choice, OP_LT, 5);
+      hist_alias[choice]++;
+    }
+    for (i = 0; i < 5; ++i)
+      tt_int_op(abs(hist_alias[i] - n/5), OP_LT, n/50);
+  }
+
+ done:
+  weighted_alias_table_free(table);
+}
+
+static void
+test_dir_choose_random_node_excluded(void *arg)
+{
+  smartlist_t *candidates = smartlist_new();
+  smartlist_t *excluded = smartlist_new();
+  int seen[HELPER_NUMBER_OF_DESCRIPTORS];
+  const node_t *choice, *last;
+  int i, j, n;
+  (void) arg;
+
+  helper_setup_fake_routerlist();
+  router_add_running_nodes_to_smartlist(candidates, 0);
+  n = smartlist_len(candidates);
+  tt_int_op(n, OP_GE, 5);
+  last = smartlist_get(candidates, n - 1);
+
+  /* Exclude the first three candidates. */
+  for (j = 0; j < 3; ++j)
+    smartlist_add(excluded, smartlist_get(candidates, j));
+
+  /* We should only ever get the candidates that are left, and we should get
+   * each of them sooner or later. */
+  memset(seen, 0, sizeof(seen));
+  for (i = 0; i < 1000; ++i) {
+    choice = router_choose_random_node(excluded, NULL, 0);
+    tt_assert(choice);
+    j = smartlist_pos(candidates, choice);
+    tt_int_op(j, OP_GE, 0);
+    seen[j]++;
+  }
+  /* That drew from the cached alias table. */
+  tt_assert(node_weight_cache);
+  tt_int_op(smartlist_len(node_weight_cache), OP_EQ, 1);
+  tt_int_op(seen[0], OP_EQ, 0);
+  tt_int_op(seen[1], OP_EQ, 0);
+  tt_int_op(seen[2], OP_EQ, 0);
+  for (j = 3; j < n; ++j)
+    tt_int_op(seen[j], OP_GT, 0);
+
+  /* With all but one candidate excluded, that one is the only choice. */
+  for (j = 3; j < n - 1; ++j)
+    smartlist_add(excluded, smartlist_get(candidates, j));
+  for (i = 0; i < 100; ++i) {
+    choice = router_choose_random_node(excluded, NULL, 0);
+    tt_ptr_op(choice, OP_EQ, last);
+  }
+
+  /* With every candidate excluded, there is nothing to choose. */
+  smartlist_add(excluded, (node_t *)last);
+  setup_full_capture_of_logs(LOG_WARN);
+  choice = router_choose_random_node(excluded, NULL, 0);
+  tt_ptr_op(choice, OP_EQ, NULL);
+  expect_log_msg_containing("No available nodes when trying to choose node.");
+
+ done:
+  teardown_capture_of_logs();
+  smartlist_free(candidates);
+  smartlist_free(excluded);
+  routerlist_free_all();
+  nodelist_free_all();
+}
+
+static void
+test_dir_choose_random_node_cache(void *arg)
+{
+  const smartlist_t *nodes;
+  node_t *dropped;
+  const node_t *choice;
+  int i, n;
+  (void) arg;
+
+  helper_setup_fake_routerlist();
+  nodes = nodelist_get_list();
+  n = smartlist_len(nodes);
+
+  /* Choosing a node builds a table... */
+  tt_assert(router_choose_random_node(NULL, NULL, 0));
+  tt_assert(node_weight_cache);
+  tt_int_op(smartlist_len(node_weight_cache), OP_EQ, 1);
+  /* ... which we keep until our directory information changes. */
+  tt_assert(router_choose_random_node(NULL, NULL, 0));
+  tt_int_op(smartlist_len(node_weight_cache), OP_EQ, 1);
+  router_dir_info_changed();
+  tt_ptr_op(node_weight_cache, OP_EQ, NULL);
+
+  /* When a node leaves the nodelist, we forget the table that points to it,
+   * and never choose it again. */
+  tt_assert(router_choose_random_node(NULL, NULL, 0));
+  tt_assert(node_weight_cache);
+  choice = router_choose_random_node(NULL, NULL, 0);
+  dropped = node_get_mutable_by_id(choice->identity);
+  nodelist_remove_routerinfo(dropped->ri);
+  tt_ptr_op(node_weight_cache, OP_EQ, NULL);
+  tt_int_op(smartlist_len(nodes), OP_EQ, n - 1);
+  for (i = 0; i < 1000; ++i) {
+    choice = router_choose_random_node(NULL, NULL, 0);
+    tt_assert(choice);
+    tt_ptr_op(choice, OP_EQ, smartlist_get(nodes, choice->nodelist_idx));
+  }
+  tt_assert(node_weight_cache);
+
+ done:
+  routerlist_free_all();
+  nodelist_free_all();
+}
+
 /* Function pointers for test_dir_clip_unmeasured_bw_kb() */
 
 static uint32_t alternate_clip_bw = 0;
@@ -7472,6 +7666,9 @@ struct testcase_t dir_tests[] = {
   DIR(param_voting_lookup, 0),
   DIR_LEGACY(v3_networkstatus),
   DIR(random_weighted, 0),
+  DIR(alias_weighted, 0),
+  DIR(choose_random_node_excluded, TT_FORK),
+  DIR(choose_random_node_cache, TT_FORK),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
   DIR_LEGACY(clip_unmeasured_bw_kb_alt),
@@ -12,7 +12,9 @@
 #include "app/config/config.h"
 #include "lib/geoip/geoip.h"
 #include "feature/stats/geoip_stats.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "test/test.h"
+#include "test/log_test_helpers.h"
 
   /* Record odd numbered fake-IPs using ipv6, even numbered fake-IPs
    * using ipv4.  Since our fake geoip database is the same between
@@ -564,6 +566,155 @@ test_geoip_load_2nd_file(void *arg)
   tor_free(fname_empty);
 }
 
+/** Number of random IPv4 ranges to use in test_geoip_load_binary(). */
+#define N_RANDOM_RANGES 1000
+
+/** Helper: return the country code that the <b>n</b> sorted, disjoint
+ * ranges from <b>lows</b> to <b>highs</b> with country codes <b>ccs</b>
+ * give to <b>addr</b>, by checking every one. */
+static const char *
+expected_country(const uint32_t *lows, const uint32_t *highs,
+                 const char **ccs, int n, uint32_t addr)
+{
+  for (int i = 0; i < n; ++i) {
+    if (lows[i] <= addr && addr <= highs[i])
+      return ccs[i];
+  }
+  return "??";
+}
+
+/** Helper for qsort: compare two uint32_t. */
+static int
+compare_uint32s_(const void *a_, const void *b_)
+{
+  const uint32_t a = *(const uint32_t *)a_, b = *(const uint32_t *)b_;
+  return (a > b) - (a < b);
+}
+
+static void
+test_geoip_load_binary(void *arg)
+{
+  (void)arg;
+  uint32_t *bounds = tor_calloc(2*N_RANDOM_RANGES, sizeof(uint32_t));
+  uint32_t *lows = tor_calloc(N_RANDOM_RANGES, sizeof(uint32_t));
+  uint32_t *highs = tor_calloc(N_RANDOM_RANGES, sizeof(uint32_t));
+  const char **ccs = tor_calloc(N_RANDOM_RANGES, sizeof(char *));
+  uint32_t *probes = tor_calloc(6*N_RANDOM_RANGES + 2, sizeof(uint32_t));
+  const char *codes[] = { "ab", "xy", "zz", "us", "de" };
+  char *fname = tor_strdup(get_fname("geoip_bin"));
+  char *fname6 = tor_strdup(get_fname("geoip6_bin"));
+  char *text = NULL, *bin = NULL, *digest = NULL;
+  smartlist_t *lines = smartlist_new();
+  struct in6_addr in6;
+  size_t bin_len = 0;
+  int i, n_probes = 0, pass;
+
+  /* Make a lot of random, disjoint ranges, leaving some gaps. */
+  for (i = 0; i < 2*N_RANDOM_RANGES; ++i)
+    bounds[i] = crypto_rand_u32();
+  qsort(bounds, 2*N_RANDOM_RANGES, sizeof(uint32_t), compare_uint32s_);
+  for (i = 0; i < N_RANDOM_RANGES; ++i) {
+    lows[i] = bounds[2*i];
+    highs[i] = bounds[2*i+1];
+    if (i && lows[i] <= highs[i-1])
+      lows[i] = highs[i-1] + 1;
+    if (lows[i] > highs[i])
+      highs[i] = lows[i];
+    ccs[i] = codes[crypto_rand_int(ARRAY_LENGTH(codes))];
+    smartlist_add_asprintf(lines, "%u,%u,%s\n", lows[i], highs[i], ccs[i]);
+    probes[n_probes++] = lows[i] - 1;
+    probes[n_probes++] = lows[i];
+    probes[n_probes++] = highs[i];
+    probes[n_probes++] = highs[i] + 1;
+    probes[n_probes++] = crypto_rand_u32();
+    probes[n_probes++] = lows[i] + (highs[i] - lows[i]) / 2;
+  }
+  probes[n_probes++] = 0;
+  probes[n_probes++] = UINT32_MAX;
+  smartlist_shuffle(lines);
+  text = smartlist_join_strings(lines, "", 0, NULL);
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, text, 0));
+
+  /* Parse the text file, and check every lookup. Then write the binary
+   * file, load it, and check them again. */
+  for (pass = 0; pass < 2; ++pass) {
+    tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname, LOG_WARN));
+    for (i = 0; i < n_probes; ++i) {
+      tt_str_op(geoip_get_country_name(geoip_get_country_by_ipv4(probes[i])),
+                OP_EQ, expected_country(lows, highs, ccs, N_RANDOM_RANGES,
+                                        probes[i]));
+    }
+    if (pass == 0) {
+      digest = tor_strdup(geoip_db_digest(AF_INET));
+      tt_int_op(0, OP_EQ, geoip_write_binary_file(AF_INET, fname));
+      /* Start over from nothing, so the country numbers may change. */
+      geoip_free_all();
+      tt_int_op(0, OP_EQ, geoip_parse_entry("1,2,qq", AF_INET));
+    }
+  }
+  /* The binary file remembers the digest of the text file. */
+  tt_str_op(digest, OP_EQ, geoip_db_digest(AF_INET));
+
+  /* A damaged binary file is rejected, and we keep what we had. */
+  bin = read_file_to_str(fname, RFTS_BIN, NULL);
+  tt_assert(bin);
+  bin_len = strlen("TORGEOIP");
+  tt_mem_op(bin, OP_EQ, "TORGEOIP", bin_len);
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, bin, 100, 1));
+  setup_capture_of_logs(LOG_WARN);
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname, LOG_WARN));
+  expect_single_log_msg_containing("wrong length");
+  teardown_capture_of_logs();
+  tt_str_op(geoip_get_country_name(geoip_get_country_by_ipv4(lows[0])),
+            OP_EQ, ccs[0]);
+
+  /* And the same for IPv6, with a few ranges. */
+  tt_int_op(0, OP_EQ, write_str_to_file(fname6,
+    "2001:4830:6010::,2001:4830:601f:ffff:ffff:ffff:ffff:ffff,GB\n"
+    "2001:4860::,2001:4860:ffff:ffff:ffff:ffff:ffff:ffff,US\n"
+    "2001:4878:129::,2001:4878:129:ffff:ffff:ffff:ffff:ffff,CR\n", 0));
+  for (pass = 0; pass < 2; ++pass) {
+    tt_int_op(0, OP_EQ, geoip_load_file(AF_INET6, fname6, LOG_WARN));
+#define CHECK6(a, cc) STMT_BEGIN                                        \
+      tor_inet_pton(AF_INET6, (a), &in6);                               \
+      tt_str_op((cc), OP_EQ,                                            \
+                geoip_get_country_name(geoip_get_country_by_ipv6(&in6))); \
+    STMT_END
+    CHECK6("::", "??");
+    CHECK6("2001:4830:600f:ffff:ffff:ffff:ffff:ffff", "??");
+    CHECK6("2001:4830:6010::", "gb");
+    CHECK6("2001:4830:601f:ffff:ffff:ffff:ffff:ffff", "gb");
+    CHECK6("2001:4830:6020::", "??");
+    CHECK6("2001:4860:4860::8888", "us");
+    CHECK6("2001:4878:129:ffff:ffff:ffff:ffff:ffff", "cr");
+    CHECK6("2001:4878:12a::", "??");
+    CHECK6("ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff", "??");
+#undef CHECK6
+    if (pass == 0)
+      tt_int_op(0, OP_EQ, geoip_write_binary_file(AF_INET6, fname6));
+  }
+
+  /* A binary file only works for the family it was written for. */
+  setup_capture_of_logs(LOG_WARN);
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname6, LOG_WARN));
+  expect_single_log_msg_containing("wrong address family");
+
+ done:
+  teardown_capture_of_logs();
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(bounds);
+  tor_free(lows);
+  tor_free(highs);
+  tor_free(ccs);
+  tor_free(probes);
+  tor_free(fname);
+  tor_free(fname6);
+  tor_free(text);
+  tor_free(bin);
+  tor_free(digest);
+}
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -575,6 +726,7 @@ struct testcase_t geoip_tests[] = {
   { "load_file", test_geoip_load_file, TT_FORK, NULL, NULL },
   { "load_file6", test_geoip6_load_file, TT_FORK, NULL, NULL },
   { "load_2nd_file", test_geoip_load_2nd_file, TT_FORK, NULL, NULL },
+  { "load_binary", test_geoip_load_binary, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
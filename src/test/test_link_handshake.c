@@ -312,8 +312,8 @@ test_link_handshake_certs_ok(void *arg)
   memset(c2->identity_digest, 0, sizeof(c2->identity_digest));
   connection_free_minimal(TO_CONN(c1));
   connection_free_minimal(TO_CONN(c2));
-  tor_free(cell1);
-  tor_free(cell2);
+  var_cell_free(cell1);
+  var_cell_free(cell2);
   certs_cell_free(cc1);
   certs_cell_free(cc2);
   if (chan1)
@@ -348,7 +348,7 @@ recv_certs_cleanup(const struct testcase_t *test, void *obj)
   UNMOCK(tor_tls_get_own_cert);
 
   if (d) {
-    tor_free(d->cell);
+    var_cell_free(d->cell);
     certs_cell_free(d->ccell);
     connection_or_clear_identity(d->c);
     connection_free_minimal(TO_CONN(d->c));
@@ -967,8 +967,8 @@ test_link_handshake_send_authchallenge(void *arg)
  done:
   UNMOCK(connection_or_write_var_cell_to_buf);
   connection_free_minimal(TO_CONN(c1));
-  tor_free(cell1);
-  tor_free(cell2);
+  var_cell_free(cell1);
+  var_cell_free(cell2);
   crypto_pk_free(rsa0);
   crypto_pk_free(rsa1);
 }
@@ -990,7 +990,7 @@ recv_authchallenge_cleanup(const struct testcase_t *test, void *obj)
   UNMOCK(connection_or_send_authenticate_cell);
 
   if (d) {
-    tor_free(d->cell);
+    var_cell_free(d->cell);
     connection_free_minimal(TO_CONN(d->c));
     circuitmux_free(d->chan->base_.cmux);
     tor_free(d->chan);
@@ -1193,7 +1193,7 @@ authenticate_data_cleanup(const struct testcase_t *test, void *arg)
   UNMOCK(tor_tls_export_key_material);
   authenticate_data_t *d = arg;
   if (d) {
-    tor_free(d->cell);
+    var_cell_free(d->cell);
     connection_or_clear_identity(d->c1);
     connection_or_clear_identity(d->c2);
     connection_free_minimal(TO_CONN(d->c1));
@@ -1255,7 +1255,7 @@ authenticate_data_setup(const struct testcase_t *test)
   memset(cell->payload, 0xf0, 16);
   or_handshake_state_record_var_cell(d->c1, d->c1->handshake_state, cell, 0);
   or_handshake_state_record_var_cell(d->c2, d->c2->handshake_state, cell, 1);
-  tor_free(cell);
+  var_cell_free(cell);
 
   d->chan2 = tor_malloc_zero(sizeof(*d->chan2));
   channel_tls_common_init(d->chan2);
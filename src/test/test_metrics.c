@@ -0,0 +1,200 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file test_metrics.c
+ * \brief Tests for the MetricsPort.
+ */
+
+#define CONFIG_PRIVATE
+#define CONNECTION_PRIVATE
+#define METRICS_PRIVATE
+
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/mainloop/connection.h"
+#include "core/or/policies.h"
+#include "feature/metrics/metrics.h"
+#include "lib/buf/buffers.h"
+#include "lib/confmgt/confmgt.h"
+#include "lib/encoding/confline.h"
+
+#include "app/config/or_options_st.h"
+#include "core/or/connection_st.h"
+
+#include "test/test.h"
+
+static void
+test_metrics_histogram(void *arg)
+{
+  smartlist_t *out = smartlist_new();
+  char *s = NULL;
+  const uint64_t buckets[4] = { 1, 0, 2, 3 };
+  (void)arg;
+
+  metrics_format_histogram(out, "tor_x_seconds", NULL, buckets, 4, 0.001,
+                           2500000);
+  s = smartlist_join_strings(out, "", 0, NULL);
+  tt_str_op(s, OP_EQ,
+            "tor_x_seconds_bucket{le=\"0.001\"} 1\n"
+            "tor_x_seconds_bucket{le=\"0.002\"} 1\n"
+            "tor_x_seconds_bucket{le=\"0.004\"} 3\n"
+            "tor_x_seconds_bucket{le=\"+Inf\"} 6\n"
+            "tor_x_seconds_sum 2.500000\n"
+            "tor_x_seconds_count 6\n");
+  SMARTLIST_FOREACH(out, char *, cp, tor_free(cp));
+  smartlist_clear(out);
+  tor_free(s);
+
+  metrics_format_histogram(out, "tor_y", "a=\"b\"", buckets, 2, 1e-6, 7);
+  s = smartlist_join_strings(out, "", 0, NULL);
+  tt_str_op(s, OP_EQ,
+            "tor_y_bucket{a=\"b\",le=\"1e-06\"} 1\n"
+            "tor_y_bucket{a=\"b\",le=\"+Inf\"} 1\n"
+            "tor_y_sum{a=\"b\"} 0.000007\n"
+            "tor_y_count{a=\"b\"} 1\n");
+
+ done:
+  SMARTLIST_FOREACH(out, char *, cp, tor_free(cp));
+  smartlist_free(out);
+  tor_free(s);
+}
+
+static void
+test_metrics_output(void *arg)
+{
+  char *s = NULL;
+  (void)arg;
+
+  s = metrics_get_output();
+  tt_assert(strstr(s, "# TYPE tor_cell_queues_bytes gauge\n"));
+  tt_assert(strstr(s, "\ntor_onion_queue_delay_seconds_bucket{le=\"+Inf\"} "));
+  tt_assert(strstr(s, "\ntor_dns_cache_lookups_total{result=\"miss\"} "));
+  tt_assert(strstr(s, "\ntor_oom_invocations_total "));
+  tt_assert(strstr(s, "\ntor_cell_queue_sojourn_seconds_count"
+                    "{circ=\"or\",direction=\"exitward\"} "));
+
+ done:
+  tor_free(s);
+}
+
+static void
+mock_mark_for_close(connection_t *conn, int line, const char *file)
+{
+  (void)line;
+  (void)file;
+  conn->marked_for_close = 1;
+}
+
+static void
+mock_write_to_buf(const char *string, size_t len, connection_t *conn,
+                  int zlib)
+{
+  (void)zlib;
+  buf_add(conn->outbuf, string, len);
+}
+
+/** Send <b>request</b> to a new MetricsPort connection, and return a newly
+ * allocated copy of its answer. */
+static char *
+metrics_answer(const char *request)
+{
+  connection_t *conn = connection_new(CONN_TYPE_METRICS, AF_INET);
+  char *answer;
+  size_t len;
+
+  conn->state = METRICS_CONN_STATE_READING;
+  buf_add_string(conn->inbuf, request);
+  tt_int_op(metrics_connection_process_inbuf(conn), OP_EQ, 0);
+  len = buf_datalen(conn->outbuf);
+  answer = tor_malloc_zero(len + 1);
+  buf_get_bytes(conn->outbuf, answer, len);
+  if (len) {
+    tt_int_op(conn->state, OP_EQ, METRICS_CONN_STATE_WRITING);
+    tt_assert(conn->marked_for_close);
+    tt_assert(conn->hold_open_until_flushed);
+  } else {
+    tt_int_op(conn->state, OP_EQ, METRICS_CONN_STATE_READING);
+  }
+  connection_free_minimal(conn);
+  return answer;
+ done:
+  connection_free_minimal(conn);
+  return NULL;
+}
+
+static void
+test_metrics_connection(void *arg)
+{
+  char *answer = NULL;
+  (void)arg;
+
+  MOCK(connection_mark_for_close_internal_, mock_mark_for_close);
+  MOCK(connection_write_to_buf_impl_, mock_write_to_buf);
+
+  /* An incomplete request gets no answer yet. */
+  answer = metrics_answer("GET /metrics HTTP/1.0\r\n");
+  tt_str_op(answer, OP_EQ, "");
+  tor_free(answer);
+
+  answer = metrics_answer("GET /metrics HTTP/1.0\r\n\r\n");
+  tt_assert(!strcmpstart(answer, "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: "));
+  tt_assert(strstr(answer, "\r\n\r\n# HELP "));
+  tt_assert(strstr(answer, "\ntor_kist_runs_total "));
+  tor_free(answer);
+
+  answer = metrics_answer("GET /index.html HTTP/1.0\r\n\r\n");
+  tt_str_op(answer, OP_EQ, "HTTP/1.0 404 Not Found\r\n\r\n");
+  tor_free(answer);
+
+  answer = metrics_answer("POST /metrics HTTP/1.0\r\n\r\n");
+  tt_str_op(answer, OP_EQ, "HTTP/1.0 405 Method Not Allowed\r\n\r\n");
+  tor_free(answer);
+
+  answer = metrics_answer("GET\r\n\r\n");
+  tt_str_op(answer, OP_EQ, "HTTP/1.0 400 Bad Request\r\n\r\n");
+
+ done:
+  tor_free(answer);
+  UNMOCK(connection_mark_for_close_internal_);
+  UNMOCK(connection_write_to_buf_impl_);
+}
+
+static void
+test_metrics_policy(void *arg)
+{
+  or_options_t *options = options_new();
+  tor_addr_t local, remote, other;
+  (void)arg;
+
+  tor_addr_parse(&local, "127.0.0.1");
+  tor_addr_parse(&remote, "192.0.2.7");
+  tor_addr_parse(&other, "192.0.2.8");
+
+  /* With no policy, only localhost may connect. */
+  tt_int_op(policies_parse_from_options(options), OP_EQ, 0);
+  tt_int_op(metrics_policy_permits_address(&local), OP_EQ, 1);
+  tt_int_op(metrics_policy_permits_address(&remote), OP_EQ, 0);
+
+  /* With a policy, only what it accepts may connect. */
+  config_line_append(&options->MetricsPortPolicy, "MetricsPortPolicy",
+                     "accept 192.0.2.7");
+  tt_int_op(policies_parse_from_options(options), OP_EQ, 0);
+  tt_int_op(metrics_policy_permits_address(&remote), OP_EQ, 1);
+  tt_int_op(metrics_policy_permits_address(&other), OP_EQ, 0);
+  tt_int_op(metrics_policy_permits_address(&local), OP_EQ, 0);
+
+ done:
+  policies_free_all();
+  or_options_free(options);
+}
+
+struct testcase_t metrics_tests[] = {
+  { "histogram", test_metrics_histogram, 0, NULL, NULL },
+  { "output", test_metrics_output, TT_FORK, NULL, NULL },
+  { "connection", test_metrics_connection, TT_FORK, NULL, NULL },
+  { "policy", test_metrics_policy, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -0,0 +1,780 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file test_multipath.c
+ * \brief Tests for multipath circuits.
+ */
+
+#define CIRCUITLIST_PRIVATE
+#define CONNECTION_PRIVATE
+#define CONNECTION_EDGE_PRIVATE
+#define MULTIPATH_PRIVATE
+#define RELAY_PRIVATE
+
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
+#include "core/or/circuitbuild.h"
+#include "core/or/circuitlist.h"
+#include "core/or/circuituse.h"
+#include "core/or/connection_edge.h"
+#include "core/or/multipath.h"
+#include "core/or/relay.h"
+#include "core/or/sendme.h"
+#include "feature/nodelist/nodelist.h"
+#include "lib/buf/buffers.h"
+
+#include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
+#include "core/or/cpath_build_state_st.h"
+#include "core/or/crypt_path_st.h"
+#include "core/or/edge_connection_st.h"
+#include "core/or/entry_connection_st.h"
+#include "core/or/extend_info_st.h"
+#include "core/or/or_circuit_st.h"
+#include "core/or/origin_circuit_st.h"
+#include "core/or/socks_request_st.h"
+#include "feature/nodelist/node_st.h"
+#include "feature/nodelist/routerstatus_st.h"
+
+#include "test/log_test_helpers.h"
+#include "test/test.h"
+
+/** The relay cells that mock_relay_send_command_from_edge() or
+ * mock_relay_send_packed_cell_from_edge() were asked to send: how many, and
+ * the circuit, command and body of each of the first MAX_SENT. */
+#define MAX_SENT 8
+static int n_sent = 0;
+static circuit_t *sent_circ[MAX_SENT];
+static uint8_t sent_command[MAX_SENT];
+static uint8_t sent_body[MAX_SENT][RELAY_PAYLOAD_SIZE];
+static size_t sent_body_len[MAX_SENT];
+
+static int
+mock_relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
+                                  uint8_t relay_command, const char *payload,
+                                  size_t payload_len,
+                                  crypt_path_t *cpath_layer,
+                                  const char *filename, int lineno)
+{
+  (void) stream_id;
+  (void) cpath_layer;
+  (void) filename;
+  (void) lineno;
+
+  if (n_sent < MAX_SENT) {
+    sent_circ[n_sent] = circ;
+    sent_command[n_sent] = relay_command;
+    sent_body_len[n_sent] = payload_len;
+    memcpy(sent_body[n_sent], payload, payload_len);
+  }
+  ++n_sent;
+  return 0;
+}
+
+static int
+mock_relay_send_packed_cell_from_edge(streamid_t stream_id, circuit_t *circ,
+                                      uint8_t relay_command,
+                                      packed_cell_t *cell, size_t body_len,
+                                      crypt_path_t *cpath_layer)
+{
+  const char *body = cell->body + RELAY_PACKED_PAYLOAD_OFFSET +
+    RELAY_HEADER_SIZE;
+  int r = mock_relay_send_command_from_edge(stream_id, circ, relay_command,
+                                            body, body_len, cpath_layer,
+                                            __FILE__, __LINE__);
+  packed_cell_free(cell);
+  return r;
+}
+
+static int n_circs_marked = 0;
+
+static void
+mock_connection_stop_reading(connection_t *conn)
+{
+  (void) conn;
+}
+
+static void
+mock_circuit_mark_for_close_(circuit_t *circ, int reason, int line,
+                             const char *file)
+{
+  (void) reason;
+  (void) line;
+  (void) file;
+
+  ++n_circs_marked;
+  circ->marked_for_close = 1;
+}
+
+static void
+mock_connection_mark_for_close_internal_(connection_t *conn, int line,
+                                         const char *file)
+{
+  (void) line;
+  (void) file;
+
+  conn->marked_for_close = 1;
+}
+
+/** Return a new open OR circuit on which we are the last hop. */
+static or_circuit_t *
+new_exit_circ(void)
+{
+  or_circuit_t *circ = or_circuit_new(0, NULL);
+  circ->base_.purpose = CIRCUIT_PURPOSE_OR;
+  circ->base_.state = CIRCUIT_STATE_OPEN;
+  return circ;
+}
+
+/** An exit that supports multipath circuits, for mock_node_get_by_id(). */
+static node_t mp_exit_node;
+static routerstatus_t mp_exit_rs;
+
+static const node_t *
+mock_node_get_by_id(const char *identity_digest)
+{
+  (void) identity_digest;
+  return &mp_exit_node;
+}
+
+/** The circuits that mock_circuit_establish_circuit() built. */
+static smartlist_t *built_circs = NULL;
+
+static origin_circuit_t *new_origin_circ(void);
+
+static origin_circuit_t *
+mock_circuit_establish_circuit(uint8_t purpose, extend_info_t *exit_ei,
+                               int flags)
+{
+  origin_circuit_t *circ = new_origin_circ();
+  (void) exit_ei;
+  (void) flags;
+
+  TO_CIRCUIT(circ)->purpose = purpose;
+  TO_CIRCUIT(circ)->state = CIRCUIT_STATE_BUILDING;
+  smartlist_add(built_circs, circ);
+  return circ;
+}
+
+/** Return a new OR circuit that asked us to link it with the set named by
+ * <b>nonce</b>, as its exit. */
+static or_circuit_t *
+new_linked_exit_circ(const uint8_t *nonce)
+{
+  or_circuit_t *circ = new_exit_circ();
+  tt_int_op(multipath_process_link(TO_CIRCUIT(circ), NULL, nonce,
+                                   MULTIPATH_NONCE_LEN), OP_EQ, 0);
+  tt_int_op(sent_command[n_sent - 1], OP_EQ, RELAY_COMMAND_MP_LINKED);
+ done:
+  return circ;
+}
+
+/** Return a new origin circuit with one open hop. */
+static origin_circuit_t *
+new_origin_circ(void)
+{
+  origin_circuit_t *circ = origin_circuit_new();
+  TO_CIRCUIT(circ)->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  TO_CIRCUIT(circ)->state = CIRCUIT_STATE_OPEN;
+  circ->cpath = tor_malloc_zero(sizeof(crypt_path_t));
+  circ->cpath->magic = CRYPT_PATH_MAGIC;
+  circ->cpath->state = CPATH_STATE_OPEN;
+  circ->cpath->package_window = CIRCWINDOW_START;
+  circ->cpath->deliver_window = CIRCWINDOW_START;
+  circ->cpath->prev = circ->cpath;
+  circ->cpath->next = circ->cpath;
+  return circ;
+}
+
+/** Return a new open exit stream with ID <b>stream_id</b> on <b>circ</b>. */
+static edge_connection_t *
+new_exit_stream(or_circuit_t *circ, streamid_t stream_id)
+{
+  edge_connection_t *conn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  conn->base_.state = EXIT_CONN_STATE_OPEN;
+  conn->stream_id = stream_id;
+  conn->package_window = STREAMWINDOW_START;
+  conn->deliver_window = STREAMWINDOW_START;
+  conn->on_circuit = TO_CIRCUIT(circ);
+  conn->next_stream = circ->n_streams;
+  circ->n_streams = conn;
+  return conn;
+}
+
+/** Return a new client stream whose SOCKS request has command
+ * <b>command</b>. */
+static entry_connection_t *
+new_ap_stream(uint8_t command)
+{
+  entry_connection_t *conn = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  conn->socks_request->command = command;
+  conn->original_dest_address = tor_strdup("example.com");
+  return conn;
+}
+
+/** Pack a relay cell with command <b>command</b> for stream
+ * <b>stream_id</b> into <b>cell</b>. If <b>with_seq</b> is set, the body
+ * starts with the sequence number <b>seq</b>; then comes the string
+ * <b>data</b>. */
+static void
+pack_cell(cell_t *cell, uint8_t command, streamid_t stream_id,
+          int with_seq, uint32_t seq, const char *data)
+{
+  relay_header_t rh;
+  size_t offset = with_seq ? MULTIPATH_SEQ_LEN : 0;
+
+  memset(cell, 0, sizeof(*cell));
+  memset(&rh, 0, sizeof(rh));
+  rh.command = command;
+  rh.stream_id = stream_id;
+  rh.length = offset + strlen(data);
+  if (with_seq)
+    set_uint32(cell->payload + RELAY_HEADER_SIZE, htonl(seq));
+  memcpy(cell->payload + RELAY_HEADER_SIZE + offset, data, strlen(data));
+  relay_header_pack(cell->payload, &rh);
+}
+
+/** Check that the outbuf of <b>conn</b> holds exactly <b>expected</b>, and
+ * empty it. */
+#define tt_outbuf_op(conn, expected) STMT_BEGIN                         \
+    char outbuf_[64];                                                   \
+    size_t outlen_ = buf_datalen(TO_CONN(conn)->outbuf);                \
+    tt_uint_op(outlen_, OP_EQ, strlen(expected));                       \
+    buf_get_bytes(TO_CONN(conn)->outbuf, outbuf_, outlen_);             \
+    tt_mem_op(outbuf_, OP_EQ, (expected), outlen_);                     \
+  STMT_END
+
+static void
+test_multipath_link(void *arg)
+{
+  uint8_t nonce[MULTIPATH_NONCE_LEN];
+  uint8_t other_nonce[MULTIPATH_NONCE_LEN];
+  or_circuit_t *legs[MULTIPATH_MAX_LEGS + 1];
+  or_circuit_t *other = NULL;
+  int i;
+  (void) arg;
+
+  memset(legs, 0, sizeof(legs));
+  memset(nonce, 'x', sizeof(nonce));
+  memset(other_nonce, 'y', sizeof(other_nonce));
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close_);
+
+  /* Every circuit that sends the same nonce joins the same set, and we
+   * answer each with the nonce. */
+  legs[0] = new_linked_exit_circ(nonce);
+  legs[1] = new_linked_exit_circ(nonce);
+  other = new_linked_exit_circ(other_nonce);
+  tt_int_op(n_sent, OP_EQ, 3);
+  tt_mem_op(sent_body[0], OP_EQ, nonce, MULTIPATH_NONCE_LEN);
+  tt_assert(TO_CIRCUIT(legs[0])->mp_linked);
+  tt_ptr_op(TO_CIRCUIT(legs[0])->mp_set, OP_EQ, TO_CIRCUIT(legs[1])->mp_set);
+  tt_ptr_op(TO_CIRCUIT(other)->mp_set, OP_NE, TO_CIRCUIT(legs[0])->mp_set);
+  tt_int_op(smartlist_len(multipath_get_legs(TO_CIRCUIT(legs[0]))),
+            OP_EQ, 2);
+
+  /* A circuit can only be linked once, with a well-formed cell. */
+  setup_full_capture_of_logs(LOG_INFO);
+  tt_int_op(multipath_process_link(TO_CIRCUIT(legs[0]), NULL, nonce,
+                                   MULTIPATH_NONCE_LEN),
+            OP_EQ, -END_CIRC_REASON_TORPROTOCOL);
+  expect_log_msg_containing("already linked");
+  legs[2] = new_exit_circ();
+  tt_int_op(multipath_process_link(TO_CIRCUIT(legs[2]), NULL, nonce,
+                                   MULTIPATH_NONCE_LEN - 1),
+            OP_EQ, -END_CIRC_REASON_TORPROTOCOL);
+  expect_log_msg_containing("bad length");
+  teardown_capture_of_logs();
+  tt_ptr_op(TO_CIRCUIT(legs[2])->mp_set, OP_EQ, NULL);
+
+  /* A set can't grow without bound. */
+  circuit_free_(TO_CIRCUIT(legs[2]));
+  n_sent = 0;
+  for (i = 2; i < MULTIPATH_MAX_LEGS; ++i)
+    legs[i] = new_linked_exit_circ(nonce);
+  legs[MULTIPATH_MAX_LEGS] = new_exit_circ();
+  tt_int_op(multipath_process_link(TO_CIRCUIT(legs[MULTIPATH_MAX_LEGS]),
+                                   NULL, nonce, MULTIPATH_NONCE_LEN),
+            OP_EQ, -END_CIRC_REASON_RESOURCELIMIT);
+
+  /* Closing one leg closes the rest of its set, but not other sets. */
+  TO_CIRCUIT(legs[3])->marked_for_close = 1;
+  multipath_circuit_about_to_close(TO_CIRCUIT(legs[3]));
+  tt_int_op(n_circs_marked, OP_EQ, MULTIPATH_MAX_LEGS - 1);
+  for (i = 0; i < MULTIPATH_MAX_LEGS; ++i) {
+    tt_assert(TO_CIRCUIT(legs[i])->marked_for_close);
+    tt_ptr_op(TO_CIRCUIT(legs[i])->mp_set, OP_EQ, NULL);
+  }
+  tt_assert(TO_CIRCUIT(other)->mp_linked);
+
+  /* Once the set is gone, its nonce names a new one. */
+  circuit_free_(TO_CIRCUIT(legs[MULTIPATH_MAX_LEGS]));
+  legs[MULTIPATH_MAX_LEGS] = new_linked_exit_circ(nonce);
+  tt_int_op(smartlist_len(multipath_get_legs(
+                                TO_CIRCUIT(legs[MULTIPATH_MAX_LEGS]))),
+            OP_EQ, 1);
+
+ done:
+  teardown_capture_of_logs();
+  for (i = 0; i <= MULTIPATH_MAX_LEGS; ++i)
+    circuit_free_(TO_CIRCUIT(legs[i]));
+  circuit_free_(TO_CIRCUIT(other));
+  multipath_free_all();
+  UNMOCK(relay_send_command_from_edge_);
+  UNMOCK(circuit_mark_for_close_);
+}
+
+static void
+test_multipath_linked(void *arg)
+{
+  origin_circuit_t *home = NULL, *leg = NULL, *late = NULL;
+  entry_connection_t *entry_conn = NULL;
+  multipath_set_t *set;
+  uint8_t nonce[MULTIPATH_NONCE_LEN];
+  crypt_path_t *wrong_hop = NULL;
+  (void) arg;
+
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close_);
+
+  home = new_origin_circ();
+  leg = new_origin_circ();
+  late = new_origin_circ();
+  set = multipath_set_new(NULL);
+  multipath_set_add_leg(set, TO_CIRCUIT(home));
+  multipath_set_add_leg(set, TO_CIRCUIT(leg));
+  multipath_set_add_leg(set, TO_CIRCUIT(late));
+  tt_int_op(multipath_set_n_linked(set), OP_EQ, 0);
+  tt_ptr_op(multipath_get_legs(TO_CIRCUIT(leg)), OP_NE, NULL);
+
+  /* MP_LINKED must come from the last hop, and name our set. */
+  wrong_hop = tor_malloc_zero(sizeof(crypt_path_t));
+  setup_full_capture_of_logs(LOG_INFO);
+  memset(nonce, 0, sizeof(nonce));
+  tt_int_op(multipath_process_linked(TO_CIRCUIT(home), wrong_hop, nonce,
+                                     sizeof(nonce)),
+            OP_EQ, -END_CIRC_REASON_TORPROTOCOL);
+  expect_log_msg_containing("unexpected MP_LINKED");
+  tt_int_op(multipath_process_linked(TO_CIRCUIT(home), home->cpath, nonce,
+                                     sizeof(nonce)),
+            OP_EQ, -END_CIRC_REASON_TORPROTOCOL);
+  expect_log_msg_containing("wrong multipath set");
+  teardown_capture_of_logs();
+  tt_assert(!TO_CIRCUIT(home)->mp_linked);
+
+  /* The exit echoes the nonce from our MP_LINK cells. */
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  multipath_circuit_has_opened(leg);
+  tt_int_op(n_sent, OP_EQ, 1);
+  tt_int_op(sent_command[0], OP_EQ, RELAY_COMMAND_MP_LINK);
+  tt_ptr_op(sent_circ[0], OP_EQ, TO_CIRCUIT(leg));
+  memcpy(nonce, sent_body[0], sizeof(nonce));
+  tt_int_op(multipath_process_linked(TO_CIRCUIT(home), home->cpath, nonce,
+                                     sizeof(nonce)), OP_EQ, 0);
+  tt_int_op(multipath_process_linked(TO_CIRCUIT(leg), leg->cpath, nonce,
+                                     sizeof(nonce)), OP_EQ, 0);
+  tt_int_op(multipath_set_n_linked(set), OP_EQ, 2);
+
+  /* Stream IDs are unique over the set. */
+  entry_conn = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  ENTRY_TO_EDGE_CONN(entry_conn)->stream_id = 1;
+  home->p_streams = ENTRY_TO_EDGE_CONN(entry_conn);
+  leg->next_stream_id = 1;
+  tt_int_op(get_unique_stream_id_by_circ(leg), OP_EQ, 2);
+
+  /* A leg that never linked just leaves the set when it closes. */
+  TO_CIRCUIT(late)->marked_for_close = 1;
+  multipath_circuit_about_to_close(TO_CIRCUIT(late));
+  tt_int_op(n_circs_marked, OP_EQ, 0);
+  tt_ptr_op(TO_CIRCUIT(late)->mp_set, OP_EQ, NULL);
+  tt_int_op(smartlist_len(multipath_get_legs(TO_CIRCUIT(home))), OP_EQ, 2);
+
+  /* A linked one takes the set with it. */
+  TO_CIRCUIT(home)->marked_for_close = 1;
+  multipath_circuit_about_to_close(TO_CIRCUIT(home));
+  tt_int_op(n_circs_marked, OP_EQ, 1);
+  tt_assert(TO_CIRCUIT(leg)->marked_for_close);
+  tt_ptr_op(TO_CIRCUIT(leg)->mp_set, OP_EQ, NULL);
+
+ done:
+  teardown_capture_of_logs();
+  tor_free(wrong_hop);
+  if (home)
+    home->p_streams = NULL;
+  connection_free_minimal(ENTRY_TO_CONN(entry_conn));
+  circuit_free_(TO_CIRCUIT(home));
+  circuit_free_(TO_CIRCUIT(leg));
+  circuit_free_(TO_CIRCUIT(late));
+  UNMOCK(relay_send_command_from_edge_);
+  UNMOCK(circuit_mark_for_close_);
+}
+
+static void
+test_multipath_stream_attached(void *arg)
+{
+  origin_circuit_t *circ = NULL;
+  entry_connection_t *resolve = NULL, *connect = NULL, *second = NULL;
+  (void) arg;
+
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  MOCK(node_get_by_id, mock_node_get_by_id);
+  MOCK(circuit_establish_circuit, mock_circuit_establish_circuit);
+  built_circs = smartlist_new();
+  mp_exit_rs.pv.supports_multipath = 1;
+  mp_exit_node.rs = &mp_exit_rs;
+  get_options_mutable()->MultipathCircuits = 3;
+
+  circ = new_origin_circ();
+  circ->build_state = tor_malloc_zero(sizeof(cpath_build_state_t));
+  circ->build_state->chosen_exit = tor_malloc_zero(sizeof(extend_info_t));
+  resolve = new_ap_stream(SOCKS_COMMAND_RESOLVE);
+  connect = new_ap_stream(SOCKS_COMMAND_CONNECT);
+  second = new_ap_stream(SOCKS_COMMAND_CONNECT);
+
+  /* Opening a circuit builds nothing: most of the circuits that we build
+   * ahead of time, and all the ones that measure build times, never get a
+   * stream. */
+  multipath_circuit_has_opened(circ);
+  tt_int_op(n_sent, OP_EQ, 0);
+  tt_ptr_op(TO_CIRCUIT(circ)->mp_set, OP_EQ, NULL);
+
+  /* Nor does a stream that only resolves a name. */
+  link_apconn_to_circ(resolve, circ, NULL);
+  tt_int_op(n_sent, OP_EQ, 0);
+  tt_ptr_op(TO_CIRCUIT(circ)->mp_set, OP_EQ, NULL);
+
+  /* The first CONNECT stream starts the set and builds the other legs. */
+  link_apconn_to_circ(connect, circ, NULL);
+  tt_int_op(n_sent, OP_EQ, 1);
+  tt_int_op(sent_command[0], OP_EQ, RELAY_COMMAND_MP_LINK);
+  tt_ptr_op(sent_circ[0], OP_EQ, TO_CIRCUIT(circ));
+  tt_int_op(smartlist_len(built_circs), OP_EQ, 2);
+  tt_int_op(smartlist_len(multipath_get_legs(TO_CIRCUIT(circ))), OP_EQ, 3);
+  SMARTLIST_FOREACH(built_circs, origin_circuit_t *, leg,
+                    tt_ptr_op(TO_CIRCUIT(leg)->mp_set, OP_EQ,
+                              TO_CIRCUIT(circ)->mp_set));
+
+  /* Later streams use the same set. */
+  link_apconn_to_circ(second, circ, NULL);
+  tt_int_op(n_sent, OP_EQ, 1);
+  tt_int_op(smartlist_len(built_circs), OP_EQ, 2);
+
+ done:
+  if (circ)
+    circ->p_streams = NULL;
+  connection_free_minimal(ENTRY_TO_CONN(resolve));
+  connection_free_minimal(ENTRY_TO_CONN(connect));
+  connection_free_minimal(ENTRY_TO_CONN(second));
+  SMARTLIST_FOREACH(built_circs, origin_circuit_t *, leg,
+                    circuit_free_(TO_CIRCUIT(leg)));
+  smartlist_free(built_circs);
+  circuit_free_(TO_CIRCUIT(circ));
+  multipath_free_all();
+  UNMOCK(relay_send_command_from_edge_);
+  UNMOCK(node_get_by_id);
+  UNMOCK(circuit_establish_circuit);
+}
+
+static void
+test_multipath_reorder(void *arg)
+{
+  edge_connection_t *conn = NULL;
+  (void) arg;
+
+  conn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+
+  /* Cells that arrive in order go straight through. */
+  tt_int_op(multipath_stream_data_received(conn, 0, (uint8_t *) "a", 1),
+            OP_EQ, 0);
+  tt_outbuf_op(conn, "a");
+  tt_ptr_op(conn->mp_reorder, OP_EQ, NULL);
+
+  /* Cells that arrive early wait for the gap before them. */
+  tt_int_op(multipath_stream_data_received(conn, 3, (uint8_t *) "d", 1),
+            OP_EQ, 0);
+  tt_int_op(multipath_stream_data_received(conn, 2, (uint8_t *) "c", 1),
+            OP_EQ, 0);
+  tt_int_op(multipath_stream_data_received(conn, 5, (uint8_t *) "f", 1),
+            OP_EQ, 0);
+  tt_outbuf_op(conn, "");
+  tt_int_op(smartlist_len(conn->mp_reorder), OP_EQ, 3);
+  tt_int_op(multipath_stream_data_received(conn, 1, (uint8_t *) "b", 1),
+            OP_EQ, 0);
+  tt_outbuf_op(conn, "bcd");
+  tt_uint_op(conn->mp_next_recv_seq, OP_EQ, 4);
+  tt_int_op(smartlist_len(conn->mp_reorder), OP_EQ, 1);
+
+  /* Duplicates, and cells beyond the stream window, break the protocol. */
+  setup_full_capture_of_logs(LOG_INFO);
+  tt_int_op(multipath_stream_data_received(conn, 5, (uint8_t *) "f", 1),
+            OP_EQ, -1);
+  expect_log_msg_containing("twice");
+  tt_int_op(multipath_stream_data_received(conn, 2, (uint8_t *) "c", 1),
+            OP_EQ, -1);
+  expect_log_msg_containing("out of its window");
+  tt_int_op(multipath_stream_data_received(conn, 4 + STREAMWINDOW_START + 1,
+                                           (uint8_t *) "z", 1),
+            OP_EQ, -1);
+  teardown_capture_of_logs();
+
+  tt_int_op(multipath_stream_data_received(conn, 4, (uint8_t *) "e", 1),
+            OP_EQ, 0);
+  tt_outbuf_op(conn, "ef");
+  tt_int_op(smartlist_len(conn->mp_reorder), OP_EQ, 0);
+
+  /* Sequence numbers wrap. */
+  conn->mp_next_recv_seq = UINT32_MAX;
+  tt_int_op(multipath_stream_data_received(conn, 0, (uint8_t *) "h", 1),
+            OP_EQ, 0);
+  tt_int_op(multipath_stream_data_received(conn, UINT32_MAX,
+                                           (uint8_t *) "g", 1),
+            OP_EQ, 0);
+  tt_outbuf_op(conn, "gh");
+  tt_uint_op(conn->mp_next_recv_seq, OP_EQ, 1);
+
+  /* Whatever we still hold goes away with the stream. */
+  tt_int_op(multipath_stream_data_received(conn, 3, (uint8_t *) "j", 1),
+            OP_EQ, 0);
+
+ done:
+  teardown_capture_of_logs();
+  connection_free_minimal(TO_CONN(conn));
+}
+
+static void
+test_multipath_held_cells(void *arg)
+{
+  uint8_t nonce[MULTIPATH_NONCE_LEN];
+  or_circuit_t *home = NULL;
+  edge_connection_t *conns[6];
+  multipath_set_t *set;
+  int i, r = 0;
+  uint32_t seq;
+  (void) arg;
+
+  memset(nonce, 'n', sizeof(nonce));
+  memset(conns, 0, sizeof(conns));
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+
+  home = new_linked_exit_circ(nonce);
+  set = TO_CIRCUIT(home)->mp_set;
+  for (i = 0; i < 6; ++i)
+    conns[i] = new_exit_stream(home, i + 1);
+
+  /* We count what we hold over the whole set, until we deliver it or the
+   * stream goes away. */
+  tt_int_op(multipath_stream_data_received(conns[0], 1, (uint8_t *) "b", 1),
+            OP_EQ, 0);
+  tt_int_op(multipath_stream_data_received(conns[1], 1, (uint8_t *) "b", 1),
+            OP_EQ, 0);
+  tt_int_op(multipath_stream_n_held(conns[0]), OP_EQ, 1);
+  tt_int_op(multipath_set_n_held_cells(set), OP_EQ, 2);
+  tt_int_op(multipath_stream_data_received(conns[0], 0, (uint8_t *) "a", 1),
+            OP_EQ, 0);
+  tt_int_op(multipath_set_n_held_cells(set), OP_EQ, 1);
+  circuit_detach_stream(TO_CIRCUIT(home), conns[1]);
+  tt_int_op(multipath_set_n_held_cells(set), OP_EQ, 0);
+  tt_ptr_op(conns[1]->mp_reorder, OP_EQ, NULL);
+
+  /* Each stream window lets the other end make us hold up to a window of
+   * cells, but not more than MULTIPATH_MAX_HELD_CELLS over the set. */
+  setup_full_capture_of_logs(LOG_INFO);
+  for (i = 2; i < 6 && r == 0; ++i) {
+    for (seq = 1; seq <= STREAMWINDOW_START && r == 0; ++seq)
+      r = multipath_stream_data_received(conns[i], seq, (uint8_t *) "x", 1);
+  }
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(multipath_set_n_held_cells(set), OP_EQ, 4 * STREAMWINDOW_START);
+
+  /* Cells that we hold don't count as delivered for stream SENDMEs. */
+  n_sent = 0;
+  conns[2]->deliver_window = STREAMWINDOW_START - STREAMWINDOW_INCREMENT;
+  sendme_connection_edge_consider_sending(conns[2]);
+  tt_int_op(n_sent, OP_EQ, 0);
+  conns[0]->deliver_window = STREAMWINDOW_START - STREAMWINDOW_INCREMENT;
+  sendme_connection_edge_consider_sending(conns[0]);
+  tt_int_op(n_sent, OP_EQ, 1);
+  tt_int_op(sent_command[0], OP_EQ, RELAY_COMMAND_SENDME);
+  tt_int_op(conns[0]->deliver_window, OP_EQ, STREAMWINDOW_START);
+  for (seq = 3; seq <= 2 + STREAMWINDOW_START && r == 0; ++seq)
+    r = multipath_stream_data_received(conns[0], seq, (uint8_t *) "x", 1);
+  tt_int_op(r, OP_EQ, -1);
+  tt_int_op(multipath_set_n_held_cells(set), OP_EQ, MULTIPATH_MAX_HELD_CELLS);
+  expect_log_msg_containing("closing it");
+
+ done:
+  teardown_capture_of_logs();
+  if (home)
+    home->n_streams = NULL;
+  for (i = 0; i < 6; ++i)
+    connection_free_minimal(TO_CONN(conns[i]));
+  circuit_free_(TO_CIRCUIT(home));
+  multipath_free_all();
+  UNMOCK(relay_send_command_from_edge_);
+}
+
+static void
+test_multipath_relay_cells(void *arg)
+{
+  uint8_t nonce[MULTIPATH_NONCE_LEN];
+  or_circuit_t *home = NULL, *leg = NULL, *stranger = NULL;
+  edge_connection_t *conn = NULL;
+  cell_t cell;
+  (void) arg;
+
+  memset(nonce, 'n', sizeof(nonce));
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  MOCK(connection_mark_for_close_internal_,
+       mock_connection_mark_for_close_internal_);
+
+  home = new_linked_exit_circ(nonce);
+  leg = new_linked_exit_circ(nonce);
+  stranger = new_exit_circ();
+  conn = new_exit_stream(home, 7);
+
+  /* DATA cells count as the first in sequence. */
+  pack_cell(&cell, RELAY_COMMAND_DATA, 7, 0, 0, "ab");
+  tt_int_op(connection_edge_process_relay_cell(&cell, TO_CIRCUIT(home),
+                                               conn, NULL), OP_EQ, 0);
+  tt_outbuf_op(conn, "ab");
+
+  /* MP_DATA cells find the stream from any circuit of its set, but not from
+   * others. */
+  pack_cell(&cell, RELAY_COMMAND_MP_DATA, 7, 1, 1, "XX");
+  tt_int_op(connection_edge_process_relay_cell(&cell, TO_CIRCUIT(stranger),
+                                               NULL, NULL), OP_EQ, 0);
+  tt_int_op(conn->deliver_window, OP_EQ, STREAMWINDOW_START - 1);
+  pack_cell(&cell, RELAY_COMMAND_MP_DATA, 7, 1, 2, "ef");
+  tt_int_op(connection_edge_process_relay_cell(&cell, TO_CIRCUIT(leg),
+                                               NULL, NULL), OP_EQ, 0);
+  tt_int_op(conn->deliver_window, OP_EQ, STREAMWINDOW_START - 2);
+  tt_int_op(TO_CIRCUIT(leg)->deliver_window, OP_EQ, CIRCWINDOW_START - 1);
+  tt_outbuf_op(conn, "");
+
+  /* An END cell waits for the data that was sent before it. */
+  pack_cell(&cell, RELAY_COMMAND_END, 7, 0, 0, "\x06....");
+  set_uint32(cell.payload + RELAY_HEADER_SIZE + 1, htonl(3));
+  tt_int_op(connection_edge_process_relay_cell(&cell, TO_CIRCUIT(home),
+                                               conn, NULL), OP_EQ, 0);
+  tt_assert(conn->mp_end_pending);
+  tt_assert(!conn->base_.marked_for_close);
+
+  pack_cell(&cell, RELAY_COMMAND_MP_DATA, 7, 1, 1, "cd");
+  tt_int_op(connection_edge_process_relay_cell(&cell, TO_CIRCUIT(leg),
+                                               NULL, NULL), OP_EQ, 0);
+  tt_outbuf_op(conn, "cdef");
+  tt_assert(conn->base_.marked_for_close);
+  tt_int_op(conn->end_reason, OP_EQ,
+            END_STREAM_REASON_DONE | END_STREAM_REASON_FLAG_REMOTE);
+
+ done:
+  if (home)
+    home->n_streams = NULL;
+  connection_free_minimal(TO_CONN(conn));
+  circuit_free_(TO_CIRCUIT(home));
+  circuit_free_(TO_CIRCUIT(leg));
+  circuit_free_(TO_CIRCUIT(stranger));
+  multipath_free_all();
+  UNMOCK(relay_send_command_from_edge_);
+  UNMOCK(connection_mark_for_close_internal_);
+}
+
+static void
+test_multipath_package(void *arg)
+{
+  uint8_t nonce[MULTIPATH_NONCE_LEN];
+  or_circuit_t *home = NULL, *leg = NULL;
+  edge_connection_t *conn = NULL;
+  char data[RELAY_PAYLOAD_SIZE * 2];
+  int i;
+  (void) arg;
+
+  memset(nonce, 'n', sizeof(nonce));
+  memset(data, 'd', sizeof(data));
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  MOCK(relay_send_packed_cell_from_edge,
+       mock_relay_send_packed_cell_from_edge);
+  MOCK(connection_stop_reading, mock_connection_stop_reading);
+
+  home = new_linked_exit_circ(nonce);
+  leg = new_linked_exit_circ(nonce);
+  conn = new_exit_stream(home, 7);
+  n_sent = 0;
+
+  /* Before the stream switches, its data goes out as DATA on its own
+   * circuit. */
+  buf_add(TO_CONN(conn)->inbuf, "abc", 3);
+  tt_int_op(connection_edge_package_raw_inbuf(conn, 1, NULL), OP_EQ, 0);
+  tt_int_op(n_sent, OP_EQ, 1);
+  tt_int_op(sent_command[0], OP_EQ, RELAY_COMMAND_DATA);
+  tt_uint_op(conn->mp_next_send_seq, OP_EQ, 1);
+
+  /* A stream-level SENDME on a linked circuit switches it. */
+  multipath_stream_note_sendme(conn, TO_CIRCUIT(home));
+  tt_assert(conn->mp_sending);
+
+  /* Then each cell goes on the circuit with the most room, with its
+   * sequence number first. */
+  TO_CIRCUIT(home)->package_window = 100;
+  TO_CIRCUIT(leg)->package_window = 101;
+  n_sent = 0;
+  buf_add(TO_CONN(conn)->inbuf, data, sizeof(data));
+  tt_int_op(connection_edge_package_raw_inbuf(conn, 1, NULL), OP_EQ, 0);
+  tt_int_op(n_sent, OP_EQ, 3);
+  tt_ptr_op(sent_circ[0], OP_EQ, TO_CIRCUIT(leg));
+  tt_ptr_op(sent_circ[1], OP_EQ, TO_CIRCUIT(home));
+  tt_ptr_op(sent_circ[2], OP_EQ, TO_CIRCUIT(leg));
+  for (i = 0; i < 3; ++i) {
+    tt_int_op(sent_command[i], OP_EQ, RELAY_COMMAND_MP_DATA);
+    tt_uint_op(ntohl(get_uint32(sent_body[i])), OP_EQ, i + 1);
+  }
+  tt_uint_op(sent_body_len[0], OP_EQ, RELAY_PAYLOAD_SIZE);
+  tt_uint_op(buf_datalen(TO_CONN(conn)->inbuf), OP_EQ, 0);
+  tt_int_op(TO_CIRCUIT(home)->package_window, OP_EQ, 99);
+  tt_int_op(TO_CIRCUIT(leg)->package_window, OP_EQ, 99);
+
+  /* Circuits with no room, or that are closing, are skipped; with none
+   * left, the stream stops. */
+  TO_CIRCUIT(leg)->package_window = 0;
+  n_sent = 0;
+  buf_add(TO_CONN(conn)->inbuf, "xyz", 3);
+  tt_int_op(connection_edge_package_raw_inbuf(conn, 1, NULL), OP_EQ, 0);
+  tt_int_op(n_sent, OP_EQ, 1);
+  tt_ptr_op(sent_circ[0], OP_EQ, TO_CIRCUIT(home));
+  TO_CIRCUIT(home)->marked_for_close = 1;
+  buf_add(TO_CONN(conn)->inbuf, "xyz", 3);
+  tt_int_op(connection_edge_package_raw_inbuf(conn, 1, NULL), OP_EQ, 0);
+  tt_int_op(n_sent, OP_EQ, 1);
+  TO_CIRCUIT(home)->marked_for_close = 0;
+
+  /* Our END cell says how many data cells we sent. */
+  n_sent = 0;
+  tt_int_op(connection_edge_end(conn, END_STREAM_REASON_DONE), OP_EQ, 0);
+  tt_int_op(sent_command[0], OP_EQ, RELAY_COMMAND_END);
+  tt_uint_op(sent_body_len[0], OP_EQ, 1 + MULTIPATH_SEQ_LEN);
+  tt_uint_op(ntohl(get_uint32(sent_body[0] + 1)), OP_EQ, 5);
+
+ done:
+  if (home)
+    home->n_streams = NULL;
+  connection_free_minimal(TO_CONN(conn));
+  circuit_free_(TO_CIRCUIT(home));
+  circuit_free_(TO_CIRCUIT(leg));
+  multipath_free_all();
+  UNMOCK(relay_send_command_from_edge_);
+  UNMOCK(relay_send_packed_cell_from_edge);
+  UNMOCK(connection_stop_reading);
+}
+
+struct testcase_t multipath_tests[] = {
+  { "link", test_multipath_link, TT_FORK, NULL, NULL },
+  { "linked", test_multipath_linked, TT_FORK, NULL, NULL },
+  { "stream_attached", test_multipath_stream_attached, TT_FORK, NULL, NULL },
+  { "reorder", test_multipath_reorder, TT_FORK, NULL, NULL },
+  { "held_cells", test_multipath_held_cells, TT_FORK, NULL, NULL },
+  { "relay_cells", test_multipath_relay_cells, TT_FORK, NULL, NULL },
+  { "package", test_multipath_package, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -0,0 +1,135 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file test_netparams.c
+ * \brief Tests for the compiled table of consensus parameters.
+ */
+
+#define NETWORKSTATUS_PRIVATE
+
+#include "core/or/or.h"
+#include "test/test.h"
+#include "test/log_test_helpers.h"
+
+#include "feature/nodelist/netparams.h"
+#include "feature/nodelist/networkstatus.h"
+
+#include "feature/nodelist/networkstatus_st.h"
+
+static networkstatus_t *mock_ns = NULL;
+
+static networkstatus_t *
+mock_networkstatus_get_latest_consensus(void)
+{
+  return mock_ns;
+}
+
+static networkstatus_t *
+new_mock_ns(const char *params)
+{
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->net_params = smartlist_new();
+  smartlist_split_string(ns->net_params, params, " ", 0, 0);
+  return ns;
+}
+
+static void
+free_mock_ns(networkstatus_t *ns)
+{
+  if (!ns)
+    return;
+  netparams_consensus_freed(ns);
+  SMARTLIST_FOREACH(ns->net_params, char *, cp, tor_free(cp));
+  smartlist_free(ns->net_params);
+  tor_free(ns);
+}
+
+static void
+test_netparams_values(void *arg)
+{
+  static netparam_t foo = NETPARAM_INIT("foo", 10, 0, 100);
+  static netparam_t bar = NETPARAM_INIT("bar", -5, -10, 10);
+  static netparam_t baz = NETPARAM_INIT("baz", 3, 1, 7);
+  static netparam_t absent = NETPARAM_INIT("absent", 42, 0, 50);
+  (void) arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  /* With no consensus, we use the defaults. */
+  tt_int_op(netparam_get(&foo), OP_EQ, 10);
+  tt_int_op(netparam_get(&bar), OP_EQ, -5);
+
+  /* The first well-formed value wins, just like networkstatus_get_param();
+   * values out of range are clamped. */
+  mock_ns = new_mock_ns("bar=x bar=-7 bar=9 baz=1000 foo=99 qux");
+  setup_capture_of_logs(LOG_WARN);
+  tt_int_op(netparam_get(&foo), OP_EQ, 99);
+  tt_int_op(netparam_get(&bar), OP_EQ, -7);
+  tt_int_op(netparam_get(&baz), OP_EQ, 7);
+  expect_single_log_msg_containing("Consensus parameter baz is too large");
+  teardown_capture_of_logs();
+  tt_int_op(netparam_get(&absent), OP_EQ, 42);
+
+  /* Each answer agrees with networkstatus_get_param(). */
+  tt_int_op(netparam_get(&foo), OP_EQ,
+            networkstatus_get_param(mock_ns, "foo", 10, 0, 100));
+  tt_int_op(netparam_get(&bar), OP_EQ,
+            networkstatus_get_param(mock_ns, "bar", -5, -10, 10));
+
+ done:
+  teardown_capture_of_logs();
+  UNMOCK(networkstatus_get_latest_consensus);
+  free_mock_ns(mock_ns);
+  mock_ns = NULL;
+  netparams_free_all();
+}
+
+static void
+test_netparams_invalidate(void *arg)
+{
+  static netparam_t foo = NETPARAM_INIT("foo", 10, 0, 100);
+  networkstatus_t *old_ns = NULL, *new_ns = NULL;
+  (void) arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  mock_ns = new_mock_ns("foo=20");
+  tt_int_op(netparam_get(&foo), OP_EQ, 20);
+
+  /* When we're told about a change, we notice it. */
+  SMARTLIST_FOREACH(mock_ns->net_params, char *, cp, tor_free(cp));
+  smartlist_clear(mock_ns->net_params);
+  smartlist_add_strdup(mock_ns->net_params, "foo=30");
+  netparams_consensus_changed(mock_ns);
+  tt_int_op(netparam_get(&foo), OP_EQ, 30);
+
+  /* When the latest consensus is replaced, we notice that too, even if
+   * nobody tells us. */
+  old_ns = mock_ns;
+  mock_ns = new_ns = new_mock_ns("foo=40");
+  tt_int_op(netparam_get(&foo), OP_EQ, 40);
+  mock_ns = old_ns;
+  tt_int_op(netparam_get(&foo), OP_EQ, 30);
+
+  /* Once a consensus is freed, we don't trust its pointer, in case a new
+   * consensus lands at the same address. */
+  free_mock_ns(mock_ns);
+  mock_ns = NULL;
+  tt_int_op(netparam_get(&foo), OP_EQ, 10);
+
+ done:
+  UNMOCK(networkstatus_get_latest_consensus);
+  free_mock_ns(mock_ns);
+  free_mock_ns(new_ns);
+  mock_ns = NULL;
+  netparams_free_all();
+}
+
+struct testcase_t netparams_tests[] = {
+  { "values", test_netparams_values, TT_FORK, NULL, NULL },
+  { "invalidate", test_netparams_invalidate, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -47,7 +47,7 @@ client1(int argc, char **argv)
   BASE16(2, node_id, DIGEST_LEN);
   BASE16(3, B.public_key, CURVE25519_PUBKEY_LEN);
 
-  if (onion_skin_ntor_create(node_id, &B, &state, msg)<0) {
+  if (onion_skin_ntor_create(node_id, &B, NULL, &state, msg)<0) {
     fprintf(stderr, "handshake failed");
     return 2;
   }
@@ -90,7 +90,8 @@ server1(int argc, char **argv)
   keys = tor_malloc(keybytes);
   hexkeys = tor_malloc(keybytes*2+1);
   if (onion_skin_ntor_server_handshake(
-                                msg_in, keymap, NULL, node_id, msg_out, keys,
+                                msg_in, keymap, NULL, NULL, node_id,
+                                msg_out, keys,
                                 (size_t)keybytes)<0) {
     fprintf(stderr, "handshake failed");
     result = 2;
@@ -126,6 +126,10 @@ test_oom_circbuf(void *arg)
   monotime_enable_test_mocking();
   MOCK(circuit_mark_for_close_, circuit_mark_for_close_dummy_);
 
+  /* Freed chunks would otherwise stay on the freelists and count against
+   * us. */
+  buf_set_freelist_max_bytes(0);
+
   /* Far too low for real life. */
   options->MaxMemInQueues = 256*packed_cell_mem_cost();
   options->CellStatistics = 0;
@@ -219,6 +223,10 @@ test_oom_streambuf(void *arg)
 
   MOCK(circuit_mark_for_close_, circuit_mark_for_close_dummy_);
 
+  /* Freed chunks would otherwise stay on the freelists and count against
+   * us. */
+  buf_set_freelist_max_bytes(0);
+
   /* Far too low for real life. */
   options->MaxMemInQueues = 81*packed_cell_mem_cost() + 4096 * 34;
   options->CellStatistics = 0;
@@ -0,0 +1,385 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file test_orshard.c
+ * \brief Tests for running OR connection I/O on worker threads.
+ */
+
+#define CONNECTION_PRIVATE
+#define ORSHARD_PRIVATE
+
+#include "core/or/or.h"
+#include "test/test.h"
+
+#include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
+#include "core/mainloop/orshard.h"
+#include "lib/buf/buffers.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/net/socket.h"
+#include "lib/time/compat_time.h"
+#include "lib/tls/tortls.h"
+
+#include "core/or/or_connection_st.h"
+
+#include <sys/socket.h>
+
+/** An orshard_io_t backend that reads and writes a plain socket. */
+typedef struct test_io_t {
+  tor_socket_t s;
+  /** If true, every write blocks. Set before handing us to a shard. */
+  int block_writes;
+  /** Bytes moved since the last get_n_raw_bytes call. Shard thread only. */
+  size_t n_read;
+  size_t n_written;
+} test_io_t;
+
+static int
+test_io_read(void *arg, char *out, size_t n)
+{
+  test_io_t *io = arg;
+  ssize_t r = tor_socket_recv(io->s, out, n, 0);
+  if (r > 0) {
+    io->n_read += r;
+    return (int)r;
+  }
+  if (r == 0)
+    return TOR_TLS_CLOSE;
+  if (ERRNO_IS_EAGAIN(tor_socket_errno(io->s)))
+    return TOR_TLS_WANTREAD;
+  return TOR_TLS_ERROR_IO;
+}
+
+static int
+test_io_write(void *arg, const char *data, size_t n)
+{
+  test_io_t *io = arg;
+  ssize_t r;
+  if (io->block_writes)
+    return TOR_TLS_WANTWRITE;
+  r = tor_socket_send(io->s, data, n, 0);
+  if (r > 0) {
+    io->n_written += r;
+    return (int)r;
+  }
+  if (r < 0 && ERRNO_IS_EAGAIN(tor_socket_errno(io->s)))
+    return TOR_TLS_WANTWRITE;
+  return TOR_TLS_ERROR_IO;
+}
+
+static void
+test_io_get_n_raw_bytes(void *arg, size_t *n_read, size_t *n_written)
+{
+  test_io_t *io = arg;
+  *n_read = io->n_read;
+  *n_written = io->n_written;
+  io->n_read = io->n_written = 0;
+}
+
+static const orshard_io_t test_io = {
+  test_io_read,
+  test_io_write,
+  test_io_get_n_raw_bytes,
+};
+
+static int n_readable_calls = 0;
+static int n_writable_calls = 0;
+
+static void
+mock_connection_handle_io_ready(connection_t *conn, int readable,
+                                int writable)
+{
+  (void) conn;
+  if (readable)
+    ++n_readable_calls;
+  if (writable)
+    ++n_writable_calls;
+}
+
+/** Set up a connected, nonblocking socketpair in <b>sp</b>. */
+static int
+make_socketpair(tor_socket_t sp[2])
+{
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, sp) < 0)
+    return -1;
+  if (set_socket_nonblocking(sp[0]) < 0 || set_socket_nonblocking(sp[1]) < 0)
+    return -1;
+  return 0;
+}
+
+static void
+test_orshard_stream(void *arg)
+{
+  const size_t total = 100000;
+  tor_socket_t sp[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  test_io_t io;
+  orshard_conn_t *sc = NULL;
+  buf_t *in = buf_new(), *out = buf_new(), *junk = buf_new();
+  char *data = tor_malloc(total), *got = tor_malloc_zero(total);
+  size_t n_read = 0, n_written = 0, raw_read = 0, raw_written = 0;
+  size_t off, n_got = 0;
+  int i, r;
+
+  (void) arg;
+  memset(&io, 0, sizeof(io));
+  crypto_rand(data, total);
+  tt_int_op(make_socketpair(sp), OP_EQ, 0);
+  io.s = sp[0];
+
+  orshard_set_n_threads(2);
+  tt_int_op(orshard_get_n_threads(), OP_EQ, 2);
+  sc = orshard_conn_new(orshard_get_shard(1), sp[0], &test_io, &io, NULL);
+  orshard_conn_set_reading(sc, 1);
+  tt_assert(orshard_conn_is_reading(sc));
+
+  /* Everything the peer sends comes out in order. */
+  tt_int_op(tor_socket_send(sp[1], data, 5000, 0), OP_EQ, 5000);
+  for (i = 0; i < 1000 && buf_datalen(in) < 5000; ++i) {
+    r = orshard_conn_read(sc, in, total, &n_read, &n_written);
+    tt_int_op(r, OP_GE, 0);
+    raw_read += n_read;
+    if (buf_datalen(in) < 5000)
+      tor_sleep_msec(5);
+  }
+  tt_int_op(buf_datalen(in), OP_EQ, 5000);
+  buf_get_bytes(in, got, 5000);
+  tt_mem_op(got, OP_EQ, data, 5000);
+
+  /* Everything we flush goes out in order, even when the rings fill up. */
+  for (off = 0; off < total; off += 1000)
+    buf_add(out, data + off, MIN(1000, total - off));
+  for (i = 0; i < 5000 && n_got < total; ++i) {
+    ssize_t k;
+    if (buf_datalen(out)) {
+      r = orshard_conn_flush(sc, out, buf_datalen(out),
+                             &n_read, &n_written);
+      tt_assert(r >= 0 || r == TOR_TLS_WANTWRITE);
+      raw_read += n_read;
+      raw_written += n_written;
+    }
+    k = tor_socket_recv(sp[1], got + n_got, total - n_got, 0);
+    if (k > 0)
+      n_got += k;
+    else
+      tor_sleep_msec(1);
+  }
+  tt_int_op(n_got, OP_EQ, total);
+  tt_int_op(buf_datalen(out), OP_EQ, 0);
+  tt_mem_op(got, OP_EQ, data, total);
+
+  /* When the peer closes, we hear about it once the data is gone. */
+  tor_close_socket(sp[1]);
+  sp[1] = TOR_INVALID_SOCKET;
+  for (i = 0; i < 1000; ++i) {
+    r = orshard_conn_read(sc, junk, total, &n_read, &n_written);
+    raw_read += n_read;
+    raw_written += n_written;
+    if (r != 0)
+      break;
+    tor_sleep_msec(5);
+  }
+  tt_int_op(r, OP_EQ, TOR_TLS_CLOSE);
+  tt_int_op(buf_datalen(junk), OP_EQ, 0);
+  tt_int_op(raw_read, OP_EQ, 5000);
+  tt_int_op(raw_written, OP_EQ, total);
+
+  /* And the connection stays closed. */
+  buf_add(out, "x", 1);
+  tt_int_op(orshard_conn_flush(sc, out, 1, &n_read, &n_written),
+            OP_EQ, TOR_TLS_CLOSE);
+
+ done:
+  if (sc) {
+    orshard_conn_release(sc, junk, junk);
+    orshard_conn_free(sc);
+  }
+  orshard_set_n_threads(0);
+  tor_close_socket(sp[0]);
+  tor_close_socket(sp[1]);
+  buf_free(in);
+  buf_free(out);
+  buf_free(junk);
+  tor_free(data);
+  tor_free(got);
+}
+
+static void
+test_orshard_release(void *arg)
+{
+  tor_socket_t sp[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  test_io_t io;
+  orshard_conn_t *sc = NULL;
+  buf_t *in = buf_new(), *out = buf_new(), *unsent = buf_new();
+  char data[3000], got[3000];
+  size_t n_read, n_written;
+  int i;
+
+  (void) arg;
+  memset(&io, 0, sizeof(io));
+  crypto_rand(data, sizeof(data));
+  tt_int_op(make_socketpair(sp), OP_EQ, 0);
+  io.s = sp[0];
+  io.block_writes = 1;
+
+  MOCK(connection_handle_io_ready, mock_connection_handle_io_ready);
+  n_readable_calls = n_writable_calls = 0;
+
+  orshard_set_n_threads(1);
+  sc = orshard_conn_new(orshard_get_shard(0), sp[0], &test_io, &io, NULL);
+
+  /* Asking to write runs the write handler right away. */
+  orshard_conn_set_writing(sc, 1);
+  tt_assert(orshard_conn_is_writing(sc));
+  orshard_process_main_queue();
+  tt_int_op(n_writable_calls, OP_EQ, 1);
+  tt_int_op(n_readable_calls, OP_EQ, 0);
+
+  /* The shard can't write this, so it stays with the shard. */
+  buf_add(out, data, 1000);
+  tt_int_op(orshard_conn_flush(sc, out, 1000, &n_read, &n_written),
+            OP_EQ, 1000);
+
+  /* Once the shard has read something, the read handler runs. */
+  orshard_conn_set_reading(sc, 1);
+  tt_int_op(tor_socket_send(sp[1], data + 1000, 2000, 0), OP_EQ, 2000);
+  for (i = 0; i < 1000 && n_readable_calls == 0; ++i) {
+    tor_sleep_msec(5);
+    orshard_process_main_queue();
+  }
+  tt_int_op(n_readable_calls, OP_GE, 1);
+
+  /* Taking the connection back gives us everything in flight. */
+  buf_add(unsent, "A", 1);
+  orshard_conn_release(sc, in, unsent);
+  orshard_conn_free(sc);
+  tt_int_op(buf_datalen(unsent), OP_EQ, 1001);
+  buf_get_bytes(unsent, got, 1001);
+  tt_mem_op(got, OP_EQ, "A", 1);
+  tt_mem_op(got + 1, OP_EQ, data, 1000);
+  tt_int_op(buf_datalen(in), OP_EQ, 2000);
+  buf_get_bytes(in, got, 2000);
+  tt_mem_op(got, OP_EQ, data + 1000, 2000);
+
+ done:
+  if (sc) {
+    orshard_conn_release(sc, in, unsent);
+    orshard_conn_free(sc);
+  }
+  orshard_set_n_threads(0);
+  UNMOCK(connection_handle_io_ready);
+  tor_close_socket(sp[0]);
+  tor_close_socket(sp[1]);
+  buf_free(in);
+  buf_free(out);
+  buf_free(unsent);
+}
+
+/** Process the main thread's queue until the shard has given back
+ * <b>conn</b>.  Return true iff it did. */
+static int
+wait_for_give_back(or_connection_t *conn)
+{
+  int i;
+  for (i = 0; i < 1000 && conn->shard_conn; ++i) {
+    orshard_process_main_queue();
+    if (conn->shard_conn)
+      tor_sleep_msec(5);
+  }
+  return conn->shard_conn == NULL;
+}
+
+static void
+test_orshard_detach_async(void *arg)
+{
+  tor_socket_t sp[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  test_io_t io;
+  or_connection_t *or_conn = NULL;
+  connection_t *conn = NULL;
+  orshard_conn_t *sc = NULL;
+  char data[3000], got[3000];
+  size_t n_read, n_written;
+  int i;
+
+  (void) arg;
+  memset(&io, 0, sizeof(io));
+  crypto_rand(data, sizeof(data));
+  tt_int_op(make_socketpair(sp), OP_EQ, 0);
+  io.s = sp[0];
+  io.block_writes = 1;
+
+  MOCK(connection_handle_io_ready, mock_connection_handle_io_ready);
+  n_readable_calls = n_writable_calls = 0;
+
+  orshard_set_n_threads(1);
+  or_conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  conn = TO_CONN(or_conn);
+  sc = orshard_conn_new(orshard_get_shard(0), sp[0], &test_io, &io, conn);
+  or_conn->shard_conn = sc;
+
+  /* Give the shard something to write, and something to read. */
+  buf_add(conn->outbuf, data, 1000);
+  tt_int_op(orshard_conn_flush(sc, conn->outbuf, 1000, &n_read, &n_written),
+            OP_EQ, 1000);
+  orshard_conn_set_reading(sc, 1);
+  tt_int_op(tor_socket_send(sp[1], data + 1000, 2000, 0), OP_EQ, 2000);
+  for (i = 0; i < 1000 && n_readable_calls == 0; ++i) {
+    tor_sleep_msec(5);
+    orshard_process_main_queue();
+  }
+  tt_int_op(n_readable_calls, OP_GE, 1);
+
+  /* Asking for the connection back doesn't wait for the shard: only the
+   * main thread's queue can finish the job. */
+  tt_int_op(orshard_start_detach_conn(conn, 0), OP_EQ, 1);
+  tt_ptr_op(or_conn->shard_conn, OP_EQ, sc);
+  tt_int_op(orshard_start_detach_conn(conn, 0), OP_EQ, 1);
+  tt_assert(wait_for_give_back(or_conn));
+  sc = NULL;
+  tt_int_op(orshard_start_detach_conn(conn, 0), OP_EQ, 0);
+
+  /* Once it has, the connection has everything that was in flight. */
+  tt_int_op(buf_datalen(conn->outbuf), OP_EQ, 1000);
+  buf_get_bytes(conn->outbuf, got, 1000);
+  tt_mem_op(got, OP_EQ, data, 1000);
+  tt_int_op(buf_datalen(conn->inbuf), OP_EQ, 2000);
+  buf_get_bytes(conn->inbuf, got, 2000);
+  tt_mem_op(got, OP_EQ, data + 1000, 2000);
+
+  /* If we close the connection first, its socket stays open until the
+   * shard has let go of it. */
+  conn->s = sp[0];
+  sc = orshard_conn_new(orshard_get_shard(0), sp[0], &test_io, &io, conn);
+  or_conn->shard_conn = sc;
+  tt_int_op(orshard_start_detach_conn(conn, 1), OP_EQ, 1);
+  tt_assert(! SOCKET_OK(conn->s));
+  tt_assert(wait_for_give_back(or_conn));
+  sc = NULL;
+  sp[0] = TOR_INVALID_SOCKET;
+  for (i = 0; i < 1000; ++i) {
+    if (tor_socket_recv(sp[1], got, sizeof(got), 0) == 0)
+      break;
+    tor_sleep_msec(5);
+  }
+  tt_int_op(i, OP_LT, 1000);
+
+ done:
+  if (sc) {
+    orshard_detach_conn(conn);
+  }
+  orshard_set_n_threads(0);
+  UNMOCK(connection_handle_io_ready);
+  if (conn) {
+    conn->s = TOR_INVALID_SOCKET;
+    connection_free_minimal(conn);
+  }
+  tor_close_socket(sp[0]);
+  tor_close_socket(sp[1]);
+}
+
+struct testcase_t orshard_tests[] = {
+  { "stream", test_orshard_stream, TT_FORK, NULL, NULL },
+  { "release", test_orshard_release, TT_FORK, NULL, NULL },
+  { "detach_async", test_orshard_detach_async, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -3,16 +3,19 @@
 
 #define CONFIG_PRIVATE
 #define POLICIES_PRIVATE
+#define POLICY_COMPILE_PRIVATE
 
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/policies.h"
+#include "core/or/policy_compile.h"
 #include "core/or/extendinfo.h"
 #include "feature/dirparse/policy_parse.h"
 #include "feature/hs/hs_common.h"
 #include "feature/hs/hs_descriptor.h"
 #include "feature/relay/router.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/confline.h"
 #include "test/test.h"
 #include "test/log_test_helpers.h"
@@ -2673,10 +2676,222 @@ test_policies_fascist_firewall_choose_address(void *arg)
 #undef CHECK_CHOSEN_ADDR_NODE
 #undef CHECK_CHOSEN_ADDR_RN
 
+/** Helper: return a new policy made of the items in <b>items</b>, which
+ * ends with NULL. */
+static smartlist_t *
+policy_from_items(const char **items)
+{
+  smartlist_t *policy = smartlist_new();
+  int malformed = 0;
+  for (; *items; ++items) {
+    addr_policy_t *p =
+      router_parse_addr_policy_item_from_string(*items, -1, &malformed);
+    tor_assert(p);
+    smartlist_add(policy, p);
+  }
+  return policy;
+}
+
+/** Helper: return the number of addr:port combinations where
+ * <b>policy</b> and its compiled form <b>c</b> disagree, trying addresses
+ * and ports on and around the boundaries of every entry, and some random
+ * ones. */
+static int
+compiled_policy_n_mismatches(const smartlist_t *policy,
+                             const addr_policy_compiled_t *c)
+{
+  smartlist_t *addrs = smartlist_new();
+  smartlist_t *ports = smartlist_new();
+  tor_addr_t *a;
+  int i, n_bad = 0;
+
+#define ADD_PORT(p) smartlist_add(ports, (void *)(uintptr_t)(p))
+  ADD_PORT(0);
+  ADD_PORT(1);
+  ADD_PORT(65535);
+  for (i = 0; i < 10; ++i)
+    ADD_PORT(crypto_rand_int(65536));
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, ent) {
+    int delta;
+    for (delta = -1; delta <= 1; ++delta) {
+      if (ent->prt_min + delta >= 0 && ent->prt_min + delta <= 65535)
+        ADD_PORT(ent->prt_min + delta);
+      if (ent->prt_max + delta >= 0 && ent->prt_max + delta <= 65535)
+        ADD_PORT(ent->prt_max + delta);
+    }
+
+    if (tor_addr_family(&ent->addr) == AF_INET) {
+      uint32_t base = tor_addr_to_ipv4h(&ent->addr);
+      uint32_t mask = ent->maskbits ? (~0u << (32 - ent->maskbits)) : 0;
+      uint32_t cands[] = { base & mask, (base & mask) - 1, base | ~mask,
+                           (base | ~mask) + 1, base ^ crypto_rand_u32() };
+      for (i = 0; i < (int)ARRAY_LENGTH(cands); ++i) {
+        a = tor_malloc_zero(sizeof(tor_addr_t));
+        tor_addr_from_ipv4h(a, cands[i]);
+        smartlist_add(addrs, a);
+      }
+    } else if (tor_addr_family(&ent->addr) == AF_INET6) {
+      uint8_t bytes[16];
+      memcpy(bytes, tor_addr_to_in6_addr8(&ent->addr), 16);
+      a = tor_malloc_zero(sizeof(tor_addr_t));
+      tor_addr_from_ipv6_bytes(a, bytes);
+      smartlist_add(addrs, a);
+      bytes[15] ^= 1;
+      a = tor_malloc_zero(sizeof(tor_addr_t));
+      tor_addr_from_ipv6_bytes(a, bytes);
+      smartlist_add(addrs, a);
+      if (ent->maskbits < 128) {
+        bytes[ent->maskbits / 8] ^= (0x80 >> (ent->maskbits % 8));
+        a = tor_malloc_zero(sizeof(tor_addr_t));
+        tor_addr_from_ipv6_bytes(a, bytes);
+        smartlist_add(addrs, a);
+      }
+    }
+  } SMARTLIST_FOREACH_END(ent);
+  for (i = 0; i < 10; ++i) {
+    uint8_t bytes[16];
+    a = tor_malloc_zero(sizeof(tor_addr_t));
+    tor_addr_from_ipv4h(a, crypto_rand_u32());
+    smartlist_add(addrs, a);
+    crypto_rand((char *)bytes, sizeof(bytes));
+    a = tor_malloc_zero(sizeof(tor_addr_t));
+    tor_addr_from_ipv6_bytes(a, bytes);
+    smartlist_add(addrs, a);
+  }
+  /* And some unknown addresses. */
+  smartlist_add(addrs, NULL);
+  a = tor_malloc_zero(sizeof(tor_addr_t));
+  smartlist_add(addrs, a);
+
+  SMARTLIST_FOREACH_BEGIN(addrs, const tor_addr_t *, addr) {
+    SMARTLIST_FOREACH_BEGIN(ports, void *, pp) {
+      const uint16_t port = (uint16_t)(uintptr_t)pp;
+      if (addr == NULL && port == 0)
+        continue; /* Logs a "bug" warning. */
+      if (compare_tor_addr_to_addr_policy(addr, port, policy) !=
+          compare_tor_addr_to_compiled_policy(addr, port, c)) {
+        TT_BLATHER(("Mismatch on %s:%d",
+                    addr ? fmt_addr(addr) : "NULL", (int)port));
+        ++n_bad;
+      }
+    } SMARTLIST_FOREACH_END(pp);
+  } SMARTLIST_FOREACH_END(addr);
+#undef ADD_PORT
+
+  SMARTLIST_FOREACH(addrs, tor_addr_t *, addr, tor_free(addr));
+  smartlist_free(addrs);
+  smartlist_free(ports);
+  return n_bad;
+}
+
+static void
+test_policies_compiled(void *arg)
+{
+  smartlist_t *policy = NULL, *policy2 = NULL, *dflt = NULL;
+  addr_policy_compiled_t *c = NULL, *c2 = NULL;
+  int i, j;
+  const char *mixed[] = {
+    "reject 18.0.0.0/8:*",
+    "accept 18.244.0.0/16:80-443",
+    "reject6 [2001:db8::]/32:*",
+    "accept 0.0.0.0/0:22",
+    "accept6 [::]/0:22",
+    "accept6 [2001:db8:1::]/48:1-1024",
+    "reject 1.2.3.4:25",
+    "accept 0.0.0.0/0:1000-2000",
+    "reject 128.0.0.0/1:3000-4000",
+    "accept6 [::]/0:5000",
+    "reject 0.0.0.0/0:*",
+    "reject6 [::]/0:*",
+    NULL
+  };
+  const char *web[] = {
+    "accept 0.0.0.0/0:80",
+    "accept6 [::]/0:80",
+    "accept 0.0.0.0/0:443",
+    "accept6 [::]/0:443",
+    "reject 0.0.0.0/0:*",
+    "reject6 [::]/0:*",
+    NULL
+  };
+  (void) arg;
+
+  /* A hand-written policy with both families and overlapping ranges. */
+  policy = policy_from_items(mixed);
+  c = addr_policy_compile(policy);
+  tt_assert(c);
+  tt_assert(!addr_policy_compiled_is_linear(c));
+  tt_int_op(compiled_policy_n_mismatches(policy, c), OP_EQ, 0);
+
+  /* Compiling the same entries again gives us the same compiled policy. */
+  policy2 = smartlist_new();
+  smartlist_add_all(policy2, policy);
+  c2 = addr_policy_compile(policy2);
+  tt_ptr_op(c2, OP_EQ, c);
+  addr_policy_compiled_free(c2);
+  smartlist_free(policy2);
+  addr_policy_compiled_free(c);
+  addr_policy_list_free(policy);
+
+  /* Port ranges with the same entries share an address table. */
+  policy = policy_from_items(web);
+  c = addr_policy_compile(policy);
+  /* Ports 0, 1-79, 80, 81-442, 443, 444-65535 need only four tables. */
+  tt_int_op(addr_policy_compiled_n_tables(c), OP_EQ, 4);
+  tt_int_op(compiled_policy_n_mismatches(policy, c), OP_EQ, 0);
+  addr_policy_compiled_free(c);
+  addr_policy_list_free(policy);
+
+  /* Our default exit policy. */
+  tt_int_op(0, OP_EQ, policies_parse_exit_policy(NULL, &dflt,
+                                           EXIT_POLICY_IPV6_ENABLED |
+                                           EXIT_POLICY_REJECT_PRIVATE |
+                                           EXIT_POLICY_ADD_DEFAULT, NULL));
+  c = addr_policy_compile(dflt);
+  tt_int_op(compiled_policy_n_mismatches(dflt, c), OP_EQ, 0);
+  addr_policy_compiled_free(c);
+
+  /* Some random policies. */
+  for (i = 0; i < 20; ++i) {
+    policy = smartlist_new();
+    for (j = 0; j < 30; ++j) {
+      char buf[128];
+      const int lo = crypto_rand_int(70000) % 65536;
+      const int hi = lo + crypto_rand_int(65536 - lo);
+      const char *action = crypto_rand_int(2) ? "accept" : "reject";
+      addr_policy_t *p;
+      int malformed = 0;
+      if (crypto_rand_int(4)) {
+        tor_snprintf(buf, sizeof(buf), "%s %d.%d.0.0/%d:%d-%d", action,
+                     crypto_rand_int(4), crypto_rand_int(256),
+                     crypto_rand_int(33), lo ? lo : 1, hi ? hi : 1);
+      } else {
+        tor_snprintf(buf, sizeof(buf), "%s6 [2001:db8:%x::]/%d:%d-%d",
+                     action, crypto_rand_int(4), crypto_rand_int(129),
+                     lo ? lo : 1, hi ? hi : 1);
+      }
+      p = router_parse_addr_policy_item_from_string(buf, -1, &malformed);
+      tt_assert(p);
+      smartlist_add(policy, p);
+    }
+    c = addr_policy_compile(policy);
+    tt_int_op(compiled_policy_n_mismatches(policy, c), OP_EQ, 0);
+    addr_policy_compiled_free(c);
+    addr_policy_list_free(policy);
+  }
+
+ done:
+  addr_policy_compiled_free(c);
+  addr_policy_list_free(policy);
+  addr_policy_list_free(dflt);
+  policy_compile_free_all();
+}
+
 struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
   { "general", test_policies_general, 0, NULL, NULL },
+  { "compiled", test_policies_compiled, 0, NULL, NULL },
   { "getinfo_helper_policies", test_policies_getinfo_helper_policies, 0, NULL,
     NULL },
   { "reject_exit_address", test_policies_reject_exit_address, 0, NULL, NULL },
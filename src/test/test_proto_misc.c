@@ -104,6 +104,56 @@ test_proto_var_cell(void *arg)
   tor_free(mem_op_hex_tmp);
 }
 
+static void
+test_proto_fixed_cells(void *arg)
+{
+  (void)arg;
+  char cell[CELL_MAX_NETWORK_SIZE];
+  const char *head = NULL;
+  buf_t *buf = NULL;
+
+  buf = buf_new();
+
+  /* Nothing, or less than one cell, gives us nothing. */
+  tt_uint_op(0, OP_EQ, peek_fixed_cells_from_buf(buf, 1, 4, 16, &head));
+  tt_ptr_op(head, OP_EQ, NULL);
+  buf_add(buf, "\x00\x00\x00\x01\x03", 5);
+  tt_uint_op(0, OP_EQ, peek_fixed_cells_from_buf(buf, 1, 4, 16, &head));
+  buf_clear(buf);
+
+  /* Two relay cells, then a variable-length cell. */
+  memset(cell, 'x', sizeof(cell));
+  set_uint32(cell, htonl(1));
+  cell[4] = CELL_RELAY;
+  buf_add(buf, cell, CELL_MAX_NETWORK_SIZE);
+  set_uint32(cell, htonl(2));
+  buf_add(buf, cell, CELL_MAX_NETWORK_SIZE);
+  cell[4] = (char) CELL_VPADDING;
+  buf_add(buf, cell, CELL_MAX_NETWORK_SIZE);
+
+  tt_uint_op(2, OP_EQ, peek_fixed_cells_from_buf(buf, 1, 4, 16, &head));
+  tt_ptr_op(head, OP_NE, NULL);
+  tt_uint_op(ntohl(get_uint32(head)), OP_EQ, 1);
+  tt_uint_op(ntohl(get_uint32(head + CELL_MAX_NETWORK_SIZE)), OP_EQ, 2);
+  tt_uint_op(1, OP_EQ, peek_fixed_cells_from_buf(buf, 1, 4, 1, &head));
+  /* The cells stay on the buffer. */
+  tt_uint_op(buf_datalen(buf), OP_EQ, 3 * CELL_MAX_NETWORK_SIZE);
+
+  /* In link protocol 2, only VERSIONS cells are variable-length, and circuit
+   * IDs are two bytes long; in link protocol 3, command 129 is
+   * variable-length too. */
+  buf_clear(buf);
+  buf_add(buf, "\x23\x45\x81", 3);
+  buf_add(buf, cell, CELL_MAX_NETWORK_SIZE - 5);
+  buf_add(buf, "\x23\x45\x07", 3);
+  buf_add(buf, cell, CELL_MAX_NETWORK_SIZE - 5);
+  tt_uint_op(1, OP_EQ, peek_fixed_cells_from_buf(buf, 0, 2, 16, &head));
+  tt_uint_op(0, OP_EQ, peek_fixed_cells_from_buf(buf, 0, 3, 16, &head));
+
+ done:
+  buf_free(buf);
+}
+
 static void
 test_proto_control0(void *arg)
 {
@@ -256,6 +306,7 @@ test_proto_line(void *arg)
 
 struct testcase_t proto_misc_tests[] = {
   { "var_cell", test_proto_var_cell, 0, NULL, NULL },
+  { "fixed_cells", test_proto_fixed_cells, 0, NULL, NULL },
   { "control0", test_proto_control0, 0, NULL, NULL },
   { "ext_or_cmd", test_proto_ext_or_cmd, TT_FORK, NULL, NULL },
   { "line", test_proto_line, 0, NULL, NULL },
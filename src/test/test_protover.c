@@ -582,6 +582,19 @@ test_protover_supported_protocols(void *arg)
   tt_assert(protocol_list_supports_protocol(supported_protocols,
                                             PRT_FLOWCTRL,
                                             PROTOVER_FLOWCTRL_V1));
+  /* FlowCtrl=2 is for a congestion control design that we don't
+   * implement: ours is DelayCC. */
+  tt_assert(!protocol_list_supports_protocol(supported_protocols,
+                                             PRT_FLOWCTRL, 2));
+  tt_assert(protocol_list_supports_protocol(supported_protocols,
+                                            PRT_DELAYCC,
+                                            PROTOVER_DELAYCC_V1));
+  /* Likewise, multipath is Multipath=1, not a FlowCtrl version. */
+  tt_assert(!protocol_list_supports_protocol(supported_protocols,
+                                             PRT_FLOWCTRL, 3));
+  tt_assert(protocol_list_supports_protocol(supported_protocols,
+                                            PRT_MULTIPATH,
+                                            PROTOVER_MULTIPATH_V1));
 
  done:
  ;
@@ -745,7 +758,9 @@ test_protover_vote_roundtrip_ours(void *args)
             "supports_establish_intro_dos_extension: %d,\n" \
             "supports_v3_hsdir: %d,\n" \
             "supports_v3_rendezvous_point: %d,\n" \
-            "supports_hs_setup_padding: %d.", \
+            "supports_hs_setup_padding: %d,\n" \
+            "supports_congestion_control: %d,\n" \
+            "supports_multipath: %d.", \
             (flags).protocols_known, \
             (flags).supports_extend2_cells, \
             (flags).supports_accepting_ipv6_extends, \
@@ -757,7 +772,9 @@ test_protover_vote_roundtrip_ours(void *args)
             (flags).supports_establish_intro_dos_extension, \
             (flags).supports_v3_hsdir, \
             (flags).supports_v3_rendezvous_point, \
-            (flags).supports_hs_setup_padding); \
+            (flags).supports_hs_setup_padding, \
+            (flags).supports_congestion_control, \
+            (flags).supports_multipath); \
     STMT_END
 
 /* Test that the proto_string version version_macro sets summary_flag. */
@@ -933,6 +950,12 @@ test_protover_summarize_flags(void *args)
   TEST_PROTOVER("Padding", PROTOVER_HS_SETUP_PADDING,
                 supports_hs_setup_padding);
 
+  TEST_PROTOVER("DelayCC", PROTOVER_DELAYCC_V1,
+                supports_congestion_control);
+
+  TEST_PROTOVER("Multipath", PROTOVER_MULTIPATH_V1,
+                supports_multipath);
+
  done:
   ;
 }
@@ -10,11 +10,14 @@
 #include "core/or/channeltls.h"
 #include "feature/stats/bwhist.h"
 #include "core/or/relay.h"
+#include "core/or/cell_queue_stats.h"
+#include "core/crypto/relay_crypto.h"
 #include "lib/container/order.h"
 /* For init/free stuff */
 #include "core/or/scheduler.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
 #include "core/or/or_circuit_st.h"
 
 #define RESOLVE_ADDR_PRIVATE
@@ -207,6 +210,155 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+static void
+test_relay_send_packed_cell(void *arg)
+{
+  static const char key[CPATH_KEY_MATERIAL_LEN] =
+    "Stream data goes straight from the inbuf into the packed cell.";
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  packed_cell_t *cell = NULL;
+  relay_crypto_t client;
+  relay_header_t rh;
+  uint8_t payload[CELL_PAYLOAD_SIZE];
+  uint8_t integrity[4];
+  uint8_t *body;
+  int wide;
+
+  (void)arg;
+
+  memset(&client, 0, sizeof(client));
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  orcirc = new_fake_orcirc(nchan, pchan);
+  tt_assert(orcirc);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+  relay_crypto_clear(&orcirc->crypto);
+  tt_int_op(0, OP_EQ,
+            relay_crypto_init(&orcirc->crypto, key, sizeof(key), 0, 0));
+  tt_int_op(0, OP_EQ, relay_crypto_init(&client, key, sizeof(key), 0, 0));
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+
+  /* Build a DATA cell in place and send it back towards the client, over a
+   * channel with wide circuit IDs and then over one with narrow ones. */
+  for (wide = 1; wide >= 0; --wide) {
+    const size_t payload_offset = (wide ? 4 : 2) + 1;
+    pchan->wide_circ_ids = wide;
+
+    cell = relay_packed_cell_new(&body);
+    memcpy(body, "hello", 5);
+    tt_int_op(relay_send_packed_cell_from_edge(7, TO_CIRCUIT(orcirc),
+                                               RELAY_COMMAND_DATA, cell, 5,
+                                               NULL), OP_EQ, 0);
+    tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 1);
+    cell = cell_queue_pop(&orcirc->p_chan_cells);
+    tt_uint_op(packed_cell_get_circid(cell, wide), OP_EQ, orcirc->p_circ_id);
+    tt_uint_op(packed_cell_get_command(cell, wide), OP_EQ, CELL_RELAY);
+
+    /* The client can decrypt it, and its digest checks out. */
+    memcpy(payload, cell->body + payload_offset, CELL_PAYLOAD_SIZE);
+    relay_crypt_one_payload(client.b_crypto, payload);
+    relay_header_unpack(&rh, payload);
+    tt_int_op(rh.command, OP_EQ, RELAY_COMMAND_DATA);
+    tt_int_op(rh.recognized, OP_EQ, 0);
+    tt_int_op(rh.stream_id, OP_EQ, 7);
+    tt_int_op(rh.length, OP_EQ, 5);
+    tt_mem_op(payload + RELAY_HEADER_SIZE, OP_EQ, "hello", 5);
+    memcpy(integrity, rh.integrity, sizeof(integrity));
+    memset(payload + 5, 0, sizeof(integrity));
+    relay_set_digest(client.b_digest, payload);
+    tt_mem_op(payload + 5, OP_EQ, integrity, sizeof(integrity));
+    packed_cell_free(cell);
+  }
+
+  /* Nothing gets queued on a closing circuit. */
+  TO_CIRCUIT(orcirc)->marked_for_close = 1;
+  cell = relay_packed_cell_new(&body);
+  tt_int_op(relay_send_packed_cell_from_edge(7, TO_CIRCUIT(orcirc),
+                                             RELAY_COMMAND_DATA, cell, 0,
+                                             NULL), OP_EQ, -1);
+  cell = NULL;
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 0);
+  TO_CIRCUIT(orcirc)->marked_for_close = 0;
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  packed_cell_free(cell);
+  relay_crypto_clear(&client);
+  if (orcirc)
+    cell_queue_clear(&orcirc->p_chan_cells);
+  free_fake_orcirc(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+}
+
+static void
+test_relay_cell_queue_sojourn(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  packed_cell_t cell;
+  const cell_sojourn_hist_t *hist;
+  uint32_t msec;
+  char *answer = NULL;
+
+  (void)arg;
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  orcirc = new_fake_orcirc(nchan, pchan);
+  memset(&cell, 0, sizeof(cell));
+
+  /* A cell that waited about 6 msec on its way to the next hop. */
+  cell.inserted_timestamp = 1000;
+  msec = cell_queue_note_sojourn(nchan, TO_CIRCUIT(orcirc), &cell,
+                        1000 + (uint32_t)
+                        monotime_msec_to_approx_coarse_stamp_units(6));
+  tt_uint_op(msec, OP_GT, 4);
+  tt_uint_op(msec, OP_LE, 8);
+  hist = cell_queue_get_sojourn_hist(CELL_SOJOURN_CIRC_OR,
+                                     CELL_SOJOURN_EXITWARD);
+  tt_u64_op(hist->n_cells, OP_EQ, 1);
+  tt_u64_op(hist->hist[3], OP_EQ, 1);
+  tt_u64_op(hist->total_msec, OP_EQ, msec);
+  tt_assert(nchan->cell_sojourn);
+  tt_u64_op(nchan->cell_sojourn->n_cells, OP_EQ, 1);
+  tt_ptr_op(pchan->cell_sojourn, OP_EQ, NULL);
+
+  /* A cell that we flushed straight away, back towards the client. */
+  cell_queue_note_sojourn(pchan, TO_CIRCUIT(orcirc), &cell, 1000);
+  hist = cell_queue_get_sojourn_hist(CELL_SOJOURN_CIRC_OR,
+                                     CELL_SOJOURN_APPWARD);
+  tt_u64_op(hist->n_cells, OP_EQ, 1);
+  tt_u64_op(hist->hist[0], OP_EQ, 1);
+  tt_u64_op(pchan->cell_sojourn->n_cells, OP_EQ, 1);
+
+  /* A cell that waited exactly 2 msec belongs under the 2 msec bound. */
+  uint32_t units = 0;
+  while (monotime_coarse_stamp_units_to_approx_msec(units) < 2)
+    ++units;
+  tt_u64_op(monotime_coarse_stamp_units_to_approx_msec(units), OP_EQ, 2);
+  cell_queue_note_sojourn(pchan, TO_CIRCUIT(orcirc), &cell, 1000 + units);
+  tt_u64_op(hist->n_cells, OP_EQ, 2);
+  tt_u64_op(hist->hist[1], OP_EQ, 1);
+
+  answer = cell_queue_sojourn_format();
+  tt_assert(strstr(answer, "or exitward cells=1 "));
+  tt_assert(!strcmpend(answer, " hist=8:1"));
+  tt_assert(strstr(answer,
+                   "or appward cells=2 total-msec=2 hist=1:1,2:1\n"));
+  tt_assert(strstr(answer, "origin appward cells=0 total-msec=0 hist=\n"));
+
+ done:
+  tor_free(answer);
+  free_fake_orcirc(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+}
+
 static void
 test_suggested_address(void *arg)
 {
@@ -364,6 +516,10 @@ struct testcase_t relay_tests[] = {
     TT_FORK, NULL, NULL },
   { "close_circ_rephist", test_relay_close_circuit,
     TT_FORK, NULL, NULL },
+  { "send_packed_cell", test_relay_send_packed_cell,
+    TT_FORK, NULL, NULL },
+  { "cell_queue_sojourn", test_relay_cell_queue_sojourn,
+    TT_FORK, NULL, NULL },
   { "suggested_address", test_suggested_address,
     TT_FORK, NULL, NULL },
   { "find_addr_to_publish", test_find_addr_to_publish,
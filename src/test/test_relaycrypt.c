@@ -181,12 +181,70 @@ test_relaycrypt_inbound(void *arg)
   ;
 }
 
+/* A cell whose "recognized" field comes out as zero, but whose digest
+ * doesn't match, must pass through unchanged, and must not disturb the
+ * digest of the hop that looked at it. */
+static void
+test_relaycrypt_false_recognized(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  tt_assert(cs);
+
+  relay_header_t rh;
+  cell_t orig;
+  cell_t encrypted;
+  int i;
+
+  for (i = 0; i < 10; ++i) {
+    crypt_path_t *layer_hint = NULL;
+    char recognized = 0;
+
+    crypto_rand((char *)&orig, sizeof(orig));
+    relay_header_unpack(&rh, orig.payload);
+    rh.recognized = 0;
+    memset(rh.integrity, 0, sizeof(rh.integrity));
+    relay_header_pack(orig.payload, &rh);
+
+    /* Encrypt the cell for the first hop without setting its digest: it
+     * has recognized == 0 there, but the wrong integrity field. */
+    memcpy(&encrypted, &orig, sizeof(orig));
+    encrypted.payload[5] ^= 0x40;
+    orig.payload[5] ^= 0x40;
+    cpath_crypt_cell(cs->origin_circ->cpath, encrypted.payload, false);
+    tt_int_op(0, OP_EQ, relay_decrypt_cell(TO_CIRCUIT(cs->or_circ[0]),
+                                           &encrypted, CELL_DIRECTION_OUT,
+                                           &layer_hint, &recognized));
+    tt_int_op(recognized, OP_EQ, 0);
+    tt_mem_op(orig.payload, OP_EQ, encrypted.payload, CELL_PAYLOAD_SIZE);
+
+    /* The next good cell is still recognized, since the first hop's digest
+     * is where it was. */
+    crypto_rand((char *)&orig, sizeof(orig));
+    relay_header_unpack(&rh, orig.payload);
+    rh.recognized = 0;
+    memset(rh.integrity, 0, sizeof(rh.integrity));
+    relay_header_pack(orig.payload, &rh);
+    memcpy(&encrypted, &orig, sizeof(orig));
+    relay_encrypt_cell_outbound(&encrypted, cs->origin_circ,
+                                cs->origin_circ->cpath);
+    tt_int_op(0, OP_EQ, relay_decrypt_cell(TO_CIRCUIT(cs->or_circ[0]),
+                                           &encrypted, CELL_DIRECTION_OUT,
+                                           &layer_hint, &recognized));
+    tt_int_op(recognized, OP_EQ, 1);
+    tt_mem_op(orig.payload, OP_EQ, encrypted.payload, CELL_PAYLOAD_SIZE);
+  }
+
+ done:
+  ;
+}
+
 #define TEST(name) \
   { # name, test_relaycrypt_ ## name, 0, &relaycrypt_setup, NULL }
 
 struct testcase_t relaycrypt_tests[] = {
   TEST(outbound),
   TEST(inbound),
+  TEST(false_recognized),
   END_OF_TESTCASES
 };
 
@@ -15,6 +15,7 @@
 #include "core/or/relay.h"
 #include "core/or/sendme.h"
 
+#include "feature/nodelist/netparams.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/networkstatus_st.h"
 
@@ -39,6 +40,7 @@ free_mock_consensus(void)
                     tor_free(r));
   smartlist_free(current_md_consensus->routerstatus_list);
   smartlist_free(current_ns_consensus->net_params);
+  netparams_consensus_freed(current_ns_consensus);
   tor_free(current_ns_consensus);
 }
 
@@ -95,6 +97,7 @@ test_v1_consensus_params(void *arg)
                 (void *) "sendme_emit_min_version=0");
   smartlist_add(current_md_consensus->net_params,
                 (void *) "sendme_accept_min_version=0");
+  netparams_consensus_changed(current_md_consensus);
   tt_int_op(get_emit_min_version(), OP_EQ, 0);
   tt_int_op(get_accept_min_version(), OP_EQ, 0);
   smartlist_clear(current_md_consensus->net_params);
@@ -104,6 +107,7 @@ test_v1_consensus_params(void *arg)
                 (void *) "sendme_emit_min_version=1");
   smartlist_add(current_md_consensus->net_params,
                 (void *) "sendme_accept_min_version=1");
+  netparams_consensus_changed(current_md_consensus);
   tt_int_op(get_emit_min_version(), OP_EQ, 1);
   tt_int_op(get_accept_min_version(), OP_EQ, 1);
   smartlist_clear(current_md_consensus->net_params);
@@ -113,6 +117,7 @@ test_v1_consensus_params(void *arg)
                 (void *) "sendme_emit_min_version=1");
   smartlist_add(current_md_consensus->net_params,
                 (void *) "sendme_accept_min_version=0");
+  netparams_consensus_changed(current_md_consensus);
   tt_int_op(get_emit_min_version(), OP_EQ, 1);
   tt_int_op(get_accept_min_version(), OP_EQ, 0);
   smartlist_clear(current_md_consensus->net_params);
@@ -121,6 +126,7 @@ test_v1_consensus_params(void *arg)
    * and the one in the consensus. */
   smartlist_add(current_md_consensus->net_params,
                 (void *) "sendme_accept_min_version=1");
+  netparams_consensus_changed(current_md_consensus);
   /* Minimum acceptable value is 1. */
   tt_int_op(cell_version_can_be_handled(1), OP_EQ, true);
   /* Minimum acceptable value is 1 so a cell version of 0 is refused. */
@@ -288,15 +294,16 @@ test_package_payload_len(void *arg)
   /* We have a bunch of cells before we need to send randomness, so the first
    * few can be packaged full. */
   int initial = c->send_randomness_after_n_cells;
-  size_t n = connection_edge_get_inbuf_bytes_to_package(10000, 0, c);
+  size_t n = connection_edge_get_inbuf_bytes_to_package(10000, 0, c, 0);
   tt_uint_op(RELAY_PAYLOAD_SIZE, OP_EQ, n);
-  n = connection_edge_get_inbuf_bytes_to_package(95000, 1, c);
+  n = connection_edge_get_inbuf_bytes_to_package(95000, 1, c, 0);
   tt_uint_op(RELAY_PAYLOAD_SIZE, OP_EQ, n);
   tt_int_op(c->send_randomness_after_n_cells, OP_EQ, initial - 2);
 
   /* If package_partial isn't set, we won't package a partially full cell at
    * all. */
-  n = connection_edge_get_inbuf_bytes_to_package(RELAY_PAYLOAD_SIZE-1, 0, c);
+  n = connection_edge_get_inbuf_bytes_to_package(RELAY_PAYLOAD_SIZE-1, 0,
+                                                 c, 0);
   tt_int_op(n, OP_EQ, 0);
   /* no change in our state, since nothing was sent. */
   tt_assert(! c->have_sent_sufficiently_random_cell);
@@ -305,13 +312,15 @@ test_package_payload_len(void *arg)
   /* If package_partial is set and the partial cell is not going to have
    * _enough_ randomness, we package it, but we don't consider ourselves to
    * have sent a sufficiently random cell. */
-  n = connection_edge_get_inbuf_bytes_to_package(RELAY_PAYLOAD_SIZE-1, 1, c);
+  n = connection_edge_get_inbuf_bytes_to_package(RELAY_PAYLOAD_SIZE-1, 1,
+                                                 c, 0);
   tt_int_op(n, OP_EQ, RELAY_PAYLOAD_SIZE-1);
   tt_assert(! c->have_sent_sufficiently_random_cell);
   tt_int_op(c->send_randomness_after_n_cells, OP_EQ, initial - 3);
 
   /* Make sure we set have_set_sufficiently_random_cell as appropriate. */
-  n = connection_edge_get_inbuf_bytes_to_package(RELAY_PAYLOAD_SIZE-64, 1, c);
+  n = connection_edge_get_inbuf_bytes_to_package(RELAY_PAYLOAD_SIZE-64, 1,
+                                                 c, 0);
   tt_int_op(n, OP_EQ, RELAY_PAYLOAD_SIZE-64);
   tt_assert(c->have_sent_sufficiently_random_cell);
   tt_int_op(c->send_randomness_after_n_cells, OP_EQ, initial - 4);
@@ -320,7 +329,7 @@ test_package_payload_len(void *arg)
    * sent a sufficiently random cell, we will not force this one to have a gap.
    */
   c->send_randomness_after_n_cells = 0;
-  n = connection_edge_get_inbuf_bytes_to_package(10000, 1, c);
+  n = connection_edge_get_inbuf_bytes_to_package(10000, 1, c, 0);
   tt_int_op(n, OP_EQ, RELAY_PAYLOAD_SIZE);
   /* Now these will be reset. */
   tt_assert(! c->have_sent_sufficiently_random_cell);
@@ -329,7 +338,7 @@ test_package_payload_len(void *arg)
 
   /* What would happen if we hadn't sent a sufficiently random cell? */
   c->send_randomness_after_n_cells = 0;
-  n = connection_edge_get_inbuf_bytes_to_package(10000, 1, c);
+  n = connection_edge_get_inbuf_bytes_to_package(10000, 1, c, 0);
   const size_t reduced_payload_size = RELAY_PAYLOAD_SIZE - 4 - 16;
   tt_int_op(n, OP_EQ, reduced_payload_size);
   /* Now these will be reset. */
@@ -341,7 +350,8 @@ test_package_payload_len(void *arg)
    * package_partial==0 should mean we accept that many bytes.
    */
   c->send_randomness_after_n_cells = 0;
-  n = connection_edge_get_inbuf_bytes_to_package(reduced_payload_size, 0, c);
+  n = connection_edge_get_inbuf_bytes_to_package(reduced_payload_size, 0,
+                                                 c, 0);
   tt_int_op(n, OP_EQ, reduced_payload_size);
 
  done:
@@ -40,6 +40,7 @@
 #include "lib/encoding/confline.h"
 #include "lib/net/socketpair.h"
 #include "lib/malloc/map_anon.h"
+#include "lib/malloc/slab.h"
 
 #ifdef HAVE_PWD_H
 #include <pwd.h>
@@ -6949,6 +6950,71 @@ test_util_map_anon_nofork(void *arg)
 #endif /* defined(_WIN32) */
 }
 
+static void
+test_util_slab_pool(void *arg)
+{
+  (void)arg;
+  slab_pool_t *pool = slab_pool_new("test", 100, 4);
+  slab_pool_stats_t st;
+  char *objs[9];
+  int i;
+
+  tt_str_op(slab_pool_get_name(pool), OP_EQ, "test");
+  tt_int_op(slab_pool_get_obj_size(pool), OP_EQ, 100);
+  slab_pool_get_stats(pool, &st);
+  tt_int_op(st.n_slabs, OP_EQ, 0);
+  tt_int_op(st.bytes_allocated, OP_EQ, 0);
+
+  /* Fill two slabs and part of a third. */
+  for (i = 0; i < 9; ++i) {
+    objs[i] = slab_pool_alloc(pool);
+    tt_ptr_op(objs[i], OP_NE, NULL);
+    tt_int_op(((uintptr_t)objs[i]) % SLAB_OBJ_ALIGN, OP_EQ, 0);
+    memset(objs[i], i, 100);
+  }
+  for (i = 0; i < 9; ++i) {
+    tt_int_op(objs[i][0], OP_EQ, i);
+    tt_int_op(objs[i][99], OP_EQ, i);
+  }
+  slab_pool_get_stats(pool, &st);
+  tt_int_op(st.n_used, OP_EQ, 9);
+  tt_int_op(st.n_free, OP_EQ, 3);
+  tt_int_op(st.n_slabs, OP_EQ, 3);
+  tt_int_op(st.bytes_allocated, OP_GE, 12 * 100);
+  tt_int_op(slab_pool_get_n_used(pool), OP_EQ, 9);
+
+  /* Released objects get reused. */
+  slab_pool_release(pool, objs[5]);
+  tt_int_op(slab_pool_get_n_used(pool), OP_EQ, 8);
+  tt_ptr_op(slab_pool_alloc(pool), OP_EQ, objs[5]);
+  slab_pool_release(pool, NULL);
+  tt_int_op(slab_pool_get_n_used(pool), OP_EQ, 9);
+
+  /* Emptying one slab keeps it around; emptying a second frees it. */
+  for (i = 0; i < 4; ++i)
+    slab_pool_release(pool, objs[i]);
+  slab_pool_get_stats(pool, &st);
+  tt_int_op(st.n_used, OP_EQ, 5);
+  tt_int_op(st.n_slabs, OP_EQ, 3);
+  for (i = 4; i < 8; ++i)
+    slab_pool_release(pool, objs[i]);
+  slab_pool_get_stats(pool, &st);
+  tt_int_op(st.n_used, OP_EQ, 1);
+  tt_int_op(st.n_slabs, OP_EQ, 2);
+
+  /* Trimming frees the empty slab but not the one in use. */
+  tt_int_op(slab_pool_trim(pool), OP_GT, 0);
+  slab_pool_get_stats(pool, &st);
+  tt_int_op(st.n_slabs, OP_EQ, 1);
+  tt_int_op(st.n_free, OP_EQ, 3);
+  tt_int_op(objs[8][0], OP_EQ, 8);
+  tt_int_op(slab_pool_trim(pool), OP_EQ, 0);
+
+ done:
+  /* This frees objs[8] too. */
+  slab_pool_free(pool);
+}
+
 #ifndef COCCI
 #define UTIL_LEGACY(name)                                               \
   { (#name), test_util_ ## name , 0, NULL, NULL }
@@ -7099,5 +7165,6 @@ struct testcase_t util_tests[] = {
   UTIL_TEST(log_mallinfo, 0),
   UTIL_TEST(map_anon, 0),
   UTIL_TEST(map_anon_nofork, 0),
+  UTIL_TEST(slab_pool, 0),
   END_OF_TESTCASES
 };
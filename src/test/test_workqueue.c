@@ -13,6 +13,7 @@
 #include "lib/evloop/compat_libevent.h"
 #include "lib/intmath/weakrng.h"
 #include "lib/crypt_ops/crypto_init.h"
+#include "lib/time/compat_time.h"
 
 #include <stdio.h>
 
@@ -25,6 +26,7 @@ static int opt_n_inflight = 1000;
 static int opt_n_lowwater = 250;
 static int opt_n_cancel = 0;
 static int opt_ratio_rsa = 5;
+static int opt_stress = 0;
 
 #ifdef TRACK_RESPONSES
 tor_mutex_t bitmap_mutex;
@@ -96,6 +98,19 @@ workqueue_do_rsa(void *state, void *work)
   return WQ_RPL_REPLY;
 }
 
+static workqueue_reply_t
+workqueue_do_nothing(void *state, void *work)
+{
+  rsa_work_t *rw = work;
+  state_t *st = state;
+
+  tor_assert(st->magic == 13371337);
+
+  ++st->n_handled;
+  mark_handled(rw->serial);
+  return WQ_RPL_REPLY;
+}
+
 static workqueue_reply_t
 workqueue_do_shutdown(void *state, void *work)
 {
@@ -193,6 +208,16 @@ handle_reply_shutdown(void *arg)
 static workqueue_entry_t *
 add_work(threadpool_t *tp)
 {
+  if (opt_stress) {
+    /* Work items that do nothing at all, so that all we measure is the cost
+     * of queueing the work and its reply. */
+    rsa_work_t *w = tor_malloc_zero(sizeof(*w));
+    w->serial = n_sent++;
+    return threadpool_queue_work_priority(tp,
+                           (workqueue_priority_t)(w->serial % 3),
+                           workqueue_do_nothing, handle_reply, w);
+  }
+
   int add_rsa =
     opt_ratio_rsa == 0 ||
     tor_weak_random_range(&weak_rng, opt_ratio_rsa) == 0;
@@ -263,6 +288,7 @@ add_n_work_items(threadpool_t *tp, int n)
 }
 
 static int shutting_down = 0;
+static monotime_t start_time, end_time;
 
 static void
 replysock_readable_cb(threadpool_t *tp)
@@ -304,6 +330,7 @@ replysock_readable_cb(threadpool_t *tp)
       n_received+n_successful_cancel == n_sent &&
       n_sent >= opt_n_items) {
     shutting_down = 1;
+    monotime_get(&end_time);
     threadpool_queue_update(tp, NULL,
                              workqueue_do_shutdown, NULL, NULL);
     // Anything we add after starting the shutdown must not be executed.
@@ -329,6 +356,8 @@ help(void)
      "  -L <lowwater> Add items whenever fewer than this many are pending\n"
      "  -C <cancel>   Try to cancel N items of every batch that we add\n"
      "  -R <ratio>    Make one out of this many items be a slow (RSA) one\n"
+     "  -S            Stress mode: run trivial work items, and report\n"
+     "                the queueing overhead per item\n"
      "  --no-{eventfd2,eventfd,pipe2,pipe,socketpair}\n"
      "                Disable one of the alert_socket backends.");
 }
@@ -355,6 +384,8 @@ main(int argc, char **argv)
       opt_n_lowwater = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "-R") && i+1<argc) {
       opt_ratio_rsa = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-S")) {
+      opt_stress = 1;
     } else if (!strcmp(argv[i], "-C") && i+1<argc) {
       opt_n_cancel = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "--no-eventfd2")) {
@@ -389,6 +420,7 @@ main(int argc, char **argv)
   }
 
   init_logging(1);
+  monotime_init();
   network_init();
   if (crypto_global_init(1, NULL, NULL) < 0) {
     printf("Couldn't initialize crypto subsystem; exiting.\n");
@@ -426,6 +458,7 @@ main(int argc, char **argv)
   handled_len = opt_n_items;
 #endif /* defined(TRACK_RESPONSES) */
 
+  monotime_get(&start_time);
   for (i = 0; i < opt_n_inflight; ++i) {
     if (! add_work(tp)) {
       puts("Couldn't add work.");
@@ -449,6 +482,12 @@ main(int argc, char **argv)
     puts("Accepted work after shutdown\n");
     puts("FAIL");
   } else {
+    if (opt_stress) {
+      int64_t nsec = monotime_diff_nsec(&start_time, &end_time);
+      printf("%d items on %d threads in %.3f msec: %.1f nsec per item\n",
+             n_sent, opt_n_threads, nsec / 1.0e6,
+             ((double)nsec) / n_sent);
+    }
     puts("OK");
     return 0;
   }
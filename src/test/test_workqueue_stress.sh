@@ -0,0 +1,3 @@
+#!/bin/sh
+
+"${builddir:-.}/src/test/test_workqueue" -S -N 100000 -I 10000 -L 2500
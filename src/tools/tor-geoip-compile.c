@@ -0,0 +1,67 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file tor-geoip-compile.c
+ * \brief Convert a text GeoIP file into the binary format that Tor can map
+ *   at startup, instead of parsing it.
+ **/
+
+#include "orconfig.h"
+
+#include "lib/crypt_ops/crypto_init.h"
+#include "lib/geoip/geoip.h"
+#include "lib/log/log.h"
+#include "lib/malloc/malloc.h"
+#include "lib/net/address.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void
+usage(void)
+{
+  fprintf(stderr, "Usage: tor-geoip-compile [-4|-6] <text geoip file> "
+          "<binary output file>\n");
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  sa_family_t family = AF_INET;
+  const char *in_fname, *out_fname;
+
+  init_logging(1);
+
+  if (argc == 4 && !strcmp(argv[1], "-6")) {
+    family = AF_INET6;
+  } else if (!(argc == 4 && !strcmp(argv[1], "-4")) && argc != 3) {
+    usage();
+  }
+  in_fname = argv[argc-2];
+  out_fname = argv[argc-1];
+
+  log_severity_list_t *severities =
+    tor_malloc_zero(sizeof(log_severity_list_t));
+  set_log_severity_config(LOG_NOTICE, LOG_ERR, severities);
+  add_stream_log(severities, "<stderr>", fileno(stderr));
+  tor_free(severities);
+
+  if (crypto_init_siphash_key() < 0) {
+    log_err(LD_GENERAL, "Couldn't initialize siphash key.");
+    return 1;
+  }
+  if (geoip_load_file(family, in_fname, LOG_ERR) < 0)
+    return 1;
+  if (geoip_write_binary_file(family, out_fname) < 0) {
+    log_err(LD_GENERAL, "Couldn't write binary GEOIP file to %s.",
+            out_fname);
+    return 1;
+  }
+  log_notice(LD_GENERAL, "Wrote binary GEOIP %s file %s.",
+             family == AF_INET ? "IPv4" : "IPv6", out_fname);
+  geoip_free_all();
+  return 0;
+}